@@ -0,0 +1,241 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Measures the coroutine primitives the I/O threads lean on for every
+ * connection and request: creating/resetting coroutines, context switches,
+ * deferred calls and coroutine-scoped allocations. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+static volatile unsigned long sink;
+static bool json_output;
+
+static void nop_defer(void *data)
+{
+    sink += (uintptr_t)data;
+}
+
+static int run_to_completion(struct coro *coro, void *data)
+{
+    (void)coro;
+    sink += (uintptr_t)data;
+    return 0;
+}
+
+static int ping_pong(struct coro *coro, void *data)
+{
+    (void)data;
+
+    while (true)
+        coro_yield(coro, 1);
+
+    return 0;
+}
+
+struct request_shape {
+    int defers;
+    int allocations;
+};
+
+/* Does roughly what process_request_coro() does around each request: takes
+ * a generation, defers a few calls, allocates a few small objects, and
+ * runs the deferred calls before yielding back to the I/O loop. */
+static int fake_requests(struct coro *coro, void *data)
+{
+    const struct request_shape *shape = data;
+
+    while (true) {
+        size_t generation = coro_deferred_get_generation(coro);
+
+        for (int i = 0; i < shape->defers; i++)
+            coro_defer(coro, nop_defer, (void *)(uintptr_t)i);
+
+        for (int i = 0; i < shape->allocations; i++) {
+            char *ptr = coro_malloc(coro, 48);
+            if (!ptr)
+                abort();
+            ptr[0] = (char)i;
+            sink += (unsigned char)ptr[0];
+        }
+
+        sink += strlen(coro_strdup(coro, "Content-Type"));
+
+        coro_deferred_run(coro, generation);
+        coro_yield(coro, 1);
+    }
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *name, double start, unsigned long iterations)
+{
+    double ns_per_iteration = (now() - start) / (double)iterations;
+
+    if (json_output) {
+        printf("{\"benchmark\": \"corobench/%s\", \"unit\": \"ns/op\", "
+               "\"value\": %.2f, \"iterations\": %lu}\n",
+               name, ns_per_iteration, iterations);
+    } else {
+        printf("%-28s %10lu iterations %10.1f ns/iteration\n", name,
+               iterations, ns_per_iteration);
+    }
+}
+
+static void bench_new_free(unsigned long iterations)
+{
+    struct coro_switcher switcher;
+    double start = now();
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        struct coro *coro = coro_new(&switcher, run_to_completion, NULL);
+        if (!coro)
+            abort();
+
+        coro_resume(coro);
+        coro_free(coro);
+    }
+
+    report("new/resume/free", start, iterations);
+}
+
+static void bench_reset(unsigned long iterations)
+{
+    struct coro_switcher switcher;
+    struct coro *coro = coro_new(&switcher, run_to_completion, NULL);
+    double start;
+
+    if (!coro)
+        abort();
+
+    start = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        coro_reset(coro, run_to_completion, NULL);
+        coro_resume(coro);
+    }
+    report("reset/resume", start, iterations);
+
+    coro_free(coro);
+}
+
+static void bench_switch(unsigned long iterations)
+{
+    struct coro_switcher switcher;
+    struct coro *coro = coro_new(&switcher, ping_pong, NULL);
+    double start;
+
+    if (!coro)
+        abort();
+
+    start = now();
+    for (unsigned long i = 0; i < iterations; i++)
+        coro_resume(coro);
+    report("resume/yield", start, iterations);
+
+    coro_free(coro);
+}
+
+static void bench_requests(const char *name,
+                           unsigned long iterations,
+                           struct request_shape shape)
+{
+    struct coro_switcher switcher;
+    struct coro *coro = coro_new(&switcher, fake_requests, &shape);
+    double start;
+
+    if (!coro)
+        abort();
+
+    start = now();
+    for (unsigned long i = 0; i < iterations; i++)
+        coro_resume(coro);
+    report(name, start, iterations);
+
+    coro_free(coro);
+}
+
+/* A new connection handled by a recycled coroutine: coro_reset() runs and
+ * drops whatever the previous connection deferred, so the first defers of
+ * each connection are the ones that would need to allocate. */
+static void bench_connections(unsigned long iterations)
+{
+    static const struct request_shape shape = {.defers = 4, .allocations = 8};
+    struct coro_switcher switcher;
+    struct coro *coro = coro_new(&switcher, fake_requests, (void *)&shape);
+    double start;
+
+    if (!coro)
+        abort();
+
+    start = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        coro_reset(coro, fake_requests, (void *)&shape);
+        coro_resume(coro);
+    }
+    report("connection (1 request)", start, iterations);
+
+    coro_free(coro);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j")) != -1) {
+        if (opt != 'j')
+            goto usage;
+        json_output = true;
+    }
+
+    if (optind < argc) {
+        iterations = strtoul(argv[optind], NULL, 10);
+        if (!iterations)
+            goto usage;
+    }
+
+    bench_new_free(iterations / 10);
+    bench_reset(iterations);
+    bench_switch(iterations);
+    bench_requests("request (4 defers, 8 allocs)", iterations,
+                   (struct request_shape){.defers = 4, .allocations = 8});
+    bench_requests("request (32 defers, 32 allocs)", iterations,
+                   (struct request_shape){.defers = 32, .allocations = 32});
+    bench_connections(iterations);
+
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-j] [iterations]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,212 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/* Measures the hash table with the sort of keys it's usually filled with:
+ * paths of files served by serve_files and keys of cache entries. */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+static volatile unsigned long sink;
+static bool json_output;
+
+static const char *const dirs[] = {
+    "", "css/", "js/", "images/", "images/2018/", "fonts/",
+    "blog/posts/", "static/vendor/jquery/", "api/v1/users/",
+};
+static const char *const names[] = {
+    "index", "style", "app.bundle", "photo", "logo", "main", "profile",
+    "favicon", "jquery.min", "README",
+};
+static const char *const exts[] = {
+    ".html", ".css", ".js", ".jpg", ".png", ".woff2", ".json", "",
+};
+
+static char **make_keys(size_t n, unsigned int salt)
+{
+    char **keys = calloc(n, sizeof(*keys));
+
+    if (!keys)
+        abort();
+
+    for (size_t i = 0; i < n; i++) {
+        size_t r = i * 2654435761u + salt;
+
+        if (asprintf(&keys[i], "%s%s-%zu%s",
+                     dirs[r % (sizeof(dirs) / sizeof(dirs[0]))],
+                     names[(r / 7) % (sizeof(names) / sizeof(names[0]))], i,
+                     exts[(r / 13) % (sizeof(exts) / sizeof(exts[0]))]) < 0)
+            abort();
+    }
+
+    return keys;
+}
+
+static void free_keys(char **keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        free(keys[i]);
+    free(keys);
+}
+
+static void shuffle(char **keys, size_t n)
+{
+    unsigned int seed = 42;
+
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = (size_t)rand_r(&seed) % (i + 1);
+        char *tmp = keys[i];
+
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *name, size_t n, double start, size_t ops)
+{
+    double ns_per_op = (now() - start) / (double)ops;
+
+    if (json_output) {
+        printf("{\"benchmark\": \"hashbench/%s/%zu-keys\", "
+               "\"unit\": \"ns/op\", \"value\": %.2f, \"iterations\": %zu}\n",
+               name, n, ns_per_op, ops);
+    } else {
+        printf("%-16s %8zu keys %10.1f ns/op\n", name, n, ns_per_op);
+    }
+}
+
+static void bench_str(size_t n, size_t iterations)
+{
+    char **keys = make_keys(n, 0);
+    char **misses = make_keys(n, 1);
+    struct hash *hash;
+    double start;
+
+    start = now();
+    for (size_t round = 0; round < iterations / n; round++) {
+        hash = hash_str_new(NULL, NULL);
+        if (!hash)
+            abort();
+        for (size_t i = 0; i < n; i++)
+            hash_add_unique(hash, keys[i], keys[i]);
+        hash_free(hash);
+    }
+    report("str insert", n, start, (iterations / n) * n);
+
+    hash = hash_str_new(NULL, NULL);
+    if (!hash)
+        abort();
+    for (size_t i = 0; i < n; i++)
+        hash_add_unique(hash, keys[i], keys[i]);
+
+    /* Look keys up with copies, so that comparisons can't short-circuit
+     * on pointer equality, and in an order unrelated to insertion. */
+    char **lookups = make_keys(n, 0);
+    shuffle(lookups, n);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++)
+        sink += (uintptr_t)hash_find(hash, lookups[i % n]);
+    report("str hit", n, start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++)
+        sink += (uintptr_t)hash_find(hash, misses[i % n]);
+    report("str miss", n, start, iterations);
+
+    /* Cache-like churn: entries expire and are replaced by new ones. */
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        const char *key = keys[i % n];
+
+        hash_del(hash, key);
+        hash_add_unique(hash, key, key);
+    }
+    report("str del+add", n, start, iterations);
+
+    hash_free(hash);
+    free_keys(lookups, n);
+    free_keys(misses, n);
+    free_keys(keys, n);
+}
+
+static void bench_int(size_t n, size_t iterations)
+{
+    struct hash *hash = hash_int_new(NULL, NULL);
+    double start;
+
+    if (!hash)
+        abort();
+
+    for (size_t i = 1; i <= n; i++)
+        hash_add_unique(hash, (void *)(uintptr_t)i, (void *)(uintptr_t)i);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++)
+        sink += (uintptr_t)hash_find(hash, (void *)(uintptr_t)(i % n + 1));
+    report("int hit", n, start, iterations);
+
+    hash_free(hash);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {16, 256, 4096, 65536};
+    size_t iterations = 4000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j")) != -1) {
+        if (opt != 'j')
+            goto usage;
+        json_output = true;
+    }
+
+    if (optind < argc) {
+        iterations = strtoul(argv[optind], NULL, 10);
+        if (!iterations)
+            goto usage;
+    }
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_str(sizes[i], iterations);
+        bench_int(sizes[i], iterations);
+    }
+
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-j] [iterations]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,506 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/* A small HTTP/1.1 load generator, so that the macro benchmarks don't
+ * depend on whichever weighttp or wrk happens to be installed: it keeps a
+ * number of connections busy with (optionally pipelined) GET requests,
+ * optionally reconnecting after every response, and reports throughput
+ * and latency.  With -j, the result is printed as a JSON object. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BUFFER_SIZE 65536
+#define IDLE_TIMEOUT_MS 10000
+
+struct options {
+    const char *name;
+    char *host;
+    char *port;
+    char *path;
+    unsigned int connections;
+    unsigned int threads;
+    unsigned int pipeline;
+    size_t requests;
+    bool reconnect;
+    bool json;
+};
+
+struct conn {
+    int fd;
+    unsigned int in_flight;
+    bool in_body;
+    bool status_ok;
+    size_t body_remaining;
+    size_t used;
+    double sent_at;
+    char buffer[READ_BUFFER_SIZE];
+};
+
+struct worker {
+    pthread_t thread;
+    const struct options *options;
+    const struct addrinfo *addr;
+    const char *request;
+    size_t request_len;
+
+    unsigned int n_conns;
+    size_t to_issue;
+    size_t issued;
+    size_t done;
+
+    size_t ok;
+    size_t errors;
+    size_t bytes;
+    double *latencies;
+    size_t n_latencies;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void conn_open(struct worker *w, struct conn *conn, int epoll_fd)
+{
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = conn};
+
+    conn->in_flight = 0;
+    conn->in_body = false;
+    conn->used = 0;
+
+    conn->fd = socket(w->addr->ai_family,
+                      w->addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      w->addr->ai_protocol);
+    if (conn->fd < 0)
+        goto fail;
+
+    if (connect(conn->fd, w->addr->ai_addr, w->addr->ai_addrlen) < 0 &&
+        errno != EINPROGRESS)
+        goto fail;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0)
+        goto fail;
+
+    return;
+
+fail:
+    perror("Could not connect");
+    exit(1);
+}
+
+static void conn_close(struct conn *conn)
+{
+    /* Closing the descriptor also removes it from the epoll set. */
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+static bool conn_send(struct worker *w, struct conn *conn, int epoll_fd)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    size_t depth = w->options->pipeline;
+    char batch[w->request_len * depth];
+
+    if (depth > w->to_issue - w->issued)
+        depth = w->to_issue - w->issued;
+
+    for (size_t i = 0; i < depth; i++)
+        memcpy(batch + i * w->request_len, w->request, w->request_len);
+
+    /* A whole batch of requests is small enough to always fit in an
+     * empty socket buffer. */
+    if (write(conn->fd, batch, depth * w->request_len) !=
+        (ssize_t)(depth * w->request_len))
+        return false;
+
+    w->issued += depth;
+    conn->in_flight = (unsigned int)depth;
+    conn->sent_at = now();
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == 0;
+}
+
+/* Latency of pipelined requests is measured from when the whole batch was
+ * written. */
+static void record_response(struct worker *w, struct conn *conn)
+{
+    if (conn->status_ok)
+        w->ok++;
+    else
+        w->errors++;
+    w->latencies[w->n_latencies++] = now() - conn->sent_at;
+    w->done++;
+    conn->in_flight--;
+}
+
+/* Chunked responses aren't supported, as no scenario needs them. */
+static bool parse_responses(struct worker *w, struct conn *conn)
+{
+    char *p = conn->buffer;
+    char *end = conn->buffer + conn->used;
+
+    while (p < end && conn->in_flight) {
+        size_t body;
+
+        if (!conn->in_body) {
+            char *headers_end = memmem(p, (size_t)(end - p), "\r\n\r\n", 4);
+            char *content_length;
+
+            if (!headers_end) {
+                if (p == conn->buffer && end == conn->buffer + READ_BUFFER_SIZE)
+                    return false;
+                break;
+            }
+            if (headers_end - p < 12 || strncmp(p, "HTTP/1.", 7))
+                return false;
+
+            *headers_end = '\0';
+            content_length = strcasestr(p, "\r\nContent-Length:");
+            if (!content_length)
+                return false;
+
+            conn->status_ok = p[9] == '2';
+            conn->body_remaining = strtoul(
+                content_length + sizeof("\r\nContent-Length:") - 1, NULL, 10);
+            conn->in_body = true;
+
+            w->bytes += (size_t)(headers_end + 4 - p);
+            p = headers_end + 4;
+        }
+
+        body = (size_t)(end - p);
+        if (body > conn->body_remaining)
+            body = conn->body_remaining;
+        conn->body_remaining -= body;
+        w->bytes += body;
+        p += body;
+
+        if (conn->body_remaining)
+            break;
+
+        conn->in_body = false;
+        record_response(w, conn);
+    }
+
+    conn->used = (size_t)(end - p);
+    memmove(conn->buffer, p, conn->used);
+
+    return true;
+}
+
+/* Every request still waiting for a response when a connection fails
+ * counts as an error; so does failing to connect or to send a batch. */
+static void conn_fail(struct worker *w, struct conn *conn)
+{
+    if (!conn->in_flight && w->issued < w->to_issue) {
+        w->issued++;
+        conn->in_flight = 1;
+    }
+
+    w->errors += conn->in_flight;
+    w->done += conn->in_flight;
+    conn_close(conn);
+}
+
+static void conn_readable(struct worker *w, struct conn *conn)
+{
+    while (true) {
+        ssize_t r = read(conn->fd, conn->buffer + conn->used,
+                         READ_BUFFER_SIZE - conn->used);
+
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            break;
+        }
+        if (!r)
+            break;
+
+        conn->used += (size_t)r;
+        if (!parse_responses(w, conn))
+            break;
+        if (!conn->in_flight)
+            return;
+    }
+
+    conn_fail(w, conn);
+}
+
+static void *worker_run(void *data)
+{
+    struct worker *w = data;
+    struct epoll_event events[256];
+    struct conn *conns;
+    int epoll_fd;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    conns = calloc(w->n_conns, sizeof(*conns));
+    w->latencies = calloc(w->to_issue, sizeof(*w->latencies));
+    if (epoll_fd < 0 || !conns || !w->latencies) {
+        perror("Could not initialize worker");
+        exit(1);
+    }
+
+    for (unsigned int i = 0; i < w->n_conns; i++)
+        conn_open(w, &conns[i], epoll_fd);
+
+    while (w->done < w->to_issue) {
+        int n_events = epoll_wait(epoll_fd, events, 256, IDLE_TIMEOUT_MS);
+
+        if (n_events < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        if (!n_events) {
+            fprintf(stderr, "Timed out waiting for responses\n");
+            w->errors += w->to_issue - w->done;
+            break;
+        }
+
+        for (int i = 0; i < n_events; i++) {
+            struct conn *conn = events[i].data.ptr;
+
+            if (conn->in_flight) {
+                conn_readable(w, conn);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP) ||
+                       !conn_send(w, conn, epoll_fd)) {
+                conn_fail(w, conn);
+            }
+
+            if (conn->fd >= 0 && conn->in_flight)
+                continue;
+
+            if (conn->fd >= 0 && w->options->reconnect)
+                conn_close(conn);
+
+            if (w->issued < w->to_issue) {
+                if (conn->fd < 0)
+                    conn_open(w, conn, epoll_fd);
+                else if (!conn_send(w, conn, epoll_fd))
+                    conn_fail(w, conn);
+            } else if (conn->fd >= 0) {
+                conn_close(conn);
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < w->n_conns; i++) {
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+    }
+    free(conns);
+    close(epoll_fd);
+
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+static bool parse_url(struct options *options, char *url)
+{
+    static const char prefix[] = "http://";
+    char *slash, *colon;
+
+    if (strncmp(url, prefix, sizeof(prefix) - 1))
+        return false;
+    url += sizeof(prefix) - 1;
+
+    slash = strchr(url, '/');
+    options->path = slash ? strdup(slash) : "/";
+    if (slash)
+        *slash = '\0';
+
+    colon = strrchr(url, ':');
+    if (colon) {
+        *colon = '\0';
+        options->port = colon + 1;
+    } else {
+        options->port = "80";
+    }
+    options->host = url;
+
+    return *options->host && *options->port;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-j] [-N name] [-c connections] [-n requests]\n"
+            "       [-p pipeline depth] [-t threads] [-r] http://host:port/path\n"
+            "  -r  Reconnect after every response (\"Connection: close\")\n",
+            argv0);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options = {
+        .name = "default",
+        .connections = 64,
+        .threads = 2,
+        .pipeline = 1,
+        .requests = 100000,
+    };
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *addr;
+    struct worker *workers;
+    char *request;
+    size_t ok = 0, errors = 0, bytes = 0, n_latencies = 0;
+    double *latencies, start, elapsed;
+    int opt, request_len;
+
+    while ((opt = getopt(argc, argv, "jrN:c:n:p:t:")) != -1) {
+        switch (opt) {
+        case 'j':
+            options.json = true;
+            break;
+        case 'r':
+            options.reconnect = true;
+            break;
+        case 'N':
+            options.name = optarg;
+            break;
+        case 'c':
+            options.connections = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            options.requests = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            options.pipeline = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            options.threads = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !parse_url(&options, argv[optind]))
+        usage(argv[0]);
+    if (!options.threads || !options.pipeline || !options.requests ||
+        options.connections < options.threads || options.pipeline > 64)
+        usage(argv[0]);
+    if (options.reconnect)
+        options.pipeline = 1;
+
+    if (getaddrinfo(options.host, options.port, &hints, &addr)) {
+        fprintf(stderr, "Could not resolve %s:%s\n", options.host, options.port);
+        return 1;
+    }
+
+    request_len = asprintf(&request, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                           options.path, options.host,
+                           options.reconnect ? "Connection: close\r\n" : "");
+    workers = calloc(options.threads, sizeof(*workers));
+    if (request_len < 0 || !workers) {
+        perror("Could not allocate memory");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < options.threads; i++) {
+        workers[i] = (struct worker){
+            .options = &options,
+            .addr = addr,
+            .request = request,
+            .request_len = (size_t)request_len,
+            .n_conns = options.connections / options.threads +
+                       (i < options.connections % options.threads),
+            .to_issue = options.requests / options.threads +
+                        (i < options.requests % options.threads),
+        };
+    }
+
+    start = now();
+    for (unsigned int i = 0; i < options.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+            perror("Could not create thread");
+            return 1;
+        }
+    }
+    for (unsigned int i = 0; i < options.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = (now() - start) / 1e9;
+
+    latencies = calloc(options.requests, sizeof(*latencies));
+    if (!latencies) {
+        perror("Could not allocate memory");
+        return 1;
+    }
+    for (unsigned int i = 0; i < options.threads; i++) {
+        ok += workers[i].ok;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        memcpy(latencies + n_latencies, workers[i].latencies,
+               workers[i].n_latencies * sizeof(*latencies));
+        n_latencies += workers[i].n_latencies;
+        free(workers[i].latencies);
+    }
+    qsort(latencies, n_latencies, sizeof(*latencies), compare_double);
+
+    double rps = (double)(ok + errors) / elapsed;
+    double mbps = (double)bytes / elapsed / (1024.0 * 1024.0);
+    double p50 = n_latencies ? latencies[n_latencies / 2] / 1e3 : 0;
+    double p99 = n_latencies ? latencies[n_latencies * 99 / 100] / 1e3 : 0;
+
+    if (options.json) {
+        printf("{\"benchmark\": \"loadbench/%s\", \"unit\": \"req/s\", "
+               "\"value\": %.2f, \"requests\": %zu, \"errors\": %zu, "
+               "\"mbytes_per_sec\": %.2f, \"latency_p50_us\": %.1f, "
+               "\"latency_p99_us\": %.1f}\n",
+               options.name, rps, ok + errors, errors, mbps, p50, p99);
+    } else {
+        printf("%s: %zu requests (%zu errors) in %.2fs\n", options.name,
+               ok + errors, errors, elapsed);
+        printf("  %.1f req/s, %.2f MiB/s\n", rps, mbps);
+        printf("  latency: p50 %.1fus, p99 %.1fus\n", p50, p99);
+    }
+
+    free(latencies);
+    free(workers);
+    free(request);
+    freeaddrinfo(addr);
+
+    return errors ? 2 : 0;
+}
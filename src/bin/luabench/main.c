@@ -0,0 +1,130 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/* Compares the two ways Lua handlers can call into request methods when
+ * built with LuaJIT: through the Lua C API, and through the FFI. */
+
+#define _GNU_SOURCE
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan-private.h"
+
+#include "lwan-lua.h"
+
+static const char script[] =
+    "function query_param(req, n)\n"
+    "    local total = 0\n"
+    "    for i = 1, n do\n"
+    "        total = total + #req:query_param('name')\n"
+    "    end\n"
+    "    return total\n"
+    "end\n"
+    "function set_response(req, n)\n"
+    "    for i = 1, n do\n"
+    "        req:set_response('Hello, world!')\n"
+    "    end\n"
+    "    return n\n"
+    "end\n";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void bench(const char *bindings,
+                  lua_State *L,
+                  const char *function,
+                  struct lwan_request *request,
+                  unsigned long iterations)
+{
+    double start;
+
+    lua_getglobal(L, function);
+    lwan_lua_state_push_request(L, request);
+    lua_pushinteger(L, (lua_Integer)iterations);
+
+    start = now();
+    if (lua_pcall(L, 2, 1, 0) != 0) {
+        fprintf(stderr, "%s: %s\n", function, lua_tostring(L, -1));
+        exit(1);
+    }
+    printf("%-6s %-14s %8.1f ns/call\n", bindings, function,
+           (now() - start) / (double)iterations);
+
+    lua_pop(L, 1);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 10000000;
+    struct lwan_strbuf response;
+    struct lwan_request request = {
+        .flags = REQUEST_PARSED_QUERY_STRING,
+        .response = {.buffer = &response},
+    };
+    struct lwan_key_value *kv;
+    lua_State *c_api, *ffi;
+
+    if (argc > 1) {
+        iterations = strtoul(argv[1], NULL, 10);
+        if (!iterations) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    lwan_strbuf_init(&response);
+
+    /* Parameters are looked up with bsearch(), and the array is
+     * terminated by an empty element. */
+    lwan_key_value_array_init(&request.query_params);
+    kv = lwan_key_value_array_append(&request.query_params);
+    kv->key = "id";
+    kv->value = "42";
+    kv = lwan_key_value_array_append(&request.query_params);
+    kv->key = "name";
+    kv->value = "Lwan";
+    kv = lwan_key_value_array_append(&request.query_params);
+    kv->key = kv->value = NULL;
+
+    c_api = lwan_lua_create_state_without_ffi(NULL, script);
+    ffi = lwan_lua_create_state(NULL, script);
+    if (!c_api || !ffi)
+        return 1;
+
+    bench("C API", c_api, "query_param", &request, iterations);
+    bench("FFI", ffi, "query_param", &request, iterations);
+    bench("C API", c_api, "set_response", &request, iterations);
+    bench("FFI", ffi, "set_response", &request, iterations);
+
+    lua_close(c_api);
+    lua_close(ffi);
+    lwan_key_value_array_reset(&request.query_params);
+    lwan_strbuf_free(&response);
+
+    return 0;
+}
@@ -0,0 +1,355 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/* Measures hot paths of the request cycle in isolation: parsing dates and
+ * headers, applying templates, looking URLs up in the trie, and the cache
+ * under contention.  With -j, results are printed as one JSON object per
+ * line, to be compared between builds by src/scripts/benchsuite.py. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "double-to-str.h"
+#include "int-to-str.h"
+#include "lwan-cache.h"
+#include "lwan-template.h"
+#include "lwan-trie.h"
+
+static volatile unsigned long sink;
+static bool json_output;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *name, double start, size_t ops)
+{
+    double ns_per_op = (now() - start) / (double)ops;
+
+    if (json_output) {
+        printf("{\"benchmark\": \"microbench/%s\", \"unit\": \"ns/op\", "
+               "\"value\": %.2f, \"iterations\": %zu}\n",
+               name, ns_per_op, ops);
+    } else {
+        printf("%-32s %10zu iterations %10.1f ns/op\n", name, ops, ns_per_op);
+    }
+}
+
+static void bench_rfc_time(size_t iterations)
+{
+    static const char date[30] = "Wed, 14 Oct 2026 16:06:39 GMT";
+    char formatted[30];
+    time_t parsed;
+    double start;
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        if (UNLIKELY(lwan_parse_rfc_time(date, &parsed) < 0))
+            abort();
+        sink += (unsigned long)parsed;
+    }
+    report("parse_rfc_time", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        if (UNLIKELY(lwan_format_rfc_time((time_t)i, formatted) < 0))
+            abort();
+        sink += (unsigned char)formatted[5];
+    }
+    report("format_rfc_time", start, iterations);
+}
+
+static void bench_number_formatting(size_t iterations)
+{
+    char buf[DOUBLE_TO_STR_BUFFER_SIZE];
+    char *formatted;
+    size_t len;
+    double start;
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        formatted = uint_to_string(i * 2654435761u, buf, &len);
+        sink += (unsigned char)formatted[len - 1];
+    }
+    report("uint_to_string", start, iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        formatted = double_to_string((double)i * 1.1, buf, &len);
+        sink += (unsigned char)formatted[len - 1];
+    }
+    report("double_to_string", start, iterations);
+
+    /* What double_to_string() replaced in templates, for comparison. */
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        len = (size_t)snprintf(buf, sizeof(buf), "%f", (double)i * 1.1);
+        sink += (unsigned char)buf[len - 1];
+    }
+    report("snprintf_double", start, iterations);
+}
+
+static void bench_headers(size_t iterations)
+{
+    /* What a browser sends after the request line; the parser writes to
+     * the buffer, so it's copied back before each run (that copy is part
+     * of what's measured). */
+    static const char headers[] =
+        "Host: localhost:8080\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/119.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: session=0123456789abcdef; theme=dark\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "If-Modified-Since: Wed, 14 Oct 2026 16:06:39 GMT\r\n"
+        "If-None-Match: \"5f3e-1a2b\"\r\n"
+        "\r\n";
+    char buffer[sizeof(headers)];
+    double start;
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        memcpy(buffer, headers, sizeof(headers));
+
+        ssize_t len =
+            lwan_parse_headers_for_benchmark(buffer, sizeof(headers) - 1);
+        if (UNLIKELY(len < 0))
+            abort();
+        sink += (unsigned long)len;
+    }
+    report("parse_headers", start, iterations);
+}
+
+struct page {
+    const char *title;
+    const char *user;
+    int visits;
+    const char *footer;
+};
+
+static void bench_template(size_t iterations)
+{
+    static const struct lwan_var_descriptor page_desc[] = {
+        TPL_VAR_STR_ESCAPE(struct page, title),
+        TPL_VAR_STR_ESCAPE(struct page, user),
+        TPL_VAR_INT(struct page, visits),
+        TPL_VAR_STR(struct page, footer),
+        TPL_VAR_SENTINEL,
+    };
+    struct page page = {
+        .title = "Lwan <benchmark> & friends",
+        .user = "someone@example.com",
+        .visits = 12345,
+        .footer = "<p>Powered by Lwan</p>",
+    };
+    struct lwan_strbuf buffer;
+    struct lwan_tpl *tpl;
+    double start;
+
+    tpl = lwan_tpl_compile_string(
+        "<html><head><title>{{title}}</title></head><body>"
+        "<h1>{{title}}</h1><p>Hello, {{user}}!</p>"
+        "{{visits?}}<p>You've been here {{visits}} times.</p>{{/visits?}}"
+        "{{footer}}</body></html>",
+        page_desc);
+    if (!tpl || !lwan_strbuf_init(&buffer))
+        abort();
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        lwan_strbuf_reset(&buffer);
+        if (UNLIKELY(!lwan_tpl_apply_with_buffer(tpl, &buffer, &page)))
+            abort();
+        sink += lwan_strbuf_get_length(&buffer);
+    }
+    report("tpl_apply", start, iterations);
+
+    lwan_strbuf_free(&buffer);
+    lwan_tpl_free(tpl);
+}
+
+static void bench_trie(size_t iterations)
+{
+    static const char *const prefixes[] = {
+        "/", "/hello", "/favicon.ico", "/admin", "/api/v1/users",
+        "/api/v1/groups", "/api/v2/users", "/static", "/static/css",
+        "/static/js", "/images", "/blog", "/blog/feed", "/login",
+        "/logout", "/metrics", "/proxy", "/chunked", "/sse", "/lua",
+    };
+    static const char *const urls[] = {
+        "/hello", "/static/css/style.css", "/api/v1/users/1234",
+        "/images/2018/photo.jpg", "/blog/posts/some-long-title",
+        "/favicon.ico", "/nonexistent/path", "/metrics",
+    };
+    struct lwan_trie trie;
+    double start;
+
+    if (!lwan_trie_init(&trie, NULL))
+        abort();
+    for (size_t i = 0; i < N_ELEMENTS(prefixes); i++)
+        lwan_trie_add(&trie, prefixes[i], (void *)prefixes[i]);
+    if (!lwan_trie_compile(&trie))
+        abort();
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++)
+        sink += (uintptr_t)lwan_trie_lookup_prefix(&trie,
+                                                   urls[i % N_ELEMENTS(urls)]);
+    report("trie_lookup_prefix", start, iterations);
+
+    lwan_trie_destroy(&trie);
+}
+
+struct cache_bench {
+    struct cache *cache;
+    char keys[64][16];
+    size_t iterations;
+    pthread_barrier_t barrier;
+};
+
+static struct cache_entry *create_entry(const char *key, void *context)
+{
+    struct cache_entry *entry = malloc(sizeof(*entry));
+
+    (void)context;
+
+    if (entry)
+        entry->size = sizeof(*entry) + strlen(key);
+    return entry;
+}
+
+static void destroy_entry(struct cache_entry *entry, void *context)
+{
+    (void)context;
+    free(entry);
+}
+
+static void *cache_thread(void *data)
+{
+    struct cache_bench *bench = data;
+    unsigned int seed = (unsigned int)(uintptr_t)pthread_self();
+
+    pthread_barrier_wait(&bench->barrier);
+
+    for (size_t i = 0; i < bench->iterations; i++) {
+        const char *key =
+            bench->keys[(size_t)rand_r(&seed) % N_ELEMENTS(bench->keys)];
+        struct cache_entry *entry;
+        int error;
+
+        /* The cache tells callers to come back later instead of blocking
+         * when another thread holds its lock; serve_files would yield. */
+        while (!(entry = cache_get_and_ref_entry(bench->cache, key, &error))) {
+            if (error != EWOULDBLOCK && error != EINPROGRESS)
+                abort();
+        }
+        cache_entry_unref(bench->cache, entry);
+    }
+
+    return NULL;
+}
+
+static void bench_cache(size_t iterations, unsigned int n_threads)
+{
+    struct cache_bench bench = {.iterations = iterations / n_threads};
+    pthread_t threads[n_threads];
+    char name[64];
+    double start;
+
+    bench.cache = cache_create(create_entry, destroy_entry, NULL, 3600);
+    if (!bench.cache)
+        abort();
+    for (size_t i = 0; i < N_ELEMENTS(bench.keys); i++)
+        snprintf(bench.keys[i], sizeof(bench.keys[i]), "/file-%zu", i);
+    if (pthread_barrier_init(&bench.barrier, NULL, n_threads + 1))
+        abort();
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        if (pthread_create(&threads[i], NULL, cache_thread, &bench))
+            abort();
+    }
+
+    start = now();
+    pthread_barrier_wait(&bench.barrier);
+    for (unsigned int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    snprintf(name, sizeof(name), "cache_get_and_ref/%u-threads", n_threads);
+    report(name, start, bench.iterations * n_threads);
+
+    pthread_barrier_destroy(&bench.barrier);
+    cache_destroy(bench.cache);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t iterations = 1000000;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jn:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json_output = true;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            if (iterations)
+                break;
+            /* fallthrough */
+        default:
+            fprintf(stderr, "Usage: %s [-j] [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_rfc_time(iterations);
+    bench_number_formatting(iterations);
+    bench_headers(iterations);
+    bench_template(iterations);
+    bench_trie(iterations);
+
+    /* The cache reads the clock and has a job thread to prune entries. */
+    lwan_clock_init(0);
+    lwan_job_thread_init();
+    for (unsigned int n_threads = 1; n_threads <= 8; n_threads *= 2) {
+        bench_cache(iterations, n_threads);
+
+        /* Always measure some contention, even on a single CPU. */
+        if (n_threads > 1 && (long)n_threads >= n_cpus)
+            break;
+    }
+    lwan_job_thread_shutdown();
+
+    return 0;
+}
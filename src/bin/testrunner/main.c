@@ -19,9 +19,15 @@
 
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "lwan.h"
+#include "lwan-escape.h"
+#include "lwan-json.h"
+#include "lwan-pubsub.h"
+
+static struct lwan_pubsub_topic *pubsub_topic;
 
 LWAN_HANDLER(quit_lwan)
 {
@@ -80,6 +86,80 @@ LWAN_HANDLER(test_server_sent_event)
     return HTTP_OK;
 }
 
+LWAN_HANDLER(test_pubsub_subscribe)
+{
+    struct lwan_pubsub_subscriber *sub = lwan_pubsub_subscribe(pubsub_topic);
+
+    if (!sub)
+        return HTTP_INTERNAL_ERROR;
+    coro_defer(request->conn->coro, CORO_DEFER(lwan_pubsub_unsubscribe), sub);
+
+    if (!lwan_response_set_event_stream(request, HTTP_OK))
+        return HTTP_INTERNAL_ERROR;
+
+    while (lwan_response_send_pubsub(request, sub, 10000))
+        ;
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_pubsub_publish)
+{
+    const char *message = lwan_request_get_query_param(request, "message");
+
+    if (!message)
+        return HTTP_BAD_REQUEST;
+    if (!lwan_pubsub_publish_event(pubsub_topic, "message", message,
+                                   strlen(message)))
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_set_static(response->buffer, "Published", sizeof("Published") - 1);
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_websocket)
+{
+    enum lwan_http_status status = lwan_request_websocket_upgrade(request);
+
+    if (status != HTTP_SWITCHING_PROTOCOLS)
+        return status;
+
+    while (!lwan_response_websocket_read(request))
+        lwan_response_websocket_write_text(request);
+
+    return HTTP_SWITCHING_PROTOCOLS;
+}
+
+LWAN_HANDLER(test_sleep)
+{
+    const char *ms_str = lwan_request_get_query_param(request, "ms");
+    unsigned int ms = ms_str ? (unsigned int)strtoul(ms_str, NULL, 10) : 0;
+
+    lwan_request_sleep(request, ms);
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "Slept %ums", ms);
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_micro_cache)
+{
+    static unsigned int generation;
+    const char *ms_str = lwan_request_get_query_param(request, "ms");
+
+    if (ms_str)
+        lwan_request_sleep(request, (unsigned int)strtoul(ms_str, NULL, 10));
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "Generation %u",
+                       __sync_add_and_fetch(&generation, 1));
+
+    return HTTP_OK;
+}
+
 LWAN_HANDLER(test_proxy)
 {
     struct lwan_key_value *headers = coro_malloc(request->conn->coro, sizeof(*headers) * 2);
@@ -154,6 +234,56 @@ LWAN_HANDLER(test_post_big)
     return HTTP_OK;
 }
 
+LWAN_HANDLER(test_post_json)
+{
+    static const char *const name_path[] = {"user", "name", NULL};
+    const struct lwan_json *name, *body, *parsed_name;
+
+    /* Looked up before the body is parsed, so that both ways of getting
+     * to the values are exercised. */
+    name = lwan_request_find_json(request, name_path);
+    if (!name || name->type != LWAN_JSON_STRING)
+        return HTTP_BAD_REQUEST;
+
+    body = lwan_request_get_json_body(request);
+    if (!body || body->type != LWAN_JSON_OBJECT)
+        return HTTP_BAD_REQUEST;
+    parsed_name = lwan_json_get_path(body, name_path);
+    if (!parsed_name || parsed_name->string.len != name->string.len ||
+        memcmp(parsed_name->string.value, name->string.value, name->string.len))
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "application/json";
+    lwan_strbuf_set(response->buffer, "{\"name\":", 8);
+    lwan_append_json_escaped(response->buffer, name->string.value,
+                             name->string.len);
+    lwan_strbuf_append_printf(response->buffer, ",\"members\":%zu}",
+                              body->children.len);
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_post_stream)
+{
+    char chunk[256];
+    size_t received = 0, sum = 0;
+    ssize_t n;
+
+    while ((n = lwan_request_read_body(request, chunk, sizeof(chunk))) > 0) {
+        for (ssize_t i = 0; i < n; i++)
+            sum += (size_t)chunk[i];
+        received += (size_t)n;
+    }
+    if (n < 0)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "application/json";
+    lwan_strbuf_printf(response->buffer, "{\"received\": %zu, \"sum\": %zu}",
+        received, sum);
+
+    return HTTP_OK;
+}
+
 LWAN_HANDLER(hello_world)
 {
     static struct lwan_key_value headers[] = {
@@ -176,7 +306,7 @@ LWAN_HANDLER(hello_world)
     lwan_strbuf_append_str(response->buffer, "\n\nCookies\n", 0);
     lwan_strbuf_append_str(response->buffer, "-------\n\n", 0);
 
-    struct lwan_key_value *qs = request->cookies.base.base;
+    const struct lwan_key_value *qs = lwan_request_get_cookies(request);
     for (; qs && qs->key; qs++)
         lwan_strbuf_append_printf(response->buffer,
                     "Key = \"%s\"; Value = \"%s\"\n", qs->key, qs->value);
@@ -184,7 +314,7 @@ LWAN_HANDLER(hello_world)
     lwan_strbuf_append_str(response->buffer, "\n\nQuery String Variables\n", 0);
     lwan_strbuf_append_str(response->buffer, "----------------------\n\n", 0);
 
-    for (qs = request->query_params.base.base; qs && qs->key; qs++)
+    for (qs = lwan_request_get_query_params(request); qs && qs->key; qs++)
         lwan_strbuf_append_printf(response->buffer,
                     "Key = \"%s\"; Value = \"%s\"\n", qs->key, qs->value);
 
@@ -194,7 +324,7 @@ LWAN_HANDLER(hello_world)
     lwan_strbuf_append_str(response->buffer, "\n\nPOST data\n", 0);
     lwan_strbuf_append_str(response->buffer, "---------\n\n", 0);
 
-    for (qs = request->post_data.base.base; qs && qs->key; qs++)
+    for (qs = lwan_request_get_post_params(request); qs && qs->key; qs++)
         lwan_strbuf_append_printf(response->buffer,
                     "Key = \"%s\"; Value = \"%s\"\n", qs->key, qs->value);
 
@@ -207,9 +337,15 @@ main()
 {
     struct lwan l;
 
+    pubsub_topic = lwan_pubsub_new_topic();
+    if (!pubsub_topic)
+        return EXIT_FAILURE;
+
     lwan_init(&l);
     lwan_main_loop(&l);
     lwan_shutdown(&l);
 
+    lwan_pubsub_free_topic(pubsub_topic);
+
     return EXIT_SUCCESS;
 }
@@ -25,42 +25,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef HAVE_ZOPFLI
-#include <zopfli/zopfli.h>
-#else
-#include <zlib.h>
-#endif
-
 #include "../../lib/hash.h"
-
-struct output {
-    char *ptr;
-    size_t used, capacity;
-};
-
-static int output_append(struct output *output, const char *str)
-{
-    size_t str_len = strlen(str) + 1;
-    size_t total_size = output->used + str_len;
-
-    if (total_size >= output->capacity) {
-        char *tmp;
-
-        while (total_size >= output->capacity)
-            output->capacity *= 2;
-
-        tmp = realloc(output->ptr, output->capacity);
-        if (!tmp)
-            return -errno;
-
-        output->ptr = tmp;
-    }
-
-    memcpy(output->ptr + output->used, str, str_len);
-    output->used = total_size;
-
-    return 0;
-}
+#include "../../lib/mime-hash.h"
 
 static int compare_ext(const void *a, const void *b)
 {
@@ -80,69 +46,127 @@ static char *strend(char *str, char ch)
     return NULL;
 }
 
-static char *compress_output(const struct output *output, size_t *outlen)
+struct bucket {
+    uint32_t index;
+    uint32_t n_keys;
+    uint32_t *keys;
+};
+
+static int compare_bucket(const void *a, const void *b)
 {
-    char *compressed;
-
-#ifdef HAVE_ZOPFLI
-    ZopfliOptions opts;
-
-    *outlen = 0;
-
-    ZopfliInitOptions(&opts);
-    ZopfliCompress(&opts, ZOPFLI_FORMAT_ZLIB,
-        (const unsigned char *)output->ptr, output->used,
-        (unsigned char **)&compressed, outlen);
-#else
-    *outlen = compressBound((uLong)output->used);
-    compressed = malloc(*outlen);
-    if (!compressed) {
-        fprintf(stderr, "Could not allocate memory for compressed data\n");
+    const struct bucket *ba = a;
+    const struct bucket *bb = b;
+
+    /* Place the fullest buckets first; break ties by index so that the
+     * generated table doesn't depend on qsort() implementation details. */
+    if (ba->n_keys != bb->n_keys)
+        return ba->n_keys > bb->n_keys ? -1 : 1;
+    return ba->index < bb->index ? -1 : 1;
+}
+
+static uint32_t next_power_of_two(uint32_t n)
+{
+    uint32_t ret = 1;
+
+    while (ret < n)
+        ret <<= 1;
+
+    return ret;
+}
+
+/* Hash and displace: every key is first hashed into a bucket, and then a
+ * single displacement is searched for each bucket, starting with the
+ * fullest ones, such that all of its keys land on free slots.  Lookups
+ * then take one hash and one comparison. */
+static bool build_perfect_hash(const uint64_t *hashes,
+                               uint32_t n_keys,
+                               uint32_t n_buckets,
+                               uint32_t table_size,
+                               uint16_t *displacements,
+                               int32_t *slots)
+{
+    struct bucket *buckets = calloc(n_buckets, sizeof(*buckets));
+    uint32_t *keys = calloc(n_keys, sizeof(*keys));
+    uint32_t *key_slots = calloc(n_keys, sizeof(*key_slots));
+    uint32_t i, j, k;
+    bool ret = false;
+
+    if (!buckets || !keys || !key_slots) {
+        fprintf(stderr, "Could not allocate memory for perfect hash\n");
         exit(1);
     }
-    if (compress2((Bytef *)compressed, outlen, (const Bytef *)output->ptr, output->used, 9) != Z_OK) {
-        fprintf(stderr, "Could not compress data\n");
-        exit(1);
+
+    for (i = 0; i < n_keys; i++)
+        buckets[mime_hash_bucket(hashes[i], n_buckets)].n_keys++;
+    for (i = 0, j = 0; i < n_buckets; i++) {
+        buckets[i].index = i;
+        buckets[i].keys = keys + j;
+        j += buckets[i].n_keys;
+        buckets[i].n_keys = 0;
+    }
+    for (i = 0; i < n_keys; i++) {
+        struct bucket *bucket = &buckets[mime_hash_bucket(hashes[i], n_buckets)];
+        bucket->keys[bucket->n_keys++] = i;
     }
-#endif
-    if (!*outlen)
-        return NULL;
+    qsort(buckets, n_buckets, sizeof(*buckets), compare_bucket);
 
-    return compressed;
-}
+    for (i = 0; i < table_size; i++)
+        slots[i] = -1;
 
-static bool is_builtin_mime_type(const char *mime)
-{
-    /* These are the mime types supported by Lwan without having to perform
-     * a bsearch().  application/octet-stream is the fallback. */
-    if (streq(mime, "application/octet-stream"))
-        return true;
-    if (streq(mime, "application/javascript"))
-        return true;
-    if (streq(mime, "image/jpeg"))
-        return true;
-    if (streq(mime, "image/png"))
-        return true;
-    if (streq(mime, "text/html"))
-        return true;
-    if (streq(mime, "text/css"))
-        return true;
-    if (streq(mime, "text/plain"))
-        return true;
-    return false;
+    for (i = 0; i < n_buckets && buckets[i].n_keys; i++) {
+        const struct bucket *bucket = &buckets[i];
+        uint32_t displacement;
+
+        for (displacement = 0; displacement <= UINT16_MAX; displacement++) {
+            for (j = 0; j < bucket->n_keys; j++) {
+                uint32_t slot = mime_hash_slot(hashes[bucket->keys[j]],
+                                               displacement, table_size);
+
+                if (slots[slot] >= 0)
+                    break;
+                for (k = 0; k < j; k++) {
+                    if (key_slots[k] == slot)
+                        break;
+                }
+                if (k < j)
+                    break;
+
+                key_slots[j] = slot;
+            }
+
+            if (j == bucket->n_keys)
+                break;
+        }
+        if (displacement > UINT16_MAX)
+            goto out;
+
+        displacements[bucket->index] = (uint16_t)displacement;
+        for (j = 0; j < bucket->n_keys; j++)
+            slots[key_slots[j]] = (int32_t)bucket->keys[j];
+    }
+
+    ret = true;
+
+out:
+    free(key_slots);
+    free(keys);
+    free(buckets);
+    return ret;
 }
 
 int main(int argc, char *argv[])
 {
     FILE *fp;
     char buffer[256];
-    struct output output = { .capacity = 1024 };
-    size_t compressed_size;
-    char *compressed, *ext;
+    char *ext;
     struct hash *ext_mime;
     struct hash_iter iter;
     const char **exts, *key;
-    size_t i;
+    uint64_t *hashes;
+    uint16_t *displacements;
+    int32_t *slots;
+    uint32_t n_exts, n_buckets, table_size;
+    size_t i, max_ext_len = 0;
 
     if (argc < 2) {
         fprintf(stderr, "Usage: %s /path/to/mime.types\n", argv[0]);
@@ -176,14 +200,12 @@ int main(int argc, char *argv[])
             continue;
 
         mime_type = start;
-        if (is_builtin_mime_type(mime_type))
-            continue;
 
         while (*tab && *tab == '\t') /* Find first extension. */
             tab++;
 
         for (ext = tab; *ext; ext += end - ext + 1) {
-            char *k, *v;
+            char *k, *v, *p;
             int r;
 
             end = strchr(ext, ' '); /* Stop at next extension. */
@@ -199,6 +221,10 @@ int main(int argc, char *argv[])
                 return 1;
             }
 
+            /* Lookups are case-insensitive. */
+            for (p = k; *p; p++)
+                *p = (char)tolower(*p);
+
             r = hash_add_unique(ext_mime, k, v);
             if (r < 0) {
                 free(k);
@@ -212,54 +238,75 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* Get sorted list of extensions. */
-    exts = calloc(hash_get_count(ext_mime), sizeof(char *));
-    if (!exts) {
+    /* Get sorted list of extensions, so that the output is reproducible. */
+    n_exts = hash_get_count(ext_mime);
+    exts = calloc(n_exts, sizeof(char *));
+    hashes = calloc(n_exts, sizeof(uint64_t));
+    if (!exts || !hashes) {
         fprintf(stderr, "Could not allocate extension array\n");
         return 1;
     }
     hash_iter_init(ext_mime, &iter);
     for (i = 0; hash_iter_next(&iter, (const void **)&key, NULL); i++)
         exts[i] = key;
-    qsort(exts, hash_get_count(ext_mime), sizeof(char *), compare_ext);
+    qsort(exts, n_exts, sizeof(char *), compare_ext);
 
-    /* Generate uncompressed blob. */
-    output.ptr = malloc(output.capacity);
-    if (!output.ptr) {
-        fprintf(stderr, "Could not allocate temporary memory\n");
-        return 1;
+    for (i = 0; i < n_exts; i++) {
+        size_t len = strlen(exts[i]);
+
+        hashes[i] = mime_hash_extension(exts[i], len);
+        if (len > max_ext_len)
+            max_ext_len = len;
     }
-    for (i = 0; i < hash_get_count(ext_mime); i++) {
-        if (output_append(&output, exts[i]) < 0) {
-            fprintf(stderr, "Could not append to output\n");
+
+    /* Roughly four keys per bucket; if no displacement works for some
+     * bucket, try again with a sparser table. */
+    n_buckets = next_power_of_two(n_exts / 4 + 1);
+    for (table_size = next_power_of_two(n_exts + 1);; table_size *= 2) {
+        displacements = calloc(n_buckets, sizeof(uint16_t));
+        slots = calloc(table_size, sizeof(int32_t));
+        if (!displacements || !slots) {
+            fprintf(stderr, "Could not allocate perfect hash table\n");
             return 1;
         }
-        if (output_append(&output, hash_find(ext_mime, exts[i])) < 0) {
-            fprintf(stderr, "Could not append to output\n");
+
+        if (build_perfect_hash(hashes, n_exts, n_buckets, table_size,
+                               displacements, slots))
+            break;
+
+        free(displacements);
+        free(slots);
+
+        if (table_size >= 1u << 20) {
+            fprintf(stderr, "Could not build perfect hash table\n");
             return 1;
         }
     }
 
-    /* Compress blob. */
-    compressed = compress_output(&output, &compressed_size);
-    if (!compressed) {
-        fprintf(stderr, "Could not compress data\n");
-        return 1;
-    }
-
     /* Print output. */
     printf("#pragma once\n");
-    printf("#define MIME_UNCOMPRESSED_LEN %zu\n", output.used);
-    printf("#define MIME_COMPRESSED_LEN %lu\n", compressed_size);
-    printf("#define MIME_ENTRIES %d\n", hash_get_count(ext_mime));
+    printf("#include \"mime-hash.h\"\n");
+    printf("#define MIME_ENTRIES %u\n", n_exts);
+    printf("#define MIME_BUCKETS %u\n", n_buckets);
+    printf("#define MIME_TABLE_SIZE %u\n", table_size);
+    printf("#define MIME_MAX_EXTENSION_LEN %zu\n", max_ext_len);
     printf("struct mime_entry { const char *extension; const char *type; };\n");
-    printf("static const unsigned char mime_entries_compressed[] = {\n");
-    for (i = 1; compressed_size; compressed_size--, i++)
-        printf("0x%x,%c", compressed[i - 1] & 0xff, " \n"[i % 13 == 0]);
+    printf("static const uint16_t mime_displacements[MIME_BUCKETS] = {\n");
+    for (i = 0; i < n_buckets; i++)
+        printf("%u,%c", displacements[i], " \n"[(i + 1) % 13 == 0]);
+    printf("};\n");
+    printf("static const struct mime_entry mime_entries[MIME_TABLE_SIZE] = {\n");
+    for (i = 0; i < table_size; i++) {
+        if (slots[i] < 0)
+            continue;
+        printf("[%zu] = {\"%s\", \"%s\"},\n", i, exts[slots[i]],
+               (const char *)hash_find(ext_mime, exts[slots[i]]));
+    }
     printf("};\n");
 
-    free(compressed);
-    free(output.ptr);
+    free(slots);
+    free(displacements);
+    free(hashes);
     free(exts);
     hash_free(ext_mime);
     fclose(fp);
@@ -23,16 +23,23 @@
 #cmakedefine HAS_ACCEPT4
 #cmakedefine HAS_ALLOCA_H
 #cmakedefine HAS_CLOCK_GETTIME
+#cmakedefine HAS_EVENTFD
+#cmakedefine HAS_EXPLICIT_BZERO
 #cmakedefine HAS_GET_CURRENT_DIR_NAME
 #cmakedefine HAS_GETAUXVAL
+#cmakedefine HAS_INOTIFY
 #cmakedefine HAS_MEMPCPY
 #cmakedefine HAS_MEMRCHR
 #cmakedefine HAS_MKOSTEMP
 #cmakedefine HAS_PIPE2
+#cmakedefine HAS_POSIX_FADVISE
+#cmakedefine HAS_PREADV2
 #cmakedefine HAS_PTHREADBARRIER
+#cmakedefine HAS_PTHREAD_ATTR_SETAFFINITY
 #cmakedefine HAS_RAWMEMCHR
 #cmakedefine HAS_READAHEAD
 #cmakedefine HAS_REALLOCARRAY
+#cmakedefine HAS_TIMER_CREATE
 
 /* Compiler builtins for specific CPU instruction support */
 #cmakedefine HAVE_BUILTIN_CLZLL
@@ -47,7 +54,24 @@
 
 /* Libraries */
 #cmakedefine HAVE_LUA
+#cmakedefine HAVE_LUAJIT
+#cmakedefine HAVE_BROTLI
+#cmakedefine HAVE_ZSTD
+#cmakedefine HAVE_KTLS
 
 /* Valgrind support for coroutines */
 #cmakedefine USE_VALGRIND
 
+/* USDT probes */
+#cmakedefine HAVE_SYS_SDT_H
+
+/* backtrace(), used by the sampling profiler */
+#cmakedefine HAVE_EXECINFO_H
+#cmakedefine HAVE_LINUX_OPENAT2_H
+
+/* Coroutine stacks allocated with mmap(), with a guard page */
+#cmakedefine USE_MMAP_CORO_STACKS
+
+/* Socket writes submitted through io_uring */
+#cmakedefine USE_IO_URING
+
@@ -0,0 +1,31 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+
+/* Large enough for "-2.2250738585072014e-308" and "-100000000000000000000",
+ * plus the NUL terminator. */
+#define DOUBLE_TO_STR_BUFFER_SIZE 32
+
+char *double_to_string(double value,
+                       char buffer[static DOUBLE_TO_STR_BUFFER_SIZE],
+                       size_t *len);
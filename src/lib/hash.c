@@ -33,29 +33,32 @@
 #include "hash.h"
 #include "murmur3.h"
 
+/* Open addressing with Robin Hood hashing: entries are kept in a single
+ * array, and an entry is never further from its home slot than the
+ * entries it skipped over, so lookups can stop as soon as they'd have to
+ * go further than the entry currently being looked at.  The full hash
+ * value is stored next to the key, so mismatches are almost always
+ * rejected without touching the key. */
 struct hash_entry {
     const char *key;
     const void *value;
     unsigned hashval;
-};
-
-struct hash_bucket {
-    struct hash_entry *entries;
-    unsigned used;
-    unsigned total;
+    /* 0 if this slot is empty; otherwise, the distance from the slot
+     * this entry hashes to, plus one. */
+    unsigned probe;
 };
 
 struct hash {
     unsigned count;
+    unsigned n_slots;
     unsigned (*hash_value)(const void *key);
     int (*key_compare)(const void *k1, const void *k2);
     void (*free_value)(void *value);
     void (*free_key)(void *value);
-    struct hash_bucket buckets[];
+    struct hash_entry *entries;
 };
 
-#define N_BUCKETS 512
-#define STEPS 64
+#define MIN_SLOTS 16
 #define DEFAULT_ODD_CONSTANT 0x27d4eb2d
 
 static unsigned int odd_constant = DEFAULT_ODD_CONSTANT;
@@ -167,12 +170,12 @@ hash_internal_new(unsigned int (*hash_value)(const void *key),
                   void (*free_key)(void *value),
                   void (*free_value)(void *value))
 {
-    struct hash *hash =
-        calloc(1, sizeof(struct hash) + N_BUCKETS * sizeof(struct hash_bucket));
+    struct hash *hash = calloc(1, sizeof(struct hash));
 
     if (hash == NULL)
         return NULL;
 
+    /* Slots are only allocated when the first element is added. */
     hash->hash_value = hash_value;
     hash->key_compare = key_compare;
     hash->free_value = free_value;
@@ -198,66 +201,134 @@ struct hash *hash_str_new(void (*free_key)(void *value),
 
 void hash_free(struct hash *hash)
 {
-    struct hash_bucket *bucket, *bucket_end;
+    struct hash_entry *entry, *entry_end;
 
     if (hash == NULL)
         return;
 
-    bucket = hash->buckets;
-    bucket_end = bucket + N_BUCKETS;
-    for (; bucket < bucket_end; bucket++) {
-        struct hash_entry *entry, *entry_end;
-        entry = bucket->entries;
-        entry_end = entry + bucket->used;
-        for (; entry < entry_end; entry++) {
-            hash->free_value((void *)entry->value);
-            hash->free_key((void *)entry->key);
-        }
-        free(bucket->entries);
+    entry = hash->entries;
+    entry_end = entry + hash->n_slots;
+    for (; entry < entry_end; entry++) {
+        if (!entry->probe)
+            continue;
+
+        hash->free_value((void *)entry->value);
+        hash->free_key((void *)entry->key);
     }
+
+    free(hash->entries);
     free(hash);
 }
 
-static struct hash_entry *hash_add_entry(struct hash *hash, const void *key)
+/* Places @new_entry in the table, displacing entries closer to their home
+ * slots than @new_entry is to its own.  Returns where @new_entry ended up;
+ * there must be at least one empty slot. */
+static struct hash_entry *hash_place_entry(struct hash_entry *entries,
+                                           unsigned int mask,
+                                           struct hash_entry new_entry)
 {
-    unsigned int hashval = hash->hash_value(key);
-    unsigned int pos = hashval & (N_BUCKETS - 1);
-    struct hash_bucket *bucket = hash->buckets + pos;
-    struct hash_entry *entry, *entry_end;
+    unsigned int pos = new_entry.hashval & mask;
+    struct hash_entry *placed = NULL;
 
-    if (bucket->used + 1 >= bucket->total) {
-        unsigned int new_total;
-        struct hash_entry *tmp;
+    new_entry.probe = 1;
 
-        if (__builtin_add_overflow(bucket->total, STEPS, &new_total)) {
-            errno = EOVERFLOW;
-            return NULL;
+    while (true) {
+        struct hash_entry *entry = &entries[pos];
+
+        if (!entry->probe) {
+            *entry = new_entry;
+            return placed ? placed : entry;
         }
 
-        tmp = reallocarray(bucket->entries, new_total, sizeof(*tmp));
-        if (tmp == NULL)
-            return NULL;
+        if (entry->probe < new_entry.probe) {
+            struct hash_entry displaced = *entry;
 
-        bucket->entries = tmp;
-        bucket->total = new_total;
+            *entry = new_entry;
+            new_entry = displaced;
+
+            if (!placed)
+                placed = entry;
+        }
+
+        pos = (pos + 1) & mask;
+        new_entry.probe++;
     }
+}
 
-    entry = bucket->entries;
-    entry_end = entry + bucket->used;
+static int hash_resize(struct hash *hash, unsigned int n_slots)
+{
+    struct hash_entry *entries = calloc(n_slots, sizeof(*entries));
+    struct hash_entry *entry, *entry_end;
+
+    if (entries == NULL)
+        return -errno;
+
+    entry = hash->entries;
+    entry_end = entry + hash->n_slots;
     for (; entry < entry_end; entry++) {
-        if (hashval != entry->hashval)
-            continue;
-        if (!hash->key_compare(key, entry->key))
+        if (entry->probe)
+            hash_place_entry(entries, n_slots - 1, *entry);
+    }
+
+    free(hash->entries);
+    hash->entries = entries;
+    hash->n_slots = n_slots;
+
+    return 0;
+}
+
+static inline struct hash_entry *
+hash_find_entry(const struct hash *hash, const char *key, unsigned int hashval)
+{
+    const unsigned int mask = hash->n_slots - 1;
+    unsigned int pos;
+
+    if (hash->n_slots == 0)
+        return NULL;
+
+    pos = hashval & mask;
+
+    for (unsigned int probe = 1;; probe++) {
+        struct hash_entry *entry = &hash->entries[pos];
+
+        /* Also catches empty slots, as their probe is 0. */
+        if (entry->probe < probe)
+            return NULL;
+
+        if (hashval == entry->hashval && !hash->key_compare(key, entry->key))
             return entry;
+
+        pos = (pos + 1) & mask;
     }
+}
 
-    bucket->used++;
-    hash->count++;
+static struct hash_entry *hash_add_entry(struct hash *hash, const void *key)
+{
+    unsigned int hashval = hash->hash_value(key);
+    struct hash_entry *entry = hash_find_entry(hash, key, hashval);
+
+    if (entry)
+        return entry;
+
+    /* Keep the load factor at or below 3/4. */
+    if ((hash->count + 1) * 4 > hash->n_slots * 3) {
+        unsigned int new_n_slots;
+
+        if (!hash->n_slots) {
+            new_n_slots = MIN_SLOTS;
+        } else if (__builtin_mul_overflow(hash->n_slots, 2, &new_n_slots)) {
+            errno = EOVERFLOW;
+            return NULL;
+        }
+
+        if (hash_resize(hash, new_n_slots) < 0)
+            return NULL;
+    }
 
-    entry->hashval = hashval;
-    entry->key = entry->value = NULL;
+    hash->count++;
 
-    return entry;
+    return hash_place_entry(hash->entries, hash->n_slots - 1,
+                            (struct hash_entry){.hashval = hashval});
 }
 
 /*
@@ -299,25 +370,6 @@ int hash_add_unique(struct hash *hash, const void *key, const void *value)
     return 0;
 }
 
-static inline struct hash_entry *
-hash_find_entry(const struct hash *hash, const char *key, unsigned int hashval)
-{
-    unsigned int pos = hashval & (N_BUCKETS - 1);
-    const struct hash_bucket *bucket = hash->buckets + pos;
-    struct hash_entry *entry, *entry_end;
-
-    entry = bucket->entries;
-    entry_end = entry + bucket->used;
-    for (; entry < entry_end; entry++) {
-        if (hashval != entry->hashval)
-            continue;
-        if (hash->key_compare(key, entry->key) == 0)
-            return entry;
-    }
-
-    return NULL;
-}
-
 void *hash_find(const struct hash *hash, const void *key)
 {
     const struct hash_entry *entry;
@@ -330,36 +382,38 @@ void *hash_find(const struct hash *hash, const void *key)
 
 int hash_del(struct hash *hash, const void *key)
 {
-    unsigned int hashval = hash->hash_value(key);
-    unsigned int pos = hashval & (N_BUCKETS - 1);
-    unsigned int steps_used, steps_total;
-    struct hash_bucket *bucket = hash->buckets + pos;
-    struct hash_entry *entry, *entry_end;
+    const unsigned int mask = hash->n_slots - 1;
+    struct hash_entry *entry;
+    unsigned int pos;
 
-    entry = hash_find_entry(hash, key, hashval);
+    entry = hash_find_entry(hash, key, hash->hash_value(key));
     if (entry == NULL)
         return -ENOENT;
 
     hash->free_value((void *)entry->value);
     hash->free_key((void *)entry->key);
 
-    entry_end = bucket->entries + bucket->used;
-    memmove(entry, entry + 1,
-            (size_t)(entry_end - entry) * sizeof(struct hash_entry));
+    /* Shift back the entries that follow, until one that's either in its
+     * home slot or empty is found, so no holes are left in probe
+     * sequences. */
+    pos = (unsigned int)(entry - hash->entries);
+    while (true) {
+        struct hash_entry *next = &hash->entries[(pos + 1) & mask];
 
-    bucket->used--;
-    hash->count--;
+        if (next->probe <= 1)
+            break;
 
-    steps_used = bucket->used / STEPS;
-    steps_total = bucket->total / STEPS;
-    if (steps_used + 1 < steps_total) {
-        struct hash_entry *tmp =
-            reallocarray(bucket->entries, steps_used + 1, STEPS * sizeof(*tmp));
-        if (tmp) {
-            bucket->entries = tmp;
-            bucket->total = (steps_used + 1) * STEPS;
-        }
+        hash->entries[pos] = *next;
+        hash->entries[pos].probe--;
+        pos = (pos + 1) & mask;
     }
+    hash->entries[pos] = (struct hash_entry){};
+
+    hash->count--;
+
+    /* Failing to shrink is fine: the table is still usable as is. */
+    if (hash->n_slots > MIN_SLOTS && hash->count * 8 < hash->n_slots)
+        hash_resize(hash, hash->n_slots / 2);
 
     return 0;
 }
@@ -369,39 +423,28 @@ unsigned int hash_get_count(const struct hash *hash) { return hash->count; }
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter)
 {
     iter->hash = hash;
-    iter->bucket = 0;
-    iter->entry = -1;
+    iter->slot = 0;
 }
 
 bool hash_iter_next(struct hash_iter *iter,
                     const void **key,
                     const void **value)
 {
-    const struct hash_bucket *b = iter->hash->buckets + iter->bucket;
-    const struct hash_entry *e;
+    const struct hash *hash = iter->hash;
 
-    iter->entry++;
+    while (iter->slot < hash->n_slots) {
+        const struct hash_entry *e = &hash->entries[iter->slot++];
 
-    if ((unsigned int)iter->entry >= b->used) {
-        iter->entry = 0;
-
-        for (iter->bucket++; iter->bucket < N_BUCKETS; iter->bucket++) {
-            b = iter->hash->buckets + iter->bucket;
+        if (!e->probe)
+            continue;
 
-            if (b->used > 0)
-                break;
-        }
+        if (value != NULL)
+            *value = e->value;
+        if (key != NULL)
+            *key = e->key;
 
-        if (iter->bucket >= N_BUCKETS)
-            return false;
+        return true;
     }
 
-    e = b->entries + iter->entry;
-
-    if (value != NULL)
-        *value = e->value;
-    if (key != NULL)
-        *key = e->key;
-
-    return true;
+    return false;
 }
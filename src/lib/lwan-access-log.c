@@ -0,0 +1,397 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lwan-private.h"
+#include "lwan-access-log.h"
+
+#define RING_SIZE 2048 /* Must be a power of 2 */
+#define URL_LEN 200
+
+/* How long the writer sleeps once all rings are empty. */
+#define WRITER_INTERVAL_MS 100
+
+#define CHUNK_SIZE 16384
+#define N_CHUNKS 16
+
+struct access_log_record {
+    time_t when;
+    size_t body_len;
+    const char *method;
+    unsigned char addr[16];
+    unsigned short family;
+    unsigned short status;
+    unsigned short url_len;
+    const char *version;
+    char url[URL_LEN];
+};
+
+/* Single producer (the I/O thread), single consumer (the writer).  Each
+ * side only writes to its own index, and caches the other one so that it
+ * is only read again when the ring looks full (or empty). */
+struct lwan_access_log_ring {
+    struct {
+        unsigned int tail;
+        unsigned int cached_head;
+        unsigned long long dropped;
+    } producer __attribute__((aligned(64)));
+
+    struct {
+        unsigned int head;
+    } consumer __attribute__((aligned(64)));
+
+    struct access_log_record records[RING_SIZE];
+};
+
+struct lwan_access_log {
+    int fd;
+    pthread_t writer;
+    bool running;
+
+    unsigned long long reported_dropped;
+
+    struct {
+        time_t when;
+        char str[sizeof("[10/Oct/2000:13:55:36 +0000]")];
+    } date;
+
+    struct iovec iov[N_CHUNKS];
+    char chunks[N_CHUNKS][CHUNK_SIZE];
+};
+
+void lwan_access_log_record(struct lwan_request *request,
+                            enum lwan_http_status status,
+                            const char *method,
+                            size_t body_len)
+{
+    struct lwan_access_log_ring *ring = request->conn->thread->access_log;
+    struct access_log_record *record;
+    unsigned int tail = ring->producer.tail;
+
+    if (UNLIKELY(tail - ring->producer.cached_head >= RING_SIZE)) {
+        ring->producer.cached_head =
+            __atomic_load_n(&ring->consumer.head, __ATOMIC_ACQUIRE);
+
+        if (tail - ring->producer.cached_head >= RING_SIZE) {
+            ATOMIC_READ(ring->producer.dropped)++;
+            return;
+        }
+    }
+
+    record = &ring->records[tail & (RING_SIZE - 1)];
+
+    struct sockaddr_storage sa;
+    if (LIKELY(lwan_request_get_remote_sockaddr(request, &sa))) {
+        record->family = sa.ss_family;
+        if (sa.ss_family == AF_INET)
+            memcpy(record->addr, &((struct sockaddr_in *)&sa)->sin_addr, 4);
+        else if (sa.ss_family == AF_INET6)
+            memcpy(record->addr, &((struct sockaddr_in6 *)&sa)->sin6_addr, 16);
+    } else {
+        record->family = AF_UNSPEC;
+    }
+
+    record->when = request->conn->thread->date.last;
+    record->method = method;
+    record->status = (unsigned short)status;
+    record->body_len = body_len;
+    if (request->flags & REQUEST_IS_HTTP_2)
+        record->version = "2";
+    else
+        record->version = request->flags & REQUEST_IS_HTTP_1_0 ? "1.0" : "1.1";
+    record->url_len = (unsigned short)(request->original_url.len < URL_LEN
+                                           ? request->original_url.len
+                                           : URL_LEN);
+    memcpy(record->url, request->original_url.value, record->url_len);
+
+    __atomic_store_n(&ring->producer.tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static const char *format_date(struct lwan_access_log *log, time_t when)
+{
+    if (when != log->date.when) {
+        struct tm tm;
+
+        log->date.when = when;
+        if (!gmtime_r(&when, &tm) ||
+            !strftime(log->date.str, sizeof(log->date.str),
+                      "[%d/%b/%Y:%H:%M:%S +0000]", &tm))
+            strcpy(log->date.str, "[-]");
+    }
+
+    return log->date.str;
+}
+
+static size_t format_record(struct lwan_access_log *log,
+                            const struct access_log_record *record,
+                            char *buffer,
+                            size_t len)
+{
+    char addr[INET6_ADDRSTRLEN];
+    char url[URL_LEN * 4 + 1];
+    char body_len[3 * sizeof(size_t) + 1];
+    char *u = url;
+    int ret;
+
+    if (record->family == AF_INET || record->family == AF_INET6) {
+        if (!inet_ntop(record->family, record->addr, addr, sizeof(addr)))
+            strcpy(addr, "-");
+    } else {
+        strcpy(addr, "-");
+    }
+
+    /* The URL comes straight from the client; keep it from being able to
+     * forge lines. */
+    for (unsigned short i = 0; i < record->url_len; i++) {
+        unsigned char c = (unsigned char)record->url[i];
+
+        if (c < 0x20 || c == '"' || c == '\\' || c >= 0x7f)
+            u += sprintf(u, "\\x%02x", c);
+        else
+            *u++ = (char)c;
+    }
+    *u = '\0';
+
+    /* As in the Common Log Format, "-" when there's no body. */
+    if (record->body_len)
+        snprintf(body_len, sizeof(body_len), "%zu", record->body_len);
+    else
+        strcpy(body_len, "-");
+
+    ret = snprintf(buffer, len, "%s - - %s \"%s %s HTTP/%s\" %u %s\n", addr,
+                   format_date(log, record->when), record->method, url,
+                   record->version, record->status, body_len);
+    if (ret < 0 || (size_t)ret >= len)
+        return 0;
+
+    return (size_t)ret;
+}
+
+static void write_chunks(struct lwan_access_log *log, int n_chunks)
+{
+    struct iovec *iov = log->iov;
+
+    while (n_chunks) {
+        ssize_t written = writev(log->fd, iov, n_chunks);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            lwan_status_perror("Could not write access log");
+            return;
+        }
+
+        while (n_chunks && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            n_chunks--;
+        }
+        if (n_chunks) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+}
+
+/* Formats everything in the rings right now, writing whenever all chunks
+ * are full.  Returns the number of records consumed. */
+static unsigned int drain(struct lwan *l, struct lwan_access_log *log)
+{
+    unsigned int consumed = 0;
+    int chunk = 0;
+    size_t used = 0;
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        struct lwan_access_log_ring *ring = l->thread.threads[i].access_log;
+        unsigned int head = ring->consumer.head;
+        const unsigned int tail =
+            __atomic_load_n(&ring->producer.tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            const struct access_log_record *record =
+                &ring->records[head & (RING_SIZE - 1)];
+            size_t len;
+
+            len = format_record(log, record, log->chunks[chunk] + used,
+                                CHUNK_SIZE - used);
+            if (!len) {
+                log->iov[chunk] = (struct iovec){log->chunks[chunk], used};
+                used = 0;
+
+                if (++chunk == N_CHUNKS) {
+                    write_chunks(log, chunk);
+                    chunk = 0;
+                }
+
+                len = format_record(log, record, log->chunks[chunk],
+                                    CHUNK_SIZE);
+            }
+
+            used += len;
+            consumed++;
+        }
+
+        __atomic_store_n(&ring->consumer.head, head, __ATOMIC_RELEASE);
+    }
+
+    if (used) {
+        log->iov[chunk] = (struct iovec){log->chunks[chunk], used};
+        chunk++;
+    }
+    if (chunk)
+        write_chunks(log, chunk);
+
+    return consumed;
+}
+
+static void report_dropped(struct lwan *l, struct lwan_access_log *log)
+{
+    unsigned long long dropped = lwan_access_log_get_dropped(l);
+
+    if (UNLIKELY(dropped != log->reported_dropped)) {
+        lwan_status_warning("Access log rings full: %llu records dropped",
+                            dropped - log->reported_dropped);
+        log->reported_dropped = dropped;
+    }
+}
+
+static void *writer_thread(void *data)
+{
+    struct lwan *l = data;
+    struct lwan_access_log *log = l->access_log;
+    const struct timespec interval = {
+        .tv_nsec = WRITER_INTERVAL_MS * 1000000,
+    };
+
+    while (ATOMIC_READ(log->running)) {
+        if (!drain(l, log))
+            nanosleep(&interval, NULL);
+
+        report_dropped(l, log);
+    }
+
+    return NULL;
+}
+
+bool lwan_access_log_init(struct lwan *l)
+{
+    struct lwan_access_log *log;
+
+    if (!l->config.access_log)
+        return true;
+
+    log = malloc(sizeof(*log));
+    if (!log)
+        return false;
+
+    log->fd = open(l->config.access_log,
+                   O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    if (log->fd < 0) {
+        lwan_status_perror("Could not open access log %s",
+                           l->config.access_log);
+        free(log);
+        return false;
+    }
+
+    log->running = true;
+    log->reported_dropped = 0;
+    log->date.when = 0;
+    strcpy(log->date.str, "[-]");
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        struct lwan_access_log_ring *ring;
+
+        if (posix_memalign((void **)&ring, 64, sizeof(*ring)))
+            goto free_rings;
+        memset(ring, 0, offsetof(struct lwan_access_log_ring, records));
+
+        l->thread.threads[i].access_log = ring;
+    }
+
+    l->access_log = log;
+
+    if (pthread_create(&log->writer, NULL, writer_thread, l)) {
+        lwan_status_perror("Could not create access log writer");
+        l->access_log = NULL;
+        goto free_rings;
+    }
+
+    lwan_status_debug("Logging requests to %s", l->config.access_log);
+    return true;
+
+free_rings:
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        free(l->thread.threads[i].access_log);
+        l->thread.threads[i].access_log = NULL;
+    }
+    close(log->fd);
+    free(log);
+    return false;
+}
+
+void lwan_access_log_shutdown(struct lwan *l)
+{
+    struct lwan_access_log *log = l->access_log;
+
+    if (!log)
+        return;
+
+    ATOMIC_READ(log->running) = false;
+    pthread_join(log->writer, NULL);
+
+    /* I/O threads are gone by now; write whatever they left behind. */
+    drain(l, log);
+    report_dropped(l, log);
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        free(l->thread.threads[i].access_log);
+        l->thread.threads[i].access_log = NULL;
+    }
+
+    close(log->fd);
+    free(log);
+    l->access_log = NULL;
+}
+
+unsigned long long lwan_access_log_get_dropped(const struct lwan *l)
+{
+    unsigned long long dropped = 0;
+
+    if (!l->access_log)
+        return 0;
+
+    for (unsigned short i = 0; i < l->thread.count; i++)
+        dropped += ATOMIC_READ(l->thread.threads[i].access_log->producer.dropped);
+
+    return dropped;
+}
@@ -0,0 +1,37 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+/* Requests are logged by each I/O thread into a ring buffer of its own,
+ * without any locks or system calls; a background thread formats them in
+ * the Common Log Format and writes them out in batches.  If a ring is
+ * full, the record is dropped and counted, so logging never blocks. */
+
+bool lwan_access_log_init(struct lwan *l);
+void lwan_access_log_shutdown(struct lwan *l);
+
+void lwan_access_log_record(struct lwan_request *request,
+                            enum lwan_http_status status,
+                            const char *method,
+                            size_t body_len);
+
+unsigned long long lwan_access_log_get_dropped(const struct lwan *l);
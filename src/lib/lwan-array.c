@@ -51,6 +51,23 @@ int lwan_array_reset(struct lwan_array *a)
     return 0;
 }
 
+/* Gives back the memory past the current elements, keeping the capacity
+ * lwan_array_append() expects: a multiple of INCREMENT. */
+void lwan_array_shrink(struct lwan_array *a, size_t element_size)
+{
+    size_t capacity = (a->elements + INCREMENT - 1) / INCREMENT * INCREMENT;
+    void *new_base;
+
+    if (!capacity) {
+        lwan_array_reset(a);
+        return;
+    }
+
+    new_base = reallocarray(a->base, capacity, element_size);
+    if (LIKELY(new_base))
+        a->base = new_base;
+}
+
 #if !defined(HAVE_BUILTIN_ADD_OVERFLOW)
 static inline bool add_overflow(size_t a, size_t b, size_t *out)
 {
@@ -31,6 +31,7 @@ struct lwan_array {
 
 int lwan_array_init(struct lwan_array *a);
 int lwan_array_reset(struct lwan_array *a);
+void lwan_array_shrink(struct lwan_array *a, size_t element_size);
 void *lwan_array_append(struct lwan_array *a, size_t element_size);
 void lwan_array_sort(struct lwan_array *a,
                      size_t element_size,
@@ -62,6 +63,11 @@ struct lwan_array *coro_lwan_array_new(struct coro *coro);
     {                                                                          \
         return lwan_array_reset((struct lwan_array *)array);                   \
     }                                                                          \
+    __attribute__((unused)) static inline void array_type_##_shrink(           \
+        struct array_type_ *array)                                             \
+    {                                                                          \
+        lwan_array_shrink((struct lwan_array *)array, sizeof(element_type_));  \
+    }                                                                          \
     __attribute__((unused)) static inline element_type_ *array_type_##_append( \
         struct array_type_ *array)                                             \
     {                                                                          \
@@ -19,16 +19,28 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "lwan-private.h"
 
+#if defined(HAS_EVENTFD)
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+
 #include "lwan-cache.h"
 #include "hash.h"
+#include "lwan-trace.h"
 
 #define GET_AND_REF_TRIES 5
 
@@ -36,12 +48,64 @@ enum {
     /* Entry flags */
     FLOATING = 1 << 0,
     TEMPORARY = 1 << 1,
+    REFERENCED = 1 << 2,
+    EVICTED = 1 << 3,
+    INVALIDATED = 1 << 4,
 
     /* Cache flags */
-    SHUTTING_DOWN = 1 << 0
+    SHUTTING_DOWN = 1 << 0,
+    ASYNC = 1 << 1,
 };
 
-struct cache {
+/* Entries are spread among shards by key, each with its own locks, so
+ * that threads looking up different keys don't fight over a single lock
+ * (or its cache line). */
+#define CACHE_SHARDS 16
+
+/* Upper bound on how many entries of a shard are looked at, at a time,
+ * when trying to bring the cache back within its limits. */
+#define MAX_EVICTION_SCAN 64
+
+/* Each I/O thread keeps, for each cache it uses, a small direct-mapped
+ * table of references to the entries it served last, so that hot entries
+ * can be handed to requests without going through the shard (and without
+ * every core writing to their reference counts).  Slots are only touched
+ * by the thread owning them; cache_destroy() and cache_sweep_fronts() do
+ * so with fronts_lock held, which also protects the lists of tables of
+ * each thread. */
+#define FRONT_SLOTS 64
+
+struct front_ref {
+    struct cache *cache;
+    struct cache_entry *entry;
+    /* One for the slot, plus one for each request using the entry. */
+    unsigned users;
+    unsigned generation;
+    uint32_t hash;
+    char key[];
+};
+
+struct front_slot {
+    struct front_ref *ref;
+    /* Whether the entry was served from this slot since it last had to
+     * fend off another key. */
+    bool hit;
+};
+
+struct cache_front {
+    struct front_slot slots[FRONT_SLOTS];
+    unsigned long long hits;
+
+    /* NULL until the thread uses it for the first time. */
+    struct cache *cache;
+    struct lwan_thread *thread;
+    struct cache_front *next_in_thread;
+    unsigned n_refs;
+} __attribute__((aligned(64)));
+
+static pthread_mutex_t fronts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct cache_shard {
     struct {
         struct hash *table;
         pthread_rwlock_t lock;
@@ -52,6 +116,26 @@ struct cache {
         pthread_rwlock_t lock;
     } queue;
 
+    /* Keys being created by some thread right now, so that concurrent
+     * misses wait for them instead of creating their own copies.  There
+     * are at most as many of these as there are threads, so a list is
+     * fine.  Protected by the hash lock. */
+    struct list_head pending;
+
+    /* Entries taken out of the hash table by cache_invalidate_matching(),
+     * but still waiting in the queue for the pruner. */
+    int invalidated;
+
+    struct {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evicted;
+    } stats;
+} __attribute__((aligned(64)));
+
+struct cache {
+    struct cache_shard shards[CACHE_SHARDS];
+
     struct {
         cache_create_entry_cb create_entry;
         cache_destroy_entry_cb destroy_entry;
@@ -60,38 +144,153 @@ struct cache {
 
     struct {
         time_t time_to_live;
-        clockid_t clock_id;
+
+        /* 0 means unlimited. */
+        size_t max_entries;
+        size_t max_bytes;
     } settings;
 
+    /* Only changes when entries are added or evicted, so these are shared
+     * by all shards without hurting lookups. */
+    struct {
+        size_t entries;
+        size_t bytes;
+    } usage;
+
+    /* Jobs submitted to the workers and not finished yet. */
+    int async_jobs;
+
     unsigned flags;
 
-#ifndef NDEBUG
-    struct {
-        unsigned hits;
-        unsigned misses;
-        unsigned evicted;
-    } stats;
-#endif
+    /* Where to write the keys of live entries to, when destroyed. */
+    char *manifest_path;
+
+    struct list_node registry_node;
+
+    /* Bumped whenever an entry leaves the hash table of a shard, telling
+     * front tables that their references to entries in that shard might
+     * be stale.  Read by every front table hit, so it's in a cache line
+     * of its own. */
+    unsigned generation[CACHE_SHARDS] __attribute__((aligned(64)));
+
+    /* One per I/O thread, allocated when a request first uses the cache. */
+    struct cache_front *fronts;
+    unsigned n_fronts;
+};
+
+/* Every live cache, so that cache_get_total_stats() can add them up.
+ * Counters of destroyed caches are kept in `retired`, so that totals never
+ * go back. */
+static struct {
+    pthread_mutex_t lock;
+    struct list_head caches;
+    struct cache_stats retired;
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .caches = LIST_HEAD_INIT(registry.caches),
+};
+
+struct pending_entry {
+    struct list_node node;
+    const char *key;
+    struct cache_job *job;
+};
+
+/* Creates an entry in one of the workers, so that blocking in the create
+ * callback (e.g. opening, mapping or compressing files) doesn't stall the
+ * I/O thread that asked for it.  Shared by the worker and the coroutines
+ * waiting on done_fd, which is readable once the entry is published. */
+struct cache_job {
+    struct list_node queue;
+    struct pending_entry pending;
+    struct cache *cache;
+    struct cache_shard *shard;
+    char *key;
+    int done_fd[2];
+    int done;
+    int refs;
+    bool created;
+};
+
+#define CACHE_WORKERS 4
+#define JOB_WAIT_TIMEOUT_MS 1000
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head queue;
+    pthread_t threads[CACHE_WORKERS];
+    unsigned users;
+    bool shutting_down;
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .queue = LIST_HEAD_INIT(workers.queue),
 };
 
 static bool cache_pruner_job(void *data);
+static void cache_workers_put(void);
+static void release_fronts(struct cache *cache);
 
-static clockid_t detect_fastest_monotonic_clock(void)
+static ALWAYS_INLINE uint32_t key_hash(const char *key)
 {
-#ifdef CLOCK_MONOTONIC_COARSE
-    struct timespec ts;
+    /* FNV-1a; the hash table uses a different function, so keys in the
+     * same shard are still spread evenly among its buckets. */
+    uint32_t hash = 2166136261u;
 
-    if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &ts))
-        return CLOCK_MONOTONIC_COARSE;
-#endif
-    return CLOCK_MONOTONIC;
+    for (; *key; key++)
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+
+    return hash;
+}
+
+static ALWAYS_INLINE unsigned shard_index(uint32_t hash)
+{
+    return (hash >> 16) % CACHE_SHARDS;
+}
+
+static ALWAYS_INLINE struct cache_shard *shard_for_key(struct cache *cache,
+                                                       const char *key)
+{
+    return &cache->shards[shard_index(key_hash(key))];
+}
+
+/* Must be called with the hash lock of the shard held for writing. */
+static ALWAYS_INLINE void removed_from_shard(struct cache *cache,
+                                             const struct cache_shard *shard)
+{
+    ATOMIC_INC(cache->generation[shard - cache->shards]);
+}
+
+static bool shard_init(struct cache_shard *shard)
+{
+    shard->hash.table = hash_str_new(free, NULL);
+    if (!shard->hash.table)
+        return false;
+
+    if (pthread_rwlock_init(&shard->hash.lock, NULL))
+        goto error_no_hash_lock;
+    if (pthread_rwlock_init(&shard->queue.lock, NULL))
+        goto error_no_queue_lock;
+
+    list_head_init(&shard->queue.list);
+    list_head_init(&shard->pending);
+
+    return true;
+
+error_no_queue_lock:
+    pthread_rwlock_destroy(&shard->hash.lock);
+error_no_hash_lock:
+    hash_free(shard->hash.table);
+
+    return false;
 }
 
-static ALWAYS_INLINE void clock_monotonic_gettime(struct cache *cache,
-    struct timespec *ts)
+static void shard_destroy(struct cache_shard *shard)
 {
-    if (UNLIKELY(clock_gettime(cache->settings.clock_id, ts) < 0))
-        lwan_status_perror("clock_gettime");
+    pthread_rwlock_destroy(&shard->hash.lock);
+    pthread_rwlock_destroy(&shard->queue.lock);
+    hash_free(shard->hash.table);
 }
 
 struct cache *cache_create(cache_create_entry_cb create_entry_cb,
@@ -100,63 +299,202 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
                              time_t time_to_live)
 {
     struct cache *cache;
+    int shard;
 
     assert(create_entry_cb);
     assert(destroy_entry_cb);
     assert(time_to_live > 0);
 
-    cache = calloc(1, sizeof(*cache));
-    if (!cache)
+    if (posix_memalign((void **)&cache, 64, sizeof(*cache)))
         return NULL;
+    memset(cache, 0, sizeof(*cache));
 
-    cache->hash.table = hash_str_new(free, NULL);
-    if (!cache->hash.table)
-        goto error_no_hash;
-
-    if (pthread_rwlock_init(&cache->hash.lock, NULL))
-        goto error_no_hash_lock;
-    if (pthread_rwlock_init(&cache->queue.lock, NULL))
-        goto error_no_queue_lock;
+    for (shard = 0; shard < CACHE_SHARDS; shard++) {
+        if (!shard_init(&cache->shards[shard]))
+            goto error;
+    }
 
     cache->cb.create_entry = create_entry_cb;
     cache->cb.destroy_entry = destroy_entry_cb;
     cache->cb.context = cb_context;
 
-    cache->settings.clock_id = detect_fastest_monotonic_clock();
     cache->settings.time_to_live = time_to_live;
 
-    list_head_init(&cache->queue.list);
+    pthread_mutex_lock(&registry.lock);
+    list_add_tail(&registry.caches, &cache->registry_node);
+    pthread_mutex_unlock(&registry.lock);
 
     lwan_job_add(cache_pruner_job, cache);
 
     return cache;
 
-error_no_queue_lock:
-    pthread_rwlock_destroy(&cache->hash.lock);
-error_no_hash_lock:
-    hash_free(cache->hash.table);
-error_no_hash:
+error:
+    while (shard--)
+        shard_destroy(&cache->shards[shard]);
     free(cache);
 
     return NULL;
 }
 
+void cache_set_limits(struct cache *cache, size_t max_entries,
+                      size_t max_bytes)
+{
+    assert(cache);
+
+    cache->settings.max_entries = max_entries;
+    cache->settings.max_bytes = max_bytes;
+}
+
+void cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+    assert(cache);
+    assert(stats);
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        stats->hits += ATOMIC_READ(shard->stats.hits);
+        stats->misses += ATOMIC_READ(shard->stats.misses);
+        stats->evicted += ATOMIC_READ(shard->stats.evicted);
+    }
+
+    const struct cache_front *fronts = ATOMIC_READ(cache->fronts);
+    if (fronts) {
+        for (unsigned i = 0; i < cache->n_fronts; i++)
+            stats->hits += ATOMIC_READ(fronts[i].hits);
+    }
+
+    stats->entries = ATOMIC_READ(cache->usage.entries);
+    stats->bytes = ATOMIC_READ(cache->usage.bytes);
+}
+
+void cache_get_total_stats(struct cache_stats *stats)
+{
+    const struct cache *cache;
+
+    pthread_mutex_lock(&registry.lock);
+
+    *stats = registry.retired;
+    list_for_each(&registry.caches, cache, registry_node) {
+        struct cache_stats cache_stats;
+
+        cache_get_stats((struct cache *)cache, &cache_stats);
+
+        stats->hits += cache_stats.hits;
+        stats->misses += cache_stats.misses;
+        stats->evicted += cache_stats.evicted;
+        stats->entries += cache_stats.entries;
+        stats->bytes += cache_stats.bytes;
+    }
+
+    pthread_mutex_unlock(&registry.lock);
+}
+
+static size_t write_manifest_keys(struct cache *cache, FILE *manifest,
+                                  bool referenced)
+{
+    size_t written = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        struct hash_iter iter;
+        const void *value;
+
+        if (UNLIKELY(pthread_rwlock_rdlock(&shard->hash.lock)))
+            continue;
+
+        hash_iter_init(shard->hash.table, &iter);
+        while (hash_iter_next(&iter, NULL, &value)) {
+            const struct cache_entry *entry = value;
+
+            if (!!(entry->flags & REFERENCED) != referenced)
+                continue;
+            /* Keys are read back one per line. */
+            if (strchr(entry->key, '\n'))
+                continue;
+
+            fputs(entry->key, manifest);
+            fputc('\n', manifest);
+            written++;
+        }
+
+        pthread_rwlock_unlock(&shard->hash.lock);
+    }
+
+    return written;
+}
+
+static void write_manifest(struct cache *cache, const char *path)
+{
+    char tmp_path[PATH_MAX];
+    size_t written;
+    FILE *manifest;
+
+    /* Written to a temporary file first, so that a process starting up
+     * at the same time never sees a partial manifest. */
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+        (int)sizeof(tmp_path)) {
+        lwan_status_error("Cache manifest path too long: %s", path);
+        return;
+    }
+
+    manifest = fopen(tmp_path, "we");
+    if (!manifest) {
+        lwan_status_perror("Could not open %s", tmp_path);
+        return;
+    }
+
+    written = write_manifest_keys(cache, manifest, true);
+    written += write_manifest_keys(cache, manifest, false);
+
+    if (fclose(manifest) || rename(tmp_path, path) < 0) {
+        lwan_status_perror("Could not write cache manifest to %s", path);
+        unlink(tmp_path);
+        return;
+    }
+
+    lwan_status_debug("Wrote %zu keys to cache manifest %s", written, path);
+}
+
 void cache_destroy(struct cache *cache)
 {
+    struct cache_stats stats;
+
     assert(cache);
 
-#ifndef NDEBUG
-    lwan_status_debug("Cache stats: %d hits, %d misses, %d evictions",
-                      cache->stats.hits, cache->stats.misses,
-                      cache->stats.evicted);
-#endif
+    pthread_mutex_lock(&registry.lock);
+    list_del(&cache->registry_node);
+    cache_get_stats(cache, &stats);
+    registry.retired.hits += stats.hits;
+    registry.retired.misses += stats.misses;
+    registry.retired.evicted += stats.evicted;
+    pthread_mutex_unlock(&registry.lock);
+
+    lwan_status_debug("Cache stats: %llu hits, %llu misses, %llu evictions",
+                      stats.hits, stats.misses, stats.evicted);
+
+    if (cache->manifest_path) {
+        write_manifest(cache, cache->manifest_path);
+        free(cache->manifest_path);
+    }
 
     lwan_job_del(cache_pruner_job, cache);
+
+    if (cache->flags & ASYNC) {
+        /* Queued jobs still point to this cache. */
+        while (ATOMIC_READ(cache->async_jobs))
+            sched_yield();
+        cache_workers_put();
+    }
+
+    release_fronts(cache);
+
     cache->flags |= SHUTTING_DOWN;
     cache_pruner_job(cache);
-    pthread_rwlock_destroy(&cache->hash.lock);
-    pthread_rwlock_destroy(&cache->queue.lock);
-    hash_free(cache->hash.table);
+    for (int shard = 0; shard < CACHE_SHARDS; shard++)
+        shard_destroy(&cache->shards[shard]);
     free(cache);
 }
 
@@ -165,61 +503,211 @@ static ALWAYS_INLINE void convert_to_temporary(struct cache_entry *entry)
     entry->flags = TEMPORARY;
 }
 
-struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
-                                              const char *key, int *error)
+/* Must be called after an entry has been removed from both the hash table
+ * and the queue. */
+static void drop_entry(struct cache *cache, struct cache_entry *entry)
 {
-    struct cache_entry *entry;
-    char *key_copy;
+    if (ATOMIC_INC(entry->refs) == 1) {
+        cache->cb.destroy_entry(entry, cache->cb.context);
+    } else {
+        ATOMIC_BITWISE(&entry->flags, or, FLOATING);
+        /* Decrement the reference and see if we were genuinely the last one
+         * holding it.  If so, destroy the entry.  */
+        if (!ATOMIC_DEC(entry->refs))
+            cache->cb.destroy_entry(entry, cache->cb.context);
+    }
+}
 
-    assert(cache);
-    assert(error);
-    assert(key);
+static ALWAYS_INLINE bool over_limits(struct cache *cache)
+{
+    if (cache->settings.max_entries &&
+        ATOMIC_READ(cache->usage.entries) > cache->settings.max_entries)
+        return true;
 
-    *error = 0;
+    return cache->settings.max_bytes &&
+           ATOMIC_READ(cache->usage.bytes) > cache->settings.max_bytes;
+}
 
-    /* If the lock can't be obtained, return an error to allow, for instance,
-     * yielding from the coroutine and trying to obtain the lock at a later
-     * time. */
-    if (UNLIKELY(pthread_rwlock_tryrdlock(&cache->hash.lock) == EBUSY)) {
-        *error = EWOULDBLOCK;
-        return NULL;
+static ALWAYS_INLINE void account_added(struct cache *cache, size_t bytes)
+{
+    ATOMIC_INC(cache->usage.entries);
+    ATOMIC_AAF(&cache->usage.bytes, bytes);
+}
+
+static ALWAYS_INLINE void
+account_evicted(struct cache *cache, size_t entries, size_t bytes)
+{
+    ATOMIC_AAF(&cache->usage.entries, -entries);
+    ATOMIC_AAF(&cache->usage.bytes, -bytes);
+}
+
+/* Entries are evicted (and their sizes taken off the usage counters) with
+ * the hash lock held for writing; holding it for reading here ensures an
+ * entry's size isn't changed after it has been accounted for.  The key has
+ * to be passed because the entry's own copy goes away when it's evicted. */
+void cache_entry_add_size(struct cache *cache, struct cache_entry *entry,
+                          const char *key, size_t bytes)
+{
+    struct cache_shard *shard;
+
+    if (entry->flags & TEMPORARY)
+        return;
+
+    shard = shard_for_key(cache, key);
+    if (UNLIKELY(pthread_rwlock_rdlock(&shard->hash.lock)))
+        return;
+
+    if (!(ATOMIC_READ(entry->flags) & EVICTED)) {
+        ATOMIC_AAF(&entry->size, bytes);
+        ATOMIC_AAF(&cache->usage.bytes, bytes);
     }
-    /* Find the item in the hash table. If it's there, increment the reference
-     * and return it. */
-    entry = hash_find(cache->hash.table, key);
-    if (LIKELY(entry)) {
-        ATOMIC_INC(entry->refs);
-        pthread_rwlock_unlock(&cache->hash.lock);
-#ifndef NDEBUG
-        ATOMIC_INC(cache->stats.hits);
-#endif
-        return entry;
+
+    pthread_rwlock_unlock(&shard->hash.lock);
+
+    if (UNLIKELY(over_limits(cache)))
+        lwan_job_kick(cache_pruner_job, cache);
+}
+
+/* CLOCK-style second chance: entries that have been hit since they were
+ * last looked at are moved to the end of the queue instead of being
+ * evicted.  They keep their original time_to_die, so the pruner may get to
+ * them a little late; expired entries are always evicted here regardless.
+ * Both the hash and queue locks must be held; evicted entries are moved to
+ * the evicted list so that they can be dropped after these are released. */
+static void evict_cold_entries(struct cache *cache,
+                               struct cache_shard *shard,
+                               const struct cache_entry *newest,
+                               time_t now,
+                               struct list_head *evicted)
+{
+    for (int scanned = 0; scanned < MAX_EVICTION_SCAN; scanned++) {
+        struct cache_entry *node;
+
+        if (!over_limits(cache))
+            break;
+
+        node = list_top(&shard->queue.list, struct cache_entry, entries);
+        if (!node || node == newest)
+            break;
+
+        list_del(&node->entries);
+
+        if ((node->flags & (REFERENCED | INVALIDATED)) == REFERENCED &&
+            now < node->time_to_die) {
+            ATOMIC_BITWISE(&node->flags, and, ~(unsigned)REFERENCED);
+            list_add_tail(&shard->queue.list, &node->entries);
+            continue;
+        }
+
+        ATOMIC_BITWISE(&node->flags, or, EVICTED);
+        account_evicted(cache, 1, node->size);
+
+        if (node->flags & INVALIDATED) {
+            /* Already gone from the hash table, along with its key. */
+            ATOMIC_DEC(shard->invalidated);
+        } else {
+            /* Frees the key. */
+            hash_del(shard->hash.table, node->key);
+            removed_from_shard(cache, shard);
+        }
+        list_add_tail(evicted, &node->entries);
     }
+}
 
-    /* Unlock the cache so the item can be created. */
-    pthread_rwlock_unlock(&cache->hash.lock);
+static unsigned drop_evicted(struct cache *cache, struct cache_shard *shard,
+                             struct list_head *evicted)
+{
+    struct cache_entry *node, *next;
+    unsigned count = 0;
 
-#ifndef NDEBUG
-    ATOMIC_INC(cache->stats.misses);
-#endif
+    list_for_each_safe(evicted, node, next, entries) {
+        drop_entry(cache, node);
+        count++;
+    }
+
+    if (count)
+        ATOMIC_AAF(&shard->stats.evicted, count);
+
+    return count;
+}
+
+static ALWAYS_INLINE struct cache_entry *
+ref_entry(struct cache_shard *shard, struct cache_entry *entry)
+{
+    ATOMIC_INC(entry->refs);
+    /* Avoid dirtying the cache line if the bit is already set. */
+    if (!(entry->flags & REFERENCED))
+        ATOMIC_BITWISE(&entry->flags, or, REFERENCED);
+    ATOMIC_INC(shard->stats.hits);
+
+    LWAN_TRACE2(cache_hit, shard, entry->key);
+
+    return entry;
+}
+
+static struct pending_entry *find_pending(const struct cache_shard *shard,
+                                          const char *key)
+{
+    struct pending_entry *pending;
+
+    list_for_each(&shard->pending, pending, node) {
+        if (streq(pending->key, key))
+            return pending;
+    }
+
+    return NULL;
+}
+
+/* Pending entries live in the stack of whoever is creating them (or in
+ * their job), so, unlike other places, not removing one from the list
+ * isn't an option.  Returns with the hash lock held for writing. */
+static void withdraw_pending(struct cache_shard *shard,
+                             struct pending_entry *pending)
+{
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock)))
+        lwan_status_critical_perror("pthread_rwlock_wrlock");
+
+    list_del(&pending->node);
+}
+
+/* Creates the entry for key and adds it to the shard.  If pending is not
+ * NULL, it has been added to the pending list and is removed from it as
+ * soon as the entry can be found in the hash table (or isn't going to). */
+static struct cache_entry *create_and_publish(struct cache *cache,
+                                              struct cache_shard *shard,
+                                              const char *key,
+                                              struct pending_entry *pending,
+                                              int *error)
+{
+    struct cache_entry *entry;
+    struct list_head evicted;
+    char *key_copy;
+
+    ATOMIC_INC(shard->stats.misses);
+    LWAN_TRACE2(cache_miss, cache, key);
 
     key_copy = strdup(key);
     if (UNLIKELY(!key_copy)) {
         *error = ENOMEM;
-        return NULL;
+        goto withdraw;
     }
 
     entry = cache->cb.create_entry(key, cache->cb.context);
+    LWAN_TRACE3(cache_create, cache, key, entry);
     if (!entry) {
         free(key_copy);
-        return NULL;
+        goto withdraw;
     }
 
-    memset(entry, 0, sizeof(*entry));
+    memset(entry, 0, offsetof(struct cache_entry, size));
     entry->key = key_copy;
     entry->refs = 1;
 
-    if (pthread_rwlock_trywrlock(&cache->hash.lock) == EBUSY) {
+    if (pending) {
+        /* Others might be waiting for this entry, so it has to be added
+         * to the table even if that means waiting for the lock. */
+        withdraw_pending(shard, pending);
+    } else if (pthread_rwlock_trywrlock(&shard->hash.lock) == EBUSY) {
         /* Couldn't obtain hash lock: instead of waiting, just return
          * the recently-created item as a temporary item. Might result
          * in starvation, though, so this might be changed back to
@@ -229,21 +717,33 @@ struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
         return entry;
     }
 
-    if (!hash_add_unique(cache->hash.table, entry->key, entry)) {
-        struct timespec time_to_die;
-        clock_monotonic_gettime(cache, &time_to_die);
-        entry->time_to_die = time_to_die.tv_sec + cache->settings.time_to_live;
+    list_head_init(&evicted);
+
+    if (!hash_add_unique(shard->hash.table, entry->key, entry)) {
+        time_t now = lwan_clock_get()->monotonic;
+
+        entry->time_to_die = now + cache->settings.time_to_live;
+
+        if (LIKELY(!pthread_rwlock_wrlock(&shard->queue.lock))) {
+            list_add_tail(&shard->queue.list, &entry->entries);
+            account_added(cache, entry->size);
 
-        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-            list_add_tail(&cache->queue.list, &entry->entries);
-            pthread_rwlock_unlock(&cache->queue.lock);
+            evict_cold_entries(cache, shard, entry, now, &evicted);
+
+            pthread_rwlock_unlock(&shard->queue.lock);
+
+            /* Eviction on insertion only looks at a few entries from this
+             * shard; let the pruner deal with the rest now rather than
+             * later. */
+            if (UNLIKELY(over_limits(cache)))
+                lwan_job_kick(cache_pruner_job, cache);
         } else {
             convert_to_temporary(entry);
 
             /* Ensure item is removed from the hash table; otherwise,
              * another thread could potentially get another reference
              * to this entry and cause an invalid memory access. */
-            hash_del(cache->hash.table, entry->key);
+            hash_del(shard->hash.table, entry->key);
         }
     } else {
         /* Either there's another item with the same key (-EEXIST), or
@@ -255,93 +755,563 @@ struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
         convert_to_temporary(entry);
     }
 
-    pthread_rwlock_unlock(&cache->hash.lock);
+    pthread_rwlock_unlock(&shard->hash.lock);
+
+    drop_evicted(cache, shard, &evicted);
+
     return entry;
+
+withdraw:
+    if (pending) {
+        withdraw_pending(shard, pending);
+        pthread_rwlock_unlock(&shard->hash.lock);
+    }
+    return NULL;
 }
 
-void cache_entry_unref(struct cache *cache, struct cache_entry *entry)
+static void cache_job_free(struct cache_job *job)
 {
-    assert(entry);
-
-    if (entry->flags & TEMPORARY) {
-        free(entry->key);
-        goto destroy_entry;
-    }
+    close(job->done_fd[0]);
+    if (job->done_fd[1] != job->done_fd[0])
+        close(job->done_fd[1]);
+    free(job->key);
+    free(job);
+}
 
-    if (ATOMIC_DEC(entry->refs))
-        return;
+static void cache_job_unref(void *data)
+{
+    struct cache_job *job = data;
 
-    /* FLOATING entries without references won't be picked up by the pruner
-     * job, so destroy them right here. */
-    if (entry->flags & FLOATING) {
-destroy_entry:
-        /* FIXME: There's a race condition here: if the cache is destroyed
-         * while there are cache items floating around, this will dereference
-         * deallocated memory. */
-        cache->cb.destroy_entry(entry, cache->cb.context);
-    }
+    if (!ATOMIC_DEC(job->refs))
+        cache_job_free(job);
 }
 
-static bool cache_pruner_job(void *data)
+static struct cache_job *cache_job_new(struct cache *cache,
+                                       struct cache_shard *shard,
+                                       const char *key)
 {
-    struct cache *cache = data;
-    struct cache_entry *node, *next;
-    struct timespec now;
-    bool shutting_down = cache->flags & SHUTTING_DOWN;
-    unsigned evicted = 0;
-    struct list_head queue;
+    struct cache_job *job = malloc(sizeof(*job));
 
-    if (UNLIKELY(pthread_rwlock_trywrlock(&cache->queue.lock) == EBUSY))
-        return false;
+    if (UNLIKELY(!job))
+        return NULL;
 
-    /* If the queue is empty, there's nothing to do; unlock/return*/
-    if (list_empty(&cache->queue.list)) {
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
+    job->key = strdup(key);
+    if (UNLIKELY(!job->key))
+        goto error_no_key;
+
+#if defined(HAS_EVENTFD)
+    job->done_fd[0] = job->done_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (UNLIKELY(job->done_fd[0] < 0))
+        goto error_no_fd;
+#else
+    if (UNLIKELY(pipe2(job->done_fd, O_NONBLOCK | O_CLOEXEC) < 0))
+        goto error_no_fd;
+#endif
+
+    job->cache = cache;
+    job->shard = shard;
+    job->pending.key = job->key;
+    job->pending.job = job;
+    job->done = 0;
+    job->created = false;
+    /* One for the worker, one for the coroutine that submitted it. */
+    job->refs = 2;
+
+    return job;
+
+error_no_fd:
+    free(job->key);
+error_no_key:
+    free(job);
+    return NULL;
+}
+
+static void *cache_worker(void *data __attribute__((unused)))
+{
+    struct cache_job *job;
+
+    while (true) {
+        pthread_mutex_lock(&workers.lock);
+        while (!(job = list_pop(&workers.queue, struct cache_job, queue)) &&
+               !workers.shutting_down)
+            pthread_cond_wait(&workers.cond, &workers.lock);
+        pthread_mutex_unlock(&workers.lock);
+
+        if (!job)
+            return NULL;
+
+        struct cache *cache = job->cache;
+        struct cache_entry *entry;
+        int error = 0;
+
+        entry = create_and_publish(cache, job->shard, job->key, &job->pending,
+                                   &error);
+        if (entry) {
+            job->created = true;
+            cache_entry_unref(cache, entry);
+        }
+
+        /* The same buffer works for both eventfd() and pipes. */
+        const uint64_t event = 1;
+        ATOMIC_INC(job->done);
+        if (UNLIKELY(write(job->done_fd[1], &event, sizeof(event)) < 0))
+            lwan_status_perror("write");
+
+        ATOMIC_DEC(cache->async_jobs);
+        cache_job_unref(job);
+    }
+}
+
+static bool cache_workers_get(void)
+{
+    bool success = true;
+
+    pthread_mutex_lock(&workers.lock);
+
+    if (!workers.users++) {
+        workers.shutting_down = false;
+
+        for (int i = 0; i < CACHE_WORKERS; i++) {
+            if (pthread_create(&workers.threads[i], NULL, cache_worker, NULL)) {
+                lwan_status_perror("pthread_create");
+
+                workers.shutting_down = true;
+                pthread_cond_broadcast(&workers.cond);
+                pthread_mutex_unlock(&workers.lock);
+                while (i--)
+                    pthread_join(workers.threads[i], NULL);
+                pthread_mutex_lock(&workers.lock);
+
+                workers.users--;
+                success = false;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&workers.lock);
+
+    return success;
+}
+
+static void cache_workers_put(void)
+{
+    pthread_mutex_lock(&workers.lock);
+
+    if (--workers.users) {
+        pthread_mutex_unlock(&workers.lock);
+        return;
+    }
+
+    workers.shutting_down = true;
+    pthread_cond_broadcast(&workers.cond);
+    pthread_mutex_unlock(&workers.lock);
+
+    for (int i = 0; i < CACHE_WORKERS; i++)
+        pthread_join(workers.threads[i], NULL);
+}
+
+static void cache_job_submit(struct cache_job *job)
+{
+    ATOMIC_INC(job->cache->async_jobs);
+
+    pthread_mutex_lock(&workers.lock);
+    list_add_tail(&workers.queue, &job->queue);
+    pthread_cond_signal(&workers.cond);
+    pthread_mutex_unlock(&workers.lock);
+}
+
+/* Must be called with the hash lock held.  Jobs can't go away while they're
+ * pending, as workers withdraw them before dropping their reference. */
+static bool wait_for_pending(const struct cache_shard *shard, const char *key,
+                             int *error, struct cache_job **job)
+{
+    struct pending_entry *pending = find_pending(shard, key);
+
+    if (!pending)
+        return false;
+
+    if (job && pending->job) {
+        ATOMIC_INC(pending->job->refs);
+        *job = pending->job;
+    }
+
+    *error = EINPROGRESS;
+    return true;
+}
+
+/* If job is not NULL and the key is not in the cache, *job is set to the
+ * job that's going to create it, and EINPROGRESS is returned. */
+static struct cache_entry *get_and_ref_entry(struct cache *cache,
+                                             const char *key, int *error,
+                                             struct cache_job **job)
+{
+    struct pending_entry local = {.key = NULL, .job = NULL};
+    struct pending_entry *pending = NULL;
+    struct cache_job *new_job = NULL;
+    struct cache_shard *shard;
+    struct cache_entry *entry;
+
+    assert(cache);
+    assert(error);
+    assert(key);
+
+    *error = 0;
+    shard = shard_for_key(cache, key);
+
+    /* If the lock can't be obtained, return an error to allow, for instance,
+     * yielding from the coroutine and trying to obtain the lock at a later
+     * time. */
+    if (UNLIKELY(pthread_rwlock_tryrdlock(&shard->hash.lock) == EBUSY)) {
+        *error = EWOULDBLOCK;
+        return NULL;
+    }
+    /* Find the item in the hash table. If it's there, increment the reference
+     * and return it. */
+    entry = hash_find(shard->hash.table, key);
+    if (LIKELY(entry)) {
+        ref_entry(shard, entry);
+        pthread_rwlock_unlock(&shard->hash.lock);
+        return entry;
+    }
+
+    /* Check this before going for the write lock, so that coroutines
+     * waiting for an entry don't keep readers away while polling. */
+    if (wait_for_pending(shard, key, error, job)) {
+        pthread_rwlock_unlock(&shard->hash.lock);
+        return NULL;
+    }
+
+    /* Unlock the cache so the item can be created. */
+    pthread_rwlock_unlock(&shard->hash.lock);
+
+    /* Not done while holding the write lock below: allocating this might
+     * take a while, and other threads would give up on the lock. */
+    if (job && (cache->flags & ASYNC))
+        new_job = cache_job_new(cache, shard, key);
+
+    /* Let other threads know this key is being created; if someone else
+     * is already doing that, have the caller try again later, when the
+     * entry is likely to be in the table already.  If the lock is busy,
+     * don't wait for it and just create the entry regardless. */
+    if (LIKELY(!pthread_rwlock_trywrlock(&shard->hash.lock))) {
+        entry = hash_find(shard->hash.table, key);
+        if (entry) {
+            ref_entry(shard, entry);
+            pthread_rwlock_unlock(&shard->hash.lock);
+            goto free_unused_job;
+        }
+
+        if (wait_for_pending(shard, key, error, job)) {
+            pthread_rwlock_unlock(&shard->hash.lock);
+            goto free_unused_job;
+        }
+
+        if (LIKELY(new_job)) {
+            list_add_tail(&shard->pending, &new_job->pending.node);
+            pthread_rwlock_unlock(&shard->hash.lock);
+
+            cache_job_submit(new_job);
+
+            *job = new_job;
+            *error = EINPROGRESS;
+            return NULL;
+        }
+
+        local.key = key;
+        pending = &local;
+        list_add_tail(&shard->pending, &local.node);
+
+        pthread_rwlock_unlock(&shard->hash.lock);
+    }
+
+    if (new_job)
+        cache_job_free(new_job);
+
+    return create_and_publish(cache, shard, key, pending, error);
+
+free_unused_job:
+    if (new_job)
+        cache_job_free(new_job);
+    return entry;
+}
+
+struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
+                                            const char *key, int *error)
+{
+    return get_and_ref_entry(cache, key, error, NULL);
+}
+
+bool cache_set_async(struct cache *cache)
+{
+    assert(cache);
+
+    if (cache->flags & ASYNC)
+        return true;
+    if (!cache_workers_get())
+        return false;
+
+    cache->flags |= ASYNC;
+    return true;
+}
+
+bool cache_set_manifest(struct cache *cache, const char *path)
+{
+    char *copy = strdup(path);
+
+    assert(cache);
+
+    if (!copy)
+        return false;
+
+    free(cache->manifest_path);
+    cache->manifest_path = copy;
+    return true;
+}
+
+struct warm_up {
+    struct cache *cache;
+    cache_warm_entry_cb warm_entry;
+
+    char **keys;
+    size_t n_keys;
+    size_t next_key;
+
+    size_t created;
+};
+
+static void *warm_up_worker(void *data)
+{
+    struct warm_up *warm_up = data;
+    struct cache *cache = warm_up->cache;
+    size_t i;
+
+    while ((i = ATOMIC_AAF(&warm_up->next_key, 1) - 1) < warm_up->n_keys) {
+        struct cache_entry *entry;
+        int error;
+
+        for (int tries = GET_AND_REF_TRIES; tries; tries--) {
+            entry = cache_get_and_ref_entry(cache, warm_up->keys[i], &error);
+            if (entry || (error != EWOULDBLOCK && error != EINPROGRESS))
+                break;
+            sched_yield();
+        }
+        if (!entry)
+            continue;
+
+        if (warm_up->warm_entry)
+            warm_up->warm_entry(entry, warm_up->keys[i], cache->cb.context);
+
+        /* Entries that couldn't be added to the table won't help. */
+        if (!(entry->flags & TEMPORARY))
+            ATOMIC_INC(warm_up->created);
+
+        cache_entry_unref(cache, entry);
+    }
+
+    return NULL;
+}
+
+static char **read_manifest(FILE *manifest, size_t *n_keys)
+{
+    char **keys = NULL;
+    size_t n = 0, allocated = 0;
+    char *line = NULL;
+    size_t line_len = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &line_len, manifest)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (!len)
+            continue;
+
+        if (n == allocated) {
+            size_t new_allocated = allocated ? allocated * 2 : 64;
+            char **tmp = realloc(keys, new_allocated * sizeof(char *));
+
+            if (!tmp)
+                break;
+            keys = tmp;
+            allocated = new_allocated;
+        }
+
+        keys[n] = strdup(line);
+        if (!keys[n])
+            break;
+        n++;
+    }
+
+    free(line);
+
+    *n_keys = n;
+    return keys;
+}
+
+size_t cache_warm_up(struct cache *cache, const char *path,
+                     unsigned int n_threads, cache_warm_entry_cb warm_entry)
+{
+    struct warm_up warm_up = {.cache = cache, .warm_entry = warm_entry};
+    pthread_t *threads;
+    unsigned int started = 0;
+    FILE *manifest;
+
+    assert(cache);
+    assert(path);
+
+    manifest = fopen(path, "re");
+    if (!manifest) {
+        if (errno != ENOENT)
+            lwan_status_perror("Could not open cache manifest %s", path);
+        return 0;
+    }
+
+    warm_up.keys = read_manifest(manifest, &warm_up.n_keys);
+    fclose(manifest);
+
+    /* No point in creating more entries than fit in the cache; the
+     * manifest has the hottest keys first. */
+    if (cache->settings.max_entries &&
+        warm_up.n_keys > cache->settings.max_entries) {
+        for (size_t i = cache->settings.max_entries; i < warm_up.n_keys; i++)
+            free(warm_up.keys[i]);
+        warm_up.n_keys = cache->settings.max_entries;
+    }
+
+    if (!warm_up.n_keys)
+        goto free_keys;
+
+    if (!n_threads)
+        n_threads = 1;
+    if (n_threads > warm_up.n_keys)
+        n_threads = (unsigned int)warm_up.n_keys;
+
+    threads = calloc(n_threads, sizeof(*threads));
+    if (threads) {
+        for (; started < n_threads; started++) {
+            if (pthread_create(&threads[started], NULL, warm_up_worker,
+                               &warm_up))
+                break;
+        }
+    }
+
+    /* Whatever wasn't picked up by a thread is created by this one. */
+    warm_up_worker(&warm_up);
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    lwan_status_debug("Warmed up cache with %zu of %zu keys from %s",
+                      warm_up.created, warm_up.n_keys, path);
+
+free_keys:
+    for (size_t i = 0; i < warm_up.n_keys; i++)
+        free(warm_up.keys[i]);
+    free(warm_up.keys);
+
+    return warm_up.created;
+}
+
+void cache_entry_unref(struct cache *cache, struct cache_entry *entry)
+{
+    assert(entry);
+
+    if (entry->flags & TEMPORARY) {
+        free(entry->key);
+        goto destroy_entry;
+    }
+
+    if (ATOMIC_DEC(entry->refs))
+        return;
+
+    /* FLOATING entries without references won't be picked up by the pruner
+     * job, so destroy them right here. */
+    if (entry->flags & FLOATING) {
+destroy_entry:
+        /* FIXME: There's a race condition here: if the cache is destroyed
+         * while there are cache items floating around, this will dereference
+         * deallocated memory. */
+        cache->cb.destroy_entry(entry, cache->cb.context);
+    }
+}
+
+bool cache_entry_ref(struct cache_entry *entry)
+{
+    if (entry->flags & TEMPORARY)
         return false;
+
+    ATOMIC_INC(entry->refs);
+    return true;
+}
+
+static unsigned prune_shard(struct cache *cache, struct cache_shard *shard,
+                            time_t now)
+{
+    struct cache_entry *node, *next;
+    bool shutting_down = cache->flags & SHUTTING_DOWN;
+    unsigned evicted = 0;
+    size_t evicted_bytes = 0;
+    struct list_head queue;
+
+    if (UNLIKELY(pthread_rwlock_trywrlock(&shard->queue.lock) == EBUSY))
+        return 0;
+
+    /* If the queue is empty, there's nothing to do; unlock/return*/
+    if (list_empty(&shard->queue.list)) {
+        if (UNLIKELY(pthread_rwlock_unlock(&shard->queue.lock)))
+            lwan_status_perror("pthread_rwlock_unlock");
+        return 0;
     }
 
     /* There are things to do; assign cache queue to a local queue,
      * initialize cache queue to an empty queue. Then unlock */
     list_head_init(&queue);
-    list_append_list(&queue, &cache->queue.list);
-    list_head_init(&cache->queue.list);
+    list_append_list(&queue, &shard->queue.list);
+    list_head_init(&shard->queue.list);
 
-    if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock))) {
+    if (UNLIKELY(pthread_rwlock_unlock(&shard->queue.lock))) {
         lwan_status_perror("pthread_rwlock_unlock");
         goto end;
     }
 
-    clock_monotonic_gettime(cache, &now);
+    /* Entries are ordered by time_to_die, except for invalidated ones;
+     * only look past the first live entry if there are any of those. */
+    bool has_invalidated = ATOMIC_READ(shard->invalidated) > 0;
+
     list_for_each_safe(&queue, node, next, entries) {
-        char *key = node->key;
+        bool invalidated = node->flags & INVALIDATED;
 
-        if (now.tv_sec < node->time_to_die && LIKELY(!shutting_down))
+        if (!invalidated && now < node->time_to_die &&
+            LIKELY(!shutting_down)) {
+            if (has_invalidated)
+                continue;
             break;
+        }
 
         list_del(&node->entries);
 
-        if (UNLIKELY(pthread_rwlock_wrlock(&cache->hash.lock))) {
+        if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
             lwan_status_perror("pthread_rwlock_wrlock");
             continue;
         }
 
-        hash_del(cache->hash.table, key);
-
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->hash.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
-
-        if (ATOMIC_INC(node->refs) == 1) {
-            cache->cb.destroy_entry(node, cache->cb.context);
+        /* Might have been invalidated while waiting for the lock. */
+        if (ATOMIC_READ(node->flags) & INVALIDATED) {
+            ATOMIC_DEC(shard->invalidated);
         } else {
-            ATOMIC_BITWISE(&node->flags, or, FLOATING);
-            /* Decrement the reference and see if we were genuinely the last one
-             * holding it.  If so, destroy the entry.  */
-            if (!ATOMIC_DEC(node->refs))
-                cache->cb.destroy_entry(node, cache->cb.context);
+            hash_del(shard->hash.table, node->key);
+            removed_from_shard(cache, shard);
         }
+        ATOMIC_BITWISE(&node->flags, or, EVICTED);
+        evicted_bytes += node->size;
+
+        if (UNLIKELY(pthread_rwlock_unlock(&shard->hash.lock)))
+            lwan_status_perror("pthread_rwlock_unlock");
 
         evicted++;
+
+        drop_entry(cache, node);
     }
 
     /* If local queue has been entirely processed, there's no need to
@@ -352,25 +1322,455 @@ static bool cache_pruner_job(void *data)
 
     /* Prepend local, unprocessed queue, to the cache queue. Since the cache
      * item TTL is constant, items created later will be destroyed later. */
-    if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-        list_prepend_list(&cache->queue.list, &queue);
-        pthread_rwlock_unlock(&cache->queue.lock);
+    if (LIKELY(!pthread_rwlock_wrlock(&shard->queue.lock))) {
+        list_prepend_list(&shard->queue.list, &queue);
+        pthread_rwlock_unlock(&shard->queue.lock);
     } else {
         lwan_status_perror("pthread_rwlock_wrlock");
     }
 
 end:
-#ifndef NDEBUG
-    ATOMIC_AAF(&cache->stats.evicted, evicted);
-#endif
+    if (evicted) {
+        account_evicted(cache, evicted, evicted_bytes);
+        ATOMIC_AAF(&shard->stats.evicted, evicted);
+    }
+    return evicted;
+}
+
+/* Insertions only evict from their own shard, which might not have
+ * anything cold enough to give up; go through all of them here. */
+static unsigned enforce_limits(struct cache *cache, time_t now)
+{
+    unsigned evicted = 0;
+
+    for (int i = 0; i < CACHE_SHARDS && over_limits(cache); i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        struct list_head list;
+
+        if (UNLIKELY(pthread_rwlock_trywrlock(&shard->hash.lock) == EBUSY))
+            continue;
+        if (UNLIKELY(pthread_rwlock_trywrlock(&shard->queue.lock) == EBUSY)) {
+            pthread_rwlock_unlock(&shard->hash.lock);
+            continue;
+        }
+
+        list_head_init(&list);
+        evict_cold_entries(cache, shard, NULL, now, &list);
+
+        pthread_rwlock_unlock(&shard->queue.lock);
+        pthread_rwlock_unlock(&shard->hash.lock);
+
+        evicted += drop_evicted(cache, shard, &list);
+    }
+
+    return evicted;
+}
+
+/* Lookups won't find the entry anymore; it stays in the queue (and keeps
+ * being accounted for) until the pruner gets to it.  Must be called with
+ * the hash lock held for writing. */
+static void invalidate_locked(struct cache *cache,
+                              struct cache_shard *shard,
+                              struct cache_entry *entry)
+{
+    ATOMIC_BITWISE(&entry->flags, or, INVALIDATED);
+    entry->time_to_die = 0;
+    /* Frees the key. */
+    hash_del(shard->hash.table, entry->key);
+    removed_from_shard(cache, shard);
+    entry->key = NULL;
+    ATOMIC_INC(shard->invalidated);
+}
+
+bool cache_invalidate_entry(struct cache *cache, const char *key,
+                            struct cache_entry *entry)
+{
+    struct cache_shard *shard;
+    bool invalidated = false;
+
+    assert(cache);
+    assert(key);
+
+    shard = shard_for_key(cache, key);
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        return false;
+    }
+
+    /* The entry might have been replaced or invalidated already, in which
+     * case entry->key can't be used anymore. */
+    if (hash_find(shard->hash.table, key) == entry) {
+        invalidate_locked(cache, shard, entry);
+        invalidated = true;
+    }
+
+    pthread_rwlock_unlock(&shard->hash.lock);
+
+    if (invalidated)
+        lwan_job_kick(cache_pruner_job, cache);
+
+    return invalidated;
+}
+
+unsigned cache_invalidate_matching(struct cache *cache,
+                                   cache_match_entry_cb match, void *data)
+{
+    unsigned invalidated = 0;
+
+    assert(cache);
+    assert(match);
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        struct cache_entry **matched;
+        struct hash_iter iter;
+        const void *value;
+        unsigned n_matched = 0;
+
+        if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
+            lwan_status_perror("pthread_rwlock_wrlock");
+            continue;
+        }
+
+        /* Entries can't be removed while iterating over the table. */
+        matched = malloc(hash_get_count(shard->hash.table) * sizeof(*matched));
+        if (UNLIKELY(!matched)) {
+            pthread_rwlock_unlock(&shard->hash.lock);
+            continue;
+        }
+
+        hash_iter_init(shard->hash.table, &iter);
+        while (hash_iter_next(&iter, NULL, &value)) {
+            struct cache_entry *entry = (struct cache_entry *)value;
+
+            if (match(entry, data))
+                matched[n_matched++] = entry;
+        }
+
+        for (unsigned j = 0; j < n_matched; j++)
+            invalidate_locked(cache, shard, matched[j]);
+
+        pthread_rwlock_unlock(&shard->hash.lock);
+
+        free(matched);
+        invalidated += n_matched;
+    }
+
+    if (invalidated)
+        lwan_job_kick(cache_pruner_job, cache);
+
+    return invalidated;
+}
+
+static bool cache_pruner_job(void *data)
+{
+    struct cache *cache = data;
+    unsigned evicted = 0;
+    time_t now;
+
+    /* I/O threads don't tick the clock while idle. */
+    lwan_clock_tick();
+    now = lwan_clock_get()->monotonic;
+
+    for (int shard = 0; shard < CACHE_SHARDS; shard++)
+        evicted += prune_shard(cache, &cache->shards[shard], now);
+
+    if (UNLIKELY(over_limits(cache)))
+        evicted += enforce_limits(cache, now);
+
     return evicted;
 }
 
+static bool wait_for_job(struct lwan_request *request, struct cache_job *job)
+{
+    struct coro *coro = request->conn->coro;
+    size_t generation = coro_deferred_get_generation(coro);
+    bool created;
+
+    /* Drops the reference even if the coroutine is killed while waiting. */
+    coro_defer(coro, cache_job_unref, job);
+
+    while (!ATOMIC_READ(job->done)) {
+        /* Waiting on the same job from the same thread twice won't work
+         * with epoll; fall back to polling in that case. */
+        if (!lwan_request_await_read(request, job->done_fd[0],
+                                     JOB_WAIT_TIMEOUT_MS))
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+    }
+
+    created = job->created;
+    coro_deferred_run(coro, generation);
+
+    return created;
+}
+
+static void front_ref_put(void *data)
+{
+    struct front_ref *ref = data;
+
+    if (--ref->users)
+        return;
+
+    cache_entry_unref(ref->cache, ref->entry);
+    free(ref);
+}
+
+static void release_fronts(struct cache *cache)
+{
+    if (!cache->fronts)
+        return;
+
+    pthread_mutex_lock(&fronts_lock);
+
+    for (unsigned i = 0; i < cache->n_fronts; i++) {
+        struct cache_front *front = &cache->fronts[i];
+
+        if (!front->cache)
+            continue;
+
+        for (int slot = 0; slot < FRONT_SLOTS; slot++) {
+            struct front_ref *ref = front->slots[slot].ref;
+
+            if (ref)
+                front_ref_put(ref);
+        }
+
+        for (struct cache_front **link = &front->thread->cache_fronts;;
+             link = &(*link)->next_in_thread) {
+            if (*link == front) {
+                *link = front->next_in_thread;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&fronts_lock);
+
+    free(cache->fronts);
+    cache->fronts = NULL;
+}
+
+bool cache_sweep_fronts(struct lwan_thread *t)
+{
+    struct cache_front *front;
+    bool holds_refs = false;
+
+    pthread_mutex_lock(&fronts_lock);
+
+    for (front = t->cache_fronts; front; front = front->next_in_thread) {
+        const struct cache *cache = front->cache;
+
+        for (int i = 0; front->n_refs && i < FRONT_SLOTS; i++) {
+            struct front_slot *slot = &front->slots[i];
+            struct front_ref *ref = slot->ref;
+
+            if (!ref || ref->generation == ATOMIC_READ(
+                            cache->generation[shard_index(ref->hash)]))
+                continue;
+
+            slot->ref = NULL;
+            front->n_refs--;
+            front_ref_put(ref);
+        }
+
+        holds_refs |= front->n_refs > 0;
+    }
+
+    pthread_mutex_unlock(&fronts_lock);
+
+    return holds_refs;
+}
+
+static struct cache_front *front_for_thread(struct cache *cache,
+                                            struct lwan_thread *t)
+{
+    struct cache_front *fronts = ATOMIC_READ(cache->fronts);
+    struct cache_front *front;
+
+    if (UNLIKELY(!fronts)) {
+        const unsigned n_fronts = t->lwan->thread.count;
+
+        if (posix_memalign((void **)&fronts, 64, n_fronts * sizeof(*fronts)))
+            return NULL;
+        memset(fronts, 0, n_fronts * sizeof(*fronts));
+
+        /* Threads racing here would all store the same value. */
+        cache->n_fronts = n_fronts;
+        if (!__sync_bool_compare_and_swap(&cache->fronts, NULL, fronts)) {
+            free(fronts);
+            fronts = cache->fronts;
+        }
+    }
+
+    front = &fronts[t - t->lwan->thread.threads];
+    if (UNLIKELY(!front->cache)) {
+        pthread_mutex_lock(&fronts_lock);
+        front->cache = cache;
+        front->thread = t;
+        front->next_in_thread = t->cache_fronts;
+        t->cache_fronts = front;
+        pthread_mutex_unlock(&fronts_lock);
+    }
+
+    return front;
+}
+
+static struct cache_entry *front_get(struct cache *cache,
+                                     struct cache_front *front,
+                                     struct coro *coro,
+                                     const char *key,
+                                     uint32_t hash)
+{
+    struct front_slot *slot = &front->slots[hash % FRONT_SLOTS];
+    struct front_ref *ref = slot->ref;
+    struct cache_entry *entry;
+
+    if (!ref || ref->hash != hash)
+        return NULL;
+
+    if (ref->generation != ATOMIC_READ(cache->generation[shard_index(hash)])) {
+        /* Might be gone from the hash table; go through the shard and let
+         * the slot be filled again. */
+        slot->ref = NULL;
+        front->n_refs--;
+        front_ref_put(ref);
+        return NULL;
+    }
+
+    if (!streq(ref->key, key))
+        return NULL;
+
+    entry = ref->entry;
+    /* Avoid dirtying the cache line if the bit is already set. */
+    if (!(ATOMIC_READ(entry->flags) & REFERENCED))
+        ATOMIC_BITWISE(&entry->flags, or, REFERENCED);
+
+    ref->users++;
+    slot->hit = true;
+    front->hits++;
+    coro_defer(coro, front_ref_put, ref);
+
+    LWAN_TRACE2(cache_hit, &cache->shards[shard_index(hash)], key);
+
+    return entry;
+}
+
+/* The generation has to be read before looking up the entry in the shard,
+ * so that the slot isn't considered fresh if it's evicted in between. */
+static void front_put(struct cache_front *front,
+                      struct lwan_thread *t,
+                      struct cache *cache,
+                      const char *key,
+                      uint32_t hash,
+                      unsigned generation,
+                      struct cache_entry *entry)
+{
+    struct front_slot *slot = &front->slots[hash % FRONT_SLOTS];
+    struct front_ref *ref;
+    size_t key_len;
+
+    if (ATOMIC_READ(entry->flags) & (TEMPORARY | FLOATING))
+        return;
+
+    if (slot->ref) {
+        /* Second chance, as with the queue: keys that keep hitting the
+         * same slot don't evict each other on every request. */
+        if (slot->hit) {
+            slot->hit = false;
+            return;
+        }
+
+        front_ref_put(slot->ref);
+        slot->ref = NULL;
+        front->n_refs--;
+    }
+
+    key_len = strlen(key);
+    ref = malloc(sizeof(*ref) + key_len + 1);
+    if (UNLIKELY(!ref))
+        return;
+
+    /* The request holds a reference already, so this can't be the first. */
+    ATOMIC_INC(entry->refs);
+
+    ref->cache = cache;
+    ref->entry = entry;
+    ref->users = 1;
+    ref->generation = generation;
+    ref->hash = hash;
+    memcpy(ref->key, key, key_len + 1);
+
+    slot->ref = ref;
+    slot->hit = false;
+    front->n_refs++;
+
+    t->holds_cache_refs = true;
+}
+
+struct cache_entry *cache_request_get_and_ref_entry(struct cache *cache,
+                                                    struct lwan_request *request,
+                                                    const char *key)
+{
+    struct coro *coro = request->conn->coro;
+    struct cache_front *front = NULL;
+    unsigned generation = 0;
+    bool waited = false;
+    uint32_t hash = 0;
+
+    if (LIKELY(request->conn->thread)) {
+        struct cache_entry *ce;
+
+        hash = key_hash(key);
+        front = front_for_thread(cache, request->conn->thread);
+        if (LIKELY(front)) {
+            ce = front_get(cache, front, coro, key, hash);
+            if (LIKELY(ce))
+                return ce;
+
+            generation = ATOMIC_READ(cache->generation[shard_index(hash)]);
+        }
+    }
+
+    for (int tries = GET_AND_REF_TRIES; tries;) {
+        struct cache_job *job = NULL;
+        int error;
+        struct cache_entry *ce =
+            get_and_ref_entry(cache, key, &error, waited ? NULL : &job);
+
+        if (LIKELY(ce)) {
+            coro_defer2(coro, CORO_DEFER2(cache_entry_unref), cache, ce);
+            if (front)
+                front_put(front, request->conn->thread, cache, key, hash,
+                          generation, ce);
+            return ce;
+        }
+
+        if (job) {
+            /* If the job couldn't create the entry, trying again won't
+             * help.  Otherwise, it's most likely in the table by now, but
+             * don't queue another job if it's not. */
+            if (!wait_for_job(request, job))
+                break;
+            waited = true;
+        } else if (error == EWOULDBLOCK) {
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+            tries--;
+        } else if (error == EINPROGRESS) {
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+        } else {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
 struct cache_entry*
 cache_coro_get_and_ref_entry(struct cache *cache, struct coro *coro,
                              const char *key)
 {
-    for (int tries = GET_AND_REF_TRIES; tries; tries--) {
+    for (int tries = GET_AND_REF_TRIES; tries;) {
         int error;
         struct cache_entry *ce = cache_get_and_ref_entry(cache, key, &error);
 
@@ -386,10 +1786,16 @@ cache_coro_get_and_ref_entry(struct cache *cache, struct coro *coro,
 
         /*
          * If the cache would block while reading its hash table, yield and
-         * try again. On any other error, just return NULL.
+         * try again.  Same if another coroutine is creating this entry, but
+         * as this won't take long (and would otherwise be done by this
+         * coroutine anyway), don't give up in that case.  On any other
+         * error, just return NULL.
          */
         if (error == EWOULDBLOCK) {
             coro_yield(coro, CONN_CORO_MAY_RESUME);
+            tries--;
+        } else if (error == EINPROGRESS) {
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
         } else {
             break;
         }
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <time.h>
 
 #include "list.h"
@@ -30,14 +31,32 @@ struct cache_entry {
   int refs;
   unsigned flags;
   time_t time_to_die;
+
+  /* Approximate memory used by the entry, in bytes.  Must be set by
+   * the create callback; use cache_entry_add_size() afterwards. */
+  size_t size;
+};
+
+struct cache_stats {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evicted;
+  size_t entries;
+  size_t bytes;
 };
 
 typedef struct cache_entry *(*cache_create_entry_cb)(
       const char *key, void *context);
 typedef void (*cache_destroy_entry_cb)(
       struct cache_entry *entry, void *context);
+typedef bool (*cache_match_entry_cb)(
+      const struct cache_entry *entry, void *data);
+typedef void (*cache_warm_entry_cb)(
+      struct cache_entry *entry, const char *key, void *context);
 
 struct cache;
+struct lwan_request;
+struct lwan_thread;
 
 struct cache *cache_create(cache_create_entry_cb create_entry_cb,
       cache_destroy_entry_cb destroy_entry_cb,
@@ -45,8 +64,45 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
       time_t time_to_live);
 void cache_destroy(struct cache *cache);
 
+void cache_set_limits(struct cache *cache, size_t max_entries,
+      size_t max_bytes);
+void cache_get_stats(struct cache *cache, struct cache_stats *stats);
+/* Sum of the statistics of every cache that has ever existed; entries and
+ * bytes only count the ones still alive. */
+void cache_get_total_stats(struct cache_stats *stats);
+bool cache_set_async(struct cache *cache);
+
+/* Keys of the entries still in the cache when it's destroyed are written
+ * to this file, one per line, recently used ones first. */
+bool cache_set_manifest(struct cache *cache, const char *path);
+/* Creates the entries for the keys listed in a manifest, with up to
+ * n_threads threads, and returns how many were created.  If warm_entry
+ * isn't NULL, it's called (with the cache context) for each of them. */
+size_t cache_warm_up(struct cache *cache, const char *path,
+      unsigned int n_threads, cache_warm_entry_cb warm_entry);
+
 struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
       const char *key, int *error);
 void cache_entry_unref(struct cache *cache, struct cache_entry *entry);
+/* Takes another reference to an entry the caller holds one to, e.g. to
+ * keep it around after the request is done; fails for entries that were
+ * created for a single request. */
+bool cache_entry_ref(struct cache_entry *entry);
+void cache_entry_add_size(struct cache *cache, struct cache_entry *entry,
+      const char *key, size_t bytes);
+unsigned cache_invalidate_matching(struct cache *cache,
+      cache_match_entry_cb match, void *data);
+/* Invalidates the entry for key if it's still the given one (e.g. to
+ * replace it with a newer version); returns false otherwise. */
+bool cache_invalidate_entry(struct cache *cache, const char *key,
+      struct cache_entry *entry);
 struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
       struct coro *coro, const char *key);
+struct cache_entry *cache_request_get_and_ref_entry(struct cache *cache,
+      struct lwan_request *request, const char *key);
+
+/* Entries handed to requests by cache_request_get_and_ref_entry() are kept
+ * referenced by their I/O threads, so that hot ones can be handed again
+ * without touching the shared cache.  Drops those references to entries
+ * that have been evicted since; returns whether any are still held. */
+bool cache_sweep_fronts(struct lwan_thread *t);
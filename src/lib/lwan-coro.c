@@ -24,11 +24,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "lwan-private.h"
 
 #include "lwan-array.h"
 #include "lwan-coro.h"
+#include "lwan-trace.h"
 
 #ifdef USE_VALGRIND
 #include <valgrind/valgrind.h>
@@ -40,9 +43,22 @@
 #endif
 #define CORO_STACK_MIN ((3 * (PTHREAD_STACK_MIN)) / 2)
 
-static_assert(DEFAULT_BUFFER_SIZE < (CORO_STACK_MIN + PTHREAD_STACK_MIN),
+static_assert(REQUEST_BUFFER_SIZE < (CORO_STACK_MIN + PTHREAD_STACK_MIN),
     "Request buffer fits inside coroutine stack");
 
+/* See coro_stack_stats_enable(). */
+#define CORO_STACK_PATTERN 0xdecafbadu
+
+#if defined(__SANITIZE_ADDRESS__)
+#  define HAVE_ASAN
+#elif defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+#    define HAVE_ASAN
+#  endif
+#endif
+
+static bool stack_stats;
+
 typedef void (*defer_func)();
 
 struct coro_defer {
@@ -53,6 +69,29 @@ struct coro_defer {
 
 DEFINE_ARRAY_TYPE(coro_defer_array, struct coro_defer)
 
+#define CORO_ARENA_BLOCK_SIZE 4096
+#define CORO_ARENA_MAX_ALLOC (CORO_ARENA_BLOCK_SIZE / 4)
+
+struct coro_arena_block {
+    struct coro_arena_block *prev;
+    char *end;
+    char data[] __attribute__((aligned(16)));
+};
+
+/* Small allocations made with coro_malloc() are carved out of blocks
+ * owned by the coroutine.  Rather than deferring a free() for each one of
+ * them, a single deferred call rewinds the arena to where it was before the
+ * first allocation made since the latest generation was taken. */
+struct coro_arena {
+    struct coro_arena_block *block;
+    char *top;
+
+    /* Index, in the defer array, of the latest rewind entry; and the
+     * latest generation handed out by coro_deferred_get_generation(). */
+    size_t marker;
+    size_t generation;
+};
+
 struct coro {
     struct coro_switcher *switcher;
     coro_context context;
@@ -65,6 +104,18 @@ struct coro {
 #endif
 
     bool ended;
+
+    /* Not before ended: coro_entry_point() hardcodes the offsets above. */
+    struct coro_arena arena;
+
+    const void *tag;
+
+    /* See coro_set_trim_callback(). */
+    void (*trim_func)(void *data);
+    void *trim_data;
+
+    /* Set by coro_stack_high_water(). */
+    bool stack_repaint;
 };
 
 #if defined(__APPLE__)
@@ -174,6 +225,90 @@ coro_entry_point(struct coro *coro, coro_function_t func, void *data);
     "jmp   " ASM_SYMBOL(coro_swapcontext) "\n\t");
 #endif
 
+#if defined(USE_MMAP_CORO_STACKS)
+/*
+ * Each coroutine is a private mapping laid out as:
+ *
+ *   [guard page (PROT_NONE)][stack, growing down...][struct coro]
+ *
+ * Pages are only backed by memory once touched, so idle coroutines cost
+ * only the stack they actually used, and overflowing the stack faults on
+ * the guard page instead of silently corrupting the heap.
+ */
+struct coro_mapping {
+    size_t page_size;
+    size_t size;
+    size_t coro_offset;
+};
+
+static const struct coro_mapping *coro_mapping(void)
+{
+    static struct coro_mapping mapping;
+
+    if (UNLIKELY(!mapping.size)) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        size_t size;
+
+        if (page_size <= 0)
+            page_size = 4096;
+
+        size = (size_t)page_size + CORO_STACK_MIN + sizeof(struct coro) + 64;
+        size = (size + (size_t)page_size - 1) & ~((size_t)page_size - 1);
+
+        mapping.page_size = (size_t)page_size;
+        mapping.coro_offset = (size - sizeof(struct coro)) & ~(size_t)63;
+        mapping.size = size;
+    }
+
+    return &mapping;
+}
+
+static ALWAYS_INLINE unsigned char *coro_stack(struct coro *coro)
+{
+    return (unsigned char *)coro - CORO_STACK_MIN;
+}
+
+static struct coro *coro_alloc(void)
+{
+    const struct coro_mapping *mapping = coro_mapping();
+    unsigned char *base;
+
+    base = mmap(NULL, mapping->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (UNLIKELY(base == MAP_FAILED))
+        return NULL;
+
+    if (UNLIKELY(mprotect(base, mapping->page_size, PROT_NONE) < 0)) {
+        munmap(base, mapping->size);
+        return NULL;
+    }
+
+    return (struct coro *)(base + mapping->coro_offset);
+}
+
+static void coro_dealloc(struct coro *coro)
+{
+    const struct coro_mapping *mapping = coro_mapping();
+
+    munmap((unsigned char *)coro - mapping->coro_offset, mapping->size);
+}
+#else
+static ALWAYS_INLINE unsigned char *coro_stack(struct coro *coro)
+{
+    return (unsigned char *)(coro + 1);
+}
+
+static ALWAYS_INLINE struct coro *coro_alloc(void)
+{
+    return malloc(sizeof(struct coro) + CORO_STACK_MIN);
+}
+
+static ALWAYS_INLINE void coro_dealloc(struct coro *coro)
+{
+    free(coro);
+}
+#endif
+
 void
 coro_deferred_run(struct coro *coro, size_t generation)
 {
@@ -190,22 +325,143 @@ coro_deferred_run(struct coro *coro, size_t generation)
 }
 
 size_t
-coro_deferred_get_generation(const struct coro *coro)
+coro_deferred_get_generation(struct coro *coro)
 {
     const struct lwan_array *array = (struct lwan_array *)&coro->defer;
 
+    /* Allocations made from now on must not be covered by a rewind entry
+     * that belongs to an older generation. */
+    coro->arena.generation = array->elements;
+
     return array->elements;
 }
 
+static void coro_arena_rewind(struct coro *coro, char *top)
+{
+    struct coro_arena *arena = &coro->arena;
+    struct coro_arena_block *block = arena->block;
+
+    if (UNLIKELY(!block))
+        return;
+
+    /* Blocks allocated after top was taken are freed, but the first one is
+     * kept around, as it's very likely to be needed again by the next
+     * request handled by this coroutine. */
+    while (block->prev && !(top >= block->data && top <= block->end)) {
+        struct coro_arena_block *prev = block->prev;
+
+        free(block);
+        block = prev;
+    }
+
+    arena->block = block;
+    arena->top = top ? top : block->data;
+}
+
+static void coro_arena_free(struct coro *coro)
+{
+    struct coro_arena_block *block = coro->arena.block;
+
+    while (block) {
+        struct coro_arena_block *prev = block->prev;
+
+        free(block);
+        block = prev;
+    }
+
+    coro->arena = (struct coro_arena){};
+}
+
+static bool coro_arena_has_marker(const struct coro *coro)
+{
+    const struct lwan_array *array = (const struct lwan_array *)&coro->defer;
+    const struct coro_defer *defers = array->base;
+    size_t marker = coro->arena.marker;
+
+    if (marker >= array->elements || marker < coro->arena.generation)
+        return false;
+
+    return defers[marker].func == (defer_func)coro_arena_rewind;
+}
+
+static void *coro_arena_alloc(struct coro *coro, size_t size)
+{
+    struct coro_arena *arena = &coro->arena;
+    void *ptr;
+
+    size = (size + 15) & ~(size_t)15;
+
+    if (!coro_arena_has_marker(coro)) {
+        struct coro_defer *defer = coro_defer_array_append(&coro->defer);
+
+        if (UNLIKELY(!defer))
+            return NULL;
+
+        defer->func = (defer_func)coro_arena_rewind;
+        defer->data1 = coro;
+        defer->data2 = arena->top;
+        arena->marker = coro->defer.base.elements - 1;
+    }
+
+    if (UNLIKELY(!arena->block || size > (size_t)(arena->block->end - arena->top))) {
+        struct coro_arena_block *block = malloc(CORO_ARENA_BLOCK_SIZE);
+
+        if (UNLIKELY(!block))
+            return NULL;
+
+        block->prev = arena->block;
+        block->end = (char *)block + CORO_ARENA_BLOCK_SIZE;
+        arena->block = block;
+        arena->top = block->data;
+    }
+
+    ptr = arena->top;
+    arena->top += size;
+    return ptr;
+}
+
+static void coro_stack_paint(struct coro *coro, uintptr_t end)
+{
+    uint32_t *p = (uint32_t *)coro_stack(coro);
+
+    while ((uintptr_t)(p + 1) <= end)
+        *p++ = CORO_STACK_PATTERN;
+
+    coro->stack_repaint = false;
+}
+
+/* Called right after the coroutine yields: the saved stack pointer tells
+ * what's still in use. */
+static ALWAYS_INLINE void coro_stack_repaint(struct coro *coro)
+{
+#if defined(__x86_64__)
+    coro_stack_paint(coro, coro->context[9 /* RSP */] - 128);
+#elif defined(__i386__)
+    coro_stack_paint(coro, coro->context[6 /* ESP */]);
+#else
+    /* Not worth digging the stack pointer out of the ucontext: the
+     * high-water mark is then the one since coro_reset(). */
+    coro->stack_repaint = false;
+#endif
+}
+
 void
 coro_reset(struct coro *coro, coro_function_t func, void *data)
 {
-    unsigned char *stack = (unsigned char *)(coro + 1);
+    unsigned char *stack = coro_stack(coro);
 
     coro->ended = false;
+    coro->tag = NULL;
+    coro->trim_func = NULL;
 
     coro_deferred_run(coro, 0);
     coro_defer_array_reset(&coro->defer);
+    coro->arena.generation = 0;
+
+    if (UNLIKELY(stack_stats))
+        coro_stack_paint(coro, (uintptr_t)(stack + CORO_STACK_MIN));
+    else
+        coro->stack_repaint = false;
 
 #if defined(__x86_64__)
     /* coro_entry_point() for x86-64 has 3 arguments, but RDX isn't
@@ -254,20 +510,22 @@ coro_reset(struct coro *coro, coro_function_t func, void *data)
 ALWAYS_INLINE struct coro *
 coro_new(struct coro_switcher *switcher, coro_function_t function, void *data)
 {
-    struct coro *coro = malloc(sizeof(*coro) + CORO_STACK_MIN);
+    struct coro *coro = coro_alloc();
     if (UNLIKELY(!coro))
         return NULL;
 
     if (UNLIKELY(coro_defer_array_init(&coro->defer) < 0)) {
-        free(coro);
+        coro_dealloc(coro);
         return NULL;
     }
 
+    coro->arena = (struct coro_arena){};
+
     coro->switcher = switcher;
     coro_reset(coro, function, data);
 
 #if !defined(NDEBUG) && defined(USE_VALGRIND)
-    char *stack = (char *)(coro + 1);
+    char *stack = (char *)coro_stack(coro);
     coro->vg_stack_id = VALGRIND_STACK_REGISTER(stack, stack + CORO_STACK_MIN);
 #endif
 
@@ -280,11 +538,16 @@ coro_resume(struct coro *coro)
     assert(coro);
     assert(coro->ended == false);
 
+    LWAN_TRACE1(coro_resume, coro);
+
 #if defined(__x86_64__) || defined(__i386__)
     coro_swapcontext(&coro->switcher->caller, &coro->context);
-    if (!coro->ended)
+    if (!coro->ended) {
         memcpy(&coro->context, &coro->switcher->callee,
                     sizeof(coro->context));
+        if (UNLIKELY(coro->stack_repaint))
+            coro_stack_repaint(coro);
+    }
 #else
     coro_context prev_caller;
 
@@ -295,6 +558,8 @@ coro_resume(struct coro *coro)
                     sizeof(coro->context));
         memcpy(&coro->switcher->caller, &prev_caller,
                     sizeof(coro->switcher->caller));
+        if (UNLIKELY(coro->stack_repaint))
+            coro_stack_repaint(coro);
     }
 #endif
 
@@ -311,10 +576,126 @@ coro_resume_value(struct coro *coro, int value)
     return coro_resume(coro);
 }
 
+void
+coro_set_tag(struct coro *coro, const void *tag)
+{
+    coro->tag = tag;
+}
+
+const void *
+coro_get_tag(const struct coro *coro)
+{
+    return coro->tag;
+}
+
+void
+coro_set_trim_callback(struct coro *coro,
+                       void (*func)(void *data),
+                       void *data)
+{
+    coro->trim_func = func;
+    coro->trim_data = data;
+}
+
+/* Stacks grow down, so pages below in_use aren't needed; they're given
+ * back, and zero-filled if touched again.  This is fine for stacks from
+ * malloc() as well, as only whole pages inside of them are dropped. */
+static void coro_trim_stack(struct coro *coro, uintptr_t in_use)
+{
+    static uintptr_t page_mask;
+    uintptr_t start, end;
+
+    /* Pages given back would read as zeroes, i.e. as having been used. */
+    if (UNLIKELY(stack_stats))
+        return;
+
+    if (UNLIKELY(!page_mask)) {
+        long page_size = sysconf(_SC_PAGESIZE);
+
+        page_mask = (uintptr_t)(page_size > 0 ? page_size : 4096) - 1;
+    }
+
+    start = ((uintptr_t)coro_stack(coro) + page_mask) & ~page_mask;
+    end = in_use & ~page_mask;
+    if (end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+void
+coro_trim(struct coro *coro)
+{
+    assert(!coro->ended);
+
+    if (coro->trim_func)
+        coro->trim_func(coro->trim_data);
+
+    coro_defer_array_shrink(&coro->defer);
+
+#if defined(__x86_64__)
+    /* Leave the red zone alone. */
+    coro_trim_stack(coro, coro->context[9 /* RSP */] - 128);
+#elif defined(__i386__)
+    coro_trim_stack(coro, coro->context[6 /* ESP */]);
+#endif
+}
+
+void
+coro_trim_unused(struct coro *coro)
+{
+    coro_deferred_run(coro, 0);
+    coro_defer_array_reset(&coro->defer);
+    coro_arena_free(coro);
+
+    coro_trim_stack(coro, (uintptr_t)(coro_stack(coro) + CORO_STACK_MIN));
+}
+
+bool
+coro_stack_stats_supported(void)
+{
+#if defined(HAVE_ASAN)
+    /* The pattern would be written over the redzones ASan keeps poisoned
+     * in stacks reused from the pool, and instrumented frames are larger
+     * than the real ones anyway. */
+    return false;
+#else
+    return true;
+#endif
+}
+
+void
+coro_stack_stats_enable(void)
+{
+    if (coro_stack_stats_supported())
+        stack_stats = true;
+}
+
+size_t
+coro_stack_high_water(struct coro *coro)
+{
+    const uint32_t *p = (const uint32_t *)coro_stack(coro);
+    const uint32_t *end = (const uint32_t *)(coro_stack(coro) + CORO_STACK_MIN);
+
+    if (!stack_stats)
+        return 0;
+
+    while (p < end && *p == CORO_STACK_PATTERN)
+        p++;
+
+    coro->stack_repaint = true;
+    return (size_t)((const unsigned char *)end - (const unsigned char *)p);
+}
+
+size_t
+coro_stack_size(void)
+{
+    return CORO_STACK_MIN;
+}
+
 ALWAYS_INLINE int
 coro_yield(struct coro *coro, int value)
 {
     assert(coro);
+    LWAN_TRACE2(coro_yield, coro, value);
     coro->yield_value = value;
     coro_swapcontext(&coro->switcher->callee, &coro->switcher->caller);
     return coro->yield_value;
@@ -329,7 +710,8 @@ coro_free(struct coro *coro)
 #endif
     coro_deferred_run(coro, 0);
     coro_defer_array_reset(&coro->defer);
-    free(coro);
+    coro_arena_free(coro);
+    coro_dealloc(coro);
 }
 
 static void
@@ -377,6 +759,9 @@ coro_malloc_full(struct coro *coro, size_t size, void (*destroy_func)())
 inline void *
 coro_malloc(struct coro *coro, size_t size)
 {
+    if (LIKELY(size <= CORO_ARENA_MAX_ALLOC))
+        return coro_arena_alloc(coro, size);
+
     return coro_malloc_full(coro, size, free);
 }
 
@@ -403,15 +788,22 @@ coro_printf(struct coro *coro, const char *fmt, ...)
 {
     va_list values;
     int len;
-    char *tmp_str;
+    char *str;
 
     va_start(values, fmt);
-    len = vasprintf(&tmp_str, fmt, values);
+    len = vsnprintf(NULL, 0, fmt, values);
     va_end(values);
 
     if (UNLIKELY(len < 0))
         return NULL;
 
-    coro_defer(coro, CORO_DEFER(free), tmp_str);
-    return tmp_str;
+    str = coro_malloc(coro, (size_t)len + 1);
+    if (UNLIKELY(!str))
+        return NULL;
+
+    va_start(values, fmt);
+    vsnprintf(str, (size_t)len + 1, fmt, values);
+    va_end(values);
+
+    return str;
 }
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #if defined(__x86_64__)
 #include <stdint.h>
@@ -49,13 +50,37 @@ int	coro_resume(struct coro *coro);
 int	coro_resume_value(struct coro *coro, int value);
 int	coro_yield(struct coro *coro, int value);
 
+/* An opaque pointer that goes along with the coroutine, e.g. to tell which
+ * handler it's running; cleared by coro_reset(). */
+void	coro_set_tag(struct coro *coro, const void *tag);
+const void *coro_get_tag(const struct coro *coro);
+
+/* Coroutines that have been waiting with nothing in flight for a while
+ * can be trimmed by whoever resumes them: func(data) is called to release
+ * memory that'd only be needed once resumed, and the part of the stack that
+ * isn't in use is given back.  Cleared by coro_reset(). */
+void	coro_set_trim_callback(struct coro *coro, void (*func)(void *data),
+                               void *data);
+void	coro_trim(struct coro *coro);
+/* Same, for coroutines that won't run again before coro_reset(). */
+void	coro_trim_unused(struct coro *coro);
+
+/* Once enabled, before any coroutine is created, stacks are filled with a
+ * pattern by coro_reset(), and coro_stack_high_water() tells how deep into
+ * the stack a coroutine has been since; the unused part of the stack is
+ * then filled again when it next yields, so that each call measures what
+ * ran since the previous one.  Stacks aren't trimmed in this mode. */
+bool	coro_stack_stats_supported(void);
+void	coro_stack_stats_enable(void);
+size_t	coro_stack_high_water(struct coro *coro);
+size_t	coro_stack_size(void);
+
 void    coro_defer(struct coro *coro, void (*func)(void *data), void *data);
 void    coro_defer2(struct coro *coro, void (*func)(void *data1, void *data2),
             void *data1, void *data2);
 
 void    coro_deferred_run(struct coro *coro, size_t generation);
-size_t  coro_deferred_get_generation(const struct coro *coro)
-            __attribute__((pure));
+size_t  coro_deferred_get_generation(struct coro *coro);
 
 void   *coro_malloc(struct coro *coro, size_t sz)
             __attribute__((malloc));
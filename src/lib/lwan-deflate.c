@@ -0,0 +1,289 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "lwan-private.h"
+#include "lwan-deflate.h"
+
+/* Streams kept by each thread, for each encoding; with the default
+ * settings, zlib uses about 256KiB for each one of them. */
+#define POOL_SIZE 4
+
+/* Output buffers larger than this aren't kept along with pooled streams. */
+#define MAX_POOLED_OUTPUT_SIZE (64 * 1024)
+
+struct lwan_deflate {
+    z_stream stream;
+    struct lwan_deflate_pool *pool;
+    struct lwan_deflate *next;
+    char *output;
+    size_t output_size;
+    bool gzip;
+};
+
+struct lwan_deflate_pool {
+    struct lwan_deflate *free[2];
+    unsigned int n_free[2];
+};
+
+static void deflate_free(struct lwan_deflate *d)
+{
+    deflateEnd(&d->stream);
+    free(d->output);
+    free(d);
+}
+
+static struct lwan_deflate *deflate_get(struct lwan_thread *t, bool gzip)
+{
+    struct lwan_deflate_pool *pool = t->deflate_pool;
+    struct lwan_deflate *d;
+
+    if (UNLIKELY(!pool)) {
+        pool = t->deflate_pool = calloc(1, sizeof(*pool));
+        if (UNLIKELY(!pool))
+            return NULL;
+    }
+
+    d = pool->free[gzip];
+    if (LIKELY(d)) {
+        pool->free[gzip] = d->next;
+        pool->n_free[gzip]--;
+        return d;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (UNLIKELY(!d))
+        return NULL;
+
+    /* Adding 16 to windowBits gets a gzip header and trailer; otherwise,
+     * the zlib format is used, which is what "deflate" means in
+     * Content-Encoding. */
+    if (UNLIKELY(deflateInit2(&d->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                              gzip ? 15 + 16 : 15, 8,
+                              Z_DEFAULT_STRATEGY) != Z_OK)) {
+        free(d);
+        return NULL;
+    }
+
+    d->pool = pool;
+    d->gzip = gzip;
+
+    return d;
+}
+
+static void deflate_put(struct lwan_deflate *d)
+{
+    struct lwan_deflate_pool *pool = d->pool;
+
+    if (pool->n_free[d->gzip] < POOL_SIZE &&
+        LIKELY(deflateReset(&d->stream) == Z_OK)) {
+        if (d->output_size > MAX_POOLED_OUTPUT_SIZE) {
+            free(d->output);
+            d->output = NULL;
+            d->output_size = 0;
+        }
+
+        d->next = pool->free[d->gzip];
+        pool->free[d->gzip] = d;
+        pool->n_free[d->gzip]++;
+        return;
+    }
+
+    deflate_free(d);
+}
+
+static bool deflate_to_output(struct lwan_deflate *d,
+                              const char *data,
+                              size_t len,
+                              int flush,
+                              size_t *output_len)
+{
+    size_t used = 0;
+
+    if (UNLIKELY(len > UINT_MAX))
+        return false;
+
+    d->stream.next_in = (Bytef *)data;
+    d->stream.avail_in = (uInt)len;
+
+    while (true) {
+        /* Room for whatever is left to compress, and for the flush
+         * marker, so this usually goes around only once. */
+        size_t needed = deflateBound(&d->stream, d->stream.avail_in) + 16;
+
+        if (d->output_size - used < needed) {
+            char *output = realloc(d->output, used + needed);
+
+            if (UNLIKELY(!output))
+                return false;
+
+            d->output = output;
+            d->output_size = used + needed;
+        }
+
+        size_t avail = d->output_size - used;
+        if (UNLIKELY(avail > UINT_MAX))
+            avail = UINT_MAX;
+
+        d->stream.next_out = (Bytef *)d->output + used;
+        d->stream.avail_out = (uInt)avail;
+
+        if (UNLIKELY(deflate(&d->stream, flush) == Z_STREAM_ERROR))
+            return false;
+
+        used += avail - d->stream.avail_out;
+
+        /* If there's space left, everything has been flushed. */
+        if (d->stream.avail_out)
+            break;
+    }
+
+    *output_len = used;
+    return true;
+}
+
+/* Picks gzip, unless the client would rather have deflate. */
+static bool use_gzip(struct lwan_request *request)
+{
+    if (!(request->flags & REQUEST_ACCEPT_DEFLATE))
+        return true;
+    if (!(request->flags & REQUEST_ACCEPT_GZIP))
+        return false;
+
+    return lwan_request_get_accept_encoding_qvalue(request,
+                                                   REQUEST_ACCEPT_GZIP) >=
+           lwan_request_get_accept_encoding_qvalue(request,
+                                                   REQUEST_ACCEPT_DEFLATE);
+}
+
+const char *lwan_deflate_get_encoding(struct lwan_request *request)
+{
+    return use_gzip(request) ? "gzip" : "deflate";
+}
+
+static bool has_content_encoding(const struct lwan_request *request)
+{
+    const struct lwan_key_value *header = request->response.headers;
+
+    if (!header)
+        return false;
+
+    for (; header->key; header++) {
+        if (!strcasecmp(header->key, "Content-Encoding"))
+            return true;
+    }
+
+    return false;
+}
+
+bool lwan_deflate_response(struct lwan_request *request)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    size_t len = lwan_strbuf_get_length(buffer);
+    struct lwan_deflate *d;
+    size_t compressed_len;
+    bool compressed = false;
+
+    if (len < request->conn->thread->lwan->config.compress_min_size)
+        return false;
+    if (UNLIKELY(has_content_encoding(request)))
+        return false;
+
+    d = deflate_get(request->conn->thread, use_gzip(request));
+    if (UNLIKELY(!d))
+        return false;
+
+    if (deflate_to_output(d, lwan_strbuf_get_buffer(buffer), len, Z_FINISH,
+                          &compressed_len) &&
+        compressed_len < len) {
+        /* Fits in the buffer, so this won't allocate. */
+        compressed = lwan_strbuf_set(buffer, d->output, compressed_len);
+        if (LIKELY(compressed))
+            request->flags |= RESPONSE_COMPRESSED;
+    }
+
+    deflate_put(d);
+
+    return compressed;
+}
+
+bool lwan_deflate_chunked_begin(struct lwan_request *request)
+{
+    struct lwan_deflate *d;
+
+    if (UNLIKELY(has_content_encoding(request)))
+        return false;
+
+    d = deflate_get(request->conn->thread, use_gzip(request));
+    if (UNLIKELY(!d))
+        return false;
+
+    /* Returned to the pool once the response is done, or if the
+     * connection is dropped while it's being sent. */
+    coro_defer(request->conn->coro, CORO_DEFER(deflate_put), d);
+
+    request->deflate = d;
+    request->flags |= RESPONSE_COMPRESSED;
+
+    return true;
+}
+
+bool lwan_deflate_chunk(struct lwan_request *request,
+                        const char *data,
+                        size_t len,
+                        bool last,
+                        struct lwan_value *output)
+{
+    struct lwan_deflate *d = request->deflate;
+
+    /* Each chunk is flushed so that clients can decompress it as soon as
+     * it arrives. */
+    if (UNLIKELY(!deflate_to_output(d, data, len,
+                                    last ? Z_FINISH : Z_SYNC_FLUSH,
+                                    &output->len)))
+        return false;
+
+    output->value = d->output;
+    return true;
+}
+
+void lwan_deflate_pool_free(struct lwan_deflate_pool *pool)
+{
+    if (!pool)
+        return;
+
+    for (size_t i = 0; i < N_ELEMENTS(pool->free); i++) {
+        struct lwan_deflate *d = pool->free[i];
+
+        while (d) {
+            struct lwan_deflate *next = d->next;
+
+            deflate_free(d);
+            d = next;
+        }
+    }
+
+    free(pool);
+}
@@ -0,0 +1,50 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include "lwan.h"
+
+/* On-the-fly compression of responses from url maps with
+ * HANDLER_COMPRESS_RESPONSE, with gzip or deflate, as preferred by the
+ * client.  zlib streams are kept in a small per-thread pool and reset
+ * between responses instead of being initialized every time. */
+
+struct lwan_deflate_pool;
+
+/* Compresses the response buffer in place, if it's large enough and if
+ * it's worth it; RESPONSE_COMPRESSED is set if so. */
+bool lwan_deflate_response(struct lwan_request *request);
+
+/* Called before the headers of a chunked response are sent; returns false
+ * if the chunks are going to be sent uncompressed. */
+bool lwan_deflate_chunked_begin(struct lwan_request *request);
+/* Compresses the next chunk, or finishes the stream if last is true; the
+ * output is valid until the next call. */
+bool lwan_deflate_chunk(struct lwan_request *request,
+                        const char *data,
+                        size_t len,
+                        bool last,
+                        struct lwan_value *output);
+
+/* Either "gzip" or "deflate", for the Content-Encoding header. */
+const char *lwan_deflate_get_encoding(struct lwan_request *request);
+
+void lwan_deflate_pool_free(struct lwan_deflate_pool *pool);
@@ -0,0 +1,377 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "lwan-private.h"
+#include "lwan-escape.h"
+
+/*
+ * Almost everything passed through the escapers is plain text, so the
+ * scanners below look at 16 bytes at a time with SSE2 or NEON (both always
+ * available on the architectures they're used on), leaving only the tail
+ * to the scalar loops.  Clean spans are then appended with a single copy.
+ */
+
+#if defined(__aarch64__)
+static ALWAYS_INLINE uint64_t neon_mask(uint8x16_t hits)
+{
+    /* Narrow each byte of the comparison result to a nibble. */
+    return vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+}
+#endif
+
+static ALWAYS_INLINE bool html_needs_escaping(char c)
+{
+    return c == '<' || c == '>' || c == '&' || c == '"' || c == '\'' ||
+           c == '/';
+}
+
+static ALWAYS_INLINE const char *find_html_escape(const char *p,
+                                                  const char *end)
+{
+#if defined(__x86_64__)
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    const __m128i slash = _mm_set1_epi8('/');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, lt),
+                                      _mm_cmpeq_epi8(chunk, gt)),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, amp),
+                                      _mm_cmpeq_epi8(chunk, quot))),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, apos),
+                         _mm_cmpeq_epi8(chunk, slash)));
+        int mask = _mm_movemask_epi8(hits);
+
+        if (mask)
+            return p + __builtin_ctz((unsigned int)mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t lt = vdupq_n_u8('<');
+    const uint8x16_t gt = vdupq_n_u8('>');
+    const uint8x16_t amp = vdupq_n_u8('&');
+    const uint8x16_t quot = vdupq_n_u8('"');
+    const uint8x16_t apos = vdupq_n_u8('\'');
+    const uint8x16_t slash = vdupq_n_u8('/');
+
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint8x16_t hits = vorrq_u8(
+            vorrq_u8(vorrq_u8(vceqq_u8(chunk, lt), vceqq_u8(chunk, gt)),
+                     vorrq_u8(vceqq_u8(chunk, amp), vceqq_u8(chunk, quot))),
+            vorrq_u8(vceqq_u8(chunk, apos), vceqq_u8(chunk, slash)));
+        uint64_t mask = neon_mask(hits);
+
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (html_needs_escaping(*p))
+            return p;
+    }
+
+    return end;
+}
+
+/* Finds the first byte that isn't printable ASCII or that has to be
+ * escaped in a JSON string: a signed comparison against 0x20 catches both
+ * control characters and bytes with the high bit set. */
+static ALWAYS_INLINE const char *find_json_escape(const char *p,
+                                                  const char *end)
+{
+#if defined(__x86_64__)
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quot),
+                         _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmplt_epi8(chunk, space));
+        int mask = _mm_movemask_epi8(hits);
+
+        if (mask)
+            return p + __builtin_ctz((unsigned int)mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t quot = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const int8x16_t space = vdupq_n_s8(' ');
+
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint8x16_t hits = vorrq_u8(
+            vorrq_u8(vceqq_u8(chunk, quot), vceqq_u8(chunk, backslash)),
+            vcltq_s8(vreinterpretq_s8_u8(chunk), space));
+        uint64_t mask = neon_mask(hits);
+
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+
+    for (; p < end; p++) {
+        const unsigned char c = (unsigned char)*p;
+
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+            return p;
+    }
+
+    return end;
+}
+
+static ALWAYS_INLINE const char *skip_ascii(const char *p, const char *end)
+{
+#if defined(__x86_64__)
+    for (; end - p >= 16; p += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p));
+
+        if (mask)
+            return p + __builtin_ctz((unsigned int)mask);
+    }
+#elif defined(__aarch64__)
+    for (; end - p >= 16; p += 16) {
+        uint64_t mask = neon_mask(
+            vcltq_s8(vld1q_s8((const int8_t *)p), vdupq_n_s8(0)));
+
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+
+    for (; p < end; p++) {
+        if ((unsigned char)*p >= 0x80)
+            return p;
+    }
+
+    return end;
+}
+
+/* Returns the length of the UTF-8 sequence starting at p, a byte that's
+ * not ASCII, or 0 if it's not valid: overlong encodings, surrogates and
+ * code points past U+10FFFF are rejected. */
+static size_t utf8_sequence_length(const char *p, const char *end)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    const size_t avail = (size_t)(end - p);
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t len;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        if (s[0] == 0xe0)
+            lo = 0xa0;
+        else if (s[0] == 0xed)
+            hi = 0x9f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        if (s[0] == 0xf0)
+            lo = 0x90;
+        else if (s[0] == 0xf4)
+            hi = 0x8f;
+    } else {
+        return 0;
+    }
+
+    if (avail < len)
+        return 0;
+    if (s[1] < lo || s[1] > hi)
+        return 0;
+    for (size_t i = 2; i < len; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+    }
+
+    return len;
+}
+
+const char *lwan_json_find_special(const char *p, const char *end)
+{
+    return find_json_escape(p, end);
+}
+
+size_t lwan_utf8_sequence_length(const char *p, const char *end)
+{
+    return utf8_sequence_length(p, end);
+}
+
+bool lwan_utf8_is_valid(const char *str, size_t len)
+{
+    const char *end = str + len;
+
+    while ((str = skip_ascii(str, end)) < end) {
+        size_t seq_len = utf8_sequence_length(str, end);
+
+        if (!seq_len)
+            return false;
+        str += seq_len;
+    }
+
+    return true;
+}
+
+static ALWAYS_INLINE bool
+append_span(struct lwan_strbuf *buf, const char *start, const char *end)
+{
+    /* A length of 0 would make lwan_strbuf_append_str() call strlen(). */
+    if (start == end)
+        return true;
+    return lwan_strbuf_append_str(buf, start, (size_t)(end - start));
+}
+
+static bool append_html_entity(struct lwan_strbuf *buf, char c)
+{
+    switch (c) {
+    case '<':
+        return lwan_strbuf_append_str(buf, "&lt;", 4);
+    case '>':
+        return lwan_strbuf_append_str(buf, "&gt;", 4);
+    case '&':
+        return lwan_strbuf_append_str(buf, "&amp;", 5);
+    case '"':
+        return lwan_strbuf_append_str(buf, "&quot;", 6);
+    case '\'':
+        return lwan_strbuf_append_str(buf, "&#x27;", 6);
+    case '/':
+        return lwan_strbuf_append_str(buf, "&#x2f;", 6);
+    }
+
+    return true;
+}
+
+bool lwan_append_html_escaped(struct lwan_strbuf *buf, const char *str,
+                              size_t len)
+{
+    if (!len)
+        len = strlen(str);
+
+    const char *end = str + len;
+
+    /* Grow once for the common case where nothing needs escaping; the
+     * entities, if any, will make the buffer grow further as needed. */
+    if (UNLIKELY(!lwan_strbuf_grow_to(buf, lwan_strbuf_get_length(buf) + len)))
+        return false;
+
+    for (const char *p = str; p < end;) {
+        const char *hit = find_html_escape(p, end);
+
+        if (UNLIKELY(!append_span(buf, p, hit)))
+            return false;
+        if (hit == end)
+            break;
+
+        if (UNLIKELY(!append_html_entity(buf, *hit)))
+            return false;
+        p = hit + 1;
+    }
+
+    return true;
+}
+
+static bool append_json_escape(struct lwan_strbuf *buf, unsigned char c)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    char escaped[6] = {'\\', 'u', '0', '0'};
+
+    switch (c) {
+    case '"':
+        return lwan_strbuf_append_str(buf, "\\\"", 2);
+    case '\\':
+        return lwan_strbuf_append_str(buf, "\\\\", 2);
+    case '\b':
+        return lwan_strbuf_append_str(buf, "\\b", 2);
+    case '\f':
+        return lwan_strbuf_append_str(buf, "\\f", 2);
+    case '\n':
+        return lwan_strbuf_append_str(buf, "\\n", 2);
+    case '\r':
+        return lwan_strbuf_append_str(buf, "\\r", 2);
+    case '\t':
+        return lwan_strbuf_append_str(buf, "\\t", 2);
+    }
+
+    if (c >= 0x80)
+        return lwan_strbuf_append_str(buf, "\\ufffd", 6);
+
+    escaped[4] = hex_digits[c >> 4];
+    escaped[5] = hex_digits[c & 0xf];
+    return lwan_strbuf_append_str(buf, escaped, sizeof(escaped));
+}
+
+bool lwan_append_json_escaped(struct lwan_strbuf *buf, const char *str,
+                              size_t len)
+{
+    if (!len)
+        len = strlen(str);
+
+    const char *end = str + len;
+    const char *span = str;
+    const char *p = str;
+
+    if (UNLIKELY(!lwan_strbuf_grow_to(buf,
+                                      lwan_strbuf_get_length(buf) + len + 2)))
+        return false;
+    if (UNLIKELY(!lwan_strbuf_append_char(buf, '"')))
+        return false;
+
+    while ((p = find_json_escape(p, end)) < end) {
+        const unsigned char c = (unsigned char)*p;
+
+        /* Valid multibyte sequences are copied along with the span. */
+        if (c >= 0x80) {
+            size_t seq_len = utf8_sequence_length(p, end);
+
+            if (LIKELY(seq_len)) {
+                p += seq_len;
+                continue;
+            }
+        }
+
+        if (UNLIKELY(!append_span(buf, span, p)))
+            return false;
+        if (UNLIKELY(!append_json_escape(buf, c)))
+            return false;
+        span = ++p;
+    }
+
+    if (UNLIKELY(!append_span(buf, span, end)))
+        return false;
+    return lwan_strbuf_append_char(buf, '"');
+}
@@ -0,0 +1,38 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lwan-strbuf.h"
+
+/* Appends str (len bytes, or up to the NUL if len is 0) escaped to be
+ * used inside HTML elements and quoted attributes. */
+bool lwan_append_html_escaped(struct lwan_strbuf *buf, const char *str,
+                              size_t len);
+
+/* Appends str as a quoted JSON string.  Bytes that aren't part of a valid
+ * UTF-8 sequence are replaced with U+FFFD. */
+bool lwan_append_json_escaped(struct lwan_strbuf *buf, const char *str,
+                              size_t len);
+
+bool lwan_utf8_is_valid(const char *str, size_t len);
@@ -0,0 +1,1760 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/* HTTP/2 (RFC 9113), on top of the HTTP/1.1 machinery.  The connection's
+ * coroutine reads and writes frames; each stream gets a coroutine of its
+ * own, that's handed the request head as HTTP/1.1 text, and runs
+ * lwan_process_request() on it; the body is then read from the stream, as
+ * it arrives, as if it were the socket.  Whatever lwan writes is a HTTP/1.1
+ * response, that's turned into HEADERS and DATA frames as it goes.  This keeps handlers, modules, and the response code unaware of
+ * HTTP/2, at the cost of parsing the headers lwan itself has just written.
+ *
+ * While a stream coroutine runs, conn->coro points to it, so that
+ * everything that yields, defers, or allocates from within the request
+ * does so in the stream.  A stream that sleeps (or waits on a file
+ * descriptor) suspends the whole connection until it's resumed.  */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-h2.h"
+#include "lwan-hpack.h"
+
+enum h2_frame_type {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+};
+
+enum h2_frame_flags {
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20,
+};
+
+enum h2_error_code {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum h2_setting {
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_FRAME_SIZE 16384
+#define MAX_FRAME_SIZE 16777215
+#define DEFAULT_WINDOW_SIZE 65535
+#define MAX_WINDOW_SIZE 0x7fffffff
+#define MAX_CONCURRENT_STREAMS 100
+
+#define MAX_HEADER_BLOCK_SIZE (4 * DEFAULT_BUFFER_SIZE)
+/* Same limit as a HTTP/1.1 request, that has to fit the request buffer */
+#define MAX_REQUEST_HEAD_SIZE DEFAULT_BUFFER_SIZE
+#define MAX_RESPONSE_HEAD_SIZE (4 * DEFAULT_BUFFER_SIZE)
+
+#define INPUT_BUFFER_SIZE (2 * (FRAME_HEADER_SIZE + DEFAULT_FRAME_SIZE))
+/* Streams stop writing once this much is waiting to be sent */
+#define OUTPUT_HIGH_WATER (64 * 1024)
+
+enum response_state {
+    RESPONSE_HEAD,
+    RESPONSE_BODY,
+    RESPONSE_CHUNK_SIZE,
+    RESPONSE_CHUNK_DATA,
+    RESPONSE_CHUNK_END,
+    RESPONSE_TRAILERS,
+    RESPONSE_DONE,
+};
+
+struct h2_session;
+
+/* Zeroed strbufs are valid empty buffers, so streams are just calloc()d. */
+struct lwan_h2_stream {
+    struct h2_session *session;
+    struct lwan_h2_stream *next;
+    struct coro *coro;
+    struct coro_switcher switcher;
+
+    uint32_t id;
+    int64_t send_window;
+
+    /* The request, as it's received */
+    enum h2_error_code error;
+    char *method;
+    char *path;
+    char *authority;
+    bool has_scheme;
+    bool seen_regular_field;
+    bool headers_done;
+    bool end_stream;
+    bool ready;
+    bool blocked;
+    bool streaming_body;
+    bool waiting_for_body;
+    long long content_length;
+    size_t body_len;
+    size_t body_consumed;
+    struct lwan_strbuf fields;
+    struct lwan_strbuf cookies;
+    struct lwan_strbuf body;
+    struct lwan_strbuf request;
+
+    /* The response, as it's written by lwan */
+    enum response_state state;
+    unsigned int head_match;
+    struct lwan_strbuf head;
+    size_t chunk_remaining;
+    size_t line_len;
+    char line[64];
+};
+
+struct h2_session {
+    struct lwan *lwan;
+    struct lwan_connection *conn;
+    struct coro *coro;
+    int fd;
+
+    struct hpack_decoder decoder;
+
+    struct lwan_h2_stream *streams;
+    struct lwan_h2_stream *sleeping;
+    unsigned int n_streams;
+    uint32_t last_stream_id;
+
+    int64_t send_window;
+    int64_t initial_window;
+    uint32_t max_frame_size;
+
+    /* Header block being received, possibly split in CONTINUATION frames */
+    struct lwan_strbuf header_block;
+    uint32_t header_block_stream;
+    bool header_block_end_stream;
+    bool expect_continuation;
+
+    bool preface_received;
+    bool goaway_sent;
+    bool goaway_received;
+    bool failed;
+
+    unsigned char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_size;
+
+    size_t in_len;
+    unsigned char in[INPUT_BUFFER_SIZE];
+};
+
+static ALWAYS_INLINE uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           (uint32_t)p[3];
+}
+
+static ALWAYS_INLINE void put_u32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void put_frame_header(unsigned char *p,
+                             size_t len,
+                             enum h2_frame_type type,
+                             uint8_t flags,
+                             uint32_t stream_id)
+{
+    p[0] = (unsigned char)(len >> 16);
+    p[1] = (unsigned char)(len >> 8);
+    p[2] = (unsigned char)len;
+    p[3] = (unsigned char)type;
+    p[4] = flags;
+    put_u32(p + 5, stream_id & 0x7fffffff);
+}
+
+static ALWAYS_INLINE size_t output_pending(const struct h2_session *s)
+{
+    return s->out_len - s->out_sent;
+}
+
+static unsigned char *reserve_output(struct h2_session *s, size_t len)
+{
+    unsigned char *p;
+
+    if (s->out_len + len > s->out_size) {
+        size_t size = s->out_size ? s->out_size : OUTPUT_HIGH_WATER;
+
+        if (s->out_sent) {
+            memmove(s->out, s->out + s->out_sent, output_pending(s));
+            s->out_len -= s->out_sent;
+            s->out_sent = 0;
+        }
+
+        while (size < s->out_len + len)
+            size *= 2;
+
+        if (size != s->out_size) {
+            p = realloc(s->out, size);
+            if (UNLIKELY(!p)) {
+                s->failed = true;
+                return NULL;
+            }
+            s->out = p;
+            s->out_size = size;
+        }
+    }
+
+    p = s->out + s->out_len;
+    s->out_len += len;
+    return p;
+}
+
+static bool send_frame(struct h2_session *s,
+                       enum h2_frame_type type,
+                       uint8_t flags,
+                       uint32_t stream_id,
+                       const void *payload,
+                       size_t len)
+{
+    unsigned char *p = reserve_output(s, FRAME_HEADER_SIZE + len);
+
+    if (UNLIKELY(!p))
+        return false;
+
+    put_frame_header(p, len, type, flags, stream_id);
+    if (len)
+        memcpy(p + FRAME_HEADER_SIZE, payload, len);
+
+    return true;
+}
+
+static void
+send_rst_stream(struct h2_session *s, uint32_t stream_id, enum h2_error_code error)
+{
+    unsigned char payload[4];
+
+    put_u32(payload, error);
+    send_frame(s, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void
+send_window_update(struct h2_session *s, uint32_t stream_id, size_t increment)
+{
+    unsigned char payload[4];
+
+    put_u32(payload, (uint32_t)increment);
+    send_frame(s, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_goaway(struct h2_session *s, enum h2_error_code error)
+{
+    unsigned char payload[8];
+
+    put_u32(payload, s->last_stream_id);
+    put_u32(payload + 4, error);
+    send_frame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+
+    s->goaway_sent = true;
+}
+
+static void send_settings(struct h2_session *s)
+{
+    unsigned char payload[12];
+
+    /* Streams can't be pushed to clients anyway, but say so. */
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_ENABLE_PUSH;
+    put_u32(payload + 2, 0);
+    payload[6] = 0;
+    payload[7] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(payload + 8, MAX_CONCURRENT_STREAMS);
+
+    send_frame(s, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static bool connection_error(struct h2_session *s, enum h2_error_code error)
+{
+    lwan_status_debug("HTTP/2 connection error %d", error);
+    send_goaway(s, error);
+    return false;
+}
+
+static struct lwan_h2_stream *find_stream(struct h2_session *s, uint32_t id)
+{
+    for (struct lwan_h2_stream *stream = s->streams; stream;
+         stream = stream->next) {
+        if (stream->id == id)
+            return stream;
+    }
+
+    return NULL;
+}
+
+/* Streams are only opened by clients, with odd, increasing, identifiers;
+ * streams that haven't been opened yet can't have frames other than
+ * HEADERS (and PRIORITY). */
+static ALWAYS_INLINE bool stream_is_idle(const struct h2_session *s, uint32_t id)
+{
+    return !(id & 1) || id > s->last_stream_id;
+}
+
+static struct lwan_h2_stream *new_stream(struct h2_session *s, uint32_t id)
+{
+    struct lwan_h2_stream *stream = calloc(1, sizeof(*stream));
+    struct lwan_h2_stream **last;
+
+    if (UNLIKELY(!stream))
+        return NULL;
+
+    stream->session = s;
+    stream->id = id;
+    stream->send_window = s->initial_window;
+    stream->content_length = -1;
+
+    /* Streams are run in the order they were opened. */
+    for (last = &s->streams; *last; last = &(*last)->next)
+        ;
+    *last = stream;
+    s->n_streams++;
+
+    return stream;
+}
+
+static void close_stream(struct h2_session *s, struct lwan_h2_stream *stream)
+{
+    struct lwan_h2_stream **prev;
+
+    for (prev = &s->streams; *prev != stream; prev = &(*prev)->next)
+        ;
+    *prev = stream->next;
+    s->n_streams--;
+
+    if (s->sleeping == stream)
+        s->sleeping = NULL;
+
+    /* Runs whatever the request deferred, wherever it stopped. */
+    if (stream->coro)
+        coro_free(stream->coro);
+
+    free(stream->method);
+    free(stream->path);
+    free(stream->authority);
+    lwan_strbuf_free(&stream->fields);
+    lwan_strbuf_free(&stream->cookies);
+    lwan_strbuf_free(&stream->body);
+    lwan_strbuf_free(&stream->request);
+    lwan_strbuf_free(&stream->head);
+    free(stream);
+}
+
+static void reset_stream(struct h2_session *s,
+                         struct lwan_h2_stream *stream,
+                         enum h2_error_code error)
+{
+    send_rst_stream(s, stream->id, error);
+    close_stream(s, stream);
+}
+
+/*
+ * Request side: header fields are validated and written as HTTP/1.1 header
+ * lines; the request is put together once the whole body is in.
+ */
+
+#define FIELD_IS(name_, len_, str_)                                            \
+    ((len_) == sizeof(str_) - 1 && !memcmp((name_), (str_), sizeof(str_) - 1))
+
+static bool is_name_valid(const char *name, size_t len)
+{
+    if (UNLIKELY(!len))
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)name[i];
+
+        /* Uppercase names are malformed in HTTP/2. */
+        if (c <= ' ' || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z'))
+            return false;
+    }
+
+    return true;
+}
+
+static bool is_value_valid(const char *value, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n')
+            return false;
+    }
+
+    return true;
+}
+
+static bool is_token(const char *value, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)value[i];
+
+        if (c <= ' ' || c >= 0x7f)
+            return false;
+    }
+
+    return len > 0;
+}
+
+static bool set_pseudo_field(char **field, const char *value, size_t len)
+{
+    if (*field)
+        return false;
+
+    *field = strndup(value, len);
+    return *field != NULL;
+}
+
+static size_t request_head_size(const struct lwan_h2_stream *stream)
+{
+    return lwan_strbuf_get_length(&stream->fields) +
+           lwan_strbuf_get_length(&stream->cookies);
+}
+
+static bool
+parse_content_length(struct lwan_h2_stream *stream, const char *value, size_t len)
+{
+    long long content_length = 0;
+
+    if (UNLIKELY(!len || len > 18))
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        if (UNLIKELY(value[i] < '0' || value[i] > '9'))
+            return false;
+        content_length = content_length * 10 + (value[i] - '0');
+    }
+
+    if (UNLIKELY(stream->content_length >= 0 &&
+                 stream->content_length != content_length))
+        return false;
+
+    stream->content_length = content_length;
+    return true;
+}
+
+static bool add_regular_field(struct lwan_h2_stream *stream,
+                              const char *name,
+                              size_t name_len,
+                              const char *value,
+                              size_t value_len)
+{
+    /* Connection-specific fields have no meaning in HTTP/2. */
+    if (FIELD_IS(name, name_len, "connection") ||
+        FIELD_IS(name, name_len, "keep-alive") ||
+        FIELD_IS(name, name_len, "proxy-connection") ||
+        FIELD_IS(name, name_len, "transfer-encoding") ||
+        FIELD_IS(name, name_len, "upgrade"))
+        return false;
+
+    if (FIELD_IS(name, name_len, "te"))
+        return FIELD_IS(value, value_len, "trailers");
+
+    if (FIELD_IS(name, name_len, "host")) {
+        /* :authority takes precedence */
+        if (stream->authority)
+            return true;
+        return set_pseudo_field(&stream->authority, value, value_len);
+    }
+
+    /* Written along with the request, once the body length is known. */
+    if (FIELD_IS(name, name_len, "content-length"))
+        return parse_content_length(stream, value, value_len);
+
+    /* Cookies might be split in many fields, but lwan expects them all
+     * in a single header. */
+    if (FIELD_IS(name, name_len, "cookie")) {
+        if (lwan_strbuf_get_length(&stream->cookies) &&
+            !lwan_strbuf_append_str(&stream->cookies, "; ", 2))
+            return false;
+        return !value_len ||
+               lwan_strbuf_append_str(&stream->cookies, value, value_len);
+    }
+
+    return lwan_strbuf_append_str(&stream->fields, name, name_len) &&
+           lwan_strbuf_append_str(&stream->fields, ": ", 2) &&
+           (!value_len ||
+            lwan_strbuf_append_str(&stream->fields, value, value_len)) &&
+           lwan_strbuf_append_str(&stream->fields, "\r\n", 2);
+}
+
+static bool add_pseudo_field(struct lwan_h2_stream *stream,
+                             const char *name,
+                             size_t name_len,
+                             const char *value,
+                             size_t value_len)
+{
+    if (UNLIKELY(stream->seen_regular_field))
+        return false;
+
+    if (FIELD_IS(name, name_len, ":method")) {
+        return is_token(value, value_len) &&
+               set_pseudo_field(&stream->method, value, value_len);
+    }
+    if (FIELD_IS(name, name_len, ":path")) {
+        return is_token(value, value_len) &&
+               set_pseudo_field(&stream->path, value, value_len);
+    }
+    if (FIELD_IS(name, name_len, ":authority"))
+        return set_pseudo_field(&stream->authority, value, value_len);
+    if (FIELD_IS(name, name_len, ":scheme")) {
+        if (UNLIKELY(stream->has_scheme))
+            return false;
+        stream->has_scheme = true;
+        return true;
+    }
+
+    return false;
+}
+
+static void on_header_field(void *data,
+                            const char *name,
+                            size_t name_len,
+                            const char *value,
+                            size_t value_len)
+{
+    struct lwan_h2_stream *stream = data;
+    bool valid;
+
+    /* Trailers, and fields for streams that were refused, are only decoded
+     * to keep the HPACK state in sync. */
+    if (!stream || stream->error)
+        return;
+
+    if (UNLIKELY(!is_value_valid(value, value_len))) {
+        stream->error = H2_PROTOCOL_ERROR;
+        return;
+    }
+
+    if (name_len && name[0] == ':') {
+        valid = add_pseudo_field(stream, name, name_len, value, value_len);
+    } else {
+        stream->seen_regular_field = true;
+        valid = is_name_valid(name, name_len) &&
+                add_regular_field(stream, name, name_len, value, value_len);
+    }
+
+    if (UNLIKELY(!valid))
+        stream->error = H2_PROTOCOL_ERROR;
+    else if (UNLIKELY(request_head_size(stream) > MAX_REQUEST_HEAD_SIZE))
+        stream->error = H2_ENHANCE_YOUR_CALM;
+}
+
+static bool append_strbuf(struct lwan_strbuf *dest, const struct lwan_strbuf *src)
+{
+    size_t len = lwan_strbuf_get_length(src);
+
+    return !len ||
+           lwan_strbuf_append_str(dest, lwan_strbuf_get_buffer(src), len);
+}
+
+/* Bodies of known length are read by lwan as they arrive, with the window
+ * given back as they're read; others are buffered whole, up to
+ * max_post_data_size, as lwan needs their length beforehand. */
+static bool build_request(struct lwan_h2_stream *stream)
+{
+    struct lwan_strbuf *request = &stream->request;
+    size_t content_length = stream->body_len;
+
+    if (UNLIKELY(!stream->method || !stream->path || !stream->has_scheme))
+        return false;
+
+    if (stream->content_length >= 0) {
+        if (UNLIKELY((unsigned long long)stream->content_length < stream->body_len))
+            return false;
+        if (UNLIKELY(stream->end_stream &&
+                     (size_t)stream->content_length != stream->body_len))
+            return false;
+        content_length = (size_t)stream->content_length;
+    }
+
+    if (UNLIKELY(!lwan_strbuf_init_with_size(
+            request, request_head_size(stream) + strlen(stream->path) +
+                         lwan_strbuf_get_length(&stream->body) + 128)))
+        return false;
+
+    if (UNLIKELY(!lwan_strbuf_printf(request, "%s %s HTTP/1.1\r\n",
+                                     stream->method, stream->path)))
+        return false;
+    if (stream->authority &&
+        UNLIKELY(!lwan_strbuf_append_printf(request, "Host: %s\r\n",
+                                            stream->authority)))
+        return false;
+    if (UNLIKELY(!append_strbuf(request, &stream->fields)))
+        return false;
+    if (lwan_strbuf_get_length(&stream->cookies) &&
+        UNLIKELY(!lwan_strbuf_append_str(request, "Cookie: ", 8) ||
+                 !append_strbuf(request, &stream->cookies) ||
+                 !lwan_strbuf_append_str(request, "\r\n", 2)))
+        return false;
+
+    /* A body that's too large is dropped as it arrives, but its length
+     * is kept, for lwan to reject the request. */
+    if ((content_length || stream->content_length >= 0 ||
+         (strcmp(stream->method, "GET") && strcmp(stream->method, "HEAD"))) &&
+        UNLIKELY(!lwan_strbuf_append_printf(request, "Content-Length: %zu\r\n",
+                                            content_length)))
+        return false;
+
+    if (UNLIKELY(!lwan_strbuf_append_str(request, "\r\n", 2)))
+        return false;
+
+    stream->streaming_body = !stream->end_stream && stream->content_length >= 0;
+    if (!stream->streaming_body) {
+        if (UNLIKELY(!append_strbuf(request, &stream->body)))
+            return false;
+
+        lwan_strbuf_free(&stream->body);
+        memset(&stream->body, 0, sizeof(stream->body));
+    }
+
+    return true;
+}
+
+/* Returns false if the stream has been closed instead. */
+static bool request_ready(struct h2_session *s, struct lwan_h2_stream *stream)
+{
+    if (UNLIKELY(!build_request(stream))) {
+        reset_stream(s, stream, H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    stream->ready = true;
+    return true;
+}
+
+static void end_request_body(struct h2_session *s, struct lwan_h2_stream *stream)
+{
+    stream->end_stream = true;
+    stream->waiting_for_body = false;
+
+    if (!stream->ready) {
+        request_ready(s, stream);
+    } else if (UNLIKELY(stream->streaming_body &&
+                        (size_t)stream->content_length != stream->body_len)) {
+        reset_stream(s, stream, H2_PROTOCOL_ERROR);
+    }
+}
+
+static bool end_header_block(struct h2_session *s)
+{
+    struct lwan_h2_stream *stream = find_stream(s, s->header_block_stream);
+    bool trailers = stream && stream->headers_done;
+    size_t len = lwan_strbuf_get_length(&s->header_block);
+    bool decoded = true;
+
+    s->expect_continuation = false;
+
+    if (len) {
+        decoded = hpack_decode(
+            &s->decoder,
+            (unsigned char *)lwan_strbuf_get_buffer(&s->header_block), len,
+            on_header_field, trailers ? NULL : stream);
+        lwan_strbuf_reset(&s->header_block);
+    }
+    if (UNLIKELY(!decoded))
+        return connection_error(s, H2_COMPRESSION_ERROR);
+
+    if (!stream)
+        return true;
+
+    if (trailers) {
+        if (UNLIKELY(!s->header_block_end_stream))
+            reset_stream(s, stream, H2_PROTOCOL_ERROR);
+        else
+            end_request_body(s, stream);
+        return true;
+    }
+
+    if (UNLIKELY(stream->error)) {
+        reset_stream(s, stream, stream->error);
+        return true;
+    }
+
+    stream->headers_done = true;
+    if (s->header_block_end_stream) {
+        stream->end_stream = true;
+        request_ready(s, stream);
+    } else if (stream->content_length >= 0) {
+        request_ready(s, stream);
+    }
+
+    return true;
+}
+
+static bool append_header_fragment(struct h2_session *s,
+                                   uint8_t flags,
+                                   const unsigned char *payload,
+                                   size_t len)
+{
+    if (UNLIKELY(lwan_strbuf_get_length(&s->header_block) + len >
+                 MAX_HEADER_BLOCK_SIZE))
+        return connection_error(s, H2_ENHANCE_YOUR_CALM);
+    if (len && UNLIKELY(!lwan_strbuf_append_str(&s->header_block,
+                                                (const char *)payload, len)))
+        return connection_error(s, H2_INTERNAL_ERROR);
+
+    if (flags & H2_FLAG_END_HEADERS)
+        return end_header_block(s);
+
+    s->expect_continuation = true;
+    return true;
+}
+
+static bool
+strip_padding(uint8_t flags, const unsigned char **payload, size_t *len)
+{
+    if (flags & H2_FLAG_PADDED) {
+        size_t padding;
+
+        if (UNLIKELY(!*len))
+            return false;
+
+        padding = (*payload)[0];
+        (*payload)++;
+        (*len)--;
+
+        if (UNLIKELY(padding > *len))
+            return false;
+        *len -= padding;
+    }
+
+    return true;
+}
+
+static bool handle_headers(struct h2_session *s,
+                           uint8_t flags,
+                           uint32_t id,
+                           const unsigned char *payload,
+                           size_t len)
+{
+    if (UNLIKELY(!(id & 1)))
+        return connection_error(s, H2_PROTOCOL_ERROR);
+    if (UNLIKELY(!strip_padding(flags, &payload, &len)))
+        return connection_error(s, H2_PROTOCOL_ERROR);
+    if (flags & H2_FLAG_PRIORITY) {
+        if (UNLIKELY(len < 5))
+            return connection_error(s, H2_FRAME_SIZE_ERROR);
+        payload += 5;
+        len -= 5;
+    }
+
+    struct lwan_h2_stream *stream = find_stream(s, id);
+    if (!stream) {
+        if (UNLIKELY(id <= s->last_stream_id))
+            return connection_error(s, H2_STREAM_CLOSED);
+        s->last_stream_id = id;
+
+        if (s->goaway_sent || s->n_streams >= MAX_CONCURRENT_STREAMS ||
+            UNLIKELY(!new_stream(s, id)))
+            send_rst_stream(s, id, H2_REFUSED_STREAM);
+    } else if (UNLIKELY(stream->end_stream)) {
+        /* Still decoded; the stream is gone by then. */
+        reset_stream(s, stream, H2_STREAM_CLOSED);
+    }
+
+    s->header_block_stream = id;
+    s->header_block_end_stream = flags & H2_FLAG_END_STREAM;
+    return append_header_fragment(s, flags, payload, len);
+}
+
+static bool handle_data(struct h2_session *s,
+                        uint8_t flags,
+                        uint32_t id,
+                        const unsigned char *payload,
+                        size_t len)
+{
+    const size_t max_post_data_size = s->lwan->config.max_post_data_size;
+    const size_t frame_len = len;
+    struct lwan_h2_stream *stream;
+
+    if (UNLIKELY(!id))
+        return connection_error(s, H2_PROTOCOL_ERROR);
+    if (UNLIKELY(!strip_padding(flags, &payload, &len)))
+        return connection_error(s, H2_PROTOCOL_ERROR);
+
+    /* Whatever's buffered is limited by the stream windows instead. */
+    if (frame_len)
+        send_window_update(s, 0, frame_len);
+
+    stream = find_stream(s, id);
+    if (!stream) {
+        if (UNLIKELY(stream_is_idle(s, id)))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+        return true;
+    }
+    if (UNLIKELY(stream->end_stream)) {
+        reset_stream(s, stream, H2_STREAM_CLOSED);
+        return true;
+    }
+
+    stream->body_len += len;
+    if (UNLIKELY(stream->content_length >= 0 &&
+                 stream->body_len > (size_t)stream->content_length)) {
+        reset_stream(s, stream, H2_PROTOCOL_ERROR);
+        return true;
+    }
+
+    if (stream->streaming_body) {
+        if (UNLIKELY(lwan_strbuf_get_length(&stream->body) -
+                         stream->body_consumed + len >
+                     DEFAULT_WINDOW_SIZE)) {
+            reset_stream(s, stream, H2_FLOW_CONTROL_ERROR);
+            return true;
+        }
+        stream->waiting_for_body = false;
+    } else if (stream->ready) {
+        /* Too large: the request has been handed over already */
+        len = 0;
+    } else if (stream->body_len >= max_post_data_size) {
+        /* Doesn't need to wait for a body that's going to be rejected. */
+        if (!request_ready(s, stream))
+            return true;
+        len = 0;
+    }
+
+    if (len && UNLIKELY(!lwan_strbuf_append_str(&stream->body,
+                                                (const char *)payload, len))) {
+        reset_stream(s, stream, H2_INTERNAL_ERROR);
+        return true;
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        end_request_body(s, stream);
+    } else {
+        /* What's buffered for lwan to read is given back once it's read */
+        size_t increment = stream->streaming_body ? frame_len - len : frame_len;
+
+        if (increment)
+            send_window_update(s, id, increment);
+    }
+
+    return true;
+}
+
+static void unblock_streams(struct h2_session *s)
+{
+    for (struct lwan_h2_stream *stream = s->streams; stream;
+         stream = stream->next)
+        stream->blocked = false;
+}
+
+static bool handle_settings(struct h2_session *s,
+                            uint8_t flags,
+                            uint32_t id,
+                            const unsigned char *payload,
+                            size_t len)
+{
+    if (UNLIKELY(id))
+        return connection_error(s, H2_PROTOCOL_ERROR);
+
+    if (flags & H2_FLAG_ACK) {
+        if (UNLIKELY(len != 0))
+            return connection_error(s, H2_FRAME_SIZE_ERROR);
+        return true;
+    }
+
+    if (UNLIKELY(len % 6 != 0))
+        return connection_error(s, H2_FRAME_SIZE_ERROR);
+
+    for (size_t i = 0; i < len; i += 6) {
+        unsigned int setting = (unsigned int)payload[i] << 8 | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+
+        switch (setting) {
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (UNLIKELY(value > 1))
+                return connection_error(s, H2_PROTOCOL_ERROR);
+            break;
+
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+            int64_t delta = (int64_t)value - s->initial_window;
+
+            if (UNLIKELY(value > MAX_WINDOW_SIZE))
+                return connection_error(s, H2_FLOW_CONTROL_ERROR);
+
+            for (struct lwan_h2_stream *stream = s->streams; stream;
+                 stream = stream->next) {
+                stream->send_window += delta;
+                if (UNLIKELY(stream->send_window > MAX_WINDOW_SIZE))
+                    return connection_error(s, H2_FLOW_CONTROL_ERROR);
+            }
+            s->initial_window = value;
+            unblock_streams(s);
+            break;
+        }
+
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (UNLIKELY(value < DEFAULT_FRAME_SIZE || value > MAX_FRAME_SIZE))
+                return connection_error(s, H2_PROTOCOL_ERROR);
+            s->max_frame_size = value;
+            break;
+        }
+    }
+
+    send_frame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    return true;
+}
+
+static bool handle_window_update(struct h2_session *s,
+                                 uint32_t id,
+                                 const unsigned char *payload,
+                                 size_t len)
+{
+    struct lwan_h2_stream *stream;
+    uint32_t increment;
+
+    if (UNLIKELY(len != 4))
+        return connection_error(s, H2_FRAME_SIZE_ERROR);
+    increment = get_u32(payload) & 0x7fffffff;
+
+    if (!id) {
+        if (UNLIKELY(!increment))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+
+        s->send_window += increment;
+        if (UNLIKELY(s->send_window > MAX_WINDOW_SIZE))
+            return connection_error(s, H2_FLOW_CONTROL_ERROR);
+
+        unblock_streams(s);
+        return true;
+    }
+
+    stream = find_stream(s, id);
+    if (!stream) {
+        if (UNLIKELY(stream_is_idle(s, id)))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+        return true;
+    }
+
+    if (UNLIKELY(!increment)) {
+        reset_stream(s, stream, H2_PROTOCOL_ERROR);
+        return true;
+    }
+
+    stream->send_window += increment;
+    if (UNLIKELY(stream->send_window > MAX_WINDOW_SIZE)) {
+        reset_stream(s, stream, H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+
+    stream->blocked = false;
+    return true;
+}
+
+static bool process_frame(struct h2_session *s,
+                          enum h2_frame_type type,
+                          uint8_t flags,
+                          uint32_t id,
+                          const unsigned char *payload,
+                          size_t len)
+{
+    struct lwan_h2_stream *stream;
+
+    /* Header blocks can't be interleaved with anything else. */
+    if (UNLIKELY(s->expect_continuation &&
+                 (type != H2_CONTINUATION || id != s->header_block_stream)))
+        return connection_error(s, H2_PROTOCOL_ERROR);
+
+    switch (type) {
+    case H2_DATA:
+        return handle_data(s, flags, id, payload, len);
+
+    case H2_HEADERS:
+        return handle_headers(s, flags, id, payload, len);
+
+    case H2_CONTINUATION:
+        if (UNLIKELY(!s->expect_continuation))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+        return append_header_fragment(s, flags, payload, len);
+
+    case H2_PRIORITY:
+        if (UNLIKELY(!id))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+        if (UNLIKELY(len != 5))
+            return connection_error(s, H2_FRAME_SIZE_ERROR);
+        return true;
+
+    case H2_RST_STREAM:
+        if (UNLIKELY(!id || stream_is_idle(s, id)))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+        if (UNLIKELY(len != 4))
+            return connection_error(s, H2_FRAME_SIZE_ERROR);
+        stream = find_stream(s, id);
+        if (stream)
+            close_stream(s, stream);
+        return true;
+
+    case H2_SETTINGS:
+        return handle_settings(s, flags, id, payload, len);
+
+    case H2_PUSH_PROMISE:
+        return connection_error(s, H2_PROTOCOL_ERROR);
+
+    case H2_PING:
+        if (UNLIKELY(id))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+        if (UNLIKELY(len != 8))
+            return connection_error(s, H2_FRAME_SIZE_ERROR);
+        if (!(flags & H2_FLAG_ACK))
+            send_frame(s, H2_PING, H2_FLAG_ACK, 0, payload, len);
+        return true;
+
+    case H2_GOAWAY:
+        if (UNLIKELY(id))
+            return connection_error(s, H2_PROTOCOL_ERROR);
+        s->goaway_received = true;
+        return true;
+
+    case H2_WINDOW_UPDATE:
+        return handle_window_update(s, id, payload, len);
+
+    default:
+        /* Unknown frame types are ignored. */
+        return true;
+    }
+}
+
+static bool process_input(struct h2_session *s)
+{
+    size_t offset = 0;
+
+    if (UNLIKELY(!s->preface_received)) {
+        const size_t preface_len = sizeof(H2_CLIENT_PREFACE) - 1;
+        size_t len = s->in_len < preface_len ? s->in_len : preface_len;
+
+        if (UNLIKELY(memcmp(s->in, H2_CLIENT_PREFACE, len)))
+            return false;
+        if (len < preface_len)
+            return true;
+
+        s->preface_received = true;
+        offset = preface_len;
+    }
+
+    while (s->in_len - offset >= FRAME_HEADER_SIZE) {
+        const unsigned char *p = s->in + offset;
+        size_t len = (size_t)p[0] << 16 | (size_t)p[1] << 8 | p[2];
+
+        /* That's what's allowed, as that's what's advertised. */
+        if (UNLIKELY(len > DEFAULT_FRAME_SIZE))
+            return connection_error(s, H2_FRAME_SIZE_ERROR);
+        if (s->in_len - offset < FRAME_HEADER_SIZE + len)
+            break;
+
+        if (UNLIKELY(!process_frame(s, p[3], p[4], get_u32(p + 5) & 0x7fffffff,
+                                    p + FRAME_HEADER_SIZE, len)))
+            return false;
+
+        offset += FRAME_HEADER_SIZE + len;
+    }
+
+    s->in_len -= offset;
+    memmove(s->in, s->in + offset, s->in_len);
+    return true;
+}
+
+/* Reads whatever is available.  The socket is edge-triggered, so *more is
+ * set if it might have more to read once there's room in the buffer. */
+static bool read_input(struct h2_session *s, bool *more)
+{
+    *more = false;
+
+    while (s->in_len < sizeof(s->in)) {
+        ssize_t n = read(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len);
+
+        if (n > 0) {
+            s->in_len += (size_t)n;
+            continue;
+        }
+        if (!n)
+            return false;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN;
+    }
+
+    *more = true;
+    return true;
+}
+
+static bool flush_output(struct h2_session *s)
+{
+    while (output_pending(s)) {
+        ssize_t n = write(s->fd, s->out + s->out_sent, output_pending(s));
+
+        if (UNLIKELY(n < 0)) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return false;
+            s->conn->flags |= CONN_WRITE_BLOCKED;
+            return true;
+        }
+
+        s->out_sent += (size_t)n;
+        s->conn->thread->metrics.bytes_sent += (unsigned long long)n;
+    }
+
+    s->out_len = s->out_sent = 0;
+    return true;
+}
+
+/*
+ * Response side: runs in the stream coroutine.
+ */
+
+static void stream_yield(struct lwan_h2_stream *stream)
+{
+    coro_yield(stream->coro, CONN_CORO_MAY_RESUME);
+}
+
+__attribute__((noreturn)) static void stream_abort(struct lwan_h2_stream *stream)
+{
+    coro_yield(stream->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+/* Waits for the flow control windows to allow for some data to be sent,
+ * and reserves room for a DATA frame with up to want bytes; *len is set to
+ * how much can be written in the returned payload. */
+static unsigned char *
+reserve_data_frame(struct lwan_h2_stream *stream, size_t want, size_t *len)
+{
+    struct h2_session *s = stream->session;
+
+    while (true) {
+        int64_t window = s->send_window < stream->send_window
+                             ? s->send_window
+                             : stream->send_window;
+
+        if (window > 0) {
+            size_t n = want;
+            unsigned char *p;
+
+            if (n > (size_t)window)
+                n = (size_t)window;
+            if (n > s->max_frame_size)
+                n = s->max_frame_size;
+            if (n > OUTPUT_HIGH_WATER)
+                n = OUTPUT_HIGH_WATER;
+
+            p = reserve_output(s, FRAME_HEADER_SIZE + n);
+            if (UNLIKELY(!p))
+                stream_abort(stream);
+
+            *len = n;
+            return p + FRAME_HEADER_SIZE;
+        }
+
+        stream->blocked = true;
+        stream_yield(stream);
+    }
+}
+
+static void commit_data_frame(struct lwan_h2_stream *stream,
+                              unsigned char *payload,
+                              size_t reserved,
+                              size_t len)
+{
+    struct h2_session *s = stream->session;
+
+    s->out_len -= reserved - len;
+    put_frame_header(payload - FRAME_HEADER_SIZE, len, H2_DATA, 0, stream->id);
+
+    s->send_window -= (int64_t)len;
+    stream->send_window -= (int64_t)len;
+
+    if (output_pending(s) >= OUTPUT_HIGH_WATER)
+        stream_yield(stream);
+}
+
+static void send_data(struct lwan_h2_stream *stream, const char *buf, size_t len)
+{
+    while (len) {
+        size_t n;
+        unsigned char *payload = reserve_data_frame(stream, len, &n);
+
+        memcpy(payload, buf, n);
+        commit_data_frame(stream, payload, n, n);
+
+        buf += n;
+        len -= n;
+    }
+}
+
+static bool send_header_block(struct h2_session *s,
+                              uint32_t stream_id,
+                              const unsigned char *block,
+                              size_t len)
+{
+    enum h2_frame_type type = H2_HEADERS;
+
+    do {
+        size_t n = len > s->max_frame_size ? s->max_frame_size : len;
+
+        if (UNLIKELY(!send_frame(s, type, n == len ? H2_FLAG_END_HEADERS : 0,
+                                 stream_id, block, n)))
+            return false;
+
+        block += n;
+        len -= n;
+        type = H2_CONTINUATION;
+    } while (len);
+
+    return true;
+}
+
+static bool has_chunked_coding(const char *value, size_t len)
+{
+    for (size_t i = 0; i + 7 <= len; i++) {
+        if (!strncasecmp(value + i, "chunked", 7))
+            return true;
+    }
+
+    return false;
+}
+
+/* Turns the head of a HTTP/1.x response into a HEADERS frame. */
+static void send_response_headers(struct lwan_h2_stream *stream)
+{
+    struct h2_session *s = stream->session;
+    char *head = lwan_strbuf_get_buffer(&stream->head);
+    size_t head_len = lwan_strbuf_get_length(&stream->head);
+    /* The empty line that ends the head */
+    const char *end = head + head_len - 2;
+    /* Each line grows by at most a few bytes when encoded */
+    size_t block_size = 2 * head_len + 16;
+    unsigned char *block, *p;
+    const char *line, *eol;
+    unsigned int status;
+    bool chunked = false;
+
+    if (UNLIKELY(head_len < 16 || strncmp(head, "HTTP/1.", 7) ||
+                 head[8] != ' '))
+        stream_abort(stream);
+    if (UNLIKELY(head[9] < '1' || head[9] > '9' || head[10] < '0' ||
+                 head[10] > '9' || head[11] < '0' || head[11] > '9'))
+        stream_abort(stream);
+    status = (unsigned int)(head[9] - '0') * 100 +
+             (unsigned int)(head[10] - '0') * 10 + (unsigned int)(head[11] - '0');
+
+    /* Protocols can't be switched in HTTP/2. */
+    if (UNLIKELY(status == 101))
+        stream_abort(stream);
+
+    block = coro_malloc(stream->coro, block_size);
+    if (UNLIKELY(!block))
+        stream_abort(stream);
+
+    p = hpack_encode_status(block, block + block_size, status);
+    if (UNLIKELY(!p))
+        stream_abort(stream);
+
+    line = memchr(head, '\n', head_len);
+    for (line = line ? line + 1 : end; line < end; line = eol + 2) {
+        const char *colon, *value;
+        size_t name_len, value_len;
+
+        eol = memmem(line, (size_t)(end - line), "\r\n", 2);
+        if (UNLIKELY(!eol))
+            stream_abort(stream);
+
+        colon = memchr(line, ':', (size_t)(eol - line));
+        if (UNLIKELY(!colon))
+            continue;
+
+        name_len = (size_t)(colon - line);
+        for (value = colon + 1; value < eol && (*value == ' ' || *value == '\t');
+             value++)
+            ;
+        value_len = (size_t)(eol - value);
+        while (value_len && (value[value_len - 1] == ' ' ||
+                             value[value_len - 1] == '\t'))
+            value_len--;
+
+        if (name_len == 17 && !strncasecmp(line, "Transfer-Encoding", 17)) {
+            chunked = has_chunked_coding(value, value_len);
+            continue;
+        }
+        if ((name_len == 10 && !strncasecmp(line, "Connection", 10)) ||
+            (name_len == 10 && !strncasecmp(line, "Keep-Alive", 10)) ||
+            (name_len == 16 && !strncasecmp(line, "Proxy-Connection", 16)) ||
+            (name_len == 7 && !strncasecmp(line, "Upgrade", 7)))
+            continue;
+
+        p = hpack_encode_field(p, block + block_size, line, name_len, value,
+                               value_len);
+        if (UNLIKELY(!p))
+            stream_abort(stream);
+    }
+
+    if (UNLIKELY(!send_header_block(s, stream->id, block, (size_t)(p - block))))
+        stream_abort(stream);
+
+    lwan_strbuf_reset(&stream->head);
+    stream->head_match = 0;
+
+    if (status < 200) {
+        /* Informational responses are followed by the final one */
+        stream->state = RESPONSE_HEAD;
+    } else {
+        stream->state = chunked ? RESPONSE_CHUNK_SIZE : RESPONSE_BODY;
+    }
+}
+
+static size_t consume_head(struct lwan_h2_stream *stream, const char *buf, size_t len)
+{
+    static const char terminator[] = "\r\n\r\n";
+    size_t i;
+
+    for (i = 0; i < len && stream->head_match < 4; i++) {
+        if (buf[i] == terminator[stream->head_match])
+            stream->head_match++;
+        else
+            stream->head_match = buf[i] == '\r';
+    }
+
+    if (UNLIKELY(lwan_strbuf_get_length(&stream->head) + i >
+                 MAX_RESPONSE_HEAD_SIZE))
+        stream_abort(stream);
+    if (UNLIKELY(!lwan_strbuf_append_str(&stream->head, buf, i)))
+        stream_abort(stream);
+
+    if (stream->head_match == 4)
+        send_response_headers(stream);
+
+    return i;
+}
+
+/* Collects the lines of the chunked coding: chunk sizes, the line break
+ * after each chunk, and trailers, which are dropped. */
+static size_t consume_line(struct lwan_h2_stream *stream, const char *buf, size_t len)
+{
+    const char *nl = memchr(buf, '\n', len);
+    size_t n = nl ? (size_t)(nl - buf) + 1 : len;
+
+    if (stream->line_len < sizeof(stream->line) - 1) {
+        size_t room = sizeof(stream->line) - 1 - stream->line_len;
+
+        memcpy(stream->line + stream->line_len, buf, n < room ? n : room);
+    }
+    stream->line_len += n;
+
+    if (!nl)
+        return n;
+
+    if (stream->state == RESPONSE_CHUNK_SIZE) {
+        char *end;
+        unsigned long size;
+
+        if (UNLIKELY(stream->line_len >= sizeof(stream->line)))
+            stream_abort(stream);
+        stream->line[stream->line_len] = '\0';
+
+        errno = 0;
+        size = strtoul(stream->line, &end, 16);
+        if (UNLIKELY(errno || end == stream->line ||
+                     !strchr(";\r\n \t", *end)))
+            stream_abort(stream);
+
+        if (size) {
+            stream->chunk_remaining = size;
+            stream->state = RESPONSE_CHUNK_DATA;
+        } else {
+            stream->state = RESPONSE_TRAILERS;
+        }
+    } else if (stream->state == RESPONSE_CHUNK_END) {
+        if (UNLIKELY(stream->line_len > 2))
+            stream_abort(stream);
+        stream->state = RESPONSE_CHUNK_SIZE;
+    } else if (stream->line_len <= 2) {
+        /* The empty line after the trailers */
+        stream->state = RESPONSE_DONE;
+    }
+
+    stream->line_len = 0;
+    return n;
+}
+
+static void stream_write(struct lwan_h2_stream *stream, const char *buf, size_t len)
+{
+    while (len) {
+        size_t used;
+
+        switch (stream->state) {
+        case RESPONSE_HEAD:
+            used = consume_head(stream, buf, len);
+            break;
+        case RESPONSE_BODY:
+            send_data(stream, buf, len);
+            used = len;
+            break;
+        case RESPONSE_CHUNK_DATA:
+            used = len < stream->chunk_remaining ? len : stream->chunk_remaining;
+            send_data(stream, buf, used);
+            stream->chunk_remaining -= used;
+            if (!stream->chunk_remaining)
+                stream->state = RESPONSE_CHUNK_END;
+            break;
+        case RESPONSE_DONE:
+            return;
+        default:
+            used = consume_line(stream, buf, len);
+        }
+
+        buf += used;
+        len -= used;
+    }
+}
+
+ssize_t lwan_h2_read(struct lwan_request *request, void *buf, size_t count)
+{
+    struct lwan_h2_stream *stream = request->h2;
+    size_t have = lwan_strbuf_get_length(&stream->body) - stream->body_consumed;
+
+    if (!have) {
+        if (stream->end_stream)
+            return 0;
+
+        stream->waiting_for_body = true;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (count > have)
+        count = have;
+    memcpy(buf, lwan_strbuf_get_buffer(&stream->body) + stream->body_consumed,
+           count);
+
+    stream->body_consumed += count;
+    if (stream->body_consumed == lwan_strbuf_get_length(&stream->body)) {
+        lwan_strbuf_reset(&stream->body);
+        stream->body_consumed = 0;
+    }
+
+    if (!stream->end_stream)
+        send_window_update(stream->session, stream->id, count);
+
+    return (ssize_t)count;
+}
+
+ssize_t lwan_h2_writev(struct lwan_request *request,
+                       const struct iovec *iov,
+                       int iov_count)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < iov_count; i++) {
+        stream_write(request->h2, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+
+    return (ssize_t)total;
+}
+
+ssize_t lwan_h2_send(struct lwan_request *request, const void *buf, size_t count)
+{
+    stream_write(request->h2, buf, count);
+    return (ssize_t)count;
+}
+
+void lwan_h2_sendfile(struct lwan_request *request,
+                      int in_fd,
+                      off_t offset,
+                      size_t count,
+                      const char *header,
+                      size_t header_len)
+{
+    struct lwan_h2_stream *stream = request->h2;
+
+    stream_write(stream, header, header_len);
+    if (UNLIKELY(stream->state != RESPONSE_BODY))
+        stream_abort(stream);
+
+    /* Read straight into DATA frames */
+    while (count) {
+        size_t n;
+        unsigned char *payload = reserve_data_frame(stream, count, &n);
+        ssize_t r = pread(in_fd, payload, n, offset);
+
+        if (UNLIKELY(r <= 0)) {
+            stream->session->out_len -= FRAME_HEADER_SIZE + n;
+            if (r < 0 && errno == EINTR)
+                continue;
+            stream_abort(stream);
+        }
+
+        commit_data_frame(stream, payload, n, (size_t)r);
+        offset += r;
+        count -= (size_t)r;
+    }
+}
+
+static void finish_response(struct lwan_h2_stream *stream)
+{
+    struct h2_session *s = stream->session;
+
+    /* Nothing has been sent, or just part of the head */
+    if (UNLIKELY(stream->state == RESPONSE_HEAD))
+        stream_abort(stream);
+
+    if (UNLIKELY(!send_frame(s, H2_DATA, H2_FLAG_END_STREAM, stream->id, NULL, 0)))
+        stream_abort(stream);
+
+    /* The response might have been sent before the whole request was
+     * received (e.g. if the body was too large); no need to send it. */
+    if (!stream->end_stream)
+        send_rst_stream(s, stream->id, H2_NO_ERROR);
+}
+
+__attribute__((noreturn)) static int stream_coro(struct coro *coro, void *data)
+{
+    struct lwan_h2_stream *stream = data;
+    struct h2_session *s = stream->session;
+    struct lwan_strbuf strbuf;
+    char response_buffer[1024];
+    struct lwan_proxy proxy;
+    struct lwan_request_buffer buffer = {
+        .value = lwan_strbuf_get_buffer(&stream->request),
+        .len = lwan_strbuf_get_length(&stream->request),
+    };
+
+    /* Never grown nor shrunk: there's no thread to take buffers from. */
+    buffer.small = buffer.value;
+    buffer.size = buffer.len + 1;
+
+    if (UNLIKELY(!lwan_strbuf_init_with_fixed_buffer(&strbuf, response_buffer,
+                                                     sizeof(response_buffer)))) {
+        coro_yield(coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+    coro_defer(coro, CORO_DEFER(lwan_strbuf_free), &strbuf);
+
+    struct lwan_request request = {
+        .conn = s->conn,
+        .fd = s->fd,
+        .response = {
+            .buffer = &strbuf
+        },
+        .flags = REQUEST_IS_HTTP_2 |
+                 s->lwan->config.allow_cors << REQUEST_ALLOW_CORS_SHIFT,
+        .proxy = &proxy,
+        .h2 = stream,
+    };
+
+    /* The whole request is in the buffer, as if it had been pipelined. */
+    lwan_process_request(s->lwan, &request, &buffer, buffer.value);
+    finish_response(stream);
+
+    coro_yield(coro, CONN_CORO_FINISHED);
+    __builtin_unreachable();
+}
+
+/*
+ * Connection side.
+ */
+
+static void resume_stream(struct h2_session *s, struct lwan_h2_stream *stream)
+{
+    int yield_value;
+
+    if (!stream->coro) {
+        stream->coro = coro_new(&stream->switcher, stream_coro, stream);
+        if (UNLIKELY(!stream->coro)) {
+            reset_stream(s, stream, H2_REFUSED_STREAM);
+            return;
+        }
+    }
+
+    s->conn->coro = stream->coro;
+    yield_value = coro_resume(stream->coro);
+    s->conn->coro = s->coro;
+
+    switch (yield_value) {
+    case CONN_CORO_MAY_RESUME:
+        break;
+    case CONN_CORO_SUSPEND:
+        s->sleeping = stream;
+        break;
+    case CONN_CORO_FINISHED:
+        close_stream(s, stream);
+        break;
+    default:
+        reset_stream(s, stream, H2_INTERNAL_ERROR);
+    }
+}
+
+static ALWAYS_INLINE bool stream_is_runnable(const struct lwan_h2_stream *stream)
+{
+    return stream->ready && !stream->blocked && !stream->waiting_for_body;
+}
+
+static void run_streams(struct h2_session *s)
+{
+    struct lwan_h2_stream *stream, *next;
+
+    if (s->sleeping) {
+        stream = s->sleeping;
+        s->sleeping = NULL;
+
+        resume_stream(s, stream);
+        if (s->sleeping)
+            return;
+    }
+
+    for (stream = s->streams; stream; stream = next) {
+        next = stream->next;
+
+        if (output_pending(s) >= OUTPUT_HIGH_WATER)
+            return;
+
+        if (stream_is_runnable(stream)) {
+            resume_stream(s, stream);
+            if (s->sleeping)
+                return;
+        }
+    }
+}
+
+static bool has_runnable_streams(const struct h2_session *s)
+{
+    for (const struct lwan_h2_stream *stream = s->streams; stream;
+         stream = stream->next) {
+        if (stream_is_runnable(stream))
+            return true;
+    }
+
+    return false;
+}
+
+static void free_session(void *data)
+{
+    struct h2_session *s = data;
+
+    while (s->streams)
+        close_stream(s, s->streams);
+
+    hpack_decoder_free(&s->decoder);
+    lwan_strbuf_free(&s->header_block);
+    free(s->out);
+    free(s);
+}
+
+void lwan_h2_serve(struct lwan *l,
+                   struct lwan_connection *conn,
+                   int fd,
+                   const char *buffered,
+                   size_t buffered_len)
+{
+    struct coro *coro = conn->coro;
+    /* Too large for the coroutine stack, even as a temporary. */
+    struct h2_session *s = calloc(1, sizeof(*s));
+
+    if (UNLIKELY(!s)) {
+        coro_yield(coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    s->lwan = l;
+    s->conn = conn;
+    s->coro = coro;
+    s->fd = fd;
+    s->send_window = DEFAULT_WINDOW_SIZE;
+    s->initial_window = DEFAULT_WINDOW_SIZE;
+    s->max_frame_size = DEFAULT_FRAME_SIZE;
+    hpack_decoder_init(&s->decoder);
+    coro_defer(coro, free_session, s);
+
+    if (buffered_len > sizeof(s->in))
+        buffered_len = sizeof(s->in);
+    memcpy(s->in, buffered, buffered_len);
+    s->in_len = buffered_len;
+
+    send_settings(s);
+
+    while (true) {
+        bool more_input;
+
+        if (UNLIKELY(!read_input(s, &more_input)))
+            break;
+        if (UNLIKELY(!process_input(s)))
+            break;
+
+        if (UNLIKELY(ATOMIC_READ(l->draining)) && !s->goaway_sent)
+            send_goaway(s, H2_NO_ERROR);
+
+        run_streams(s);
+
+        if (UNLIKELY(!flush_output(s) || s->failed))
+            break;
+        if ((s->goaway_sent || s->goaway_received) && !s->n_streams &&
+            !output_pending(s))
+            break;
+
+        if (s->sleeping) {
+            coro_yield(coro, CONN_CORO_SUSPEND);
+        } else if (output_pending(s) || more_input || has_runnable_streams(s)) {
+            conn->flags &= ~CONN_MUST_READ;
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+        } else {
+            conn->flags |= CONN_MUST_READ;
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+        }
+    }
+
+    /* Whatever's left, such as a GOAWAY, is sent if it can be. */
+    flush_output(s);
+
+    coro_yield(coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
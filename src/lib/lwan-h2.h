@@ -0,0 +1,52 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "lwan.h"
+
+#define H2_CLIENT_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+/* The part of it that's read as if it were a HTTP/1.x request */
+#define H2_CLIENT_PREFACE_HEAD_LEN (sizeof("PRI * HTTP/2.0\r\n\r\n") - 1)
+
+/* Takes over the connection: each request is handled in a coroutine of its
+ * own, as if it were a HTTP/1.1 request, and its response is translated
+ * into frames by the functions below.  Bytes read past the preface (or
+ * part of it) are passed in buffered.  Never returns. */
+void lwan_h2_serve(struct lwan *l,
+                   struct lwan_connection *conn,
+                   int fd,
+                   const char *buffered,
+                   size_t buffered_len) __attribute__((noreturn));
+
+ssize_t lwan_h2_read(struct lwan_request *request, void *buf, size_t count);
+ssize_t lwan_h2_writev(struct lwan_request *request,
+                       const struct iovec *iov,
+                       int iov_count);
+ssize_t lwan_h2_send(struct lwan_request *request, const void *buf, size_t count);
+void lwan_h2_sendfile(struct lwan_request *request,
+                      int in_fd,
+                      off_t offset,
+                      size_t count,
+                      const char *header,
+                      size_t header_len);
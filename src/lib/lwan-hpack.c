@@ -0,0 +1,551 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "lwan-private.h"
+
+#include "lwan-hpack.h"
+
+struct hpack_entry {
+    size_t name_len;
+    size_t value_len;
+    char data[];
+};
+
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_TABLE_ENTRIES ((unsigned int)N_ELEMENTS(static_table) - 1)
+#define ENTRY_OVERHEAD 32
+
+/* Lengths of the Huffman codes for each octet, plus EOS (256), from
+ * Appendix B of RFC 7541.  The code is canonical: codes of the same length
+ * are consecutive, in symbol order, so that's all that's needed to decode
+ * it. */
+static const uint8_t huffman_code_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+#define HUFFMAN_MAX_LEN 30
+#define HUFFMAN_EOS 256
+
+static uint32_t huffman_first_code[HUFFMAN_MAX_LEN + 1];
+static uint16_t huffman_count[HUFFMAN_MAX_LEN + 1];
+static uint16_t huffman_offset[HUFFMAN_MAX_LEN + 1];
+static uint16_t huffman_symbols[257];
+
+__attribute__((constructor)) static void build_huffman_decoder(void)
+{
+    uint32_t code = 0;
+    uint16_t n = 0;
+
+    for (unsigned int len = 1; len <= HUFFMAN_MAX_LEN; len++) {
+        huffman_first_code[len] = code;
+        huffman_offset[len] = n;
+
+        for (uint16_t sym = 0; sym < N_ELEMENTS(huffman_code_len); sym++) {
+            if (huffman_code_len[sym] == len)
+                huffman_symbols[n++] = sym;
+        }
+
+        huffman_count[len] = (uint16_t)(n - huffman_offset[len]);
+        code = (code + huffman_count[len]) << 1;
+    }
+}
+
+static ssize_t
+huffman_decode(const unsigned char *src, size_t len, char *dst)
+{
+    unsigned int code_len = 0;
+    uint32_t code = 0;
+    char *p = dst;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = code << 1 | ((src[i] >> bit) & 1);
+            code_len++;
+
+            /* Wraps around if the code is shorter than this length. */
+            uint32_t index = code - huffman_first_code[code_len];
+            if (index < huffman_count[code_len]) {
+                uint16_t sym = huffman_symbols[huffman_offset[code_len] + index];
+
+                if (UNLIKELY(sym == HUFFMAN_EOS))
+                    return -1;
+
+                *p++ = (char)sym;
+                code = 0;
+                code_len = 0;
+            } else if (UNLIKELY(code_len == HUFFMAN_MAX_LEN)) {
+                return -1;
+            }
+        }
+    }
+
+    /* Padding is shorter than a byte, and a prefix of EOS (all ones). */
+    if (UNLIKELY(code_len > 7 || code != (1u << code_len) - 1))
+        return -1;
+
+    return p - dst;
+}
+
+static bool
+decode_int(const unsigned char **p, const unsigned char *end,
+           unsigned int prefix_bits, size_t *value)
+{
+    const size_t max_prefix = (1u << prefix_bits) - 1;
+    size_t v;
+
+    if (UNLIKELY(*p >= end))
+        return false;
+
+    v = **p & max_prefix;
+    (*p)++;
+    if (v < max_prefix) {
+        *value = v;
+        return true;
+    }
+
+    for (unsigned int shift = 0; *p < end && shift <= 28; shift += 7) {
+        unsigned char b = *(*p)++;
+
+        v += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+decode_string(struct hpack_decoder *decoder,
+              const unsigned char **p,
+              const unsigned char *end,
+              size_t *scratch_used,
+              const char **out,
+              size_t *out_len)
+{
+    bool huffman;
+    size_t len;
+
+    if (UNLIKELY(*p >= end))
+        return false;
+
+    huffman = **p & 0x80;
+    if (UNLIKELY(!decode_int(p, end, 7, &len)))
+        return false;
+    if (UNLIKELY(len > (size_t)(end - *p)))
+        return false;
+
+    if (huffman) {
+        char *dst = decoder->scratch + *scratch_used;
+        ssize_t decoded = huffman_decode(*p, len, dst);
+
+        if (UNLIKELY(decoded < 0))
+            return false;
+
+        *out = dst;
+        *out_len = (size_t)decoded;
+        *scratch_used += (size_t)decoded;
+    } else {
+        *out = (const char *)*p;
+        *out_len = len;
+    }
+
+    *p += len;
+    return true;
+}
+
+static struct hpack_entry *
+dynamic_entry(const struct hpack_decoder *decoder, size_t index)
+{
+    return decoder->entries[(decoder->first + index) % HPACK_MAX_ENTRIES];
+}
+
+static void evict_until(struct hpack_decoder *decoder, size_t max_size)
+{
+    while (decoder->count && decoder->size > max_size) {
+        struct hpack_entry *oldest = dynamic_entry(decoder, decoder->count - 1);
+
+        decoder->size -= oldest->name_len + oldest->value_len + ENTRY_OVERHEAD;
+        decoder->count--;
+        free(oldest);
+    }
+}
+
+static void add_entry(struct hpack_decoder *decoder,
+                      const char *name,
+                      size_t name_len,
+                      const char *value,
+                      size_t value_len)
+{
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+    struct hpack_entry *entry;
+
+    /* Entries larger than the table just empty it. */
+    if (size > decoder->max_size) {
+        evict_until(decoder, 0);
+        return;
+    }
+
+    /* Copied before evicting, as the name might come from an entry that's
+     * about to be evicted. */
+    entry = malloc(sizeof(*entry) + name_len + value_len);
+    if (UNLIKELY(!entry)) {
+        /* Keeping the table consistent with the encoder's matters more
+         * than keeping this entry. */
+        evict_until(decoder, 0);
+        return;
+    }
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    memcpy(entry->data, name, name_len);
+    memcpy(entry->data + name_len, value, value_len);
+
+    evict_until(decoder, decoder->max_size - size);
+
+    decoder->first = (decoder->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    decoder->entries[decoder->first] = entry;
+    decoder->count++;
+    decoder->size += size;
+}
+
+static bool lookup(const struct hpack_decoder *decoder,
+                   size_t index,
+                   const char **name,
+                   size_t *name_len,
+                   const char **value,
+                   size_t *value_len)
+{
+    if (UNLIKELY(!index))
+        return false;
+
+    if (index <= STATIC_TABLE_ENTRIES) {
+        *name = static_table[index].name;
+        *name_len = strlen(*name);
+        *value = static_table[index].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+
+    index -= STATIC_TABLE_ENTRIES + 1;
+    if (UNLIKELY(index >= decoder->count))
+        return false;
+
+    const struct hpack_entry *entry = dynamic_entry(decoder, index);
+    *name = entry->data;
+    *name_len = entry->name_len;
+    *value = entry->data + entry->name_len;
+    *value_len = entry->value_len;
+    return true;
+}
+
+void hpack_decoder_init(struct hpack_decoder *decoder)
+{
+    *decoder = (struct hpack_decoder){.max_size = HPACK_DEFAULT_TABLE_SIZE};
+}
+
+void hpack_decoder_free(struct hpack_decoder *decoder)
+{
+    evict_until(decoder, 0);
+    free(decoder->scratch);
+}
+
+bool hpack_decode(struct hpack_decoder *decoder,
+                  const unsigned char *block,
+                  size_t len,
+                  hpack_field_cb callback,
+                  void *data)
+{
+    const unsigned char *p = block;
+    const unsigned char *end = block + len;
+    bool seen_field = false;
+
+    /* Huffman coded strings are at least 5 bits per character. */
+    size_t scratch_needed = len / 5 * 8 + 8;
+    if (scratch_needed > decoder->scratch_size) {
+        char *scratch = realloc(decoder->scratch, scratch_needed);
+
+        if (UNLIKELY(!scratch))
+            return false;
+        decoder->scratch = scratch;
+        decoder->scratch_size = scratch_needed;
+    }
+
+    while (p < end) {
+        const char *name, *value;
+        size_t name_len, value_len;
+        size_t scratch_used = 0;
+        size_t index;
+
+        if (*p & 0x80) {
+            /* Indexed field */
+            if (UNLIKELY(!decode_int(&p, end, 7, &index)))
+                return false;
+            if (UNLIKELY(!lookup(decoder, index, &name, &name_len, &value,
+                                 &value_len)))
+                return false;
+
+            callback(data, name, name_len, value, value_len);
+        } else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update, only allowed before fields */
+            if (UNLIKELY(seen_field))
+                return false;
+            if (UNLIKELY(!decode_int(&p, end, 5, &index)))
+                return false;
+            if (UNLIKELY(index > HPACK_DEFAULT_TABLE_SIZE))
+                return false;
+
+            decoder->max_size = index;
+            evict_until(decoder, index);
+            continue;
+        } else {
+            /* Literal field, with incremental indexing (01), without
+             * indexing (0000) or never indexed (0001). */
+            bool indexing = (*p & 0xc0) == 0x40;
+
+            if (UNLIKELY(!decode_int(&p, end, indexing ? 6 : 4, &index)))
+                return false;
+
+            if (index) {
+                if (UNLIKELY(!lookup(decoder, index, &name, &name_len, &value,
+                                     &value_len)))
+                    return false;
+            } else if (UNLIKELY(!decode_string(decoder, &p, end, &scratch_used,
+                                               &name, &name_len))) {
+                return false;
+            }
+
+            if (UNLIKELY(!decode_string(decoder, &p, end, &scratch_used, &value,
+                                        &value_len)))
+                return false;
+
+            callback(data, name, name_len, value, value_len);
+
+            if (indexing)
+                add_entry(decoder, name, name_len, value, value_len);
+        }
+
+        seen_field = true;
+    }
+
+    return true;
+}
+
+static unsigned char *encode_int(unsigned char *p,
+                                 unsigned char *end,
+                                 unsigned char first_byte,
+                                 unsigned int prefix_bits,
+                                 size_t value)
+{
+    const size_t max_prefix = (1u << prefix_bits) - 1;
+
+    if (UNLIKELY(p >= end))
+        return NULL;
+
+    if (value < max_prefix) {
+        *p++ = (unsigned char)(first_byte | value);
+        return p;
+    }
+
+    *p++ = (unsigned char)(first_byte | max_prefix);
+    for (value -= max_prefix; value >= 0x80; value >>= 7) {
+        if (UNLIKELY(p >= end))
+            return NULL;
+        *p++ = (unsigned char)((value & 0x7f) | 0x80);
+    }
+
+    if (UNLIKELY(p >= end))
+        return NULL;
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+static unsigned char *encode_string(unsigned char *p,
+                                    unsigned char *end,
+                                    const char *str,
+                                    size_t len,
+                                    bool lowercase)
+{
+    p = encode_int(p, end, 0, 7, len);
+    if (UNLIKELY(!p || (size_t)(end - p) < len))
+        return NULL;
+
+    if (!lowercase)
+        return mempcpy(p, str, len);
+
+    for (size_t i = 0; i < len; i++)
+        *p++ = (unsigned char)((str[i] >= 'A' && str[i] <= 'Z') ? (str[i] | 0x20)
+                                                               : str[i]);
+    return p;
+}
+
+static unsigned int static_name_index(const char *name, size_t len)
+{
+    for (unsigned int i = 1; i <= STATIC_TABLE_ENTRIES; i++) {
+        if (!strncasecmp(static_table[i].name, name, len) &&
+            !static_table[i].name[len])
+            return i;
+    }
+
+    return 0;
+}
+
+unsigned char *
+hpack_encode_status(unsigned char *p, unsigned char *end, unsigned int status)
+{
+    char digits[3];
+
+    switch (status) {
+    case 200:
+        return encode_int(p, end, 0x80, 7, 8);
+    case 204:
+        return encode_int(p, end, 0x80, 7, 9);
+    case 206:
+        return encode_int(p, end, 0x80, 7, 10);
+    case 304:
+        return encode_int(p, end, 0x80, 7, 11);
+    case 400:
+        return encode_int(p, end, 0x80, 7, 12);
+    case 404:
+        return encode_int(p, end, 0x80, 7, 13);
+    case 500:
+        return encode_int(p, end, 0x80, 7, 14);
+    }
+
+    if (UNLIKELY(status < 100 || status > 999))
+        return NULL;
+
+    digits[0] = (char)('0' + status / 100);
+    digits[1] = (char)('0' + status / 10 % 10);
+    digits[2] = (char)('0' + status % 10);
+
+    /* Literal without indexing, name from the static table */
+    p = encode_int(p, end, 0x00, 4, 8);
+    return p ? encode_string(p, end, digits, sizeof(digits), false) : NULL;
+}
+
+unsigned char *hpack_encode_field(unsigned char *p,
+                                  unsigned char *end,
+                                  const char *name,
+                                  size_t name_len,
+                                  const char *value,
+                                  size_t value_len)
+{
+    unsigned int index = static_name_index(name, name_len);
+
+    if (index) {
+        p = encode_int(p, end, 0x00, 4, index);
+    } else {
+        p = encode_int(p, end, 0x00, 4, 0);
+        if (LIKELY(p))
+            p = encode_string(p, end, name, name_len, true);
+    }
+
+    return p ? encode_string(p, end, value, value_len, false) : NULL;
+}
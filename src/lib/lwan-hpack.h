@@ -0,0 +1,74 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* HPACK (RFC 7541), as needed by lwan-h2.c.  The decoder handles the whole
+ * format, including the dynamic table and Huffman coded strings; the
+ * encoder only emits literals that aren't added to the peer's dynamic
+ * table, which keeps it stateless. */
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_MAX_ENTRIES (HPACK_DEFAULT_TABLE_SIZE / 32)
+
+struct hpack_entry;
+
+struct hpack_decoder {
+    struct hpack_entry *entries[HPACK_MAX_ENTRIES];
+    unsigned int first, count;
+    size_t size, max_size;
+
+    char *scratch;
+    size_t scratch_size;
+};
+
+/* Called for every field in a header block, in order.  Strings are only
+ * valid during the call. */
+typedef void (*hpack_field_cb)(void *data,
+                               const char *name,
+                               size_t name_len,
+                               const char *value,
+                               size_t value_len);
+
+void hpack_decoder_init(struct hpack_decoder *decoder);
+void hpack_decoder_free(struct hpack_decoder *decoder);
+
+/* Returns false on errors, which are connection errors in HTTP/2: the
+ * state of the dynamic table can't be trusted anymore. */
+bool hpack_decode(struct hpack_decoder *decoder,
+                  const unsigned char *block,
+                  size_t len,
+                  hpack_field_cb callback,
+                  void *data);
+
+/* Both return the position past what's been written, or NULL if it
+ * wouldn't fit before end.  Names are lowercased, as HTTP/2 requires. */
+unsigned char *
+hpack_encode_status(unsigned char *p, unsigned char *end, unsigned int status);
+unsigned char *hpack_encode_field(unsigned char *p,
+                                  unsigned char *end,
+                                  const char *name,
+                                  size_t name_len,
+                                  const char *value,
+                                  size_t value_len);
@@ -17,22 +17,111 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include "base64.h"
+#include "lwan-private.h"
 #include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
+#include "sha256.h"
+
+/* Passwords are never kept in memory: only a salted, iterated SHA-256 of
+ * each one is.  This makes verifying a password deliberately slow, so each
+ * thread remembers a few Authorization headers that were recently
+ * accepted (again, only as salted digests), letting clients that repeat
+ * the same credentials skip the verification. */
+#define VERIFIER_ROUNDS 1024
+#define SALT_LENGTH 16
+#define AUTHORIZED_CACHE_SIZE 8
+
+struct password_verifier {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
 
 struct realm_password_file_t {
     struct cache_entry base;
     struct hash *entries;
+    /* Compared against when the username isn't known, so that the time
+     * taken doesn't depend on whether it exists. */
+    struct password_verifier dummy;
+    unsigned char salt[SALT_LENGTH];
+    unsigned int serial;
+};
+
+struct authorized_credential {
+    unsigned int serial;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
 };
 
+static __thread struct {
+    struct authorized_credential entries[AUTHORIZED_CACHE_SIZE];
+    unsigned int next;
+} authorized_cache;
+
 static struct cache *realm_password_cache = NULL;
+static unsigned int realm_serial;
+
+static bool fill_random(void *buffer, size_t len)
+{
+#ifdef SYS_getrandom
+    if (syscall(SYS_getrandom, buffer, len, 0) == (long int)len)
+        return true;
+#endif
+
+    int fd = open("/dev/urandom", O_CLOEXEC | O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool ok = read(fd, buffer, len) == (ssize_t)len;
+    close(fd);
+
+    return ok;
+}
+
+static bool constant_time_equal(const unsigned char *a,
+                                const unsigned char *b,
+                                size_t len)
+{
+    unsigned char diff = 0;
+
+    for (size_t i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+
+    return !diff;
+}
+
+static void salted_digest(const struct realm_password_file_t *rpf,
+                          const void *data,
+                          size_t len,
+                          unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    struct sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, rpf->salt, sizeof(rpf->salt));
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+static void compute_verifier(const struct realm_password_file_t *rpf,
+                             const char *password,
+                             size_t len,
+                             struct password_verifier *verifier)
+{
+    salted_digest(rpf, password, len, verifier->digest);
+
+    for (int round = 1; round < VERIFIER_ROUNDS; round++)
+        salted_digest(rpf, verifier->digest, sizeof(verifier->digest),
+                      verifier->digest);
+}
 
 static void fourty_two_and_free(void *str)
 {
@@ -44,6 +133,14 @@ static void fourty_two_and_free(void *str)
     }
 }
 
+static void free_verifier(void *data)
+{
+    if (LIKELY(data)) {
+        explicit_bzero(data, sizeof(struct password_verifier));
+        free(data);
+    }
+}
+
 static struct cache_entry *create_realm_file(
           const char *key,
           void *context __attribute__((unused)))
@@ -55,34 +152,41 @@ static struct cache_entry *create_realm_file(
     if (UNLIKELY(!rpf))
         return NULL;
 
-    rpf->entries = hash_str_new(fourty_two_and_free, fourty_two_and_free);
+    rpf->entries = hash_str_new(fourty_two_and_free, free_verifier);
     if (UNLIKELY(!rpf->entries))
         goto error_no_close;
 
+    if (UNLIKELY(!fill_random(rpf->salt, sizeof(rpf->salt)))) {
+        lwan_status_perror("Could not generate salt for password file");
+        goto error_no_close;
+    }
+    compute_verifier(rpf, "", 0, &rpf->dummy);
+    rpf->serial = ATOMIC_INC(realm_serial);
+
     f = config_open(key);
     if (!f)
         goto error_no_close;
 
     while (config_read_line(f, &l)) {
-        /* FIXME: Storing plain-text passwords in memory isn't a good idea. */
         switch (l.type) {
         case CONFIG_LINE_TYPE_LINE: {
             char *username = strdup(l.key);
             if (!username)
                 goto error;
 
-            char *password = strdup(l.value);
-            if (!password) {
+            struct password_verifier *verifier = malloc(sizeof(*verifier));
+            if (!verifier) {
                 free(username);
                 goto error;
             }
+            compute_verifier(rpf, l.value, strlen(l.value), verifier);
 
-            int err = hash_add_unique(rpf->entries, username, password);
+            int err = hash_add_unique(rpf->entries, username, verifier);
             if (LIKELY(!err))
                 continue;
 
             free(username);
-            free(password);
+            free_verifier(verifier);
 
             if (err == -EEXIST) {
                 lwan_status_warning(
@@ -106,6 +210,7 @@ static struct cache_entry *create_realm_file(
     }
 
     config_close(f);
+    rpf->base.size = sizeof(*rpf);
     return (struct cache_entry *)rpf;
 
 error:
@@ -121,6 +226,7 @@ static void destroy_realm_file(struct cache_entry *entry,
 {
     struct realm_password_file_t *rpf = (struct realm_password_file_t *)entry;
     hash_free(rpf->entries);
+    explicit_bzero(rpf, sizeof(*rpf));
     free(rpf);
 }
 
@@ -139,16 +245,45 @@ lwan_http_authorize_shutdown(void)
     cache_destroy(realm_password_cache);
 }
 
+static bool
+is_recently_authorized(const struct realm_password_file_t *rpf,
+                       const unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    bool found = false;
+
+    for (int i = 0; i < AUTHORIZED_CACHE_SIZE; i++) {
+        const struct authorized_credential *cred = &authorized_cache.entries[i];
+
+        found |= cred->serial == rpf->serial &&
+                 constant_time_equal(cred->digest, digest, SHA256_DIGEST_LENGTH);
+    }
+
+    return found;
+}
+
+static void
+remember_authorized(const struct realm_password_file_t *rpf,
+                    const unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    struct authorized_credential *cred =
+        &authorized_cache.entries[authorized_cache.next++ % AUTHORIZED_CACHE_SIZE];
+
+    cred->serial = rpf->serial;
+    memcpy(cred->digest, digest, SHA256_DIGEST_LENGTH);
+}
+
 static bool
 authorize(struct coro *coro,
     struct lwan_value *authorization,
     const char *password_file)
 {
     struct realm_password_file_t *rpf;
+    const struct password_verifier *expected;
+    struct password_verifier verifier;
+    unsigned char header_digest[SHA256_DIGEST_LENGTH];
     unsigned char *decoded;
     char *colon;
     char *password;
-    char *looked_password;
     size_t decoded_len;
     bool password_ok = false;
 
@@ -157,6 +292,12 @@ authorize(struct coro *coro,
     if (UNLIKELY(!rpf))
         return false;
 
+    /* Serials start at 1, so that empty cache slots never match. */
+    salted_digest(rpf, authorization->value, authorization->len,
+                  header_digest);
+    if (is_recently_authorized(rpf, header_digest))
+        return true;
+
     decoded = base64_decode((unsigned char *)authorization->value,
                             authorization->len, &decoded_len);
     if (UNLIKELY(!decoded))
@@ -169,12 +310,22 @@ authorize(struct coro *coro,
     *colon = '\0';
     password = colon + 1;
 
-    looked_password = hash_find(rpf->entries, decoded);
-    if (looked_password)
-        password_ok = streq(password, looked_password);
+    expected = hash_find(rpf->entries, decoded);
+    compute_verifier(rpf, password,
+                     decoded_len - (size_t)(password - (char *)decoded),
+                     &verifier);
+    password_ok = constant_time_equal(expected ? expected->digest
+                                               : rpf->dummy.digest,
+                                      verifier.digest, sizeof(verifier.digest));
+    password_ok &= expected != NULL;
+
+    if (password_ok)
+        remember_authorized(rpf, header_digest);
 
 out:
+    explicit_bzero(decoded, decoded_len);
     free(decoded);
+    explicit_bzero(&verifier, sizeof(verifier));
     return password_ok;
 }
 
@@ -25,25 +25,109 @@
 #include <sys/socket.h>
 #include <sys/sendfile.h>
 
-#include "lwan.h"
+#include "lwan-private.h"
+#include "lwan-h2.h"
 #include "lwan-io-wrappers.h"
+#include "lwan-uring.h"
+#include "lwan-zerocopy.h"
 
 static const int MAX_FAILED_TRIES = 5;
 
+static ALWAYS_INLINE void
+init_write_deadline(struct lwan_deadline *deadline,
+                    struct lwan_request *request)
+{
+    lwan_deadline_init(deadline, request,
+                       request->conn->thread->lwan->config.write_timeout);
+}
+
+/* Yields until the socket is writable again, unless the client has been
+ * reading the response too slowly. */
+static void
+wait_for_client(struct lwan_request *request, struct lwan_deadline *deadline,
+                size_t written)
+{
+    if (UNLIKELY(!lwan_deadline_wait(deadline, request, written))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+}
+
+#if defined(USE_IO_URING)
+static ssize_t uring_result(int res)
+{
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+#endif
+
+static ALWAYS_INLINE ssize_t
+do_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
+{
+#if defined(USE_IO_URING)
+    struct lwan_uring *ring = request->conn->thread->uring;
+    struct io_uring_sqe *sqe;
+
+    if (LIKELY(ring) && LIKELY((sqe = lwan_uring_get_sqe(ring)))) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = request->fd;
+        sqe->addr = (__u64)(uintptr_t)iov;
+        sqe->len = (__u32)iov_count;
+        return uring_result(lwan_uring_await(request, sqe));
+    }
+#endif
+
+    return writev(request->fd, iov, iov_count);
+}
+
+static ALWAYS_INLINE ssize_t
+do_send(struct lwan_request *request, const void *buf, size_t count, int flags)
+{
+#if defined(USE_IO_URING)
+    struct lwan_uring *ring = request->conn->thread->uring;
+    struct io_uring_sqe *sqe;
+
+    if (LIKELY(ring) && LIKELY((sqe = lwan_uring_get_sqe(ring)))) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = request->fd;
+        sqe->addr = (__u64)(uintptr_t)buf;
+        sqe->len = (__u32)count;
+        sqe->msg_flags = (__u32)flags;
+        return uring_result(lwan_uring_await(request, sqe));
+    }
+#endif
+
+    return send(request->fd, buf, count, flags);
+}
+
 ssize_t
 lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
 {
+    struct lwan_deadline deadline;
     ssize_t total_written = 0;
     int curr_iov = 0;
 
+    if (UNLIKELY(request->flags & REQUEST_IS_HTTP_2))
+        return lwan_h2_writev(request, iov, iov_count);
+
+    lwan_flush_batch_if_needed(request);
+    init_write_deadline(&deadline, request);
+
     for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = writev(request->fd, iov + curr_iov, iov_count - curr_iov);
+        ssize_t written = do_writev(request, iov + curr_iov, iov_count - curr_iov);
         if (UNLIKELY(written < 0)) {
             /* FIXME: Consider short writes as another try as well? */
             tries--;
 
             switch (errno) {
             case EAGAIN:
+                request->conn->flags |= CONN_WRITE_BLOCKED;
+                /* fallthrough */
             case EINTR:
                 goto try_again;
             default:
@@ -52,20 +136,23 @@ lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
         }
 
         total_written += written;
+        request->conn->thread->metrics.bytes_sent += (unsigned long long)written;
 
         while (curr_iov < iov_count && written >= (ssize_t)iov[curr_iov].iov_len) {
             written -= (ssize_t)iov[curr_iov].iov_len;
             curr_iov++;
         }
 
-        if (curr_iov == iov_count)
+        if (curr_iov == iov_count) {
+            lwan_deadline_done(request);
             return total_written;
+        }
 
         iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
         iov[curr_iov].iov_len -= (size_t)written;
 
 try_again:
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wait_for_client(request, &deadline, (size_t)total_written);
     }
 
 out:
@@ -76,15 +163,25 @@ out:
 ssize_t
 lwan_send(struct lwan_request *request, const void *buf, size_t count, int flags)
 {
+    struct lwan_deadline deadline;
     ssize_t total_sent = 0;
 
+    if (UNLIKELY(request->flags & REQUEST_IS_HTTP_2))
+        return lwan_h2_send(request, buf, count);
+
+    lwan_flush_batch_if_needed(request);
+    init_write_deadline(&deadline, request);
+
     for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = send(request->fd, buf, count, flags);
+        ssize_t written =
+            do_send(request, buf, count - (size_t)total_sent, flags);
         if (UNLIKELY(written < 0)) {
             tries--;
 
             switch (errno) {
             case EAGAIN:
+                request->conn->flags |= CONN_WRITE_BLOCKED;
+                /* fallthrough */
             case EINTR:
                 goto try_again;
             default:
@@ -93,13 +190,16 @@ lwan_send(struct lwan_request *request, const void *buf, size_t count, int flags
         }
 
         total_sent += written;
-        if ((size_t)total_sent == count)
+        request->conn->thread->metrics.bytes_sent += (unsigned long long)written;
+        if ((size_t)total_sent == count) {
+            lwan_deadline_done(request);
             return total_sent;
+        }
         if ((size_t)total_sent < count)
             buf = (char *)buf + written;
 
 try_again:
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wait_for_client(request, &deadline, (size_t)total_sent);
     }
 
 out:
@@ -107,7 +207,110 @@ out:
     __builtin_unreachable();
 }
 
+ssize_t
+lwan_writev_zerocopy(struct lwan_request *request, struct iovec *iov,
+                     int iov_count, void (*release)(void *data1, void *data2),
+                     void *data1, void *data2)
+{
+    struct coro *coro = request->conn->coro;
+    size_t generation = coro_deferred_get_generation(coro);
+    struct zerocopy_pending *pending;
+    struct zerocopy_socket *sock;
+    struct lwan_deadline deadline;
+    ssize_t total_written = 0;
+    int curr_iov = 0;
+
+    /* Deferred, so that buffers are released even if the coroutine is
+     * aborted while they're being sent. */
+    pending = lwan_zerocopy_pending_new(release, data1, data2);
+    if (UNLIKELY(!pending)) {
+        coro_defer2(coro, release, data1, data2);
+        total_written = lwan_writev(request, iov, iov_count);
+        goto out;
+    }
+    coro_defer(coro, CORO_DEFER(lwan_zerocopy_commit), pending);
+
+    sock = (request->flags & REQUEST_IS_HTTP_2)
+               ? NULL
+               : lwan_zerocopy_get_socket(request);
+    if (!sock) {
+        total_written = lwan_writev(request, iov, iov_count);
+        goto out;
+    }
+
+    lwan_flush_batch_if_needed(request);
+    init_write_deadline(&deadline, request);
+
+    while (true) {
+        struct msghdr msg = {
+            .msg_iov = iov + curr_iov,
+            .msg_iovlen = (size_t)(iov_count - curr_iov),
+        };
+        ssize_t written =
+            sendmsg(request->fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+
+        if (UNLIKELY(written < 0)) {
+            switch (errno) {
+            case EAGAIN:
+                request->conn->flags |= CONN_WRITE_BLOCKED;
+                /* fallthrough */
+            case EINTR:
+                wait_for_client(request, &deadline, (size_t)total_written);
+                continue;
+            case EOPNOTSUPP:
+                /* e.g. kTLS sockets. */
+                lwan_zerocopy_disable(sock);
+                /* fallthrough */
+            case ENOBUFS:
+                /* Not enough memory to pin the pages (net.core.optmem_max);
+                 * send whatever is left by copying it. */
+                total_written +=
+                    lwan_writev(request, iov + curr_iov, iov_count - curr_iov);
+                goto out;
+            default:
+                coro_yield(coro, CONN_CORO_ABORT);
+                __builtin_unreachable();
+            }
+        }
+
+        lwan_zerocopy_sent(sock, pending);
+        total_written += written;
+        request->conn->thread->metrics.bytes_sent += (unsigned long long)written;
+
+        while (curr_iov < iov_count && written >= (ssize_t)iov[curr_iov].iov_len) {
+            written -= (ssize_t)iov[curr_iov].iov_len;
+            curr_iov++;
+        }
+
+        if (curr_iov == iov_count) {
+            lwan_deadline_done(request);
+            break;
+        }
+
+        iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
+        iov[curr_iov].iov_len -= (size_t)written;
+
+        wait_for_client(request, &deadline, (size_t)total_written);
+    }
+
+out:
+    coro_deferred_run(coro, generation);
+    return total_written;
+}
+
+void
+lwan_flush_batch(struct lwan_request *request)
+{
+    size_t len = request->batch->len;
+
+    /* Reset first, so that lwan_send() doesn't try flushing it again. */
+    request->batch->len = 0;
+    lwan_send(request, request->batch->buffer, len, 0);
+}
+
 #if defined(__linux__)
+#define SENDFILE_READAHEAD_WINDOW (4u << 20)
+
 static inline size_t min_size(size_t a, size_t b)
 {
     return (a > b) ? b : a;
@@ -119,16 +322,35 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
 {
     size_t chunk_size = min_size(count, 1<<17);
     size_t to_be_written = count;
+    struct lwan_deadline deadline;
+    off_t resident_end = offset;
+
+    if (UNLIKELY(request->flags & REQUEST_IS_HTTP_2)) {
+        lwan_h2_sendfile(request, in_fd, offset, count, header, header_len);
+        return;
+    }
 
     lwan_send(request, header, header_len, MSG_MORE);
+    init_write_deadline(&deadline, request);
 
     do {
+        /* Don't let sendfile() wait for the disk.  Once it would have,
+         * read well ahead, so that this doesn't happen every chunk. */
+        if (offset + (off_t)chunk_size > resident_end) {
+            size_t ahead = min_size(to_be_written, SENDFILE_READAHEAD_WINDOW);
+
+            lwan_readahead_wait(request, in_fd, offset, ahead);
+            resident_end = offset + (off_t)ahead;
+        }
+
         ssize_t written = sendfile(request->fd, in_fd, &offset, chunk_size);
         if (written < 0) {
             switch (errno) {
             case EAGAIN:
+                request->conn->flags |= CONN_WRITE_BLOCKED;
+                /* fallthrough */
             case EINTR:
-                coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+                wait_for_client(request, &deadline, count - to_be_written);
                 continue;
 
             default:
@@ -138,10 +360,13 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
         }
 
         to_be_written -= (size_t)written;
+        request->conn->thread->metrics.bytes_sent += (unsigned long long)written;
         chunk_size = min_size(to_be_written, 1<<19);
 
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wait_for_client(request, &deadline, count - to_be_written);
     } while (to_be_written > 0);
+
+    lwan_deadline_done(request);
 }
 #elif defined(__FreeBSD__) || defined(__APPLE__)
 void
@@ -157,9 +382,18 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
         },
         .hdr_cnt = 1
     };
+    struct lwan_deadline deadline;
     size_t total_written = 0;
     off_t sbytes = (off_t)count;
 
+    if (UNLIKELY(request->flags & REQUEST_IS_HTTP_2)) {
+        lwan_h2_sendfile(request, in_fd, offset, count, header, header_len);
+        return;
+    }
+
+    lwan_flush_batch_if_needed(request);
+    init_write_deadline(&deadline, request);
+
     do {
         int r;
 
@@ -172,9 +406,11 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
         if (UNLIKELY(r < 0)) {
             switch (errno) {
             case EAGAIN:
+                request->conn->flags |= CONN_WRITE_BLOCKED;
+                /* fallthrough */
             case EBUSY:
             case EINTR:
-                coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+                wait_for_client(request, &deadline, total_written);
                 continue;
 
             default:
@@ -184,9 +420,12 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
         }
 
         total_written += (size_t)sbytes;
+        request->conn->thread->metrics.bytes_sent += (unsigned long long)sbytes;
 
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wait_for_client(request, &deadline, total_written);
     } while (total_written < count);
+
+    lwan_deadline_done(request);
 }
 #else
 #error No sendfile() implementation for this platform
@@ -28,7 +28,29 @@ ssize_t lwan_writev(struct lwan_request *request, struct iovec *iov,
                     int iovcnt);
 ssize_t lwan_send(struct lwan_request *request, const void *buf, size_t count,
                   int flags);
+/* Sends with MSG_ZEROCOPY when possible: release(data1, data2) is called
+ * once the kernel is done with the buffers, which can be after this
+ * returns (or after the coroutine is gone).  Worth it only for responses
+ * of at least zerocopy_min_size bytes; see lwan_should_zerocopy(). */
+ssize_t lwan_writev_zerocopy(struct lwan_request *request, struct iovec *iov,
+                             int iovcnt,
+                             void (*release)(void *data1, void *data2),
+                             void *data1, void *data2);
+void lwan_flush_batch(struct lwan_request *request);
 void lwan_sendfile(struct lwan_request *request, int in_fd,
                     off_t offset, size_t count,
                     const char *header, size_t header_len);
 
+static inline bool lwan_should_zerocopy(const struct lwan_request *request,
+                                        size_t len)
+{
+    size_t min_size = request->conn->thread->lwan->config.zerocopy_min_size;
+
+    return min_size && len >= min_size;
+}
+
+static inline void lwan_flush_batch_if_needed(struct lwan_request *request)
+{
+    if (UNLIKELY(request->batch && request->batch->len))
+        lwan_flush_batch(request);
+}
@@ -21,124 +21,189 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
-#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <sys/time.h>
+#include <time.h>
 
-#include "lwan.h"
+#include "lwan-private.h"
 #include "lwan-status.h"
 #include "list.h"
 
+/* Jobs used to run one after the other in a single SCHED_IDLE thread,
+ * which could starve indefinitely precisely when the server was busiest
+ * (and caches the fullest).  They're now run by a few worker threads with
+ * normal priority, each one picking the due job with the highest priority
+ * and the earliest deadline. */
+#define JOB_WORKERS 2
+
 struct job {
     struct list_node jobs;
     bool (*cb)(void *data);
     void *data;
+    uint64_t deadline_ms;
+    unsigned int interval_ms;
+    enum lwan_job_priority priority;
+    bool running;
+    bool kicked;
 };
 
-static pthread_t self;
+static pthread_t workers[JOB_WORKERS];
 static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond;
+static pthread_cond_t job_done_cond = PTHREAD_COND_INITIALIZER;
 static bool running = false;
 static struct list_head jobs;
 
-static pthread_mutex_t job_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t job_wait_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &ts) < 0))
+        lwan_status_critical_perror("clock_gettime");
 
-static void
-timedwait(bool had_job)
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool runs_before(const struct job *a, const struct job *b,
+                        uint64_t now)
 {
-    static int secs = 1;
-    struct timeval now;
+    bool a_due = a->deadline_ms <= now;
+    bool b_due = b->deadline_ms <= now;
+
+    if (a_due != b_due)
+        return a_due;
+    if (a_due && a->priority != b->priority)
+        return a->priority > b->priority;
+    return a->deadline_ms < b->deadline_ms;
+}
 
-    if (had_job)
-        secs = 1;
-    else if (secs <= 15)
-        secs++;
+/* Must be called with queue_mutex held. */
+static struct job *next_job(uint64_t now)
+{
+    struct job *job, *next = NULL;
 
-    gettimeofday(&now, NULL);
+    list_for_each(&jobs, job, jobs) {
+        if (job->running)
+            continue;
+        if (!next || runs_before(job, next, now))
+            next = job;
+    }
 
-    struct timespec rgtp = { now.tv_sec + secs, now.tv_usec * 1000 };
-    pthread_cond_timedwait(&job_wait_cond, &job_wait_mutex, &rgtp);
+    return next;
 }
 
-static void*
-job_thread(void *data __attribute__((unused)))
+static void wait_until(uint64_t deadline_ms)
 {
-    if (pthread_mutex_lock(&job_wait_mutex))
-        lwan_status_critical("Could not lock job wait mutex");
-    
-    while (running) {
-        bool had_job = false;
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline_ms / 1000),
+        .tv_nsec = (long)(deadline_ms % 1000) * 1000000,
+    };
 
-        if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
-            struct job *job;
+    pthread_cond_timedwait(&queue_cond, &queue_mutex, &ts);
+}
 
-            list_for_each(&jobs, job, jobs)
-                had_job |= job->cb(job->data);
+static void *job_worker(void *data __attribute__((unused)))
+{
+    if (pthread_mutex_lock(&queue_mutex))
+        lwan_status_critical("Could not lock job queue mutex");
 
-            pthread_mutex_unlock(&queue_mutex);
+    while (running) {
+        uint64_t now = monotonic_ms();
+        struct job *job = next_job(now);
+
+        if (!job) {
+            /* Nothing to do until a job is added or kicked. */
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+            continue;
+        }
+        if (job->deadline_ms > now) {
+            wait_until(job->deadline_ms);
+            continue;
         }
 
-        timedwait(had_job);
+        job->running = true;
+        job->kicked = false;
+        pthread_mutex_unlock(&queue_mutex);
+
+        /* The return value used to control how long the job thread would
+         * sleep; intervals are now fixed, so it's not used anymore. */
+        (void)job->cb(job->data);
+
+        pthread_mutex_lock(&queue_mutex);
+        job->running = false;
+        /* Kicking a job while it runs will have it running again right
+         * away; otherwise, schedule it for the next interval. */
+        if (!job->kicked)
+            job->deadline_ms = monotonic_ms() + job->interval_ms;
+        pthread_cond_broadcast(&job_done_cond);
     }
 
-    if (pthread_mutex_unlock(&job_wait_mutex))
-        lwan_status_critical("Could not lock job wait mutex");
+    pthread_mutex_unlock(&queue_mutex);
 
     return NULL;
 }
 
 void lwan_job_thread_init(void)
 {
+    pthread_condattr_t attr;
+
     assert(!running);
 
-    lwan_status_debug("Initializing low priority job thread");
+    lwan_status_debug("Initializing job threads");
 
     list_head_init(&jobs);
 
-    running = true;
-    if (pthread_create(&self, NULL, job_thread, NULL) < 0)
-        lwan_status_critical_perror("pthread_create");
+    if (pthread_condattr_init(&attr))
+        lwan_status_critical("Could not initialize condition attributes");
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))
+        lwan_status_critical("Could not use monotonic clock for jobs");
+    if (pthread_cond_init(&queue_cond, &attr))
+        lwan_status_critical("Could not initialize job queue condition");
+    pthread_condattr_destroy(&attr);
 
-#ifdef SCHED_IDLE
-    struct sched_param sched_param = {
-        .sched_priority = 0
-    };
-    if (pthread_setschedparam(self, SCHED_IDLE, &sched_param) < 0)
-        lwan_status_perror("pthread_setschedparam");
-#endif  /* SCHED_IDLE */
+    running = true;
+    for (int i = 0; i < JOB_WORKERS; i++) {
+        if (pthread_create(&workers[i], NULL, job_worker, NULL))
+            lwan_status_critical_perror("pthread_create");
+    }
 }
 
 void lwan_job_thread_shutdown(void)
 {
-    lwan_status_debug("Shutting down job thread");
+    struct job *node, *next;
 
-    if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
-        struct job *node, *next;
-        int r;
+    lwan_status_debug("Shutting down job threads");
 
-        list_for_each_safe(&jobs, node, next, jobs) {
-            list_del(&node->jobs);
-            free(node);
-        }
-        running = false;
+    if (UNLIKELY(pthread_mutex_lock(&queue_mutex)))
+        return;
 
-        pthread_cond_signal(&job_wait_cond);
+    running = false;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
 
-        r = pthread_join(self, NULL);
+    for (int i = 0; i < JOB_WORKERS; i++) {
+        int r = pthread_join(workers[i], NULL);
         if (r) {
             errno = r;
             lwan_status_perror("pthread_join");
         }
+    }
 
-        pthread_mutex_unlock(&queue_mutex);
+    list_for_each_safe(&jobs, node, next, jobs) {
+        list_del(&node->jobs);
+        free(node);
     }
+
+    pthread_cond_destroy(&queue_cond);
 }
 
-void lwan_job_add(bool (*cb)(void *data), void *data)
+void lwan_job_add_full(bool (*cb)(void *data), void *data,
+                       unsigned int interval_ms,
+                       enum lwan_job_priority priority)
 {
     assert(cb);
+    assert(interval_ms > 0);
 
     struct job *job = calloc(1, sizeof(*job));
     if (!job)
@@ -146,9 +211,13 @@ void lwan_job_add(bool (*cb)(void *data), void *data)
 
     job->cb = cb;
     job->data = data;
+    job->interval_ms = interval_ms;
+    job->priority = priority;
 
     if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
+        job->deadline_ms = monotonic_ms() + interval_ms;
         list_add(&jobs, &job->jobs);
+        pthread_cond_signal(&queue_cond);
         pthread_mutex_unlock(&queue_mutex);
     } else {
         lwan_status_warning("Couldn't lock job mutex");
@@ -156,6 +225,34 @@ void lwan_job_add(bool (*cb)(void *data), void *data)
     }
 }
 
+void lwan_job_add(bool (*cb)(void *data), void *data)
+{
+    lwan_job_add_full(cb, data, 1000, LWAN_JOB_PRIORITY_NORMAL);
+}
+
+void lwan_job_kick(bool (*cb)(void *data), void *data)
+{
+    struct job *node;
+
+    assert(cb);
+
+    if (UNLIKELY(pthread_mutex_lock(&queue_mutex)))
+        return;
+
+    list_for_each(&jobs, node, jobs) {
+        if (cb == node->cb && data == node->data) {
+            node->deadline_ms = 0;
+            node->kicked = true;
+            pthread_cond_signal(&queue_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/* Waits for the job to finish if it's running, so that whatever data it
+ * uses can be freed right after this returns.  Can't be called from the
+ * job itself. */
 void lwan_job_del(bool (*cb)(void *data), void *data)
 {
     struct job *node, *next;
@@ -163,8 +260,16 @@ void lwan_job_del(bool (*cb)(void *data), void *data)
     assert(cb);
 
     if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
+again:
         list_for_each_safe(&jobs, node, next, jobs) {
             if (cb == node->cb && data == node->data) {
+                if (node->running) {
+                    /* The list can change while the lock isn't held, so
+                     * look for the job from the start once it's done. */
+                    pthread_cond_wait(&job_done_cond, &queue_mutex);
+                    goto again;
+                }
+
                 list_del(&node->jobs);
                 free(node);
             }
@@ -0,0 +1,634 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan-private.h"
+#include "lwan-json.h"
+
+/* Values are parsed recursively, on the coroutine stack. */
+#define MAX_DEPTH 32
+
+struct parser {
+    struct coro *coro;
+    char *p;
+    const char *end;
+    unsigned int depth;
+    /* If false, strings are decoded into memory allocated from the
+     * coroutine, and the buffer is left alone. */
+    bool in_place;
+};
+
+static struct lwan_json *parse_value(struct parser *parser);
+
+static ALWAYS_INLINE void skip_whitespace(struct parser *parser)
+{
+    while (parser->p < parser->end &&
+           (*parser->p == ' ' || *parser->p == '\n' || *parser->p == '\r' ||
+            *parser->p == '\t'))
+        parser->p++;
+}
+
+static ALWAYS_INLINE bool consume(struct parser *parser, char c)
+{
+    skip_whitespace(parser);
+    if (parser->p < parser->end && *parser->p == c) {
+        parser->p++;
+        return true;
+    }
+    return false;
+}
+
+static struct lwan_json *new_node(struct parser *parser,
+                                  enum lwan_json_type type)
+{
+    struct lwan_json *node = coro_malloc(parser->coro, sizeof(*node));
+
+    if (LIKELY(node)) {
+        node->type = type;
+        node->key = (struct lwan_value){};
+        node->next = NULL;
+    }
+
+    return node;
+}
+
+static int decode_hex4(const char *p)
+{
+    int value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            value |= (c | 0x20) - 'a' + 10;
+        else
+            return -1;
+    }
+
+    return value;
+}
+
+static char *encode_utf8(char *out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        *out++ = (char)cp;
+    } else if (cp < 0x800) {
+        *out++ = (char)(0xc0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        *out++ = (char)(0xe0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    } else {
+        *out++ = (char)(0xf0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    }
+
+    return out;
+}
+
+/* Decodes the escape sequence after the backslash at *p into out, which
+ * never gets ahead of *p: no escape sequence is shorter than what it
+ * decodes to. */
+static char *decode_escape(const char **p, const char *end, char *out)
+{
+    const char *s = *p + 1;
+    int cp;
+
+    if (UNLIKELY(s >= end))
+        return NULL;
+
+    switch (*s) {
+    case '"':
+    case '\\':
+    case '/':
+        *out++ = *s;
+        break;
+    case 'b':
+        *out++ = '\b';
+        break;
+    case 'f':
+        *out++ = '\f';
+        break;
+    case 'n':
+        *out++ = '\n';
+        break;
+    case 'r':
+        *out++ = '\r';
+        break;
+    case 't':
+        *out++ = '\t';
+        break;
+    case 'u':
+        if (UNLIKELY(end - s < 5))
+            return NULL;
+        cp = decode_hex4(s + 1);
+        if (UNLIKELY(cp < 0))
+            return NULL;
+        s += 4;
+
+        if (cp >= 0xd800 && cp <= 0xdbff) {
+            int low;
+
+            if (UNLIKELY(end - s < 7 || s[1] != '\\' || s[2] != 'u'))
+                return NULL;
+            low = decode_hex4(s + 3);
+            if (UNLIKELY(low < 0xdc00 || low > 0xdfff))
+                return NULL;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            s += 6;
+        } else if (UNLIKELY(cp >= 0xdc00 && cp <= 0xdfff)) {
+            return NULL;
+        }
+
+        out = encode_utf8(out, (uint32_t)cp);
+        break;
+    default:
+        return NULL;
+    }
+
+    *p = s + 1;
+    return out;
+}
+
+/* p points right after the opening quote.  Decodes the string into out
+ * (which can be p itself, as decoding never makes strings longer), and
+ * returns a pointer past the closing quote. */
+static const char *
+decode_string(const char *p, const char *end, char *out, size_t *len)
+{
+    char *start = out;
+
+    while (true) {
+        const char *hit = lwan_json_find_special(p, end);
+
+        if (UNLIKELY(hit == end))
+            return NULL;
+
+        if (out != p)
+            memmove(out, p, (size_t)(hit - p));
+        out += hit - p;
+        p = hit;
+
+        const unsigned char c = (unsigned char)*p;
+        if (c == '"') {
+            *out = '\0';
+            *len = (size_t)(out - start);
+            return p + 1;
+        }
+        if (c == '\\') {
+            out = decode_escape(&p, end, out);
+            if (UNLIKELY(!out))
+                return NULL;
+            continue;
+        }
+        if (c >= 0x80) {
+            size_t seq_len = lwan_utf8_sequence_length(p, end);
+
+            if (UNLIKELY(!seq_len))
+                return NULL;
+            if (out != p)
+                memmove(out, p, seq_len);
+            out += seq_len;
+            p += seq_len;
+            continue;
+        }
+
+        /* Control characters have to be escaped. */
+        return NULL;
+    }
+}
+
+/* p points right after the opening quote; returns a pointer to the
+ * closing quote, without validating what's in between. */
+static const char *find_string_end(const char *p, const char *end)
+{
+    while (p < end) {
+        const char *hit = lwan_json_find_special(p, end);
+
+        if (hit == end)
+            break;
+        if (*hit == '"')
+            return hit;
+        p = hit + (*hit == '\\' ? 2 : 1);
+    }
+
+    return NULL;
+}
+
+static bool parse_string(struct parser *parser, struct lwan_value *value)
+{
+    const char *after;
+    char *out;
+
+    if (UNLIKELY(!consume(parser, '"')))
+        return false;
+
+    if (parser->in_place) {
+        out = parser->p;
+    } else {
+        const char *closing = find_string_end(parser->p, parser->end);
+
+        if (UNLIKELY(!closing))
+            return false;
+        out = coro_malloc(parser->coro, (size_t)(closing - parser->p) + 1);
+        if (UNLIKELY(!out))
+            return false;
+    }
+
+    after = decode_string(parser->p, parser->end, out, &value->len);
+    if (UNLIKELY(!after))
+        return false;
+
+    value->value = out;
+    parser->p = (char *)after;
+    return true;
+}
+
+static bool parse_number(struct parser *parser, double *number)
+{
+    const char *p = parser->p;
+    const char *start = p;
+    bool negative = false;
+    bool is_integer = true;
+    uint64_t integer = 0;
+    int digits = 0;
+
+    if (p < parser->end && *p == '-') {
+        negative = true;
+        p++;
+    }
+
+    if (p < parser->end && *p == '0') {
+        p++;
+        digits = 1;
+    } else {
+        for (; p < parser->end && *p >= '0' && *p <= '9'; p++, digits++)
+            integer = integer * 10 + (uint64_t)(*p - '0');
+    }
+    if (UNLIKELY(!digits))
+        return false;
+
+    if (p < parser->end && *p == '.') {
+        is_integer = false;
+        p++;
+        if (UNLIKELY(p >= parser->end || *p < '0' || *p > '9'))
+            return false;
+        while (p < parser->end && *p >= '0' && *p <= '9')
+            p++;
+    }
+
+    if (p < parser->end && (*p == 'e' || *p == 'E')) {
+        is_integer = false;
+        p++;
+        if (p < parser->end && (*p == '+' || *p == '-'))
+            p++;
+        if (UNLIKELY(p >= parser->end || *p < '0' || *p > '9'))
+            return false;
+        while (p < parser->end && *p >= '0' && *p <= '9')
+            p++;
+    }
+
+    /* Integers that fit in a double's mantissa don't need strtod(). */
+    if (is_integer && digits <= 15) {
+        *number = negative ? -(double)integer : (double)integer;
+    } else {
+        /* strtod() needs a NUL-terminated string, and the buffer isn't
+         * necessarily terminated right after the number. */
+        const size_t len = (size_t)(p - start);
+        char stack_buf[64];
+        char *copy = len < sizeof(stack_buf)
+                         ? stack_buf
+                         : coro_malloc(parser->coro, len + 1);
+
+        if (UNLIKELY(!copy))
+            return false;
+
+        memcpy(copy, start, len);
+        copy[len] = '\0';
+        *number = strtod(copy, NULL);
+    }
+
+    parser->p = (char *)p;
+    return true;
+}
+
+static bool parse_literal(struct parser *parser, const char *literal,
+                          size_t len)
+{
+    if ((size_t)(parser->end - parser->p) < len ||
+        memcmp(parser->p, literal, len))
+        return false;
+
+    parser->p += len;
+    return true;
+}
+
+static struct lwan_json *parse_array(struct parser *parser)
+{
+    struct lwan_json *array = new_node(parser, LWAN_JSON_ARRAY);
+    struct lwan_json **tail;
+
+    if (UNLIKELY(!array))
+        return NULL;
+
+    array->children.head = NULL;
+    array->children.len = 0;
+    tail = &array->children.head;
+
+    parser->p++;
+    if (consume(parser, ']'))
+        return array;
+
+    do {
+        struct lwan_json *element = parse_value(parser);
+
+        if (UNLIKELY(!element))
+            return NULL;
+
+        *tail = element;
+        tail = &element->next;
+        array->children.len++;
+    } while (consume(parser, ','));
+
+    return consume(parser, ']') ? array : NULL;
+}
+
+static struct lwan_json *parse_object(struct parser *parser)
+{
+    struct lwan_json *object = new_node(parser, LWAN_JSON_OBJECT);
+    struct lwan_json **tail;
+
+    if (UNLIKELY(!object))
+        return NULL;
+
+    object->children.head = NULL;
+    object->children.len = 0;
+    tail = &object->children.head;
+
+    parser->p++;
+    if (consume(parser, '}'))
+        return object;
+
+    do {
+        struct lwan_value key;
+        struct lwan_json *member;
+
+        if (UNLIKELY(!parse_string(parser, &key)))
+            return NULL;
+        if (UNLIKELY(!consume(parser, ':')))
+            return NULL;
+
+        member = parse_value(parser);
+        if (UNLIKELY(!member))
+            return NULL;
+
+        member->key = key;
+        *tail = member;
+        tail = &member->next;
+        object->children.len++;
+    } while (consume(parser, ','));
+
+    return consume(parser, '}') ? object : NULL;
+}
+
+static struct lwan_json *parse_value(struct parser *parser)
+{
+    struct lwan_json *value;
+
+    skip_whitespace(parser);
+    if (UNLIKELY(parser->p >= parser->end))
+        return NULL;
+
+    switch (*parser->p) {
+    case '{':
+    case '[':
+        if (UNLIKELY(parser->depth >= MAX_DEPTH))
+            return NULL;
+
+        parser->depth++;
+        value = *parser->p == '{' ? parse_object(parser) : parse_array(parser);
+        parser->depth--;
+        return value;
+
+    case '"':
+        value = new_node(parser, LWAN_JSON_STRING);
+        if (UNLIKELY(!value))
+            return NULL;
+        return parse_string(parser, &value->string) ? value : NULL;
+
+    case 't':
+        if (!parse_literal(parser, "true", 4))
+            return NULL;
+        return new_node(parser, LWAN_JSON_TRUE);
+
+    case 'f':
+        if (!parse_literal(parser, "false", 5))
+            return NULL;
+        return new_node(parser, LWAN_JSON_FALSE);
+
+    case 'n':
+        if (!parse_literal(parser, "null", 4))
+            return NULL;
+        return new_node(parser, LWAN_JSON_NULL);
+
+    default:
+        value = new_node(parser, LWAN_JSON_NUMBER);
+        if (UNLIKELY(!value))
+            return NULL;
+        return parse_number(parser, &value->number) ? value : NULL;
+    }
+}
+
+struct lwan_json *lwan_json_parse(struct coro *coro, char *buf, size_t len)
+{
+    struct parser parser = {
+        .coro = coro,
+        .p = buf,
+        .end = buf + len,
+        .in_place = true,
+    };
+    struct lwan_json *root = parse_value(&parser);
+
+    if (UNLIKELY(!root))
+        return NULL;
+
+    skip_whitespace(&parser);
+    return parser.p == parser.end ? root : NULL;
+}
+
+static bool skip_string(struct parser *parser)
+{
+    const char *closing = find_string_end(parser->p + 1, parser->end);
+
+    if (UNLIKELY(!closing))
+        return false;
+
+    parser->p = (char *)closing + 1;
+    return true;
+}
+
+/* Skips over a value without looking too closely at it: brackets are
+ * counted, and strings are skipped so that brackets inside them aren't. */
+static bool skip_value(struct parser *parser)
+{
+    unsigned int depth = 0;
+
+    skip_whitespace(parser);
+    if (UNLIKELY(parser->p >= parser->end))
+        return false;
+
+    if (*parser->p != '{' && *parser->p != '[') {
+        if (*parser->p == '"')
+            return skip_string(parser);
+
+        while (parser->p < parser->end &&
+               !memchr(",}] \t\r\n", *parser->p, 7))
+            parser->p++;
+        return true;
+    }
+
+    while (parser->p < parser->end) {
+        switch (*parser->p) {
+        case '"':
+            if (UNLIKELY(!skip_string(parser)))
+                return false;
+            continue;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            if (!--depth) {
+                parser->p++;
+                return true;
+            }
+            break;
+        }
+
+        parser->p++;
+    }
+
+    return false;
+}
+
+static bool key_matches(struct parser *parser, const char *key,
+                        size_t key_len)
+{
+    const char *start = parser->p + 1;
+    const char *closing = find_string_end(start, parser->end);
+    size_t raw_len;
+
+    if (UNLIKELY(!closing))
+        return false;
+
+    raw_len = (size_t)(closing - start);
+
+    if (LIKELY(!memchr(start, '\\', raw_len)))
+        return raw_len == key_len && !memcmp(start, key, key_len);
+
+    /* Rare enough that decoding to a temporary copy is fine. */
+    struct lwan_value decoded;
+    if (UNLIKELY(!parse_string(parser, &decoded)))
+        return false;
+    parser->p = (char *)start - 1;
+
+    return decoded.len == key_len && !memcmp(decoded.value, key, key_len);
+}
+
+struct lwan_json *lwan_json_find(struct coro *coro, const char *buf,
+                                 size_t len, const char *const path[])
+{
+    struct parser parser = {
+        .coro = coro,
+        .p = (char *)buf,
+        .end = buf + len,
+        .in_place = false,
+    };
+
+    for (; *path; path++) {
+        const size_t key_len = strlen(*path);
+
+        if (!consume(&parser, '{'))
+            return NULL;
+
+        while (true) {
+            bool found;
+
+            skip_whitespace(&parser);
+            if (parser.p >= parser.end || *parser.p != '"')
+                return NULL;
+
+            found = key_matches(&parser, *path, key_len);
+
+            if (!skip_string(&parser))
+                return NULL;
+            if (!consume(&parser, ':'))
+                return NULL;
+
+            if (found)
+                break;
+
+            if (!skip_value(&parser))
+                return NULL;
+            if (!consume(&parser, ','))
+                return NULL;
+        }
+    }
+
+    return parse_value(&parser);
+}
+
+const struct lwan_json *lwan_json_get_member(const struct lwan_json *object,
+                                             const char *key)
+{
+    const size_t key_len = strlen(key);
+
+    if (!object || object->type != LWAN_JSON_OBJECT)
+        return NULL;
+
+    for (const struct lwan_json *member = object->children.head; member;
+         member = member->next) {
+        if (member->key.len == key_len &&
+            !memcmp(member->key.value, key, key_len))
+            return member;
+    }
+
+    return NULL;
+}
+
+const struct lwan_json *lwan_json_get_path(const struct lwan_json *value,
+                                           const char *const path[])
+{
+    for (; value && *path; path++)
+        value = lwan_json_get_member(value, *path);
+
+    return value;
+}
@@ -0,0 +1,72 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lwan.h"
+
+enum lwan_json_type {
+    LWAN_JSON_NULL,
+    LWAN_JSON_FALSE,
+    LWAN_JSON_TRUE,
+    LWAN_JSON_NUMBER,
+    LWAN_JSON_STRING,
+    LWAN_JSON_ARRAY,
+    LWAN_JSON_OBJECT,
+};
+
+struct lwan_json {
+    enum lwan_json_type type;
+
+    /* Set for members of objects. */
+    struct lwan_value key;
+    /* The next element of the array or member of the object. */
+    struct lwan_json *next;
+
+    union {
+        double number;
+        /* NUL-terminated; might contain NULs if \u0000 has been used. */
+        struct lwan_value string;
+        struct {
+            struct lwan_json *head;
+            size_t len;
+        } children;
+    };
+};
+
+/* Parses a whole document, decoding strings in place: buf isn't JSON
+ * anymore afterwards.  Nodes are allocated from the coroutine and go away
+ * with it.  Returns NULL if the document isn't valid. */
+struct lwan_json *lwan_json_parse(struct coro *coro, char *buf, size_t len);
+
+/* Looks for the value at path (a NULL-terminated list of keys, one per
+ * level of nested objects) without building nodes for anything else, and
+ * without changing buf.  Only what's in the way of the value is looked
+ * at, and what's skipped isn't fully validated. */
+struct lwan_json *lwan_json_find(struct coro *coro, const char *buf,
+                                 size_t len, const char *const path[]);
+
+const struct lwan_json *lwan_json_get_member(const struct lwan_json *object,
+                                             const char *key);
+const struct lwan_json *lwan_json_get_path(const struct lwan_json *value,
+                                           const char *const path[]);
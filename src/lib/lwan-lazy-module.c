@@ -0,0 +1,196 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "lwan-private.h"
+#include "lwan-lazy-module.h"
+#include "list.h"
+
+/* Added to the reference count while an instance is being destroyed, so
+ * that requests trying to take a reference fall back to waiting on the
+ * lock instead. */
+#define REFS_DYING (INT_MIN / 2)
+
+struct lwan_lazy_module {
+    struct list_node list;
+    const struct lwan_module *module;
+    struct lwan_url_map *url_map;
+    struct hash *hash;
+
+    pthread_mutex_t lock;
+    int refs;
+    time_t last_used;
+    unsigned int idle_timeout;
+    bool created;
+};
+
+static pthread_mutex_t lazy_modules_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head lazy_modules = LIST_HEAD_INIT(lazy_modules);
+static bool reaper_running;
+
+static bool reap_idle_modules(void *data __attribute__((unused)))
+{
+    time_t now = lwan_clock_get()->monotonic;
+    struct lwan_lazy_module *lazy;
+
+    pthread_mutex_lock(&lazy_modules_mutex);
+
+    list_for_each (&lazy_modules, lazy, list) {
+        struct lwan_url_map *url_map = lazy->url_map;
+
+        if (!lazy->idle_timeout || !lazy->module->destroy)
+            continue;
+        if (now - ATOMIC_READ(lazy->last_used) < (time_t)lazy->idle_timeout)
+            continue;
+        if (pthread_mutex_trylock(&lazy->lock))
+            continue;
+
+        if (lazy->created &&
+            __sync_bool_compare_and_swap(&lazy->refs, 0, REFS_DYING)) {
+            ATOMIC_READ(lazy->created) = false;
+            lazy->module->destroy(url_map->data);
+            url_map->data = NULL;
+            ATOMIC_AAF(&lazy->refs, -REFS_DYING);
+
+            lwan_status_debug("Destroyed idle module instance for prefix \"%s\"",
+                              url_map->prefix);
+        }
+
+        pthread_mutex_unlock(&lazy->lock);
+    }
+
+    pthread_mutex_unlock(&lazy_modules_mutex);
+
+    return true;
+}
+
+struct lwan_lazy_module *lwan_lazy_module_new(const struct lwan_module *module,
+                                              struct hash *hash,
+                                              unsigned int idle_timeout)
+{
+    struct lwan_lazy_module *lazy = calloc(1, sizeof(*lazy));
+
+    if (!lazy)
+        return NULL;
+
+    if (pthread_mutex_init(&lazy->lock, NULL)) {
+        free(lazy);
+        return NULL;
+    }
+
+    lazy->module = module;
+    lazy->hash = hash;
+    lazy->idle_timeout = idle_timeout;
+
+    pthread_mutex_lock(&lazy_modules_mutex);
+    list_add_tail(&lazy_modules, &lazy->list);
+    if (idle_timeout && module->destroy && !reaper_running) {
+        /* A single job goes through all of them, however many there are;
+         * instances are destroyed at most a minute late. */
+        lwan_job_add_full(reap_idle_modules, NULL,
+                          (idle_timeout < 60 ? idle_timeout : 60) * 1000,
+                          LWAN_JOB_PRIORITY_LOW);
+        reaper_running = true;
+    }
+    pthread_mutex_unlock(&lazy_modules_mutex);
+
+    return lazy;
+}
+
+void lwan_lazy_module_attach(struct lwan_lazy_module *lazy,
+                             struct lwan_url_map *url_map)
+{
+    lazy->url_map = url_map;
+    url_map->data = NULL;
+}
+
+void lwan_lazy_module_free(struct lwan_lazy_module *lazy)
+{
+    if (!lazy)
+        return;
+
+    pthread_mutex_lock(&lazy_modules_mutex);
+    list_del(&lazy->list);
+    if (reaper_running && list_empty(&lazy_modules)) {
+        lwan_job_del(reap_idle_modules, NULL);
+        reaper_running = false;
+    }
+    pthread_mutex_unlock(&lazy_modules_mutex);
+
+    if (lazy->created && lazy->module->destroy)
+        lazy->module->destroy(lazy->url_map->data);
+
+    hash_free(lazy->hash);
+    pthread_mutex_destroy(&lazy->lock);
+    free(lazy);
+}
+
+static void release(void *data)
+{
+    struct lwan_lazy_module *lazy = data;
+
+    ATOMIC_DEC(lazy->refs);
+}
+
+static void instantiate(struct lwan_lazy_module *lazy)
+{
+    struct lwan_url_map *url_map = lazy->url_map;
+
+    pthread_mutex_lock(&lazy->lock);
+
+    if (!lazy->created) {
+        /* Like when instances are created upfront, NULL is a valid
+         * instance for the module to return. */
+        url_map->data =
+            lazy->module->create_from_hash(url_map->prefix, lazy->hash);
+
+        /* Pairs with the barrier in the reference count increment. */
+        __sync_synchronize();
+        ATOMIC_READ(lazy->created) = true;
+    }
+
+    ATOMIC_INC(lazy->refs);
+
+    pthread_mutex_unlock(&lazy->lock);
+}
+
+void lwan_lazy_module_acquire(struct lwan_url_map *url_map,
+                              struct lwan_request *request)
+{
+    struct lwan_lazy_module *lazy = url_map->lazy;
+    time_t now = lwan_clock_get()->monotonic;
+
+    /* Once the (positive) reference count is taken, the instance can't go
+     * away; if it's not there, or being destroyed, take the slow path. */
+    if (UNLIKELY(ATOMIC_INC(lazy->refs) <= 0 || !ATOMIC_READ(lazy->created))) {
+        ATOMIC_DEC(lazy->refs);
+        instantiate(lazy);
+    }
+
+    /* Only written when it changes, to keep the cache line shared. */
+    if (ATOMIC_READ(lazy->last_used) != now)
+        ATOMIC_READ(lazy->last_used) = now;
+
+    coro_defer(request->conn->coro, release, lazy);
+}
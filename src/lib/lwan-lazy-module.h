@@ -0,0 +1,49 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include "lwan.h"
+
+/* Instances of modules configured in a listener, created by the first
+ * request routed to them (rather than when the configuration file is
+ * read), and destroyed after being unused for idle_timeout seconds (never,
+ * if that's 0, or if the module can't be destroyed).  Only modules that
+ * are set up from key/value pairs alone can be instantiated this way. */
+struct lwan_lazy_module;
+
+static inline bool lwan_lazy_module_supported(const struct lwan_module *module)
+{
+    return module->create_from_hash && !module->parse_conf;
+}
+
+/* Takes ownership of hash.  The returned instance has to be attached to
+ * the URL map it's going to be created for before it's used. */
+struct lwan_lazy_module *lwan_lazy_module_new(const struct lwan_module *module,
+                                              struct hash *hash,
+                                              unsigned int idle_timeout);
+void lwan_lazy_module_attach(struct lwan_lazy_module *lazy,
+                             struct lwan_url_map *url_map);
+void lwan_lazy_module_free(struct lwan_lazy_module *lazy);
+
+/* Sets url_map->data, creating the instance if needed, and keeps it from
+ * being destroyed until the current request is done with. */
+void lwan_lazy_module_acquire(struct lwan_url_map *url_map,
+                              struct lwan_request *request);
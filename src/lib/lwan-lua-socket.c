@@ -0,0 +1,833 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <lauxlib.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-lua.h"
+
+/* Defaults for settimeout() and setkeepalive(), in milliseconds */
+#define DEFAULT_TIMEOUT_MS 30000
+#define DEFAULT_KEEPALIVE_MS 60000
+/* Idle connections kept per "host:port", per Lua state (thus per thread) */
+#define POOL_SIZE_PER_BACKEND 16
+#define RECEIVE_CHUNK_SIZE 4096
+
+static const char *socket_metatable_name = "Lwan.Socket";
+
+/* Its address is the registry key of the pool: a table mapping "host:port"
+ * to arrays of idle sockets, the most recently used at the end. */
+static const char pool_key;
+
+enum socket_op {
+    SOCKET_IDLE,
+    SOCKET_CONNECTING,
+    SOCKET_SENDING,
+    SOCKET_RECEIVING,
+};
+
+enum receive_pattern {
+    RECEIVE_BYTES,
+    RECEIVE_LINE,
+    RECEIVE_ALL,
+};
+
+struct lua_socket {
+    int fd;
+    unsigned int timeout_ms;
+    bool reused;
+    enum socket_op op;
+
+    enum receive_pattern pattern;
+    size_t wanted;
+
+    /* The string being sent is referenced from the registry while the
+     * script waits, so that it's not collected; the socket itself is
+     * referenced while connecting, to be returned afterwards. */
+    int send_ref;
+    const char *send_data;
+    size_t send_len, sent;
+    int self_ref;
+
+    /* Data received but not returned to the script yet */
+    char *buffer;
+    size_t buffer_start, buffer_end, buffer_size;
+
+    char *backend;
+    unsigned long long idle_deadline_ns;
+};
+
+/* Sockets can't wait for I/O themselves: the coroutine running the handler
+ * has to.  So, when an operation would block, it's recorded here and the
+ * script yields; lwan_lua_resume_pending() then waits for the socket and
+ * carries on with the operation, until it's done and the script can be
+ * resumed with its results. */
+static __thread struct {
+    lua_State *L;
+    struct lua_socket *sock;
+    int (*resume)(lua_State *L, struct lua_socket *sock, bool ready);
+    bool write;
+} pending;
+
+static int wait_for(lua_State *L,
+                    struct lua_socket *sock,
+                    bool write,
+                    int (*resume)(lua_State *L, struct lua_socket *sock, bool ready))
+{
+    pending.L = L;
+    pending.sock = sock;
+    pending.resume = resume;
+    pending.write = write;
+
+    return -1;
+}
+
+static int yield_if_pending(lua_State *L, int n_results)
+{
+    return n_results >= 0 ? n_results : lua_yield(L, 0);
+}
+
+int lwan_lua_resume_pending(lua_State *L, struct lwan_request *request)
+{
+    while (pending.L == L) {
+        struct lua_socket *sock = pending.sock;
+        bool ready;
+        int n_results;
+
+        pending.L = NULL;
+
+        if (pending.write)
+            ready = lwan_request_await_write(request, sock->fd, sock->timeout_ms);
+        else
+            ready = lwan_request_await_read(request, sock->fd, sock->timeout_ms);
+
+        n_results = pending.resume(L, sock, ready);
+        if (n_results >= 0)
+            return n_results;
+    }
+
+    return -1;
+}
+
+static void socket_close(struct lua_socket *sock)
+{
+    if (sock->fd >= 0) {
+        close(sock->fd);
+        sock->fd = -1;
+    }
+    sock->buffer_start = sock->buffer_end = 0;
+}
+
+static struct lua_socket *push_new_socket(lua_State *L)
+{
+    struct lua_socket *sock = lua_newuserdata(L, sizeof(*sock));
+
+    *sock = (struct lua_socket){
+        .fd = -1,
+        .timeout_ms = DEFAULT_TIMEOUT_MS,
+        .send_ref = LUA_NOREF,
+        .self_ref = LUA_NOREF,
+    };
+
+    luaL_getmetatable(L, socket_metatable_name);
+    lua_setmetatable(L, -2);
+
+    return sock;
+}
+
+static struct lua_socket *check_socket(lua_State *L)
+{
+    struct lua_socket *sock = luaL_checkudata(L, 1, socket_metatable_name);
+
+    if (UNLIKELY(sock->op != SOCKET_IDLE))
+        luaL_error(L, "socket is busy");
+
+    return sock;
+}
+
+/* Errors close the socket: what's left in it can't be trusted anymore. */
+static int push_error(lua_State *L, struct lua_socket *sock, const char *error)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    socket_close(sock);
+    sock->op = SOCKET_IDLE;
+
+    return 2;
+}
+
+static bool is_idle_connection_alive(int fd)
+{
+    /* An idle connection has nothing to say; if it's readable, the other
+     * end closed it (or is misbehaving). */
+    struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLRDHUP};
+
+    return poll(&pfd, 1, 0) == 0;
+}
+
+static void push_pool(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *)&pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1))
+        return;
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushlightuserdata(L, (void *)&pool_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* Pushes an idle connection to backend and returns it, if there's one. */
+static struct lua_socket *pool_take(lua_State *L, const char *backend)
+{
+    unsigned long long now = lwan_monotonic_ns();
+
+    push_pool(L);
+    lua_getfield(L, -1, backend);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return NULL;
+    }
+
+    for (int i = (int)lua_objlen(L, -1); i > 0; i--) {
+        struct lua_socket *sock;
+
+        lua_rawgeti(L, -1, i);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, i);
+
+        sock = lua_touserdata(L, -1);
+        if (sock->fd >= 0 && now < sock->idle_deadline_ns &&
+            is_idle_connection_alive(sock->fd)) {
+            lua_replace(L, -3);
+            lua_pop(L, 1);
+            sock->reused = true;
+            return sock;
+        }
+
+        socket_close(sock);
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 2);
+    return NULL;
+}
+
+static int connect_resume(lua_State *L, struct lua_socket *sock, bool ready)
+{
+    int error = ETIMEDOUT;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sock->self_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, sock->self_ref);
+    sock->self_ref = LUA_NOREF;
+
+    if (ready) {
+        socklen_t len = sizeof(error);
+
+        if (getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+            error = errno;
+    }
+    if (error) {
+        lua_pop(L, 1);
+        return push_error(L, sock,
+                          ready ? strerror(error) : "timeout");
+    }
+
+    sock->op = SOCKET_IDLE;
+    return 1;
+}
+
+/* Names are resolved with getaddrinfo(), which blocks the whole I/O thread;
+ * scripts talking to remote services should use addresses (or names from
+ * /etc/hosts) to avoid that.  Connecting, though, doesn't block. */
+static int req_tcp_connect_cb(lua_State *L)
+{
+    size_t host_len;
+    const char *host = luaL_checklstring(L, 2, &host_len);
+    lua_Integer port = luaL_checkinteger(L, 3);
+    lua_Integer timeout = luaL_optinteger(L, 4, DEFAULT_TIMEOUT_MS);
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICSERV,
+    };
+    char backend[NI_MAXHOST + sizeof(":65535")];
+    struct addrinfo *addrs;
+    struct lua_socket *sock;
+    int gai_error;
+    int one = 1;
+
+    if (port <= 0 || port > 65535)
+        return luaL_argerror(L, 3, "invalid port");
+    if (timeout < 0)
+        return luaL_argerror(L, 4, "negative timeout");
+    if (host_len >= NI_MAXHOST)
+        return luaL_argerror(L, 2, "host name too long");
+
+    snprintf(backend, sizeof(backend), "%s:%d", host, (int)port);
+
+    sock = pool_take(L, backend);
+    if (sock) {
+        sock->timeout_ms = (unsigned int)timeout;
+        return 1;
+    }
+
+    sock = push_new_socket(L);
+    sock->timeout_ms = (unsigned int)timeout;
+    sock->backend = strdup(backend);
+    if (UNLIKELY(!sock->backend))
+        return push_error(L, sock, "out of memory");
+
+    gai_error = getaddrinfo(host, backend + host_len + 1, &hints, &addrs);
+    if (gai_error)
+        return push_error(L, sock, gai_strerror(gai_error));
+
+    sock->fd = socket(addrs->ai_family,
+                      addrs->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      addrs->ai_protocol);
+    if (sock->fd < 0) {
+        freeaddrinfo(addrs);
+        return push_error(L, sock, strerror(errno));
+    }
+
+    setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!connect(sock->fd, addrs->ai_addr, addrs->ai_addrlen)) {
+        freeaddrinfo(addrs);
+        return 1;
+    }
+    freeaddrinfo(addrs);
+
+    if (errno != EINPROGRESS)
+        return push_error(L, sock, strerror(errno));
+
+    sock->op = SOCKET_CONNECTING;
+    lua_pushvalue(L, -1);
+    sock->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return yield_if_pending(L, wait_for(L, sock, true, connect_resume));
+}
+
+static int finish_send(lua_State *L, struct lua_socket *sock, const char *error)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, sock->send_ref);
+    sock->send_ref = LUA_NOREF;
+    sock->send_data = NULL;
+
+    if (error)
+        return push_error(L, sock, error);
+
+    sock->op = SOCKET_IDLE;
+    lua_pushinteger(L, (lua_Integer)sock->sent);
+    return 1;
+}
+
+static int send_resume(lua_State *L, struct lua_socket *sock, bool ready);
+
+static int try_send(lua_State *L, struct lua_socket *sock)
+{
+    while (sock->sent < sock->send_len) {
+        ssize_t n = send(sock->fd, sock->send_data + sock->sent,
+                         sock->send_len - sock->sent, MSG_NOSIGNAL);
+
+        if (n > 0) {
+            sock->sent += (size_t)n;
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return wait_for(L, sock, true, send_resume);
+        }
+
+        return finish_send(L, sock, n < 0 ? strerror(errno) : "closed");
+    }
+
+    return finish_send(L, sock, NULL);
+}
+
+static int send_resume(lua_State *L, struct lua_socket *sock, bool ready)
+{
+    return ready ? try_send(L, sock) : finish_send(L, sock, "timeout");
+}
+
+static int sock_send_cb(lua_State *L)
+{
+    struct lua_socket *sock = check_socket(L);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+
+    if (sock->fd < 0)
+        return push_error(L, sock, "closed");
+
+    lua_pushvalue(L, 2);
+    sock->send_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    sock->send_data = data;
+    sock->send_len = len;
+    sock->sent = 0;
+    sock->op = SOCKET_SENDING;
+
+    return yield_if_pending(L, try_send(L, sock));
+}
+
+/* Pushes the next result of the pending receive(), if it's buffered. */
+static bool push_buffered(lua_State *L, struct lua_socket *sock)
+{
+    const char *start = sock->buffer + sock->buffer_start;
+    size_t available = sock->buffer_end - sock->buffer_start;
+
+    switch (sock->pattern) {
+    case RECEIVE_BYTES:
+        if (available < sock->wanted)
+            return false;
+
+        lua_pushlstring(L, start, sock->wanted);
+        sock->buffer_start += sock->wanted;
+        return true;
+
+    case RECEIVE_LINE: {
+        const char *newline = available ? memchr(start, '\n', available) : NULL;
+        size_t len;
+
+        if (!newline)
+            return false;
+
+        len = (size_t)(newline - start);
+        sock->buffer_start += len + 1;
+        if (len && start[len - 1] == '\r')
+            len--;
+
+        lua_pushlstring(L, start, len);
+        return true;
+    }
+
+    case RECEIVE_ALL:
+    default:
+        /* Everything is only returned once the connection is closed. */
+        return false;
+    }
+}
+
+static bool reserve_buffer(struct lua_socket *sock)
+{
+    size_t new_size;
+    char *buffer;
+
+    if (sock->buffer_start == sock->buffer_end)
+        sock->buffer_start = sock->buffer_end = 0;
+
+    if (sock->buffer_size - sock->buffer_end >= RECEIVE_CHUNK_SIZE)
+        return true;
+
+    if (sock->buffer_start) {
+        memmove(sock->buffer, sock->buffer + sock->buffer_start,
+                sock->buffer_end - sock->buffer_start);
+        sock->buffer_end -= sock->buffer_start;
+        sock->buffer_start = 0;
+
+        if (sock->buffer_size - sock->buffer_end >= RECEIVE_CHUNK_SIZE)
+            return true;
+    }
+
+    new_size = sock->buffer_size ? sock->buffer_size * 2 : RECEIVE_CHUNK_SIZE;
+    buffer = realloc(sock->buffer, new_size);
+    if (UNLIKELY(!buffer))
+        return false;
+
+    sock->buffer = buffer;
+    sock->buffer_size = new_size;
+    return true;
+}
+
+/* Returns nil, the error, and whatever was received so far. */
+static int receive_error(lua_State *L, struct lua_socket *sock, const char *error)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    lua_pushlstring(L, sock->buffer + sock->buffer_start,
+                    sock->buffer_end - sock->buffer_start);
+    socket_close(sock);
+    sock->op = SOCKET_IDLE;
+
+    return 3;
+}
+
+static int receive_resume(lua_State *L, struct lua_socket *sock, bool ready);
+
+static int try_receive(lua_State *L, struct lua_socket *sock)
+{
+    while (true) {
+        ssize_t n;
+
+        if (push_buffered(L, sock)) {
+            sock->op = SOCKET_IDLE;
+            return 1;
+        }
+
+        if (UNLIKELY(!reserve_buffer(sock)))
+            return receive_error(L, sock, "out of memory");
+
+        n = recv(sock->fd, sock->buffer + sock->buffer_end,
+                 sock->buffer_size - sock->buffer_end, 0);
+        if (n > 0) {
+            sock->buffer_end += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            if (sock->pattern != RECEIVE_ALL)
+                return receive_error(L, sock, "closed");
+
+            lua_pushlstring(L, sock->buffer + sock->buffer_start,
+                            sock->buffer_end - sock->buffer_start);
+            socket_close(sock);
+            sock->op = SOCKET_IDLE;
+            return 1;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN)
+            return wait_for(L, sock, false, receive_resume);
+
+        return receive_error(L, sock, strerror(errno));
+    }
+}
+
+static int receive_resume(lua_State *L, struct lua_socket *sock, bool ready)
+{
+    return ready ? try_receive(L, sock) : receive_error(L, sock, "timeout");
+}
+
+/* receive(n) returns n bytes, receive("*l") (the default) a line without
+ * its line ending, and receive("*a") everything until the connection is
+ * closed. */
+static int sock_receive_cb(lua_State *L)
+{
+    struct lua_socket *sock = check_socket(L);
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer wanted = lua_tointeger(L, 2);
+
+        if (wanted < 0)
+            return luaL_argerror(L, 2, "negative size");
+
+        sock->pattern = RECEIVE_BYTES;
+        sock->wanted = (size_t)wanted;
+    } else {
+        const char *pattern = luaL_optstring(L, 2, "*l");
+
+        if (!strcmp(pattern, "*l"))
+            sock->pattern = RECEIVE_LINE;
+        else if (!strcmp(pattern, "*a"))
+            sock->pattern = RECEIVE_ALL;
+        else
+            return luaL_argerror(L, 2, "invalid pattern");
+    }
+
+    if (sock->fd < 0)
+        return push_error(L, sock, "closed");
+
+    sock->op = SOCKET_RECEIVING;
+    return yield_if_pending(L, try_receive(L, sock));
+}
+
+static int sock_settimeout_cb(lua_State *L)
+{
+    struct lua_socket *sock = check_socket(L);
+    lua_Integer timeout = luaL_checkinteger(L, 2);
+
+    if (timeout < 0)
+        return luaL_argerror(L, 2, "negative timeout");
+
+    sock->timeout_ms = (unsigned int)timeout;
+    return 0;
+}
+
+/* Puts the connection in the pool for tcp_connect() to pick up later,
+ * for up to idle_ms; this socket object is closed. */
+static int sock_setkeepalive_cb(lua_State *L)
+{
+    struct lua_socket *sock = check_socket(L);
+    lua_Integer keepalive = luaL_optinteger(L, 2, DEFAULT_KEEPALIVE_MS);
+    struct lua_socket *pooled;
+    size_t n_pooled;
+
+    if (keepalive < 0)
+        return luaL_argerror(L, 2, "negative timeout");
+    if (sock->fd < 0)
+        return push_error(L, sock, "closed");
+    if (!sock->backend || sock->buffer_start != sock->buffer_end ||
+        !is_idle_connection_alive(sock->fd))
+        return push_error(L, sock, "connection can't be reused");
+
+    push_pool(L);
+    lua_getfield(L, -1, sock->backend);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, sock->backend);
+    }
+
+    n_pooled = lua_objlen(L, -1);
+    if (n_pooled >= POOL_SIZE_PER_BACKEND) {
+        lua_pop(L, 2);
+        socket_close(sock);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    pooled = push_new_socket(L);
+    pooled->fd = sock->fd;
+    pooled->backend = sock->backend;
+    pooled->buffer = sock->buffer;
+    pooled->buffer_size = sock->buffer_size;
+    pooled->idle_deadline_ns =
+        lwan_monotonic_ns() + (unsigned long long)keepalive * 1000000ull;
+    lua_rawseti(L, -2, (int)n_pooled + 1);
+    lua_pop(L, 2);
+
+    sock->fd = -1;
+    sock->backend = NULL;
+    sock->buffer = NULL;
+    sock->buffer_size = 0;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int sock_close_cb(lua_State *L)
+{
+    socket_close(check_socket(L));
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int sock_reused_cb(lua_State *L)
+{
+    struct lua_socket *sock = luaL_checkudata(L, 1, socket_metatable_name);
+
+    lua_pushboolean(L, sock->reused);
+    return 1;
+}
+
+static int sock_gc_cb(lua_State *L)
+{
+    struct lua_socket *sock = luaL_checkudata(L, 1, socket_metatable_name);
+
+    socket_close(sock);
+    free(sock->buffer);
+    free(sock->backend);
+
+    return 0;
+}
+
+static const struct luaL_reg lwan_socket_meta_regs[] = {
+    { "send", sock_send_cb },
+    { "receive", sock_receive_cb },
+    { "settimeout", sock_settimeout_cb },
+    { "setkeepalive", sock_setkeepalive_cb },
+    { "close", sock_close_cb },
+    { "reused", sock_reused_cb },
+    { "__gc", sock_gc_cb },
+    { NULL, NULL }
+};
+
+/* Called with the request metatable; adds req:http_request(), built on the
+ * sockets.  Takes a URL, or a table with "url", and optionally "method",
+ * "headers", "body", "timeout" and "keepalive_timeout" (both in
+ * milliseconds, for each operation and for the idle connection
+ * afterwards).  Returns the status code, the body and the headers (with
+ * lowercase names), or nil and an error message. */
+static const char http_client_prelude[] =
+    "local methods = ...\n"
+    "local byte, find, lower, match = string.byte, string.find, string.lower, string.match\n"
+    "local concat, pairs, tonumber, type = table.concat, pairs, tonumber, type\n"
+    "local function parse_url(url)\n"
+    "    local host, port, path = match(url, '^http://%[([^%]]+)%]:?(%d*)(.*)$')\n"
+    "    local authority\n"
+    "    if host then\n"
+    "        authority = '[' .. host .. ']'\n"
+    "    else\n"
+    "        host, port, path = match(url, '^http://([^/:?#]+):?(%d*)(.*)$')\n"
+    "        if not host then return nil end\n"
+    "        authority = host\n"
+    "    end\n"
+    "    path = match(path, '^[^#]*')\n"
+    "    if path == '' then path = '/'\n"
+    "    elseif byte(path) == 63 then path = '/' .. path\n"
+    "    elseif byte(path) ~= 47 then return nil end\n"
+    "    if port == '' then\n"
+    "        port = 80\n"
+    "    else\n"
+    "        port = tonumber(port)\n"
+    "        authority = authority .. ':' .. port\n"
+    "    end\n"
+    "    return host, port, authority, path\n"
+    "end\n"
+    "local function read_headers(sock)\n"
+    "    local line, err = sock:receive('*l')\n"
+    "    if not line then return nil, err end\n"
+    "    local version, status = match(line, '^HTTP/(%d%.%d) (%d%d%d)')\n"
+    "    if not version then return nil, 'invalid status line' end\n"
+    "    local headers = {}\n"
+    "    while true do\n"
+    "        line, err = sock:receive('*l')\n"
+    "        if not line then return nil, err end\n"
+    "        if line == '' then return tonumber(status), version, headers end\n"
+    "        local name, value = match(line, '^([^:]+):%s*(.-)%s*$')\n"
+    "        if not name then return nil, 'invalid header' end\n"
+    "        name = lower(name)\n"
+    "        local previous = headers[name]\n"
+    "        headers[name] = previous and (previous .. ', ' .. value) or value\n"
+    "    end\n"
+    "end\n"
+    "local function read_chunked(sock)\n"
+    "    local chunks = {}\n"
+    "    while true do\n"
+    "        local line, err = sock:receive('*l')\n"
+    "        if not line then return nil, err end\n"
+    "        local size = match(line, '^%x+')\n"
+    "        if not size then return nil, 'invalid chunk' end\n"
+    "        size = tonumber(size, 16)\n"
+    "        if size == 0 then\n"
+    "            repeat\n"
+    "                line, err = sock:receive('*l')\n"
+    "                if not line then return nil, err end\n"
+    "            until line == ''\n"
+    "            return concat(chunks)\n"
+    "        end\n"
+    "        local data\n"
+    "        data, err = sock:receive(size)\n"
+    "        if not data then return nil, err end\n"
+    "        chunks[#chunks + 1] = data\n"
+    "        line, err = sock:receive('*l')\n"
+    "        if line ~= '' then return nil, err or 'invalid chunk' end\n"
+    "    end\n"
+    "end\n"
+    "local function has_token(value, token)\n"
+    "    return value and find(lower(value), token, 1, true)\n"
+    "end\n"
+    "local function request_once(sock, request, method)\n"
+    "    local ok, err = sock:send(request)\n"
+    "    if not ok then return nil, err, true end\n"
+    "    local status, version, headers\n"
+    "    repeat\n"
+    "        status, version, headers = read_headers(sock)\n"
+    "        if not status then return nil, version, true end\n"
+    "    until status >= 200 or status == 101\n"
+    "    local body, keepalive = '', version == '1.1'\n"
+    "    if has_token(headers['connection'], 'close') then keepalive = false end\n"
+    "    if method == 'HEAD' or status == 204 or status == 304 or status == 101 then\n"
+    "        body = ''\n"
+    "    elseif has_token(headers['transfer-encoding'], 'chunked') then\n"
+    "        body, err = read_chunked(sock)\n"
+    "    elseif headers['content-length'] then\n"
+    "        local len = tonumber(headers['content-length'])\n"
+    "        if not len then return nil, 'invalid content-length' end\n"
+    "        body, err = sock:receive(len)\n"
+    "    else\n"
+    "        body, err = sock:receive('*a')\n"
+    "        keepalive = false\n"
+    "    end\n"
+    "    if not body then return nil, err end\n"
+    "    return status, body, headers, keepalive\n"
+    "end\n"
+    "function methods.http_request(req, params)\n"
+    "    if type(params) == 'string' then params = { url = params } end\n"
+    "    local host, port, authority, path = parse_url(params.url or '')\n"
+    "    if not host then return nil, 'invalid URL' end\n"
+    "    local method, body = params.method or 'GET', params.body\n"
+    "    local lines, given = { method .. ' ' .. path .. ' HTTP/1.1' }, {}\n"
+    "    for name, value in pairs(params.headers or {}) do\n"
+    "        lines[#lines + 1] = name .. ': ' .. value\n"
+    "        given[lower(name)] = true\n"
+    "    end\n"
+    "    if not given['host'] then lines[#lines + 1] = 'Host: ' .. authority end\n"
+    "    if body and not given['content-length'] then\n"
+    "        lines[#lines + 1] = 'Content-Length: ' .. #body\n"
+    "    end\n"
+    "    lines[#lines + 1] = '\\r\\n'\n"
+    "    local request = concat(lines, '\\r\\n') .. (body or '')\n"
+    "    for attempt = 1, 2 do\n"
+    "        local sock, err = req:tcp_connect(host, port, params.timeout)\n"
+    "        if not sock then return nil, err end\n"
+    "        local reused = sock:reused()\n"
+    "        local status, response, headers, keepalive = request_once(sock, request, method)\n"
+    "        if status then\n"
+    "            if keepalive then\n"
+    "                sock:setkeepalive(params.keepalive_timeout)\n"
+    "            else\n"
+    "                sock:close()\n"
+    "            end\n"
+    "            return status, response, headers\n"
+    "        end\n"
+    "        sock:close()\n"
+    "        -- A pooled connection might have been closed by the server in\n"
+    "        -- the meantime; on failures before the status line (flagged in\n"
+    "        -- place of the headers), try again with a new one.\n"
+    "        if not (reused and headers) then return nil, response end\n"
+    "    end\n"
+    "    return nil, 'closed'\n"
+    "end\n";
+
+void lwan_lua_socket_register(lua_State *L)
+{
+    luaL_newmetatable(L, socket_metatable_name);
+    luaL_register(L, NULL, lwan_socket_meta_regs);
+    lua_setfield(L, -1, "__index");
+
+    luaL_getmetatable(L, "Lwan.Request");
+    lua_pushcfunction(L, req_tcp_connect_cb);
+    lua_setfield(L, -2, "tcp_connect");
+
+    if (UNLIKELY(luaL_loadbuffer(L, http_client_prelude,
+                                 sizeof(http_client_prelude) - 1,
+                                 "=lwan-http") != 0)) {
+        lwan_status_warning("Could not register HTTP client: %s",
+                            lua_tostring(L, -1));
+        lua_pop(L, 2);
+        return;
+    }
+
+    lua_pushvalue(L, -2);
+    if (UNLIKELY(lua_pcall(L, 1, 0, 0) != 0)) {
+        lwan_status_warning("Could not register HTTP client: %s",
+                            lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
@@ -193,12 +193,94 @@ static const struct luaL_reg lwan_request_meta_regs[] = {
     { NULL, NULL }
 };
 
+#if defined(HAVE_LUAJIT)
+/* Request methods that neither yield nor call back into Lua are also
+ * exposed as plain C functions, and called through LuaJIT's FFI, which
+ * the JIT compiler can turn into direct calls.  The others (say(),
+ * send_event(), set_headers()) keep using the C API, as an FFI call must
+ * not leave the coroutine while it's running. */
+struct lwan_lua_ffi_api {
+    const char *(*query_param)(struct lwan_request *request, const char *key);
+    const char *(*post_param)(struct lwan_request *request, const char *key);
+    const char *(*cookie)(struct lwan_request *request, const char *key);
+    void (*set_response)(struct lwan_request *request,
+                         const char *str,
+                         size_t len);
+};
+
+static void ffi_set_response(struct lwan_request *request,
+                             const char *str,
+                             size_t len)
+{
+    lwan_strbuf_set(request->response.buffer, str, len);
+}
+
+static const struct lwan_lua_ffi_api ffi_api = {
+    .query_param = lwan_request_get_query_param,
+    .post_param = lwan_request_get_post_param,
+    .cookie = lwan_request_get_cookie,
+    .set_response = ffi_set_response,
+};
+
+/* Called with the address of ffi_api and the request metatable; replaces
+ * the metatable entries with functions using the FFI.  The request
+ * userdata holds a pointer to the request, which the FFI can read. */
+static const char ffi_prelude[] =
+    "local ffi = require('ffi')\n"
+    "ffi.cdef[[\n"
+    "struct lwan_request;\n"
+    "struct lwan_lua_ffi_api {\n"
+    "    const char *(*query_param)(struct lwan_request *, const char *);\n"
+    "    const char *(*post_param)(struct lwan_request *, const char *);\n"
+    "    const char *(*cookie)(struct lwan_request *, const char *);\n"
+    "    void (*set_response)(struct lwan_request *, const char *, size_t);\n"
+    "};\n"
+    "]]\n"
+    "local api = ffi.cast('const struct lwan_lua_ffi_api *', (...))\n"
+    "local methods = select(2, ...)\n"
+    "local request_ptr = ffi.typeof('struct lwan_request **')\n"
+    "local cast, tostr = ffi.cast, ffi.string\n"
+    "local function getter(func)\n"
+    "    return function(req, key)\n"
+    "        local value = func(cast(request_ptr, req)[0], key)\n"
+    "        if value ~= nil then return tostr(value) end\n"
+    "    end\n"
+    "end\n"
+    "methods.query_param = getter(api.query_param)\n"
+    "methods.post_param = getter(api.post_param)\n"
+    "methods.cookie = getter(api.cookie)\n"
+    "methods.set_response = function(req, str)\n"
+    "    if type(str) ~= 'string' then str = tostring(str) end\n"
+    "    api.set_response(cast(request_ptr, req)[0], str, #str)\n"
+    "end\n";
+
+static void register_ffi_methods(lua_State *L)
+{
+    if (UNLIKELY(luaL_loadbuffer(L, ffi_prelude, sizeof(ffi_prelude) - 1,
+                                 "=lwan-ffi") != 0))
+        goto error;
+
+    lua_pushlightuserdata(L, (void *)&ffi_api);
+    luaL_getmetatable(L, request_metatable_name);
+    if (UNLIKELY(lua_pcall(L, 2, 0, 0) != 0))
+        goto error;
+
+    return;
+
+error:
+    /* The C API methods are still registered, so this isn't fatal. */
+    lwan_status_warning("Could not register FFI request methods: %s",
+                        lua_tostring(L, -1));
+    lua_pop(L, 1);
+}
+#endif
+
 const char *lwan_lua_state_last_error(lua_State *L)
 {
     return lua_tostring(L, -1);
 }
 
-lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+static lua_State *new_state(bool use_ffi)
 {
     lua_State *L;
 
@@ -212,6 +294,27 @@ lua_State *lwan_lua_create_state(const char *script_file, const char *script)
     luaL_register(L, NULL, lwan_request_meta_regs);
     lua_setfield(L, -1, "__index");
 
+    lwan_lua_socket_register(L);
+
+#if defined(HAVE_LUAJIT)
+    if (use_ffi)
+        register_ffi_methods(L);
+#else
+    (void)use_ffi;
+#endif
+
+    return L;
+}
+
+static lua_State *create_state(const char *script_file,
+                               const char *script,
+                               bool use_ffi)
+{
+    lua_State *L = new_state(use_ffi);
+
+    if (UNLIKELY(!L))
+        return NULL;
+
     if (script_file) {
         if (UNLIKELY(luaL_dofile(L, script_file) != 0)) {
             lwan_status_error("Error opening Lua script %s: %s",
@@ -230,6 +333,85 @@ close_lua_state:
     return NULL;
 }
 
+lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+{
+    return create_state(script_file, script, true);
+}
+
+#if defined(HAVE_LUAJIT)
+lua_State *lwan_lua_create_state_without_ffi(const char *script_file,
+                                             const char *script)
+{
+    return create_state(script_file, script, false);
+}
+#endif
+
+static int append_to_strbuf(lua_State *L __attribute__((unused)),
+                            const void *p,
+                            size_t sz,
+                            void *ud)
+{
+    return lwan_strbuf_append_str(ud, p, sz) ? 0 : -1;
+}
+
+struct lwan_strbuf *lwan_lua_compile(const char *script_file,
+                                     const char *script)
+{
+    struct lwan_strbuf *bytecode = NULL;
+    lua_State *L;
+    int ret;
+
+    /* Only the parser is needed here, so no libraries are opened. */
+    L = luaL_newstate();
+    if (UNLIKELY(!L))
+        return NULL;
+
+    if (script_file)
+        ret = luaL_loadfile(L, script_file);
+    else
+        ret = luaL_loadstring(L, script);
+    if (UNLIKELY(ret != 0)) {
+        lwan_status_error("Could not compile Lua script %s: %s",
+                          script_file ? script_file : "", lua_tostring(L, -1));
+        goto out;
+    }
+
+    bytecode = lwan_strbuf_new();
+    if (UNLIKELY(!bytecode))
+        goto out;
+
+    if (UNLIKELY(lua_dump(L, append_to_strbuf, bytecode) != 0)) {
+        lwan_status_error("Could not dump bytecode for Lua script %s",
+                          script_file ? script_file : "");
+        lwan_strbuf_free(bytecode);
+        bytecode = NULL;
+    }
+
+out:
+    lua_close(L);
+    return bytecode;
+}
+
+lua_State *lwan_lua_create_state_from_bytecode(const struct lwan_strbuf *bytecode,
+                                               const char *name)
+{
+    lua_State *L = new_state(true);
+
+    if (UNLIKELY(!L))
+        return NULL;
+
+    if (UNLIKELY(luaL_loadbuffer(L, lwan_strbuf_get_buffer(bytecode),
+                                 lwan_strbuf_get_length(bytecode), name) != 0 ||
+                 lua_pcall(L, 0, 0, 0) != 0)) {
+        lwan_status_error("Error evaluating Lua script %s: %s", name,
+                          lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
+    }
+
+    return L;
+}
+
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request)
 {
     struct lwan_request **userdata = lua_newuserdata(L, sizeof(struct lwan_request *));
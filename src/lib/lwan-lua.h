@@ -24,4 +24,25 @@
 const char *lwan_lua_state_last_error(lua_State *L);
 lua_State *lwan_lua_create_state(const char *script_file, const char *script);
 
+/* Parses a script once, so that many states can be created from it
+ * without parsing it again. */
+struct lwan_strbuf *lwan_lua_compile(const char *script_file,
+                                     const char *script);
+lua_State *lwan_lua_create_state_from_bytecode(const struct lwan_strbuf *bytecode,
+                                               const char *name);
+#if defined(HAVE_LUAJIT)
+/* Same as above, but with request methods implemented only with the Lua C
+ * API; used to compare them with the FFI bindings. */
+lua_State *lwan_lua_create_state_without_ffi(const char *script_file,
+                                             const char *script);
+#endif
+
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request);
+
+/* Adds req:tcp_connect() and req:http_request() to the request metatable.
+ * Sockets yield when they'd block; after a script yields, the handler has
+ * to call lwan_lua_resume_pending(), which waits for the socket and returns
+ * how many values to resume the script with, or -1 if the script yielded
+ * by itself. */
+void lwan_lua_socket_register(lua_State *L);
+int lwan_lua_resume_pending(lua_State *L, struct lwan_request *request);
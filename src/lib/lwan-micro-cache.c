@@ -0,0 +1,592 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lwan-private.h"
+#include "lwan-cache.h"
+#include "lwan-micro-cache.h"
+
+#define GET_ENTRY_TRIES 5
+/* Doubled on every try, so that a request waits for about half a second
+ * for a placeholder to be filled before calling the handler itself. */
+#define FILL_WAIT_MS 32
+
+struct vary {
+    char *names;
+    const char **name;
+    size_t n_names;
+};
+
+struct lwan_micro_cache {
+    struct cache *cache;
+    unsigned int ttl;
+    struct vary headers;
+    struct vary cookies;
+};
+
+struct micro_cache_entry {
+    struct cache_entry base;
+
+    time_t fresh_until;
+    int revalidating;
+    /* Set for the placeholder added on a miss, until the handler called
+     * by whoever added it is done and the entry has been replaced. */
+    int filling;
+    /* Set for responses that can't be cached: requests are passed
+     * straight to the handler until the entry goes stale. */
+    bool pass;
+
+    enum lwan_http_status status;
+    const char *mime_type;
+    char *body;
+    size_t body_len;
+    /* Terminated by a NULL key; the strings follow the array. */
+    struct lwan_key_value headers[];
+};
+
+/* The request looking up an entry.  The cache doesn't pass anything but
+ * the key to the create callback, so it's found here, set by the coroutine
+ * looking up the entry right before each lookup. */
+struct micro_cache_fill {
+    struct lwan_request *request;
+    const struct lwan_url_map *url_map;
+    /* If not NULL, used as the new entry instead of a placeholder. */
+    struct micro_cache_entry *entry;
+    enum lwan_http_status status;
+    /* Set if the lookup added a placeholder to be filled by this request. */
+    bool created;
+};
+
+/* Withdraws the placeholder of a request that's gone before its handler
+ * was done (e.g. the client went away while it was sleeping), so that the
+ * requests waiting for it try again. */
+struct micro_cache_abandon {
+    struct lwan_micro_cache *mc;
+    const char *key;
+    struct micro_cache_entry *placeholder;
+};
+
+static __thread struct micro_cache_fill *current_fill;
+
+static bool vary_init(struct vary *vary, const char *names)
+{
+    char *name, *saveptr;
+
+    vary->names = NULL;
+    vary->name = NULL;
+    vary->n_names = 0;
+
+    if (!names)
+        return true;
+
+    vary->names = strdup(names);
+    if (!vary->names)
+        return false;
+
+    /* Overestimated if there are empty names, but that's fine. */
+    vary->name = calloc(strlen(names) / 2 + 1, sizeof(*vary->name));
+    if (!vary->name) {
+        free(vary->names);
+        return false;
+    }
+
+    for (name = strtok_r(vary->names, ", \t", &saveptr); name;
+         name = strtok_r(NULL, ", \t", &saveptr))
+        vary->name[vary->n_names++] = name;
+
+    return true;
+}
+
+static void vary_free(struct vary *vary)
+{
+    free(vary->name);
+    free(vary->names);
+}
+
+static bool is_cacheable(const struct lwan_request *request,
+                         enum lwan_http_status status)
+{
+    const struct lwan_key_value *header;
+
+    if (status >= HTTP_INTERNAL_ERROR)
+        return false;
+
+    /* Responses that have been sent already (or that are going to be sent
+     * by something else) aren't in the response buffer. */
+    if (request->flags & (RESPONSE_SENT_HEADERS | RESPONSE_CHUNKED_ENCODING |
+                          RESPONSE_NO_CONTENT_LENGTH | RESPONSE_URL_REWRITTEN))
+        return false;
+    if (request->response.stream.callback)
+        return false;
+
+    for (header = request->response.headers; header && header->key; header++) {
+        if (!strcasecmp(header->key, "Set-Cookie"))
+            return false;
+
+        if (!strcasecmp(header->key, "Cache-Control") &&
+            (strcasestr(header->value, "private") ||
+             strcasestr(header->value, "no-store") ||
+             strcasestr(header->value, "no-cache")))
+            return false;
+    }
+
+    return true;
+}
+
+static struct micro_cache_entry *
+entry_from_response(const struct lwan_micro_cache *mc,
+                    const struct lwan_request *request,
+                    enum lwan_http_status status)
+{
+    const struct lwan_response *response = &request->response;
+    const struct lwan_key_value *header;
+    bool pass = !is_cacheable(request, status);
+    size_t n_headers = 0, strings_len = 0, body_len = 0;
+    struct micro_cache_entry *entry;
+    size_t size;
+    char *p;
+
+    if (!pass) {
+        for (header = response->headers; header && header->key; header++) {
+            strings_len += strlen(header->key) + strlen(header->value) + 2;
+            n_headers++;
+        }
+        if (response->mime_type)
+            strings_len += strlen(response->mime_type) + 1;
+        body_len = lwan_strbuf_get_length(response->buffer);
+    }
+
+    size = sizeof(*entry) + (n_headers + 1) * sizeof(entry->headers[0]) +
+           strings_len + body_len + 1;
+    entry = malloc(size);
+    if (UNLIKELY(!entry))
+        return NULL;
+
+    p = (char *)&entry->headers[n_headers + 1];
+
+    for (size_t i = 0; i < n_headers; i++) {
+        header = &response->headers[i];
+
+        entry->headers[i].key = p;
+        p = stpcpy(p, header->key) + 1;
+        entry->headers[i].value = p;
+        p = stpcpy(p, header->value) + 1;
+    }
+    entry->headers[n_headers] = (struct lwan_key_value){};
+
+    if (!pass && response->mime_type) {
+        entry->mime_type = p;
+        p = stpcpy(p, response->mime_type) + 1;
+    } else {
+        entry->mime_type = NULL;
+    }
+
+    entry->body = p;
+    entry->body_len = body_len;
+    if (body_len)
+        memcpy(p, lwan_strbuf_get_buffer(response->buffer), body_len);
+    p[body_len] = '\0';
+
+    entry->base.size = size;
+    entry->fresh_until = lwan_clock_get()->monotonic + mc->ttl;
+    entry->revalidating = 0;
+    entry->filling = 0;
+    entry->pass = pass;
+    entry->status = status;
+
+    return entry;
+}
+
+static struct micro_cache_entry *entry_placeholder(void)
+{
+    size_t size = sizeof(struct micro_cache_entry) +
+                  sizeof(struct lwan_key_value) + 1;
+    struct micro_cache_entry *entry = malloc(size);
+
+    if (UNLIKELY(!entry))
+        return NULL;
+
+    entry->headers[0] = (struct lwan_key_value){};
+    entry->body = (char *)&entry->headers[1];
+    entry->body[0] = '\0';
+    entry->body_len = 0;
+    entry->mime_type = NULL;
+    entry->base.size = size;
+    entry->fresh_until = 0;
+    entry->revalidating = 0;
+    entry->filling = 1;
+    entry->pass = true;
+    entry->status = HTTP_INTERNAL_ERROR;
+
+    return entry;
+}
+
+static ALWAYS_INLINE enum lwan_http_status
+call_handler(const struct lwan_url_map *url_map, struct lwan_request *request)
+{
+    return url_map->handler(request, &request->response, url_map->data);
+}
+
+static struct cache_entry *create_entry(const char *key __attribute__((unused)),
+                                        void *context)
+{
+    struct micro_cache_fill *fill = current_fill;
+    struct micro_cache_entry *entry;
+
+    /* Entries are only created by lookups from this file. */
+    if (UNLIKELY(!fill))
+        return NULL;
+
+    current_fill = NULL;
+
+    if (fill->entry) {
+        entry = fill->entry;
+        fill->entry = NULL;
+        return &entry->base;
+    }
+
+    /* The handler isn't called from here: it might yield, and the cache
+     * keeps track of entries being created in the stack of the caller.
+     * Others looking for the same key wait on the placeholder instead. */
+    entry = entry_placeholder();
+    if (UNLIKELY(!entry))
+        return NULL;
+
+    fill->created = true;
+    return &entry->base;
+}
+
+static void destroy_entry(struct cache_entry *entry,
+                          void *context __attribute__((unused)))
+{
+    free(entry);
+}
+
+struct lwan_micro_cache *
+lwan_micro_cache_new(const struct lwan_micro_cache_settings *settings)
+{
+    struct lwan_micro_cache *mc;
+
+    if (!settings->ttl)
+        return NULL;
+
+    mc = malloc(sizeof(*mc));
+    if (!mc)
+        return NULL;
+
+    if (!vary_init(&mc->headers, settings->vary_headers))
+        goto free_mc;
+    if (!vary_init(&mc->cookies, settings->vary_cookies))
+        goto free_headers;
+
+    /* Entries stay around past their TTL for as long as they can be
+     * served while being revalidated. */
+    mc->cache = cache_create(create_entry, destroy_entry, mc,
+                             (time_t)settings->ttl +
+                                 (time_t)settings->stale_while_revalidate);
+    if (!mc->cache)
+        goto free_cookies;
+
+    cache_set_limits(mc->cache, settings->max_entries, settings->max_size);
+    mc->ttl = settings->ttl;
+
+    return mc;
+
+free_cookies:
+    vary_free(&mc->cookies);
+free_headers:
+    vary_free(&mc->headers);
+free_mc:
+    free(mc);
+    return NULL;
+}
+
+void lwan_micro_cache_free(struct lwan_micro_cache *mc)
+{
+    if (mc) {
+        cache_destroy(mc->cache);
+        vary_free(&mc->headers);
+        vary_free(&mc->cookies);
+        free(mc);
+    }
+}
+
+struct header_lookup {
+    const char *name;
+    size_t len;
+    struct lwan_value value;
+};
+
+static bool find_header(const struct lwan_value *name,
+                        const struct lwan_value *value,
+                        void *data)
+{
+    struct header_lookup *lookup = data;
+
+    if (name->len == lookup->len &&
+        !strncasecmp(name->value, lookup->name, lookup->len)) {
+        lookup->value = *value;
+        return false;
+    }
+
+    return true;
+}
+
+/* The decoded path, the query string, and then each one of the headers and
+ * cookies the response varies on, separated by line breaks, which can't
+ * appear in any of these. */
+static const char *build_key(const struct lwan_micro_cache *mc,
+                             struct lwan_request *request)
+{
+    struct lwan_strbuf *key = lwan_strbuf_new();
+    const struct lwan_value *query_string;
+
+    if (UNLIKELY(!key))
+        return NULL;
+    coro_defer(request->conn->coro, CORO_DEFER(lwan_strbuf_free), key);
+
+    if (!lwan_strbuf_set(key, request->original_url.value,
+                         request->original_url.len))
+        return NULL;
+
+    query_string = lwan_request_get_raw_query_string(request);
+    if (query_string) {
+        if (query_string->len &&
+            (!lwan_strbuf_append_char(key, '?') ||
+             !lwan_strbuf_append_str(key, query_string->value,
+                                     query_string->len)))
+            return NULL;
+    } else {
+        /* Already parsed (and decoded), e.g. by a rewrite. */
+        const struct lwan_key_value *param;
+
+        for (param = lwan_request_get_query_params(request);
+             param && param->key; param++) {
+            if (!lwan_strbuf_append_printf(key, "&%s=%s", param->key,
+                                           param->value))
+                return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < mc->headers.n_names; i++) {
+        struct header_lookup lookup = {
+            .name = mc->headers.name[i],
+            .len = strlen(mc->headers.name[i]),
+        };
+
+        lwan_request_foreach_header(request, find_header, &lookup);
+
+        if (!lwan_strbuf_append_char(key, '\n') ||
+            (lookup.value.len &&
+             !lwan_strbuf_append_str(key, lookup.value.value,
+                                     lookup.value.len)))
+            return NULL;
+    }
+
+    for (size_t i = 0; i < mc->cookies.n_names; i++) {
+        const char *value = lwan_request_get_cookie(request, mc->cookies.name[i]);
+
+        if (!lwan_strbuf_append_char(key, '\n') ||
+            (value && !lwan_strbuf_append_str(key, value, strlen(value))))
+            return NULL;
+    }
+
+    return lwan_strbuf_get_buffer(key);
+}
+
+static struct micro_cache_entry *get_entry(struct lwan_micro_cache *mc,
+                                           const char *key,
+                                           struct micro_cache_fill *fill)
+{
+    struct coro *coro = fill->request->conn->coro;
+
+    for (int tries = GET_ENTRY_TRIES; tries;) {
+        struct cache_entry *ce;
+        int error;
+
+        fill->created = false;
+        current_fill = fill;
+        ce = cache_get_and_ref_entry(mc->cache, key, &error);
+        current_fill = NULL;
+
+        if (LIKELY(ce)) {
+            struct micro_cache_entry *entry = (struct micro_cache_entry *)ce;
+
+            coro_defer2(coro, CORO_DEFER2(cache_entry_unref), mc->cache, ce);
+            if (LIKELY(!ATOMIC_READ(entry->filling)) || fill->created)
+                return entry;
+
+            /* Someone else is calling the handler for this key.  The
+             * placeholder is only done with once its replacement is in
+             * the cache, or once that request is gone; if that takes too
+             * long, the handler is called for this request as well. */
+            if (!--tries)
+                break;
+            lwan_request_sleep(fill->request,
+                               FILL_WAIT_MS << (GET_ENTRY_TRIES - tries - 1));
+            continue;
+        }
+
+        /* Someone else is creating this entry: wait for them, as that
+         * might take as long as calling the handler here. */
+        if (error == EWOULDBLOCK)
+            tries--;
+        else if (error != EINPROGRESS)
+            return NULL;
+
+        coro_yield(coro, CONN_CORO_MAY_RESUME);
+    }
+
+    return NULL;
+}
+
+/* Calls the handler, and replaces old (a stale entry, or the placeholder
+ * added by this request) with the new response. */
+static enum lwan_http_status replace_entry(struct lwan_micro_cache *mc,
+                                           const char *key,
+                                           struct micro_cache_entry *old,
+                                           struct micro_cache_fill *fill)
+{
+    struct micro_cache_entry *entry;
+
+    fill->status = call_handler(fill->url_map, fill->request);
+
+    entry = entry_from_response(mc, fill->request, fill->status);
+    if (entry && cache_invalidate_entry(mc->cache, key, &old->base)) {
+        struct cache_entry *ce;
+        int error;
+
+        fill->entry = entry;
+        current_fill = fill;
+        ce = cache_get_and_ref_entry(mc->cache, key, &error);
+        current_fill = NULL;
+
+        if (ce)
+            cache_entry_unref(mc->cache, ce);
+
+        /* Not used if another entry made it to the cache first. */
+        entry = fill->entry;
+    }
+
+    free(entry);
+
+    return fill->status;
+}
+
+/* Everybody else gets the stale entry while the first request to get to it
+ * replaces it. */
+static enum lwan_http_status revalidate(struct lwan_micro_cache *mc,
+                                        const char *key,
+                                        struct micro_cache_entry *stale,
+                                        struct micro_cache_fill *fill)
+{
+    enum lwan_http_status status = replace_entry(mc, key, stale, fill);
+
+    ATOMIC_READ(stale->revalidating) = 0;
+
+    return status;
+}
+
+static void abandon_placeholder(void *data)
+{
+    struct micro_cache_abandon *abandon = data;
+
+    if (ATOMIC_READ(abandon->placeholder->filling)) {
+        cache_invalidate_entry(abandon->mc->cache, abandon->key,
+                               &abandon->placeholder->base);
+        ATOMIC_READ(abandon->placeholder->filling) = 0;
+    }
+}
+
+/* Requests for the key wait for this one, as calling the handler for each
+ * one of them would take just as long. */
+static enum lwan_http_status fill_placeholder(struct lwan_micro_cache *mc,
+                                              const char *key,
+                                              struct micro_cache_entry *placeholder,
+                                              struct micro_cache_fill *fill)
+{
+    struct coro *coro = fill->request->conn->coro;
+    struct micro_cache_abandon *abandon =
+        coro_malloc(coro, sizeof(*abandon));
+    enum lwan_http_status status;
+
+    if (UNLIKELY(!abandon)) {
+        cache_invalidate_entry(mc->cache, key, &placeholder->base);
+        ATOMIC_READ(placeholder->filling) = 0;
+        return call_handler(fill->url_map, fill->request);
+    }
+
+    /* Deferred after the strbuf holding the key, and after the reference
+     * to the placeholder, so it runs before either one goes away. */
+    *abandon = (struct micro_cache_abandon){
+        .mc = mc,
+        .key = key,
+        .placeholder = placeholder,
+    };
+    coro_defer(coro, abandon_placeholder, abandon);
+
+    status = replace_entry(mc, key, placeholder, fill);
+    ATOMIC_READ(placeholder->filling) = 0;
+
+    return status;
+}
+
+enum lwan_http_status lwan_micro_cache_handle(struct lwan_micro_cache *mc,
+                                              const struct lwan_url_map *url_map,
+                                              struct lwan_request *request)
+{
+    enum lwan_request_flags method = lwan_request_get_method(request);
+    struct micro_cache_fill fill = {.request = request, .url_map = url_map};
+    struct micro_cache_entry *entry;
+    const char *key;
+
+    if (method != REQUEST_METHOD_GET && method != REQUEST_METHOD_HEAD)
+        return call_handler(url_map, request);
+
+    key = build_key(mc, request);
+    if (UNLIKELY(!key))
+        return call_handler(url_map, request);
+
+    entry = get_entry(mc, key, &fill);
+    if (UNLIKELY(!entry))
+        return call_handler(url_map, request);
+
+    if (fill.created)
+        return fill_placeholder(mc, key, entry, &fill);
+
+    if (UNLIKELY(lwan_clock_get()->monotonic >= entry->fresh_until) &&
+        __sync_bool_compare_and_swap(&entry->revalidating, 0, 1))
+        return revalidate(mc, key, entry, &fill);
+
+    if (entry->pass)
+        return call_handler(url_map, request);
+
+    request->response.mime_type = entry->mime_type;
+    request->response.headers = entry->headers;
+    lwan_strbuf_set_static(request->response.buffer, entry->body,
+                           entry->body_len);
+
+    return entry->status;
+}
@@ -0,0 +1,51 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include "lwan.h"
+
+/* Caches the responses of a url map for a few seconds, keyed by the URL
+ * and by the values of some request headers and cookies, so that hits
+ * never get to the handler.  Only one request regenerates an entry at a
+ * time: while an entry is missing, others wait for it; once it's stale,
+ * others are served the old one in the meantime. */
+
+struct lwan_micro_cache;
+
+struct lwan_micro_cache_settings {
+    unsigned int ttl;
+    unsigned int stale_while_revalidate;
+    /* Comma-separated names; NULL if none. */
+    const char *vary_headers;
+    const char *vary_cookies;
+    /* 0 means unlimited. */
+    size_t max_entries;
+    size_t max_size;
+};
+
+struct lwan_micro_cache *
+lwan_micro_cache_new(const struct lwan_micro_cache_settings *settings);
+void lwan_micro_cache_free(struct lwan_micro_cache *mc);
+
+/* Called in place of the handler of url maps with HANDLER_MICRO_CACHE. */
+enum lwan_http_status lwan_micro_cache_handle(struct lwan_micro_cache *mc,
+                                              const struct lwan_url_map *url_map,
+                                              struct lwan_request *request);
@@ -25,11 +25,11 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "lwan-private.h"
 
 #include "lwan-array.h"
-#include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-lua.h"
 #include "lwan-mod-lua.h"
@@ -38,57 +38,131 @@ struct lwan_lua_priv {
     char *default_type;
     char *script_file;
     char *script;
-    pthread_key_t cache_key;
-    unsigned cache_period;
+
+    /* The script is compiled only once; each I/O thread gets its own Lua
+     * state, loaded from this bytecode the first time it handles a request
+     * for this module.  When script_file changes on disk, the bytecode is
+     * replaced and the generation bumped, and threads pick up the new
+     * version on their next request. */
+    pthread_mutex_t bytecode_lock;
+    struct lwan_strbuf *bytecode;
+    unsigned int generation;
+    struct stat script_stat;
+
+    pthread_key_t state_key;
 };
 
 struct lwan_lua_state {
-    struct cache_entry base;
     lua_State *L;
+    unsigned int generation;
+    /* One reference is held by the thread, one by each request using this
+     * state; a state that has been replaced is closed when the last request
+     * using it finishes. */
+    int refs;
 };
 
-static struct cache_entry *state_create(const char *key __attribute__((unused)),
-                                        void *context)
+static void unref_state(void *data)
+{
+    struct lwan_lua_state *state = data;
+
+    if (!--state->refs) {
+        lua_close(state->L);
+        free(state);
+    }
+}
+
+static struct lwan_lua_state *create_state(struct lwan_lua_priv *priv)
 {
-    struct lwan_lua_priv *priv = context;
     struct lwan_lua_state *state = malloc(sizeof(*state));
 
     if (UNLIKELY(!state))
         return NULL;
 
-    state->L = lwan_lua_create_state(priv->script_file, priv->script);
-    if (LIKELY(state->L))
-        return (struct cache_entry *)state;
+    pthread_mutex_lock(&priv->bytecode_lock);
+    state->generation = priv->generation;
+    state->L = lwan_lua_create_state_from_bytecode(
+        priv->bytecode, priv->script_file ? priv->script_file : "script");
+    pthread_mutex_unlock(&priv->bytecode_lock);
 
-    free(state);
-    return NULL;
+    if (UNLIKELY(!state->L)) {
+        free(state);
+        return NULL;
+    }
+
+    state->refs = 1;
+    return state;
 }
 
-static void state_destroy(struct cache_entry *entry,
-                          void *context __attribute__((unused)))
+static struct lwan_lua_state *get_or_create_state(struct lwan_lua_priv *priv)
 {
-    struct lwan_lua_state *state = (struct lwan_lua_state *)entry;
+    struct lwan_lua_state *state = pthread_getspecific(priv->state_key);
+
+    if (LIKELY(state && state->generation == ATOMIC_READ(priv->generation)))
+        return state;
 
-    lua_close(state->L);
-    free(state);
+    lwan_status_debug("Creating Lua state for this thread");
+
+    struct lwan_lua_state *new_state = create_state(priv);
+    if (UNLIKELY(!new_state)) {
+        /* Keep serving with the previous version of the script, if any. */
+        return state;
+    }
+
+    if (UNLIKELY(pthread_setspecific(priv->state_key, new_state))) {
+        lwan_status_perror("pthread_setspecific");
+        unref_state(new_state);
+        return state;
+    }
+
+    if (state)
+        unref_state(state);
+
+    return new_state;
 }
 
-static struct cache *get_or_create_cache(struct lwan_lua_priv *priv)
+static bool script_file_changed(struct lwan_lua_priv *priv)
 {
-    struct cache *cache = pthread_getspecific(priv->cache_key);
-
-    if (UNLIKELY(!cache)) {
-        lwan_status_debug("Creating cache for this thread");
-        cache =
-            cache_create(state_create, state_destroy, priv, priv->cache_period);
-        if (UNLIKELY(!cache))
-            lwan_status_error("Could not create cache");
-        /* FIXME: This cache instance leaks: store it somewhere and
-         * free it on module shutdown */
-        pthread_setspecific(priv->cache_key, cache);
+    struct stat st;
+
+    if (UNLIKELY(stat(priv->script_file, &st) < 0))
+        return false;
+
+    if (st.st_mtim.tv_sec == priv->script_stat.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == priv->script_stat.st_mtim.tv_nsec &&
+        st.st_size == priv->script_stat.st_size &&
+        st.st_ino == priv->script_stat.st_ino &&
+        st.st_dev == priv->script_stat.st_dev)
+        return false;
+
+    priv->script_stat = st;
+    return true;
+}
+
+static bool reload_script_job(void *data)
+{
+    struct lwan_lua_priv *priv = data;
+    struct lwan_strbuf *bytecode, *old_bytecode;
+
+    if (!script_file_changed(priv))
+        return false;
+
+    lwan_status_info("Lua script %s changed, reloading", priv->script_file);
+
+    bytecode = lwan_lua_compile(priv->script_file, NULL);
+    if (UNLIKELY(!bytecode)) {
+        lwan_status_error("Keeping previous version of %s", priv->script_file);
+        return true;
     }
 
-    return cache;
+    pthread_mutex_lock(&priv->bytecode_lock);
+    old_bytecode = priv->bytecode;
+    priv->bytecode = bytecode;
+    ATOMIC_INC(priv->generation);
+    pthread_mutex_unlock(&priv->bytecode_lock);
+
+    lwan_strbuf_free(old_bytecode);
+
+    return true;
 }
 
 static void unref_thread(void *data1, void *data2)
@@ -185,16 +259,15 @@ static enum lwan_http_status lua_handle_request(struct lwan_request *request,
     if (UNLIKELY(!priv))
         return HTTP_INTERNAL_ERROR;
 
-    struct cache *cache = get_or_create_cache(priv);
-    if (UNLIKELY(!cache))
-        return HTTP_INTERNAL_ERROR;
-
-    struct lwan_lua_state *state =
-        (struct lwan_lua_state *)cache_coro_get_and_ref_entry(
-            cache, request->conn->coro, "");
+    struct lwan_lua_state *state = get_or_create_state(priv);
     if (UNLIKELY(!state))
         return HTTP_NOT_FOUND;
 
+    /* Deferred before the thread unref in push_newthread(), so that it
+     * runs after it. */
+    state->refs++;
+    coro_defer(request->conn->coro, CORO_DEFER(unref_state), state);
+
     lua_State *L = push_newthread(state->L, request->conn->coro);
     if (UNLIKELY(!L))
         return HTTP_INTERNAL_ERROR;
@@ -208,8 +281,11 @@ static enum lwan_http_status lua_handle_request(struct lwan_request *request,
     while (true) {
         switch (lua_resume(L, n_arguments)) {
         case LUA_YIELD:
-            coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
-            n_arguments = 0;
+            n_arguments = lwan_lua_resume_pending(L, request);
+            if (n_arguments < 0) {
+                coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+                n_arguments = 0;
+            }
             break;
         case 0:
             return HTTP_OK;
@@ -255,15 +331,30 @@ static void *lua_create(const char *prefix __attribute__((unused)), void *data)
         goto error;
     }
 
-    if (pthread_key_create(&priv->cache_key, NULL)) {
-        lwan_status_perror("pthread_key_create");
+    if (priv->script_file && stat(priv->script_file, &priv->script_stat) < 0) {
+        lwan_status_perror("Could not stat %s", priv->script_file);
+        goto error;
+    }
+
+    /* Compiling here also reports syntax errors at startup. */
+    priv->bytecode = lwan_lua_compile(priv->script_file, priv->script);
+    if (!priv->bytecode)
         goto error;
+
+    if (pthread_key_create(&priv->state_key, unref_state)) {
+        lwan_status_perror("pthread_key_create");
+        goto free_bytecode;
     }
 
-    priv->cache_period = settings->cache_period;
+    pthread_mutex_init(&priv->bytecode_lock, NULL);
+
+    if (priv->script_file)
+        lwan_job_add(reload_script_job, priv);
 
     return priv;
 
+free_bytecode:
+    lwan_strbuf_free(priv->bytecode);
 error:
     free(priv->script_file);
     free(priv->default_type);
@@ -278,7 +369,12 @@ static void lua_destroy(void *instance)
     struct lwan_lua_priv *priv = instance;
 
     if (priv) {
-        pthread_key_delete(priv->cache_key);
+        if (priv->script_file)
+            lwan_job_del(reload_script_job, priv);
+
+        pthread_key_delete(priv->state_key);
+        pthread_mutex_destroy(&priv->bytecode_lock);
+        lwan_strbuf_free(priv->bytecode);
         free(priv->default_type);
         free(priv->script_file);
         free(priv->script);
@@ -291,7 +387,6 @@ static void *lua_create_from_hash(const char *prefix, const struct hash *hash)
     struct lwan_lua_settings settings = {
         .default_type = hash_find(hash, "default_type"),
         .script_file = hash_find(hash, "script_file"),
-        .cache_period = parse_time_period(hash_find(hash, "cache_period"), 15),
         .script = hash_find(hash, "script")
     };
 
@@ -25,6 +25,7 @@ struct lwan_lua_settings {
     const char *default_type;
     const char *script_file;
     const char *script;
+    /* Unused: Lua states live as long as the threads using them. */
     unsigned int cache_period;
 };
 
@@ -0,0 +1,234 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+
+#include "lwan-private.h"
+
+#include "lwan-access-log.h"
+#include "lwan-cache.h"
+#include "lwan-mod-metrics.h"
+
+#define COUNTER(name_, help_)                                                  \
+    "# HELP " name_ " " help_ "\n# TYPE " name_ " counter\n"
+#define GAUGE(name_, help_)                                                    \
+    "# HELP " name_ " " help_ "\n# TYPE " name_ " gauge\n"
+
+static void append_latency_histogram(struct lwan_strbuf *buf,
+                                     const struct lwan_thread_metrics *metrics)
+{
+    unsigned long long cumulative = 0;
+
+    lwan_strbuf_append_printf(
+        buf, "# HELP lwan_request_duration_seconds Time taken to handle "
+             "requests, once they have been read.\n"
+             "# TYPE lwan_request_duration_seconds histogram\n");
+
+    for (int i = 0; i < LWAN_METRICS_LATENCY_BUCKETS - 1; i++) {
+        cumulative += metrics->latency[i];
+        lwan_strbuf_append_printf(
+            buf, "lwan_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+            lwan_metrics_latency_bounds_us[i] / 1e6, cumulative);
+    }
+    cumulative += metrics->latency[LWAN_METRICS_LATENCY_BUCKETS - 1];
+
+    lwan_strbuf_append_printf(
+        buf,
+        "lwan_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+        "lwan_request_duration_seconds_sum %.9f\n"
+        "lwan_request_duration_seconds_count %llu\n",
+        cumulative, (double)metrics->latency_sum_ns / 1e9, cumulative);
+}
+
+/* Starts a sample labelled with a prefix, escaped as Prometheus expects;
+ * the caller appends the closing quote. */
+static void append_prefix_sample(struct lwan_strbuf *buf, const char *name,
+                                 const char *prefix)
+{
+    lwan_strbuf_append_printf(buf, "%s{prefix=\"", name);
+
+    for (; *prefix; prefix++) {
+        if (*prefix == '"' || *prefix == '\\')
+            lwan_strbuf_append_char(buf, '\\');
+        lwan_strbuf_append_char(buf, *prefix);
+    }
+}
+
+static void append_stack_histograms(struct lwan_strbuf *buf,
+                                    const struct lwan *l)
+{
+    const struct lwan_stack_usage *usage;
+
+    lwan_strbuf_append_printf(
+        buf,
+        GAUGE("lwan_coroutine_stack_size_bytes",
+              "Size of each coroutine stack.")
+        "lwan_coroutine_stack_size_bytes %zu\n"
+        "# HELP lwan_coroutine_stack_used_bytes Stack used by coroutines "
+        "while handling requests, by prefix.\n"
+        "# TYPE lwan_coroutine_stack_used_bytes histogram\n",
+        coro_stack_size());
+
+    for (usage = l->stack_usage; usage; usage = usage->next) {
+        unsigned long long cumulative = 0;
+
+        for (int i = 0; i < LWAN_METRICS_STACK_BUCKETS - 1; i++) {
+            cumulative += ATOMIC_READ(usage->buckets[i]);
+            append_prefix_sample(buf, "lwan_coroutine_stack_used_bytes_bucket",
+                                 usage->prefix);
+            lwan_strbuf_append_printf(buf, "\",le=\"%u\"} %llu\n",
+                                      lwan_metrics_stack_bounds[i], cumulative);
+        }
+        cumulative += ATOMIC_READ(usage->buckets[LWAN_METRICS_STACK_BUCKETS - 1]);
+
+        append_prefix_sample(buf, "lwan_coroutine_stack_used_bytes_bucket",
+                             usage->prefix);
+        lwan_strbuf_append_printf(buf, "\",le=\"+Inf\"} %llu\n", cumulative);
+        append_prefix_sample(buf, "lwan_coroutine_stack_used_bytes_sum",
+                             usage->prefix);
+        lwan_strbuf_append_printf(buf, "\"} %llu\n", ATOMIC_READ(usage->sum));
+        append_prefix_sample(buf, "lwan_coroutine_stack_used_bytes_count",
+                             usage->prefix);
+        lwan_strbuf_append_printf(buf, "\"} %llu\n", cumulative);
+    }
+
+    lwan_strbuf_append_printf(
+        buf, GAUGE("lwan_coroutine_stack_max_used_bytes",
+                   "Most stack used by a request, by prefix."));
+    for (usage = l->stack_usage; usage; usage = usage->next) {
+        append_prefix_sample(buf, "lwan_coroutine_stack_max_used_bytes",
+                             usage->prefix);
+        lwan_strbuf_append_printf(buf, "\"} %llu\n", ATOMIC_READ(usage->max));
+    }
+}
+
+static enum lwan_http_status
+metrics_handle_request(struct lwan_request *request,
+                       struct lwan_response *response,
+                       void *instance __attribute__((unused)))
+{
+    struct lwan *l = request->conn->thread->lwan;
+    struct lwan_strbuf *buf = response->buffer;
+    struct lwan_thread_metrics metrics;
+    struct lwan_busy_poll_stats busy_poll;
+    struct cache_stats cache;
+
+    /* Requests are only timed once somebody is looking. */
+    if (UNLIKELY(!ATOMIC_READ(l->measure_latency)))
+        ATOMIC_READ(l->measure_latency) = true;
+
+    lwan_get_metrics(l, &metrics);
+    lwan_get_busy_poll_stats(l, &busy_poll);
+    cache_get_total_stats(&cache);
+
+    lwan_strbuf_append_printf(
+        buf,
+        COUNTER("lwan_connections_accepted_total", "Connections accepted.")
+        "lwan_connections_accepted_total %llu\n"
+        COUNTER("lwan_connections_timed_out_total",
+                "Connections closed after being idle for too long.")
+        "lwan_connections_timed_out_total %llu\n"
+        COUNTER("lwan_connections_shed_total",
+                "Connections turned away while overloaded.")
+        "lwan_connections_shed_total %llu\n"
+        COUNTER("lwan_requests_total", "Requests read.")
+        "lwan_requests_total %llu\n"
+        COUNTER("lwan_sent_bytes_total", "Bytes written to sockets.")
+        "lwan_sent_bytes_total %llu\n",
+        metrics.connections_accepted, metrics.connections_timed_out,
+        metrics.connections_shed, metrics.requests, metrics.bytes_sent);
+
+    lwan_strbuf_append_printf(
+        buf, COUNTER("lwan_responses_total", "Responses sent, by status class."));
+    for (size_t i = 1; i < N_ELEMENTS(metrics.responses); i++) {
+        lwan_strbuf_append_printf(buf, "lwan_responses_total{code=\"%zuxx\"} %llu\n",
+                                  i, metrics.responses[i]);
+    }
+
+    lwan_strbuf_append_printf(
+        buf, GAUGE("lwan_connections_active", "Open connections, by I/O thread."));
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        lwan_strbuf_append_printf(
+            buf, "lwan_connections_active{thread=\"%u\"} %u\n", i,
+            ATOMIC_READ(l->thread.threads[i].n_connections));
+    }
+
+    lwan_strbuf_append_printf(
+        buf,
+        COUNTER("lwan_cache_hits_total", "Lookups found in a cache.")
+        "lwan_cache_hits_total %llu\n"
+        COUNTER("lwan_cache_misses_total", "Lookups that created an entry.")
+        "lwan_cache_misses_total %llu\n"
+        COUNTER("lwan_cache_evictions_total", "Entries evicted from caches.")
+        "lwan_cache_evictions_total %llu\n"
+        GAUGE("lwan_cache_entries", "Entries in all caches.")
+        "lwan_cache_entries %zu\n"
+        GAUGE("lwan_cache_bytes", "Approximate size of all cached entries.")
+        "lwan_cache_bytes %zu\n",
+        cache.hits, cache.misses, cache.evicted, cache.entries, cache.bytes);
+
+    lwan_strbuf_append_printf(
+        buf,
+        COUNTER("lwan_busy_poll_seconds_total",
+                "Time spent polling for events without sleeping.")
+        "lwan_busy_poll_seconds_total %.9f\n"
+        COUNTER("lwan_busy_poll_hits_total", "Events found while spinning.")
+        "lwan_busy_poll_hits_total %llu\n"
+        COUNTER("lwan_busy_poll_misses_total",
+                "Times the busy polling budget ran out.")
+        "lwan_busy_poll_misses_total %llu\n",
+        (double)busy_poll.spin_ns / 1e9, busy_poll.spin_hits, busy_poll.spin_misses);
+
+    lwan_strbuf_append_printf(
+        buf,
+        COUNTER("lwan_access_log_dropped_total",
+                "Access log records dropped because a ring was full.")
+        "lwan_access_log_dropped_total %llu\n",
+        lwan_access_log_get_dropped(l));
+
+    append_latency_histogram(buf, &metrics);
+
+    if (l->stack_usage)
+        append_stack_histograms(buf, l);
+
+    response->mime_type = "text/plain; version=0.0.4";
+    return HTTP_OK;
+}
+
+static void *metrics_create(const char *prefix __attribute__((unused)),
+                            void *args __attribute__((unused)))
+{
+    /* Everything comes from the server itself; no state is needed. */
+    return NULL;
+}
+
+static void *metrics_create_from_hash(const char *prefix,
+                                      const struct hash *hash
+                                      __attribute__((unused)))
+{
+    return metrics_create(prefix, NULL);
+}
+
+static const struct lwan_module module = {
+    .create = metrics_create,
+    .create_from_hash = metrics_create_from_hash,
+    .handle_request = metrics_handle_request,
+};
+
+LWAN_REGISTER_MODULE(metrics, &module);
@@ -0,0 +1,703 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-mod-profiler.h"
+
+#if defined(HAS_TIMER_CREATE) && defined(HAVE_EXECINFO_H) &&                 \
+    defined(__linux__)
+#define PROFILER_SUPPORTED
+#endif
+
+#if defined(PROFILER_SUPPORTED)
+#include <elf.h>
+#include <execinfo.h>
+#include <link.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define MAX_FRAMES 48
+#define MAX_SAMPLES_PER_THREAD 16384
+
+/* backtrace() called from the signal handler sees the handler itself (with
+ * record_sample() inlined) and the signal trampoline before the interrupted
+ * frame. */
+#define SIGNAL_FRAMES 2
+
+#define DEFAULT_SECONDS 5
+#define DEFAULT_HZ 99
+#define MAX_HZ 1000
+
+struct sample {
+    const char *handler;
+    bool in_coro;
+    int n_frames;
+    void *frames[MAX_FRAMES];
+};
+
+struct profile_thread {
+    struct lwan_thread *thread;
+    timer_t timer;
+    bool has_timer;
+
+    /* Only touched by the signal handler while the profile is running. */
+    size_t n_samples;
+    size_t dropped;
+    size_t capacity;
+    struct sample *samples;
+};
+
+struct profile {
+    struct profile_thread *threads;
+    unsigned short n_threads;
+    bool stopped;
+};
+
+static struct profile *active_profile;
+static int handlers_running;
+
+static ALWAYS_INLINE void record_sample(struct profile_thread *pt)
+{
+    if (UNLIKELY(pt->n_samples >= pt->capacity)) {
+        pt->dropped++;
+        return;
+    }
+
+    struct sample *sample = &pt->samples[pt->n_samples];
+    struct lwan_connection *conn = ATOMIC_READ(pt->thread->running_conn);
+
+    sample->in_coro = conn != NULL;
+    sample->handler = (conn && conn->coro) ? coro_get_tag(conn->coro) : NULL;
+    sample->n_frames = backtrace(sample->frames, MAX_FRAMES);
+
+    pt->n_samples++;
+}
+
+static void take_sample(int signum __attribute__((unused)),
+                        siginfo_t *info,
+                        void *context __attribute__((unused)))
+{
+    int saved_errno = errno;
+
+    /* Announce ourselves before looking at the profile, so that
+     * profile_stop() knows when it's safe to free it. */
+    __sync_fetch_and_add(&handlers_running, 1);
+
+    struct profile *profile = ATOMIC_READ(active_profile);
+    if (profile && info->si_code == SI_TIMER) {
+        unsigned int index = (unsigned int)info->si_value.sival_int;
+
+        if (index < profile->n_threads)
+            record_sample(&profile->threads[index]);
+    }
+
+    __sync_fetch_and_sub(&handlers_running, 1);
+
+    errno = saved_errno;
+}
+
+static void profile_stop(struct profile *profile)
+{
+    if (profile->stopped)
+        return;
+    profile->stopped = true;
+
+    for (unsigned short i = 0; i < profile->n_threads; i++) {
+        if (profile->threads[i].has_timer)
+            timer_delete(profile->threads[i].timer);
+    }
+
+    /* Signals already queued might still arrive; they'll find no profile,
+     * and the ones that have found it are waited for. */
+    ATOMIC_READ(active_profile) = NULL;
+    __sync_synchronize();
+    while (ATOMIC_READ(handlers_running))
+        sched_yield();
+}
+
+static void profile_free(void *data)
+{
+    struct profile *profile = data;
+
+    profile_stop(profile);
+
+    for (unsigned short i = 0; i < profile->n_threads; i++)
+        free(profile->threads[i].samples);
+    free(profile->threads);
+}
+
+static bool profile_start(struct profile *profile,
+                          struct lwan *l,
+                          unsigned int seconds,
+                          unsigned int hz)
+{
+    size_t capacity = (size_t)seconds * hz + hz;
+    long interval_ns = 1000000000l / (long)hz;
+
+    if (capacity > MAX_SAMPLES_PER_THREAD)
+        capacity = MAX_SAMPLES_PER_THREAD;
+
+    profile->threads = calloc(l->thread.count, sizeof(*profile->threads));
+    if (!profile->threads)
+        return false;
+    profile->n_threads = l->thread.count;
+
+    for (unsigned short i = 0; i < profile->n_threads; i++) {
+        struct profile_thread *pt = &profile->threads[i];
+
+        pt->thread = &l->thread.threads[i];
+        pt->capacity = capacity;
+        pt->samples = calloc(capacity, sizeof(*pt->samples));
+        if (!pt->samples)
+            return false;
+    }
+
+    ATOMIC_READ(active_profile) = profile;
+    __sync_synchronize();
+
+    for (unsigned short i = 0; i < profile->n_threads; i++) {
+        struct profile_thread *pt = &profile->threads[i];
+        struct sigevent sev = {
+            .sigev_notify = SIGEV_THREAD_ID,
+            .sigev_signo = SIGPROF,
+            .sigev_value.sival_int = i,
+        };
+        struct itimerspec spec = {
+            .it_interval = {.tv_nsec = interval_ns},
+            .it_value = {.tv_nsec = interval_ns},
+        };
+        clockid_t clock;
+
+        if (interval_ns >= 1000000000l) {
+            spec.it_interval = spec.it_value =
+                (struct timespec){.tv_sec = interval_ns / 1000000000l};
+        }
+
+        /* Threads are sampled as they burn CPU time, not while they're
+         * blocked in epoll_wait(). */
+        if (pthread_getcpuclockid(pt->thread->self, &clock) < 0)
+            clock = CLOCK_MONOTONIC;
+
+        sev.sigev_notify_thread_id = (pid_t)pt->thread->tid;
+
+        if (timer_create(clock, &sev, &pt->timer) < 0) {
+            lwan_status_perror("Could not create profiling timer for thread %d",
+                               i);
+            return false;
+        }
+        pt->has_timer = true;
+
+        if (timer_settime(pt->timer, 0, &spec, NULL) < 0) {
+            lwan_status_perror("Could not arm profiling timer for thread %d",
+                               i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct symbol {
+    uintptr_t addr;
+    size_t size;
+    const char *name;
+};
+
+struct object {
+    char *path;
+    const char *basename;
+    uintptr_t base;
+    uintptr_t start, end;
+
+    bool loaded;
+    struct symbol *symbols;
+    size_t n_symbols;
+    void *map;
+    size_t map_size;
+};
+
+struct objects {
+    struct object *objects;
+    size_t n_objects;
+};
+
+static int append_object(struct dl_phdr_info *info,
+                         size_t size __attribute__((unused)),
+                         void *data)
+{
+    struct objects *objects = data;
+    uintptr_t start = UINTPTR_MAX, end = 0;
+
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+
+        if (phdr->p_type != PT_LOAD)
+            continue;
+
+        uintptr_t seg_start = info->dlpi_addr + phdr->p_vaddr;
+        if (seg_start < start)
+            start = seg_start;
+        if (seg_start + phdr->p_memsz > end)
+            end = seg_start + phdr->p_memsz;
+    }
+    if (start >= end)
+        return 0;
+
+    struct object *new_objects = realloc(
+        objects->objects, (objects->n_objects + 1) * sizeof(struct object));
+    if (!new_objects)
+        return 1;
+    objects->objects = new_objects;
+
+    const char *path = info->dlpi_name;
+    if (!path || !*path)
+        path = "/proc/self/exe";
+
+    struct object *object = &objects->objects[objects->n_objects];
+    *object = (struct object){
+        .path = strdup(path),
+        .base = info->dlpi_addr,
+        .start = start,
+        .end = end,
+    };
+    if (!object->path)
+        return 1;
+
+    if (streq(path, "/proc/self/exe")) {
+        object->basename = program_invocation_short_name;
+    } else {
+        const char *slash = strrchr(object->path, '/');
+        object->basename = slash ? slash + 1 : object->path;
+    }
+
+    objects->n_objects++;
+    return 0;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const struct symbol *sa = a, *sb = b;
+
+    return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+static const ElfW(Shdr) *find_section(const ElfW(Ehdr) *ehdr,
+                                      size_t map_size,
+                                      ElfW(Word) type)
+{
+    const ElfW(Shdr) *shdrs = (const void *)((const char *)ehdr + ehdr->e_shoff);
+
+    for (ElfW(Half) i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type != type)
+            continue;
+        if (shdrs[i].sh_link >= ehdr->e_shnum)
+            continue;
+        if (shdrs[i].sh_offset + shdrs[i].sh_size > map_size)
+            continue;
+        return &shdrs[i];
+    }
+
+    return NULL;
+}
+
+/* Reads the function symbols from the object's file rather than relying on
+ * dladdr(), which only knows about exported symbols: most of lwan is static
+ * functions.  Objects without symbol tables are reported as offsets. */
+static void load_symbols(struct object *object)
+{
+    struct stat st;
+    int fd;
+
+    object->loaded = true;
+
+    fd = open(object->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return;
+    }
+
+    object->map_size = (size_t)st.st_size;
+    object->map = mmap(NULL, object->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (object->map == MAP_FAILED) {
+        object->map = NULL;
+        return;
+    }
+
+    const ElfW(Ehdr) *ehdr = object->map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+        ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(ElfW(Shdr)) >
+            object->map_size)
+        return;
+
+    const ElfW(Shdr) *symtab = find_section(ehdr, object->map_size, SHT_SYMTAB);
+    if (!symtab)
+        symtab = find_section(ehdr, object->map_size, SHT_DYNSYM);
+    if (!symtab)
+        return;
+
+    const ElfW(Shdr) *strtab =
+        (const ElfW(Shdr) *)((const char *)ehdr + ehdr->e_shoff) +
+        symtab->sh_link;
+    if (strtab->sh_offset + strtab->sh_size > object->map_size)
+        return;
+
+    const ElfW(Sym) *syms =
+        (const void *)((const char *)object->map + symtab->sh_offset);
+    const char *strings = (const char *)object->map + strtab->sh_offset;
+    size_t n_syms = symtab->sh_size / sizeof(ElfW(Sym));
+
+    object->symbols = calloc(n_syms, sizeof(struct symbol));
+    if (!object->symbols)
+        return;
+
+    for (size_t i = 0; i < n_syms; i++) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC)
+            continue;
+        if (syms[i].st_shndx == SHN_UNDEF || !syms[i].st_value)
+            continue;
+        if (syms[i].st_name >= strtab->sh_size)
+            continue;
+
+        object->symbols[object->n_symbols++] = (struct symbol){
+            .addr = syms[i].st_value,
+            .size = syms[i].st_size,
+            .name = strings + syms[i].st_name,
+        };
+    }
+
+    qsort(object->symbols, object->n_symbols, sizeof(struct symbol),
+          compare_symbols);
+}
+
+static void append_symbol(struct lwan_strbuf *buf,
+                          struct objects *objects,
+                          uintptr_t addr)
+{
+    struct object *object = NULL;
+
+    for (size_t i = 0; i < objects->n_objects; i++) {
+        if (addr >= objects->objects[i].start && addr < objects->objects[i].end) {
+            object = &objects->objects[i];
+            break;
+        }
+    }
+    if (!object) {
+        lwan_strbuf_append_printf(buf, "0x%" PRIxPTR, addr);
+        return;
+    }
+
+    if (!object->loaded)
+        load_symbols(object);
+
+    uintptr_t offset = addr - object->base;
+    size_t lo = 0, hi = object->n_symbols;
+
+    /* Finds the last symbol starting at or before the offset. */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (object->symbols[mid].addr <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo) {
+        const struct symbol *sym = &object->symbols[lo - 1];
+
+        if (!sym->size || offset < sym->addr + sym->size) {
+            lwan_strbuf_append_str(buf, sym->name, 0);
+            return;
+        }
+    }
+
+    lwan_strbuf_append_printf(buf, "%s+0x%" PRIxPTR, object->basename, offset);
+}
+
+static void objects_free(struct objects *objects)
+{
+    for (size_t i = 0; i < objects->n_objects; i++) {
+        struct object *object = &objects->objects[i];
+
+        if (object->map)
+            munmap(object->map, object->map_size);
+        free(object->symbols);
+        free(object->path);
+    }
+    free(objects->objects);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void append_folded_stack(struct lwan_strbuf *buf,
+                                struct objects *objects,
+                                unsigned short thread,
+                                const struct sample *sample)
+{
+    lwan_strbuf_append_printf(buf, "lwan-thread-%u;%s", thread,
+                              sample->in_coro ? "coroutine" : "scheduler");
+    if (sample->handler)
+        lwan_strbuf_append_printf(buf, ";handler %s", sample->handler);
+
+    /* Root first, as expected by the folded format. */
+    for (int f = sample->n_frames - 1; f >= SIGNAL_FRAMES; f--) {
+        uintptr_t addr = (uintptr_t)sample->frames[f];
+
+        /* Return addresses may point past the end of the calling function
+         * if the callee doesn't return; the interrupted one doesn't. */
+        if (f > SIGNAL_FRAMES)
+            addr--;
+
+        lwan_strbuf_append_char(buf, ';');
+        append_symbol(buf, objects, addr);
+    }
+}
+
+static bool fold_samples(struct lwan_strbuf *response, struct profile *profile)
+{
+    struct objects objects = {};
+    struct lwan_strbuf stack;
+    size_t total = 0;
+    char **stacks;
+    bool ret = false;
+
+    for (unsigned short i = 0; i < profile->n_threads; i++)
+        total += profile->threads[i].n_samples;
+
+    stacks = calloc(total ? total : 1, sizeof(char *));
+    if (!stacks)
+        return false;
+    if (!lwan_strbuf_init(&stack)) {
+        free(stacks);
+        return false;
+    }
+
+    dl_iterate_phdr(append_object, &objects);
+
+    total = 0;
+    for (unsigned short i = 0; i < profile->n_threads; i++) {
+        const struct profile_thread *pt = &profile->threads[i];
+
+        for (size_t s = 0; s < pt->n_samples; s++) {
+            lwan_strbuf_reset(&stack);
+            append_folded_stack(&stack, &objects, i, &pt->samples[s]);
+
+            stacks[total] = strdup(lwan_strbuf_get_buffer(&stack));
+            if (!stacks[total])
+                goto out;
+            total++;
+        }
+    }
+
+    qsort(stacks, total, sizeof(char *), compare_strings);
+
+    for (size_t i = 0; i < total;) {
+        size_t count = 1;
+
+        while (i + count < total && streq(stacks[i], stacks[i + count]))
+            count++;
+
+        lwan_strbuf_append_printf(response, "%s %zu\n", stacks[i], count);
+        i += count;
+    }
+
+    ret = true;
+
+out:
+    for (size_t i = 0; i < total; i++)
+        free(stacks[i]);
+    free(stacks);
+    lwan_strbuf_free(&stack);
+    objects_free(&objects);
+
+    return ret;
+}
+
+static enum lwan_http_status
+profiler_handle_request(struct lwan_request *request,
+                        struct lwan_response *response,
+                        void *instance)
+{
+    struct lwan_profiler_settings *settings = instance;
+    struct lwan *l = request->conn->thread->lwan;
+    const char *param;
+    int seconds = DEFAULT_SECONDS;
+    int hz = DEFAULT_HZ;
+
+    param = lwan_request_get_query_param(request, "seconds");
+    if (param) {
+        seconds = parse_int(param, -1);
+        if (seconds <= 0 || (unsigned int)seconds > settings->max_seconds)
+            return HTTP_BAD_REQUEST;
+    } else if ((unsigned int)seconds > settings->max_seconds) {
+        seconds = (int)settings->max_seconds;
+    }
+
+    param = lwan_request_get_query_param(request, "hz");
+    if (param) {
+        hz = parse_int(param, -1);
+        if (hz <= 0 || hz > MAX_HZ)
+            return HTTP_BAD_REQUEST;
+    }
+
+    struct profile *profile =
+        coro_malloc_full(request->conn->coro, sizeof(*profile), profile_free);
+    if (UNLIKELY(!profile))
+        return HTTP_INTERNAL_ERROR;
+    *profile = (struct profile){};
+
+    /* One profile at a time; the signal handler only knows about one. */
+    if (!__sync_bool_compare_and_swap(&active_profile, NULL, profile)) {
+        /* So that profile_free() doesn't touch the running profile. */
+        profile->stopped = true;
+        return HTTP_UNAVAILABLE;
+    }
+
+    if (!profile_start(profile, l, (unsigned int)seconds, (unsigned int)hz)) {
+        profile_stop(profile);
+        return HTTP_INTERNAL_ERROR;
+    }
+
+    /* If the connection is closed while sleeping, the coroutine is freed
+     * and profile_free() stops the profile. */
+    lwan_request_sleep(request, (unsigned int)seconds * 1000);
+    profile_stop(profile);
+
+    size_t samples = 0, dropped = 0;
+    for (unsigned short i = 0; i < profile->n_threads; i++) {
+        samples += profile->threads[i].n_samples;
+        dropped += profile->threads[i].dropped;
+    }
+    lwan_status_debug("Profile done: %zu samples, %zu dropped", samples,
+                      dropped);
+
+    if (!fold_samples(response->buffer, profile))
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    return HTTP_OK;
+}
+
+static void *profiler_create(const char *prefix __attribute__((unused)),
+                             void *args)
+{
+    struct lwan_profiler_settings *settings = args;
+    struct lwan_profiler_settings *instance;
+    static bool handler_installed;
+
+    if (!handler_installed) {
+        struct sigaction sa = {
+            .sa_sigaction = take_sample,
+            .sa_flags = SA_SIGINFO | SA_RESTART,
+        };
+        void *frame;
+
+        /* The first call to backtrace() loads libgcc, which can't be done
+         * from within a signal handler. */
+        backtrace(&frame, 1);
+
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL) < 0) {
+            lwan_status_perror("Could not install SIGPROF handler");
+            return NULL;
+        }
+        handler_installed = true;
+    }
+
+    instance = malloc(sizeof(*instance));
+    if (!instance)
+        return NULL;
+
+    *instance = *settings;
+    if (!instance->max_seconds)
+        instance->max_seconds = 30;
+
+    return instance;
+}
+
+static void profiler_destroy(void *instance)
+{
+    free(instance);
+}
+
+#else
+
+static enum lwan_http_status
+profiler_handle_request(struct lwan_request *request __attribute__((unused)),
+                        struct lwan_response *response __attribute__((unused)),
+                        void *instance __attribute__((unused)))
+{
+    return HTTP_NOT_IMPLEMENTED;
+}
+
+static void *profiler_create(const char *prefix __attribute__((unused)),
+                             void *args __attribute__((unused)))
+{
+    lwan_status_error("Sampling profiler not supported in this platform");
+    return NULL;
+}
+
+static void profiler_destroy(void *instance __attribute__((unused))) {}
+
+#endif
+
+static void *profiler_create_from_hash(const char *prefix,
+                                       const struct hash *hash)
+{
+    struct lwan_profiler_settings settings = {
+        .max_seconds =
+            (unsigned int)parse_int(hash_find(hash, "max_seconds"), 30),
+    };
+
+    return profiler_create(prefix, &settings);
+}
+
+static const struct lwan_module module = {
+    .create = profiler_create,
+    .create_from_hash = profiler_create_from_hash,
+    .destroy = profiler_destroy,
+    .handle_request = profiler_handle_request,
+};
+
+LWAN_REGISTER_MODULE(profiler, &module);
@@ -0,0 +1,39 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include "lwan.h"
+
+LWAN_MODULE_FORWARD_DECL(profiler)
+
+struct lwan_profiler_settings {
+    unsigned int max_seconds;
+};
+
+/* Samples every I/O thread for a few seconds when requested, and replies
+ * with the stacks in the folded format taken by flamegraph.pl and
+ * friends.  Accepts "seconds" and "hz" in the query string. */
+#define PROFILER(max_seconds_) \
+  .module = LWAN_MODULE_REF(profiler), \
+  .args = ((struct lwan_profiler_settings[]) {{ \
+    .max_seconds = max_seconds_, \
+  }}), \
+  .flags = 0
@@ -67,6 +67,7 @@ static const struct lwan_module module = {
     .create_from_hash = redirect_create_from_hash,
     .destroy = free,
     .handle_request = redirect_handle_request,
+    .flags = HANDLER_CONSTANT_RESPONSE,
 };
 
 LWAN_REGISTER_MODULE(redirect, &module);
@@ -65,6 +65,7 @@ static const struct lwan_module module = {
     .create = response_create,
     .create_from_hash = response_create_from_hash,
     .handle_request = response_handle_request,
+    .flags = HANDLER_CONSTANT_RESPONSE,
 };
 
 LWAN_REGISTER_MODULE(response, &module);
@@ -0,0 +1,1272 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-config.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-mod-reverse-proxy.h"
+
+/* Largest response header block accepted from the upstream server */
+#define UPSTREAM_HEADERS_SIZE (2 * DEFAULT_BUFFER_SIZE)
+
+struct reverse_proxy_priv {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    unsigned int timeout_ms;
+
+    /* Idle keep-alive connections, shared by all I/O threads */
+    struct {
+        pthread_mutex_t lock;
+        int *fds;
+        unsigned int count, max;
+    } pool;
+};
+
+/* Everything that has to be closed if the coroutine is torn down while
+ * proxying a request. */
+struct upstream {
+    struct reverse_proxy_priv *priv;
+    struct lwan_request *request;
+    int fd;
+    bool reused;
+    bool sent_body;
+    int pipe[2];
+};
+
+enum body_framing {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE,
+};
+
+struct upstream_response {
+    char buf[UPSTREAM_HEADERS_SIZE];
+    size_t len;
+    size_t head_len;
+
+    struct lwan_value status_line;
+    size_t content_length;
+    enum body_framing framing;
+    bool has_content_length;
+    bool keep_alive;
+};
+
+static inline size_t min_size(size_t a, size_t b)
+{
+    return (a > b) ? b : a;
+}
+
+static bool value_eq(const struct lwan_value *v, const char *str)
+{
+    size_t len = strlen(str);
+
+    return v->len == len && !strncasecmp(v->value, str, len);
+}
+
+static bool value_has_token_len(const struct lwan_value *v,
+                                const char *token,
+                                size_t len)
+{
+    const char *p = v->value;
+    const char *end = p + v->len;
+
+    while (p < end) {
+        const char *comma = memchr(p, ',', (size_t)(end - p));
+        const char *token_end = comma ? comma : end;
+
+        while (p < token_end && (*p == ' ' || *p == '\t'))
+            p++;
+        while (token_end > p && (token_end[-1] == ' ' || token_end[-1] == '\t'))
+            token_end--;
+
+        if ((size_t)(token_end - p) == len && !strncasecmp(p, token, len))
+            return true;
+
+        if (!comma)
+            break;
+        p = comma + 1;
+    }
+
+    return false;
+}
+
+static bool value_has_token(const struct lwan_value *v, const char *token)
+{
+    return value_has_token_len(v, token, strlen(token));
+}
+
+/* Headers that only make sense for a single connection, and thus aren't
+ * forwarded in either direction. */
+static bool is_hop_by_hop(const struct lwan_value *name)
+{
+    static const char *const headers[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+        "Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding",
+        "Upgrade",
+    };
+
+    for (size_t i = 0; i < N_ELEMENTS(headers); i++) {
+        if (value_eq(name, headers[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/* Besides those, a message can name others in its Connection header
+ * fields (RFC 9110 section 7.6.1); messages with more of these fields
+ * than this aren't forwarded. */
+#define MAX_CONNECTION_HEADERS 8
+
+struct connection_options {
+    struct lwan_value values[MAX_CONNECTION_HEADERS];
+    size_t n_values;
+};
+
+static bool connection_options_add(struct connection_options *options,
+                                   const struct lwan_value *value)
+{
+    if (options->n_values == MAX_CONNECTION_HEADERS)
+        return false;
+
+    options->values[options->n_values++] = *value;
+    return true;
+}
+
+static bool is_connection_option(const struct connection_options *options,
+                                 const struct lwan_value *name)
+{
+    for (size_t i = 0; i < options->n_values; i++) {
+        if (value_has_token_len(&options->values[i], name->value, name->len))
+            return true;
+    }
+
+    return false;
+}
+
+static void upstream_close(struct upstream *up)
+{
+    if (up->fd >= 0) {
+        close(up->fd);
+        up->fd = -1;
+    }
+}
+
+static void upstream_destroy(void *data)
+{
+    struct upstream *up = data;
+
+    upstream_close(up);
+
+    if (up->pipe[0] >= 0) {
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+    }
+}
+
+static int pool_take(struct reverse_proxy_priv *priv)
+{
+    while (true) {
+        int fd = -1;
+
+        pthread_mutex_lock(&priv->pool.lock);
+        if (priv->pool.count)
+            fd = priv->pool.fds[--priv->pool.count];
+        pthread_mutex_unlock(&priv->pool.lock);
+
+        if (fd < 0)
+            return -1;
+
+        /* An idle connection has nothing to say; if it's readable, the
+         * upstream server closed it (or is misbehaving). */
+        struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLRDHUP};
+        if (!poll(&pfd, 1, 0))
+            return fd;
+
+        close(fd);
+    }
+}
+
+static void pool_give_back(struct upstream *up)
+{
+    struct reverse_proxy_priv *priv = up->priv;
+    int fd = up->fd;
+
+    up->fd = -1;
+
+    pthread_mutex_lock(&priv->pool.lock);
+    if (priv->pool.count < priv->pool.max) {
+        priv->pool.fds[priv->pool.count++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&priv->pool.lock);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static bool upstream_connect(struct upstream *up, bool pooled)
+{
+    struct reverse_proxy_priv *priv = up->priv;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    int one = 1;
+
+    if (pooled) {
+        up->fd = pool_take(priv);
+        if (up->fd >= 0) {
+            up->reused = true;
+            return true;
+        }
+    }
+    up->reused = false;
+
+    up->fd = socket(priv->addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (UNLIKELY(up->fd < 0))
+        return false;
+
+    if (priv->addr.ss_family != AF_UNIX)
+        (void)setsockopt(up->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!connect(up->fd, (struct sockaddr *)&priv->addr, priv->addr_len))
+        return true;
+    if (errno != EINPROGRESS)
+        return false;
+
+    if (!lwan_request_await_write(up->request, up->fd, priv->timeout_ms))
+        return false;
+    if (getsockopt(up->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+        return false;
+
+    return !error;
+}
+
+static bool upstream_send(struct upstream *up, const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = send(up->fd, buf, len, MSG_NOSIGNAL);
+
+        if (LIKELY(n > 0)) {
+            buf = (const char *)buf + n;
+            len -= (size_t)n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN &&
+            lwan_request_await_write(up->request, up->fd, up->priv->timeout_ms))
+            continue;
+
+        return false;
+    }
+
+    return true;
+}
+
+/* Returns the number of bytes read, 0 on EOF, or -1 on errors and
+ * timeouts. */
+static ssize_t upstream_recv(struct upstream *up, void *buf, size_t len)
+{
+    while (true) {
+        ssize_t n = recv(up->fd, buf, len, 0);
+
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN) {
+            if (lwan_request_await_read(up->request, up->fd,
+                                        up->priv->timeout_ms))
+                continue;
+            errno = ETIMEDOUT;
+        }
+
+        return -1;
+    }
+}
+
+static const char *method_name(struct lwan_request *request)
+{
+    switch (lwan_request_get_method(request)) {
+    case REQUEST_METHOD_GET:
+        return "GET";
+    case REQUEST_METHOD_HEAD:
+        return "HEAD";
+    case REQUEST_METHOD_POST:
+        return "POST";
+    case REQUEST_METHOD_OPTIONS:
+        return "OPTIONS";
+    case REQUEST_METHOD_DELETE:
+        return "DELETE";
+    default:
+        return NULL;
+    }
+}
+
+/* The URL has been decoded in place, so encode it once again, leaving
+ * alone the characters that are allowed in a path. */
+static bool append_path(struct lwan_strbuf *buf, const char *path, size_t len)
+{
+    static const char hex_digit[] = "0123456789ABCDEF";
+    const char *end = path + len;
+
+    if (!len || *path != '/') {
+        if (!lwan_strbuf_append_char(buf, '/'))
+            return false;
+    }
+
+    while (path < end) {
+        const char *run = path;
+
+        while (path < end &&
+               ((*path >= 'a' && *path <= 'z') ||
+                (*path >= 'A' && *path <= 'Z') ||
+                (*path >= '0' && *path <= '9') ||
+                strchr("-._~!$&'()*+,;=:@/", *path)))
+            path++;
+
+        if (path > run &&
+            !lwan_strbuf_append_str(buf, run, (size_t)(path - run)))
+            return false;
+
+        if (path < end) {
+            unsigned char c = (unsigned char)*path++;
+            char encoded[] = {'%', hex_digit[c >> 4], hex_digit[c & 15]};
+
+            if (!lwan_strbuf_append_str(buf, encoded, sizeof(encoded)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+struct forwarded_headers {
+    struct lwan_strbuf *buf;
+    struct lwan_value forwarded_for;
+    struct connection_options connection;
+    bool ok;
+};
+
+static bool find_connection_options(const struct lwan_value *name,
+                                    const struct lwan_value *value,
+                                    void *data)
+{
+    struct forwarded_headers *fh = data;
+
+    if (value_eq(name, "Connection"))
+        fh->ok = connection_options_add(&fh->connection, value);
+
+    return fh->ok;
+}
+
+static bool forward_request_header(const struct lwan_value *name,
+                                   const struct lwan_value *value,
+                                   void *data)
+{
+    struct forwarded_headers *fh = data;
+
+    if (is_hop_by_hop(name) || value_eq(name, "Expect"))
+        return true;
+    if (is_connection_option(&fh->connection, name))
+        return true;
+    if (value_eq(name, "X-Forwarded-For")) {
+        fh->forwarded_for = *value;
+        return true;
+    }
+
+    fh->ok = lwan_strbuf_append_printf(fh->buf, "%.*s: %.*s\r\n",
+                                       (int)name->len, name->value,
+                                       (int)value->len, value->value);
+    return fh->ok;
+}
+
+static enum lwan_http_status build_request(struct lwan_request *request,
+                                           struct lwan_strbuf *buf)
+{
+    const struct lwan_value *query = lwan_request_get_raw_query_string(request);
+    const char *method = method_name(request);
+    bool http_1_0 = request->flags & REQUEST_IS_HTTP_1_0;
+    char ip_buffer[INET6_ADDRSTRLEN];
+    const char *ip;
+    struct forwarded_headers fh = {.buf = buf, .ok = true};
+
+    if (UNLIKELY(!method))
+        return HTTP_INTERNAL_ERROR;
+
+    lwan_strbuf_reset(buf);
+
+    if (!lwan_strbuf_append_printf(buf, "%s ", method))
+        return HTTP_INTERNAL_ERROR;
+    if (!append_path(buf, request->url.value, request->url.len))
+        return HTTP_INTERNAL_ERROR;
+    if (query && query->len &&
+        !lwan_strbuf_append_printf(buf, "?%.*s", (int)query->len,
+                                   query->value))
+        return HTTP_INTERNAL_ERROR;
+    if (!lwan_strbuf_append_printf(buf, " HTTP/1.%c\r\n", http_1_0 ? '0' : '1'))
+        return HTTP_INTERNAL_ERROR;
+
+    lwan_request_foreach_header(request, find_connection_options, &fh);
+    if (!fh.ok)
+        return HTTP_BAD_REQUEST;
+    lwan_request_foreach_header(request, forward_request_header, &fh);
+    if (!fh.ok)
+        return HTTP_INTERNAL_ERROR;
+
+    ip = lwan_request_get_remote_address(request, ip_buffer);
+    if (ip) {
+        if (fh.forwarded_for.len) {
+            if (!lwan_strbuf_append_printf(
+                    buf, "X-Forwarded-For: %.*s, %s\r\n",
+                    (int)fh.forwarded_for.len, fh.forwarded_for.value, ip))
+                return HTTP_INTERNAL_ERROR;
+        } else if (!lwan_strbuf_append_printf(buf, "X-Forwarded-For: %s\r\n",
+                                              ip)) {
+            return HTTP_INTERNAL_ERROR;
+        }
+    }
+
+    /* Keep-alive is the default in HTTP/1.1 */
+    if (http_1_0 && !lwan_strbuf_append_str(buf, "Connection: keep-alive\r\n",
+                                            sizeof("Connection: keep-alive\r\n") - 1))
+        return HTTP_INTERNAL_ERROR;
+
+    if (!lwan_strbuf_append_str(buf, "\r\n", 2))
+        return HTTP_INTERNAL_ERROR;
+
+    return HTTP_OK;
+}
+
+static enum lwan_http_status send_request(struct upstream *up)
+{
+    struct lwan_request *request = up->request;
+    struct lwan_strbuf *buf = request->response.buffer;
+    char body[DEFAULT_BUFFER_SIZE];
+
+    if (!upstream_send(up, lwan_strbuf_get_buffer(buf),
+                       lwan_strbuf_get_length(buf)))
+        return up->reused ? HTTP_UNAVAILABLE : HTTP_BAD_GATEWAY;
+
+    while (true) {
+        ssize_t n = lwan_request_read_body(request, body, sizeof(body));
+
+        if (!n)
+            return HTTP_OK;
+        if (n < 0)
+            return HTTP_BAD_REQUEST;
+        up->sent_body = true;
+        if (!upstream_send(up, body, (size_t)n))
+            return HTTP_BAD_GATEWAY;
+    }
+}
+
+static bool parse_content_length(const struct lwan_value *value, size_t *out)
+{
+    size_t length = 0;
+
+    if (!value->len)
+        return false;
+
+    for (size_t i = 0; i < value->len; i++) {
+        char c = value->value[i];
+
+        if (c < '0' || c > '9')
+            return false;
+        if (__builtin_mul_overflow(length, 10, &length) ||
+            __builtin_add_overflow(length, (size_t)(c - '0'), &length))
+            return false;
+    }
+
+    *out = length;
+    return true;
+}
+
+/* Parses the header line starting at p, returning where it ends, or NULL
+ * if it's malformed. */
+static char *parse_header_line(char *p,
+                               char *end,
+                               struct lwan_value *name,
+                               struct lwan_value *value)
+{
+    char *eol = memchr(p, '\n', (size_t)(end - p));
+    char *colon;
+
+    if (!eol)
+        eol = end;
+
+    colon = memchr(p, ':', (size_t)(eol - p));
+    if (!colon || colon == p)
+        return NULL;
+
+    *name = (struct lwan_value){.value = p, .len = (size_t)(colon - p)};
+    value->value = colon + 1;
+    while (value->value < eol && (*value->value == ' ' || *value->value == '\t'))
+        value->value++;
+    value->len = (size_t)(eol - value->value);
+    while (value->len && (value->value[value->len - 1] == '\r' ||
+                          value->value[value->len - 1] == ' ' ||
+                          value->value[value->len - 1] == '\t'))
+        value->len--;
+
+    return eol;
+}
+
+/* Parses the header block in resp->buf, up to resp->head_len, appending
+ * the headers that should make it to the client to buf. */
+static bool parse_response_head(struct upstream_response *resp,
+                                struct lwan_request *request,
+                                struct lwan_strbuf *buf)
+{
+    char *p = resp->buf;
+    char *end = resp->buf + resp->head_len - 2;
+    char *eol = memchr(p, '\n', (size_t)(end - p));
+    char *headers;
+    struct connection_options connection = {};
+    bool chunked = false, has_transfer_encoding = false;
+    int status;
+
+    if (!eol || eol - p < (ptrdiff_t)sizeof("HTTP/1.1 200") ||
+        strncmp(p, "HTTP/1.", sizeof("HTTP/1.") - 1) || p[8] != ' ')
+        return false;
+    if (p[9] < '1' || p[9] > '5' || p[10] < '0' || p[10] > '9' ||
+        p[11] < '0' || p[11] > '9')
+        return false;
+
+    status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    resp->keep_alive = p[7] == '1';
+    resp->status_line.value = p + 9;
+    resp->status_line.len = (size_t)(eol - resp->status_line.value);
+    if (resp->status_line.value[resp->status_line.len - 1] == '\r')
+        resp->status_line.len--;
+    resp->has_content_length = false;
+
+    headers = eol + 1;
+    for (p = headers; p < end; p = eol + 1) {
+        struct lwan_value name, value;
+
+        eol = parse_header_line(p, end, &name, &value);
+        if (!eol)
+            return false;
+
+        if (value_eq(&name, "Content-Length")) {
+            size_t length;
+
+            if (!parse_content_length(&value, &length))
+                return false;
+            if (resp->has_content_length && length != resp->content_length)
+                return false;
+            resp->content_length = length;
+            resp->has_content_length = true;
+        } else if (value_eq(&name, "Transfer-Encoding")) {
+            has_transfer_encoding = true;
+            chunked = value_has_token(&value, "chunked");
+        } else if (value_eq(&name, "Connection")) {
+            if (!connection_options_add(&connection, &value))
+                return false;
+            if (value_has_token(&value, "close"))
+                resp->keep_alive = false;
+            else if (value_has_token(&value, "keep-alive"))
+                resp->keep_alive = true;
+        }
+    }
+
+    for (p = headers; p < end; p = eol + 1) {
+        struct lwan_value name, value;
+
+        eol = parse_header_line(p, end, &name, &value);
+
+        /* Framing is decided by relay_response() */
+        if (is_hop_by_hop(&name) || value_eq(&name, "Content-Length"))
+            continue;
+        if (is_connection_option(&connection, &name))
+            continue;
+
+        if (!lwan_strbuf_append_printf(buf, "%.*s: %.*s\r\n", (int)name.len,
+                                       name.value, (int)value.len,
+                                       value.value))
+            return false;
+    }
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
+        status == 204 || status == 304) {
+        resp->framing = BODY_NONE;
+    } else if (has_transfer_encoding) {
+        /* Any other transfer coding is only delimited by the end of the
+         * connection. */
+        resp->framing = chunked ? BODY_CHUNKED : BODY_UNTIL_CLOSE;
+        resp->has_content_length = false;
+    } else if (resp->has_content_length) {
+        resp->framing = BODY_LENGTH;
+    } else {
+        resp->framing = BODY_UNTIL_CLOSE;
+    }
+
+    if (resp->framing == BODY_UNTIL_CLOSE)
+        resp->keep_alive = false;
+
+    return true;
+}
+
+/* Reads the response header block, skipping interim (1xx) responses.
+ * Whatever was read past it is left in the buffer. */
+static enum lwan_http_status read_response_head(struct upstream *up,
+                                                struct upstream_response *resp)
+{
+    resp->len = 0;
+
+    while (true) {
+        char *head_end = NULL;
+
+        while (!head_end) {
+            size_t scanned = resp->len > 3 ? resp->len - 3 : 0;
+            ssize_t n;
+
+            if (resp->len == sizeof(resp->buf))
+                return HTTP_BAD_GATEWAY;
+
+            n = upstream_recv(up, resp->buf + resp->len,
+                              sizeof(resp->buf) - resp->len);
+            if (n <= 0) {
+                /* Nothing at all from a reused connection: it might have
+                 * been closed just as it was taken from the pool. */
+                if (!resp->len && up->reused && !n)
+                    return HTTP_UNAVAILABLE;
+                return n < 0 && errno == ETIMEDOUT ? HTTP_GATEWAY_TIMEOUT
+                                                   : HTTP_BAD_GATEWAY;
+            }
+            resp->len += (size_t)n;
+
+            head_end = memmem(resp->buf + scanned, resp->len - scanned,
+                              "\r\n\r\n", 4);
+        }
+
+        resp->head_len = (size_t)(head_end - resp->buf) + 4;
+
+        if (resp->len < sizeof("HTTP/1.1 100") || resp->buf[9] != '1')
+            return HTTP_OK;
+
+        resp->len -= resp->head_len;
+        memmove(resp->buf, resp->buf + resp->head_len, resp->len);
+    }
+}
+
+static void abort_response(struct lwan_request *request)
+{
+    /* Headers have been sent already: all that can be done is closing
+     * the connection, so the client knows the response is truncated. */
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static void send_to_client(struct lwan_request *request, const void *buf,
+                           size_t len)
+{
+    if (len)
+        lwan_send(request, buf, len, 0);
+}
+
+#if defined(__linux__)
+static bool take_pipe(struct upstream *up)
+{
+    struct lwan_thread *thread = up->request->conn->thread;
+
+    if (thread->splice_pipe[0] >= 0) {
+        up->pipe[0] = thread->splice_pipe[0];
+        up->pipe[1] = thread->splice_pipe[1];
+        thread->splice_pipe[0] = thread->splice_pipe[1] = -1;
+        return true;
+    }
+
+    if (pipe2(up->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        up->pipe[0] = up->pipe[1] = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static void give_pipe_back(struct upstream *up)
+{
+    struct lwan_thread *thread = up->request->conn->thread;
+
+    /* Only empty pipes are given back, so they can be reused by any
+     * other coroutine. */
+    if (thread->splice_pipe[0] < 0) {
+        thread->splice_pipe[0] = up->pipe[0];
+        thread->splice_pipe[1] = up->pipe[1];
+    } else {
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+    }
+
+    up->pipe[0] = up->pipe[1] = -1;
+}
+
+/* Moves the body from the upstream socket to the client socket through a
+ * pipe, without copying it to userspace.  Returns false if the body couldn't
+ * be moved, with *remaining updated so that the caller can fall back to
+ * copying if splice() isn't supported by either socket. */
+static bool splice_body(struct upstream *up, size_t *remaining, bool *fallback)
+{
+    struct lwan_request *request = up->request;
+
+    *fallback = false;
+
+    /* HTTP/2 responses are framed, so they have to go through userspace. */
+    if (request->h2 || !take_pipe(up)) {
+        *fallback = true;
+        return false;
+    }
+
+    while (*remaining) {
+        ssize_t in = splice(up->fd, NULL, up->pipe[1], NULL,
+                            min_size(*remaining, 1 << 16),
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (in < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                if (!lwan_request_await_read(request, up->fd,
+                                             up->priv->timeout_ms))
+                    return false;
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS)
+                *fallback = true;
+            return false;
+        }
+        if (!in)
+            return false;
+
+        *remaining -= (size_t)in;
+
+        while (in) {
+            ssize_t out = splice(up->pipe[0], NULL, request->fd, NULL,
+                                 (size_t)in,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                                     (*remaining ? SPLICE_F_MORE : 0));
+
+            if (out < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN) {
+                    request->conn->flags |= CONN_WRITE_BLOCKED;
+                    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+                    continue;
+                }
+                /* Data is stuck in the pipe: can't fall back anymore. */
+                abort_response(request);
+            }
+
+            in -= out;
+        }
+    }
+
+    give_pipe_back(up);
+    return true;
+}
+#endif
+
+static bool copy_body(struct upstream *up, size_t remaining)
+{
+    char buf[DEFAULT_BUFFER_SIZE];
+
+    while (remaining) {
+        ssize_t n = upstream_recv(up, buf, min_size(remaining, sizeof(buf)));
+
+        if (n <= 0)
+            return false;
+
+        send_to_client(up->request, buf, (size_t)n);
+        remaining -= (size_t)n;
+    }
+
+    return true;
+}
+
+static bool relay_length(struct upstream *up, size_t remaining)
+{
+#if defined(__linux__)
+    bool fallback;
+
+    if (splice_body(up, &remaining, &fallback))
+        return true;
+    if (!fallback)
+        return false;
+#endif
+
+    return copy_body(up, remaining);
+}
+
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LF,
+    CHUNK_DONE,
+};
+
+struct chunk_parser {
+    enum chunk_state state;
+    size_t size;
+    bool has_digits;
+};
+
+/* Follows the chunked framing of len bytes in buf, returning how many of
+ * them belong to the body, or -1 if the framing is invalid. */
+static ssize_t chunk_parser_feed(struct chunk_parser *cp, const char *buf,
+                                 size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && cp->state != CHUNK_DONE) {
+        char c = buf[i];
+
+        switch (cp->state) {
+        case CHUNK_SIZE:
+            if (lwan_char_isxdigit(c)) {
+                unsigned int digit = (unsigned int)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+
+                if (cp->size >> (sizeof(size_t) * 8 - 4))
+                    return -1;
+                cp->size = cp->size << 4 | digit;
+                cp->has_digits = true;
+                break;
+            }
+            if (!cp->has_digits)
+                return -1;
+            if (c == '\r') {
+                cp->state = CHUNK_SIZE_LF;
+                break;
+            }
+            if (c != ';' && c != ' ' && c != '\t')
+                return -1;
+            cp->state = CHUNK_EXTENSION;
+            break;
+        case CHUNK_EXTENSION:
+            if (c == '\r')
+                cp->state = CHUNK_SIZE_LF;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            cp->has_digits = false;
+            cp->state = cp->size ? CHUNK_DATA : CHUNK_TRAILER_START;
+            break;
+        case CHUNK_DATA: {
+            size_t n = min_size(cp->size, len - i);
+
+            cp->size -= n;
+            i += n;
+            if (!cp->size)
+                cp->state = CHUNK_DATA_CR;
+            continue;
+        }
+        case CHUNK_DATA_CR:
+            if (c != '\r')
+                return -1;
+            cp->state = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            cp->state = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER_START:
+            cp->state = c == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\n')
+                cp->state = CHUNK_TRAILER_START;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n')
+                return -1;
+            cp->state = CHUNK_DONE;
+            break;
+        case CHUNK_DONE:
+            break;
+        }
+
+        i++;
+    }
+
+    return (ssize_t)i;
+}
+
+/* Chunked bodies are forwarded as they are, only following the framing to
+ * know where they end. */
+static bool relay_chunked(struct upstream *up, struct upstream_response *resp,
+                          const char *leftover, size_t leftover_len)
+{
+    struct chunk_parser cp = {.state = CHUNK_SIZE};
+    ssize_t used;
+
+    used = chunk_parser_feed(&cp, leftover, leftover_len);
+    if (used < 0)
+        return false;
+    send_to_client(up->request, leftover, (size_t)used);
+
+    while (cp.state != CHUNK_DONE) {
+        ssize_t n = upstream_recv(up, resp->buf, sizeof(resp->buf));
+
+        if (n <= 0)
+            return false;
+
+        used = chunk_parser_feed(&cp, resp->buf, (size_t)n);
+        if (used < 0)
+            return false;
+        send_to_client(up->request, resp->buf, (size_t)used);
+        if (used != n)
+            resp->keep_alive = false;
+    }
+
+    return true;
+}
+
+static bool relay_until_close(struct upstream *up,
+                              struct upstream_response *resp)
+{
+    while (true) {
+        ssize_t n = upstream_recv(up, resp->buf, sizeof(resp->buf));
+
+        if (!n)
+            return true;
+        if (n < 0)
+            return false;
+
+        send_to_client(up->request, resp->buf, (size_t)n);
+    }
+}
+
+static enum lwan_http_status relay_response(struct upstream *up,
+                                            struct upstream_response *resp)
+{
+    struct lwan_request *request = up->request;
+    struct lwan_strbuf *buf = request->response.buffer;
+    bool client_keep_alive;
+    const char *leftover;
+    size_t leftover_len;
+    bool ok;
+
+    lwan_strbuf_reset(buf);
+    if (!lwan_strbuf_append_printf(buf, "HTTP/1.%c ",
+                                   request->flags & REQUEST_IS_HTTP_1_0 ? '0'
+                                                                       : '1'))
+        return HTTP_INTERNAL_ERROR;
+    /* Status line goes first; headers are appended right after it. */
+    if (!parse_response_head(resp, request, buf))
+        return HTTP_BAD_GATEWAY;
+
+    client_keep_alive = (request->conn->flags & CONN_KEEP_ALIVE) &&
+                        resp->framing != BODY_UNTIL_CLOSE;
+    if (!client_keep_alive)
+        request->conn->flags &= ~CONN_KEEP_ALIVE;
+
+    if (resp->has_content_length &&
+        !lwan_strbuf_append_printf(buf, "Content-Length: %zu\r\n",
+                                   resp->content_length))
+        return HTTP_INTERNAL_ERROR;
+    if (resp->framing == BODY_CHUNKED &&
+        !lwan_strbuf_append_str(buf, "Transfer-Encoding: chunked\r\n",
+                                sizeof("Transfer-Encoding: chunked\r\n") - 1))
+        return HTTP_INTERNAL_ERROR;
+    if (!lwan_strbuf_append_printf(buf, "Connection: %s\r\n\r\n",
+                                   client_keep_alive ? "keep-alive" : "close"))
+        return HTTP_INTERNAL_ERROR;
+
+    leftover = resp->buf + resp->head_len;
+    leftover_len = resp->len - resp->head_len;
+
+    switch (resp->framing) {
+    case BODY_NONE:
+        leftover_len = 0;
+        break;
+    case BODY_LENGTH:
+        if (leftover_len > resp->content_length) {
+            leftover_len = resp->content_length;
+            resp->keep_alive = false;
+        }
+        break;
+    case BODY_CHUNKED:
+        /* Sent by relay_chunked() as the framing is followed */
+        leftover_len = 0;
+        break;
+    case BODY_UNTIL_CLOSE:
+        break;
+    }
+
+    /* The status line from upstream goes right after the protocol version,
+     * before the headers that have been appended to it. */
+    struct iovec head[] = {
+        {.iov_base = lwan_strbuf_get_buffer(buf), .iov_len = sizeof("HTTP/1.1 ") - 1},
+        {.iov_base = resp->status_line.value, .iov_len = resp->status_line.len},
+        {.iov_base = "\r\n", .iov_len = 2},
+        {.iov_base = lwan_strbuf_get_buffer(buf) + sizeof("HTTP/1.1 ") - 1,
+         .iov_len = lwan_strbuf_get_length(buf) - (sizeof("HTTP/1.1 ") - 1)},
+        {.iov_base = (void *)leftover, .iov_len = leftover_len},
+    };
+    lwan_writev(request, head, N_ELEMENTS(head));
+
+    switch (resp->framing) {
+    case BODY_NONE:
+        ok = true;
+        break;
+    case BODY_LENGTH:
+        ok = relay_length(up, resp->content_length - leftover_len);
+        break;
+    case BODY_CHUNKED:
+        ok = relay_chunked(up, resp, resp->buf + resp->head_len,
+                           resp->len - resp->head_len);
+        break;
+    case BODY_UNTIL_CLOSE:
+        ok = relay_until_close(up, resp);
+        break;
+    default:
+        ok = false;
+    }
+
+    if (!ok)
+        abort_response(request);
+
+    /* A body delimited by the end of the connection needs the client to
+     * see it end right away, rather than when the connection times out. */
+    if (resp->framing == BODY_UNTIL_CLOSE && !request->h2)
+        shutdown(request->fd, SHUT_WR);
+
+    if (resp->keep_alive)
+        pool_give_back(up);
+    else
+        upstream_close(up);
+
+    return HTTP_OK;
+}
+
+static enum lwan_http_status proxy_request(struct upstream *up,
+                                           struct upstream_response *resp,
+                                           bool pooled)
+{
+    enum lwan_http_status status;
+
+    if (!upstream_connect(up, pooled))
+        return HTTP_BAD_GATEWAY;
+
+    status = send_request(up);
+    if (status != HTTP_OK)
+        return status;
+
+    return read_response_head(up, resp);
+}
+
+static enum lwan_http_status
+reverse_proxy_serve(struct lwan_request *request, void *data)
+{
+    struct reverse_proxy_priv *priv = data;
+    struct coro *coro = request->conn->coro;
+    struct upstream_response *resp;
+    struct upstream *up;
+    enum lwan_http_status status;
+
+    up = coro_malloc_full(coro, sizeof(*up), upstream_destroy);
+    if (UNLIKELY(!up))
+        return HTTP_INTERNAL_ERROR;
+    *up = (struct upstream){.priv = priv,
+                            .request = request,
+                            .fd = -1,
+                            .pipe = {-1, -1}};
+
+    resp = coro_malloc(coro, sizeof(*resp));
+    if (UNLIKELY(!resp))
+        return HTTP_INTERNAL_ERROR;
+
+    status = build_request(request, request->response.buffer);
+    if (status != HTTP_OK)
+        return status;
+
+    status = proxy_request(up, resp, true);
+    if (status == HTTP_UNAVAILABLE) {
+        /* A pooled connection went away before a single byte of the
+         * response arrived.  The request is only retried, this time on a
+         * new connection, if there's no body that had to be consumed. */
+        upstream_close(up);
+        if (up->sent_body)
+            return HTTP_BAD_GATEWAY;
+
+        status = proxy_request(up, resp, false);
+    }
+    if (status != HTTP_OK)
+        return status == HTTP_UNAVAILABLE ? HTTP_BAD_GATEWAY : status;
+
+    return relay_response(up, resp);
+}
+
+static enum lwan_http_status
+reverse_proxy_handle_request(struct lwan_request *request
+                             __attribute__((unused)),
+                             struct lwan_response *response,
+                             void *instance)
+{
+    if (UNLIKELY(!instance))
+        return HTTP_INTERNAL_ERROR;
+
+    /* The content type is whatever the upstream server sends; this is
+     * only here so that lwan_response() calls the stream callback. */
+    response->mime_type = "application/octet-stream";
+    response->stream.callback = reverse_proxy_serve;
+    response->stream.data = instance;
+
+    return HTTP_OK;
+}
+
+static bool parse_upstream(struct reverse_proxy_priv *priv,
+                           const char *upstream)
+{
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    char *host, *port;
+    int ret;
+
+    host = strdupa(upstream);
+    if (*host == '[') {
+        char *bracket = strchr(host, ']');
+
+        if (!bracket || bracket[1] != ':')
+            return false;
+        *bracket = '\0';
+        host++;
+        port = bracket + 2;
+    } else {
+        port = strrchr(host, ':');
+        if (!port)
+            return false;
+        *port++ = '\0';
+    }
+
+    ret = getaddrinfo(host, port, &hints, &res);
+    if (ret) {
+        lwan_status_error("Could not resolve upstream %s: %s", upstream,
+                          gai_strerror(ret));
+        return false;
+    }
+
+    memcpy(&priv->addr, res->ai_addr, res->ai_addrlen);
+    priv->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return true;
+}
+
+static void *reverse_proxy_create(const char *prefix __attribute__((unused)),
+                                  void *args)
+{
+    struct lwan_reverse_proxy_settings *settings = args;
+    struct reverse_proxy_priv *priv;
+
+    if (!settings->upstream) {
+        lwan_status_error("`upstream` not supplied");
+        return NULL;
+    }
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return NULL;
+
+    if (!parse_upstream(priv, settings->upstream)) {
+        lwan_status_error("Invalid upstream: %s", settings->upstream);
+        goto error;
+    }
+
+    priv->timeout_ms = settings->timeout * 1000;
+    priv->pool.max = settings->keep_alive_connections;
+    if (priv->pool.max) {
+        priv->pool.fds = calloc(priv->pool.max, sizeof(int));
+        if (!priv->pool.fds)
+            goto error;
+    }
+    pthread_mutex_init(&priv->pool.lock, NULL);
+
+    return priv;
+
+error:
+    free(priv);
+    return NULL;
+}
+
+static void *reverse_proxy_create_from_hash(const char *prefix,
+                                            const struct hash *hash)
+{
+    struct lwan_reverse_proxy_settings settings = {
+        .upstream = hash_find(hash, "upstream"),
+        .keep_alive_connections = (unsigned int)parse_int(
+            hash_find(hash, "keep_alive_connections"), 16),
+        .timeout = parse_time_period(hash_find(hash, "timeout"), 30),
+    };
+
+    return reverse_proxy_create(prefix, &settings);
+}
+
+static void reverse_proxy_destroy(void *instance)
+{
+    struct reverse_proxy_priv *priv = instance;
+
+    if (!priv)
+        return;
+
+    for (unsigned int i = 0; i < priv->pool.count; i++)
+        close(priv->pool.fds[i]);
+    pthread_mutex_destroy(&priv->pool.lock);
+    free(priv->pool.fds);
+    free(priv);
+}
+
+static const struct lwan_module module = {
+    .create = reverse_proxy_create,
+    .create_from_hash = reverse_proxy_create_from_hash,
+    .destroy = reverse_proxy_destroy,
+    .handle_request = reverse_proxy_handle_request,
+    .flags = HANDLER_STREAM_POST_DATA,
+};
+
+LWAN_REGISTER_MODULE(reverse_proxy, &module);
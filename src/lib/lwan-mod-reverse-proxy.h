@@ -0,0 +1,43 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_reverse_proxy_settings {
+    /* "host:port", or "[address]:port" for IPv6 */
+    const char *upstream;
+    /* Idle connections kept open to the upstream server */
+    unsigned int keep_alive_connections;
+    /* For connecting to, and each read from or write to, the upstream
+     * server; in seconds */
+    unsigned int timeout;
+};
+
+LWAN_MODULE_FORWARD_DECL(reverse_proxy)
+
+#define REVERSE_PROXY(upstream_)                                               \
+    .module = LWAN_MODULE_REF(reverse_proxy),                                  \
+    .args = ((struct lwan_reverse_proxy_settings[]){{                          \
+        .upstream = upstream_,                                                 \
+        .keep_alive_connections = 16,                                          \
+        .timeout = 30,                                                         \
+    }}),                                                                       \
+    .flags = 0
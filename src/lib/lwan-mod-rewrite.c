@@ -27,6 +27,7 @@
 #include "lwan-private.h"
 
 #include "lwan-array.h"
+#include "lwan-cache.h"
 #include "lwan-mod-rewrite.h"
 #include "patterns.h"
 
@@ -48,18 +49,43 @@ enum pattern_flag {
     PATTERN_EXPAND_MASK = PATTERN_EXPAND_LWAN | PATTERN_EXPAND_LUA,
 };
 
+struct byte_set {
+    uint64_t bits[4];
+};
+
 struct pattern {
     char *pattern;
     char *expand_pattern;
     enum pattern_flag flags;
+
+    /* Filled by analyze_pattern(): a run of characters that every URL
+     * matched by this pattern contains (at its start, if the pattern is
+     * anchored and begins with it), and the set of bytes in that run.
+     * These let most patterns be skipped without running the matcher. */
+    char *required;
+    size_t required_len;
+    bool required_at_start;
+    struct byte_set required_bytes;
 };
 
 DEFINE_ARRAY_TYPE(pattern_array, struct pattern)
 
 struct private_data {
     struct pattern_array patterns;
+    struct cache *cache;
+};
+
+/* Which pattern matched an URL, plus the expanded URL if it doesn't
+ * depend on anything else in the request. */
+struct rewrite_result {
+    struct cache_entry base;
+    struct pattern *pattern;
+    char *expanded;
 };
 
+static const time_t rewrite_cache_time_to_live = 5;
+static const size_t rewrite_cache_max_entries = 4096;
+
 struct str_builder {
     char *buffer;
     size_t size, len;
@@ -177,6 +203,260 @@ static const char *expand(struct lwan_request *request __attribute__((unused)),
     return builder.buffer;
 }
 
+static ALWAYS_INLINE void byte_set_add(struct byte_set *set, unsigned char c)
+{
+    set->bits[c / 64] |= 1ull << (c % 64);
+}
+
+static ALWAYS_INLINE bool byte_set_contains_all(const struct byte_set *set,
+                                                const struct byte_set *subset)
+{
+    return !((subset->bits[0] & ~set->bits[0]) |
+             (subset->bits[1] & ~set->bits[1]) |
+             (subset->bits[2] & ~set->bits[2]) |
+             (subset->bits[3] & ~set->bits[3]));
+}
+
+static const char *skip_bracket_class(const char *p)
+{
+    /* Mirrors classend() in patterns.c: a ']' right after the opening
+     * bracket (or after '^') is part of the set. */
+    if (*p == '^')
+        p++;
+    do {
+        if (!*p)
+            return NULL;
+        if (*p++ == '%' && *p)
+            p++;
+    } while (*p != ']');
+
+    return p + 1;
+}
+
+/* Walks the pattern looking for runs of literal characters, which must
+ * appear verbatim in anything the pattern matches (Lua patterns have no
+ * alternation).  A run preceded only by the '^' anchor is preferred, as
+ * it's cheaper to check; otherwise, the longest run is used. */
+static bool analyze_pattern(struct pattern *pattern)
+{
+    const char *p = pattern->pattern;
+    size_t pattern_len = strlen(p);
+    char *run = malloc(pattern_len + 1);
+    char *best = malloc(pattern_len + 1);
+    size_t run_len = 0, best_len = 0;
+    bool run_at_start = false, best_at_start = false;
+
+    if (!run || !best)
+        goto fail;
+
+    if (*p == '^') {
+        run_at_start = true;
+        p++;
+    }
+
+#define FLUSH_RUN()                                                                do {                                                                               if (run_len && !best_at_start &&                                                   (run_at_start || run_len > best_len)) {                                        memcpy(best, run, run_len);                                                    best_len = run_len;                                                            best_at_start = run_at_start;                                              }                                                                              run_len = 0;                                                                   run_at_start = false;                                                      } while (0)
+
+    while (*p) {
+        const char *item_end;
+        bool is_literal = false;
+        bool can_repeat = true;
+        char c = '\0';
+
+        switch (*p) {
+        case '(':
+        case ')':
+            /* Captures don't consume anything by themselves. */
+            p++;
+            continue;
+        case '$':
+            if (!p[1]) {
+                p++;
+                continue;
+            }
+            is_literal = true;
+            c = *p;
+            item_end = p + 1;
+            break;
+        case '.':
+            item_end = p + 1;
+            break;
+        case '[':
+            item_end = skip_bracket_class(p + 1);
+            if (!item_end)
+                goto fail;
+            break;
+        case '%':
+            if (!p[1])
+                goto fail;
+            if (p[1] == 'b') {
+                if (!p[2] || !p[3])
+                    goto fail;
+                item_end = p + 4;
+                can_repeat = false;
+            } else if (p[1] == 'f') {
+                if (p[2] != '[')
+                    goto fail;
+                item_end = skip_bracket_class(p + 3);
+                if (!item_end)
+                    goto fail;
+                can_repeat = false;
+            } else if (isalnum((unsigned char)p[1])) {
+                /* Character classes and back-references. */
+                item_end = p + 2;
+                can_repeat = p[1] < '0' || p[1] > '9';
+            } else {
+                is_literal = true;
+                c = p[1];
+                item_end = p + 2;
+            }
+            break;
+        default:
+            is_literal = true;
+            c = *p;
+            item_end = p + 1;
+        }
+
+        p = item_end;
+
+        if (!is_literal) {
+            FLUSH_RUN();
+            if (can_repeat && (*p == '*' || *p == '+' || *p == '?' || *p == '-'))
+                p++;
+            continue;
+        }
+
+        switch (*p) {
+        case '*':
+        case '?':
+        case '-':
+            /* Optional; whatever follows isn't adjacent to the run. */
+            FLUSH_RUN();
+            p++;
+            break;
+        case '+':
+            /* At least one, so it ends this run and starts the next. */
+            run[run_len++] = c;
+            FLUSH_RUN();
+            run[run_len++] = c;
+            p++;
+            break;
+        default:
+            run[run_len++] = c;
+        }
+    }
+
+    FLUSH_RUN();
+
+#undef FLUSH_RUN
+
+    free(run);
+
+    if (!best_len) {
+        free(best);
+        return true;
+    }
+
+    best[best_len] = '\0';
+    pattern->required = best;
+    pattern->required_len = best_len;
+    pattern->required_at_start = best_at_start;
+    for (size_t i = 0; i < best_len; i++)
+        byte_set_add(&pattern->required_bytes, (unsigned char)best[i]);
+
+    return true;
+
+fail:
+    free(run);
+    free(best);
+    return false;
+}
+
+static ALWAYS_INLINE bool pattern_might_match(const struct pattern *pattern,
+                                              const char *url,
+                                              const struct byte_set *url_bytes)
+{
+    if (!pattern->required)
+        return true;
+
+    if (!byte_set_contains_all(url_bytes, &pattern->required_bytes))
+        return false;
+
+    if (pattern->required_at_start)
+        return !strncmp(url, pattern->required, pattern->required_len);
+
+    return strstr(url, pattern->required) != NULL;
+}
+
+static struct pattern *find_pattern(struct private_data *pd,
+                                    const char *url,
+                                    struct str_find sf[static MAXCAPTURES],
+                                    int *captures)
+{
+    struct byte_set url_bytes = {};
+    struct pattern *p;
+
+    for (const char *u = url; *u; u++)
+        byte_set_add(&url_bytes, (unsigned char)*u);
+
+    LWAN_ARRAY_FOREACH(&pd->patterns, p) {
+        const char *errmsg;
+
+        if (!pattern_might_match(p, url, &url_bytes))
+            continue;
+
+        *captures = str_find(url, p->pattern, sf, MAXCAPTURES, &errmsg);
+        if (*captures > 0)
+            return p;
+    }
+
+    return NULL;
+}
+
+static struct cache_entry *create_rewrite_result(const char *key,
+                                                 void *context)
+{
+    struct private_data *pd = context;
+    struct rewrite_result *result = malloc(sizeof(*result));
+    struct str_find sf[MAXCAPTURES];
+    int captures;
+
+    if (UNLIKELY(!result))
+        return NULL;
+
+    result->pattern = find_pattern(pd, key, sf, &captures);
+    result->expanded = NULL;
+    result->base.size = sizeof(*result);
+
+    if (result->pattern &&
+        (result->pattern->flags & PATTERN_EXPAND_MASK) == PATTERN_EXPAND_LWAN) {
+        char buffer[PATH_MAX];
+        const char *expanded =
+            expand(NULL, result->pattern, key, buffer, sf, captures);
+
+        /* If expansion fails, this is cached as well, and requests for
+         * this URL will keep failing as they would without the cache. */
+        if (expanded) {
+            result->expanded = strdup(expanded);
+            if (UNLIKELY(!result->expanded)) {
+                free(result);
+                return NULL;
+            }
+            result->base.size += strlen(expanded) + 1;
+        }
+    }
+
+    return &result->base;
+}
+
+static void destroy_rewrite_result(struct cache_entry *entry,
+                                   void *context __attribute__((unused)))
+{
+    struct rewrite_result *result = (struct rewrite_result *)entry;
+
+    free(result->expanded);
+    free(result);
+}
+
 #ifdef HAVE_LUA
 static const char *expand_lua(struct lwan_request *request,
                               struct pattern *pattern, const char *orig,
@@ -228,6 +508,22 @@ static const char *expand_lua(struct lwan_request *request,
 }
 #endif
 
+static enum lwan_http_status handle_expanded(struct lwan_request *request,
+                                             const struct pattern *p,
+                                             const char *expanded)
+{
+    if (LIKELY(expanded)) {
+        switch (p->flags & PATTERN_HANDLE_MASK) {
+        case PATTERN_HANDLE_REDIRECT:
+            return module_redirect_to(request, expanded);
+        case PATTERN_HANDLE_REWRITE:
+            return module_rewrite_as(request, expanded);
+        }
+    }
+
+    return HTTP_INTERNAL_ERROR;
+}
+
 static enum lwan_http_status
 rewrite_handle_request(struct lwan_request *request,
                        struct lwan_response *response __attribute__((unused)),
@@ -236,45 +532,49 @@ rewrite_handle_request(struct lwan_request *request,
     struct private_data *pd = instance;
     const char *url = request->url.value;
     char final_url[PATH_MAX];
+    struct str_find sf[MAXCAPTURES];
+    const char *expanded = NULL;
+    struct rewrite_result *result;
     struct pattern *p;
+    int captures;
 
     if (UNLIKELY(!pd))
         return HTTP_INTERNAL_ERROR;
 
-    LWAN_ARRAY_FOREACH(&pd->patterns, p) {
-        struct str_find sf[MAXCAPTURES];
-        const char *expanded = NULL;
-        const char *errmsg;
-        int captures;
+    result = (struct rewrite_result *)cache_coro_get_and_ref_entry(
+        pd->cache, request->conn->coro, url);
+    if (LIKELY(result)) {
+        p = result->pattern;
+        if (!p)
+            return HTTP_NOT_FOUND;
+
+        if ((p->flags & PATTERN_EXPAND_MASK) == PATTERN_EXPAND_LWAN)
+            return handle_expanded(request, p, result->expanded);
 
+        /* Expansion depends on the request; only the search for a
+         * matching pattern is saved. */
+        const char *errmsg;
         captures = str_find(url, p->pattern, sf, MAXCAPTURES, &errmsg);
-        if (captures <= 0)
-            continue;
+        if (UNLIKELY(captures <= 0))
+            return HTTP_INTERNAL_ERROR;
+    } else {
+        p = find_pattern(pd, url, sf, &captures);
+        if (!p)
+            return HTTP_NOT_FOUND;
+    }
 
-        switch (p->flags & PATTERN_EXPAND_MASK) {
+    switch (p->flags & PATTERN_EXPAND_MASK) {
 #ifdef HAVE_LUA
-        case PATTERN_EXPAND_LUA:
-            expanded = expand_lua(request, p, url, final_url, sf, captures);
-            break;
+    case PATTERN_EXPAND_LUA:
+        expanded = expand_lua(request, p, url, final_url, sf, captures);
+        break;
 #endif
-        case PATTERN_EXPAND_LWAN:
-            expanded = expand(request, p, url, final_url, sf, captures);
-            break;
-        }
-
-        if (LIKELY(expanded)) {
-            switch (p->flags & PATTERN_HANDLE_MASK) {
-            case PATTERN_HANDLE_REDIRECT:
-                return module_redirect_to(request, expanded);
-            case PATTERN_HANDLE_REWRITE:
-                return module_rewrite_as(request, expanded);
-            }
-        }
-
-        return HTTP_INTERNAL_ERROR;
+    case PATTERN_EXPAND_LWAN:
+        expanded = expand(request, p, url, final_url, sf, captures);
+        break;
     }
 
-    return HTTP_NOT_FOUND;
+    return handle_expanded(request, p, expanded);
 }
 
 static void *rewrite_create(const char *prefix __attribute__((unused)),
@@ -285,6 +585,14 @@ static void *rewrite_create(const char *prefix __attribute__((unused)),
     if (!pd)
         return NULL;
 
+    pd->cache = cache_create(create_rewrite_result, destroy_rewrite_result, pd,
+                             rewrite_cache_time_to_live);
+    if (!pd->cache) {
+        free(pd);
+        return NULL;
+    }
+    cache_set_limits(pd->cache, rewrite_cache_max_entries, 0);
+
     pattern_array_init(&pd->patterns);
 
     return pd;
@@ -295,9 +603,12 @@ static void rewrite_destroy(void *instance)
     struct private_data *pd = instance;
     struct pattern *iter;
 
+    cache_destroy(pd->cache);
+
     LWAN_ARRAY_FOREACH(&pd->patterns, iter) {
         free(iter->pattern);
         free(iter->expand_pattern);
+        free(iter->required);
     }
 
     pattern_array_reset(&pd->patterns);
@@ -383,6 +694,12 @@ static bool rewrite_parse_conf_pattern(struct private_data *pd,
                 pattern->flags |= PATTERN_EXPAND_LWAN;
             }
 
+            if (!analyze_pattern(pattern)) {
+                config_error(config, "Malformed pattern: %s",
+                             pattern->pattern);
+                return false;
+            }
+
             return true;
         }
     }
@@ -22,7 +22,9 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -31,24 +33,108 @@
 
 #include "lwan-private.h"
 
+#if defined(HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(HAVE_LINUX_OPENAT2_H)
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#endif
+#if defined(HAS_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
 #include "hash.h"
 #include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-io-wrappers.h"
 #include "lwan-mod-serve-files.h"
+#include "lwan-shm-cache.h"
 #include "lwan-template.h"
+#include "murmur3.h"
 #include "realpathat.h"
 
 #include "auto-index-icons.h"
 
 static const char *compression_none = NULL;
-static const char *compression_gzip = "gzip";
-static const char *compression_deflate = "deflate";
+
+/* Precompressed siblings looked for next to files served with sendfile(),
+ * e.g. "app.js.br" and "app.js.gz" for "app.js". */
+enum precompressed {
+    PRECOMPRESSED_BROTLI,
+    PRECOMPRESSED_ZSTD,
+    PRECOMPRESSED_GZIP,
+    N_PRECOMPRESSED,
+};
+
+static const struct {
+    const char *suffix;
+    const char *name;
+    enum lwan_request_flags accept_flag;
+} precompressed[] = {
+    [PRECOMPRESSED_BROTLI] = {".br", "br", REQUEST_ACCEPT_BROTLI},
+    [PRECOMPRESSED_ZSTD] = {".zst", "zstd", REQUEST_ACCEPT_ZSTD},
+    [PRECOMPRESSED_GZIP] = {".gz", "gzip", REQUEST_ACCEPT_GZIP},
+};
+
+/* Encodings the contents of small, memory-mapped files can be served with.
+ * Each one of them is compressed only when a client first asks for it. */
+enum encoding {
+    ENCODING_DEFLATE,
+    ENCODING_GZIP,
+#if defined(HAVE_BROTLI)
+    ENCODING_BROTLI,
+#endif
+#if defined(HAVE_ZSTD)
+    ENCODING_ZSTD,
+#endif
+    N_ENCODINGS,
+};
+
+enum encoded_state {
+    ENCODED_UNKNOWN = 0,
+    ENCODED_BUILDING,
+    ENCODED_READY,
+    ENCODED_UNAVAILABLE,
+};
 
 static const int open_mode = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
 
+/* Files larger than this have a weak ETag, derived from their size and
+ * modification time, instead of one derived from their contents. */
+#define ETAG_MAX_HASHED_SIZE (16 * 1024 * 1024)
+
+#define DEFAULT_SHARED_CACHE_SIZE (64 * 1024 * 1024)
+
+/* How much of a file served with sendfile() is read ahead of time when it's
+ * opened, or before sending a range of it.  The kernel keeps reading ahead
+ * of sequential transfers past that. */
+#define SENDFILE_READAHEAD_SIZE (1024 * 1024)
+
 struct file_cache_entry;
 
+/* Keys that didn't lead to a file, e.g. from vulnerability scanners, so
+ * that 404s for them are answered without looking them up again.  Each key
+ * takes the slot its hash points to.  Entries are good until the cache TTL
+ * elapses, or, with watch_files, until something is created. */
+struct not_found_entry {
+    char *key;
+    time_t time_to_die;
+    unsigned int generation;
+};
+
+struct not_found_cache {
+    pthread_mutex_t lock;
+    time_t ttl;
+    unsigned int generation;
+    unsigned int mask;
+    struct not_found_entry entries[];
+};
+
 struct serve_files_priv {
     struct cache *cache;
 
@@ -61,6 +147,25 @@ struct serve_files_priv {
 
     struct lwan_tpl *directory_list_tpl;
 
+    int levels[N_ENCODINGS];
+
+    struct lwan_shm_cache *shared;
+
+    /* Directory with compressed copies that outlive the process; -1 if
+     * there's none. */
+    int store_fd;
+
+    /* NULL if paths that weren't found aren't remembered. */
+    struct not_found_cache *not_found;
+
+#if defined(HAS_INOTIFY)
+    struct {
+        int fd;
+        /* Watch descriptor -> full path of the watched directory */
+        struct hash *dirs;
+    } watch;
+#endif
+
     bool serve_precompressed_files;
     bool auto_index;
 };
@@ -73,23 +178,58 @@ struct cache_funcs {
     size_t struct_size;
 };
 
+/* Files are told apart in the shared cache by these, as keys outlive the
+ * processes that stored them. */
+struct shared_file_id {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t ctime_ns;
+};
+
+/* Encodings, or SHARED_KIND_ETAG */
+#define SHARED_KIND_ETAG N_ENCODINGS
+
+struct shared_key {
+    struct shared_file_id id;
+    uint32_t kind;
+    int32_t level;
+};
+
 struct mmap_cache_data {
     struct {
         void *contents;
-        /* zlib expects unsigned longs instead of size_t */
-        unsigned long size;
-    } compressed, uncompressed;
+        size_t size;
+    } uncompressed;
+
+    struct {
+        void *contents;
+        size_t size;
+        int state;
+        /* Points to the shared cache; not freed. */
+        bool shared;
+        /* Points right past the header of a file from the store. */
+        bool mapped;
+    } encoded[N_ENCODINGS];
+
+    /* Directory listings aren't in the shared cache. */
+    bool shareable;
+    struct shared_file_id id;
 };
 
 struct sendfile_cache_data {
     struct {
         int fd;
         size_t size;
-    } compressed, uncompressed;
+    } compressed[N_PRECOMPRESSED], uncompressed;
 };
 
 struct dir_list_cache_data {
     struct lwan_strbuf *rendered;
+    /* Points to the rendered listing, so that it can be compressed and
+     * served as a small file would. */
+    struct mmap_cache_data md;
 };
 
 struct redir_cache_data {
@@ -104,8 +244,19 @@ struct file_cache_entry {
         time_t integer;
     } last_modified;
 
+    /* Computed once, from the contents if possible; empty opaque tag if
+     * the entry has no ETag. */
+    struct {
+        char opaque[40];
+        bool weak;
+    } etag;
+
     const char *mime_type;
     const struct cache_funcs *funcs;
+
+    /* Full path of whatever is being served; stored after the
+     * funcs-specific data. */
+    const char *path;
 };
 
 struct file_list {
@@ -126,6 +277,40 @@ struct file_list {
 
 static int directory_list_generator(struct coro *coro, void *data);
 
+/* Strong ETags take hashing the whole file; processes sharing the cache
+ * reuse each other's. */
+static bool get_shared_etag(struct file_cache_entry *ce,
+                            const struct serve_files_priv *priv,
+                            const struct shared_file_id *id)
+{
+    const struct shared_key key = {.id = *id, .kind = SHARED_KIND_ETAG};
+    const char *etag;
+    size_t len;
+
+    if (!priv->shared)
+        return false;
+
+    etag = lwan_shm_cache_get(priv->shared, &key, sizeof(key), &len);
+    if (!etag || !len || len > sizeof(ce->etag.opaque))
+        return false;
+
+    memcpy(ce->etag.opaque, etag, len);
+    ce->etag.opaque[len - 1] = '\0';
+    ce->etag.weak = false;
+    return true;
+}
+
+static void put_shared_etag(const struct file_cache_entry *ce,
+                            const struct serve_files_priv *priv,
+                            const struct shared_file_id *id)
+{
+    const struct shared_key key = {.id = *id, .kind = SHARED_KIND_ETAG};
+
+    if (priv->shared && !ce->etag.weak)
+        lwan_shm_cache_put(priv->shared, &key, sizeof(key), ce->etag.opaque,
+                           strlen(ce->etag.opaque) + 1);
+}
+
 static bool mmap_init(struct file_cache_entry *ce,
                       struct serve_files_priv *priv, const char *full_path,
                       struct stat *st);
@@ -231,27 +416,33 @@ static const char *directory_list_tpl_str =
     "</body>\n"
     "</html>\n";
 
+static int directory_list_filter(const struct dirent *entry)
+{
+    return entry->d_name[0] != '.';
+}
+
 static int directory_list_generator(struct coro *coro, void *data)
 {
     struct file_list *fl = data;
-    struct dirent *entry;
-    DIR *dir;
+    struct dirent **entries;
+    int n_entries, i;
     int fd;
 
-    dir = opendir(fl->full_path);
-    if (!dir)
+    fd = open(fl->full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
         return 0;
 
-    fd = dirfd(dir);
-    if (fd < 0)
+    /* Listings are rendered once per cache entry, so sorting them here
+     * costs nothing per request. */
+    n_entries = scandir(fl->full_path, &entries, directory_list_filter,
+                        alphasort);
+    if (n_entries < 0)
         goto out;
 
-    while ((entry = readdir(dir))) {
+    for (i = 0; i < n_entries; i++) {
+        struct dirent *entry = entries[i];
         struct stat st;
 
-        if (entry->d_name[0] == '.')
-            continue;
-
         if (fstatat(fd, entry->d_name, &st, 0) < 0)
             continue;
 
@@ -288,40 +479,495 @@ static int directory_list_generator(struct coro *coro, void *data)
             break;
     }
 
+    for (i = 0; i < n_entries; i++)
+        free(entries[i]);
+    free(entries);
+
 out:
-    closedir(dir);
+    close(fd);
     return 0;
 }
 
 static ALWAYS_INLINE bool is_compression_worthy(const size_t compressed_sz,
                                                 const size_t uncompressed_sz)
 {
-    /* FIXME: gzip encoding is also supported but not considered here */
-    static const size_t deflated_header_size =
+    /* Longest Content-Encoding header we might send */
+    static const size_t encoding_header_size =
         sizeof("Content-Encoding: deflate\r\n") - 1;
-    return ((compressed_sz + deflated_header_size) < uncompressed_sz);
+    return ((compressed_sz + encoding_header_size) < uncompressed_sz);
 }
 
-static void compress_cached_entry(struct mmap_cache_data *md)
+static bool compress_deflate(const void *in, size_t in_len, int level,
+                             void *out, size_t *out_len)
 {
-    md->compressed.size = compressBound(md->uncompressed.size);
+    /* zlib expects unsigned longs instead of size_t */
+    unsigned long len = *out_len;
 
-    if (UNLIKELY(!(md->compressed.contents = malloc(md->compressed.size))))
-        goto error_zero_out;
+    if (compress2(out, &len, in, in_len, level) != Z_OK)
+        return false;
 
-    if (UNLIKELY(compress(md->compressed.contents, &md->compressed.size,
-                          md->uncompressed.contents,
-                          md->uncompressed.size) != Z_OK))
-        goto error_free_compressed;
+    *out_len = len;
+    return true;
+}
+
+static bool compress_gzip(const void *in, size_t in_len, int level,
+                          void *out, size_t *out_len)
+{
+    z_stream stream = {
+        .next_in = (void *)in,
+        .avail_in = (unsigned int)in_len,
+        .next_out = out,
+        .avail_out = (unsigned int)*out_len,
+    };
+    bool success;
+
+    /* Adding 16 to the window bits asks zlib for a gzip wrapper. */
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    success = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+    *out_len = stream.total_out;
+
+    deflateEnd(&stream);
+
+    return success;
+}
+
+#if defined(HAVE_BROTLI)
+static bool compress_brotli(const void *in, size_t in_len, int level,
+                            void *out, size_t *out_len)
+{
+    return BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW,
+                                 BROTLI_DEFAULT_MODE, in_len, in, out_len,
+                                 out) == BROTLI_TRUE;
+}
+
+static size_t brotli_bound(size_t in_len)
+{
+    return BrotliEncoderMaxCompressedSize(in_len);
+}
+#endif
+
+#if defined(HAVE_ZSTD)
+static bool compress_zstd(const void *in, size_t in_len, int level,
+                          void *out, size_t *out_len)
+{
+    size_t len = ZSTD_compress(out, *out_len, in, in_len, level);
+
+    if (ZSTD_isError(len))
+        return false;
+
+    *out_len = len;
+    return true;
+}
+
+static size_t zstd_bound(size_t in_len)
+{
+    return ZSTD_compressBound(in_len);
+}
+#endif
+
+static size_t zlib_bound(size_t in_len)
+{
+    /* Enough for the gzip wrapper as well */
+    return compressBound(in_len) + 18;
+}
+
+static const struct {
+    const char *name;
+    enum lwan_request_flags accept_flag;
+    size_t (*bound)(size_t in_len);
+    bool (*compress)(const void *in, size_t in_len, int level, void *out,
+                     size_t *out_len);
+    int default_level, max_level;
+} encodings[] = {
+    [ENCODING_DEFLATE] = {"deflate", REQUEST_ACCEPT_DEFLATE, zlib_bound,
+                          compress_deflate, 6, 9},
+    [ENCODING_GZIP] = {"gzip", REQUEST_ACCEPT_GZIP, zlib_bound, compress_gzip,
+                       6, 9},
+#if defined(HAVE_BROTLI)
+    [ENCODING_BROTLI] = {"br", REQUEST_ACCEPT_BROTLI, brotli_bound,
+                         compress_brotli, 5, BROTLI_MAX_QUALITY},
+#endif
+#if defined(HAVE_ZSTD)
+    [ENCODING_ZSTD] = {"zstd", REQUEST_ACCEPT_ZSTD, zstd_bound, compress_zstd,
+                       3, 19},
+#endif
+};
+
+/* Order in which encodings are preferred when the client likes them all
+ * the same; better compression ratios go first. */
+static const enum encoding encoding_preference[] = {
+#if defined(HAVE_BROTLI)
+    ENCODING_BROTLI,
+#endif
+#if defined(HAVE_ZSTD)
+    ENCODING_ZSTD,
+#endif
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+};
+
+static void shared_file_id_init(struct shared_file_id *id,
+                                const struct stat *st)
+{
+    *id = (struct shared_file_id){
+        .dev = (uint64_t)st->st_dev,
+        .ino = (uint64_t)st->st_ino,
+        .size = (uint64_t)st->st_size,
+        .mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000ull +
+                    (uint64_t)st->st_mtim.tv_nsec,
+        .ctime_ns = (uint64_t)st->st_ctim.tv_sec * 1000000000ull +
+                    (uint64_t)st->st_ctim.tv_nsec,
+    };
+}
+
+/* Encodings built by another process sharing the cache are used as they
+ * are; encodings that weren't worth it are stored there as empty values. */
+static int get_shared_encoding(struct mmap_cache_data *md,
+                               const struct serve_files_priv *priv,
+                               const struct shared_key *key,
+                               enum encoding encoding)
+{
+    size_t size;
+    const void *contents =
+        lwan_shm_cache_get(priv->shared, key, sizeof(*key), &size);
+
+    if (!contents)
+        return ENCODED_UNKNOWN;
+    if (!size)
+        return ENCODED_UNAVAILABLE;
+
+    md->encoded[encoding].contents = (void *)contents;
+    md->encoded[encoding].size = size;
+    md->encoded[encoding].shared = true;
+    return ENCODED_READY;
+}
+
+/* Files in the compressed store are named after the key, and start with
+ * this header: the checksum catches files left incomplete by a crash.  An
+ * empty file means that the encoding isn't worth it. */
+struct stored_header {
+    char magic[8];
+    uint64_t size;
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+#define STORED_MAGIC "lwanenc1"
+#define STORED_NAME_MAX 192
+
+static void stored_name(char name[static STORED_NAME_MAX],
+                        const struct shared_key *key)
+{
+    snprintf(name, STORED_NAME_MAX,
+             "%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64 ".%s.%d",
+             key->id.dev, key->id.ino, key->id.size, key->id.mtime_ns,
+             key->id.ctime_ns, encodings[key->kind].name, key->level);
+}
+
+static uint32_t stored_crc(const void *contents, size_t size)
+{
+    return (uint32_t)crc32(crc32(0, Z_NULL, 0), contents, (uInt)size);
+}
+
+static int load_stored_encoding(struct mmap_cache_data *md,
+                                const struct serve_files_priv *priv,
+                                const struct shared_key *key,
+                                enum encoding encoding)
+{
+    char name[STORED_NAME_MAX];
+    struct stored_header *header;
+    int state = ENCODED_UNKNOWN;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    stored_name(name, key);
+    fd = openat(priv->store_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return ENCODED_UNKNOWN;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header))
+        goto out;
+
+    header = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (UNLIKELY(header == MAP_FAILED))
+        goto out;
+
+    size = (size_t)st.st_size - sizeof(*header);
+    if (memcmp(header->magic, STORED_MAGIC, sizeof(header->magic)) ||
+        header->size != size || header->crc != stored_crc(header + 1, size)) {
+        lwan_status_debug("Ignoring damaged compressed copy %s", name);
+        munmap(header, (size_t)st.st_size);
+        goto out;
+    }
+
+    if (!size) {
+        munmap(header, (size_t)st.st_size);
+        state = ENCODED_UNAVAILABLE;
+        goto out;
+    }
+
+    md->encoded[encoding].contents = header + 1;
+    md->encoded[encoding].size = size;
+    md->encoded[encoding].mapped = true;
+    state = ENCODED_READY;
+
+out:
+    close(fd);
+    return state;
+}
+
+static bool write_fully(int fd, const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t written = write(fd, buf, len);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        buf = (const char *)buf + written;
+        len -= (size_t)written;
+    }
 
-    if (is_compression_worthy(md->compressed.size, md->uncompressed.size))
+    return true;
+}
+
+/* Written under a temporary name first, so that other processes never
+ * find a partial copy. */
+static void store_encoding(const struct serve_files_priv *priv,
+                           const struct shared_key *key,
+                           const void *contents,
+                           size_t size)
+{
+    static unsigned int counter;
+    struct stored_header header = {
+        .magic = STORED_MAGIC,
+        .size = size,
+        .crc = stored_crc(contents, size),
+    };
+    char name[STORED_NAME_MAX];
+    char tmp_name[STORED_NAME_MAX + 32];
+    int fd;
+
+    stored_name(name, key);
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d-%u.tmp", name, getpid(),
+             ATOMIC_INC(counter));
+
+    fd = openat(priv->store_fd, tmp_name,
+                O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        lwan_status_perror("Could not store compressed copy %s", name);
         return;
+    }
+
+    if (!write_fully(fd, &header, sizeof(header)) ||
+        !write_fully(fd, contents, size)) {
+        lwan_status_perror("Could not store compressed copy %s", name);
+        goto remove;
+    }
+
+    close(fd);
+    if (renameat(priv->store_fd, tmp_name, priv->store_fd, name) < 0) {
+        lwan_status_perror("Could not store compressed copy %s", name);
+        unlinkat(priv->store_fd, tmp_name, 0);
+    }
+    return;
+
+remove:
+    close(fd);
+    unlinkat(priv->store_fd, tmp_name, 0);
+}
+
+static int compress_cached_entry(struct mmap_cache_data *md,
+                                 const struct serve_files_priv *priv,
+                                 enum encoding encoding)
+{
+    bool shareable = priv->shared && md->shareable;
+    bool storable = priv->store_fd >= 0 && md->shareable;
+    const struct shared_key key = {.id = md->id,
+                                   .kind = (uint32_t)encoding,
+                                   .level = priv->levels[encoding]};
+    size_t size;
+    void *contents;
+    int state;
+
+    if (shareable) {
+        state = get_shared_encoding(md, priv, &key, encoding);
+        if (state != ENCODED_UNKNOWN)
+            return state;
+    }
+    if (storable) {
+        state = load_stored_encoding(md, priv, &key, encoding);
+        if (state != ENCODED_UNKNOWN)
+            return state;
+    }
+
+    size = encodings[encoding].bound(md->uncompressed.size);
+    contents = malloc(size);
+    if (UNLIKELY(!contents))
+        return ENCODED_UNAVAILABLE;
+
+    if (UNLIKELY(!encodings[encoding].compress(md->uncompressed.contents,
+                                               md->uncompressed.size,
+                                               priv->levels[encoding],
+                                               contents, &size)))
+        goto error_free_compressed;
+
+    if (!is_compression_worthy(size, md->uncompressed.size)) {
+        if (shareable)
+            lwan_shm_cache_put(priv->shared, &key, sizeof(key), "", 0);
+        if (storable)
+            store_encoding(priv, &key, "", 0);
+        goto error_free_compressed;
+    }
+
+    if (storable)
+        store_encoding(priv, &key, contents, size);
+
+    if (shareable) {
+        const void *shared =
+            lwan_shm_cache_put(priv->shared, &key, sizeof(key), contents, size);
+
+        if (shared) {
+            free(contents);
+            md->encoded[encoding].contents = (void *)shared;
+            md->encoded[encoding].size = size;
+            md->encoded[encoding].shared = true;
+            return ENCODED_READY;
+        }
+    }
+
+    /* Bounds are usually quite a bit larger than what's needed; files
+     * served this way are small, so copying is cheap. */
+    md->encoded[encoding].contents = malloc(size);
+    if (LIKELY(md->encoded[encoding].contents)) {
+        memcpy(md->encoded[encoding].contents, contents, size);
+        free(contents);
+    } else {
+        md->encoded[encoding].contents = contents;
+    }
+    md->encoded[encoding].size = size;
+
+    return ENCODED_READY;
 
 error_free_compressed:
-    free(md->compressed.contents);
-    md->compressed.contents = NULL;
-error_zero_out:
-    md->compressed.size = 0;
+    free(contents);
+    return ENCODED_UNAVAILABLE;
+}
+
+/* Returns true if the encoding is ready to be served.  Whoever gets to
+ * flip the state from unknown compresses the file, in the calling thread;
+ * other requests skip that encoding until it's done. */
+static bool ensure_encoded(struct mmap_cache_data *md,
+                           struct serve_files_priv *priv,
+                           const char *key,
+                           struct file_cache_entry *fce,
+                           enum encoding encoding)
+{
+    int *state = &md->encoded[encoding].state;
+
+    switch (ATOMIC_READ(*state)) {
+    case ENCODED_READY:
+        /* Pairs with the barrier before the state is published. */
+        __sync_synchronize();
+        return true;
+    case ENCODED_UNKNOWN:
+        if (__sync_bool_compare_and_swap(state, ENCODED_UNKNOWN,
+                                         ENCODED_BUILDING))
+            break;
+        /* fallthrough */
+    default:
+        return false;
+    }
+
+    int new_state = compress_cached_entry(md, priv, encoding);
+
+    __sync_synchronize();
+    ATOMIC_READ(*state) = new_state;
+
+    if (new_state != ENCODED_READY)
+        return false;
+
+    /* Shared encodings don't count against the limits of this process. */
+    if (!md->encoded[encoding].shared)
+        cache_entry_add_size(priv->cache, &fce->base, key,
+                             md->encoded[encoding].size);
+    return true;
+}
+
+/* Picks the encoding the client likes the most among the ones that could
+ * be built; returns N_ENCODINGS if the file should be sent as is. */
+static enum encoding choose_encoding(struct mmap_cache_data *md,
+                                     struct serve_files_priv *priv,
+                                     struct lwan_request *request,
+                                     struct file_cache_entry *fce)
+{
+    int qvalues[N_ENCODINGS];
+
+    for (size_t i = 0; i < N_ENCODINGS; i++) {
+        if (ATOMIC_READ(md->encoded[i].state) == ENCODED_UNAVAILABLE)
+            qvalues[i] = 0;
+        else
+            qvalues[i] = lwan_request_get_accept_encoding_qvalue(
+                request, encodings[i].accept_flag);
+    }
+
+    while (true) {
+        enum encoding best = N_ENCODINGS;
+
+        for (size_t i = 0; i < N_ELEMENTS(encoding_preference); i++) {
+            enum encoding encoding = encoding_preference[i];
+
+            if (!qvalues[encoding])
+                continue;
+            if (best == N_ENCODINGS || qvalues[encoding] > qvalues[best])
+                best = encoding;
+        }
+
+        if (best == N_ENCODINGS || ensure_encoded(md, priv, request->url.value, fce,
+                                                  best))
+            return best;
+
+        qvalues[best] = 0;
+    }
+}
+
+static void set_etag_from_contents(struct file_cache_entry *ce,
+                                   const void *contents, size_t size)
+{
+    unsigned long crc = crc32(0, contents, (unsigned int)size);
+    unsigned long adler = adler32(1, contents, (unsigned int)size);
+
+    snprintf(ce->etag.opaque, sizeof(ce->etag.opaque), "%zx-%08lx%08lx", size,
+             crc, adler);
+    ce->etag.weak = false;
+}
+
+static void set_etag_from_file(struct file_cache_entry *ce, int fd,
+                               const struct stat *st)
+{
+    size_t size = (size_t)st->st_size;
+
+    if (size && size <= ETAG_MAX_HASHED_SIZE) {
+        void *contents =
+            mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+
+        if (LIKELY(contents != MAP_FAILED)) {
+            set_etag_from_contents(ce, contents, size);
+            munmap(contents, size);
+            return;
+        }
+    }
+
+    snprintf(ce->etag.opaque, sizeof(ce->etag.opaque), "%zx-%llx", size,
+             (unsigned long long)st->st_mtime);
+    ce->etag.weak = true;
 }
 
 static bool mmap_init(struct file_cache_entry *ce,
@@ -339,19 +985,33 @@ static bool mmap_init(struct file_cache_entry *ce,
     if (UNLIKELY(file_fd < 0))
         return false;
 
+    /* These are small, and are about to be hashed anyway: fault all of the
+     * pages in with a single system call rather than one at a time. */
     md->uncompressed.contents =
-        mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+        mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+             file_fd, 0);
     if (UNLIKELY(md->uncompressed.contents == MAP_FAILED)) {
         success = false;
         goto close_file;
     }
 
-    if (UNLIKELY(madvise(md->uncompressed.contents, (size_t)st->st_size,
-                         MADV_WILLNEED) < 0))
+    if (!MAP_POPULATE && UNLIKELY(madvise(md->uncompressed.contents,
+                                          (size_t)st->st_size,
+                                          MADV_WILLNEED) < 0))
         lwan_status_perror("madvise");
 
     md->uncompressed.size = (size_t)st->st_size;
-    compress_cached_entry(md);
+    memset(md->encoded, 0, sizeof(md->encoded));
+    md->shareable = true;
+    shared_file_id_init(&md->id, st);
+
+    if (!get_shared_etag(ce, priv, &md->id)) {
+        set_etag_from_contents(ce, md->uncompressed.contents,
+                               md->uncompressed.size);
+        put_shared_etag(ce, priv, &md->id);
+    }
+
+    ce->base.size += md->uncompressed.size;
 
     ce->mime_type =
         lwan_determine_mime_type_for_file_name(full_path + priv->root_path_len);
@@ -371,21 +1031,33 @@ static bool is_world_readable(mode_t mode)
     return (mode & world_readable) == world_readable;
 }
 
+static void prepare_for_sendfile(int fd, size_t size)
+{
+    /* Doubles the readahead window for the whole file.  Only the beginning
+     * is read right away; whatever isn't requested stays out of the page
+     * cache. */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, 0,
+              size < SENDFILE_READAHEAD_SIZE ? size : SENDFILE_READAHEAD_SIZE);
+}
+
 static int try_open_compressed(const char *relpath,
                                const struct serve_files_priv *priv,
                                const struct stat *uncompressed,
+                               const char *suffix,
                                size_t *compressed_sz)
 {
-    char gzpath[PATH_MAX];
+    char path[PATH_MAX];
     struct stat st;
     int ret, fd;
 
-    /* Try to serve a compressed file using sendfile() if $FILENAME.gz exists */
-    ret = snprintf(gzpath, PATH_MAX, "%s.gz", relpath + 1);
+    /* Try to serve a compressed file using sendfile() if, for instance,
+     * $FILENAME.gz exists */
+    ret = snprintf(path, PATH_MAX, "%s%s", relpath + 1, suffix);
     if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
         goto out;
 
-    fd = openat(priv->root_fd, gzpath, open_mode);
+    fd = openat(priv->root_fd, path, open_mode);
     if (UNLIKELY(fd < 0))
         goto out;
 
@@ -403,7 +1075,7 @@ static int try_open_compressed(const char *relpath,
                                      (size_t)uncompressed->st_size))) {
         *compressed_sz = (size_t)st.st_size;
 
-        readahead(fd, 0, *compressed_sz);
+        prepare_for_sendfile(fd, *compressed_sz);
 
         return fd;
     }
@@ -424,6 +1096,11 @@ static bool sendfile_init(struct file_cache_entry *ce,
 
     ce->mime_type = lwan_determine_mime_type_for_file_name(relpath);
 
+    for (int i = 0; i < N_PRECOMPRESSED; i++) {
+        sd->compressed[i].fd = -ENOENT;
+        sd->compressed[i].size = 0;
+    }
+
     sd->uncompressed.fd = openat(priv->root_fd, relpath + 1, open_mode);
     if (UNLIKELY(sd->uncompressed.fd < 0)) {
         switch (errno) {
@@ -432,8 +1109,8 @@ static bool sendfile_init(struct file_cache_entry *ce,
         case EACCES:
             /* These errors should produce responses other than 404, so
              * store errno as the file descriptor.  */
-            sd->uncompressed.fd = sd->compressed.fd = -errno;
-            sd->compressed.size = sd->uncompressed.size = 0;
+            sd->uncompressed.fd = -errno;
+            sd->uncompressed.size = 0;
 
             return true;
         }
@@ -441,17 +1118,25 @@ static bool sendfile_init(struct file_cache_entry *ce,
         return false;
     }
 
-    /* If precompressed files can be served, try opening it */
+    /* If precompressed files can be served, try opening them; whatever is
+     * found here is kept open for as long as the entry is cached. */
     if (LIKELY(priv->serve_precompressed_files)) {
-        size_t compressed_sz;
-        int fd = try_open_compressed(relpath, priv, st, &compressed_sz);
-
-        sd->compressed.fd = fd;
-        sd->compressed.size = compressed_sz;
+        for (int i = 0; i < N_PRECOMPRESSED; i++) {
+            sd->compressed[i].fd =
+                try_open_compressed(relpath, priv, st, precompressed[i].suffix,
+                                    &sd->compressed[i].size);
+        }
     }
 
     sd->uncompressed.size = (size_t)st->st_size;
-    readahead(sd->uncompressed.fd, 0, sd->uncompressed.size);
+    prepare_for_sendfile(sd->uncompressed.fd, sd->uncompressed.size);
+
+    struct shared_file_id id;
+    shared_file_id_init(&id, st);
+    if (!get_shared_etag(ce, priv, &id)) {
+        set_etag_from_file(ce, sd->uncompressed.fd, st);
+        put_shared_etag(ce, priv, &id);
+    }
 
     return true;
 }
@@ -485,9 +1170,18 @@ static bool dirlist_init(struct file_cache_entry *ce,
                              .rel_path = get_rel_path(full_path, priv)};
 
     dd->rendered = lwan_tpl_apply(priv->directory_list_tpl, &vars);
+    if (UNLIKELY(!dd->rendered))
+        return false;
+
+    dd->md.uncompressed.contents = lwan_strbuf_get_buffer(dd->rendered);
+    dd->md.uncompressed.size = lwan_strbuf_get_length(dd->rendered);
+    memset(dd->md.encoded, 0, sizeof(dd->md.encoded));
+    dd->md.shareable = false;
+
     ce->mime_type = "text/html";
+    ce->base.size += dd->md.uncompressed.size;
 
-    return !!dd->rendered;
+    return true;
 }
 
 static bool redir_init(struct file_cache_entry *ce,
@@ -496,9 +1190,12 @@ static bool redir_init(struct file_cache_entry *ce,
 {
     struct redir_cache_data *rd = (struct redir_cache_data *)(ce + 1);
 
-    if (asprintf(&rd->redir_to, "%s/", full_path + priv->root_path_len) < 0)
+    int len = asprintf(&rd->redir_to, "%s/", full_path + priv->root_path_len);
+    if (len < 0)
         return false;
 
+    ce->base.size += (size_t)len + 1;
+
     ce->mime_type = "text/plain";
     return true;
 }
@@ -579,11 +1276,17 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
                               const struct cache_funcs *funcs)
 {
     struct file_cache_entry *fce;
+    size_t path_len = strlen(full_path);
 
-    fce = malloc(sizeof(*fce) + funcs->struct_size);
+    fce = malloc(sizeof(*fce) + funcs->struct_size + path_len + 1);
     if (UNLIKELY(!fce))
         return NULL;
 
+    fce->base.size = sizeof(*fce) + funcs->struct_size + path_len + 1;
+    fce->path = memcpy((char *)(fce + 1) + funcs->struct_size, full_path,
+                       path_len + 1);
+    fce->etag.opaque[0] = '\0';
+
     if (LIKELY(funcs->init(fce, priv, full_path, st))) {
         fce->funcs = funcs;
         return fce;
@@ -597,6 +1300,27 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
     return create_cache_entry_from_funcs(priv, full_path, st, &sendfile_funcs);
 }
 
+/* Compresses everything that would otherwise be compressed by the first
+ * requests for a file, for entries created from a cache manifest. */
+static void warm_cache_entry(struct cache_entry *entry,
+                             const char *key,
+                             void *context)
+{
+    struct file_cache_entry *fce = (struct file_cache_entry *)entry;
+    struct serve_files_priv *priv = context;
+    struct mmap_cache_data *md;
+
+    if (fce->funcs == &mmap_funcs)
+        md = (struct mmap_cache_data *)(fce + 1);
+    else if (fce->funcs == &dirlist_funcs)
+        md = &((struct dir_list_cache_data *)(fce + 1))->md;
+    else
+        return;
+
+    for (size_t i = 0; i < N_ELEMENTS(encoding_preference); i++)
+        ensure_encoded(md, priv, key, fce, encoding_preference[i]);
+}
+
 static void destroy_cache_entry(struct cache_entry *entry,
                                 void *context __attribute__((unused)))
 {
@@ -606,23 +1330,215 @@ static void destroy_cache_entry(struct cache_entry *entry,
     free(fce);
 }
 
-static struct cache_entry *create_cache_entry(const char *key, void *context)
+enum resolution { RESOLVED, NOT_RESOLVED, RESOLVE_WITH_REALPATHAT };
+
+#if defined(HAVE_LINUX_OPENAT2_H) && defined(SYS_openat2)
+/* True if the path has no empty, "." or ".." components: then, if there
+ * are no symbolic links in the way either, it's canonical already. */
+static bool is_canonical_path(const char *path, size_t len)
 {
-    struct serve_files_priv *priv = context;
-    struct file_cache_entry *fce;
-    struct stat st;
-    const struct cache_funcs *funcs;
-    char full_path[PATH_MAX];
+    const char *end = path + len;
 
-    if (UNLIKELY(
-            !realpathat2(priv->root_fd, priv->root_path, key, full_path, &st)))
-        return NULL;
+    while (path < end) {
+        const char *slash = memchr(path, '/', (size_t)(end - path));
+        size_t component_len = (size_t)((slash ? slash : end) - path);
 
-    if (UNLIKELY(!is_world_readable(st.st_mode)))
-        return NULL;
+        if (component_len == 0)
+            return false;
+        if (path[0] == '.' &&
+            (component_len == 1 || (component_len == 2 && path[1] == '.')))
+            return false;
 
-    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len)))
-        return NULL;
+        path += component_len + 1;
+    }
+
+    return true;
+}
+
+/* Looks up a file with a single openat2() call, instead of the lstat() per
+ * path component made by realpathat2().  The kernel refuses to go past the
+ * root directory or to follow symbolic links; paths that have those (or
+ * that aren't canonical), and kernels without openat2(), are left for
+ * realpathat2() to figure out. */
+static enum resolution resolve_beneath_root(const struct serve_files_priv *priv,
+                                            const char *key,
+                                            char full_path[static PATH_MAX],
+                                            struct stat *st)
+{
+    static bool unsupported;
+    struct open_how how = {
+        .flags = O_PATH | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+    };
+    size_t key_len = strlen(key);
+    size_t root_len = priv->root_path_len;
+    int fd, ret;
+
+    if (UNLIKELY(ATOMIC_READ(unsupported)))
+        return RESOLVE_WITH_REALPATHAT;
+
+    /* The trailing slash is kept for the lookup, so that it fails for
+     * anything but directories, but, like with realpath(), it's not part
+     * of the resolved path. */
+    if (key_len && key[key_len - 1] == '/')
+        key_len--;
+    if (!is_canonical_path(key, key_len))
+        return RESOLVE_WITH_REALPATHAT;
+
+    if (root_len == 1 && key_len)
+        root_len = 0; /* Serving from "/": don't double the slash. */
+    if (UNLIKELY(root_len + 1 + key_len >= PATH_MAX)) {
+        errno = ENAMETOOLONG;
+        return NOT_RESOLVED;
+    }
+
+    memcpy(full_path, priv->root_path, root_len);
+    if (key_len) {
+        full_path[root_len] = '/';
+        memcpy(full_path + root_len + 1, key, key_len);
+        full_path[root_len + 1 + key_len] = '\0';
+    } else {
+        full_path[root_len] = '\0';
+    }
+
+    fd = (int)syscall(SYS_openat2, priv->root_fd, *key ? key : ".", &how,
+                      sizeof(how));
+    if (UNLIKELY(fd < 0)) {
+        switch (errno) {
+        case ENOSYS:
+        case EPERM:
+            /* Not supported (or blocked by seccomp): don't try again. */
+            ATOMIC_READ(unsupported) = true;
+            return RESOLVE_WITH_REALPATHAT;
+        case ELOOP:
+        case EXDEV:
+            /* There's a symbolic link somewhere in the path. */
+            return RESOLVE_WITH_REALPATHAT;
+        default:
+            return NOT_RESOLVED;
+        }
+    }
+
+    ret = fstat(fd, st);
+    close(fd);
+
+    return ret < 0 ? NOT_RESOLVED : RESOLVED;
+}
+#else
+static enum resolution
+resolve_beneath_root(const struct serve_files_priv *priv __attribute__((unused)),
+                     const char *key __attribute__((unused)),
+                     char full_path[static PATH_MAX] __attribute__((unused)),
+                     struct stat *st __attribute__((unused)))
+{
+    return RESOLVE_WITH_REALPATHAT;
+}
+#endif
+
+static struct not_found_cache *not_found_cache_new(size_t size, time_t ttl)
+{
+    struct not_found_cache *nf;
+    size_t n_entries = 1;
+
+    while (n_entries < size && n_entries < (1u << 20))
+        n_entries <<= 1;
+
+    nf = calloc(1, sizeof(*nf) + n_entries * sizeof(nf->entries[0]));
+    if (!nf)
+        return NULL;
+
+    if (pthread_mutex_init(&nf->lock, NULL)) {
+        free(nf);
+        return NULL;
+    }
+
+    nf->ttl = ttl;
+    nf->mask = (unsigned int)n_entries - 1;
+    return nf;
+}
+
+static void not_found_cache_free(struct not_found_cache *nf)
+{
+    if (!nf)
+        return;
+
+    for (unsigned int i = 0; i <= nf->mask; i++)
+        free(nf->entries[i].key);
+    pthread_mutex_destroy(&nf->lock);
+    free(nf);
+}
+
+static bool not_found_cache_has(struct not_found_cache *nf, const char *key)
+{
+    const struct not_found_entry *entry =
+        &nf->entries[murmur3_simple(key) & nf->mask];
+    bool found;
+
+    pthread_mutex_lock(&nf->lock);
+    found = entry->key && entry->generation == nf->generation &&
+            entry->time_to_die > lwan_clock_get()->monotonic &&
+            streq(entry->key, key);
+    pthread_mutex_unlock(&nf->lock);
+
+    return found;
+}
+
+static void not_found_cache_add(struct not_found_cache *nf, const char *key)
+{
+    struct not_found_entry *entry =
+        &nf->entries[murmur3_simple(key) & nf->mask];
+    char *key_copy = strdup(key);
+    char *old_key;
+
+    if (UNLIKELY(!key_copy))
+        return;
+
+    pthread_mutex_lock(&nf->lock);
+    old_key = entry->key;
+    entry->key = key_copy;
+    entry->time_to_die = lwan_clock_get()->monotonic + nf->ttl;
+    entry->generation = nf->generation;
+    pthread_mutex_unlock(&nf->lock);
+
+    free(old_key);
+}
+
+/* Forgets everything: a path that wasn't found might lead to a file now. */
+static void not_found_cache_flush(struct not_found_cache *nf)
+{
+    pthread_mutex_lock(&nf->lock);
+    nf->generation++;
+    pthread_mutex_unlock(&nf->lock);
+}
+
+static struct cache_entry *create_cache_entry(const char *key, void *context)
+{
+    struct serve_files_priv *priv = context;
+    struct file_cache_entry *fce;
+    struct stat st;
+    const struct cache_funcs *funcs;
+    char full_path[PATH_MAX];
+
+    if (priv->not_found && not_found_cache_has(priv->not_found, key))
+        return NULL;
+
+    switch (resolve_beneath_root(priv, key, full_path, &st)) {
+    case RESOLVED:
+        break;
+    case NOT_RESOLVED:
+        goto not_found;
+    case RESOLVE_WITH_REALPATHAT:
+        if (UNLIKELY(!realpathat2(priv->root_fd, priv->root_path, key,
+                                  full_path, &st)))
+            goto not_found;
+        break;
+    }
+
+    if (UNLIKELY(!is_world_readable(st.st_mode)))
+        return NULL;
+
+    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len)))
+        return NULL;
 
     funcs = get_funcs(priv, key, full_path, &st);
     if (UNLIKELY(!funcs))
@@ -640,6 +1556,25 @@ static struct cache_entry *create_cache_entry(const char *key, void *context)
     fce->last_modified.integer = st.st_mtime;
 
     return (struct cache_entry *)fce;
+
+not_found:
+    /* Other errors, such as running out of file descriptors, don't say
+     * anything about the path. */
+    if (priv->not_found && (errno == ENOENT || errno == ENOTDIR))
+        not_found_cache_add(priv->not_found, key);
+    return NULL;
+}
+
+static void free_encoded(struct mmap_cache_data *md)
+{
+    for (int i = 0; i < N_ENCODINGS; i++) {
+        if (md->encoded[i].mapped) {
+            munmap((struct stored_header *)md->encoded[i].contents - 1,
+                   sizeof(struct stored_header) + md->encoded[i].size);
+        } else if (!md->encoded[i].shared) {
+            free(md->encoded[i].contents);
+        }
+    }
 }
 
 static void mmap_free(void *data)
@@ -647,15 +1582,17 @@ static void mmap_free(void *data)
     struct mmap_cache_data *md = data;
 
     munmap(md->uncompressed.contents, md->uncompressed.size);
-    free(md->compressed.contents);
+    free_encoded(md);
 }
 
 static void sendfile_free(void *data)
 {
     struct sendfile_cache_data *sd = data;
 
-    if (sd->compressed.fd >= 0)
-        close(sd->compressed.fd);
+    for (int i = 0; i < N_PRECOMPRESSED; i++) {
+        if (sd->compressed[i].fd >= 0)
+            close(sd->compressed[i].fd);
+    }
     if (sd->uncompressed.fd >= 0)
         close(sd->uncompressed.fd);
 }
@@ -664,6 +1601,7 @@ static void dirlist_free(void *data)
 {
     struct dir_list_cache_data *dd = data;
 
+    free_encoded(&dd->md);
     lwan_strbuf_free(dd->rendered);
 }
 
@@ -674,6 +1612,317 @@ static void redir_free(void *data)
     free(rd->redir_to);
 }
 
+#if defined(HAS_INOTIFY)
+#define WATCH_MASK                                                             \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |      \
+     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* How often changes are looked for, in milliseconds */
+#define WATCH_INTERVAL_MS 100
+
+struct changes {
+    /* Paths that changed, and the directories they're in */
+    struct hash *paths;
+    /* Directories that changed as a whole (e.g. moved) */
+    struct hash *subtrees;
+    /* Something was created or moved in */
+    bool created;
+    bool everything;
+};
+
+static int join_path(char buf[static PATH_MAX], const char *dir,
+                     const char *name, size_t name_len)
+{
+    size_t dir_len = strlen(dir);
+    int ret;
+
+    if (dir_len && dir[dir_len - 1] == '/')
+        dir_len--;
+
+    ret = snprintf(buf, PATH_MAX, "%.*s/%.*s", (int)dir_len, dir,
+                   (int)name_len, name);
+    return (ret < 0 || ret >= PATH_MAX) ? -1 : ret;
+}
+
+static void watch_tree(struct serve_files_priv *priv, const char *path)
+{
+    struct dirent *ent;
+    char *path_copy;
+    DIR *dir;
+    int wd;
+
+    wd = inotify_add_watch(priv->watch.fd, path, WATCH_MASK);
+    if (UNLIKELY(wd < 0)) {
+        lwan_status_perror("Could not watch %s for changes", path);
+        return;
+    }
+
+    path_copy = strdup(path);
+    if (UNLIKELY(!path_copy) ||
+        hash_add(priv->watch.dirs, (void *)(intptr_t)wd, path_copy)) {
+        free(path_copy);
+        inotify_rm_watch(priv->watch.fd, wd);
+        return;
+    }
+
+    dir = opendir(path);
+    if (UNLIKELY(!dir))
+        return;
+
+    while ((ent = readdir(dir))) {
+        char child[PATH_MAX];
+
+        if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+            continue;
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        if (join_path(child, path, ent->d_name, strlen(ent->d_name)) < 0)
+            continue;
+
+        /* inotify_add_watch() fails for anything that isn't a directory,
+         * thanks to IN_ONLYDIR, and won't follow symlinks either. */
+        watch_tree(priv, child);
+    }
+
+    closedir(dir);
+}
+
+static bool watch_start(struct serve_files_priv *priv)
+{
+    priv->watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (priv->watch.fd < 0)
+        return false;
+
+    priv->watch.dirs = hash_int_new(NULL, free);
+    if (!priv->watch.dirs) {
+        close(priv->watch.fd);
+        priv->watch.fd = -1;
+        return false;
+    }
+
+    watch_tree(priv, priv->root_path);
+
+    return true;
+}
+
+static void watch_stop(struct serve_files_priv *priv)
+{
+    if (priv->watch.fd < 0)
+        return;
+
+    close(priv->watch.fd);
+    hash_free(priv->watch.dirs);
+    priv->watch.fd = -1;
+}
+
+static bool add_change(struct hash *set, const char *path, size_t len)
+{
+    char *copy = strndup(path, len);
+
+    if (UNLIKELY(!copy))
+        return false;
+    /* Either it's already there, or the hash table couldn't take it */
+    if (hash_add_unique(set, copy, copy))
+        free(copy);
+
+    return true;
+}
+
+static void add_path_change(struct changes *changes, const char *path,
+                            size_t len)
+{
+    const char *slash = memrchr(path, '/', len);
+
+    if (!add_change(changes->paths, path, len))
+        goto everything;
+
+    /* Directory listings include this file. */
+    if (slash && !add_change(changes->paths, path, (size_t)(slash - path)))
+        goto everything;
+
+    /* Precompressed siblings are kept open by the entry for the file. */
+    for (int i = 0; i < N_PRECOMPRESSED; i++) {
+        size_t suffix_len = strlen(precompressed[i].suffix);
+
+        if (len > suffix_len &&
+            !strcmp(path + len - suffix_len, precompressed[i].suffix)) {
+            if (!add_change(changes->paths, path, len - suffix_len))
+                goto everything;
+            break;
+        }
+    }
+
+    return;
+
+everything:
+    changes->everything = true;
+}
+
+static void unwatch_tree(struct serve_files_priv *priv, const char *path,
+                         size_t len)
+{
+    struct hash_iter iter;
+    const void *key, *value;
+    int *wds;
+    unsigned n_wds = 0;
+
+    wds = malloc(hash_get_count(priv->watch.dirs) * sizeof(*wds));
+    if (UNLIKELY(!wds))
+        return;
+
+    hash_iter_init(priv->watch.dirs, &iter);
+    while (hash_iter_next(&iter, &key, &value)) {
+        const char *dir = value;
+
+        if (!strncmp(dir, path, len) && (dir[len] == '/' || !dir[len]))
+            wds[n_wds++] = (int)(intptr_t)key;
+    }
+
+    for (unsigned i = 0; i < n_wds; i++) {
+        inotify_rm_watch(priv->watch.fd, wds[i]);
+        hash_del(priv->watch.dirs, (void *)(intptr_t)wds[i]);
+    }
+
+    free(wds);
+}
+
+static void handle_watch_event(struct serve_files_priv *priv,
+                               struct changes *changes,
+                               const struct inotify_event *event)
+{
+    const char *dir;
+    char path[PATH_MAX];
+    int len;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        /* Events were lost; start over. */
+        changes->everything = true;
+        return;
+    }
+
+    if (event->mask & IN_IGNORED) {
+        hash_del(priv->watch.dirs, (void *)(intptr_t)event->wd);
+        return;
+    }
+
+    dir = hash_find(priv->watch.dirs, (void *)(intptr_t)event->wd);
+    if (UNLIKELY(!dir))
+        return;
+
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        /* Only matters for the root directory; everything else is handled
+         * by the events on the directory it's in. */
+        if (streq(dir, priv->root_path))
+            changes->everything = true;
+        return;
+    }
+
+    if (!event->len)
+        return;
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        changes->created = true;
+
+    len = join_path(path, dir, event->name, strlen(event->name));
+    if (UNLIKELY(len < 0))
+        return;
+
+    add_path_change(changes, path, (size_t)len);
+
+    if (event->mask & IN_ISDIR) {
+        if (!add_change(changes->subtrees, path, (size_t)len))
+            changes->everything = true;
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            watch_tree(priv, path);
+        else if (event->mask & IN_MOVED_FROM)
+            unwatch_tree(priv, path, (size_t)len);
+    }
+}
+
+static bool is_entry_stale(const struct cache_entry *entry, void *data)
+{
+    const struct file_cache_entry *fce =
+        (const struct file_cache_entry *)entry;
+    const struct changes *changes = data;
+    char path[PATH_MAX];
+    char *slash;
+
+    if (changes->everything)
+        return true;
+
+    if (hash_find(changes->paths, fce->path))
+        return true;
+
+    if (!hash_get_count(changes->subtrees))
+        return false;
+
+    strncpy(path, fce->path, PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
+    while ((slash = strrchr(path, '/'))) {
+        *slash = '\0';
+        if (hash_find(changes->subtrees, path))
+            return true;
+    }
+
+    return false;
+}
+
+static bool watch_job(void *data)
+{
+    struct serve_files_priv *priv = data;
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct changes changes = {};
+    ssize_t r;
+
+    while ((r = read(priv->watch.fd, buffer, sizeof(buffer))) > 0) {
+        const struct inotify_event *event;
+
+        if (!changes.paths) {
+            changes.paths = hash_str_new(free, NULL);
+            changes.subtrees = hash_str_new(free, NULL);
+            if (UNLIKELY(!changes.paths || !changes.subtrees))
+                changes.everything = true;
+        }
+
+        for (char *p = buffer; p < buffer + r;
+             p += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)p;
+
+            if (LIKELY(!changes.everything))
+                handle_watch_event(priv, &changes, event);
+        }
+    }
+
+    if (!changes.paths && !changes.everything)
+        return false;
+
+    if (priv->not_found && (changes.created || changes.everything))
+        not_found_cache_flush(priv->not_found);
+
+    if (changes.everything) {
+        /* Watches might not match what's on disk anymore either. */
+        watch_stop(priv);
+        if (!watch_start(priv))
+            lwan_status_perror("Could not watch %s for changes anymore",
+                               priv->root_path);
+    }
+
+    unsigned invalidated __attribute__((unused)) =
+        cache_invalidate_matching(priv->cache, is_entry_stale, &changes);
+    lwan_status_debug("%s changed, %u cached files invalidated",
+                      priv->root_path, invalidated);
+
+    if (changes.paths)
+        hash_free(changes.paths);
+    if (changes.subtrees)
+        hash_free(changes.subtrees);
+
+    return true;
+}
+#endif
+
 static void *serve_files_create(const char *prefix, void *args)
 {
     struct lwan_serve_files_settings *settings = args;
@@ -705,12 +1954,51 @@ static void *serve_files_create(const char *prefix, void *args)
         goto out_malloc;
     }
 
-    priv->cache =
-        cache_create(create_cache_entry, destroy_cache_entry, priv, 5);
+    priv->cache = cache_create(create_cache_entry, destroy_cache_entry, priv,
+                               settings->cache_ttl ? settings->cache_ttl : 5);
     if (!priv->cache) {
         lwan_status_error("Couldn't create cache");
         goto out_cache_create;
     }
+    cache_set_limits(priv->cache, settings->cache_max_entries,
+                     settings->cache_max_size);
+    if (settings->cache_async && !cache_set_async(priv->cache))
+        lwan_status_warning("Couldn't start cache workers, "
+                            "files will be opened by I/O threads");
+
+    priv->store_fd = -1;
+    if (settings->compressed_store) {
+        if (mkdir(settings->compressed_store, 0755) < 0 && errno != EEXIST) {
+            lwan_status_perror("Could not create %s",
+                               settings->compressed_store);
+        }
+
+        priv->store_fd = open(settings->compressed_store,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (priv->store_fd < 0)
+            lwan_status_perror("Compressed files won't be stored in %s",
+                               settings->compressed_store);
+    }
+
+    priv->not_found = NULL;
+    if (settings->not_found_cache_size) {
+        priv->not_found = not_found_cache_new(
+            settings->not_found_cache_size,
+            settings->cache_ttl ? settings->cache_ttl : 5);
+        if (!priv->not_found)
+            lwan_status_warning("Paths that aren't found won't be remembered");
+    }
+
+    priv->shared = NULL;
+    if (settings->shared_cache) {
+        priv->shared = lwan_shm_cache_open(settings->shared_cache,
+                                           settings->shared_cache_size
+                                               ? settings->shared_cache_size
+                                               : DEFAULT_SHARED_CACHE_SIZE);
+        if (!priv->shared)
+            lwan_status_warning("Compressed files won't be shared with "
+                                "other processes");
+    }
 
     if (settings->directory_list_template) {
         priv->directory_list_tpl = lwan_tpl_compile_file(
@@ -739,11 +2027,58 @@ static void *serve_files_create(const char *prefix, void *args)
     priv->serve_precompressed_files = settings->serve_precompressed_files;
     priv->auto_index = settings->auto_index;
 
+    priv->levels[ENCODING_DEFLATE] = settings->gzip_level;
+    priv->levels[ENCODING_GZIP] = settings->gzip_level;
+#if defined(HAVE_BROTLI)
+    priv->levels[ENCODING_BROTLI] = settings->brotli_level;
+#endif
+#if defined(HAVE_ZSTD)
+    priv->levels[ENCODING_ZSTD] = settings->zstd_level;
+#endif
+    for (int i = 0; i < N_ENCODINGS; i++) {
+        if (priv->levels[i] <= 0) {
+            priv->levels[i] = encodings[i].default_level;
+        } else if (priv->levels[i] > encodings[i].max_level) {
+            lwan_status_warning("Compression level for %s is too high, "
+                                "using %d instead",
+                                encodings[i].name, encodings[i].max_level);
+            priv->levels[i] = encodings[i].max_level;
+        }
+    }
+
+    if (settings->cache_manifest) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        cache_warm_up(priv->cache, settings->cache_manifest,
+                      n_cpus > 0 ? (unsigned int)n_cpus : 1, warm_cache_entry);
+        if (!cache_set_manifest(priv->cache, settings->cache_manifest))
+            lwan_status_warning("Could not set cache manifest");
+    }
+
+#if defined(HAS_INOTIFY)
+    priv->watch.fd = -1;
+    if (settings->watch_files) {
+        if (watch_start(priv))
+            lwan_job_add_full(watch_job, priv, WATCH_INTERVAL_MS,
+                              LWAN_JOB_PRIORITY_HIGH);
+        else
+            lwan_status_perror("Could not watch %s for changes",
+                               canonical_root);
+    }
+#else
+    if (settings->watch_files)
+        lwan_status_warning("Watching files for changes is not supported");
+#endif
+
     return priv;
 
 out_tpl_prefix_copy:
 out_tpl_compile:
     cache_destroy(priv->cache);
+    not_found_cache_free(priv->not_found);
+    lwan_shm_cache_close(priv->shared);
+    if (priv->store_fd >= 0)
+        close(priv->store_fd);
 out_cache_create:
     free(priv);
 out_malloc:
@@ -763,7 +2098,38 @@ static void *serve_files_create_from_hash(const char *prefix,
         .serve_precompressed_files =
             parse_bool(hash_find(hash, "serve_precompressed_files"), true),
         .auto_index = parse_bool(hash_find(hash, "auto_index"), true),
+        .cache_async = parse_bool(hash_find(hash, "cache_async"), false),
+        .watch_files = parse_bool(hash_find(hash, "watch_files"), false),
+        .cache_manifest = hash_find(hash, "cache_manifest"),
+        .shared_cache = hash_find(hash, "shared_cache"),
+        .compressed_store = hash_find(hash, "compressed_store"),
         .directory_list_template = hash_find(hash, "directory_list_template")};
+    long max_entries = parse_long(hash_find(hash, "cache_max_entries"), 0);
+    long max_size = parse_long(hash_find(hash, "cache_max_size"), 0);
+    long ttl = parse_long(hash_find(hash, "cache_ttl"), 5);
+    long shared_size = parse_long(hash_find(hash, "shared_cache_size"), 0);
+    long not_found_size =
+        parse_long(hash_find(hash, "not_found_cache_size"), 0);
+
+    settings.gzip_level = (int)parse_long(hash_find(hash, "gzip_level"), 0);
+    settings.brotli_level =
+        (int)parse_long(hash_find(hash, "brotli_level"), 0);
+    settings.zstd_level = (int)parse_long(hash_find(hash, "zstd_level"), 0);
+
+    if (max_entries < 0 || max_size < 0 || shared_size < 0 ||
+        not_found_size < 0) {
+        lwan_status_error("Cache limits can't be negative");
+        return NULL;
+    }
+    if (ttl <= 0) {
+        lwan_status_error("Cache TTL must be positive");
+        return NULL;
+    }
+    settings.cache_ttl = (time_t)ttl;
+    settings.cache_max_entries = (size_t)max_entries;
+    settings.cache_max_size = (size_t)max_size;
+    settings.shared_cache_size = (size_t)shared_size;
+    settings.not_found_cache_size = (size_t)not_found_size;
 
     return serve_files_create(prefix, &settings);
 }
@@ -777,51 +2143,181 @@ static void serve_files_destroy(void *data)
         return;
     }
 
+#if defined(HAS_INOTIFY)
+    /* Might not have been added, but that's harmless. */
+    lwan_job_del(watch_job, priv);
+    watch_stop(priv);
+#endif
+
     lwan_tpl_free(priv->directory_list_tpl);
     cache_destroy(priv->cache);
+    not_found_cache_free(priv->not_found);
+    /* Cached entries might point to it, so it goes after them. */
+    lwan_shm_cache_close(priv->shared);
+    if (priv->store_fd >= 0)
+        close(priv->store_fd);
     close(priv->root_fd);
     free(priv->root_path);
     free(priv->prefix);
     free(priv);
 }
 
-static ALWAYS_INLINE bool client_has_fresh_content(struct lwan_request *request,
-                                                   time_t mtime)
+/* Each encoding is a different representation, so it gets its own tag. */
+static const char *format_etag(const struct file_cache_entry *fce,
+                               const char *compression_type,
+                               char buf[static 64])
+{
+    int ret;
+
+    if (!fce->etag.opaque[0])
+        return NULL;
+
+    ret = snprintf(buf, 64, "%s\"%s%s%s\"", fce->etag.weak ? "W/" : "",
+                   fce->etag.opaque, compression_type ? "-" : "",
+                   compression_type ? compression_type : "");
+    if (UNLIKELY(ret < 0 || ret >= 64))
+        return NULL;
+
+    return buf;
+}
+
+static ALWAYS_INLINE const char *skip_weak_prefix(const char *tag)
+{
+    return (tag[0] == 'W' && tag[1] == '/') ? tag + 2 : tag;
+}
+
+/* Weak comparison, as per RFC 7232, of every entity-tag in an
+ * If-None-Match list against the tag of the representation being sent. */
+static bool etag_matches(const struct lwan_value *list, const char *etag)
+{
+    const char *p = list->value;
+    const char *end = p + list->len;
+    size_t etag_len = 0;
+
+    if (etag) {
+        etag = skip_weak_prefix(etag);
+        etag_len = strlen(etag);
+    }
+
+    while (p < end) {
+        const char *tag_end;
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+
+        if (*p == '*')
+            return true;
+
+        if (end - p > 2)
+            p = skip_weak_prefix(p);
+        if (*p != '"')
+            return false;
+
+        tag_end = memchr(p + 1, '"', (size_t)(end - p - 1));
+        if (!tag_end)
+            return false;
+        tag_end++;
+
+        if (etag && (size_t)(tag_end - p) == etag_len &&
+            !memcmp(p, etag, etag_len))
+            return true;
+
+        p = tag_end;
+    }
+
+    return false;
+}
+
+static bool client_has_fresh_content(struct lwan_request *request,
+                                     const struct file_cache_entry *fce,
+                                     const char *etag)
 {
+    /* If-Modified-Since is ignored if If-None-Match is present. */
+    if (request->header.if_none_match)
+        return etag_matches(request->header.if_none_match, etag);
+
     return request->header.if_modified_since &&
-           mtime <= request->header.if_modified_since;
+           fce->last_modified.integer <= request->header.if_modified_since;
 }
 
+/* Satisfiable ranges of a partial response.  A single part is sent as a
+ * regular 206 response with a Content-Range header, while more than one are
+ * sent as multipart/byteranges; each part header, as well as the closing
+ * boundary, ends at part_header_end[n] in part_headers. */
+struct byteranges {
+    struct lwan_range parts[MAX_RANGES];
+    size_t n_parts;
+    off_t size;
+
+    struct lwan_strbuf part_headers;
+    size_t part_header_end[MAX_RANGES + 1];
+    char content_type[128];
+    char content_range[64];
+};
+
 static size_t prepare_headers(struct lwan_request *request,
                               enum lwan_http_status return_status,
                               struct file_cache_entry *fce, size_t size,
-                              const char *compression_type, char *header_buf,
+                              const char *compression_type, bool vary,
+                              const char *etag,
+                              const struct byteranges *ranges,
+                              char *header_buf,
                               size_t header_buf_size)
 {
-    struct lwan_key_value additional_headers[3] = {
+    struct lwan_key_value additional_headers[6] = {
         [0] = {.key = "Last-Modified", .value = fce->last_modified.string},
     };
+    int n_headers = 1;
+    size_t len;
 
     request->response.content_length = size;
 
     if (compression_type) {
-        additional_headers[1] = (struct lwan_key_value) {
+        additional_headers[n_headers++] = (struct lwan_key_value) {
             .key = "Content-Encoding", .value = (char *)compression_type
         };
     }
+    /* Let caches know that what they got depends on Accept-Encoding,
+     * whether a compressed response has been sent this time or not. */
+    if (vary) {
+        additional_headers[n_headers++] = (struct lwan_key_value) {
+            .key = "Vary", .value = "Accept-Encoding"
+        };
+    }
+    if (etag) {
+        additional_headers[n_headers++] = (struct lwan_key_value) {
+            .key = "ETag", .value = (char *)etag
+        };
+    }
+    if (ranges && ranges->n_parts == 1) {
+        additional_headers[n_headers++] = (struct lwan_key_value) {
+            .key = "Content-Range", .value = (char *)ranges->content_range
+        };
+    }
+
+    if (ranges && ranges->n_parts > 1) {
+        request->response.mime_type = ranges->content_type;
+        len = lwan_prepare_response_header_full(request, return_status,
+                                                header_buf, header_buf_size,
+                                                additional_headers);
+        request->response.mime_type = fce->mime_type;
+    } else {
+        len = lwan_prepare_response_header_full(request, return_status,
+                                                header_buf, header_buf_size,
+                                                additional_headers);
+    }
 
-    return lwan_prepare_response_header_full(request, return_status, header_buf,
-                                             header_buf_size,
-                                             additional_headers);
+    return len;
 }
 
 static enum lwan_http_status
-compute_range(struct lwan_request *request, off_t *from, off_t *to, off_t size)
+compute_single_range(const struct lwan_range *range, off_t *from, off_t *to,
+                     off_t size)
 {
-    off_t f, t;
-
-    f = request->header.range.from;
-    t = request->header.range.to;
+    off_t f = range->from;
+    off_t t = range->to;
 
     /* No Range: header present: both t and f are -1 */
     if (LIKELY(t <= 0 && f <= 0)) {
@@ -841,18 +2337,199 @@ compute_range(struct lwan_request *request, off_t *from, off_t *to, off_t size)
         return HTTP_RANGE_UNSATISFIABLE;
 
     /* t < 0: ranges from f to the file size */
-    if (t < 0) {
-	*to = size;
-    } else {
-        if (UNLIKELY(__builtin_sub_overflow(t, f, to)))
-            return HTTP_RANGE_UNSATISFIABLE;
-    }
-
     *from = f;
+    *to = t < 0 ? size : t;
 
     return HTTP_PARTIAL_CONTENT;
 }
 
+/* Fills ranges with the parts to send, as [from, to) offsets.  In a
+ * multi-range request, unsatisfiable ranges are ignored as long as
+ * there's at least one that can be sent. */
+static enum lwan_http_status compute_range(struct lwan_request *request,
+                                           struct byteranges *ranges,
+                                           off_t size)
+{
+    enum lwan_http_status status;
+    off_t from, to;
+
+    ranges->size = size;
+    ranges->n_parts = 0;
+
+    if (LIKELY(request->header.n_ranges <= 1)) {
+        status = compute_single_range(&request->header.range, &from, &to,
+                                      size);
+        if (status == HTTP_PARTIAL_CONTENT) {
+            ranges->parts[0] = (struct lwan_range){.from = from, .to = to};
+            ranges->n_parts = 1;
+        }
+
+        return status;
+    }
+
+    for (size_t i = 0; i < request->header.n_ranges; i++) {
+        status = compute_single_range(&request->header.ranges[i], &from, &to,
+                                      size);
+        if (status == HTTP_RANGE_UNSATISFIABLE)
+            continue;
+
+        ranges->parts[ranges->n_parts++] =
+            (struct lwan_range){.from = from, .to = to};
+    }
+
+    return ranges->n_parts ? HTTP_PARTIAL_CONTENT : HTTP_RANGE_UNSATISFIABLE;
+}
+
+/* Formats the headers for each part, returning the length of the body of
+ * the response, or 0 on failure. */
+static size_t prepare_byteranges(struct byteranges *ranges,
+                                 const char *mime_type)
+{
+    static uint64_t boundary_counter;
+    char boundary[24];
+    size_t length = 0;
+
+    if (ranges->n_parts == 1) {
+        const struct lwan_range *part = &ranges->parts[0];
+
+        snprintf(ranges->content_range, sizeof(ranges->content_range),
+                 "bytes %jd-%jd/%jd", (intmax_t)part->from,
+                 (intmax_t)(part->to - 1), (intmax_t)ranges->size);
+
+        return (size_t)(part->to - part->from);
+    }
+
+    /* The boundary only has to be unlikely to be found in the file; mixing
+     * a counter is enough for that without calling into the RNG. */
+    snprintf(boundary, sizeof(boundary), "%016" PRIx64,
+             (uint64_t)(ATOMIC_INC(boundary_counter) * 0x9e3779b97f4a7c15ull));
+    snprintf(ranges->content_type, sizeof(ranges->content_type),
+             "multipart/byteranges; boundary=%s", boundary);
+
+    if (!lwan_strbuf_init(&ranges->part_headers))
+        return 0;
+
+    for (size_t i = 0; i < ranges->n_parts; i++) {
+        const struct lwan_range *part = &ranges->parts[i];
+
+        if (!lwan_strbuf_append_printf(
+                &ranges->part_headers,
+                "%s--%s\r\nContent-Type: %s\r\n"
+                "Content-Range: bytes %jd-%jd/%jd\r\n\r\n",
+                i ? "\r\n" : "", boundary, mime_type, (intmax_t)part->from,
+                (intmax_t)(part->to - 1), (intmax_t)ranges->size))
+            goto fail;
+
+        ranges->part_header_end[i] =
+            lwan_strbuf_get_length(&ranges->part_headers);
+        length += (size_t)(part->to - part->from);
+    }
+
+    if (!lwan_strbuf_append_printf(&ranges->part_headers, "\r\n--%s--\r\n",
+                                   boundary))
+        goto fail;
+    ranges->part_header_end[ranges->n_parts] =
+        lwan_strbuf_get_length(&ranges->part_headers);
+
+    return length + lwan_strbuf_get_length(&ranges->part_headers);
+
+fail:
+    lwan_strbuf_free(&ranges->part_headers);
+    return 0;
+}
+
+static void free_byteranges(struct byteranges *ranges)
+{
+    if (ranges->n_parts > 1)
+        lwan_strbuf_free(&ranges->part_headers);
+}
+
+static ALWAYS_INLINE struct iovec
+part_header_iovec(const struct byteranges *ranges, size_t i)
+{
+    size_t start = i ? ranges->part_header_end[i - 1] : 0;
+
+    return (struct iovec){
+        .iov_base = lwan_strbuf_get_buffer(&ranges->part_headers) + start,
+        .iov_len = ranges->part_header_end[i] - start,
+    };
+}
+
+static bool has_precompressed(const struct sendfile_cache_data *sd)
+{
+    for (int i = 0; i < N_PRECOMPRESSED; i++) {
+        if (sd->compressed[i].size)
+            return true;
+    }
+
+    return false;
+}
+
+/* Picks the sibling the client likes the most, or the smallest one if it
+ * likes more than one the same; returns -1 if there's none to send. */
+static int choose_precompressed(const struct sendfile_cache_data *sd,
+                                struct lwan_request *request)
+{
+    int best = -1, best_qvalue = 0;
+
+    for (int i = 0; i < N_PRECOMPRESSED; i++) {
+        int qvalue;
+
+        if (!sd->compressed[i].size)
+            continue;
+
+        qvalue = lwan_request_get_accept_encoding_qvalue(
+            request, precompressed[i].accept_flag);
+        if (!qvalue || qvalue < best_qvalue)
+            continue;
+        if (qvalue == best_qvalue &&
+            sd->compressed[i].size >= sd->compressed[best].size)
+            continue;
+
+        best = i;
+        best_qvalue = qvalue;
+    }
+
+    return best;
+}
+
+static void sendfile_byteranges(struct lwan_request *request, int fd,
+                                const struct byteranges *ranges,
+                                const char *headers, size_t header_len)
+{
+    /* Ranges usually aren't where readahead left off: start reading all
+     * of them in the background while the first one is being sent. */
+    for (size_t i = 0; i < ranges->n_parts; i++) {
+        const struct lwan_range *part = &ranges->parts[i];
+        off_t len = part->to - part->from;
+
+        if (len > SENDFILE_READAHEAD_SIZE)
+            len = SENDFILE_READAHEAD_SIZE;
+        posix_fadvise(fd, part->from, len, POSIX_FADV_WILLNEED);
+    }
+
+    if (ranges->n_parts == 1) {
+        const struct lwan_range *part = &ranges->parts[0];
+
+        lwan_sendfile(request, fd, part->from, (size_t)(part->to - part->from),
+                      headers, header_len);
+        return;
+    }
+
+    lwan_send(request, headers, header_len, MSG_MORE);
+
+    for (size_t i = 0; i < ranges->n_parts; i++) {
+        const struct lwan_range *part = &ranges->parts[i];
+        struct iovec part_header = part_header_iovec(ranges, i);
+
+        lwan_sendfile(request, fd, part->from, (size_t)(part->to - part->from),
+                      part_header.iov_base, part_header.iov_len);
+    }
+
+    struct iovec closing = part_header_iovec(ranges, ranges->n_parts);
+    lwan_send(request, closing.iov_base, closing.iov_len, 0);
+}
+
 static enum lwan_http_status sendfile_serve(struct lwan_request *request,
                                             void *data)
 {
@@ -861,29 +2538,29 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
     char headers[DEFAULT_BUFFER_SIZE];
     size_t header_len;
     enum lwan_http_status return_status;
-    off_t from, to;
+    struct byteranges ranges = {.n_parts = 0};
     const char *compressed;
+    char etag_buf[64];
+    const char *etag;
     size_t size;
     int fd;
+    int best = choose_precompressed(sd, request);
 
-    if (sd->compressed.size && (request->flags & REQUEST_ACCEPT_GZIP)) {
-        from = 0;
-        to = (off_t)sd->compressed.size;
-
-        compressed = compression_gzip;
-        fd = sd->compressed.fd;
-        size = sd->compressed.size;
+    if (best >= 0) {
+        compressed = precompressed[best].name;
+        fd = sd->compressed[best].fd;
+        size = sd->compressed[best].size;
 
         return_status = HTTP_OK;
     } else {
         return_status =
-            compute_range(request, &from, &to, (off_t)sd->uncompressed.size);
+            compute_range(request, &ranges, (off_t)sd->uncompressed.size);
         if (UNLIKELY(return_status == HTTP_RANGE_UNSATISFIABLE))
             return HTTP_RANGE_UNSATISFIABLE;
 
         compressed = compression_none;
         fd = sd->uncompressed.fd;
-        size = (size_t)(to - from);
+        size = sd->uncompressed.size;
     }
     if (UNLIKELY(fd < 0)) {
         switch (-fd) {
@@ -897,53 +2574,120 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
         }
     }
 
-    if (client_has_fresh_content(request, fce->last_modified.integer))
+    etag = format_etag(fce, compressed, etag_buf);
+    if (client_has_fresh_content(request, fce, etag)) {
         return_status = HTTP_NOT_MODIFIED;
+        ranges.n_parts = 0;
+    }
 
-    header_len = prepare_headers(request, return_status, fce, size, compressed,
-                                 headers, DEFAULT_HEADERS_SIZE);
-    if (UNLIKELY(!header_len))
-        return HTTP_INTERNAL_ERROR;
+    if (ranges.n_parts) {
+        size = prepare_byteranges(&ranges, fce->mime_type);
+        if (UNLIKELY(!size))
+            return HTTP_INTERNAL_ERROR;
+    }
 
-    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
-        return_status == HTTP_NOT_MODIFIED) {
+    header_len = prepare_headers(request, return_status, fce, size, compressed,
+                                 has_precompressed(sd), etag, &ranges, headers,
+                                 DEFAULT_HEADERS_SIZE);
+    if (UNLIKELY(!header_len)) {
+        return_status = HTTP_INTERNAL_ERROR;
+    } else if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
+               return_status == HTTP_NOT_MODIFIED) {
         lwan_send(request, headers, header_len, 0);
+    } else if (ranges.n_parts) {
+        sendfile_byteranges(request, fd, &ranges, headers, header_len);
     } else {
-        lwan_sendfile(request, fd, from, (size_t)to, headers, header_len);
+        lwan_sendfile(request, fd, 0, size, headers, header_len);
     }
 
+    free_byteranges(&ranges);
     return return_status;
 }
 
+static void writev_contents(struct lwan_request *request,
+                            struct file_cache_entry *fce,
+                            struct iovec *vec,
+                            int n_vec,
+                            size_t size)
+{
+    struct serve_files_priv *priv = request->response.stream.priv;
+
+    /* The entry owns the contents, so it's kept until the kernel is done
+     * sending them. */
+    if (lwan_should_zerocopy(request, size) && cache_entry_ref(&fce->base)) {
+        lwan_writev_zerocopy(request, vec, n_vec,
+                             CORO_DEFER2(cache_entry_unref), priv->cache,
+                             &fce->base);
+    } else {
+        lwan_writev(request, vec, n_vec);
+    }
+}
+
 static enum lwan_http_status serve_buffer(struct lwan_request *request,
                                           struct file_cache_entry *fce,
                                           const char *compression_type,
+                                          bool vary,
                                           const void *contents, size_t size,
-                                          enum lwan_http_status return_status)
+                                          enum lwan_http_status return_status,
+                                          struct byteranges *ranges)
 {
     char headers[DEFAULT_BUFFER_SIZE];
+    char etag_buf[64];
+    const char *etag = format_etag(fce, compression_type, etag_buf);
     size_t header_len;
 
-    if (client_has_fresh_content(request, fce->last_modified.integer))
+    if (client_has_fresh_content(request, fce, etag)) {
         return_status = HTTP_NOT_MODIFIED;
+        ranges = NULL;
+    }
+
+    if (ranges) {
+        size = prepare_byteranges(ranges, fce->mime_type);
+        if (UNLIKELY(!size))
+            return HTTP_INTERNAL_ERROR;
+    }
 
     header_len =
         prepare_headers(request, return_status, fce, size, compression_type,
-                        headers, DEFAULT_HEADERS_SIZE);
-    if (UNLIKELY(!header_len))
-        return HTTP_INTERNAL_ERROR;
-
-    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
-        return_status == HTTP_NOT_MODIFIED) {
+                        vary, etag, ranges, headers, DEFAULT_HEADERS_SIZE);
+    if (UNLIKELY(!header_len)) {
+        return_status = HTTP_INTERNAL_ERROR;
+    } else if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
+               return_status == HTTP_NOT_MODIFIED) {
         lwan_send(request, headers, header_len, 0);
+    } else if (ranges) {
+        /* Headers, then a part header and the part itself for each part,
+         * and finally the closing boundary if there's more than one. */
+        struct iovec response_vec[2 * MAX_RANGES + 2] = {
+            {.iov_base = headers, .iov_len = header_len},
+        };
+        int n_vec = 1;
+
+        for (size_t i = 0; i < ranges->n_parts; i++) {
+            const struct lwan_range *part = &ranges->parts[i];
+
+            if (ranges->n_parts > 1)
+                response_vec[n_vec++] = part_header_iovec(ranges, i);
+            response_vec[n_vec++] = (struct iovec){
+                .iov_base = (char *)contents + part->from,
+                .iov_len = (size_t)(part->to - part->from),
+            };
+        }
+        if (ranges->n_parts > 1)
+            response_vec[n_vec++] = part_header_iovec(ranges, ranges->n_parts);
+
+        writev_contents(request, fce, response_vec, n_vec, size);
     } else {
         struct iovec response_vec[] = {
             {.iov_base = headers, .iov_len = header_len},
             {.iov_base = (void *)contents, .iov_len = size}};
 
-        lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
+        writev_contents(request, fce, response_vec, N_ELEMENTS(response_vec),
+                        size);
     }
 
+    if (ranges)
+        free_byteranges(ranges);
     return return_status;
 }
 
@@ -952,36 +2696,31 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
 {
     struct file_cache_entry *fce = data;
     struct mmap_cache_data *md = (struct mmap_cache_data *)(fce + 1);
-    void *contents;
-    size_t size;
-    const char *compressed;
+    struct serve_files_priv *priv = request->response.stream.priv;
+    struct byteranges ranges;
     enum lwan_http_status status;
-
-    if (md->compressed.size && (request->flags & REQUEST_ACCEPT_DEFLATE)) {
-        contents = md->compressed.contents;
-        size = md->compressed.size;
-        compressed = compression_deflate;
-
-        status = HTTP_OK;
-    } else {
-        off_t from, to;
-
-        status =
-            compute_range(request, &from, &to, (off_t)md->uncompressed.size);
-        switch (status) {
-        case HTTP_PARTIAL_CONTENT:
-        case HTTP_OK:
-            contents = (char *)md->uncompressed.contents + from;
-            size = (size_t)(to - from);
-            compressed = compression_none;
-            break;
-
-        default:
-            return status;
-        }
+    enum encoding encoding;
+
+    /* Ranges refer to the uncompressed contents; whether a compressed
+     * copy exists depends on earlier requests, so it can't win here. */
+    if (request->header.n_ranges)
+        encoding = N_ENCODINGS;
+    else
+        encoding = choose_encoding(md, priv, request, fce);
+
+    if (encoding != N_ENCODINGS) {
+        return serve_buffer(request, fce, encodings[encoding].name, true,
+                            md->encoded[encoding].contents,
+                            md->encoded[encoding].size, HTTP_OK, NULL);
     }
 
-    return serve_buffer(request, fce, compressed, contents, size, status);
+    status = compute_range(request, &ranges, (off_t)md->uncompressed.size);
+    if (UNLIKELY(status == HTTP_RANGE_UNSATISFIABLE))
+        return status;
+
+    return serve_buffer(request, fce, compression_none, true,
+                        md->uncompressed.contents, md->uncompressed.size,
+                        status, ranges.n_parts ? &ranges : NULL);
 }
 
 static enum lwan_http_status dirlist_serve(struct lwan_request *request,
@@ -989,14 +2728,24 @@ static enum lwan_http_status dirlist_serve(struct lwan_request *request,
 {
     struct file_cache_entry *fce = data;
     struct dir_list_cache_data *dd = (struct dir_list_cache_data *)(fce + 1);
+    struct serve_files_priv *priv = request->response.stream.priv;
     const char *icon;
     const void *contents;
     size_t size;
 
     icon = lwan_request_get_query_param(request, "icon");
     if (!icon) {
-        contents = lwan_strbuf_get_buffer(dd->rendered);
-        size = lwan_strbuf_get_length(dd->rendered);
+        enum encoding encoding = choose_encoding(&dd->md, priv, request, fce);
+
+        if (encoding != N_ENCODINGS) {
+            return serve_buffer(request, fce, encodings[encoding].name, true,
+                                dd->md.encoded[encoding].contents,
+                                dd->md.encoded[encoding].size, HTTP_OK, NULL);
+        }
+
+        return serve_buffer(request, fce, compression_none, true,
+                            dd->md.uncompressed.contents,
+                            dd->md.uncompressed.size, HTTP_OK, NULL);
     } else if (!strcmp(icon, "back")) {
         contents = back_gif;
         size = sizeof(back_gif);
@@ -1013,7 +2762,8 @@ static enum lwan_http_status dirlist_serve(struct lwan_request *request,
         return HTTP_NOT_FOUND;
     }
 
-    return serve_buffer(request, fce, compression_none, contents, size, HTTP_OK);
+    return serve_buffer(request, fce, compression_none, false, contents, size,
+                        HTTP_OK, NULL);
 }
 
 static enum lwan_http_status redir_serve(struct lwan_request *request,
@@ -1058,8 +2808,8 @@ serve_files_handle_request(struct lwan_request *request,
         goto fail;
     }
 
-    ce = cache_coro_get_and_ref_entry(priv->cache, request->conn->coro,
-                                      request->url.value);
+    ce = cache_request_get_and_ref_entry(priv->cache, request,
+                                         request->url.value);
     if (LIKELY(ce)) {
         struct file_cache_entry *fce = (struct file_cache_entry *)ce;
 
@@ -29,8 +29,31 @@ struct lwan_serve_files_settings {
   const char *root_path;
   const char *index_html;
   const char *directory_list_template;
+  /* Keys that were cached when the previous process exited, to warm up
+   * the cache with; written on shutdown. */
+  const char *cache_manifest;
+  size_t cache_max_entries;
+  size_t cache_max_size;
+  /* File (on a tmpfs) where compressed copies and ETags are shared with
+   * other processes; NULL to not share them. */
+  const char *shared_cache;
+  size_t shared_cache_size;
+  /* Directory where compressed copies of small files are written to, and
+   * looked for before compressing them; NULL to not keep them on disk. */
+  const char *compressed_store;
+  /* Number of paths that weren't found to remember, so that requests for
+   * them don't cost a lookup each; 0 to not remember them. */
+  size_t not_found_cache_size;
+  /* In seconds; 0 uses the default. */
+  time_t cache_ttl;
+  /* 0 picks a sensible default for each encoding. */
+  int gzip_level;
+  int brotli_level;
+  int zstd_level;
   bool serve_precompressed_files;
   bool auto_index;
+  bool cache_async;
+  bool watch_files;
 };
 
 LWAN_MODULE_FORWARD_DECL(serve_files);
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <time.h>
+
 #include "lwan.h"
 
 void lwan_response_init(struct lwan *l);
@@ -27,27 +29,179 @@ void lwan_response_shutdown(struct lwan *l);
 void lwan_socket_init(struct lwan *l);
 void lwan_socket_shutdown(struct lwan *l);
 
+void lwan_tls_init(struct lwan *l);
+void lwan_tls_shutdown(struct lwan *l);
+bool lwan_tls_handshake(struct lwan *l,
+                        struct lwan_connection *conn,
+                        int fd,
+                        bool *http2);
+
 void lwan_thread_init(struct lwan *l);
 void lwan_thread_shutdown(struct lwan *l);
-void lwan_thread_add_client(struct lwan_thread *t, int fd);
+/* Clients queued for an I/O thread are only handed over to it, waking it
+ * up at most once, by lwan_thread_flush_clients(). */
+void lwan_thread_queue_client(struct lwan_thread *t, int fd);
+void lwan_thread_flush_clients(struct lwan_thread *t);
+void lwan_thread_add_listener(struct lwan_thread *t, int fd);
+void lwan_thread_stop_accepting(struct lwan *l);
+
+/* A new process started by lwan_reload_spawn_successor(): ready_fd becomes
+ * readable once it's ready to serve, or once it's gone.  Either way (or
+ * once lwan_reload_successor_timeout() gets to 0), it's up to
+ * lwan_reload_successor_ready() to tell which; a process that isn't ready
+ * is killed. */
+struct lwan_successor {
+    pid_t pid;
+    int ready_fd;
+    unsigned long long deadline_ns;
+};
+
+bool lwan_reload_spawn_successor(struct lwan *l,
+                                 struct lwan_successor *successor);
+int lwan_reload_successor_timeout(const struct lwan_successor *successor);
+bool lwan_reload_successor_ready(struct lwan_successor *successor);
+bool lwan_reload_wait_for_successor(struct lwan_successor *successor);
+void lwan_reload_abandon_successor(struct lwan_successor *successor);
+void lwan_reload_notify_predecessor(void);
+
+/* Like lwan_request_get_remote_address(), without formatting it; the
+ * family is AF_UNSPEC if a PROXY header didn't say. */
+bool lwan_request_get_remote_sockaddr(struct lwan_request *request,
+                                      struct sockaddr_storage *sock_addr);
+
+void lwan_metrics_record_latency(struct lwan_thread *t, unsigned long long ns);
+void lwan_metrics_record_stack_usage(struct lwan_stack_usage *usage,
+                                     size_t bytes);
+
+/* Bounds the time it takes to read a request or write a response: the
+ * clock starts the first time the transfer has to wait for the client,
+ * and each min_transfer_rate bytes that go through extend it by a second.
+ * The connection timer is only touched before yielding. */
+struct lwan_deadline {
+    unsigned int start;
+    unsigned int timeout_ms;
+    bool started;
+};
+
+void lwan_deadline_init(struct lwan_deadline *deadline,
+                        const struct lwan_request *request,
+                        unsigned int timeout);
+bool lwan_deadline_wait(struct lwan_deadline *deadline,
+                        struct lwan_request *request,
+                        size_t transferred);
+
+static inline void lwan_deadline_done(struct lwan_request *request)
+{
+    request->conn->flags &= ~CONN_HAS_DEADLINE;
+}
+
+static inline unsigned long long lwan_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull +
+           (unsigned long long)ts.tv_nsec;
+}
+
+/* With numa_local_connections, each 4KiB page of the connection array is
+ * first-touched by (and connections in it are scheduled to) a single
+ * I/O thread. */
+#define CONNS_PER_PAGE (4096 / sizeof(struct lwan_connection))
+
+static inline unsigned short
+lwan_thread_for_fd_page(const struct lwan *l, int fd)
+{
+    return (unsigned short)(((size_t)fd / CONNS_PER_PAGE) % l->thread.count);
+}
+
+/* Set in epoll_event.data for file descriptors awaited by a connection
+ * coroutine, to tell them apart from the connection socket itself. */
+#define CONN_AWAITED_FD_TAG ((uintptr_t)1)
 
 void lwan_status_init(struct lwan *l);
 void lwan_status_shutdown(struct lwan *l);
 
+enum lwan_job_priority {
+    LWAN_JOB_PRIORITY_LOW,
+    LWAN_JOB_PRIORITY_NORMAL,
+    LWAN_JOB_PRIORITY_HIGH,
+};
+
 void lwan_job_thread_init(void);
 void lwan_job_thread_shutdown(void);
 void lwan_job_add(bool (*cb)(void *data), void *data);
+void lwan_job_add_full(bool (*cb)(void *data), void *data,
+                       unsigned int interval_ms,
+                       enum lwan_job_priority priority);
+void lwan_job_kick(bool (*cb)(void *data), void *data);
 void lwan_job_del(bool (*cb)(void *data), void *data);
 
+void lwan_readahead_init(void);
+void lwan_readahead_shutdown(void);
+/* Returns once [offset, offset + count) of fd is in the page cache, with
+ * the coroutine waiting for a worker to read it if it wasn't. */
+void lwan_readahead_wait(struct lwan_request *request, int fd, off_t offset,
+                         size_t count);
+
+struct lwan_clock {
+    time_t now;         /* Wall clock, in seconds */
+    time_t monotonic;   /* Monotonic clock, in seconds */
+    char date[30];
+    char expires[30];
+};
+
+void lwan_clock_init(time_t expires);
+void lwan_clock_tick(void);
+const struct lwan_clock *lwan_clock_get(void);
+
 void lwan_tables_init(void);
 void lwan_tables_shutdown(void);
 
+/* Where requests are read into; value points either to a buffer owned by
+ * the caller, or, after a request that didn't fit in it, to a (larger)
+ * one taken from the thread's pool, until lwan_request_buffer_shrink(). */
+struct lwan_request_buffer {
+    char *value;
+    size_t len;
+    size_t size;
+    char *small;
+    struct lwan_thread *thread;
+};
+
+void lwan_url_map_specialize(struct lwan_url_map *url_map);
 char *lwan_process_request(struct lwan *l, struct lwan_request *request,
-                           struct lwan_value *buffer, char *next_request);
+                           struct lwan_request_buffer *buffer,
+                           char *next_request);
+char *lwan_request_buffer_shrink(struct lwan_request_buffer *buffer,
+                                 char *next_request);
+void lwan_request_buffer_release(void *data);
+void lwan_request_buffer_pool_free(struct lwan_thread *t);
+
+ssize_t lwan_parse_headers_for_benchmark(char *buffer, size_t len);
+/* Sends the response kept for a handler with HANDLER_CONSTANT_RESPONSE;
+ * otherwise, lwan_response() keeps the one it's about to send. */
+bool lwan_response_send_constant(struct lwan_request *request,
+                                 const struct lwan_url_map *url_map);
+void lwan_response_constant_cache_free(struct lwan_thread *thread);
+
 size_t lwan_prepare_response_header_full(struct lwan_request *request,
      enum lwan_http_status status, char headers[],
      size_t headers_buf_size, const struct lwan_key_value *additional_headers);
 
+/* For handlers forwarding requests elsewhere: the query string as sent by
+ * the client (NULL if query parameters have been parsed already), and every
+ * header in the request, in order.  Header values aren't NUL-terminated;
+ * iteration stops when the callback returns false. */
+const struct lwan_value *
+lwan_request_get_raw_query_string(struct lwan_request *request);
+void lwan_request_foreach_header(struct lwan_request *request,
+    bool (*callback)(const struct lwan_value *name,
+                     const struct lwan_value *value, void *data),
+    void *data);
+
+void lwan_request_begin_upgraded_body(struct lwan_request *request);
+
 void lwan_straitjacket_enforce_from_config(struct config *c);
 
 const char *lwan_get_config_path(char *path_buf, size_t path_buf_len);
@@ -56,6 +210,11 @@ uint8_t lwan_char_isspace(char ch) __attribute__((pure));
 uint8_t lwan_char_isxdigit(char ch) __attribute__((pure));
 uint8_t lwan_char_isdigit(char ch) __attribute__((pure));
 
+/* Finds the first byte in [p, end) that's a quote, a backslash, a control
+ * character or not ASCII. */
+const char *lwan_json_find_special(const char *p, const char *end);
+size_t lwan_utf8_sequence_length(const char *p, const char *end);
+
 #ifdef HAVE_LUA
 #include <lua.h>
 
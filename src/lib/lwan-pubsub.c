@@ -0,0 +1,377 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#if defined(HAS_EVENTFD)
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+
+#include "list.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-pubsub.h"
+
+/* Must be a power of two. */
+#define SUBSCRIBER_QUEUE_SIZE 64
+#define SUBSCRIBER_QUEUE_MASK (SUBSCRIBER_QUEUE_SIZE - 1)
+
+/* Messages written with a single writev() by lwan_response_send_pubsub(). */
+#define MAX_MSGS_PER_WRITE 16
+
+struct lwan_pubsub_msg {
+    struct lwan_value value;
+    unsigned int refs;
+    char contents[];
+};
+
+struct lwan_pubsub_topic {
+    pthread_mutex_t lock;
+    struct list_head subscribers;
+    unsigned int n_subscribers;
+};
+
+/* Publishers hold the topic lock while queueing a message, so each queue
+ * has a single producer and a single consumer, and needs no locks: head
+ * is only written by publishers, and tail by the subscriber. */
+struct lwan_pubsub_subscriber {
+    struct list_node subscribers;
+    struct lwan_pubsub_topic *topic;
+    int notify_fd[2];
+
+    size_t head;
+    size_t tail;
+    struct lwan_pubsub_msg *queue[SUBSCRIBER_QUEUE_SIZE];
+};
+
+struct lwan_pubsub_topic *lwan_pubsub_new_topic(void)
+{
+    struct lwan_pubsub_topic *topic = malloc(sizeof(*topic));
+
+    if (!topic)
+        return NULL;
+
+    if (pthread_mutex_init(&topic->lock, NULL)) {
+        free(topic);
+        return NULL;
+    }
+
+    list_head_init(&topic->subscribers);
+    topic->n_subscribers = 0;
+
+    return topic;
+}
+
+void lwan_pubsub_free_topic(struct lwan_pubsub_topic *topic)
+{
+    struct lwan_pubsub_subscriber *sub, *next;
+
+    if (!topic)
+        return;
+
+    /* Meant for shutdown: subscribers still around won't get any other
+     * message, but can still be unsubscribed. */
+    pthread_mutex_lock(&topic->lock);
+    list_for_each_safe(&topic->subscribers, sub, next, subscribers) {
+        list_del(&sub->subscribers);
+        sub->topic = NULL;
+    }
+    pthread_mutex_unlock(&topic->lock);
+
+    pthread_mutex_destroy(&topic->lock);
+    free(topic);
+}
+
+void lwan_pubsub_msg_done(struct lwan_pubsub_msg *msg)
+{
+    if (!ATOMIC_DEC(msg->refs))
+        free(msg);
+}
+
+const struct lwan_value *lwan_pubsub_msg_value(const struct lwan_pubsub_msg *msg)
+{
+    return &msg->value;
+}
+
+static void notify(struct lwan_pubsub_subscriber *sub)
+{
+    /* The same buffer works for both eventfd() and pipes.  If the write
+     * fails because the counter (or the pipe) is full, the subscriber has
+     * been notified already. */
+    const uint64_t event = 1;
+
+    while (UNLIKELY(write(sub->notify_fd[1], &event, sizeof(event)) < 0)) {
+        if (errno != EINTR)
+            break;
+    }
+}
+
+static void publish_msg(struct lwan_pubsub_topic *topic,
+                        struct lwan_pubsub_msg *msg)
+{
+    struct lwan_pubsub_subscriber *sub;
+    unsigned int unused_refs = 1;
+
+    pthread_mutex_lock(&topic->lock);
+
+    /* Every subscriber gets its reference before any of them can see the
+     * message; the ones for subscribers with a full queue, and the one for
+     * the publisher, are given back after the message has been queued. */
+    msg->refs = topic->n_subscribers + 1;
+
+    list_for_each(&topic->subscribers, sub, subscribers) {
+        size_t head = sub->head;
+        size_t tail = __atomic_load_n(&sub->tail, __ATOMIC_ACQUIRE);
+
+        if (UNLIKELY(head - tail == SUBSCRIBER_QUEUE_SIZE)) {
+            unused_refs++;
+            continue;
+        }
+
+        sub->queue[head & SUBSCRIBER_QUEUE_MASK] = msg;
+        __atomic_store_n(&sub->head, head + 1, __ATOMIC_RELEASE);
+
+        /* Subscribers only wait once they've emptied their queue. */
+        if (head == tail)
+            notify(sub);
+    }
+
+    pthread_mutex_unlock(&topic->lock);
+
+    if (!__sync_sub_and_fetch(&msg->refs, unused_refs))
+        free(msg);
+}
+
+static struct lwan_pubsub_msg *new_msg(size_t len)
+{
+    struct lwan_pubsub_msg *msg = malloc(sizeof(*msg) + len + 1);
+
+    if (UNLIKELY(!msg))
+        return NULL;
+
+    msg->value = (struct lwan_value){.value = msg->contents, .len = len};
+    msg->contents[len] = '\0';
+
+    return msg;
+}
+
+bool lwan_pubsub_publish(struct lwan_pubsub_topic *topic,
+                         const void *contents,
+                         size_t len)
+{
+    struct lwan_pubsub_msg *msg = new_msg(len);
+
+    if (UNLIKELY(!msg))
+        return false;
+
+    memcpy(msg->contents, contents, len);
+    publish_msg(topic, msg);
+
+    return true;
+}
+
+#define APPEND_CONSTANT(p_, const_) mempcpy((p_), (const_), sizeof(const_) - 1)
+
+bool lwan_pubsub_publish_event(struct lwan_pubsub_topic *topic,
+                               const char *event,
+                               const void *data,
+                               size_t len)
+{
+    size_t event_len = event ? strlen(event) : 0;
+    struct lwan_pubsub_msg *msg;
+    char *p;
+
+    /* "event: " event "\r\n" "data: " data "\r\n\r\n" */
+    msg = new_msg(event_len + len + 19);
+    if (UNLIKELY(!msg))
+        return false;
+
+    p = msg->contents;
+    if (event) {
+        p = APPEND_CONSTANT(p, "event: ");
+        p = mempcpy(p, event, event_len);
+        p = APPEND_CONSTANT(p, "\r\n");
+    }
+    if (len) {
+        p = APPEND_CONSTANT(p, "data: ");
+        p = mempcpy(p, data, len);
+    }
+    p = APPEND_CONSTANT(p, "\r\n\r\n");
+    *p = '\0';
+    msg->value.len = (size_t)(p - msg->contents);
+
+    publish_msg(topic, msg);
+
+    return true;
+}
+
+#undef APPEND_CONSTANT
+
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic)
+{
+    struct lwan_pubsub_subscriber *sub = malloc(sizeof(*sub));
+
+    if (UNLIKELY(!sub))
+        return NULL;
+
+#if defined(HAS_EVENTFD)
+    sub->notify_fd[0] = sub->notify_fd[1] =
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (UNLIKELY(sub->notify_fd[0] < 0))
+        goto error;
+#else
+    if (UNLIKELY(pipe2(sub->notify_fd, O_NONBLOCK | O_CLOEXEC) < 0))
+        goto error;
+#endif
+
+    sub->topic = topic;
+    sub->head = sub->tail = 0;
+
+    pthread_mutex_lock(&topic->lock);
+    list_add_tail(&topic->subscribers, &sub->subscribers);
+    topic->n_subscribers++;
+    pthread_mutex_unlock(&topic->lock);
+
+    return sub;
+
+error:
+    free(sub);
+    return NULL;
+}
+
+struct lwan_pubsub_msg *lwan_pubsub_consume(struct lwan_pubsub_subscriber *sub)
+{
+    size_t tail = sub->tail;
+    struct lwan_pubsub_msg *msg;
+
+    if (tail == __atomic_load_n(&sub->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    msg = sub->queue[tail & SUBSCRIBER_QUEUE_MASK];
+    __atomic_store_n(&sub->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return msg;
+}
+
+void lwan_pubsub_unsubscribe(struct lwan_pubsub_subscriber *sub)
+{
+    struct lwan_pubsub_topic *topic = sub->topic;
+    struct lwan_pubsub_msg *msg;
+
+    if (topic) {
+        pthread_mutex_lock(&topic->lock);
+        list_del(&sub->subscribers);
+        topic->n_subscribers--;
+        pthread_mutex_unlock(&topic->lock);
+    }
+
+    while ((msg = lwan_pubsub_consume(sub)))
+        lwan_pubsub_msg_done(msg);
+
+    close(sub->notify_fd[0]);
+    if (sub->notify_fd[1] != sub->notify_fd[0])
+        close(sub->notify_fd[1]);
+    free(sub);
+}
+
+int lwan_pubsub_get_notification_fd(struct lwan_pubsub_subscriber *sub)
+{
+    return sub->notify_fd[0];
+}
+
+static void drain_notifications(struct lwan_pubsub_subscriber *sub)
+{
+    char buffer[64];
+
+    while (read(sub->notify_fd[0], buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+struct msg_batch {
+    struct lwan_pubsub_msg *msgs[MAX_MSGS_PER_WRITE];
+    int count;
+};
+
+static void release_batch(void *data)
+{
+    struct msg_batch *batch = data;
+
+    for (int i = 0; i < batch->count; i++)
+        lwan_pubsub_msg_done(batch->msgs[i]);
+}
+
+bool lwan_response_send_pubsub(struct lwan_request *request,
+                               struct lwan_pubsub_subscriber *sub,
+                               unsigned int timeout_ms)
+{
+    struct coro *coro = request->conn->coro;
+    struct iovec vec[MAX_MSGS_PER_WRITE];
+    struct msg_batch batch = {.count = 0};
+    struct lwan_pubsub_msg *msg;
+
+    msg = lwan_pubsub_consume(sub);
+    if (!msg) {
+        /* Reset the notification before looking at the queue again, so
+         * that a message published right after that isn't missed. */
+        drain_notifications(sub);
+
+        msg = lwan_pubsub_consume(sub);
+        if (!msg) {
+            if (!lwan_request_await_read(request, sub->notify_fd[0],
+                                         timeout_ms))
+                return false;
+
+            msg = lwan_pubsub_consume(sub);
+            if (!msg)
+                return false;
+        }
+    }
+
+    do {
+        vec[batch.count].iov_base = msg->value.value;
+        vec[batch.count].iov_len = msg->value.len;
+        batch.msgs[batch.count++] = msg;
+    } while (batch.count < MAX_MSGS_PER_WRITE &&
+             (msg = lwan_pubsub_consume(sub)));
+
+    /* The coroutine is aborted if the client goes away while the batch is
+     * being written; the references are given back either way. */
+    size_t generation = coro_deferred_get_generation(coro);
+    coro_defer(coro, release_batch, &batch);
+
+    lwan_writev(request, vec, batch.count);
+
+    coro_deferred_run(coro, generation);
+
+    /* Let other connections in this thread run, like
+     * lwan_response_send_event() does. */
+    coro_yield(coro, CONN_CORO_MAY_RESUME);
+
+    return true;
+}
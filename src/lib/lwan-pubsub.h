@@ -0,0 +1,74 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lwan.h"
+
+/* Topics that messages are published to, from any thread, and that any
+ * number of connections (in any I/O thread) can subscribe to.  Messages
+ * are reference-counted buffers shared by all subscribers: a server-sent
+ * event is formatted once, no matter how many clients receive it.
+ *
+ * Each subscriber has a bounded queue; messages that don't fit in it are
+ * dropped for that subscriber only, so a client that stopped reading
+ * can't hold on to more than a queue's worth of messages. */
+struct lwan_pubsub_topic;
+struct lwan_pubsub_subscriber;
+struct lwan_pubsub_msg;
+
+struct lwan_pubsub_topic *lwan_pubsub_new_topic(void);
+void lwan_pubsub_free_topic(struct lwan_pubsub_topic *topic);
+
+/* Both return false if the message couldn't be allocated.  The second
+ * formats the message as a server-sent event, like
+ * lwan_response_send_event() does. */
+bool lwan_pubsub_publish(struct lwan_pubsub_topic *topic,
+                         const void *contents,
+                         size_t len);
+bool lwan_pubsub_publish_event(struct lwan_pubsub_topic *topic,
+                               const char *event,
+                               const void *data,
+                               size_t len);
+
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic);
+void lwan_pubsub_unsubscribe(struct lwan_pubsub_subscriber *sub);
+
+/* Messages are taken from the queue by the subscriber with
+ * lwan_pubsub_consume() (NULL if it's empty), and given back with
+ * lwan_pubsub_msg_done() once they're not needed anymore.  The
+ * notification file descriptor becomes readable when something is
+ * published to an empty queue, and can be waited on with
+ * lwan_request_await_read(). */
+struct lwan_pubsub_msg *lwan_pubsub_consume(struct lwan_pubsub_subscriber *sub);
+const struct lwan_value *lwan_pubsub_msg_value(const struct lwan_pubsub_msg *msg);
+void lwan_pubsub_msg_done(struct lwan_pubsub_msg *msg);
+int lwan_pubsub_get_notification_fd(struct lwan_pubsub_subscriber *sub);
+
+/* Writes every queued message to the client, as is, waiting up to
+ * timeout_ms for one to be published if the queue is empty.  Returns
+ * false if nothing was written.  For server-sent events, call
+ * lwan_response_set_event_stream() beforehand. */
+bool lwan_response_send_pubsub(struct lwan_request *request,
+                               struct lwan_pubsub_subscriber *sub,
+                               unsigned int timeout_ms);
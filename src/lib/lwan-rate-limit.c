@@ -0,0 +1,200 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "lwan-private.h"
+#include "lwan-rate-limit.h"
+
+/* Each shard is a set-associative table: an address can only live in one
+ * of the SHARD_WAYS buckets of its set, and when the set is full, the
+ * bucket that has been idle for longest is reused.  A reused bucket starts
+ * full, so forgetting a client can only ever let it through. */
+#define SHARD_SETS 1024
+#define SHARD_WAYS 4
+
+/* Tokens are kept in thousandths, so that refilling at N requests per
+ * second is adding N per elapsed millisecond. */
+#define TOKEN 1000u
+
+struct bucket {
+    uint64_t addr[2];
+    uint32_t last_ms;
+    uint32_t tokens;
+};
+
+struct shard {
+    struct bucket sets[SHARD_SETS][SHARD_WAYS];
+};
+
+struct lwan_rate_limit *lwan_rate_limit_new(unsigned int requests_per_second,
+                                            unsigned int burst)
+{
+    struct lwan_rate_limit *rl;
+
+    if (!requests_per_second)
+        return NULL;
+
+    rl = malloc(sizeof(*rl));
+    if (!rl)
+        return NULL;
+
+    if (pthread_key_create(&rl->shard_key, free)) {
+        free(rl);
+        return NULL;
+    }
+
+    rl->requests_per_second = requests_per_second;
+    rl->burst = burst ? burst : requests_per_second;
+    if (rl->burst > UINT32_MAX / TOKEN)
+        rl->burst = UINT32_MAX / TOKEN;
+
+    return rl;
+}
+
+void lwan_rate_limit_free(struct lwan_rate_limit *rl)
+{
+    if (rl) {
+        /* Shards are freed by the I/O threads as they exit. */
+        pthread_key_delete(rl->shard_key);
+        free(rl);
+    }
+}
+
+static bool get_address(struct lwan_request *request, uint64_t addr[2])
+{
+    struct sockaddr_storage storage;
+    const struct sockaddr_storage *sa = &storage;
+
+    if (UNLIKELY(!lwan_request_get_remote_sockaddr(request, &storage)))
+        return false;
+
+    switch (sa->ss_family) {
+    case AF_INET: {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+
+        addr[0] = 0;
+        addr[1] = 0xffff00000000ull | sin->sin_addr.s_addr;
+        return true;
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+        memcpy(addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+        return true;
+    }
+    default:
+        /* Unix sockets, or a PROXY header with an unspecified address:
+         * nothing to tell clients apart with. */
+        return false;
+    }
+}
+
+static ALWAYS_INLINE uint32_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 +
+                      (uint64_t)ts.tv_nsec / 1000000);
+}
+
+static ALWAYS_INLINE unsigned int set_index(const uint64_t addr[2])
+{
+    uint64_t h = (addr[0] ^ (addr[1] * 0x9e3779b97f4a7c15ull)) *
+                 0xff51afd7ed558ccdull;
+
+    return (unsigned int)(h >> 32) % SHARD_SETS;
+}
+
+static struct shard *get_shard(struct lwan_rate_limit *rl)
+{
+    struct shard *shard = pthread_getspecific(rl->shard_key);
+
+    if (UNLIKELY(!shard)) {
+        shard = calloc(1, sizeof(*shard));
+        if (UNLIKELY(!shard))
+            return NULL;
+
+        if (UNLIKELY(pthread_setspecific(rl->shard_key, shard))) {
+            free(shard);
+            return NULL;
+        }
+    }
+
+    return shard;
+}
+
+bool lwan_rate_limit_allow(struct lwan_rate_limit *rl,
+                           struct lwan_request *request)
+{
+    struct bucket *set, *bucket;
+    struct shard *shard;
+    uint64_t addr[2];
+    uint64_t tokens;
+    uint32_t now;
+
+    if (UNLIKELY(!get_address(request, addr)))
+        return true;
+
+    shard = get_shard(rl);
+    if (UNLIKELY(!shard))
+        return true;
+
+    now = now_ms();
+    set = shard->sets[set_index(addr)];
+    bucket = &set[0];
+
+    for (int way = 0; way < SHARD_WAYS; way++) {
+        if (set[way].addr[0] == addr[0] && set[way].addr[1] == addr[1]) {
+            bucket = &set[way];
+            goto found;
+        }
+
+        if (now - set[way].last_ms > now - bucket->last_ms)
+            bucket = &set[way];
+    }
+
+    bucket->addr[0] = addr[0];
+    bucket->addr[1] = addr[1];
+    bucket->tokens = rl->burst * TOKEN;
+    bucket->last_ms = now;
+
+found:
+    tokens = bucket->tokens +
+             (uint64_t)(now - bucket->last_ms) * rl->requests_per_second;
+    if (tokens > rl->burst * TOKEN)
+        tokens = rl->burst * TOKEN;
+
+    bucket->last_ms = now;
+
+    if (tokens < TOKEN) {
+        bucket->tokens = (uint32_t)tokens;
+        return false;
+    }
+
+    bucket->tokens = (uint32_t)(tokens - TOKEN);
+    return true;
+}
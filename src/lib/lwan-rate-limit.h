@@ -0,0 +1,42 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "lwan.h"
+
+/* Token buckets keyed by the client address (as given by the PROXY
+ * protocol header, if any).  Each I/O thread has its own table, so
+ * checking a bucket takes no locks nor atomic operations; a client is
+ * limited per thread handling its connections. */
+struct lwan_rate_limit {
+    pthread_key_t shard_key;
+    unsigned int requests_per_second;
+    unsigned int burst;
+};
+
+struct lwan_rate_limit *lwan_rate_limit_new(unsigned int requests_per_second,
+                                            unsigned int burst);
+void lwan_rate_limit_free(struct lwan_rate_limit *rl);
+
+bool lwan_rate_limit_allow(struct lwan_rate_limit *rl,
+                           struct lwan_request *request);
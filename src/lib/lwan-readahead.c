@@ -0,0 +1,252 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(HAS_EVENTFD)
+#include <sys/eventfd.h>
+#endif
+
+#include "lwan-private.h"
+#include "lwan-status.h"
+#include "list.h"
+
+/* O_NONBLOCK means nothing for regular files, so sendfile() blocks the
+ * I/O thread (and every connection it handles) whenever what it's about
+ * to send isn't in the page cache.  Parts of files that aren't are read
+ * by these workers instead, while the coroutine waits for them. */
+#define READAHEAD_WORKERS 2
+#define READAHEAD_WAIT_TIMEOUT_MS 1000
+
+struct readahead_job {
+    struct list_node queue;
+    /* A dup() of the file being sent, as the coroutine (and whatever
+     * keeps the file open for it) can go away while the worker reads. */
+    int fd;
+    off_t offset;
+    size_t count;
+    int done_fd[2];
+    int done;
+    int refs;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head queue;
+    pthread_t threads[READAHEAD_WORKERS];
+    int n_threads;
+    bool shutting_down;
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .queue = LIST_HEAD_INIT(workers.queue),
+};
+
+static void readahead_job_unref(void *data)
+{
+    struct readahead_job *job = data;
+
+    if (ATOMIC_DEC(job->refs))
+        return;
+
+    close(job->fd);
+    close(job->done_fd[0]);
+    if (job->done_fd[1] != job->done_fd[0])
+        close(job->done_fd[1]);
+    free(job);
+}
+
+static struct readahead_job *
+readahead_job_new(int fd, off_t offset, size_t count)
+{
+    struct readahead_job *job = malloc(sizeof(*job));
+
+    if (UNLIKELY(!job))
+        return NULL;
+
+    job->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (UNLIKELY(job->fd < 0))
+        goto error_no_fd;
+
+#if defined(HAS_EVENTFD)
+    job->done_fd[0] = job->done_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (UNLIKELY(job->done_fd[0] < 0))
+        goto error_no_done_fd;
+#else
+    if (UNLIKELY(pipe2(job->done_fd, O_NONBLOCK | O_CLOEXEC) < 0))
+        goto error_no_done_fd;
+#endif
+
+    job->offset = offset;
+    job->count = count;
+    job->done = 0;
+    /* One for the worker, one for the coroutine waiting for it. */
+    job->refs = 2;
+
+    return job;
+
+error_no_done_fd:
+    close(job->fd);
+error_no_fd:
+    free(job);
+    return NULL;
+}
+
+static void *readahead_worker(void *data __attribute__((unused)))
+{
+    struct readahead_job *job;
+
+    while (true) {
+        pthread_mutex_lock(&workers.lock);
+        while (!(job = list_pop(&workers.queue, struct readahead_job, queue)) &&
+               !workers.shutting_down)
+            pthread_cond_wait(&workers.cond, &workers.lock);
+        pthread_mutex_unlock(&workers.lock);
+
+        if (!job)
+            return NULL;
+
+        /* readahead() only queues the reads; reading the last byte waits
+         * for them, as they're done in order. */
+        char byte;
+        readahead(job->fd, job->offset, job->count);
+        if (UNLIKELY(pread(job->fd, &byte, 1,
+                           job->offset + (off_t)job->count - 1) < 0))
+            lwan_status_perror("pread");
+
+        const uint64_t event = 1;
+        ATOMIC_INC(job->done);
+        if (UNLIKELY(write(job->done_fd[1], &event, sizeof(event)) < 0))
+            lwan_status_perror("write");
+
+        readahead_job_unref(job);
+    }
+}
+
+static bool readahead_job_submit(struct readahead_job *job)
+{
+    bool submitted;
+
+    pthread_mutex_lock(&workers.lock);
+    submitted = workers.n_threads > 0 && !workers.shutting_down;
+    if (submitted) {
+        list_add_tail(&workers.queue, &job->queue);
+        pthread_cond_signal(&workers.cond);
+    }
+    pthread_mutex_unlock(&workers.lock);
+
+    return submitted;
+}
+
+/* Only the first and the last pages are looked at: the kernel reads
+ * files sequentially, so the ones in between are most likely there too.
+ * Filesystems that can't tell are assumed to have everything cached, as
+ * before. */
+static bool is_resident(int fd, off_t offset, size_t count)
+{
+#if defined(HAS_PREADV2) && defined(RWF_NOWAIT)
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+
+    if (preadv2(fd, &iov, 1, offset, RWF_NOWAIT) < 0 && errno == EAGAIN)
+        return false;
+    if (count > 1 && preadv2(fd, &iov, 1, offset + (off_t)count - 1,
+                             RWF_NOWAIT) < 0 && errno == EAGAIN)
+        return false;
+#endif
+
+    return true;
+}
+
+void lwan_readahead_wait(struct lwan_request *request,
+                         int fd,
+                         off_t offset,
+                         size_t count)
+{
+    struct coro *coro = request->conn->coro;
+    struct readahead_job *job;
+    size_t generation;
+
+    if (LIKELY(!count || is_resident(fd, offset, count)))
+        return;
+
+    job = readahead_job_new(fd, offset, count);
+    if (UNLIKELY(!job))
+        return;
+    if (UNLIKELY(!readahead_job_submit(job))) {
+        job->refs = 1;
+        readahead_job_unref(job);
+        return;
+    }
+
+    generation = coro_deferred_get_generation(coro);
+    coro_defer(coro, readahead_job_unref, job);
+
+    while (!ATOMIC_READ(job->done)) {
+        if (!lwan_request_await_read(request, job->done_fd[0],
+                                     READAHEAD_WAIT_TIMEOUT_MS))
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+    }
+
+    coro_deferred_run(coro, generation);
+}
+
+void lwan_readahead_init(void)
+{
+    pthread_mutex_lock(&workers.lock);
+
+    workers.shutting_down = false;
+    for (; workers.n_threads < READAHEAD_WORKERS; workers.n_threads++) {
+        if (pthread_create(&workers.threads[workers.n_threads], NULL,
+                           readahead_worker, NULL)) {
+            lwan_status_perror("Could not create readahead worker");
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&workers.lock);
+}
+
+void lwan_readahead_shutdown(void)
+{
+    struct readahead_job *job;
+
+    pthread_mutex_lock(&workers.lock);
+    workers.shutting_down = true;
+    pthread_cond_broadcast(&workers.cond);
+    pthread_mutex_unlock(&workers.lock);
+
+    for (int i = 0; i < workers.n_threads; i++)
+        pthread_join(workers.threads[i], NULL);
+    workers.n_threads = 0;
+
+    /* Whoever was waiting for these is gone by now. */
+    while ((job = list_pop(&workers.queue, struct readahead_job, queue)))
+        readahead_job_unref(job);
+}
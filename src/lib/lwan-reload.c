@@ -0,0 +1,389 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libproc.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "lwan-private.h"
+#include "sd-daemon.h"
+
+/* How long a new process has to get to lwan_main_loop() before it is
+ * considered broken (and killed), with the old one still serving. */
+#define SUCCESSOR_READY_TIMEOUT_MS 30000
+
+#define READY_FD_ENV "LWAN_READY_FD"
+
+static char **read_own_argv(char **buffer_out)
+{
+    size_t len = 0, size = 4096;
+    char *buffer = malloc(size);
+    char **argv;
+    size_t argc = 0;
+    ssize_t n;
+    int fd;
+
+    if (!buffer)
+        return NULL;
+
+    fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        goto free_buffer;
+
+    while ((n = read(fd, buffer + len, size - len - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            goto free_buffer;
+        }
+
+        len += (size_t)n;
+        if (len == size - 1) {
+            char *tmp = realloc(buffer, size * 2);
+            if (!tmp) {
+                close(fd);
+                goto free_buffer;
+            }
+            buffer = tmp;
+            size *= 2;
+        }
+    }
+    close(fd);
+
+    if (!len)
+        goto free_buffer;
+    buffer[len] = '\0';
+
+    for (size_t i = 0; i < len; i++)
+        argc += buffer[i] == '\0';
+
+    argv = calloc(argc + 1, sizeof(char *));
+    if (!argv)
+        goto free_buffer;
+
+    for (size_t i = 0, arg = 0; i < len; i += strlen(buffer + i) + 1)
+        argv[arg++] = buffer + i;
+
+    *buffer_out = buffer;
+    return argv;
+
+free_buffer:
+    free(buffer);
+    return NULL;
+}
+
+static bool is_own_variable(const char *var)
+{
+    return !strncmp(var, "LISTEN_PID=", sizeof("LISTEN_PID=") - 1) ||
+           !strncmp(var, "LISTEN_FDS=", sizeof("LISTEN_FDS=") - 1) ||
+           !strncmp(var, "LISTEN_FDNAMES=", sizeof("LISTEN_FDNAMES=") - 1) ||
+           !strncmp(var, READY_FD_ENV "=", sizeof(READY_FD_ENV "=") - 1);
+}
+
+/* Everything that reaches the new process is prepared before fork(), as
+ * only async-signal-safe functions can be used in the child.  The PID in
+ * LISTEN_PID is only known afterwards, so room is left to write it. */
+struct successor_env {
+    char **envp;
+    char listen_pid[sizeof("LISTEN_PID=") + 3 * sizeof(pid_t)];
+    char ready_fd[sizeof(READY_FD_ENV "=") + 3 * sizeof(int)];
+};
+
+static bool build_env(struct successor_env *env, bool pass_socket, int ready_fd)
+{
+    extern char **environ;
+    size_t n_vars = 0, i = 0;
+
+    for (char **var = environ; *var; var++)
+        n_vars++;
+
+    env->envp = calloc(n_vars + 4, sizeof(char *));
+    if (!env->envp)
+        return false;
+
+    for (char **var = environ; *var; var++) {
+        if (!is_own_variable(*var))
+            env->envp[i++] = *var;
+    }
+
+    snprintf(env->ready_fd, sizeof(env->ready_fd), READY_FD_ENV "=%d",
+             ready_fd);
+    env->envp[i++] = env->ready_fd;
+
+    if (pass_socket) {
+        strcpy(env->listen_pid, "LISTEN_PID=");
+        env->envp[i++] = env->listen_pid;
+        env->envp[i++] = "LISTEN_FDS=1";
+    }
+
+    return true;
+}
+
+static void write_pid(char *dest, pid_t pid)
+{
+    char digits[3 * sizeof(pid_t)];
+    size_t n = 0;
+
+    do {
+        digits[n++] = (char)('0' + pid % 10);
+        pid /= 10;
+    } while (pid);
+
+    while (n)
+        *dest++ = digits[--n];
+    *dest = '\0';
+}
+
+/* proc_pidpath() gives the path the binary was executed as (or, failing
+ * that, what /proc/self/exe points to), so that an upgraded binary
+ * installed at the same path is picked up.  If the name came from
+ * /proc/self/exe and the binary has been replaced, the kernel appends
+ * " (deleted)" to it. */
+static bool executable_path(char *path, size_t size)
+{
+    static const char deleted[] = " (deleted)";
+    size_t len;
+
+    if (proc_pidpath(getpid(), path, size) < 0)
+        return false;
+
+    len = strlen(path);
+    if (len > sizeof(deleted) - 1 &&
+        streq(path + len - (sizeof(deleted) - 1), deleted))
+        path[len - (sizeof(deleted) - 1)] = '\0';
+
+    return true;
+}
+
+static void __attribute__((noreturn))
+exec_successor(struct lwan *l,
+               const char *path,
+               char **argv,
+               struct successor_env *env)
+{
+    sigset_t mask;
+
+    if (l->main_socket >= 0) {
+        if (l->main_socket == SD_LISTEN_FDS_START) {
+            int flags = fcntl(l->main_socket, F_GETFD);
+
+            if (flags < 0 ||
+                fcntl(l->main_socket, F_SETFD, flags & ~FD_CLOEXEC) < 0)
+                _exit(127);
+        } else if (dup2(l->main_socket, SD_LISTEN_FDS_START) < 0) {
+            _exit(127);
+        }
+
+        write_pid(env->listen_pid + sizeof("LISTEN_PID=") - 1, getpid());
+    }
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    execve(path, argv, env->envp);
+    _exit(127);
+}
+
+static void kill_successor(struct lwan_successor *successor)
+{
+    int status;
+
+    kill(successor->pid, SIGKILL);
+    while (waitpid(successor->pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    close(successor->ready_fd);
+    successor->ready_fd = -1;
+}
+
+int lwan_reload_successor_timeout(const struct lwan_successor *successor)
+{
+    unsigned long long now = lwan_monotonic_ns();
+
+    if (now >= successor->deadline_ns)
+        return 0;
+
+    /* Rounded up, so that poll() doesn't return right before it. */
+    return (int)((successor->deadline_ns - now + 999999) / 1000000);
+}
+
+bool lwan_reload_successor_ready(struct lwan_successor *successor)
+{
+    struct pollfd pfd = {.fd = successor->ready_fd, .events = POLLIN};
+    char ready;
+    ssize_t n;
+
+    if (poll(&pfd, 1, 0) <= 0) {
+        lwan_status_error("New process didn't become ready in time");
+        goto kill;
+    }
+
+    do {
+        n = read(successor->ready_fd, &ready, 1);
+    } while (n < 0 && errno == EINTR);
+
+    if (n == 1) {
+        close(successor->ready_fd);
+        successor->ready_fd = -1;
+        return true;
+    }
+
+    /* Hung up without writing anything: it died before getting ready,
+     * probably because of an invalid configuration. */
+    lwan_status_error("New process exited before becoming ready");
+
+kill:
+    kill_successor(successor);
+    return false;
+}
+
+bool lwan_reload_wait_for_successor(struct lwan_successor *successor)
+{
+    struct pollfd pfd = {.fd = successor->ready_fd, .events = POLLIN};
+
+    while (poll(&pfd, 1, lwan_reload_successor_timeout(successor)) < 0) {
+        if (errno != EINTR) {
+            lwan_status_perror("poll");
+            kill_successor(successor);
+            return false;
+        }
+    }
+
+    return lwan_reload_successor_ready(successor);
+}
+
+void lwan_reload_abandon_successor(struct lwan_successor *successor)
+{
+    if (successor->ready_fd >= 0) {
+        lwan_status_info("Stopping new process (PID %d)", successor->pid);
+        kill_successor(successor);
+    }
+}
+
+bool lwan_reload_spawn_successor(struct lwan *l,
+                                 struct lwan_successor *successor)
+{
+    struct successor_env env;
+    char path[PATH_MAX];
+    char *argv_buffer;
+    char **argv;
+    int ready_pipe[2];
+    int ready_fd;
+    bool ret = false;
+    pid_t pid;
+
+    if (!executable_path(path, sizeof(path))) {
+        lwan_status_perror("Could not obtain path to executable");
+        return false;
+    }
+
+    argv = read_own_argv(&argv_buffer);
+    if (!argv) {
+        lwan_status_perror("Could not read command line of this process");
+        return false;
+    }
+
+    if (pipe2(ready_pipe, O_CLOEXEC) < 0) {
+        lwan_status_perror("pipe2");
+        goto free_argv;
+    }
+
+    /* A copy without FD_CLOEXEC, that can't be at the position the
+     * listening socket is going to be passed in. */
+    ready_fd = fcntl(ready_pipe[1], F_DUPFD, SD_LISTEN_FDS_START + 1);
+    if (ready_fd < 0) {
+        lwan_status_perror("fcntl");
+        goto close_pipe;
+    }
+
+    if (!build_env(&env, l->main_socket >= 0, ready_fd)) {
+        lwan_status_error("Could not build environment for new process");
+        goto close_ready_fd;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        lwan_status_perror("fork");
+        goto free_env;
+    }
+    if (pid == 0)
+        exec_successor(l, path, argv, &env);
+
+    close(ready_fd);
+    ready_fd = -1;
+    close(ready_pipe[1]);
+    ready_pipe[1] = -1;
+
+    lwan_status_info("Waiting for new process (PID %d) to become ready", pid);
+    *successor = (struct lwan_successor){
+        .pid = pid,
+        .ready_fd = ready_pipe[0],
+        .deadline_ns = lwan_monotonic_ns() +
+                       SUCCESSOR_READY_TIMEOUT_MS * 1000000ull,
+    };
+    ready_pipe[0] = -1;
+    ret = true;
+
+free_env:
+    free(env.envp);
+close_ready_fd:
+    if (ready_fd >= 0)
+        close(ready_fd);
+close_pipe:
+    if (ready_pipe[0] >= 0)
+        close(ready_pipe[0]);
+    if (ready_pipe[1] >= 0)
+        close(ready_pipe[1]);
+free_argv:
+    free(argv);
+    free(argv_buffer);
+
+    return ret;
+}
+
+void lwan_reload_notify_predecessor(void)
+{
+    const char *ready_fd_str = getenv(READY_FD_ENV);
+    char *end;
+    long fd;
+
+    if (!ready_fd_str)
+        return;
+
+    errno = 0;
+    fd = strtol(ready_fd_str, &end, 10);
+    unsetenv(READY_FD_ENV);
+    if (errno || *end || fd <= STDERR_FILENO || fd > INT_MAX)
+        return;
+
+    if (write((int)fd, "", 1) < 0)
+        lwan_status_perror("Could not notify previous process");
+    close((int)fd);
+}
@@ -24,36 +24,59 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "lwan-private.h"
 
 #include "lwan-config.h"
+#include "lwan-h2.h"
 #include "lwan-http-authorize.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-json.h"
+#include "lwan-lazy-module.h"
+#include "lwan-micro-cache.h"
+#include "lwan-rate-limit.h"
+#include "lwan-timer-wheel.h"
+#include "lwan-trace.h"
+#include "lwan-uring.h"
+#include "lwan-vhost.h"
 
 enum lwan_read_finalizer {
     FINALIZER_DONE,
     FINALIZER_TRY_AGAIN,
     FINALIZER_YIELD_TRY_AGAIN,
     FINALIZER_ERROR_TOO_LARGE,
-    FINALIZER_ERROR_TIMEOUT
 };
 
 struct request_parser_helper {
-    struct lwan_value *buffer;
+    struct lwan_value *buffer;		/* The current request */
     char *next_request;			/* For pipelined requests */
+    size_t scanned;			/* How much of buffer was searched for CRLFCRLF */
+    struct lwan_value headers;		/* Whole header block */
     struct lwan_value accept_encoding;
+    short accept_encoding_qvalue[4];	/* Indexed by encoding_index() */
     struct lwan_value if_modified_since;
+    struct lwan_value if_none_match;
     struct lwan_value range;
+    struct lwan_range ranges[MAX_RANGES];
     struct lwan_value cookie;
+    struct lwan_value host;
 
     struct lwan_value query_string;
     struct lwan_value fragment;
@@ -62,9 +85,12 @@ struct request_parser_helper {
 
     struct lwan_value post_data;
     struct lwan_value content_type;
+    struct lwan_json *json_body;
+    size_t body_remaining;		/* Unread body, when streaming it */
+    size_t body_length;
+    bool body_streamed;
 
-    time_t error_when_time;
-    int error_when_n_packets;
+    struct lwan_deadline deadline;
     int urls_rewritten;
     char connection;
 };
@@ -396,28 +422,55 @@ identity_decode(char *input __attribute__((unused)))
     return 1;
 }
 
+/*
+ * Query strings, cookies and POST data are only parsed (and thus decoded
+ * and sorted) the first time a handler asks for them.  The helper, pointed
+ * to by request->helper, lives until the handler returns.
+ */
 static void
-parse_cookies(struct lwan_request *request, struct request_parser_helper *helper)
+parse_cookies(struct lwan_request *request)
 {
+    struct request_parser_helper *helper = request->helper;
+
+    if (request->flags & REQUEST_PARSED_COOKIES)
+        return;
+    request->flags |= REQUEST_PARSED_COOKIES;
+
+    if (UNLIKELY(!helper))
+        return;
+
     parse_key_values(request, &helper->cookie, &request->cookies,
         identity_decode, ';');
 }
 
 static void
-parse_query_string(struct lwan_request *request, struct request_parser_helper *helper)
+parse_query_string(struct lwan_request *request)
 {
+    struct request_parser_helper *helper = request->helper;
+
+    if (request->flags & REQUEST_PARSED_QUERY_STRING)
+        return;
+    request->flags |= REQUEST_PARSED_QUERY_STRING;
+
+    if (UNLIKELY(!helper))
+        return;
+
     parse_key_values(request, &helper->query_string, &request->query_params,
         url_decode, '&');
 }
 
 static void
-parse_post_data(struct lwan_request *request, struct request_parser_helper *helper)
+parse_post_data(struct lwan_request *request)
 {
     static const char content_type[] = "application/x-www-form-urlencoded";
+    struct request_parser_helper *helper = request->helper;
 
-    request->header.body = &helper->post_data;
-    request->header.content_type = &helper->content_type;
+    if (request->flags & REQUEST_PARSED_POST_DATA)
+        return;
+    request->flags |= REQUEST_PARSED_POST_DATA;
 
+    if (UNLIKELY(!helper))
+        return;
     if (helper->content_type.len < sizeof(content_type) - 1)
         return;
     if (UNLIKELY(strncmp(helper->content_type.value, content_type, sizeof(content_type) - 1)))
@@ -451,6 +504,44 @@ parse_fragment_and_query(struct lwan_request *request,
     }
 }
 
+/*
+ * Finds the first occurrence of c in [p, end).  Request and header lines
+ * are short, so the first 64 bytes are scanned inline, 16 bytes at a time,
+ * avoiding the cost of calling memchr() for each line.  SSE2 and NEON are
+ * always available on x86-64 and AArch64, so no runtime check is needed;
+ * longer lines are left to memchr(), which already picks the widest
+ * vector instructions the CPU supports.
+ */
+static ALWAYS_INLINE char *
+find_byte(char *p, char *end, char c)
+{
+#if defined(__x86_64__)
+    const __m128i needle = _mm_set1_epi8(c);
+
+    for (int i = 0; i < 4 && end - p >= 16; i++, p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+        if (mask)
+            return p + __builtin_ctz((unsigned int)mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+
+    for (int i = 0; i < 4 && end - p >= 16; i++, p += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)p), needle);
+        /* Narrow each byte of the comparison result to a nibble. */
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+
+    return memchr(p, c, (size_t)(end - p));
+}
+
 static char *
 identify_http_path(struct lwan_request *request, char *buffer,
             struct request_parser_helper *helper)
@@ -461,8 +552,8 @@ identify_http_path(struct lwan_request *request, char *buffer,
     if (UNLIKELY(*buffer != '/'))
         return NULL;
 
-    end_of_line = memchr(buffer, '\r',
-        (helper->buffer->len - (size_t)(buffer - helper->buffer->value)));
+    end_of_line = find_byte(buffer,
+        helper->buffer->value + helper->buffer->len, '\r');
     if (UNLIKELY(!end_of_line))
         return NULL;
     if (UNLIKELY((size_t)(end_of_line - buffer) < minimal_request_line_len))
@@ -501,7 +592,7 @@ identify_http_path(struct lwan_request *request, char *buffer,
             goto did_not_match; \
         p += 2; \
         \
-        char *end = strchr(p, '\r'); \
+        char *end = find_byte(p, buffer_end, '\r'); \
         if (UNLIKELY(!end)) \
             goto did_not_match; \
         \
@@ -563,10 +654,18 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
             helper->cookie.value = value;
             helper->cookie.len = length;
             break;
+        CASE_HEADER(MULTICHAR_CONSTANT_L('H','o','s','t'), "Host")
+            helper->host.value = value;
+            helper->host.len = length;
+            break;
         CASE_HEADER(MULTICHAR_CONSTANT_L('I','f','-','M'), "If-Modified-Since")
             helper->if_modified_since.value = value;
             helper->if_modified_since.len = length;
             break;
+        CASE_HEADER(MULTICHAR_CONSTANT_L('I','f','-','N'), "If-None-Match")
+            helper->if_none_match.value = value;
+            helper->if_none_match.len = length;
+            break;
         CASE_HEADER(MULTICHAR_CONSTANT_L('R','a','n','g'), "Range")
             helper->range.value = value;
             helper->range.len = length;
@@ -580,7 +679,7 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
             }
         }
 did_not_match:
-        p = memchr(p, '\n', (size_t)(buffer_end - p));
+        p = find_byte(p, buffer_end, '\n');
         if (!p)
             break;
     }
@@ -591,6 +690,18 @@ did_not_match:
 #undef CASE_HEADER
 #undef MATCH_HEADER
 
+/* Runs the header parser over a header block that's already in memory,
+ * without a connection around it, so that microbench can measure it.  The
+ * buffer is modified just like a request buffer would be. */
+ssize_t
+lwan_parse_headers_for_benchmark(char *buffer, size_t len)
+{
+    struct request_parser_helper helper = {};
+    char *end = parse_headers(&helper, buffer, buffer + len);
+
+    return end ? end - buffer : -1;
+}
+
 static void
 parse_if_modified_since(struct lwan_request *request, struct request_parser_helper *helper)
 {
@@ -605,54 +716,269 @@ parse_if_modified_since(struct lwan_request *request, struct request_parser_help
     request->header.if_modified_since = parsed;
 }
 
+static bool
+parse_range_offset(const char **p, const char *end, off_t *offset)
+{
+    const char *q = *p;
+    off_t value = 0;
+
+    for (; q < end && *q >= '0' && *q <= '9'; q++) {
+        if (UNLIKELY(__builtin_mul_overflow(value, 10, &value) ||
+                     __builtin_add_overflow(value, *q - '0', &value)))
+            return false;
+    }
+    if (q == *p)
+        return false;
+
+    *p = q;
+    *offset = value;
+    return true;
+}
+
+static bool
+parse_range_spec(const char **p, const char *end, struct lwan_range *range)
+{
+    if (**p == '-') {
+        (*p)++;
+        range->from = 0;
+        return parse_range_offset(p, end, &range->to);
+    }
+
+    if (!parse_range_offset(p, end, &range->from))
+        return false;
+    if (*p == end || **p != '-')
+        return false;
+    (*p)++;
+
+    if (*p == end || **p < '0' || **p > '9') {
+        range->to = -1;
+        return true;
+    }
+    return parse_range_offset(p, end, &range->to);
+}
+
 static void
 parse_range(struct lwan_request *request, struct request_parser_helper *helper)
 {
     if (UNLIKELY(helper->range.len <= (sizeof("bytes=") - 1)))
         return;
 
-    char *range = helper->range.value;
+    const char *range = helper->range.value;
     if (UNLIKELY(strncmp(range, "bytes=", sizeof("bytes=") - 1)))
         return;
 
+    const char *end = range + helper->range.len;
+    size_t n_ranges = 0;
+
     range += sizeof("bytes=") - 1;
-    off_t from, to;
-
-    if (sscanf(range, "%"SCNu64"-%"SCNu64, &from, &to) == 2) {
-        request->header.range.from = from;
-        request->header.range.to = to;
-    } else if (sscanf(range, "-%"SCNu64, &to) == 1) {
-        request->header.range.from = 0;
-        request->header.range.to = to;
-    } else if (sscanf(range, "%"SCNu64"-", &from) == 1) {
-        request->header.range.from = from;
-        request->header.range.to = -1;
-    } else {
-        request->header.range.from = -1;
-        request->header.range.to = -1;
+    while (true) {
+        while (range < end &&
+               (*range == ' ' || *range == '\t' || *range == ','))
+            range++;
+        if (range == end)
+            break;
+
+        if (UNLIKELY(n_ranges == MAX_RANGES))
+            goto invalid;
+        if (UNLIKELY(!parse_range_spec(&range, end, &helper->ranges[n_ranges])))
+            goto invalid;
+        n_ranges++;
+
+        while (range < end && (*range == ' ' || *range == '\t'))
+            range++;
+        if (range < end && *range != ',')
+            goto invalid;
+    }
+    if (UNLIKELY(!n_ranges))
+        goto invalid;
+
+    request->header.range = helper->ranges[0];
+    request->header.ranges = helper->ranges;
+    request->header.n_ranges = n_ranges;
+    return;
+
+invalid:
+    request->header.range.from = -1;
+    request->header.range.to = -1;
+}
+
+static const enum lwan_request_flags accept_encoding_flags[] = {
+    REQUEST_ACCEPT_DEFLATE,
+    REQUEST_ACCEPT_GZIP,
+    REQUEST_ACCEPT_BROTLI,
+    REQUEST_ACCEPT_ZSTD,
+};
+
+static int encoding_index(enum lwan_request_flags encoding)
+{
+    for (size_t i = 0; i < N_ELEMENTS(accept_encoding_flags); i++) {
+        if (accept_encoding_flags[i] == encoding)
+            return (int)i;
     }
+
+    return -1;
+}
+
+/* Parses a qvalue ("q=0.5") into an integer between 0 and 1000. A missing
+ * or malformed qvalue means 1.0, as per RFC 7231. */
+static short
+parse_qvalue(const char *p, const char *end)
+{
+    int q, digits;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (end - p < 3 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=')
+        return 1000;
+    p += 2;
+
+    if (*p == '1')
+        return 1000;
+    if (*p != '0')
+        return 1000;
+    if (++p == end || *p != '.')
+        return 0;
+
+    for (q = 0, digits = 0, p++; digits < 3; digits++, p++) {
+        q *= 10;
+        if (p < end && lwan_char_isdigit(*p))
+            q += *p - '0';
+    }
+
+    return (short)q;
 }
 
 static void
 parse_accept_encoding(struct lwan_request *request, struct request_parser_helper *helper)
 {
-    if (!helper->accept_encoding.len)
+    const char *p = helper->accept_encoding.value;
+    const char *end = p + helper->accept_encoding.len;
+    short *qvalues = helper->accept_encoding_qvalue;
+    short star = 0;
+
+    for (size_t i = 0; i < N_ELEMENTS(helper->accept_encoding_qvalue); i++)
+        qvalues[i] = -1;
+
+    while (p < end) {
+        const char *comma = memchr(p, ',', (size_t)(end - p));
+        const char *token_end = comma ? comma : end;
+        const char *params = memchr(p, ';', (size_t)(token_end - p));
+        const char *name_end = params ? params : token_end;
+        short q;
+        int index;
+
+        while (p < name_end && (*p == ' ' || *p == '\t'))
+            p++;
+        while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+            name_end--;
+
+        q = params ? parse_qvalue(params + 1, token_end) : 1000;
+
+#define IS_CODING(name_) \
+    ((size_t)(name_end - p) == sizeof(name_) - 1 && \
+     !strncasecmp(p, name_, sizeof(name_) - 1))
+
+        if (IS_CODING("deflate"))
+            index = encoding_index(REQUEST_ACCEPT_DEFLATE);
+        else if (IS_CODING("gzip") || IS_CODING("x-gzip"))
+            index = encoding_index(REQUEST_ACCEPT_GZIP);
+        else if (IS_CODING("br"))
+            index = encoding_index(REQUEST_ACCEPT_BROTLI);
+        else if (IS_CODING("zstd"))
+            index = encoding_index(REQUEST_ACCEPT_ZSTD);
+        else
+            index = -1;
+
+        if (index >= 0)
+            qvalues[index] = q;
+        else if (IS_CODING("*"))
+            star = q;
+
+#undef IS_CODING
+
+        if (!comma)
+            break;
+        p = comma + 1;
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(accept_encoding_flags); i++) {
+        if (qvalues[i] < 0)
+            qvalues[i] = star;
+        if (qvalues[i] > 0)
+            request->flags |= accept_encoding_flags[i];
+    }
+}
+
+int
+lwan_request_get_accept_encoding_qvalue(struct lwan_request *request,
+                                        enum lwan_request_flags encoding)
+{
+    struct request_parser_helper *helper = request->helper;
+    int index;
+
+    if (!(request->flags & encoding))
+        return 0;
+
+    index = encoding_index(encoding);
+    if (UNLIKELY(index < 0 || !helper))
+        return 0;
+
+    return helper->accept_encoding_qvalue[index];
+}
+
+const struct lwan_value *
+lwan_request_get_raw_query_string(struct lwan_request *request)
+{
+    struct request_parser_helper *helper = request->helper;
+
+    /* Parsing query parameters decodes them in place. */
+    if (UNLIKELY(!helper || (request->flags & REQUEST_PARSED_QUERY_STRING)))
+        return NULL;
+
+    return &helper->query_string;
+}
+
+void
+lwan_request_foreach_header(struct lwan_request *request,
+    bool (*callback)(const struct lwan_value *name,
+                     const struct lwan_value *value, void *data),
+    void *data)
+{
+    struct request_parser_helper *helper = request->helper;
+
+    if (UNLIKELY(!helper || !helper->headers.value))
         return;
 
-    for (const char *p = helper->accept_encoding.value; *p; p++) {
-        STRING_SWITCH(p) {
-        case MULTICHAR_CONSTANT('d','e','f','l'):
-        case MULTICHAR_CONSTANT(' ','d','e','f'):
-            request->flags |= REQUEST_ACCEPT_DEFLATE;
-            break;
-        case MULTICHAR_CONSTANT('g','z','i','p'):
-        case MULTICHAR_CONSTANT(' ','g','z','i'):
-            request->flags |= REQUEST_ACCEPT_GZIP;
-            break;
+    char *p = helper->headers.value;
+    char *end = p + helper->headers.len;
+
+    while (p < end) {
+        char *eol = memchr(p, '\n', (size_t)(end - p));
+        char *line_end = eol ? eol : end;
+        char *colon;
+
+        /* Headers picked up by parse_headers() end in a NUL instead
+         * of a carriage return. */
+        if (line_end > p && (line_end[-1] == '\r' || line_end[-1] == '\0'))
+            line_end--;
+
+        colon = memchr(p, ':', (size_t)(line_end - p));
+        if (colon && colon > p) {
+            char *value = colon + 1;
+
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                value++;
+
+            struct lwan_value n = {.value = p, .len = (size_t)(colon - p)};
+            struct lwan_value v = {.value = value,
+                                   .len = (size_t)(line_end - value)};
+            if (!callback(&n, &v, data))
+                return;
         }
 
-        if (!(p = strchr(p, ',')))
+        if (!eol)
             break;
+        p = eol + 1;
     }
 }
 
@@ -672,34 +998,57 @@ compute_keep_alive_flag(struct lwan_request *request, struct request_parser_help
         is_keep_alive = (helper->connection == 'k');
     else
         is_keep_alive = (helper->connection != 'c');
-    if (is_keep_alive)
+    if (is_keep_alive &&
+        LIKELY(!ATOMIC_READ(request->conn->thread->lwan->draining)))
         request->conn->flags |= CONN_KEEP_ALIVE;
     else
         request->conn->flags &= ~CONN_KEEP_ALIVE;
 }
 
+/* HTTP/2 streams share the socket with the connection, that has read
+ * whatever the stream gets to read. */
+static ALWAYS_INLINE ssize_t
+read_socket(struct lwan_request *request, void *buf, size_t count)
+{
+    if (UNLIKELY(request->flags & REQUEST_IS_HTTP_2))
+        return lwan_h2_read(request, buf, count);
+
+#if defined(USE_IO_URING)
+    /* Having waited for the socket, there's most likely something to read
+     * now: batch the read with everything else going through the ring.
+     * Speculative reads, that usually find nothing, stay as they are. */
+    if (request->conn->flags & CONN_MUST_READ)
+        return lwan_uring_recv(request, buf, count);
+#endif
+
+    return read(request->fd, buf, count);
+}
+
+static enum lwan_read_finalizer read_request_finalizer(size_t total_read,
+    size_t buffer_size, struct request_parser_helper *helper);
+
 static enum lwan_http_status read_from_request_socket(struct lwan_request *request,
     struct lwan_value *buffer, struct request_parser_helper *helper, const size_t buffer_size,
-    enum lwan_read_finalizer (*finalizer)(size_t total_read, size_t buffer_size, struct request_parser_helper *helper, int n_packets))
+    enum lwan_read_finalizer (*finalizer)(size_t total_read, size_t buffer_size, struct request_parser_helper *helper))
 {
     ssize_t n;
     size_t total_read = 0;
-    int n_packets = 0;
 
     if (helper->next_request) {
-        buffer->len -= (size_t)(helper->next_request - buffer->value);
-        /* FIXME: This memmove() could be eventually removed if a better
-         * stucture were used for the request buffer. */
-        memmove(buffer->value, helper->next_request, buffer->len);
+        /* Pipelined request: the buffer already starts at it, and might
+         * contain all of it; look before reading anything. */
+        helper->next_request = NULL;
         total_read = buffer->len;
         goto try_to_finalize;
     }
 
-    for (; ; n_packets++) {
-        n = read(request->fd, buffer->value + total_read,
-                    (size_t)(buffer_size - total_read));
+
+    while (true) {
+        n = read_socket(request, buffer->value + total_read,
+                        (size_t)(buffer_size - total_read));
         /* Client has shutdown orderly, nothing else to do; kill coro */
         if (UNLIKELY(n == 0)) {
+            lwan_flush_batch_if_needed(request);
             coro_yield(request->conn->coro, CONN_CORO_ABORT);
             __builtin_unreachable();
         }
@@ -709,7 +1058,29 @@ static enum lwan_http_status read_from_request_socket(struct lwan_request *reque
             case EAGAIN:
             case EINTR:
 yield_and_read_again:
+                /* Idle keep-alive connections are left to the keep-alive
+                 * timeout; the deadline only starts with the first byte. */
+                if (total_read &&
+                    UNLIKELY(!lwan_deadline_wait(&helper->deadline, request,
+                                                 total_read)))
+                    return HTTP_TIMEOUT;
+
+                /* Don't keep responses waiting for the rest of a
+                 * pipelined request. */
+                lwan_flush_batch_if_needed(request);
                 request->conn->flags |= CONN_MUST_READ;
+
+                /* Nothing of the next request yet: the coroutine can be
+                 * trimmed if it takes a while to come. */
+                if (!total_read && !buffer->len &&
+                    finalizer == read_request_finalizer &&
+                    !(request->flags & REQUEST_IS_HTTP_2)) {
+                    request->conn->flags |= CONN_IDLE;
+                    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+                    request->conn->flags &= ~CONN_IDLE;
+                    continue;
+                }
+
                 coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
                 continue;
             }
@@ -727,9 +1098,9 @@ yield_and_read_again:
         buffer->len = (size_t)total_read;
 
 try_to_finalize:
-        switch (finalizer(total_read, buffer_size, helper, n_packets)) {
+        switch (finalizer(total_read, buffer_size, helper)) {
         case FINALIZER_DONE:
-            request->conn->flags &= ~CONN_MUST_READ;
+            request->conn->flags &= ~(CONN_MUST_READ | CONN_HAS_DEADLINE);
             buffer->value[buffer->len] = '\0';
             return HTTP_OK;
         case FINALIZER_TRY_AGAIN:
@@ -738,8 +1109,6 @@ try_to_finalize:
             goto yield_and_read_again;
         case FINALIZER_ERROR_TOO_LARGE:
             return HTTP_TOO_LARGE;
-        case FINALIZER_ERROR_TIMEOUT:
-            return HTTP_TIMEOUT;
         }
     }
 
@@ -750,71 +1119,164 @@ try_to_finalize:
 }
 
 static enum lwan_read_finalizer read_request_finalizer(size_t total_read,
-    size_t buffer_size, struct request_parser_helper *helper, int n_packets)
+    size_t buffer_size, struct request_parser_helper *helper)
 {
-    /* 16 packets should be enough to read a request (without the body, as
-     * is the case for POST requests).  This yields a timeout error to avoid
-     * clients being intentionally slow and hogging the server.  */
-    if (UNLIKELY(n_packets > helper->error_when_n_packets))
-        return FINALIZER_ERROR_TIMEOUT;
-
+    /* Clients that are intentionally slow to send the request are stopped
+     * by the header deadline, in read_from_request_socket().  */
     if (UNLIKELY(total_read < 4))
         return FINALIZER_YIELD_TRY_AGAIN;
 
+    /* Only look at what has been read since last time, backing up a few
+     * bytes in case the terminator straddles two reads. */
+    size_t start = helper->scanned > 3 ? helper->scanned - 3 : 0;
+    helper->scanned = total_read;
+
+    if (LIKELY(memmem(helper->buffer->value + start, total_read - start,
+                      "\r\n\r\n", 4)))
+        return FINALIZER_DONE;
+
+    /* A full buffer might still hold complete (pipelined) requests, so this
+     * is only checked after looking for the terminator. */
     if (UNLIKELY(total_read == buffer_size))
         return FINALIZER_ERROR_TOO_LARGE;
 
-    if (LIKELY(helper->next_request)) {
-        helper->next_request = NULL;
-        return FINALIZER_DONE;
+    return FINALIZER_TRY_AGAIN;
+}
+
+/* Large buffers are only kept around for as many connections as are
+ * likely to need them at the same time. */
+#define MAX_POOLED_LARGE_REQUEST_BUFFERS 16
+
+static char *get_large_request_buffer(struct lwan_thread *t)
+{
+    char *buffer = t->large_request_buffers;
+
+    if (LIKELY(buffer)) {
+        memcpy(&t->large_request_buffers, buffer, sizeof(void *));
+        t->n_large_request_buffers--;
+        return buffer;
     }
 
-    /* FIXME: Would saving the location of CRLFCRLF be useful? Maybe
-     * parse_headers() could benefit from this information?  How would it
-     * compare to helper->next_request?  */
-    if (LIKELY(memmem(helper->buffer->value, helper->buffer->len, "\r\n\r\n", 4)))
-        return FINALIZER_DONE;
+    return malloc(LARGE_REQUEST_BUFFER_SIZE);
+}
 
-    return FINALIZER_TRY_AGAIN;
+static void put_large_request_buffer(struct lwan_thread *t, char *buffer)
+{
+    if (t->n_large_request_buffers == MAX_POOLED_LARGE_REQUEST_BUFFERS) {
+        free(buffer);
+        return;
+    }
+
+    memcpy(buffer, &t->large_request_buffers, sizeof(void *));
+    t->large_request_buffers = buffer;
+    t->n_large_request_buffers++;
 }
 
-static ALWAYS_INLINE enum lwan_http_status
-read_request(struct lwan_request *request, struct request_parser_helper *helper)
+void lwan_request_buffer_pool_free(struct lwan_thread *t)
 {
-    return read_from_request_socket(request, helper->buffer, helper,
-                        DEFAULT_BUFFER_SIZE, read_request_finalizer);
+    while (t->large_request_buffers)
+        free(get_large_request_buffer(t));
 }
 
-static enum lwan_read_finalizer post_data_finalizer(size_t total_read,
-    size_t buffer_size, struct request_parser_helper *helper, int n_packets)
+/* Deferred by the owner of the buffer, for connections that go away while
+ * using a large one. */
+void lwan_request_buffer_release(void *data)
 {
-    if (buffer_size == total_read)
-        return FINALIZER_DONE;
+    struct lwan_request_buffer *buffer = data;
 
-    /* For POST requests, the body can be larger, and due to small MTUs on
-     * most ethernet connections, responding with a timeout solely based on
-     * number of packets doesn't work.  Use keepalive timeout instead.  */
-    if (UNLIKELY(time(NULL) > helper->error_when_time))
-        return FINALIZER_ERROR_TIMEOUT;
+    if (buffer->value != buffer->small) {
+        put_large_request_buffer(buffer->thread, buffer->value);
+        buffer->value = buffer->small;
+        buffer->size = REQUEST_BUFFER_SIZE;
+        buffer->len = 0;
+    }
+}
+
+/* Goes back to the small buffer once the requests that needed a large one
+ * have been handled, taking whatever has been pipelined after them along
+ * if it fits.  Returns where the next request starts. */
+char *lwan_request_buffer_shrink(struct lwan_request_buffer *buffer,
+                                 char *next_request)
+{
+    size_t pipelined = 0;
 
-    /* In addition to time, also estimate the number of packets based on an
-     * usual MTU value and the request body size.  */
-    if (UNLIKELY(n_packets > helper->error_when_n_packets))
-        return FINALIZER_ERROR_TIMEOUT;
+    if (LIKELY(buffer->value == buffer->small))
+        return next_request;
 
-    return FINALIZER_TRY_AGAIN;
+    if (next_request)
+        pipelined = (size_t)(buffer->value + buffer->len - next_request);
+    if (pipelined >= REQUEST_BUFFER_SIZE)
+        return next_request;
+
+    if (pipelined)
+        memcpy(buffer->small, next_request, pipelined);
+    lwan_request_buffer_release(buffer);
+    buffer->len = pipelined;
+
+    return pipelined ? buffer->small : NULL;
 }
 
-static ALWAYS_INLINE int max(int a, int b)
+static bool grow_request_buffer(struct lwan_request_buffer *buffer,
+                                struct lwan_value *window)
 {
-    return (a > b) ? a : b;
+    char *large;
+
+    if (!buffer->thread || buffer->value != buffer->small)
+        return false;
+
+    large = get_large_request_buffer(buffer->thread);
+    if (UNLIKELY(!large))
+        return false;
+
+    memcpy(large, window->value, window->len);
+    buffer->value = window->value = large;
+    buffer->size = LARGE_REQUEST_BUFFER_SIZE;
+
+    return true;
 }
 
-static ALWAYS_INLINE int calculate_n_packets(size_t total)
+static enum lwan_http_status
+read_request(struct lwan_request *request, struct request_parser_helper *helper,
+             struct lwan_request_buffer *buffer)
 {
-    /* 740 = 1480 (a common MTU) / 2, so that Lwan'll optimistically error out
-     * after ~2x number of expected packets to fully read the request body.*/
-    return max(1, (int)(total / 740));
+    struct lwan_value *window = helper->buffer;
+    enum lwan_http_status status;
+
+    while (true) {
+        size_t offset = (size_t)(window->value - buffer->value);
+
+        /* Leave room for the NUL terminator. */
+        status = read_from_request_socket(request, window, helper,
+                                          buffer->size - 1 - offset,
+                                          read_request_finalizer);
+        if (LIKELY(status != HTTP_TOO_LARGE)) {
+            buffer->len = offset + window->len;
+            return status;
+        }
+
+        if (offset) {
+            /* A pipelined request didn't fit in what was left of the
+             * buffer; only now is it moved to the front. */
+            memmove(buffer->value, window->value, window->len);
+            window->value = buffer->value;
+        } else if (!grow_request_buffer(buffer, window)) {
+            buffer->len = window->len;
+            return status;
+        }
+
+        helper->next_request = window->value;
+    }
+}
+
+static enum lwan_read_finalizer post_data_finalizer(size_t total_read,
+    size_t buffer_size,
+    struct request_parser_helper *helper __attribute__((unused)))
+{
+    if (buffer_size == total_read)
+        return FINALIZER_DONE;
+
+    /* Slow clients are taken care of by the body deadline. */
+    return FINALIZER_TRY_AGAIN;
 }
 
 static const char *
@@ -954,6 +1416,11 @@ read_post_data(struct lwan_request *request, struct request_parser_helper *helpe
     char *new_buffer;
     long parsed_size;
 
+    /* A rewritten URL shouldn't start the body over. */
+    if (helper->body_streamed)
+        return HTTP_OK;
+    helper->body_streamed = true;
+
     if (UNLIKELY(!helper->content_length.value))
         return HTTP_BAD_REQUEST;
     parsed_size = parse_long(helper->content_length.value, -1);
@@ -989,14 +1456,250 @@ read_post_data(struct lwan_request *request, struct request_parser_helper *helpe
         new_buffer = mempcpy(new_buffer, helper->next_request, have);
     helper->next_request = NULL;
 
-    helper->error_when_time = time(NULL) + config->keep_alive_timeout;
-    helper->error_when_n_packets = calculate_n_packets(post_data_size);
+    lwan_deadline_init(&helper->deadline, request,
+                       config->request_body_timeout);
 
     struct lwan_value buffer = { .value = new_buffer, .len = post_data_size - have };
     return read_from_request_socket(request, &buffer, helper, buffer.len,
         post_data_finalizer);
 }
 
+static enum lwan_http_status
+prepare_body_stream(struct lwan_request *request,
+    struct request_parser_helper *helper)
+{
+    long parsed_size;
+
+    if (UNLIKELY(!helper->content_length.value))
+        return HTTP_BAD_REQUEST;
+    parsed_size = parse_long(helper->content_length.value, -1);
+    if (UNLIKELY(parsed_size < 0))
+        return HTTP_BAD_REQUEST;
+
+    helper->body_remaining = helper->body_length = (size_t)parsed_size;
+    lwan_deadline_init(&helper->deadline, request,
+                       request->conn->thread->lwan->config.request_body_timeout);
+    return HTTP_OK;
+}
+
+/* Takes up to count bytes of the body that were read along with the
+ * request headers, if any. */
+static size_t
+take_buffered_body(struct request_parser_helper *helper, void **buf,
+    size_t count)
+{
+    char *buffer_end = helper->buffer->value + helper->buffer->len;
+    size_t have;
+
+    if (!helper->next_request || helper->next_request >= buffer_end)
+        return 0;
+
+    have = (size_t)(buffer_end - helper->next_request);
+    if (have > helper->body_remaining)
+        have = helper->body_remaining;
+    if (have > count)
+        have = count;
+
+    *buf = helper->next_request;
+    helper->next_request += have;
+    helper->body_remaining -= have;
+
+    return have;
+}
+
+/* Waits until the socket is readable; the timer wheel takes care of
+ * clients that stop sending the body.  Returns false on errors. */
+static bool
+wait_for_body(struct lwan_request *request, ssize_t result)
+{
+    if (UNLIKELY(!result)) {
+        /* Client has shutdown before sending the whole body. */
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    if (errno != EAGAIN && errno != EINTR)
+        return false;
+
+    struct request_parser_helper *helper = request->helper;
+    if (UNLIKELY(!lwan_deadline_wait(&helper->deadline, request,
+                                     helper->body_length -
+                                         helper->body_remaining))) {
+        errno = ETIMEDOUT;
+        return false;
+    }
+
+    lwan_flush_batch_if_needed(request);
+    request->conn->flags |= CONN_MUST_READ;
+    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+    return true;
+}
+
+ssize_t
+lwan_request_read_body(struct lwan_request *request, void *buf, size_t count)
+{
+    struct request_parser_helper *helper = request->helper;
+    void *buffered;
+    size_t have;
+
+    if (UNLIKELY(!helper))
+        return -EINVAL;
+    if (!helper->body_remaining || !count)
+        return 0;
+
+    have = take_buffered_body(helper, &buffered, count);
+    if (have) {
+        memcpy(buf, buffered, have);
+        return (ssize_t)have;
+    }
+
+    if (count > helper->body_remaining)
+        count = helper->body_remaining;
+
+    while (true) {
+        ssize_t n = read_socket(request, buf, count);
+
+        if (LIKELY(n > 0)) {
+            request->conn->flags &= ~(CONN_MUST_READ | CONN_HAS_DEADLINE);
+            helper->body_remaining -= (size_t)n;
+            return n;
+        }
+
+        if (UNLIKELY(!wait_for_body(request, n)))
+            return -errno;
+    }
+}
+
+/* After switching protocols, whatever the client sends (including what
+ * might have been read along with the request) is read as a body that
+ * never ends. */
+void lwan_request_begin_upgraded_body(struct lwan_request *request)
+{
+    request->helper->body_remaining = SIZE_MAX;
+    lwan_deadline_init(&request->helper->deadline, request, 0);
+}
+
+static ssize_t
+write_all(int fd, const char *buf, size_t count)
+{
+    size_t written = 0;
+
+    while (written < count) {
+        ssize_t n = write(fd, buf + written, count - written);
+
+        if (UNLIKELY(n < 0)) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        written += (size_t)n;
+    }
+
+    return (ssize_t)written;
+}
+
+static ssize_t
+copy_body(struct lwan_request *request, int fd, size_t total)
+{
+    char chunk[DEFAULT_BUFFER_SIZE];
+
+    while (request->helper->body_remaining) {
+        ssize_t n = lwan_request_read_body(request, chunk, sizeof(chunk));
+
+        if (UNLIKELY(n < 0))
+            return n;
+
+        n = write_all(fd, chunk, (size_t)n);
+        if (UNLIKELY(n < 0))
+            return n;
+
+        total += (size_t)n;
+    }
+
+    return (ssize_t)total;
+}
+
+#if defined(__linux__)
+static void
+close_pipe(void *data)
+{
+    int *pipefd = data;
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+#endif
+
+ssize_t
+lwan_request_splice_body(struct lwan_request *request, int fd)
+{
+    struct request_parser_helper *helper = request->helper;
+    size_t total = 0;
+    void *buffered;
+    size_t have;
+
+    if (UNLIKELY(!helper))
+        return -EINVAL;
+
+    have = take_buffered_body(helper, &buffered, helper->body_remaining);
+    if (have) {
+        ssize_t r = write_all(fd, buffered, have);
+        if (UNLIKELY(r < 0))
+            return r;
+        total += have;
+    }
+
+    if (!helper->body_remaining)
+        return (ssize_t)total;
+
+#if defined(__linux__)
+    if (UNLIKELY(request->flags & REQUEST_IS_HTTP_2))
+        return copy_body(request, fd, total);
+
+    int *pipefd = coro_malloc_full(request->conn->coro, 2 * sizeof(int),
+        close_pipe);
+    if (UNLIKELY(!pipefd))
+        return -ENOMEM;
+    if (UNLIKELY(pipe2(pipefd, O_CLOEXEC) < 0)) {
+        pipefd[0] = pipefd[1] = -1;
+        return -errno;
+    }
+
+    while (helper->body_remaining) {
+        ssize_t n = splice(request->fd, NULL, pipefd[1], NULL,
+            helper->body_remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (UNLIKELY(n <= 0)) {
+            if (UNLIKELY(!wait_for_body(request, n)))
+                return -errno;
+            continue;
+        }
+
+        request->conn->flags &= ~(CONN_MUST_READ | CONN_HAS_DEADLINE);
+        helper->body_remaining -= (size_t)n;
+        total += (size_t)n;
+
+        while (n) {
+            ssize_t out = splice(pipefd[0], NULL, fd, NULL, (size_t)n,
+                SPLICE_F_MOVE);
+
+            if (UNLIKELY(out < 0)) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            }
+
+            n -= out;
+        }
+    }
+
+    return (ssize_t)total;
+#else
+    return copy_body(request, fd, total);
+#endif
+}
+
 static char *
 parse_proxy_protocol(struct lwan_request *request, char *buffer)
 {
@@ -1033,9 +1736,20 @@ parse_http_request(struct lwan_request *request, struct request_parser_helper *h
     if (UNLIKELY(!buffer))
         return HTTP_BAD_REQUEST;
 
+    struct lwan_rate_limit *rate_limit = request->conn->thread->lwan->rate_limit;
+    if (rate_limit && !lwan_rate_limit_allow(rate_limit, request)) {
+        /* Headers weren't parsed, so where this request ends isn't known:
+         * don't read anything else from this client. */
+        request->conn->flags &= ~CONN_KEEP_ALIVE;
+        helper->next_request = NULL;
+        return HTTP_TOO_MANY_REQUESTS;
+    }
+
+    helper->headers.value = buffer;
     buffer = parse_headers(helper, buffer, helper->buffer->value + helper->buffer->len);
     if (UNLIKELY(!buffer))
         return HTTP_BAD_REQUEST;
+    helper->headers.len = (size_t)(buffer - helper->headers.value);
 
     ssize_t decoded_len = url_decode(request->url.value);
     if (UNLIKELY(decoded_len < 0))
@@ -1047,15 +1761,33 @@ parse_http_request(struct lwan_request *request, struct request_parser_helper *h
     return HTTP_OK;
 }
 
-static enum lwan_http_status
-prepare_for_response(struct lwan_url_map *url_map,
-                      struct lwan_request *request,
-                      struct request_parser_helper *helper)
+/* Flags looked at by prepare_for_response(). */
+#define PREPARE_FOR_RESPONSE_FLAGS                                             \
+    (HANDLER_RATE_LIMIT | HANDLER_MUST_AUTHORIZE |                             \
+     HANDLER_PARSE_IF_MODIFIED_SINCE | HANDLER_PARSE_RANGE |                   \
+     HANDLER_PARSE_ACCEPT_ENCODING | HANDLER_COMPRESS_RESPONSE |               \
+     HANDLER_REMOVE_LEADING_SLASH | HANDLER_STREAM_POST_DATA |                 \
+     HANDLER_PARSE_POST_DATA)
+
+/* Always inlined with a constant static_flags, so that the checks for
+ * flags outside of it are compiled out; see lwan_url_map_specialize(). */
+static ALWAYS_INLINE enum lwan_http_status
+prepare_for_response(const enum lwan_handler_flags static_flags,
+                     struct lwan_url_map *url_map,
+                     struct lwan_request *request,
+                     struct request_parser_helper *helper)
 {
+    const enum lwan_handler_flags flags = static_flags & url_map->flags;
+
     request->url.value += url_map->prefix_len;
     request->url.len -= url_map->prefix_len;
 
-    if (url_map->flags & HANDLER_MUST_AUTHORIZE) {
+    if (flags & HANDLER_RATE_LIMIT) {
+        if (!lwan_rate_limit_allow(url_map->rate_limit, request))
+            return HTTP_TOO_MANY_REQUESTS;
+    }
+
+    if (flags & HANDLER_MUST_AUTHORIZE) {
         if (!lwan_http_authorize(request,
                         &helper->authorization,
                         url_map->authorization.realm,
@@ -1063,22 +1795,26 @@ prepare_for_response(struct lwan_url_map *url_map,
             return HTTP_NOT_AUTHORIZED;
     }
 
-    if (url_map->flags & HANDLER_PARSE_QUERY_STRING)
-        parse_query_string(request, helper);
-
-    if (url_map->flags & HANDLER_PARSE_IF_MODIFIED_SINCE)
+    if (flags & HANDLER_PARSE_IF_MODIFIED_SINCE) {
         parse_if_modified_since(request, helper);
 
-    if (url_map->flags & HANDLER_PARSE_RANGE)
+        if (helper->if_none_match.len)
+            request->header.if_none_match = &helper->if_none_match;
+    }
+
+    if (flags & HANDLER_PARSE_RANGE)
         parse_range(request, helper);
 
-    if (url_map->flags & HANDLER_PARSE_ACCEPT_ENCODING)
+    if (flags & HANDLER_PARSE_ACCEPT_ENCODING)
         parse_accept_encoding(request, helper);
 
-    if (url_map->flags & HANDLER_PARSE_COOKIES)
-        parse_cookies(request, helper);
+    if (flags & HANDLER_COMPRESS_RESPONSE) {
+        if (request->flags & (REQUEST_ACCEPT_GZIP | REQUEST_ACCEPT_DEFLATE) &&
+            lwan_request_get_method(request) != REQUEST_METHOD_HEAD)
+            request->flags |= RESPONSE_MAY_COMPRESS;
+    }
 
-    if (url_map->flags & HANDLER_REMOVE_LEADING_SLASH) {
+    if (flags & HANDLER_REMOVE_LEADING_SLASH) {
         while (*request->url.value == '/' && request->url.len > 0) {
             ++request->url.value;
             --request->url.len;
@@ -1088,7 +1824,12 @@ prepare_for_response(struct lwan_url_map *url_map,
     if (lwan_request_get_method(request) == REQUEST_METHOD_POST) {
         enum lwan_http_status status;
 
-        if (!(url_map->flags & HANDLER_PARSE_POST_DATA)) {
+        if (flags & HANDLER_STREAM_POST_DATA) {
+            request->header.content_type = &helper->content_type;
+            return prepare_body_stream(request, helper);
+        }
+
+        if (!(flags & HANDLER_PARSE_POST_DATA)) {
             /* FIXME: Discard POST data here? If a POST request is sent
              * to a handler that is not supposed to handle a POST request,
              * the next request in the pipeline will fail because the
@@ -1101,17 +1842,75 @@ prepare_for_response(struct lwan_url_map *url_map,
         if (UNLIKELY(status != HTTP_OK))
             return status;
 
-        parse_post_data(request, helper);
+        request->header.body = &helper->post_data;
+        request->header.content_type = &helper->content_type;
     }
 
     return HTTP_OK;
 }
 
+#define DEFINE_PREPARE_FOR_RESPONSE(name_, static_flags_)                      \
+    static enum lwan_http_status prepare_for_response_##name_(                 \
+        struct lwan_url_map *url_map, struct lwan_request *request,            \
+        struct request_parser_helper *helper)                                  \
+    {                                                                          \
+        return prepare_for_response(static_flags_, url_map, request, helper);  \
+    }
+
+#define PREPARE_FOR_FILES                                                      \
+    (HANDLER_REMOVE_LEADING_SLASH | HANDLER_PARSE_IF_MODIFIED_SINCE |          \
+     HANDLER_PARSE_RANGE | HANDLER_PARSE_ACCEPT_ENCODING)
+
+/* The combinations used by the bundled modules and by handlers. */
+DEFINE_PREPARE_FOR_RESPONSE(plain, 0)
+DEFINE_PREPARE_FOR_RESPONSE(remove_leading_slash, HANDLER_REMOVE_LEADING_SLASH)
+DEFINE_PREPARE_FOR_RESPONSE(stream_post_data, HANDLER_STREAM_POST_DATA)
+DEFINE_PREPARE_FOR_RESPONSE(files, PREPARE_FOR_FILES)
+DEFINE_PREPARE_FOR_RESPONSE(handler, HANDLER_PARSE_MASK)
+DEFINE_PREPARE_FOR_RESPONSE(generic, PREPARE_FOR_RESPONSE_FLAGS)
+
+/* From the one with the fewest flags to the one with all of them. */
+static const struct {
+    enum lwan_handler_flags flags;
+    lwan_url_map_prepare_func prepare;
+} prepare_for_response_variants[] = {
+    {0, prepare_for_response_plain},
+    {HANDLER_REMOVE_LEADING_SLASH, prepare_for_response_remove_leading_slash},
+    {HANDLER_STREAM_POST_DATA, prepare_for_response_stream_post_data},
+    {PREPARE_FOR_FILES, prepare_for_response_files},
+    {HANDLER_PARSE_MASK, prepare_for_response_handler},
+    {PREPARE_FOR_RESPONSE_FLAGS, prepare_for_response_generic},
+};
+
+#undef DEFINE_PREPARE_FOR_RESPONSE
+#undef PREPARE_FOR_FILES
+
+void lwan_url_map_specialize(struct lwan_url_map *url_map)
+{
+    const enum lwan_handler_flags flags =
+        url_map->flags & PREPARE_FOR_RESPONSE_FLAGS;
+
+    for (size_t i = 0; i < N_ELEMENTS(prepare_for_response_variants); i++) {
+        if (!(flags & ~prepare_for_response_variants[i].flags)) {
+            url_map->prepare = prepare_for_response_variants[i].prepare;
+            return;
+        }
+    }
+
+    __builtin_unreachable();
+}
+
 static bool
 handle_rewrite(struct lwan_request *request, struct request_parser_helper *helper)
 {
     request->flags &= ~RESPONSE_URL_REWRITTEN;
 
+    /* The query string might have changed, so parse it again if needed. */
+    if (request->flags & REQUEST_PARSED_QUERY_STRING) {
+        lwan_key_value_array_reset(&request->query_params);
+        request->flags &= ~REQUEST_PARSED_QUERY_STRING;
+    }
+
     parse_fragment_and_query(request, helper,
         request->url.value + request->url.len);
 
@@ -1124,20 +1923,64 @@ handle_rewrite(struct lwan_request *request, struct request_parser_helper *helpe
     return true;
 }
 
+static void discard_unread_body(struct lwan_request *request,
+                                struct request_parser_helper *helper)
+{
+    if (UNLIKELY(helper->body_remaining > 0)) {
+        /* Whatever the handler didn't read can't be told apart from the
+         * next request, so don't keep this connection around. */
+        request->conn->flags &= ~CONN_KEEP_ALIVE;
+        helper->body_remaining = 0;
+        helper->next_request = NULL;
+    }
+}
+
+static ALWAYS_INLINE struct lwan_trie *
+find_url_map_trie(struct lwan *l, const struct request_parser_helper *helper)
+{
+    if (UNLIKELY(l->vhosts != NULL) && helper->host.len) {
+        struct lwan_trie *url_map_trie =
+            lwan_vhosts_find(l->vhosts, helper->host.value, helper->host.len);
+
+        if (url_map_trie)
+            return url_map_trie;
+    }
+
+    return &l->url_map_trie;
+}
+
 char *
 lwan_process_request(struct lwan *l, struct lwan_request *request,
-    struct lwan_value *buffer, char *next_request)
+    struct lwan_request_buffer *buffer, char *next_request)
 {
+    struct lwan_thread *t = request->conn->thread;
+    unsigned long long start_ns = 0;
     enum lwan_http_status status;
-    struct lwan_url_map *url_map;
+    struct lwan_url_map *url_map = NULL;
+    struct lwan_trie *url_map_trie;
+    struct lwan_value window;
+
+    /* Pipelined requests are parsed in place, right where the previous
+     * request ended. */
+    if (next_request && next_request < buffer->value + buffer->len) {
+        window.value = next_request;
+        window.len = (size_t)(buffer->value + buffer->len - next_request);
+    } else {
+        window.value = buffer->value;
+        window.len = 0;
+        next_request = NULL;
+    }
 
     struct request_parser_helper helper = {
-        .buffer = buffer,
+        .buffer = &window,
         .next_request = next_request,
-        .error_when_n_packets = calculate_n_packets(DEFAULT_BUFFER_SIZE)
     };
 
-    status = read_request(request, &helper);
+    request->helper = &helper;
+    lwan_deadline_init(&helper.deadline, request,
+                       l->config.request_header_timeout);
+
+    status = read_request(request, &helper, buffer);
     if (UNLIKELY(status != HTTP_OK)) {
         /* This request was bad, but maybe there's a good one in the
          * pipeline.  */
@@ -1152,26 +1995,66 @@ lwan_process_request(struct lwan *l, struct lwan_request *request,
         __builtin_unreachable();
     }
 
+    if (UNLIKELY(request->flags & REQUEST_ALLOW_HTTP_2) &&
+        window.len >= H2_CLIENT_PREFACE_HEAD_LEN &&
+        !memcmp(window.value, H2_CLIENT_PREFACE, H2_CLIENT_PREFACE_HEAD_LEN)) {
+        /* The connection is handed over to the HTTP/2 code, preface and
+         * all, by the caller. */
+        request->flags |= REQUEST_IS_HTTP_2;
+        request->helper = NULL;
+        return window.value;
+    }
+
+    LWAN_TRACE1(request_start, request);
+
+    t->metrics.requests++;
+    if (l->measure_latency)
+        start_ns = lwan_monotonic_ns();
+
     status = parse_http_request(request, &helper);
     if (UNLIKELY(status != HTTP_OK)) {
         lwan_default_response(request, status);
         goto out;
     }
 
+    url_map_trie = find_url_map_trie(l, &helper);
+
 lookup_again:
-    url_map = lwan_trie_lookup_prefix(&l->url_map_trie, request->url.value);
+    url_map = lwan_trie_lookup_prefix(url_map_trie, request->url.value);
     if (UNLIKELY(!url_map)) {
         lwan_default_response(request, HTTP_NOT_FOUND);
         goto out;
     }
 
-    status = prepare_for_response(url_map, request, &helper);
+    status = url_map->prepare(url_map, request, &helper);
     if (UNLIKELY(status != HTTP_OK)) {
         lwan_default_response(request, status);
         goto out;
     }
 
-    status = url_map->handler(request, &request->response, url_map->data);
+    if (UNLIKELY(url_map->flags & HANDLER_LAZY_MODULE))
+        lwan_lazy_module_acquire(url_map, request);
+
+    /* Another request is already in the buffer: its response can be sent
+     * along with this one.  */
+    if (helper.next_request && !helper.body_remaining &&
+        helper.next_request < buffer->value + buffer->len)
+        request->flags |= REQUEST_PIPELINED;
+
+    if (url_map->flags & HANDLER_CONSTANT_RESPONSE) {
+        if (lwan_response_send_constant(request, url_map)) {
+            discard_unread_body(request, &helper);
+            goto out;
+        }
+    }
+
+    LWAN_TRACE2(handler_start, request, url_map->prefix);
+    coro_set_tag(request->conn->coro, url_map->prefix);
+    if (url_map->flags & HANDLER_MICRO_CACHE)
+        status = lwan_micro_cache_handle(url_map->micro_cache, url_map, request);
+    else
+        status = url_map->handler(request, &request->response, url_map->data);
+    LWAN_TRACE2(handler_end, request, status);
     if (UNLIKELY(url_map->flags & HANDLER_CAN_REWRITE_URL)) {
         if (request->flags & RESPONSE_URL_REWRITTEN) {
             if (LIKELY(handle_rewrite(request, &helper)))
@@ -1180,9 +2063,28 @@ lookup_again:
         }
     }
 
+    /* Stream callbacks may still read the body from within lwan_response(),
+     * so only give up on it afterwards for those. */
+    if (!request->response.stream.callback)
+        discard_unread_body(request, &helper);
+
     lwan_response(request, status);
 
+    discard_unread_body(request, &helper);
+
 out:
+    LWAN_TRACE2(request_end, request, status);
+    coro_set_tag(request->conn->coro, NULL);
+
+    if (UNLIKELY(url_map && url_map->stack_usage)) {
+        lwan_metrics_record_stack_usage(
+            url_map->stack_usage, coro_stack_high_water(request->conn->coro));
+    }
+
+    if (start_ns)
+        lwan_metrics_record_latency(t, lwan_monotonic_ns() - start_ns);
+
+    request->helper = NULL;
     return helper.next_request;
 }
 
@@ -1206,49 +2108,124 @@ value_lookup(const struct lwan_key_value_array *array, const char *key)
 const char *
 lwan_request_get_query_param(struct lwan_request *request, const char *key)
 {
+    parse_query_string(request);
     return value_lookup(&request->query_params, key);
 }
 
 const char *
 lwan_request_get_post_param(struct lwan_request *request, const char *key)
 {
+    parse_post_data(request);
     return value_lookup(&request->post_data, key);
 }
 
 const char *
 lwan_request_get_cookie(struct lwan_request *request, const char *key)
 {
+    parse_cookies(request);
     return value_lookup(&request->cookies, key);
 }
 
+const struct lwan_key_value *
+lwan_request_get_query_params(struct lwan_request *request)
+{
+    parse_query_string(request);
+    return request->query_params.base.base;
+}
+
+const struct lwan_key_value *
+lwan_request_get_post_params(struct lwan_request *request)
+{
+    parse_post_data(request);
+    return request->post_data.base.base;
+}
+
+const struct lwan_key_value *
+lwan_request_get_cookies(struct lwan_request *request)
+{
+    parse_cookies(request);
+    return request->cookies.base.base;
+}
+
+static bool has_json_body(const struct lwan_request *request)
+{
+    static const char content_type[] = "application/json";
+    const struct request_parser_helper *helper = request->helper;
+
+    if (UNLIKELY(!helper || !helper->post_data.len))
+        return false;
+    if (helper->content_type.len < sizeof(content_type) - 1)
+        return false;
+    return !strncasecmp(helper->content_type.value, content_type,
+                        sizeof(content_type) - 1);
+}
+
+const struct lwan_json *
+lwan_request_get_json_body(struct lwan_request *request)
+{
+    struct request_parser_helper *helper = request->helper;
+
+    if (request->flags & REQUEST_PARSED_JSON_BODY)
+        return helper->json_body;
+    request->flags |= REQUEST_PARSED_JSON_BODY;
+
+    if (!has_json_body(request))
+        return NULL;
+
+    helper->json_body = lwan_json_parse(request->conn->coro,
+                                        helper->post_data.value,
+                                        helper->post_data.len);
+    return helper->json_body;
+}
+
+const struct lwan_json *
+lwan_request_find_json(struct lwan_request *request, const char *const path[])
+{
+    struct request_parser_helper *helper = request->helper;
+
+    /* Once parsed in place, the body isn't JSON anymore. */
+    if (request->flags & REQUEST_PARSED_JSON_BODY)
+        return lwan_json_get_path(helper->json_body, path);
+
+    if (!has_json_body(request))
+        return NULL;
+
+    return lwan_json_find(request->conn->coro, helper->post_data.value,
+                          helper->post_data.len, path);
+}
+
 ALWAYS_INLINE int
 lwan_connection_get_fd(const struct lwan *lwan, const struct lwan_connection *conn)
 {
     return (int)(ptrdiff_t)(conn - lwan->conns);
 }
 
+bool
+lwan_request_get_remote_sockaddr(struct lwan_request *request,
+                                  struct sockaddr_storage *sock_addr)
+{
+    if (request->flags & REQUEST_PROXIED) {
+        memcpy(sock_addr, &request->proxy->from, sizeof(request->proxy->from));
+        return true;
+    }
+
+    socklen_t sock_len = sizeof(*sock_addr);
+    return getpeername(request->fd, (struct sockaddr *)sock_addr,
+                       &sock_len) == 0;
+}
+
 const char *
 lwan_request_get_remote_address(struct lwan_request *request,
             char buffer[static INET6_ADDRSTRLEN])
 {
-    struct sockaddr_storage non_proxied_addr = { .ss_family = AF_UNSPEC };
-    struct sockaddr_storage *sock_addr;
-
-    if (request->flags & REQUEST_PROXIED) {
-        sock_addr = (struct sockaddr_storage *)&request->proxy->from;
+    struct sockaddr_storage storage = { .ss_family = AF_UNSPEC };
+    struct sockaddr_storage *sock_addr = &storage;
 
-        if (UNLIKELY(sock_addr->ss_family == AF_UNSPEC))
-            return memcpy(buffer, "*unspecified*", sizeof("*unspecified*"));
-    } else {
-        socklen_t sock_len = sizeof(non_proxied_addr);
+    if (UNLIKELY(!lwan_request_get_remote_sockaddr(request, sock_addr)))
+        return NULL;
 
-        sock_addr = &non_proxied_addr;
-
-        if (UNLIKELY(getpeername(request->fd,
-                                 (struct sockaddr *) sock_addr,
-                                 &sock_len) < 0))
-            return NULL;
-    }
+    if (UNLIKELY(sock_addr->ss_family == AF_UNSPEC))
+        return memcpy(buffer, "*unspecified*", sizeof("*unspecified*"));
 
     if (sock_addr->ss_family == AF_INET)
         return inet_ntop(AF_INET,
@@ -1259,3 +2236,72 @@ lwan_request_get_remote_address(struct lwan_request *request,
                      &((struct sockaddr_in6 *) sock_addr)->sin6_addr,
                      buffer, INET6_ADDRSTRLEN);
 }
+
+void
+lwan_request_sleep(struct lwan_request *request, unsigned int ms)
+{
+    struct lwan_connection *conn = request->conn;
+
+    lwan_flush_batch_if_needed(request);
+
+    /* The I/O thread won't resume this coroutine until the timer expires
+     * (or the file descriptor being awaited becomes ready), regardless of
+     * any activity in the connection socket. */
+    timer_wheel_add(conn->thread->wheel, conn, ms);
+    conn->flags |= CONN_SUSPENDED;
+
+    coro_yield(conn->coro, CONN_CORO_SUSPEND);
+
+    conn->flags &= ~CONN_SUSPENDED;
+}
+
+static void
+remove_awaited_fd(struct lwan_connection *conn, void *fd)
+{
+    epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_DEL, (int)(intptr_t)fd, NULL);
+}
+
+static bool
+await_fd(struct lwan_request *request, int fd, uint32_t epoll_events,
+         short poll_events, unsigned int timeout_ms)
+{
+    struct lwan_connection *conn = request->conn;
+    struct pollfd pfd = { .fd = fd, .events = poll_events };
+    struct epoll_event event = {
+        .events = epoll_events,
+        .data.ptr = (void *)((uintptr_t)conn | CONN_AWAITED_FD_TAG)
+    };
+
+    if (poll(&pfd, 1, 0) > 0)
+        return true;
+    if (!timeout_ms)
+        return false;
+
+    if (UNLIKELY(epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0))
+        return false;
+
+    size_t generation = coro_deferred_get_generation(conn->coro);
+    coro_defer2(conn->coro, CORO_DEFER2(remove_awaited_fd), conn,
+                (void *)(intptr_t)fd);
+
+    lwan_request_sleep(request, timeout_ms);
+
+    coro_deferred_run(conn->coro, generation);
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
+bool
+lwan_request_await_read(struct lwan_request *request, int fd,
+                        unsigned int timeout_ms)
+{
+    return await_fd(request, fd, EPOLLIN | EPOLLRDHUP, POLLIN | POLLRDHUP,
+                    timeout_ms);
+}
+
+bool
+lwan_request_await_write(struct lwan_request *request, int fd,
+                         unsigned int timeout_ms)
+{
+    return await_fd(request, fd, EPOLLOUT, POLLOUT, timeout_ms);
+}
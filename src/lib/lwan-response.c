@@ -20,6 +20,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <netinet/in.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
@@ -28,6 +29,8 @@
 #include "lwan-private.h"
 
 #include "int-to-str.h"
+#include "lwan-access-log.h"
+#include "lwan-deflate.h"
 #include "lwan-io-wrappers.h"
 #include "lwan-template.h"
 
@@ -95,7 +98,6 @@ lwan_response_shutdown(struct lwan *l __attribute__((unused)))
     lwan_tpl_free(error_template);
 }
 
-#ifndef NDEBUG
 static const char *
 get_request_method(struct lwan_request *request)
 {
@@ -115,8 +117,9 @@ get_request_method(struct lwan_request *request)
     }
 }
 
+#ifndef NDEBUG
 static void
-log_request(struct lwan_request *request, enum lwan_http_status status)
+debug_log_request(struct lwan_request *request, enum lwan_http_status status)
 {
     char ip_buffer[INET6_ADDRSTRLEN];
 
@@ -125,19 +128,291 @@ log_request(struct lwan_request *request, enum lwan_http_status status)
         request->conn->thread->date.date,
         get_request_method(request),
         request->original_url.value,
-        request->flags & REQUEST_IS_HTTP_1_0 ? "1.0" : "1.1",
+        request->flags & REQUEST_IS_HTTP_2
+            ? "2"
+            : request->flags & REQUEST_IS_HTTP_1_0 ? "1.0" : "1.1",
         status,
         request->response.mime_type);
 }
-#else
-#define log_request(...)
 #endif
 
+static ALWAYS_INLINE void
+log_request(struct lwan_request *request,
+            enum lwan_http_status status,
+            size_t body_len)
+{
+    if (request->conn->thread->access_log) {
+        lwan_access_log_record(request, status, get_request_method(request),
+                               body_len);
+        return;
+    }
+
+#ifndef NDEBUG
+    debug_log_request(request, status);
+#endif
+}
+
 static const bool has_response_body[REQUEST_METHOD_MASK] = {
     [REQUEST_METHOD_GET] = true,
     [REQUEST_METHOD_POST] = true,
 };
 
+/* Stream callbacks send the body themselves: what they said it'd be in the
+ * Content-Length header, or what went out in chunks. */
+static size_t
+streamed_body_len(const struct lwan_request *request,
+                  enum lwan_http_status status)
+{
+    if (!has_response_body[lwan_request_get_method(request)])
+        return 0;
+    if (status == HTTP_NOT_MODIFIED)
+        return 0;
+    if ((request->flags & RESPONSE_NO_CONTENT_LENGTH) &&
+        !(request->flags & RESPONSE_CHUNKED_ENCODING))
+        return 0;
+
+    return request->response.content_length;
+}
+
+static bool
+batch_response(struct lwan_request *request, const char *headers,
+               size_t header_len, const char *body, size_t body_len)
+{
+    struct lwan_output_batch *batch = request->batch;
+
+    if (!(request->flags & REQUEST_PIPELINED) || !batch)
+        return false;
+    if (header_len + body_len > DEFAULT_BUFFER_SIZE - batch->len)
+        return false;
+
+    if (UNLIKELY(!batch->buffer)) {
+        /* Freed by the request processing coroutine. */
+        batch->buffer = malloc(DEFAULT_BUFFER_SIZE);
+        if (UNLIKELY(!batch->buffer))
+            return false;
+    }
+
+    char *p = mempcpy(batch->buffer + batch->len, headers, header_len);
+    if (body_len)
+        memcpy(p, body, body_len);
+    batch->len += header_len + body_len;
+
+    return true;
+}
+
+static ALWAYS_INLINE void
+count_response(struct lwan_request *request, enum lwan_http_status status)
+{
+    struct lwan_thread_metrics *metrics = &request->conn->thread->metrics;
+    unsigned int class = (unsigned int)status / 100;
+
+    if (LIKELY(class < N_ELEMENTS(metrics->responses)))
+        metrics->responses[class]++;
+}
+
+/*
+ * Handlers and modules with HANDLER_CONSTANT_RESPONSE answer every request
+ * the same way, given its method, HTTP version, and whether the connection
+ * is kept alive.  Each I/O thread keeps the first response it sends for
+ * each of these, headers and body in a single buffer, and sends it again
+ * without calling the handler; only the Date and Expires headers are
+ * rewritten, once per second.  Entries are never replaced, as they might
+ * be in the middle of being sent by another coroutine: responses that
+ * can't find a free slot take the usual path.
+ */
+#define CONSTANT_RESPONSE_CACHE_SIZE 64
+#define CONSTANT_RESPONSE_PROBES 4
+#define CONSTANT_RESPONSE_MAX_SIZE DEFAULT_BUFFER_SIZE
+
+struct constant_response {
+    const struct lwan_url_map *url_map;
+    unsigned int key;
+    enum lwan_http_status status;
+    unsigned short len;
+    unsigned short body_len;
+    /* Zero if the header isn't in the response, or has been set by the
+     * handler. */
+    unsigned short date_offset;
+    unsigned short expires_offset;
+    time_t date;
+    char *buffer; /* Followed by the MIME type, for the access log */
+};
+
+struct constant_response_cache {
+    struct constant_response entries[CONSTANT_RESPONSE_CACHE_SIZE];
+};
+
+static ALWAYS_INLINE unsigned int
+constant_response_key(const struct lwan_request *request)
+{
+    unsigned int key = (unsigned int)(request->flags &
+        (REQUEST_METHOD_MASK | REQUEST_IS_HTTP_1_0 | REQUEST_ALLOW_CORS));
+
+    return key << 1 | !!(request->conn->flags & CONN_KEEP_ALIVE);
+}
+
+static ALWAYS_INLINE size_t
+constant_response_slot(const struct lwan_url_map *url_map, unsigned int key)
+{
+    uintptr_t hash = ((uintptr_t)url_map >> 4) ^ (key * 0x9e3779b1u);
+
+    return (size_t)(hash ^ (hash >> 11));
+}
+
+static unsigned short
+constant_response_date_offset(const char *headers, size_t header_len,
+                              const char *header, size_t header_name_len,
+                              const char *value)
+{
+    const char *p = memmem(headers, header_len, header, header_name_len);
+
+    if (!p)
+        return 0;
+
+    p += header_name_len;
+    if (p + 29 > headers + header_len || memcmp(p, value, 29))
+        return 0;
+
+    return (unsigned short)(p - headers);
+}
+
+static void store_constant_response(struct lwan_request *request,
+                                    enum lwan_http_status status,
+                                    const char *headers,
+                                    size_t header_len,
+                                    const char *body,
+                                    size_t body_len)
+{
+    const struct lwan_url_map *url_map = request->constant_response;
+    struct lwan_thread *thread = request->conn->thread;
+    const char *mime_type = request->response.mime_type;
+    size_t mime_type_len = strlen(mime_type);
+    unsigned int key = constant_response_key(request);
+    struct constant_response *entry = NULL;
+
+    request->constant_response = NULL;
+
+    if (request->flags & RESPONSE_COMPRESSED)
+        return;
+    if (header_len + body_len + mime_type_len + 1 > CONSTANT_RESPONSE_MAX_SIZE)
+        return;
+
+    size_t slot = constant_response_slot(url_map, key);
+    for (int i = 0; i < CONSTANT_RESPONSE_PROBES; i++) {
+        struct constant_response *e =
+            &thread->constant_responses->entries[(slot + (size_t)i) %
+                                                 CONSTANT_RESPONSE_CACHE_SIZE];
+
+        if (e->url_map == url_map && e->key == key)
+            return;
+        if (!e->url_map) {
+            entry = e;
+            break;
+        }
+    }
+    if (!entry)
+        return;
+
+    char *buffer = malloc(header_len + body_len + mime_type_len + 1);
+    if (UNLIKELY(!buffer))
+        return;
+
+    char *p = mempcpy(buffer, headers, header_len);
+    if (body_len)
+        p = mempcpy(p, body, body_len);
+    memcpy(p, mime_type, mime_type_len + 1);
+
+    *entry = (struct constant_response){
+        .url_map = url_map,
+        .key = key,
+        .status = status,
+        .len = (unsigned short)(header_len + body_len),
+        .body_len = (unsigned short)body_len,
+        .date_offset = constant_response_date_offset(
+            headers, header_len, "\r\nDate: ", 8, thread->date.date),
+        .expires_offset = constant_response_date_offset(
+            headers, header_len, "\r\nExpires: ", 11, thread->date.expires),
+        .date = thread->date.last,
+        .buffer = buffer,
+    };
+}
+
+bool lwan_response_send_constant(struct lwan_request *request,
+                                 const struct lwan_url_map *url_map)
+{
+    struct lwan_thread *thread = request->conn->thread;
+
+    if (UNLIKELY(request->flags & (REQUEST_IS_HTTP_2 | RESPONSE_MAY_COMPRESS)))
+        return false;
+
+    if (UNLIKELY(!thread->constant_responses)) {
+        thread->constant_responses =
+            calloc(1, sizeof(struct constant_response_cache));
+        if (UNLIKELY(!thread->constant_responses))
+            return false;
+    }
+
+    unsigned int key = constant_response_key(request);
+    size_t slot = constant_response_slot(url_map, key);
+    struct constant_response *entry = NULL;
+    for (int i = 0; i < CONSTANT_RESPONSE_PROBES; i++) {
+        struct constant_response *e =
+            &thread->constant_responses->entries[(slot + (size_t)i) %
+                                                 CONSTANT_RESPONSE_CACHE_SIZE];
+
+        if (e->url_map == url_map && e->key == key) {
+            entry = e;
+            break;
+        }
+        if (!e->url_map)
+            break;
+    }
+    if (!entry) {
+        request->constant_response = url_map;
+        return false;
+    }
+
+    if (entry->date != thread->date.last) {
+        if (entry->date_offset)
+            memcpy(entry->buffer + entry->date_offset, thread->date.date, 29);
+        if (entry->expires_offset)
+            memcpy(entry->buffer + entry->expires_offset, thread->date.expires, 29);
+        entry->date = thread->date.last;
+    }
+
+    request->response.mime_type = entry->buffer + entry->len;
+    log_request(request, entry->status, entry->body_len);
+    count_response(request, entry->status);
+
+    if (batch_response(request, entry->buffer, entry->len, NULL, 0))
+        return true;
+
+    struct lwan_output_batch *batch = request->batch;
+    if (batch && batch->len) {
+        struct iovec response_vec[] = {
+            {.iov_base = batch->buffer, .iov_len = batch->len},
+            {.iov_base = entry->buffer, .iov_len = entry->len},
+        };
+
+        batch->len = 0;
+        lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
+    } else {
+        lwan_send(request, entry->buffer, entry->len, 0);
+    }
+
+    return true;
+}
+
+void lwan_response_constant_cache_free(struct lwan_thread *thread)
+{
+    if (!thread->constant_responses)
+        return;
+
+    for (size_t i = 0; i < CONSTANT_RESPONSE_CACHE_SIZE; i++)
+        free(thread->constant_responses->entries[i].buffer);
+    free(thread->constant_responses);
+}
+
 void
 lwan_response(struct lwan_request *request, enum lwan_http_status status)
 {
@@ -147,7 +422,8 @@ lwan_response(struct lwan_request *request, enum lwan_http_status status)
         /* Send last, 0-sized chunk */
         lwan_strbuf_reset(request->response.buffer);
         lwan_response_send_chunk(request);
-        log_request(request, status);
+        log_request(request, status, request->response.content_length);
+        count_response(request, status);
         return;
     }
 
@@ -163,8 +439,6 @@ lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return;
     }
 
-    log_request(request, status);
-
     if (request->response.stream.callback) {
         enum lwan_http_status callback_status;
 
@@ -173,33 +447,68 @@ lwan_response(struct lwan_request *request, enum lwan_http_status status)
         /* Reset it after it has been called to avoid eternal recursion on errors */
         request->response.stream.callback = NULL;
 
-        if (callback_status >= HTTP_BAD_REQUEST) /* Status < 400: success */
+        /* Status < 400: success.  Error responses are counted by the call
+         * sending them, unless the headers went out already. */
+        if (callback_status >= HTTP_BAD_REQUEST &&
+            !(request->flags & RESPONSE_SENT_HEADERS)) {
             lwan_default_response(request, callback_status);
+        } else {
+            log_request(request, callback_status,
+                        streamed_body_len(request, callback_status));
+            count_response(request, callback_status);
+        }
         return;
     }
 
+    count_response(request, status);
+
+    if (request->flags & RESPONSE_MAY_COMPRESS)
+        lwan_deflate_response(request);
+
     size_t header_len = lwan_prepare_response_header(request, status, headers, sizeof(headers));
     if (UNLIKELY(!header_len)) {
         lwan_default_response(request, HTTP_INTERNAL_ERROR);
         return;
     }
 
+    char *body = NULL;
+    size_t body_len = 0;
     if (has_response_body[lwan_request_get_method(request)]) {
-        struct iovec response_vec[] = {
-            {
-                .iov_base = headers,
-                .iov_len = header_len
-            },
-            {
-                .iov_base = lwan_strbuf_get_buffer(request->response.buffer),
-                .iov_len = lwan_strbuf_get_length(request->response.buffer)
-            }
-        };
-
-        lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
-    } else {
-        lwan_send(request, headers, header_len, 0);
+        body = lwan_strbuf_get_buffer(request->response.buffer);
+        body_len = lwan_strbuf_get_length(request->response.buffer);
     }
+
+    log_request(request, status, body_len);
+
+    if (request->constant_response)
+        store_constant_response(request, status, headers, header_len, body,
+                                body_len);
+
+    /* More requests are waiting in the buffer: send this response together
+     * with theirs, if it fits. */
+    if (batch_response(request, headers, header_len, body, body_len))
+        return;
+
+    /* Otherwise, send it along with whatever has been batched so far. */
+    struct lwan_output_batch *batch = request->batch;
+    struct iovec response_vec[] = {
+        {
+            .iov_base = batch ? batch->buffer : NULL,
+            .iov_len = batch ? batch->len : 0
+        },
+        {
+            .iov_base = headers,
+            .iov_len = header_len
+        },
+        {
+            .iov_base = body,
+            .iov_len = body_len
+        }
+    };
+    if (batch)
+        batch->len = 0;
+
+    lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
 }
 
 void
@@ -251,6 +560,172 @@ lwan_default_response(struct lwan_request *request, enum lwan_http_status status
 #define APPEND_CONSTANT(const_str_) \
     APPEND_STRING_LEN((const_str_), sizeof(const_str_) - 1)
 
+/*
+ * Responses without additional headers from the same thread, with the same
+ * status, MIME type and connection flags, only differ in their
+ * Content-Length and (once per second) Date and Expires headers.  Each I/O
+ * thread keeps a small direct-mapped cache of pre-rendered headers: the
+ * part before the Content-Length value, and the part after it, where the
+ * dates are written into fixed-width slots when they get stale.
+ */
+#define HEADER_CACHE_SIZE 32
+#define HEADER_CACHE_MIME_TYPE_SIZE 64
+
+struct header_cache_entry {
+    unsigned int key;
+    unsigned short prefix_len;
+    unsigned short suffix_len;
+    unsigned short date_offset;
+    unsigned short expires_offset;
+    time_t date;
+    char mime_type[HEADER_CACHE_MIME_TYPE_SIZE];
+    char prefix[80];
+    char suffix[DEFAULT_HEADERS_SIZE];
+};
+
+enum header_cache_key_flags {
+    HEADER_CACHE_CORS = 1<<0,
+    HEADER_CACHE_KEEP_ALIVE = 1<<1,
+    HEADER_CACHE_HTTP_1_0 = 1<<2,
+    HEADER_CACHE_STATUS_SHIFT = 3,
+};
+
+struct header_cache {
+    struct header_cache_entry entries[HEADER_CACHE_SIZE];
+};
+
+static const char cors_headers[] =
+    "\r\nAccess-Control-Allow-Origin: *"
+    "\r\nAccess-Control-Allow-Methods: GET, POST, OPTIONS"
+    "\r\nAccess-Control-Allow-Credentials: true"
+    "\r\nAccess-Control-Allow-Headers: Origin, Accept, Content-Type";
+
+static unsigned int
+header_cache_key(const struct lwan_request *request,
+    enum lwan_http_status status)
+{
+    /* Never zero, as that's used for empty entries. */
+    unsigned int key = (unsigned int)status << HEADER_CACHE_STATUS_SHIFT;
+
+    if (request->flags & REQUEST_IS_HTTP_1_0)
+        key |= HEADER_CACHE_HTTP_1_0;
+    if (request->conn->flags & CONN_KEEP_ALIVE)
+        key |= HEADER_CACHE_KEEP_ALIVE;
+    if (request->flags & REQUEST_ALLOW_CORS)
+        key |= HEADER_CACHE_CORS;
+
+    return key;
+}
+
+#define COPY_CONSTANT(dest_, const_str_) \
+    mempcpy((dest_), (const_str_), sizeof(const_str_) - 1)
+
+static bool
+header_cache_fill(struct header_cache_entry *entry, unsigned int key,
+    const struct lwan_request *request, enum lwan_http_status status,
+    size_t mime_type_len)
+{
+    const char *status_str = lwan_http_status_as_string_with_code(status);
+    size_t status_len = strlen(status_str);
+    char *p;
+
+    /* "HTTP/1.x " + status + "\r\nContent-Length: " */
+    if (UNLIKELY(status_len + 27 > sizeof(entry->prefix)))
+        return false;
+    /* Content-Type, Connection, Date, Expires, CORS and Server, with a
+     * generous margin. */
+    if (UNLIKELY(mime_type_len + 128 + sizeof(cors_headers) > sizeof(entry->suffix)))
+        return false;
+
+    if (key & HEADER_CACHE_HTTP_1_0)
+        p = COPY_CONSTANT(entry->prefix, "HTTP/1.0 ");
+    else
+        p = COPY_CONSTANT(entry->prefix, "HTTP/1.1 ");
+    p = mempcpy(p, status_str, status_len);
+    p = COPY_CONSTANT(p, "\r\nContent-Length: ");
+    entry->prefix_len = (unsigned short)(p - entry->prefix);
+
+    p = COPY_CONSTANT(entry->suffix, "\r\nContent-Type: ");
+    p = mempcpy(p, request->response.mime_type, mime_type_len);
+    if (key & HEADER_CACHE_KEEP_ALIVE)
+        p = COPY_CONSTANT(p, "\r\nConnection: keep-alive");
+    else
+        p = COPY_CONSTANT(p, "\r\nConnection: close");
+    p = COPY_CONSTANT(p, "\r\nDate: ");
+    entry->date_offset = (unsigned short)(p - entry->suffix);
+    p += 29;
+    p = COPY_CONSTANT(p, "\r\nExpires: ");
+    entry->expires_offset = (unsigned short)(p - entry->suffix);
+    p += 29;
+    if (key & HEADER_CACHE_CORS)
+        p = COPY_CONSTANT(p, cors_headers);
+    p = COPY_CONSTANT(p, "\r\nServer: lwan\r\n\r\n");
+    entry->suffix_len = (unsigned short)(p - entry->suffix);
+
+    memcpy(entry->mime_type, request->response.mime_type, mime_type_len + 1);
+    entry->key = key;
+    entry->date = (time_t)-1;
+
+    return true;
+}
+
+static size_t
+prepare_response_header_from_cache(struct lwan_request *request,
+    enum lwan_http_status status, char headers[], size_t headers_buf_size)
+{
+    struct lwan_thread *thread = request->conn->thread;
+    const char *mime_type = request->response.mime_type;
+    char buffer[INT_TO_STR_BUFFER_SIZE];
+    size_t content_length_len;
+    char *content_length;
+
+    if (UNLIKELY(!thread->header_cache)) {
+        thread->header_cache = calloc(1, sizeof(struct header_cache));
+        if (UNLIKELY(!thread->header_cache))
+            return 0;
+    }
+
+    unsigned int key = header_cache_key(request, status);
+    uintptr_t hash = key ^ ((uintptr_t)mime_type >> 3);
+    hash ^= hash >> 7;
+    struct header_cache_entry *entry =
+        &thread->header_cache->entries[hash % HEADER_CACHE_SIZE];
+
+    if (entry->key != key || strcmp(entry->mime_type, mime_type)) {
+        size_t mime_type_len = strlen(mime_type);
+
+        if (UNLIKELY(mime_type_len >= HEADER_CACHE_MIME_TYPE_SIZE))
+            return 0;
+        if (UNLIKELY(!header_cache_fill(entry, key, request, status, mime_type_len)))
+            return 0;
+    }
+
+    if (entry->date != thread->date.last) {
+        memcpy(entry->suffix + entry->date_offset, thread->date.date, 29);
+        memcpy(entry->suffix + entry->expires_offset, thread->date.expires, 29);
+        entry->date = thread->date.last;
+    }
+
+    if (request->response.stream.callback)
+        content_length = uint_to_string(request->response.content_length,
+            buffer, &content_length_len);
+    else
+        content_length = uint_to_string(
+            lwan_strbuf_get_length(request->response.buffer),
+            buffer, &content_length_len);
+
+    size_t len = entry->prefix_len + content_length_len + entry->suffix_len;
+    if (UNLIKELY(len >= headers_buf_size))
+        return 0;
+
+    char *p = mempcpy(headers, entry->prefix, entry->prefix_len);
+    p = mempcpy(p, content_length, content_length_len);
+    p = mempcpy(p, entry->suffix, entry->suffix_len);
+    *p = '\0';
+
+    return len;
+}
+
 size_t
 lwan_prepare_response_header_full(struct lwan_request *request,
     enum lwan_http_status status,
@@ -264,6 +739,22 @@ lwan_prepare_response_header_full(struct lwan_request *request,
     bool date_overridden = false;
     bool expires_overridden = false;
 
+    if (LIKELY(!(request->flags & (RESPONSE_CHUNKED_ENCODING |
+                                   RESPONSE_NO_CONTENT_LENGTH |
+                                   RESPONSE_COMPRESSED)))) {
+        /* Additional headers are ignored in error responses, except for
+         * 401, which might need WWW-Authenticate. */
+        bool no_additional_headers = !additional_headers || !additional_headers->key ||
+            (status >= HTTP_BAD_REQUEST && status != HTTP_NOT_AUTHORIZED);
+
+        if (LIKELY(no_additional_headers)) {
+            size_t len = prepare_response_header_from_cache(request, status,
+                headers, headers_buf_size);
+            if (LIKELY(len))
+                return len;
+        }
+    }
+
     p_headers = headers;
 
     if (request->flags & REQUEST_IS_HTTP_1_0)
@@ -284,13 +775,23 @@ lwan_prepare_response_header_full(struct lwan_request *request,
             APPEND_UINT(lwan_strbuf_get_length(request->response.buffer));
     }
 
-    APPEND_CONSTANT("\r\nContent-Type: ");
-    APPEND_STRING(request->response.mime_type);
+    if (UNLIKELY(request->conn->flags & CONN_IS_WEBSOCKET)) {
+        APPEND_CONSTANT("\r\nConnection: Upgrade");
+    } else {
+        APPEND_CONSTANT("\r\nContent-Type: ");
+        APPEND_STRING(request->response.mime_type);
 
-    if (request->conn->flags & CONN_KEEP_ALIVE)
-        APPEND_CONSTANT("\r\nConnection: keep-alive");
-    else
-        APPEND_CONSTANT("\r\nConnection: close");
+        if (request->conn->flags & CONN_KEEP_ALIVE)
+            APPEND_CONSTANT("\r\nConnection: keep-alive");
+        else
+            APPEND_CONSTANT("\r\nConnection: close");
+    }
+
+    if (request->flags & RESPONSE_COMPRESSED) {
+        APPEND_CONSTANT("\r\nContent-Encoding: ");
+        APPEND_STRING(lwan_deflate_get_encoding(request));
+        APPEND_CONSTANT("\r\nVary: Accept-Encoding");
+    }
 
     if ((status < HTTP_BAD_REQUEST && additional_headers)) {
         const struct lwan_key_value *header;
@@ -333,12 +834,8 @@ lwan_prepare_response_header_full(struct lwan_request *request,
         APPEND_STRING_LEN(request->conn->thread->date.expires, 29);
     }
 
-    if (request->flags & REQUEST_ALLOW_CORS) {
-        APPEND_CONSTANT("\r\nAccess-Control-Allow-Origin: *"
-            "\r\nAccess-Control-Allow-Methods: GET, POST, OPTIONS"
-            "\r\nAccess-Control-Allow-Credentials: true"
-            "\r\nAccess-Control-Allow-Headers: Origin, Accept, Content-Type");
-    }
+    if (request->flags & REQUEST_ALLOW_CORS)
+        APPEND_CONSTANT(cors_headers);
 
     APPEND_CONSTANT("\r\nServer: lwan\r\n\r\n\0");
 
@@ -351,6 +848,7 @@ lwan_prepare_response_header_full(struct lwan_request *request,
 #undef APPEND_STRING
 #undef APPEND_STRING_LEN
 #undef APPEND_UINT
+#undef COPY_CONSTANT
 #undef RETURN_0_ON_OVERFLOW
 
 ALWAYS_INLINE size_t
@@ -373,6 +871,10 @@ lwan_response_set_chunked(struct lwan_request *request, enum lwan_http_status st
         return false;
 
     request->flags |= RESPONSE_CHUNKED_ENCODING;
+    request->response.content_length = 0;
+    if (request->flags & RESPONSE_MAY_COMPRESS)
+        lwan_deflate_chunked_begin(request);
+
     buffer_len = lwan_prepare_response_header(request, status,
                                                 buffer, DEFAULT_BUFFER_SIZE);
     if (UNLIKELY(!buffer_len))
@@ -384,6 +886,44 @@ lwan_response_set_chunked(struct lwan_request *request, enum lwan_http_status st
     return true;
 }
 
+static void
+send_compressed_chunk(struct lwan_request *request, size_t buffer_len)
+{
+    static const char last_chunk[] = "\r\n0\r\n\r\n";
+    struct lwan_value output;
+    bool last = !buffer_len;
+
+    if (UNLIKELY(!lwan_deflate_chunk(request,
+                                     lwan_strbuf_get_buffer(request->response.buffer),
+                                     buffer_len, last, &output))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    char chunk_size[3 * sizeof(size_t) + 2];
+    int converted_len = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", output.len);
+    if (UNLIKELY(converted_len < 0 || (size_t)converted_len >= sizeof(chunk_size))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    /* The end of the compressed stream goes in the same write as the last,
+     * 0-sized chunk. */
+    struct iovec chunk_vec[] = {
+        { .iov_base = chunk_size, .iov_len = (size_t)converted_len },
+        { .iov_base = output.value, .iov_len = output.len },
+        { .iov_base = (char *)last_chunk, .iov_len = last ? sizeof(last_chunk) - 1 : 2 },
+    };
+
+    lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    request->response.content_length += output.len;
+
+    if (!last) {
+        lwan_strbuf_reset(request->response.buffer);
+        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+    }
+}
+
 void
 lwan_response_send_chunk(struct lwan_request *request)
 {
@@ -393,6 +933,11 @@ lwan_response_send_chunk(struct lwan_request *request)
     }
 
     size_t buffer_len = lwan_strbuf_get_length(request->response.buffer);
+    if (request->flags & RESPONSE_COMPRESSED) {
+        send_compressed_chunk(request, buffer_len);
+        return;
+    }
+
     if (UNLIKELY(!buffer_len)) {
         static const char last_chunk[] = "0\r\n\r\n";
         lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
@@ -414,6 +959,7 @@ lwan_response_send_chunk(struct lwan_request *request)
     };
 
     lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    request->response.content_length += buffer_len;
 
     lwan_strbuf_reset(request->response.buffer);
     coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
@@ -437,7 +983,9 @@ lwan_response_set_event_stream(struct lwan_request *request,
         return false;
 
     request->flags |= RESPONSE_SENT_HEADERS;
-    lwan_send(request, buffer, buffer_len, MSG_MORE);
+    /* The first event might take a while to come (e.g. with pub/sub
+     * topics), so don't hold the headers back waiting for it. */
+    lwan_send(request, buffer, buffer_len, 0);
 
     return true;
 }
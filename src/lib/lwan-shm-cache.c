@@ -0,0 +1,329 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-shm-cache.h"
+
+/* "LWANSHM1"; bump the digit whenever the layout changes. */
+#define SHM_CACHE_MAGIC 0x314d48534e41574cull
+
+/* Slots take this fraction of the file; the rest holds keys and values. */
+#define SLOTS_FRACTION 16
+#define MAX_PROBES 64
+#define VALUE_ALIGNMENT 16
+
+/* Slot tags hold the upper bits of the hash of the key, and the state of
+ * the slot in the lower ones.  Tags go from 0 to WRITING (claiming the
+ * slot) with a compare-and-swap, and then to READY or DEAD (if there was
+ * no room for the value) once; readers only look at READY slots, after
+ * reading their tags. */
+enum {
+    SLOT_EMPTY = 0,
+    SLOT_WRITING = 1,
+    SLOT_READY = 2,
+    SLOT_DEAD = 3,
+    SLOT_STATE_MASK = 3,
+};
+
+struct shm_slot {
+    uint64_t tag;
+    /* Key, followed by the value, from the start of the data area */
+    uint64_t offset;
+    uint32_t key_len;
+    uint32_t value_len;
+};
+
+struct shm_header {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t n_slots;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t data_used;
+};
+
+struct lwan_shm_cache {
+    struct shm_header *header;
+    struct shm_slot *slots;
+    char *data;
+    uint64_t slot_mask;
+    uint64_t data_size;
+    size_t size;
+};
+
+static uint64_t key_hash(const void *key, size_t key_len)
+{
+    /* FNV-1a: the hash has to be the same in every process, so the seeded
+     * hash functions used elsewhere can't be used here. */
+    const unsigned char *p = key;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    /* Never 0 (an empty slot) once the state bits are masked off. */
+    return (hash & ~(uint64_t)SLOT_STATE_MASK) | (SLOT_STATE_MASK + 1);
+}
+
+static bool initialize(struct shm_header *header, size_t size)
+{
+    uint64_t slots_size = size / SLOTS_FRACTION;
+    uint64_t n_slots = 1;
+
+    while (n_slots * 2 * sizeof(struct shm_slot) <= slots_size)
+        n_slots *= 2;
+    if (n_slots < MAX_PROBES)
+        return false;
+
+    header->size = size;
+    header->n_slots = n_slots;
+    header->data_offset = sizeof(*header) + n_slots * sizeof(struct shm_slot);
+    header->data_offset =
+        (header->data_offset + VALUE_ALIGNMENT - 1) & ~(uint64_t)(VALUE_ALIGNMENT - 1);
+    if (header->data_offset >= size)
+        return false;
+    header->data_size = size - header->data_offset;
+    header->data_used = 0;
+
+    /* Written last, so that a process that crashed while initializing the
+     * file leaves it to be initialized again. */
+    __sync_synchronize();
+    header->magic = SHM_CACHE_MAGIC;
+
+    return true;
+}
+
+struct lwan_shm_cache *lwan_shm_cache_open(const char *path, size_t size)
+{
+    struct lwan_shm_cache *shm;
+    struct shm_header *header;
+    struct stat st;
+    bool created = false;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        lwan_status_perror("Could not open shared cache %s", path);
+        return NULL;
+    }
+
+    /* Serializes creation of the file with processes starting at the same
+     * time; lookups and insertions don't need it. */
+    if (flock(fd, LOCK_EX) < 0) {
+        lwan_status_perror("Could not lock shared cache %s", path);
+        goto close_fd;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        lwan_status_perror("Could not stat shared cache %s", path);
+        goto unlock;
+    }
+
+    if (st.st_size == 0) {
+        if (ftruncate(fd, (off_t)size) < 0) {
+            lwan_status_perror("Could not resize shared cache %s", path);
+            goto unlock;
+        }
+        created = true;
+    } else {
+        if ((size_t)st.st_size != size) {
+            lwan_status_warning("Shared cache %s exists with %zu bytes, "
+                                "using that instead of %zu",
+                                path, (size_t)st.st_size, size);
+        }
+        size = (size_t)st.st_size;
+    }
+
+    if (size < sizeof(*header)) {
+        lwan_status_error("Shared cache %s is too small", path);
+        goto unlock;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        lwan_status_perror("Could not map shared cache %s", path);
+        goto unlock;
+    }
+
+    /* Nobody else is initializing it, as the lock is held. */
+    if (created || !header->magic) {
+        if (!initialize(header, size)) {
+            lwan_status_error("Shared cache %s is too small", path);
+            goto unmap;
+        }
+    } else if (header->magic != SHM_CACHE_MAGIC || header->size != size) {
+        lwan_status_error("%s isn't a shared cache (or is from an "
+                          "incompatible version)", path);
+        goto unmap;
+    }
+
+    shm = malloc(sizeof(*shm));
+    if (!shm) {
+        lwan_status_perror("malloc");
+        goto unmap;
+    }
+
+    shm->header = header;
+    shm->slots = (struct shm_slot *)(header + 1);
+    shm->data = (char *)header + header->data_offset;
+    shm->slot_mask = header->n_slots - 1;
+    shm->data_size = header->data_size;
+    shm->size = size;
+
+    /* The mapping keeps the open file description (and with it, the lock)
+     * around after the descriptor is closed. */
+    flock(fd, LOCK_UN);
+    close(fd);
+    return shm;
+
+unmap:
+    munmap(header, size);
+unlock:
+    flock(fd, LOCK_UN);
+close_fd:
+    close(fd);
+    return NULL;
+}
+
+void lwan_shm_cache_close(struct lwan_shm_cache *shm)
+{
+    if (!shm)
+        return;
+
+    munmap(shm->header, shm->size);
+    free(shm);
+}
+
+/* Other processes are trusted as much as this one, but a corrupted file
+ * shouldn't make anybody read past the mapping. */
+static const char *slot_key(const struct lwan_shm_cache *shm,
+                            const struct shm_slot *slot,
+                            const void *key,
+                            size_t key_len)
+{
+    uint64_t offset = ATOMIC_READ(slot->offset);
+    uint64_t len = (uint64_t)slot->key_len + slot->value_len;
+
+    if (slot->key_len != key_len || offset > shm->data_size ||
+        len > shm->data_size - offset)
+        return NULL;
+    if (memcmp(shm->data + offset, key, key_len))
+        return NULL;
+
+    return shm->data + offset;
+}
+
+const void *lwan_shm_cache_get(const struct lwan_shm_cache *shm,
+                               const void *key,
+                               size_t key_len,
+                               size_t *value_len)
+{
+    uint64_t hash = key_hash(key, key_len);
+
+    for (uint64_t i = 0; i < MAX_PROBES; i++) {
+        const struct shm_slot *slot = &shm->slots[(hash + i) & shm->slot_mask];
+        uint64_t tag = ATOMIC_READ(slot->tag);
+        const char *stored;
+
+        if (tag == SLOT_EMPTY)
+            return NULL;
+        if (tag != (hash | SLOT_READY))
+            continue;
+
+        /* Pairs with the barrier before the tag is published. */
+        __sync_synchronize();
+
+        stored = slot_key(shm, slot, key, key_len);
+        if (stored) {
+            *value_len = slot->value_len;
+            return stored + key_len;
+        }
+    }
+
+    return NULL;
+}
+
+const void *lwan_shm_cache_put(struct lwan_shm_cache *shm,
+                               const void *key,
+                               size_t key_len,
+                               const void *value,
+                               size_t value_len)
+{
+    uint64_t hash = key_hash(key, key_len);
+    uint64_t len = ((uint64_t)key_len + value_len + VALUE_ALIGNMENT - 1) &
+                   ~(uint64_t)(VALUE_ALIGNMENT - 1);
+
+    if (key_len > UINT32_MAX || value_len > UINT32_MAX)
+        return NULL;
+
+    for (uint64_t i = 0; i < MAX_PROBES; i++) {
+        struct shm_slot *slot = &shm->slots[(hash + i) & shm->slot_mask];
+        uint64_t tag = ATOMIC_READ(slot->tag);
+        uint64_t offset;
+        char *stored;
+
+        if (tag == SLOT_EMPTY) {
+            if (!__sync_bool_compare_and_swap(&slot->tag, SLOT_EMPTY,
+                                              hash | SLOT_WRITING)) {
+                /* Somebody else got it first; look at it again. */
+                i--;
+                continue;
+            }
+
+            offset = ATOMIC_AAF(&shm->header->data_used, len) - len;
+            if (offset > shm->data_size || len > shm->data_size - offset) {
+                ATOMIC_READ(slot->tag) = hash | SLOT_DEAD;
+                return NULL;
+            }
+
+            stored = shm->data + offset;
+            memcpy(stored, key, key_len);
+            memcpy(stored + key_len, value, value_len);
+            slot->offset = offset;
+            slot->key_len = (uint32_t)key_len;
+            slot->value_len = (uint32_t)value_len;
+
+            __sync_synchronize();
+            ATOMIC_READ(slot->tag) = hash | SLOT_READY;
+
+            return stored + key_len;
+        }
+
+        /* Almost certainly this key, stored (or being stored) by another
+         * process; the caller keeps its own copy this time around. */
+        if ((tag & ~(uint64_t)SLOT_STATE_MASK) == hash)
+            return NULL;
+    }
+
+    return NULL;
+}
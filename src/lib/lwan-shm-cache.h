@@ -0,0 +1,52 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Immutable values shared by every process mapping the same file (usually
+ * on a tmpfs, such as /dev/shm), so that whatever they're derived from is
+ * only computed once per machine.  Lookups don't take locks.  Values are
+ * never evicted: once the file is full, lwan_shm_cache_put() fails and
+ * callers have to keep their own copies; delete the file while no process
+ * is using it to start over.  Keys should identify the contents they're
+ * derived from, as they outlive the processes that stored them. */
+struct lwan_shm_cache;
+
+/* Creates the file with the given size if it doesn't exist yet; otherwise,
+ * the size it was created with is used. */
+struct lwan_shm_cache *lwan_shm_cache_open(const char *path, size_t size);
+void lwan_shm_cache_close(struct lwan_shm_cache *shm);
+
+/* Returned values point to the shared mapping, and are valid until the
+ * cache is closed. */
+const void *lwan_shm_cache_get(const struct lwan_shm_cache *shm,
+                               const void *key,
+                               size_t key_len,
+                               size_t *value_len);
+/* Returns the shared copy of the value; NULL if there's no room, or if
+ * another process stored (or is storing) the same key in the meantime. */
+const void *lwan_shm_cache_put(struct lwan_shm_cache *shm,
+                               const void *key,
+                               size_t key_len,
+                               const void *value,
+                               size_t value_len);
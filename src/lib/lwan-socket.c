@@ -138,11 +138,14 @@ static sa_family_t parse_listener(char *listener, char **node, char **port)
     return parse_listener_ipv4(listener, node, port);
 }
 
-static int listen_addrinfo(int fd, const struct addrinfo *addr)
+static int listen_addrinfo(int fd, const struct addrinfo *addr, bool print)
 {
     if (listen(fd, get_backlog_size()) < 0)
         lwan_status_critical_perror("listen");
 
+    if (!print)
+        return fd;
+
     char host_buf[NI_MAXHOST], serv_buf[NI_MAXSERV];
     int ret = getnameinfo(addr->ai_addr, addr->ai_addrlen, host_buf,
                           sizeof(host_buf), serv_buf, sizeof(serv_buf),
@@ -170,7 +173,8 @@ static int listen_addrinfo(int fd, const struct addrinfo *addr)
             lwan_status_warning("%s not supported by the kernel", #_option);   \
     } while (0)
 
-static int bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
+static int bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port,
+                                     bool print)
 {
     const struct addrinfo *addr;
 
@@ -188,7 +192,7 @@ static int bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
 #endif
 
         if (!bind(fd, addr->ai_addr, addr->ai_addrlen))
-            return listen_addrinfo(fd, addr);
+            return listen_addrinfo(fd, addr, print);
 
         close(fd);
     }
@@ -196,7 +200,7 @@ static int bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
     lwan_status_critical("Could not bind socket");
 }
 
-static int setup_socket_normally(struct lwan *l)
+static int setup_socket_normally(struct lwan *l, bool print)
 {
     char *node, *port;
     char *listener = strdupa(l->config.listener);
@@ -214,7 +218,7 @@ static int setup_socket_normally(struct lwan *l)
     if (ret)
         lwan_status_critical("getaddrinfo: %s", gai_strerror(ret));
 
-    int fd = bind_and_listen_addrinfos(addrs, l->config.reuse_port);
+    int fd = bind_and_listen_addrinfos(addrs, l->config.reuse_port, print);
     freeaddrinfo(addrs);
     return fd;
 }
@@ -223,6 +227,74 @@ static int setup_socket_normally(struct lwan *l)
 #define TCP_FASTOPEN 23
 #endif
 
+static void set_socket_options(const struct lwan *l, int fd)
+{
+    SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
+                      (&(struct linger){.l_onoff = 1, .l_linger = 1}),
+                      sizeof(struct linger));
+
+#ifdef __linux__
+    if (l->config.tcp_fastopen) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN,
+                                   (int[]){(int)l->config.tcp_fastopen},
+                                   sizeof(int));
+    }
+    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK, (int[]){0}, sizeof(int));
+
+    /* Connections only become acceptable once the client sends something
+     * (or after this timeout, in which case the kernel hands them over
+     * anyway); those that never do don't wake up anybody. */
+    if (l->config.tcp_defer_accept) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_DEFER_ACCEPT,
+                                   (int[]){(int)l->config.tcp_defer_accept},
+                                   sizeof(int));
+    }
+
+    /* Inherited by accepted sockets. */
+    if (l->config.busy_poll) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_BUSY_POLL,
+                                   (int[]){(int)l->config.busy_poll},
+                                   sizeof(int));
+    }
+#else
+    (void)l;
+#endif
+}
+
+static void setup_per_thread_sockets(struct lwan *l)
+{
+    lwan_status_debug("Creating one SO_REUSEPORT listener per thread");
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        int fd = setup_socket_normally(l, i == 0);
+
+        /* The I/O threads accept() on their own; the listening socket
+         * must not block them if another thread won the race. */
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0)
+            lwan_status_critical_perror("Could not obtain socket flags");
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+            lwan_status_critical_perror("Could not set socket flags");
+
+        set_socket_options(l, fd);
+
+#ifdef SO_INCOMING_CPU
+        /* Have the kernel prefer the listener of the thread pinned to the
+         * CPU that handled the incoming packets, so that busy polling
+         * spins on the same queue the connection arrived on. */
+        if (l->config.busy_poll && l->thread.threads[i].cpu >= 0) {
+            SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_INCOMING_CPU,
+                                       (int[]){l->thread.threads[i].cpu},
+                                       sizeof(int));
+        }
+#endif
+
+        lwan_thread_add_listener(&l->thread.threads[i], fd);
+    }
+
+    l->main_socket = -1;
+}
+
 void lwan_socket_init(struct lwan *l)
 {
     int fd, n;
@@ -235,17 +307,16 @@ void lwan_socket_init(struct lwan *l)
     } else if (n == 1) {
         fd = setup_socket_from_systemd();
     } else {
-        fd = setup_socket_normally(l);
+#ifdef SO_REUSEPORT
+        if (l->config.reuse_port) {
+            setup_per_thread_sockets(l);
+            return;
+        }
+#endif
+        fd = setup_socket_normally(l, true);
     }
 
-    SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
-                      (&(struct linger){.l_onoff = 1, .l_linger = 1}),
-                      sizeof(struct linger));
-
-#ifdef __linux__
-    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN, (int[]){5}, sizeof(int));
-    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK, (int[]){0}, sizeof(int));
-#endif
+    set_socket_options(l, fd);
 
     l->main_socket = fd;
 }
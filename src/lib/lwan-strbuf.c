@@ -29,6 +29,7 @@
 
 static const unsigned int STATIC = 1 << 0;
 static const unsigned int DYNAMICALLY_ALLOCATED = 1 << 1;
+static const unsigned int FIXED_BUFFER = 1 << 2;
 static const size_t DEFAULT_BUF_SIZE = 64;
 
 static size_t find_next_power_of_two(size_t number)
@@ -76,7 +77,7 @@ static ALWAYS_INLINE size_t max(size_t one, size_t another)
 static bool grow_buffer_if_needed(struct lwan_strbuf *s, size_t size)
 {
     if (s->flags & STATIC) {
-        const size_t aligned_size = align_size(max(size + 1, s->used));
+        const size_t aligned_size = align_size(max(size, s->used) + 1);
         if (UNLIKELY(!aligned_size))
             return false;
 
@@ -85,23 +86,42 @@ static bool grow_buffer_if_needed(struct lwan_strbuf *s, size_t size)
             return false;
 
         memcpy(buffer, s->value.static_buffer, s->used);
-        buffer[s->used + 1] = '\0';
+        buffer[s->used] = '\0';
 
         s->flags &= ~STATIC;
         s->value.buffer = buffer;
+        s->capacity = aligned_size;
 
         return true;
     }
 
-    if (UNLIKELY(find_next_power_of_two(s->used) < size)) {
+    /* Compare against what's actually allocated rather than what's being
+     * used, so that a buffer that has been grown in advance -- or reset
+     * after a large response -- isn't reallocated as it's filled again. */
+    if (UNLIKELY(s->capacity < size)) {
         const size_t aligned_size = align_size(size + 1);
         if (UNLIKELY(!aligned_size))
             return false;
 
-        char *buffer = realloc(s->value.buffer, aligned_size);
-        if (UNLIKELY(!buffer))
-            return false;
-        s->value.buffer = buffer;
+        if (s->flags & FIXED_BUFFER) {
+            /* The caller's buffer was outgrown; move to the heap, and
+             * leave that buffer alone from now on. */
+            char *buffer = malloc(aligned_size);
+            if (UNLIKELY(!buffer))
+                return false;
+
+            memcpy(buffer, s->value.buffer, s->used);
+            buffer[s->used] = '\0';
+
+            s->flags &= ~FIXED_BUFFER;
+            s->value.buffer = buffer;
+        } else {
+            char *buffer = realloc(s->value.buffer, aligned_size);
+            if (UNLIKELY(!buffer))
+                return false;
+            s->value.buffer = buffer;
+        }
+        s->capacity = aligned_size;
     }
 
     return true;
@@ -123,6 +143,23 @@ bool lwan_strbuf_init_with_size(struct lwan_strbuf *s, size_t size)
     return true;
 }
 
+bool lwan_strbuf_init_with_fixed_buffer(struct lwan_strbuf *s,
+                                        void *buffer,
+                                        size_t size)
+{
+    if (UNLIKELY(!s || !size))
+        return false;
+
+    memset(s, 0, sizeof(*s));
+
+    s->flags = FIXED_BUFFER;
+    s->value.buffer = buffer;
+    s->value.buffer[0] = '\0';
+    s->capacity = size;
+
+    return true;
+}
+
 ALWAYS_INLINE bool lwan_strbuf_init(struct lwan_strbuf *s)
 {
     return lwan_strbuf_init_with_size(s, DEFAULT_BUF_SIZE);
@@ -156,20 +193,28 @@ ALWAYS_INLINE struct lwan_strbuf *lwan_strbuf_new_static(const char *str,
     s->flags = STATIC | DYNAMICALLY_ALLOCATED;
     s->value.static_buffer = str;
     s->used = size;
+    s->capacity = 0;
 
     return s;
 }
 
-void lwan_strbuf_free(struct lwan_strbuf *s)
+/* Kept out of line: once lwan_strbuf_free() is inlined into a function
+ * with a strbuf (or its fixed buffer) in the stack or in another struct,
+ * compilers can't tell the flags keep these from being freed, and warn. */
+static void __attribute__((noinline)) free_heap_parts(struct lwan_strbuf *s)
 {
-    if (UNLIKELY(!s))
-        return;
-    if (!(s->flags & STATIC))
+    if (!(s->flags & (STATIC | FIXED_BUFFER)))
         free(s->value.buffer);
     if (s->flags & DYNAMICALLY_ALLOCATED)
         free(s);
 }
 
+void lwan_strbuf_free(struct lwan_strbuf *s)
+{
+    if (LIKELY(s))
+        free_heap_parts(s);
+}
+
 bool lwan_strbuf_append_char(struct lwan_strbuf *s, const char c)
 {
     if (UNLIKELY(!grow_buffer_if_needed(s, s->used + 2)))
@@ -201,12 +246,13 @@ bool lwan_strbuf_set_static(struct lwan_strbuf *s1, const char *s2, size_t sz)
     if (!sz)
         sz = strlen(s2);
 
-    if (!(s1->flags & STATIC))
+    if (!(s1->flags & (STATIC | FIXED_BUFFER)))
         free(s1->value.buffer);
 
     s1->value.static_buffer = s2;
     s1->used = sz;
-    s1->flags |= STATIC;
+    s1->capacity = 0;
+    s1->flags = (s1->flags & ~FIXED_BUFFER) | STATIC;
 
     return true;
 }
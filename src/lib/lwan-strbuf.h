@@ -29,11 +29,18 @@ struct lwan_strbuf {
         const char *static_buffer;
     } value;
     size_t used;
+    size_t capacity;
     unsigned int flags;
 };
 
 bool lwan_strbuf_init_with_size(struct lwan_strbuf *buf, size_t size);
 bool lwan_strbuf_init(struct lwan_strbuf *buf);
+/* Uses the size bytes at buffer (e.g. on the stack) until they're
+ * outgrown, at which point the contents are moved to the heap.  The
+ * buffer must outlive the strbuf. */
+bool lwan_strbuf_init_with_fixed_buffer(struct lwan_strbuf *buf,
+                                        void *buffer,
+                                        size_t size);
 struct lwan_strbuf *lwan_strbuf_new_static(const char *str, size_t size);
 struct lwan_strbuf *lwan_strbuf_new_with_size(size_t size);
 struct lwan_strbuf *lwan_strbuf_new(void);
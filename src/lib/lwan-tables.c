@@ -21,44 +21,14 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-#include <zlib.h>
 
 #include "lwan-private.h"
 
 #include "mime-types.h"
 
-static unsigned char uncompressed_mime_entries[MIME_UNCOMPRESSED_LEN];
-static struct mime_entry mime_entries[MIME_ENTRIES];
-static bool mime_entries_initialized = false;
-
 void
 lwan_tables_init(void)
 {
-    if (mime_entries_initialized)
-        return;
-
-    lwan_status_debug("Uncompressing MIME type table");
-    uLongf uncompressed_length = MIME_UNCOMPRESSED_LEN;
-    int ret = uncompress((Bytef*)uncompressed_mime_entries,
-            &uncompressed_length, (const Bytef*)mime_entries_compressed,
-            MIME_COMPRESSED_LEN);
-    if (ret != Z_OK)
-        lwan_status_critical(
-            "Error while uncompressing table: zlib error %d", ret);
-
-    if (uncompressed_length != MIME_UNCOMPRESSED_LEN)
-        lwan_status_critical("Expected uncompressed length %d, got %ld",
-            MIME_UNCOMPRESSED_LEN, uncompressed_length);
-
-    unsigned char *ptr = uncompressed_mime_entries;
-    for (size_t i = 0; i < MIME_ENTRIES; i++) {
-        mime_entries[i].extension = (char*)ptr;
-        ptr = rawmemchr(ptr + 1, '\0') + 1;
-        mime_entries[i].type = (char*)ptr;
-        ptr = rawmemchr(ptr + 1, '\0') + 1;
-    }
-
-    mime_entries_initialized = true;
 }
 
 void
@@ -66,12 +36,32 @@ lwan_tables_shutdown(void)
 {
 }
 
-static int
-compare_mime_entry(const void *a, const void *b)
+static const char *
+lookup_mime_type(const char *extension)
 {
-    const struct mime_entry *me1 = a;
-    const struct mime_entry *me2 = b;
-    return strcmp(me1->extension, me2->extension);
+    char lowercase[MIME_MAX_EXTENSION_LEN + 1];
+    size_t len;
+
+    for (len = 0; extension[len]; len++) {
+        char c = extension[len];
+
+        if (UNLIKELY(len == MIME_MAX_EXTENSION_LEN))
+            return NULL;
+
+        lowercase[len] = (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+    }
+    lowercase[len] = '\0';
+
+    const uint64_t hash = mime_hash_extension(lowercase, len);
+    const uint32_t displacement =
+        mime_displacements[mime_hash_bucket(hash, MIME_BUCKETS)];
+    const struct mime_entry *entry =
+        &mime_entries[mime_hash_slot(hash, displacement, MIME_TABLE_SIZE)];
+
+    if (LIKELY(entry->extension && streq(entry->extension, lowercase)))
+        return entry->type;
+
+    return NULL;
 }
 
 const char *
@@ -96,13 +86,11 @@ lwan_determine_mime_type_for_file_name(const char *file_name)
         return "application/javascript";
     }
 
-    if (LIKELY(*last_dot)) {
-        struct mime_entry *entry, key = { .extension = last_dot + 1 };
+    if (LIKELY(last_dot[1])) {
+        const char *type = lookup_mime_type(last_dot + 1);
 
-        entry = bsearch(&key, mime_entries, MIME_ENTRIES,
-                       sizeof(struct mime_entry), compare_mime_entry);
-        if (LIKELY(entry))
-            return entry->type;
+        if (LIKELY(type))
+            return type;
     }
 
 fallback:
@@ -115,6 +103,7 @@ static const struct {
     const char *status;
     const char *description;
 } status_table[] = {
+    STATUS(101, "Switching protocols", "The connection is switching to another protocol."),
     STATUS(200, "OK", "Success!"),
     STATUS(206, "Partial content", "Delivering part of requested resource."),
     STATUS(301, "Moved permanently", "This content has moved to another place."),
@@ -129,9 +118,12 @@ static const struct {
     STATUS(416, "Requested range unsatisfiable", "The server can't supply the requested portion of the requested resource."),
     STATUS(418, "I'm a teapot", "Client requested to brew coffee but device is a teapot."),
     STATUS(420, "Client too high", "Client is too high to make a request."),
+    STATUS(429, "Too many requests", "The client has sent too many requests in a given amount of time."),
     STATUS(500, "Internal server error", "The server encountered an internal error that couldn't be recovered from."),
     STATUS(501, "Not implemented", "Server lacks the ability to fulfil the request."),
+    STATUS(502, "Bad gateway", "The upstream server sent an invalid response."),
     STATUS(503, "Service unavailable", "The server is either overloaded or down for maintenance."),
+    STATUS(504, "Gateway timeout", "The upstream server did not respond in time."),
     STATUS(520, "Server too high", "The server is too high to answer the request."),
 };
 #undef STATUS
@@ -39,13 +39,16 @@
 #include <unistd.h>
 
 #include "lwan-private.h"
+#include "lwan-escape.h"
 
+#include "double-to-str.h"
 #include "hash.h"
 #include "int-to-str.h"
 #include "list.h"
 #include "lwan-template.h"
 #include "lwan-strbuf.h"
 #include "lwan-array.h"
+#include "lwan-cache.h"
 
 /* Define this and build a debug version to have the template
  * chunks printed out after compilation. */
@@ -62,6 +65,8 @@ enum action {
     ACTION_IF_VARIABLE_NOT_EMPTY,
     ACTION_END_IF_VARIABLE_NOT_EMPTY,
     ACTION_APPLY_TPL,
+    ACTION_START_CACHE,
+    ACTION_END_CACHE,
     ACTION_LAST
 };
 
@@ -86,6 +91,7 @@ enum lexeme_type {
     LEXEME_GREATER_THAN,
     LEXEME_OPEN_CURLY_BRACE,
     LEXEME_CLOSE_CURLY_BRACE,
+    LEXEME_PERCENT,
     TOTAL_LEXEMES
 };
 
@@ -102,7 +108,8 @@ static const char *lexeme_type_str[TOTAL_LEXEMES] = {
     [LEXEME_HAT] = "HAT",
     [LEXEME_GREATER_THAN] = "GREATER_THAN",
     [LEXEME_OPEN_CURLY_BRACE] = "LEXEME_OPEN_CURLY_BRACE",
-    [LEXEME_CLOSE_CURLY_BRACE] = "LEXEME_CLOSE_CURLY_BRACE"
+    [LEXEME_CLOSE_CURLY_BRACE] = "LEXEME_CLOSE_CURLY_BRACE",
+    [LEXEME_PERCENT] = "PERCENT",
 };
 
 struct chunk {
@@ -116,6 +123,7 @@ DEFINE_ARRAY_TYPE(chunk_array, struct chunk)
 struct lwan_tpl {
     struct chunk_array chunks;
     size_t minimum_size;
+    size_t size_hint;
 };
 
 struct symtab {
@@ -164,8 +172,28 @@ struct chunk_descriptor {
     struct lwan_var_descriptor *descriptor;
 };
 
+/* Sections between {{%key}} and {{/key%}} are rendered once for each value
+ * of the key variable, and kept in a cache until they expire. */
+struct chunk_cache {
+    struct lwan_var_descriptor *key;
+    struct lwan_tpl *tpl;
+    struct chunk *first, *end;
+    struct cache *cache;
+};
+
+struct fragment {
+    struct cache_entry base;
+    struct lwan_strbuf *rendered;
+};
+
 static const char left_meta[] = "{{";
 static const char right_meta[] = "}}";
+static const size_t max_size_hint = 1 << 16;
+static const time_t fragment_time_to_live = 60;
+
+/* The cache only passes a key to its create callback, so the variables
+ * a fragment is being rendered with are passed along through this. */
+static __thread void *fragment_variables;
 static_assert(sizeof(left_meta) == sizeof(right_meta),
     "right_meta and left_meta are the same length");
 
@@ -177,7 +205,9 @@ static void *lex_text(struct lexer *lexer);
 
 static void *parser_end_iter(struct parser *parser, struct lexeme *lexeme);
 static void *parser_end_var_not_empty(struct parser *parser, struct lexeme *lexeme);
+static void *parser_end_cache(struct parser *parser, struct lexeme *lexeme);
 static void *parser_iter(struct parser *parser, struct lexeme *lexeme);
+static void *parser_cache(struct parser *parser, struct lexeme *lexeme);
 static void *parser_meta(struct parser *parser, struct lexeme *lexeme);
 static void *parser_negate(struct parser *parser, struct lexeme *lexeme);
 static void *parser_identifier(struct parser *parser, struct lexeme *lexeme);
@@ -440,6 +470,8 @@ static void *lex_inside_action(struct lexer *lexer)
             emit(lexer, LEXEME_QUESTION_MARK);
         } else if (r == '^') {
             emit(lexer, LEXEME_HAT);
+        } else if (r == '%') {
+            emit(lexer, LEXEME_PERCENT);
         } else if (r == '>') {
             emit(lexer, LEXEME_GREATER_THAN);
             return lex_partial;
@@ -603,7 +635,12 @@ static void *parser_end_iter(struct parser *parser, struct lexeme *lexeme)
         if (iter->action != ACTION_START_ITER)
             continue;
         if (iter->data == symbol) {
-            emit_chunk(parser, ACTION_END_ITER, 0, iter);
+            /* Chunks might move around until the template is finalized, so
+             * refer to the START_ITER chunk by its index for the time being;
+             * post_process_template() turns this into a pointer. */
+            size_t index = (size_t)(iter - (struct chunk *)parser->chunks.base.base);
+
+            emit_chunk(parser, ACTION_END_ITER, 0, (void *)(uintptr_t)index);
             symtab_pop(parser);
             return parser_text;
         }
@@ -641,6 +678,35 @@ static void *parser_end_var_not_empty(struct parser *parser, struct lexeme *lexe
     return error_lexeme(lexeme, "Could not find {{%.*s?}}", (int)lexeme->value.len, lexeme->value.value);
 }
 
+static void *parser_end_cache(struct parser *parser, struct lexeme *lexeme)
+{
+    struct chunk *iter;
+    struct lwan_var_descriptor *symbol;
+
+    if (!parser_stack_top_matches(parser, lexeme, LEXEME_IDENTIFIER))
+        return NULL;
+
+    symbol = symtab_lookup(parser, strndupa(lexeme->value.value, lexeme->value.len));
+    if (!symbol) {
+        return error_lexeme(lexeme, "Unknown variable: %.*s", (int)lexeme->value.len,
+            lexeme->value.value);
+    }
+
+    if (!parser->chunks.base.elements)
+        return error_lexeme(lexeme, "No chunks were emitted but parsing end cache");
+
+    LWAN_ARRAY_FOREACH_REVERSE(&parser->chunks, iter) {
+        if (iter->action != ACTION_START_CACHE)
+            continue;
+        if (iter->data == symbol) {
+            emit_chunk(parser, ACTION_END_CACHE, 0, symbol);
+            return parser_right_meta;
+        }
+    }
+
+    return error_lexeme(lexeme, "Could not find {{%%%.*s}}", (int)lexeme->value.len, lexeme->value.value);
+}
+
 static void *parser_slash(struct parser *parser, struct lexeme *lexeme)
 {
     if (lexeme->type == LEXEME_IDENTIFIER) {
@@ -655,6 +721,9 @@ static void *parser_slash(struct parser *parser, struct lexeme *lexeme)
         if (next->type == LEXEME_QUESTION_MARK)
             return parser_end_var_not_empty(parser, lexeme);
 
+        if (next->type == LEXEME_PERCENT)
+            return parser_end_cache(parser, lexeme);
+
         return unexpected_lexeme_or_lex_error(lexeme, next);
     }
 
@@ -689,6 +758,24 @@ static void *parser_iter(struct parser *parser, struct lexeme *lexeme)
     return unexpected_lexeme(lexeme);
 }
 
+static void *parser_cache(struct parser *parser, struct lexeme *lexeme)
+{
+    if (lexeme->type == LEXEME_IDENTIFIER) {
+        struct lwan_var_descriptor *symbol = symtab_lookup(parser, strndupa(lexeme->value.value, lexeme->value.len));
+        if (!symbol) {
+            return error_lexeme(lexeme, "Unknown variable: %.*s", (int)lexeme->value.len,
+                lexeme->value.value);
+        }
+
+        emit_chunk(parser, ACTION_START_CACHE, FLAGS_NO_FREE, symbol);
+        parser_push_lexeme(parser, lexeme);
+
+        return parser_right_meta;
+    }
+
+    return unexpected_lexeme(lexeme);
+}
+
 static void *parser_negate(struct parser *parser, struct lexeme *lexeme)
 {
     switch (lexeme->type) {
@@ -794,6 +881,9 @@ static void *parser_meta(struct parser *parser, struct lexeme *lexeme)
     if (lexeme->type == LEXEME_HAT)
         return parser_negate;
 
+    if (lexeme->type == LEXEME_PERCENT)
+        return parser_cache;
+
     if (lexeme->type == LEXEME_SLASH)
         return parser_slash;
 
@@ -859,7 +949,12 @@ lwan_tpl_int_is_empty(void *ptr)
 void
 lwan_append_double_to_strbuf(struct lwan_strbuf *buf, void *ptr)
 {
-    lwan_strbuf_append_printf(buf, "%f", *(double *)ptr);
+    char convertbuf[DOUBLE_TO_STR_BUFFER_SIZE];
+    size_t len;
+    char *converted;
+
+    converted = double_to_string(*(double *)ptr, convertbuf, &len);
+    lwan_strbuf_append_str(buf, converted, len);
 }
 
 bool lwan_tpl_double_is_empty(void *ptr)
@@ -891,22 +986,7 @@ lwan_append_str_escaped_to_strbuf(struct lwan_strbuf *buf, void *ptr)
     if (UNLIKELY(!str))
         return;
 
-    for (const char *p = str; *p; p++) {
-        if (*p == '<')
-            lwan_strbuf_append_str(buf, "&lt;", 4);
-        else if (*p == '>')
-            lwan_strbuf_append_str(buf, "&gt;", 4);
-        else if (*p == '&')
-            lwan_strbuf_append_str(buf, "&amp;", 5);
-        else if (*p == '"')
-            lwan_strbuf_append_str(buf, "&quot;", 6);
-        else if (*p == '\'')
-            lwan_strbuf_append_str(buf, "&#x27;", 6);
-        else if (*p == '/')
-            lwan_strbuf_append_str(buf, "&#x2f;", 6);
-        else
-            lwan_strbuf_append_char(buf, *p);
-    }
+    lwan_append_html_escaped(buf, str, 0);
 }
 
 bool
@@ -935,8 +1015,16 @@ free_chunk(struct chunk *chunk)
     case ACTION_VARIABLE_STR_ESCAPE:
     case ACTION_END_IF_VARIABLE_NOT_EMPTY:
     case ACTION_END_ITER:
+    case ACTION_END_CACHE:
         /* do nothing */
         break;
+    case ACTION_START_CACHE: {
+        struct chunk_cache *cc = chunk->data;
+
+        cache_destroy(cc->cache);
+        free(cc);
+        break;
+    }
     case ACTION_IF_VARIABLE_NOT_EMPTY:
     case ACTION_START_ITER:
         free(chunk->data);
@@ -968,12 +1056,203 @@ lwan_tpl_free(struct lwan_tpl *tpl)
     free(tpl);
 }
 
+static struct chunk *apply_until(struct lwan_tpl *tpl, struct chunk *chunks,
+                                 struct lwan_strbuf *buf, void *variables,
+                                 void *until_data);
+
+static struct cache_entry *create_fragment(const char *key __attribute__((unused)),
+                                           void *context)
+{
+    struct chunk_cache *cc = context;
+    struct fragment *fragment = malloc(sizeof(*fragment));
+
+    if (UNLIKELY(!fragment))
+        return NULL;
+
+    fragment->rendered = lwan_strbuf_new();
+    if (UNLIKELY(!fragment->rendered)) {
+        free(fragment);
+        return NULL;
+    }
+
+    apply_until(cc->tpl, cc->first, fragment->rendered, fragment_variables,
+                cc->end);
+    fragment->base.size =
+        sizeof(*fragment) + lwan_strbuf_get_length(fragment->rendered);
+
+    return &fragment->base;
+}
+
+static void destroy_fragment(struct cache_entry *entry,
+                             void *context __attribute__((unused)))
+{
+    struct fragment *fragment = (struct fragment *)entry;
+
+    lwan_strbuf_free(fragment->rendered);
+    free(fragment);
+}
+
+static struct fragment *get_fragment(struct chunk_cache *cc, void *variables)
+{
+    char convertbuf[INT_TO_STR_BUFFER_SIZE];
+    void *previous_variables = fragment_variables;
+    void *key_ptr = (char *)variables + cc->key->offset;
+    struct cache_entry *entry;
+    const char *key;
+    int error;
+
+    if (cc->key->append_to_strbuf == lwan_append_int_to_strbuf) {
+        size_t len;
+
+        key = int_to_string(*(int *)key_ptr, convertbuf, &len);
+    } else {
+        key = *(const char **)key_ptr;
+        if (!key)
+            key = "";
+    }
+
+    /* Sections can be nested, so restore whatever was there before. */
+    fragment_variables = variables;
+    entry = cache_get_and_ref_entry(cc->cache, key, &error);
+    fragment_variables = previous_variables;
+
+    return (struct fragment *)entry;
+}
+
+static bool is_text_chunk(const struct chunk *chunk)
+{
+    return chunk->action == ACTION_APPEND || chunk->action == ACTION_APPEND_CHAR;
+}
+
+static bool is_flat_template(const struct lwan_tpl *tpl)
+{
+    const struct chunk *iter;
+
+    LWAN_ARRAY_FOREACH(&tpl->chunks, iter) {
+        switch (iter->action) {
+        case ACTION_APPEND:
+        case ACTION_APPEND_CHAR:
+        case ACTION_VARIABLE:
+        case ACTION_VARIABLE_STR:
+        case ACTION_VARIABLE_STR_ESCAPE:
+            break;
+        case ACTION_LAST:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool merge_text_chunk(struct chunk *into, struct chunk *chunk)
+{
+    if (into->action == ACTION_APPEND_CHAR) {
+        struct lwan_strbuf *buf = lwan_strbuf_new_with_size(16);
+        if (!buf)
+            return false;
+
+        lwan_strbuf_append_char(buf, (char)(uintptr_t)into->data);
+        into->action = ACTION_APPEND;
+        into->data = buf;
+    }
+
+    if (chunk->action == ACTION_APPEND_CHAR)
+        return lwan_strbuf_append_char(into->data, (char)(uintptr_t)chunk->data);
+
+    if (!lwan_strbuf_append_str(into->data, lwan_strbuf_get_buffer(chunk->data),
+                                lwan_strbuf_get_length(chunk->data)))
+        return false;
+
+    lwan_strbuf_free(chunk->data);
+    return true;
+}
+
+static bool flatten_emit(struct chunk_array *flat, struct chunk *chunk)
+{
+    struct chunk *last = NULL;
+
+    if (flat->base.elements)
+        last = (struct chunk *)flat->base.base + flat->base.elements - 1;
+
+    if (last && is_text_chunk(last) && is_text_chunk(chunk))
+        return merge_text_chunk(last, chunk);
+
+    struct chunk *copy = chunk_array_append(flat);
+    if (!copy)
+        return false;
+
+    *copy = *chunk;
+    return true;
+}
+
+/* Rewrites the program so that partials containing only text and variables
+ * are spliced in place of their APPLY_TPL chunk, and every run of adjacent
+ * text chunks becomes a single APPEND.  Ownership of whatever the chunks
+ * point to moves to the new array. */
+static void flatten_template(struct parser *parser)
+{
+    struct chunk_array flat;
+    struct chunk *chunk;
+    size_t *remap;
+
+    remap = calloc(parser->chunks.base.elements, sizeof(*remap));
+    if (!remap)
+        lwan_status_critical_perror("calloc");
+
+    chunk_array_init(&flat);
+
+    LWAN_ARRAY_FOREACH(&parser->chunks, chunk) {
+        size_t index = (size_t)(chunk - (struct chunk *)parser->chunks.base.base);
+
+        remap[index] = flat.base.elements;
+
+        if (chunk->action == ACTION_END_ITER)
+            chunk->data = (void *)(uintptr_t)remap[(uintptr_t)chunk->data];
+
+        if (chunk->action == ACTION_APPLY_TPL && is_flat_template(chunk->data)) {
+            struct lwan_tpl *partial = chunk->data;
+            struct chunk *partial_chunk;
+
+            LWAN_ARRAY_FOREACH(&partial->chunks, partial_chunk) {
+                if (partial_chunk->action == ACTION_LAST)
+                    break;
+                if (!flatten_emit(&flat, partial_chunk))
+                    goto out_of_memory;
+            }
+
+            parser->tpl->minimum_size += partial->minimum_size;
+
+            chunk_array_reset(&partial->chunks);
+            free(partial);
+            continue;
+        }
+
+        if (!flatten_emit(&flat, chunk))
+            goto out_of_memory;
+
+        if (chunk->action == ACTION_LAST)
+            break;
+    }
+
+    free(remap);
+    chunk_array_reset(&parser->chunks);
+    parser->chunks = flat;
+    return;
+
+out_of_memory:
+    lwan_status_critical("Could not flatten template: out of memory");
+}
+
 static bool
 post_process_template(struct parser *parser)
 {
     struct chunk *prev_chunk;
     struct chunk *chunk;
 
+    flatten_template(parser);
+
     LWAN_ARRAY_FOREACH(&parser->chunks, chunk) {
         if (chunk->action == ACTION_IF_VARIABLE_NOT_EMPTY) {
             for (prev_chunk = chunk; ; chunk++) {
@@ -993,7 +1272,7 @@ post_process_template(struct parser *parser)
             prev_chunk->data = cd;
             prev_chunk->flags &= ~FLAGS_NO_FREE;
 
-            chunk = prev_chunk + 1;
+            chunk = prev_chunk;
         } else if (chunk->action == ACTION_START_ITER) {
             enum flags flags = chunk->flags;
 
@@ -1001,7 +1280,10 @@ post_process_template(struct parser *parser)
                 if (chunk->action == ACTION_LAST)
                     break;
                 if (chunk->action == ACTION_END_ITER) {
-                    if (chunk->data == prev_chunk) {
+                    size_t index = (size_t)(prev_chunk - (struct chunk *)parser->chunks.base.base);
+
+                    if ((uintptr_t)chunk->data == index) {
+                        chunk->data = prev_chunk;
                         chunk->flags |= flags;
                         break;
                     }
@@ -1021,7 +1303,44 @@ post_process_template(struct parser *parser)
             else
                 cd->chunk = chunk + 1;
 
-            chunk = prev_chunk + 1;
+            chunk = prev_chunk;
+        } else if (chunk->action == ACTION_START_CACHE) {
+            for (prev_chunk = chunk; ; chunk++) {
+                if (chunk->action == ACTION_LAST)
+                    break;
+                if (chunk->action == ACTION_END_CACHE
+                            && chunk->data == prev_chunk->data)
+                    break;
+            }
+
+            struct chunk_cache *cc = malloc(sizeof(*cc));
+            if (!cc)
+                lwan_status_critical_perror("malloc");
+
+            cc->key = prev_chunk->data;
+            cc->tpl = parser->tpl;
+            cc->first = prev_chunk + 1;
+            cc->end = chunk;
+            cc->cache = cache_create(create_fragment, destroy_fragment, cc,
+                                     fragment_time_to_live);
+
+            prev_chunk->data = cc;
+            prev_chunk->flags &= ~FLAGS_NO_FREE;
+
+            if (!cc->cache) {
+                lwan_status_error("Could not create cache for section `%s'",
+                                  cc->key->name);
+                return false;
+            }
+
+            if (cc->key->append_to_strbuf != lwan_append_str_to_strbuf &&
+                cc->key->append_to_strbuf != lwan_append_int_to_strbuf) {
+                lwan_status_error("Cache key `%s' must be a string or an integer",
+                                  cc->key->name);
+                return false;
+            }
+
+            chunk = prev_chunk;
         } else if (chunk->action == ACTION_VARIABLE) {
             struct lwan_var_descriptor *descriptor = chunk->data;
             bool escape = chunk->flags & FLAGS_QUOTE;
@@ -1045,6 +1364,7 @@ post_process_template(struct parser *parser)
     }
 
     parser->tpl->chunks = parser->chunks;
+    parser->tpl->size_hint = parser->tpl->minimum_size;
 
     return true;
 }
@@ -1169,6 +1489,7 @@ static void dump_program(const struct lwan_tpl *tpl)
             break;
         case ACTION_END_ITER:
         case ACTION_END_IF_VARIABLE_NOT_EMPTY:
+        case ACTION_END_CACHE:
             break;
         }
 
@@ -1204,7 +1525,8 @@ static void dump_program(const struct lwan_tpl *tpl)
             break;
         }
         case ACTION_END_ITER: {
-            struct chunk_descriptor *descriptor = iter->data;
+            struct chunk *start_iter = iter->data;
+            struct chunk_descriptor *descriptor = start_iter->data;
 
             printf("%s [%s]", instr("END_ITER", instr_buf),
                 descriptor->descriptor->name);
@@ -1226,6 +1548,17 @@ static void dump_program(const struct lwan_tpl *tpl)
         case ACTION_APPLY_TPL:
             printf("%s", instr("APPLY_TEMPLATE", instr_buf));
             break;
+        case ACTION_START_CACHE: {
+            struct chunk_cache *cc = iter->data;
+
+            printf("%s [%s]", instr("START_CACHE", instr_buf), cc->key->name);
+            indent++;
+            break;
+        }
+        case ACTION_END_CACHE:
+            printf("%s", instr("END_CACHE", instr_buf));
+            indent--;
+            break;
         case ACTION_LAST:
             printf("%s", instr("LAST", instr_buf));
         }
@@ -1314,6 +1647,8 @@ apply_until(struct lwan_tpl *tpl, struct chunk *chunks, struct lwan_strbuf *buf,
         [ACTION_APPLY_TPL] = &&action_apply_tpl,
         [ACTION_START_ITER] = &&action_start_iter,
         [ACTION_END_ITER] = &&action_end_iter,
+        [ACTION_START_CACHE] = &&action_start_cache,
+        [ACTION_END_CACHE] = &&action_end_cache,
         [ACTION_LAST] = &&finalize
     };
     struct coro_switcher switcher;
@@ -1369,10 +1704,32 @@ action_end_if_variable_not_empty:
         goto finalize;
     NEXT_ACTION();
 
+action_start_cache: {
+        struct chunk_cache *cc = chunk->data;
+        struct fragment *fragment = get_fragment(cc, variables);
+
+        /* If the fragment couldn't be obtained (e.g. another thread is
+         * rendering it right now), just render it inline instead. */
+        if (LIKELY(fragment)) {
+            lwan_strbuf_append_str(buf,
+                                   lwan_strbuf_get_buffer(fragment->rendered),
+                                   lwan_strbuf_get_length(fragment->rendered));
+            cache_entry_unref(cc->cache, &fragment->base);
+            chunk = cc->end;
+        } else {
+            chunk = apply_until(tpl, chunk + 1, buf, variables, cc->end);
+        }
+        NEXT_ACTION();
+    }
+
+action_end_cache:
+    if (LIKELY(until_data == chunk))
+        goto finalize;
+    NEXT_ACTION();
+
 action_apply_tpl: {
-        struct lwan_strbuf *tmp = lwan_tpl_apply(chunk->data, variables);
-        lwan_strbuf_append_str(buf, lwan_strbuf_get_buffer(tmp), lwan_strbuf_get_length(tmp));
-        lwan_strbuf_free(tmp);
+        struct lwan_tpl *partial = chunk->data;
+        apply_until(partial, partial->chunks.base.base, buf, variables, NULL);
         NEXT_ACTION();
     }
 
@@ -1434,20 +1791,40 @@ finalize:
 struct lwan_strbuf *
 lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl, struct lwan_strbuf *buf, void *variables)
 {
+    size_t size_hint = ATOMIC_READ(tpl->size_hint);
+    size_t applied_size;
+
     lwan_strbuf_reset(buf);
 
-    if (UNLIKELY(!lwan_strbuf_grow_to(buf, tpl->minimum_size)))
+    if (UNLIKELY(!lwan_strbuf_grow_to(buf, size_hint)))
         return NULL;
 
     apply_until(tpl, tpl->chunks.base.base, buf, variables, NULL);
 
+    /* Iterations and variables make the static text a poor estimate of the
+     * final size, so keep a moving average of recent renders instead.  It
+     * follows larger renders immediately and smaller ones slowly, as
+     * undershooting costs a reallocation while overshooting costs only
+     * some memory. */
+    applied_size = lwan_strbuf_get_length(buf);
+    if (applied_size > size_hint) {
+        if (applied_size <= max_size_hint)
+            ATOMIC_READ(tpl->size_hint) = applied_size;
+    } else if (applied_size < size_hint) {
+        ATOMIC_READ(tpl->size_hint) = size_hint - (size_hint - applied_size) / 8;
+    }
+
     return buf;
 }
 
 struct lwan_strbuf *
 lwan_tpl_apply(struct lwan_tpl *tpl, void *variables)
 {
-    struct lwan_strbuf *buf = lwan_strbuf_new_with_size(tpl->minimum_size);
+    struct lwan_strbuf *buf = lwan_strbuf_new_with_size(ATOMIC_READ(tpl->size_hint));
+
+    if (UNLIKELY(!buf))
+        return NULL;
+
     return lwan_tpl_apply_with_buffer(tpl, buf, variables);
 }
 
@@ -21,112 +21,350 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#if defined(HAS_EVENTFD)
+#include <sys/eventfd.h>
+#endif
+#include <sys/socket.h>
 
 #include "lwan-private.h"
+#include "lwan-access-log.h"
+#include "lwan-cache.h"
+#include "lwan-deflate.h"
+#include "lwan-h2.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-timer-wheel.h"
+#include "lwan-trace.h"
+#include "lwan-uring.h"
+#include "lwan-zerocopy.h"
 
 struct death_queue_t {
     const struct lwan *lwan;
-    struct lwan_connection *conns;
-    struct lwan_connection head;
-    unsigned time;
-    unsigned short keep_alive_timeout;
+    struct timer_wheel wheel;
+    int epoll_fd;
+    unsigned int keep_alive_timeout_ms;
+    unsigned int websocket_timeout_ms;
+    unsigned int last_trim_tick;
+
+    /* Past crowded_conns, the keep-alive timeout shrinks as connections
+     * approach overloaded_conns; from there on, new ones are turned away. */
+    unsigned int crowded_conns;
+    unsigned int overloaded_conns;
+
+    /* Per-thread listener taken out of epoll after running out of file
+     * descriptors or memory, until accept_resume_tick. */
+    unsigned int accept_resume_tick;
+    unsigned int accept_backoff_ms;
+    bool accept_paused;
+
+    /* Coroutines of closed connections, ready to be reused.  Coroutines
+     * that remained unused for a whole second are freed. */
+    struct {
+        struct coro **coros;
+        unsigned short count;
+        unsigned short max;
+        unsigned short low_water;
+    } pool;
+
+    /* With edge_triggered_epoll, connections whose coroutines yielded
+     * without having to wait for the socket; they're resumed after each
+     * round of events, as epoll won't report anything new for them. */
+    struct {
+        struct lwan_connection **conns;
+        unsigned int count;
+        unsigned int size;
+    } ready;
+    bool edge_triggered;
 };
 
+#define CORO_POOL_TRIM_TICKS (1000 / TIMER_WHEEL_TICK_MS)
+
+#define MIN_KEEP_ALIVE_TIMEOUT_MS 1000u
+/* Keep-alive connections idle for this long give back the memory their
+ * coroutines grew to while serving earlier requests. */
+#define IDLE_TRIM_MS 2000u
+#define MAX_ACCEPT_BACKOFF_MS 1000u
+
+/* Sent to connections that are shed: it fits in any socket buffer, so it's
+ * either written at once or not at all. */
+static const char overloaded_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Connection: close\r\n"
+    "Retry-After: 1\r\n"
+    "\r\n"
+    "Service unavailable\n";
+
 static const uint32_t events_by_write_flag[] = {
     EPOLLOUT | EPOLLRDHUP | EPOLLERR,
     EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLET
 };
 
-static inline int death_queue_node_to_idx(struct death_queue_t *dq,
+static const uint32_t edge_triggered_events =
+    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLET;
+
+static ALWAYS_INLINE unsigned int
+keep_alive_timeout_ms(const struct death_queue_t *dq,
+                      const struct lwan_thread *t)
+{
+    const unsigned int n_conns = t->n_connections;
+
+    if (LIKELY(n_conns <= dq->crowded_conns))
+        return dq->keep_alive_timeout_ms;
+    if (n_conns >= dq->overloaded_conns ||
+        dq->keep_alive_timeout_ms <= MIN_KEEP_ALIVE_TIMEOUT_MS)
+        return MIN_KEEP_ALIVE_TIMEOUT_MS;
+
+    /* Shrink linearly, so that idle connections make room first. */
+    const uint64_t range = dq->keep_alive_timeout_ms - MIN_KEEP_ALIVE_TIMEOUT_MS;
+    return MIN_KEEP_ALIVE_TIMEOUT_MS +
+           (unsigned int)(range * (dq->overloaded_conns - n_conns) /
+                          (dq->overloaded_conns - dq->crowded_conns));
+}
+
+static void death_queue_move_to_last(struct death_queue_t *dq,
     struct lwan_connection *conn)
 {
-    return (conn == &dq->head) ? -1 : (int)(ptrdiff_t)(conn - dq->conns);
+    /*
+     * If the connection isn't keep alive, it might have a coroutine that
+     * should be resumed.  If that's the case, schedule for this request to
+     * die according to the keep alive timeout.
+     *
+     * If it's not a keep alive connection, or the coroutine shouldn't be
+     * resumed -- then just mark it to be reaped right away.
+     */
+    unsigned int timeout_ms = 0;
+
+    /* Connection might have been closed while its coroutine was resumed;
+     * its file descriptor might even belong to another thread by now.
+     * Suspended coroutines have their own timer armed. */
+    if (UNLIKELY((conn->flags & (CONN_IS_ALIVE | CONN_SUSPENDED)) != CONN_IS_ALIVE))
+        return;
+
+    conn->flags &= ~CONN_IDLE_TRIM;
+
+    /* Waiting in the middle of a transfer: the timer has been armed by the
+     * coroutine, and activity on the socket mustn't push it back. */
+    if (conn->flags & CONN_HAS_DEADLINE)
+        return;
+
+    /* WebSockets are expected to sit idle for much longer than keep-alive
+     * connections, waiting for the next message. */
+    if (conn->flags & CONN_IS_WEBSOCKET)
+        timeout_ms = dq->websocket_timeout_ms;
+    else if (conn->flags & (CONN_KEEP_ALIVE | CONN_SHOULD_RESUME_CORO))
+        timeout_ms = keep_alive_timeout_ms(dq, conn->thread);
+
+    if (timeout_ms > IDLE_TRIM_MS && (conn->flags & CONN_IDLE)) {
+        conn->flags |= CONN_IDLE_TRIM;
+        timeout_ms = IDLE_TRIM_MS;
+    }
+
+    timer_wheel_add(&dq->wheel, conn, timeout_ms);
 }
 
-static inline struct lwan_connection *death_queue_idx_to_node(struct death_queue_t *dq,
-    int idx)
+void lwan_deadline_init(struct lwan_deadline *deadline,
+                        const struct lwan_request *request,
+                        unsigned int timeout)
 {
-    return (idx < 0) ? &dq->head : &dq->conns[idx];
+    /* Streams are multiplexed over a connection with a single timer. */
+    if (request->flags & REQUEST_IS_HTTP_2)
+        timeout = 0;
+
+    deadline->timeout_ms = timeout * 1000u;
+    deadline->start = 0;
+    deadline->started = false;
 }
 
-static void death_queue_insert(struct death_queue_t *dq,
-    struct lwan_connection *new_node)
+bool lwan_deadline_wait(struct lwan_deadline *deadline,
+                        struct lwan_request *request,
+                        size_t transferred)
 {
-    new_node->next = -1;
-    new_node->prev = dq->head.prev;
-    struct lwan_connection *prev = death_queue_idx_to_node(dq, dq->head.prev);
-    dq->head.prev = prev->next = death_queue_node_to_idx(dq, new_node);
+    struct lwan_connection *conn = request->conn;
+    struct timer_wheel *wheel = conn->thread->wheel;
+
+    if (!deadline->timeout_ms)
+        return true;
+
+    if (!deadline->started) {
+        deadline->start = wheel->now;
+        deadline->started = true;
+    }
+
+    uint64_t allowed_ms = deadline->timeout_ms;
+    const unsigned int min_rate = conn->thread->lwan->config.min_transfer_rate;
+    if (min_rate)
+        allowed_ms += (uint64_t)transferred * 1000u / min_rate;
+
+    uint64_t elapsed_ms =
+        (uint64_t)(wheel->now - deadline->start) * TIMER_WHEEL_TICK_MS;
+    if (UNLIKELY(elapsed_ms >= allowed_ms)) {
+        conn->flags &= ~CONN_HAS_DEADLINE;
+        conn->thread->metrics.connections_timed_out++;
+        return false;
+    }
+
+    allowed_ms -= elapsed_ms;
+    timer_wheel_add(wheel, conn,
+                    allowed_ms > UINT_MAX ? UINT_MAX : (unsigned int)allowed_ms);
+    conn->flags |= CONN_HAS_DEADLINE;
+
+    return true;
 }
 
-static void death_queue_remove(struct death_queue_t *dq,
-    struct lwan_connection *node)
+static void
+death_queue_init(struct death_queue_t *dq, const struct lwan *lwan,
+                 int epoll_fd)
 {
-    struct lwan_connection *prev = death_queue_idx_to_node(dq, node->prev);
-    struct lwan_connection *next = death_queue_idx_to_node(dq, node->next);
-    next->prev = node->prev;
-    prev->next = node->next;
+    dq->lwan = lwan;
+    dq->epoll_fd = epoll_fd;
+    dq->keep_alive_timeout_ms = lwan->config.keep_alive_timeout * 1000u;
+    dq->websocket_timeout_ms = lwan->config.websocket_timeout * 1000u;
+    timer_wheel_init(&dq->wheel, lwan->conns);
+    dq->last_trim_tick = dq->wheel.now;
+    dq->accept_paused = false;
+    dq->accept_backoff_ms = 0;
+    dq->edge_triggered = lwan->config.edge_triggered_epoll;
+    dq->ready.conns = NULL;
+    dq->ready.count = dq->ready.size = 0;
+
+    if (lwan->config.overload_threshold) {
+        dq->overloaded_conns = (unsigned int)((uint64_t)lwan->thread.max_fd *
+                                              lwan->config.overload_threshold / 100);
+        if (!dq->overloaded_conns)
+            dq->overloaded_conns = 1;
+        dq->crowded_conns = dq->overloaded_conns / 2;
+    } else {
+        dq->overloaded_conns = dq->crowded_conns = UINT_MAX;
+    }
+
+    dq->pool.count = dq->pool.low_water = 0;
+    dq->pool.max = lwan->config.coro_pool_size;
+    if (!dq->pool.max) {
+        dq->pool.coros = NULL;
+        return;
+    }
 
-    /* FIXME: This shouldn't be required; there may be a bug somewhere when
-     * a few million requests are attended to.  */
-    node->next = node->prev = -1;
+    dq->pool.coros = calloc(dq->pool.max, sizeof(struct coro *));
+    if (UNLIKELY(!dq->pool.coros)) {
+        lwan_status_warning("Could not allocate coroutine pool");
+        dq->pool.max = 0;
+    }
 }
 
-static bool death_queue_empty(struct death_queue_t *dq)
+static ALWAYS_INLINE int
+death_queue_epoll_timeout(struct death_queue_t *dq,
+                          const struct lwan_thread *t)
 {
-    return dq->head.next < 0;
+    int timeout = timer_wheel_timeout(&dq->wheel);
+
+    if (dq->ready.count)
+        return 0;
+
+    /* Keep waking up while there are pooled coroutines so they're trimmed
+     * even if no connections are active.  Same with references to cache
+     * entries, which would otherwise keep evicted ones around, and with
+     * buffers of closed sockets that were sent with MSG_ZEROCOPY. */
+    if ((dq->pool.count || t->holds_cache_refs ||
+         lwan_zerocopy_has_lingering(t)) &&
+        (timeout < 0 || timeout > 1000))
+        timeout = 1000;
+
+    if (UNLIKELY(dq->accept_paused)) {
+        int resume = (int)(dq->accept_resume_tick - dq->wheel.now) *
+                     TIMER_WHEEL_TICK_MS;
+
+        if (resume < 0)
+            resume = 0;
+        if (timeout < 0 || timeout > resume)
+            timeout = resume;
+    }
+
+    return timeout;
 }
 
-static void death_queue_move_to_last(struct death_queue_t *dq,
-    struct lwan_connection *conn)
+static int process_request_coro(struct coro *coro, void *data);
+
+static ALWAYS_INLINE struct coro *
+coro_pool_get(struct death_queue_t *dq, struct coro_switcher *switcher,
+              struct lwan_connection *conn)
 {
-    /*
-     * If the connection isn't keep alive, it might have a coroutine that
-     * should be resumed.  If that's the case, schedule for this request to
-     * die according to the keep alive timeout.
-     *
-     * If it's not a keep alive connection, or the coroutine shouldn't be
-     * resumed -- then just mark it to be reaped right away.
-     */
-    conn->time_to_die = dq->time;
-    if (conn->flags & (CONN_KEEP_ALIVE | CONN_SHOULD_RESUME_CORO))
-        conn->time_to_die += dq->keep_alive_timeout;
+    if (dq->pool.count) {
+        struct coro *coro = dq->pool.coros[--dq->pool.count];
+
+        if (dq->pool.count < dq->pool.low_water)
+            dq->pool.low_water = dq->pool.count;
+
+        coro_reset(coro, process_request_coro, conn);
+        return coro;
+    }
 
-    death_queue_remove(dq, conn);
-    death_queue_insert(dq, conn);
+    return coro_new(switcher, process_request_coro, conn);
+}
+
+static ALWAYS_INLINE void
+coro_pool_put(struct death_queue_t *dq, struct coro *coro)
+{
+    if (dq->pool.count < dq->pool.max) {
+        /* Run deferred callbacks now, so that resources held by the
+         * connection aren't kept around while the coroutine is pooled. */
+        coro_deferred_run(coro, 0);
+        dq->pool.coros[dq->pool.count++] = coro;
+    } else {
+        coro_free(coro);
+    }
 }
 
 static void
-death_queue_init(struct death_queue_t *dq, const struct lwan *lwan)
+coro_pool_trim(struct death_queue_t *dq)
 {
-    dq->lwan = lwan;
-    dq->conns = lwan->conns;
-    dq->time = 0;
-    dq->keep_alive_timeout = lwan->config.keep_alive_timeout;
-    dq->head.next = dq->head.prev = -1;
+    /* Coroutines below the low water mark weren't needed during the last
+     * second; give their memory back.  Stacks of the others are given back
+     * too, as they're only likely to be reused soon. */
+    for (unsigned short i = 0; i < dq->pool.low_water; i++)
+        coro_free(dq->pool.coros[i]);
+    for (unsigned short i = dq->pool.low_water; i < dq->pool.count; i++)
+        coro_trim_unused(dq->pool.coros[i]);
+
+    dq->pool.count = (unsigned short)(dq->pool.count - dq->pool.low_water);
+    memmove(dq->pool.coros, dq->pool.coros + dq->pool.low_water,
+            dq->pool.count * sizeof(struct coro *));
+    dq->pool.low_water = dq->pool.count;
 }
 
-static ALWAYS_INLINE int
-death_queue_epoll_timeout(struct death_queue_t *dq)
+static void
+coro_pool_free(struct death_queue_t *dq)
 {
-    return death_queue_empty(dq) ? -1 : 1000;
+    while (dq->pool.count)
+        coro_free(dq->pool.coros[--dq->pool.count]);
+
+    free(dq->pool.coros);
 }
 
 static ALWAYS_INLINE void
 destroy_coro(struct death_queue_t *dq, struct lwan_connection *conn)
 {
-    death_queue_remove(dq, conn);
+    timer_wheel_del(&dq->wheel, conn);
+    ATOMIC_READ(conn->thread->n_connections)--;
     if (LIKELY(conn->coro)) {
-        coro_free(conn->coro);
+        coro_pool_put(dq, conn->coro);
         conn->coro = NULL;
     }
     if (conn->flags & CONN_IS_ALIVE) {
+        int fd = lwan_connection_get_fd(dq->lwan, conn);
+
         conn->flags &= ~CONN_IS_ALIVE;
-        close(lwan_connection_get_fd(dq->lwan, conn));
+        if (conn->flags & CONN_ZEROCOPY)
+            lwan_zerocopy_forget(conn->thread, fd);
+        close(fd);
     }
 }
 
@@ -136,6 +374,44 @@ min(const int a, const int b)
     return a < b ? a : b;
 }
 
+/* Pipelined requests handled in a row before giving other connections a
+ * chance to run. */
+#define MAX_PIPELINED_WITHOUT_YIELD 16
+
+static void
+free_output_batch(void *data)
+{
+    struct lwan_output_batch *batch = data;
+
+    free(batch->buffer);
+}
+
+/* Buffers a connection waiting for its next request can do without. */
+struct idle_buffers {
+    struct lwan_strbuf *strbuf;
+    char *response_buffer;
+    size_t response_buffer_size;
+    struct lwan_output_batch *batch;
+};
+
+static void
+release_idle_buffers(void *data)
+{
+    struct idle_buffers *idle = data;
+
+    /* Responses have all been sent by now; go back to the buffer on the
+     * stack if one of them outgrew it. */
+    if (lwan_strbuf_get_buffer(idle->strbuf) != idle->response_buffer) {
+        lwan_strbuf_free(idle->strbuf);
+        lwan_strbuf_init_with_fixed_buffer(idle->strbuf, idle->response_buffer,
+                                           idle->response_buffer_size);
+    }
+
+    free(idle->batch->buffer);
+    idle->batch->buffer = NULL;
+    idle->batch->len = 0;
+}
+
 __attribute__((noreturn)) static int
 process_request_coro(struct coro *coro, void *data)
 {
@@ -145,22 +421,57 @@ process_request_coro(struct coro *coro, void *data)
     struct lwan_connection *conn = data;
     const enum lwan_request_flags flags_filter = (REQUEST_PROXIED | REQUEST_ALLOW_CORS);
     struct lwan_strbuf strbuf;
+    /* Most response bodies generated by handlers are small enough to be
+     * built here without ever touching the heap. */
+    char response_buffer[1024];
     struct lwan *lwan = conn->thread->lwan;
     int fd = lwan_connection_get_fd(lwan, conn);
-    char request_buffer[DEFAULT_BUFFER_SIZE];
-    struct lwan_value buffer = {
+    char request_buffer[REQUEST_BUFFER_SIZE];
+    struct lwan_request_buffer buffer = {
         .value = request_buffer,
-        .len = 0
+        .len = 0,
+        .size = sizeof(request_buffer),
+        .small = request_buffer,
+        .thread = conn->thread,
     };
     char *next_request = NULL;
     enum lwan_request_flags flags = 0;
     struct lwan_proxy proxy;
+    struct lwan_output_batch batch = { .buffer = NULL, .len = 0 };
+    struct idle_buffers idle = {
+        .strbuf = &strbuf,
+        .response_buffer = response_buffer,
+        .response_buffer_size = sizeof(response_buffer),
+        .batch = &batch,
+    };
+    int pipelined = 0;
 
-    if (UNLIKELY(!lwan_strbuf_init(&strbuf))) {
+    if (UNLIKELY(!lwan_strbuf_init_with_fixed_buffer(&strbuf, response_buffer,
+                                                     sizeof(response_buffer)))) {
         coro_yield(coro, CONN_CORO_ABORT);
         __builtin_unreachable();
     }
     coro_defer(coro, CORO_DEFER(lwan_strbuf_free), &strbuf);
+    coro_defer(coro, CORO_DEFER(free_output_batch), &batch);
+    coro_defer(coro, lwan_request_buffer_release, &buffer);
+    coro_set_trim_callback(coro, release_idle_buffers, &idle);
+
+    /* Records are encrypted by the kernel past this point, so nothing
+     * else needs to know the connection is using TLS. */
+    if (lwan->tls) {
+        bool http2;
+
+        if (UNLIKELY(!lwan_tls_handshake(lwan, conn, fd, &http2))) {
+            coro_yield(coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+        if (http2)
+            lwan_h2_serve(lwan, conn, fd, NULL, 0);
+    } else {
+        /* Cleartext HTTP/2 is only spoken with prior knowledge: the
+         * client preface is recognized as the first request. */
+        flags |= lwan->config.http2 << REQUEST_ALLOW_HTTP_2_SHIFT;
+    }
 
     flags |= lwan->config.proxy_protocol << REQUEST_ALLOW_PROXY_REQS_SHIFT |
              lwan->config.allow_cors << REQUEST_ALLOW_CORS_SHIFT;
@@ -173,7 +484,8 @@ process_request_coro(struct coro *coro, void *data)
                 .buffer = &strbuf
             },
             .flags = flags,
-            .proxy = &proxy
+            .proxy = &proxy,
+            .batch = &batch
         };
 
         assert(conn->flags & CONN_IS_ALIVE);
@@ -182,31 +494,125 @@ process_request_coro(struct coro *coro, void *data)
         next_request = lwan_process_request(lwan, &request, &buffer, next_request);
         coro_deferred_run(coro, generation);
 
-        coro_yield(coro, CONN_CORO_MAY_RESUME);
+        /* There's no going back to HTTP once the handler is done with a
+         * WebSocket. */
+        if (UNLIKELY(conn->flags & CONN_IS_WEBSOCKET))
+            coro_yield(coro, CONN_CORO_ABORT);
+
+        if (UNLIKELY(request.flags & REQUEST_IS_HTTP_2)) {
+            lwan_h2_serve(lwan, conn, fd, next_request,
+                          (size_t)(buffer.value + buffer.len - next_request));
+        }
+
+        next_request = lwan_request_buffer_shrink(&buffer, next_request);
+
+        /* Go straight to the next pipelined request, batching the responses;
+         * they're sent once the requests read so far have been handled.  */
+        bool has_pipelined = next_request &&
+                             next_request < buffer.value + buffer.len;
+        if (!has_pipelined || ++pipelined == MAX_PIPELINED_WITHOUT_YIELD) {
+            lwan_flush_batch_if_needed(&request);
+            pipelined = 0;
+
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+        }
 
         lwan_strbuf_reset(&strbuf);
         flags = request.flags & flags_filter;
     }
 }
 
+static void
+queue_ready_conn(struct death_queue_t *dq, struct lwan_connection *conn)
+{
+    if (conn->flags & CONN_READY)
+        return;
+
+    if (UNLIKELY(dq->ready.count == dq->ready.size)) {
+        unsigned int size = dq->ready.size ? dq->ready.size * 2 : 64;
+        struct lwan_connection **conns =
+            reallocarray(dq->ready.conns, size, sizeof(*conns));
+
+        if (UNLIKELY(!conns)) {
+            /* It'll be reaped by its timer. */
+            lwan_status_perror("Could not queue connection to be resumed");
+            return;
+        }
+
+        dq->ready.conns = conns;
+        dq->ready.size = size;
+    }
+
+    dq->ready.conns[dq->ready.count++] = conn;
+    conn->flags |= CONN_READY;
+}
+
+/* Events for a direction the coroutine isn't waiting on aren't reported
+ * again with EPOLLET; a pending write is remembered as CONN_WRITE_BLOCKED
+ * being cleared, and reads are always attempted before waiting. */
+static ALWAYS_INLINE bool
+edge_triggered_should_resume(struct lwan_connection *conn, uint32_t events)
+{
+    if (events & EPOLLOUT) {
+        bool write_blocked = conn->flags & CONN_WRITE_BLOCKED;
+
+        conn->flags &= ~CONN_WRITE_BLOCKED;
+        if (write_blocked && !(conn->flags & CONN_MUST_READ))
+            return true;
+    }
+
+    return (events & EPOLLIN) && (conn->flags & CONN_MUST_READ);
+}
+
 static ALWAYS_INLINE void
 resume_coro_if_needed(struct death_queue_t *dq, struct lwan_connection *conn,
     int epoll_fd)
 {
     assert(conn->coro);
 
-    if (!(conn->flags & CONN_SHOULD_RESUME_CORO))
+    /* Suspended coroutines are only resumed by their timer or by the file
+     * descriptor they're waiting on, not by activity on the socket. */
+    if ((conn->flags & (CONN_SHOULD_RESUME_CORO | CONN_SUSPENDED)) !=
+        CONN_SHOULD_RESUME_CORO)
         return;
 
+    ATOMIC_READ(conn->thread->running_conn) = conn;
     enum lwan_connection_coro_yield yield_result = coro_resume(conn->coro);
+    ATOMIC_READ(conn->thread->running_conn) = NULL;
     /* CONN_CORO_ABORT is -1, but comparing with 0 is cheaper */
     if (yield_result < CONN_CORO_MAY_RESUME) {
         destroy_coro(dq, conn);
         return;
     }
 
+    if (dq->edge_triggered) {
+        /* Readiness in both directions is always reported, so epoll is never
+         * told about what the coroutine is waiting for. */
+        if (yield_result == CONN_CORO_SUSPEND || (conn->flags & CONN_MUST_READ))
+            return;
+
+        if (yield_result == CONN_CORO_MAY_RESUME) {
+            conn->flags |= CONN_SHOULD_RESUME_CORO;
+            if (!(conn->flags & CONN_WRITE_BLOCKED))
+                queue_ready_conn(dq, conn);
+        } else {
+            conn->flags &= ~CONN_SHOULD_RESUME_CORO;
+        }
+        return;
+    }
+
     bool write_events;
-    if (conn->flags & CONN_MUST_READ) {
+    if (UNLIKELY(yield_result == CONN_CORO_SUSPEND)) {
+        /* Stop waiting for the socket to become writable while suspended:
+         * these events are level-triggered and would keep waking up this
+         * thread for nothing. */
+        if (!(conn->flags & CONN_WRITE_EVENTS))
+            return;
+        write_events = true;
+    } else if (conn->flags & CONN_MUST_READ) {
+        /* Already waiting for the socket to become readable. */
+        if (!(conn->flags & CONN_WRITE_EVENTS))
+            return;
         write_events = true;
     } else {
         bool should_resume_coro = (yield_result == CONN_CORO_MAY_RESUME);
@@ -234,46 +640,112 @@ resume_coro_if_needed(struct death_queue_t *dq, struct lwan_connection *conn,
 }
 
 static void
-death_queue_kill_waiting(struct death_queue_t *dq)
+resume_ready_coros(struct death_queue_t *dq)
 {
-    dq->time++;
+    /* Coroutines queued again while these are resumed wait for the next
+     * round, so that connections waiting on epoll aren't starved. */
+    const unsigned int count = dq->ready.count;
 
-    while (!death_queue_empty(dq)) {
-        struct lwan_connection *conn = death_queue_idx_to_node(dq, dq->head.next);
+    for (unsigned int i = 0; i < count; i++) {
+        struct lwan_connection *conn = dq->ready.conns[i];
 
-        if (conn->time_to_die > dq->time)
-            return;
+        /* Connections closed after being queued might have been reused
+         * already, with CONN_READY cleared by spawn_coro(). */
+        if ((conn->flags & (CONN_READY | CONN_IS_ALIVE)) !=
+            (CONN_READY | CONN_IS_ALIVE))
+            continue;
 
-        destroy_coro(dq, conn);
+        conn->flags &= ~CONN_READY;
+        resume_coro_if_needed(dq, conn, dq->epoll_fd);
+        death_queue_move_to_last(dq, conn);
     }
 
-    /* Death queue exhausted: reset epoch */
-    dq->time = 0;
+    dq->ready.count -= count;
+    memmove(dq->ready.conns, dq->ready.conns + count,
+            dq->ready.count * sizeof(*dq->ready.conns));
 }
 
 static void
-death_queue_kill_all(struct death_queue_t *dq)
+resume_suspended_coro(struct death_queue_t *dq, struct lwan_connection *conn)
 {
-    while (!death_queue_empty(dq)) {
-        struct lwan_connection *conn = death_queue_idx_to_node(dq, dq->head.next);
-        destroy_coro(dq, conn);
+    conn->flags &= ~CONN_SUSPENDED;
+
+    resume_coro_if_needed(dq, conn, dq->epoll_fd);
+    death_queue_move_to_last(dq, conn);
+}
+
+static void
+trim_idle_coro(struct death_queue_t *dq, struct lwan_connection *conn)
+{
+    unsigned int timeout_ms = keep_alive_timeout_ms(dq, conn->thread);
+
+    conn->flags &= ~CONN_IDLE_TRIM;
+    coro_trim(conn->coro);
+
+    /* Then wait for whatever is left of the keep-alive timeout. */
+    timer_wheel_add(&dq->wheel, conn,
+                    timeout_ms > IDLE_TRIM_MS ? timeout_ms - IDLE_TRIM_MS : 0);
+}
+
+static void
+death_queue_expire(struct lwan_connection *conn, void *data)
+{
+    if (conn->flags & CONN_SUSPENDED) {
+        resume_suspended_coro(data, conn);
+    } else if ((conn->flags & (CONN_IDLE | CONN_IDLE_TRIM)) ==
+               (CONN_IDLE | CONN_IDLE_TRIM)) {
+        trim_idle_coro(data, conn);
+    } else {
+        conn->thread->metrics.connections_timed_out++;
+        destroy_coro(data, conn);
     }
 }
 
+static void
+death_queue_destroy(struct lwan_connection *conn, void *data)
+{
+    destroy_coro(data, conn);
+}
+
+static void
+death_queue_kill_waiting(struct death_queue_t *dq, struct lwan_thread *t)
+{
+    timer_wheel_advance(&dq->wheel, death_queue_expire, dq);
+
+    if (dq->wheel.now - dq->last_trim_tick >= CORO_POOL_TRIM_TICKS) {
+        dq->last_trim_tick = dq->wheel.now;
+        coro_pool_trim(dq);
+
+        if (t->holds_cache_refs)
+            t->holds_cache_refs = cache_sweep_fronts(t);
+        lwan_zerocopy_release_lingering(t);
+    }
+}
+
+static void
+death_queue_kill_all(struct death_queue_t *dq)
+{
+    timer_wheel_expire_all(&dq->wheel, death_queue_destroy, dq);
+}
+
 static void
 update_date_cache(struct lwan_thread *thread)
 {
-    time_t now = time(NULL);
-    if (now != thread->date.last) {
-        thread->date.last = now;
+    const struct lwan_clock *clock;
+
+    lwan_clock_tick();
 
-        lwan_format_rfc_time(now, thread->date.date);
-        lwan_format_rfc_time(now + (time_t)thread->lwan->config.expires,
-                    thread->date.expires);
+    clock = lwan_clock_get();
+    if (clock->now != thread->date.last) {
+        thread->date.last = clock->now;
+
+        memcpy(thread->date.date, clock->date, sizeof(thread->date.date));
+        memcpy(thread->date.expires, clock->expires,
+               sizeof(thread->date.expires));
     }
 }
 
-static ALWAYS_INLINE void
+static ALWAYS_INLINE bool
 spawn_coro(struct lwan_connection *conn,
             struct coro_switcher *switcher, struct death_queue_t *dq)
 {
@@ -281,30 +753,26 @@ spawn_coro(struct lwan_connection *conn,
     assert(!(conn->flags & CONN_IS_ALIVE));
     assert(!(conn->flags & CONN_SHOULD_RESUME_CORO));
 
-    conn->coro = coro_new(switcher, process_request_coro, conn);
-    conn->flags = CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO;
+    conn->coro = coro_pool_get(dq, switcher, conn);
+    if (UNLIKELY(!conn->coro))
+        return false;
 
-    death_queue_insert(dq, conn);
-}
-
-static int
-grab_command(int pipe_fd)
-{
-    int cmd;
-    ssize_t sz = read(pipe_fd, &cmd, sizeof(cmd));
+    conn->flags = CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO;
+    /* Every new socket is writable, so wait for the request. */
+    if (dq->edge_triggered)
+        conn->flags |= CONN_MUST_READ;
 
-    if (UNLIKELY(sz < 0))
-        return -1;
-    if (UNLIKELY((size_t)sz < sizeof(cmd)))
-        return -2;
-    return cmd;
+    ATOMIC_READ(conn->thread->n_connections)++;
+    conn->thread->metrics.connections_accepted++;
+    return true;
 }
 
 static struct lwan_connection *
-watch_client(int epoll_fd, int fd, struct lwan_connection *conns)
+watch_client(int epoll_fd, int fd, struct lwan_connection *conns,
+             uint32_t events)
 {
     struct epoll_event event = {
-        .events = events_by_write_flag[1],
+        .events = events,
         .data.ptr = &conns[fd]
     };
     if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0))
@@ -313,15 +781,339 @@ watch_client(int epoll_fd, int fd, struct lwan_connection *conns)
     return &conns[fd];
 }
 
+/* Turns a connection away without creating a coroutine for it.  TLS
+ * clients wouldn't understand the canned response, so they're just
+ * closed. */
+static void
+shed_client(struct lwan_thread *t, int fd)
+{
+    if (!t->lwan->tls)
+        (void)send(fd, overloaded_response, sizeof(overloaded_response) - 1,
+                   MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    close(fd);
+    t->metrics.connections_shed++;
+}
+
+static void
+serve_client(struct lwan_thread *t, struct coro_switcher *switcher,
+             struct death_queue_t *dq, int fd)
+{
+    struct lwan_connection *conn;
+
+    if (UNLIKELY(t->n_connections >= dq->overloaded_conns)) {
+        shed_client(t, fd);
+        return;
+    }
+
+    conn = watch_client(t->epoll_fd, fd, t->lwan->conns,
+                        dq->edge_triggered ? edge_triggered_events
+                                           : events_by_write_flag[1]);
+    if (UNLIKELY(!conn)) {
+        lwan_status_perror("epoll_ctl");
+        close(fd);
+        return;
+    }
+
+    /* Closing the socket also takes it out of epoll. */
+    if (UNLIKELY(!spawn_coro(conn, switcher, dq))) {
+        shed_client(t, fd);
+        return;
+    }
+
+    death_queue_move_to_last(dq, conn);
+}
+
+static void
+pause_accepting(struct lwan_thread *t, struct death_queue_t *dq)
+{
+    struct epoll_event event = {.events = 0, .data.ptr = t};
+
+    /* Same as back_off_accepting() in lwan.c, without blocking the other
+     * connections handled by this thread. */
+    if (!dq->accept_backoff_ms) {
+        lwan_status_perror("accept");
+        dq->accept_backoff_ms = TIMER_WHEEL_TICK_MS;
+    } else if (dq->accept_backoff_ms < MAX_ACCEPT_BACKOFF_MS) {
+        dq->accept_backoff_ms *= 2;
+    }
+
+    /* The listener is level-triggered, and would otherwise wake this
+     * thread up right away, only for accept() to fail again. */
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, t->listen_fd, &event) < 0)
+        return;
+
+    dq->accept_paused = true;
+    dq->accept_resume_tick =
+        dq->wheel.now + 1 + dq->accept_backoff_ms / TIMER_WHEEL_TICK_MS;
+}
+
+static void
+resume_accepting(struct lwan_thread *t, struct death_queue_t *dq)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = t};
+
+    if ((int)(dq->wheel.now - dq->accept_resume_tick) < 0)
+        return;
+
+    dq->accept_paused = false;
+
+    /* Fails if lwan_thread_stop_accepting() got to it in the meantime. */
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, t->listen_fd, &event) < 0 &&
+        errno != ENOENT)
+        lwan_status_perror("epoll_ctl");
+}
+
+static bool
+accept_pending_clients(struct lwan_thread *t, struct coro_switcher *switcher,
+    struct death_queue_t *dq)
+{
+    uint64_t wakeups[8];
+
+    /* Reset the wakeup file descriptor before draining the queue, so that
+     * anything enqueued from now on will generate a new event. */
+    if (UNLIKELY(read(t->wakeup_fd[0], wakeups, sizeof(wakeups)) < 0)) {
+        if (errno != EAGAIN && errno != EINTR)
+            lwan_status_perror("read");
+    }
+
+    for (;;) {
+        int n_popped = 0;
+        int fd;
+
+        while (mpsc_queue_pop(&t->pending_fds, &fd)) {
+            if (UNLIKELY(fd < 0))
+                return false;
+
+            n_popped++;
+            serve_client(t, switcher, dq, fd);
+        }
+
+        /* Producers increment n_pending after pushing, so this might go
+         * negative for a brief moment; keep trying until every file
+         * descriptor that has been accounted for is consumed. */
+        if (!ATOMIC_AAF(&t->n_pending, -n_popped))
+            return true;
+    }
+}
+
+static void
+accept_clients(struct lwan_thread *t, struct coro_switcher *switcher,
+    struct death_queue_t *dq)
+{
+    struct lwan_connection *conns = t->lwan->conns;
+
+    /* The listening socket is level-triggered, so there's no need to drain
+     * the whole backlog here; whatever is left will wake this thread up
+     * again on the next call to epoll_wait(). */
+    for (int i = 0; i < 64; i++) {
+        int fd = accept4(t->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (UNLIKELY(fd < 0)) {
+            switch (errno) {
+            case EAGAIN:
+            case EINTR:
+            case ECONNABORTED:
+            case EINVAL: /* Listener shut down by lwan_thread_stop_accepting() */
+                return;
+            case EMFILE:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+                pause_accepting(t, dq);
+                return;
+            }
+
+            lwan_status_perror("accept");
+            return;
+        }
+
+        if (UNLIKELY(dq->accept_backoff_ms))
+            dq->accept_backoff_ms /= 2;
+        conns[fd].flags = 0;
+        conns[fd].thread = t;
+
+        serve_client(t, switcher, dq, fd);
+    }
+}
+
+static void
+touch_local_connections(struct lwan_thread *t)
+{
+    struct lwan *l = t->lwan;
+    const unsigned short idx = (unsigned short)(t - l->thread.threads);
+
+    /* Fault in the pages of the connection array this thread has been
+     * assigned, so that they're allocated on its NUMA node. */
+    for (size_t fd = (size_t)idx * CONNS_PER_PAGE; fd < l->n_conns;
+         fd += (size_t)l->thread.count * CONNS_PER_PAGE) {
+        size_t n = l->n_conns - fd;
+
+        if (n > CONNS_PER_PAGE)
+            n = CONNS_PER_PAGE;
+
+        memset(&l->conns[fd], 0, n * sizeof(struct lwan_connection));
+    }
+}
+
+#if defined(USE_IO_URING)
+struct uring_reaper {
+    struct lwan_thread *t;
+    struct coro_switcher *switcher;
+    struct death_queue_t *dq;
+};
+
+/* Takes the listening socket out of epoll and accepts through the ring
+ * instead; epoll is only told about it again once the multishot accept
+ * ends, either to arm it once more or to go back to accept4(). */
+static bool
+uring_accept(struct lwan_thread *t)
+{
+    struct epoll_event event = {.events = 0, .data.ptr = t};
+
+    if (!lwan_uring_accept(t->uring, t->listen_fd))
+        return false;
+
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, t->listen_fd, &event) < 0 &&
+        errno != ENOENT)
+        lwan_status_perror("epoll_ctl");
+    return true;
+}
+
+static void
+uring_accepted(const struct uring_reaper *reaper,
+               const struct lwan_uring_op *op)
+{
+    struct lwan_thread *t = reaper->t;
+    struct death_queue_t *dq = reaper->dq;
+
+    if (LIKELY(op->res >= 0)) {
+        if (UNLIKELY(dq->accept_backoff_ms))
+            dq->accept_backoff_ms /= 2;
+        t->lwan->conns[op->res].flags = 0;
+        t->lwan->conns[op->res].thread = t;
+
+        serve_client(t, reaper->switcher, dq, op->res);
+    }
+
+    if (op->flags & IORING_CQE_F_MORE)
+        return;
+
+    switch (-op->res) {
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+        errno = -op->res;
+        pause_accepting(t, dq);
+        return;
+    case EINVAL:
+        /* Either the kernel doesn't know about multishot accepts, or the
+         * listener has been shut down by lwan_thread_stop_accepting(), in
+         * which case it's gone from epoll and this doesn't matter. */
+        t->uring->accept_unsupported = true;
+        break;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = t};
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, t->listen_fd, &event) < 0 &&
+        errno != ENOENT)
+        lwan_status_perror("epoll_ctl");
+}
+
+static void
+uring_complete(struct lwan_uring_op *op, void *data)
+{
+    const struct uring_reaper *reaper = data;
+    struct lwan_connection *conn = op->conn;
+
+    if (UNLIKELY(!conn)) {
+        uring_accepted(reaper, op);
+        return;
+    }
+
+    if (conn->flags & CONN_SUSPENDED)
+        resume_suspended_coro(reaper->dq, conn);
+}
+
+static int
+uring_submit_and_reap(struct lwan_thread *t, struct uring_reaper *reaper,
+                      int epoll_timeout)
+{
+    if (!t->uring)
+        return epoll_timeout;
+
+    /* Everything queued since the last iteration goes in a single
+     * io_uring_enter(); socket reads and writes usually complete right
+     * away, so look for completions before going to sleep. */
+    lwan_uring_submit(t->uring);
+    lwan_uring_reap(t->uring, uring_complete, reaper);
+
+    /* Coroutines resumed above might have queued more work. */
+    return lwan_uring_has_unsubmitted(t->uring) ? 0 : epoll_timeout;
+}
+
+static void
+create_uring(struct lwan_thread *t)
+{
+    struct lwan_uring *ring = malloc(sizeof(*ring));
+
+    if (ring && lwan_uring_init(ring, 256)) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = ring};
+
+        if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, ring->fd, &event) == 0) {
+            t->uring = ring;
+            return;
+        }
+
+        lwan_uring_free(ring);
+    }
+
+    lwan_status_perror("Could not set up io_uring, using plain writes");
+    free(ring);
+}
+#endif
+
+static int
+wait_for_events(struct lwan_thread *t, struct epoll_event *events,
+                int max_events, int timeout)
+{
+    const uint64_t budget_ns = t->lwan->config.busy_poll * 1000ull;
+
+    /* With busy polling, keep checking for events for a while before
+     * giving up and going to sleep: being woken up again would take longer
+     * than most of the requests a latency-critical deployment handles. */
+    if (budget_ns && timeout) {
+        struct lwan_busy_poll_stats *stats = &t->busy_poll;
+        uint64_t start = lwan_monotonic_ns();
+        uint64_t elapsed;
+
+        do {
+            int n_fds = epoll_wait(t->epoll_fd, events, max_events, 0);
+
+            elapsed = lwan_monotonic_ns() - start;
+            if (n_fds) {
+                ATOMIC_READ(stats->spin_ns) += elapsed;
+                if (n_fds > 0)
+                    ATOMIC_READ(stats->spin_hits)++;
+                return n_fds;
+            }
+        } while (elapsed < budget_ns);
+
+        ATOMIC_READ(stats->spin_ns) += elapsed;
+        ATOMIC_READ(stats->spin_misses)++;
+    }
+
+    return epoll_wait(t->epoll_fd, events, max_events, timeout);
+}
+
 static void *
 thread_io_loop(void *data)
 {
     struct lwan_thread *t = data;
     const int epoll_fd = t->epoll_fd;
-    const int read_pipe_fd = t->pipe_fd[0];
     const int max_events = min((int)t->lwan->thread.max_fd, 1024);
     struct lwan *lwan = t->lwan;
-    struct lwan_connection *conns = lwan->conns;
     struct epoll_event *events;
     struct coro_switcher switcher;
     struct death_queue_t dq;
@@ -330,17 +1122,39 @@ thread_io_loop(void *data)
     lwan_status_debug("Starting IO loop on thread #%d",
         (unsigned short)(ptrdiff_t)(t - t->lwan->thread.threads) + 1);
 
+    if (lwan->config.numa_local_connections)
+        touch_local_connections(t);
+
     events = calloc((size_t)max_events, sizeof(*events));
     if (UNLIKELY(!events))
         lwan_status_critical("Could not allocate memory for events");
 
-    death_queue_init(&dq, lwan);
+    death_queue_init(&dq, lwan, epoll_fd);
+    t->wheel = &dq.wheel;
+#if defined(USE_IO_URING)
+    struct uring_reaper reaper = {.t = t, .switcher = &switcher, .dq = &dq};
+#endif
+    t->tid = gettid();
 
     pthread_barrier_wait(&lwan->thread.barrier);
 
     for (;;) {
-        switch (n_fds = epoll_wait(epoll_fd, events, max_events,
-                                   death_queue_epoll_timeout(&dq))) {
+        int timeout = death_queue_epoll_timeout(&dq, t);
+
+#if defined(USE_IO_URING)
+        timeout = uring_submit_and_reap(t, &reaper, timeout);
+#endif
+
+        n_fds = wait_for_events(t, events, max_events, timeout);
+        LWAN_TRACE2(epoll_wakeup, t, n_fds);
+
+        /* Shutdown waiting sockets, both on timeouts and on activity, so
+         * that busy threads still reap idle connections. */
+        death_queue_kill_waiting(&dq, t);
+        if (UNLIKELY(dq.accept_paused))
+            resume_accepting(t, &dq);
+
+        switch (n_fds) {
         case -1:
             switch (errno) {
             case EBADF:
@@ -348,8 +1162,7 @@ thread_io_loop(void *data)
                 goto epoll_fd_closed;
             }
             continue;
-        case 0: /* timeout: shutdown waiting sockets */
-            death_queue_kill_waiting(&dq);
+        case 0:
             break;
         default: /* activity in some of this poller's file descriptor */
             update_date_cache(t);
@@ -357,50 +1170,92 @@ thread_io_loop(void *data)
             for (struct epoll_event *ep_event = events; n_fds--; ep_event++) {
                 struct lwan_connection *conn;
 
-                if (!ep_event->data.ptr) {
-                    int cmd = grab_command(read_pipe_fd);
-                    if (LIKELY(cmd >= 0)) {
-                        conn = watch_client(epoll_fd, cmd, conns);
-                        spawn_coro(conn, &switcher, &dq);
-                    } else if (UNLIKELY(cmd == -1)) {
+#if defined(USE_IO_URING)
+                if (t->uring && ep_event->data.ptr == t->uring) {
+                    lwan_uring_reap(t->uring, uring_complete, &reaper);
+                    continue;
+                }
+#endif
+
+                if (ep_event->data.ptr == t) {
+                    /* Per-thread SO_REUSEPORT listener. */
+#if defined(USE_IO_URING)
+                    if (t->uring && uring_accept(t))
                         continue;
-                    } else if (UNLIKELY(cmd == -2)) {
+#endif
+                    accept_clients(t, &switcher, &dq);
+                    continue;
+                }
+
+                if (!ep_event->data.ptr) {
+                    if (UNLIKELY(!accept_pending_clients(t, &switcher, &dq)))
                         goto epoll_fd_closed;
-                    } else {
-                        lwan_status_debug("Unknown command received, ignored");
-                        continue;
-                    }
-                } else {
-                    conn = ep_event->data.ptr;
-                    if (UNLIKELY(ep_event->events & (EPOLLRDHUP | EPOLLHUP))) {
-                        destroy_coro(&dq, conn);
+                    continue;
+                }
+
+                if (UNLIKELY((uintptr_t)ep_event->data.ptr & CONN_AWAITED_FD_TAG)) {
+                    conn = (struct lwan_connection *)(
+                        (uintptr_t)ep_event->data.ptr & ~CONN_AWAITED_FD_TAG);
+                    if (conn->flags & CONN_SUSPENDED)
+                        resume_suspended_coro(&dq, conn);
+                    continue;
+                }
+
+                conn = ep_event->data.ptr;
+                if (UNLIKELY((conn->flags & CONN_ZEROCOPY) &&
+                             (ep_event->events & EPOLLERR))) {
+                    lwan_zerocopy_reap(
+                        t, lwan_connection_get_fd(dq.lwan, conn));
+                }
+                if (UNLIKELY(ep_event->events & (EPOLLRDHUP | EPOLLHUP))) {
+                    /* The coroutine will find out from the pending operation
+                     * on its own, and its stack has to outlive it. */
+                    if (conn->flags & CONN_URING_PENDING)
                         continue;
-                    }
+                    destroy_coro(&dq, conn);
+                    continue;
+                }
 
-                    resume_coro_if_needed(&dq, conn, epoll_fd);
+                if (dq.edge_triggered &&
+                    !edge_triggered_should_resume(conn, ep_event->events)) {
+                    death_queue_move_to_last(&dq, conn);
+                    continue;
                 }
 
+                resume_coro_if_needed(&dq, conn, epoll_fd);
                 death_queue_move_to_last(&dq, conn);
             }
         }
+
+        if (dq.ready.count)
+            resume_ready_coros(&dq);
     }
 
 epoll_fd_closed:
     pthread_barrier_wait(&lwan->thread.barrier);
 
     death_queue_kill_all(&dq);
+    t->wheel = NULL;
+    coro_pool_free(&dq);
+    free(dq.ready.conns);
     free(events);
 
+    if (t->listen_fd >= 0)
+        close(t->listen_fd);
+
     return NULL;
 }
 
 static void
-create_thread(struct lwan *l, struct lwan_thread *thread)
+create_thread(struct lwan *l, struct lwan_thread *thread, int cpu)
 {
     pthread_attr_t attr;
 
     memset(thread, 0, sizeof(*thread));
     thread->lwan = l;
+    thread->listen_fd = -1;
+    thread->splice_pipe[0] = thread->splice_pipe[1] = -1;
+    thread->cpu = cpu;
 
     if ((thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
         lwan_status_critical_perror("epoll_create");
@@ -414,13 +1269,42 @@ create_thread(struct lwan *l, struct lwan_thread *thread)
     if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE))
         lwan_status_critical_perror("pthread_attr_setdetachstate");
 
-    if (pipe2(thread->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0)
+    if (cpu >= 0) {
+#if defined(HAS_PTHREAD_ATTR_SETAFFINITY)
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET((size_t)cpu, &set);
+
+        if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set))
+            lwan_status_critical_perror("pthread_attr_setaffinity_np");
+#else
+        lwan_status_warning("CPU affinity not supported on this platform");
+#endif
+    }
+
+    size_t queue_size = l->thread.max_fd < 4096 ? l->thread.max_fd : 4096;
+    if (mpsc_queue_init(&thread->pending_fds, queue_size) < 0)
+        lwan_status_critical("Could not initialize pending connection queue");
+
+#if defined(HAS_EVENTFD)
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        lwan_status_critical_perror("eventfd");
+    thread->wakeup_fd[0] = thread->wakeup_fd[1] = fd;
+#else
+    if (pipe2(thread->wakeup_fd, O_NONBLOCK | O_CLOEXEC) < 0)
         lwan_status_critical_perror("pipe");
+#endif
 
     struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
-    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->pipe_fd[0], &event) < 0)
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->wakeup_fd[0], &event) < 0)
         lwan_status_critical_perror("epoll_ctl");
 
+#if defined(USE_IO_URING)
+    create_uring(thread);
+#endif
+
     if (pthread_create(&thread->self, &attr, thread_io_loop, thread))
         lwan_status_critical_perror("pthread_create");
 
@@ -428,65 +1312,281 @@ create_thread(struct lwan *l, struct lwan_thread *thread)
         lwan_status_critical_perror("pthread_attr_destroy");
 }
 
+static bool
+wake_up_thread(struct lwan_thread *t)
+{
+    /* The same buffer works for both eventfd() and pipes. */
+    const uint64_t event = 1;
+
+    while (true) {
+        if (LIKELY(write(t->wakeup_fd[1], &event, sizeof(event)) >= 0))
+            return true;
+
+        if (errno != EINTR)
+            return errno == EAGAIN;
+    }
+}
+
+void
+lwan_thread_flush_clients(struct lwan_thread *t)
+{
+    const int n_queued = t->n_queued;
+
+    if (!n_queued)
+        return;
+
+    t->n_queued = 0;
+    if (ATOMIC_AAF(&t->n_pending, n_queued) == n_queued &&
+        UNLIKELY(!wake_up_thread(t)))
+        lwan_status_perror("write");
+}
+
 void
-lwan_thread_add_client(struct lwan_thread *t, int fd)
+lwan_thread_queue_client(struct lwan_thread *t, int fd)
 {
     t->lwan->conns[fd].flags = 0;
     t->lwan->conns[fd].thread = t;
 
-    if (UNLIKELY(write(t->pipe_fd[1], &fd, sizeof(int)) < 0))
-        lwan_status_perror("write");
+    /* Once the I/O thread knows about what's in the queue, it'll drain it
+     * soon. */
+    while (UNLIKELY(!mpsc_queue_push(&t->pending_fds, fd))) {
+        lwan_thread_flush_clients(t);
+        sched_yield();
+    }
+
+    t->n_queued++;
+}
+
+void
+lwan_thread_add_listener(struct lwan_thread *t, int fd)
+{
+    /* The thread itself is used as the marker for its listening socket, as
+     * it can't be confused with either a connection or the wakeup file
+     * descriptor. */
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = t };
+
+    t->listen_fd = fd;
+
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        lwan_status_critical_perror("epoll_ctl");
+}
+
+void
+lwan_thread_stop_accepting(struct lwan *l)
+{
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        struct lwan_thread *t = &l->thread.threads[i];
+
+        if (t->listen_fd < 0)
+            continue;
+
+        /* The descriptor is only closed once the thread is done with it;
+         * shutting it down takes it out of the SO_REUSEPORT group, so that
+         * the kernel stops queueing connections nobody will accept. */
+        if (epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, t->listen_fd, NULL) < 0)
+            lwan_status_perror("epoll_ctl");
+        if (shutdown(t->listen_fd, SHUT_RDWR) < 0)
+            lwan_status_perror("shutdown");
+    }
+}
+
+static size_t
+parse_cpu_list(const char *spec, int *cpus, size_t max_cpus)
+{
+    size_t n_cpus = 0;
+    cpu_set_t allowed_set;
+    bool allowed = !sched_getaffinity(0, sizeof(allowed_set), &allowed_set);
+
+    /* Accepts lists such as "0-3,8,10-11", as used by taskset(1). */
+    while (*spec) {
+        char *end;
+        long first, last;
+
+        first = last = strtol(spec, &end, 10);
+        if (end == spec || first < 0 || first >= CPU_SETSIZE)
+            goto invalid;
+
+        if (*end == '-') {
+            spec = end + 1;
+            last = strtol(spec, &end, 10);
+            if (end == spec || last < first || last >= CPU_SETSIZE)
+                goto invalid;
+        }
+
+        for (long cpu = first; cpu <= last && n_cpus < max_cpus; cpu++) {
+            if (allowed && !CPU_ISSET((size_t)cpu, &allowed_set)) {
+                lwan_status_warning("CPU %ld not available, ignoring", cpu);
+                continue;
+            }
+            cpus[n_cpus++] = (int)cpu;
+        }
+
+        if (*end == ',')
+            end++;
+        else if (*end)
+            goto invalid;
+        spec = end;
+    }
+
+    return n_cpus;
+
+invalid:
+    lwan_status_warning("Invalid CPU list, not pinning I/O threads");
+    return 0;
 }
 
 void
 lwan_thread_init(struct lwan *l)
 {
+    int cpus[CPU_SETSIZE];
+    size_t n_cpus = 0;
+
     if (pthread_barrier_init(&l->thread.barrier, NULL, (unsigned)l->thread.count + 1))
         lwan_status_critical("Could not create barrier");
 
     lwan_status_debug("Initializing threads");
 
-    l->thread.threads = calloc((size_t)l->thread.count, sizeof(struct lwan_thread));
-    if (!l->thread.threads)
+    /* Aligned so that the metrics of each thread get their own cache
+     * lines. */
+    if (posix_memalign((void **)&l->thread.threads, 64,
+                       (size_t)l->thread.count * sizeof(struct lwan_thread)))
         lwan_status_critical("Could not allocate memory for threads");
+    memset(l->thread.threads, 0,
+           (size_t)l->thread.count * sizeof(struct lwan_thread));
+
+    if (l->config.cpu_affinity)
+        n_cpus = parse_cpu_list(l->config.cpu_affinity, cpus, N_ELEMENTS(cpus));
 
-    for (short i = 0; i < l->thread.count; i++)
-        create_thread(l, &l->thread.threads[i]);
+    for (short i = 0; i < l->thread.count; i++) {
+        int cpu = n_cpus ? cpus[(size_t)i % n_cpus] : -1;
+
+        create_thread(l, &l->thread.threads[i], cpu);
+    }
 
     pthread_barrier_wait(&l->thread.barrier);
 
+    /* Nothing is listening yet, so threads won't log anything before
+     * their rings are in place. */
+    if (!lwan_access_log_init(l))
+        lwan_status_critical("Could not initialize access log");
+
     lwan_status_debug("IO threads created and ready to serve");
 }
 
+void
+lwan_get_busy_poll_stats(const struct lwan *l,
+                         struct lwan_busy_poll_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        const struct lwan_busy_poll_stats *t = &l->thread.threads[i].busy_poll;
+
+        stats->spin_ns += ATOMIC_READ(t->spin_ns);
+        stats->spin_hits += ATOMIC_READ(t->spin_hits);
+        stats->spin_misses += ATOMIC_READ(t->spin_misses);
+    }
+}
+
+const unsigned int
+    lwan_metrics_latency_bounds_us[LWAN_METRICS_LATENCY_BUCKETS - 1] = {
+        50,    100,    250,    500,    1000,   2500,   5000,
+        10000, 25000,  50000,  100000, 250000, 500000, 1000000,
+};
+
+void
+lwan_metrics_record_latency(struct lwan_thread *t, unsigned long long ns)
+{
+    const unsigned long long us = ns / 1000;
+    int bucket;
+
+    for (bucket = 0; bucket < LWAN_METRICS_LATENCY_BUCKETS - 1; bucket++) {
+        if (us <= lwan_metrics_latency_bounds_us[bucket])
+            break;
+    }
+
+    t->metrics.latency[bucket]++;
+    t->metrics.latency_sum_ns += ns;
+}
+
+const unsigned int
+    lwan_metrics_stack_bounds[LWAN_METRICS_STACK_BUCKETS - 1] = {
+        1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072,
+};
+
+void
+lwan_metrics_record_stack_usage(struct lwan_stack_usage *usage, size_t bytes)
+{
+    unsigned long long max = ATOMIC_READ(usage->max);
+    int bucket;
+
+    for (bucket = 0; bucket < LWAN_METRICS_STACK_BUCKETS - 1; bucket++) {
+        if (bytes <= lwan_metrics_stack_bounds[bucket])
+            break;
+    }
+
+    /* Shared by all threads serving the prefix. */
+    ATOMIC_INC(usage->buckets[bucket]);
+    ATOMIC_AAF(&usage->sum, bytes);
+    while (bytes > max) {
+        if (__sync_bool_compare_and_swap(&usage->max, max, bytes))
+            break;
+        max = ATOMIC_READ(usage->max);
+    }
+}
+
+void
+lwan_get_metrics(const struct lwan *l, struct lwan_thread_metrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        const struct lwan_thread_metrics *t = &l->thread.threads[i].metrics;
+
+        metrics->connections_accepted += ATOMIC_READ(t->connections_accepted);
+        metrics->connections_timed_out += ATOMIC_READ(t->connections_timed_out);
+        metrics->connections_shed += ATOMIC_READ(t->connections_shed);
+        metrics->requests += ATOMIC_READ(t->requests);
+        metrics->bytes_sent += ATOMIC_READ(t->bytes_sent);
+        metrics->latency_sum_ns += ATOMIC_READ(t->latency_sum_ns);
+
+        for (size_t j = 0; j < N_ELEMENTS(t->responses); j++)
+            metrics->responses[j] += ATOMIC_READ(t->responses[j]);
+        for (size_t j = 0; j < N_ELEMENTS(t->latency); j++)
+            metrics->latency[j] += ATOMIC_READ(t->latency[j]);
+    }
+}
+
 void
 lwan_thread_shutdown(struct lwan *l)
 {
     lwan_status_debug("Shutting down threads");
 
+    if (l->config.busy_poll) {
+        struct lwan_busy_poll_stats stats;
+
+        lwan_get_busy_poll_stats(l, &stats);
+        lwan_status_debug("Busy polling: %llu hits, %llu misses, %llums "
+                          "spinning",
+                          stats.spin_hits, stats.spin_misses,
+                          stats.spin_ns / 1000000);
+    }
+
     for (int i = l->thread.count - 1; i >= 0; i--) {
         struct lwan_thread *t = &l->thread.threads[i];
-        char less_than_int = 0;
-        ssize_t r;
 
         lwan_status_debug("Closing epoll for thread %d (fd=%d)", i,
             t->epoll_fd);
 
-        /* Close the epoll_fd and write less than an int to signal the
-         * thread to gracefully finish.  */
+        /* Close the epoll_fd and enqueue an invalid file descriptor to
+         * signal the thread to gracefully finish.  */
         close(t->epoll_fd);
 
-        while (true) {
-            r = write(t->pipe_fd[1], &less_than_int, sizeof(less_than_int));
-
-            if (r >= 0)
-                break;
-
-            if (errno == EAGAIN || errno == EINTR)
-                continue;
-
-            lwan_status_error("Could not write to I/O thread (%d) pipe to shutdown", i);
-            break;
-        }
+        while (!mpsc_queue_push(&t->pending_fds, -1))
+            sched_yield();
+        ATOMIC_INC(t->n_pending);
+        if (!wake_up_thread(t))
+            lwan_status_error("Could not wake up I/O thread (%d) to shutdown", i);
     }
 
     pthread_barrier_wait(&l->thread.barrier);
@@ -495,14 +1595,34 @@ lwan_thread_shutdown(struct lwan *l)
     for (int i = l->thread.count - 1; i >= 0; i--) {
         struct lwan_thread *t = &l->thread.threads[i];
 
-        lwan_status_debug("Closing pipe (%d, %d)", t->pipe_fd[0],
-            t->pipe_fd[1]);
-        close(t->pipe_fd[0]);
-        close(t->pipe_fd[1]);
+        lwan_status_debug("Closing wakeup file descriptors (%d, %d)",
+            t->wakeup_fd[0], t->wakeup_fd[1]);
+        close(t->wakeup_fd[0]);
+        if (t->wakeup_fd[1] != t->wakeup_fd[0])
+            close(t->wakeup_fd[1]);
+        mpsc_queue_free(&t->pending_fds);
+        free(t->header_cache);
+        lwan_response_constant_cache_free(t);
+        if (t->splice_pipe[0] >= 0) {
+            close(t->splice_pipe[0]);
+            close(t->splice_pipe[1]);
+        }
 
         lwan_status_debug("Waiting for thread %d to finish", i);
         pthread_join(l->thread.threads[i].self, NULL);
+        lwan_deflate_pool_free(t->deflate_pool);
+        lwan_zerocopy_free(t->zerocopy);
+        lwan_request_buffer_pool_free(t);
+
+#if defined(USE_IO_URING)
+        if (t->uring) {
+            lwan_uring_free(t->uring);
+            free(t->uring);
+        }
+#endif
     }
 
+    lwan_access_log_shutdown(l);
+
     free(l->thread.threads);
 }
@@ -139,3 +139,87 @@ int lwan_format_rfc_time(const time_t in, char out[static 30])
 
     return 0;
 }
+
+/*
+ * Clock shared by all threads.  Whichever thread first notices that the
+ * second has changed formats the new Date and Expires values into the next
+ * slot, and then publishes it; readers only load the index of the current
+ * slot.  A slot is only reused after CLOCK_SLOTS seconds, long after any
+ * reader is done with it.
+ */
+#define CLOCK_SLOTS 4
+
+static struct lwan_clock clock_slots[CLOCK_SLOTS];
+static unsigned int clock_current;
+static int clock_updating;
+static time_t clock_expires;
+static clockid_t realtime_clock_id = CLOCK_REALTIME;
+static clockid_t monotonic_clock_id = CLOCK_MONOTONIC;
+
+static clockid_t
+coarse_clock_id(clockid_t coarse_id, clockid_t fallback_id)
+{
+    struct timespec ts;
+
+    /* Coarse clocks are read from the vDSO, without entering the kernel,
+     * and are precise enough for timestamps with a resolution of one
+     * second. */
+    if (!clock_gettime(coarse_id, &ts))
+        return coarse_id;
+    return fallback_id;
+}
+
+void lwan_clock_init(time_t expires)
+{
+#if defined(CLOCK_REALTIME_COARSE)
+    realtime_clock_id = coarse_clock_id(CLOCK_REALTIME_COARSE, CLOCK_REALTIME);
+#endif
+#if defined(CLOCK_MONOTONIC_COARSE)
+    monotonic_clock_id = coarse_clock_id(CLOCK_MONOTONIC_COARSE, CLOCK_MONOTONIC);
+#endif
+
+    clock_expires = expires;
+    clock_slots[ATOMIC_READ(clock_current)].now = -1;
+
+    lwan_clock_tick();
+}
+
+void lwan_clock_tick(void)
+{
+    struct timespec realtime, monotonic;
+    struct lwan_clock *slot;
+    unsigned int next;
+
+    if (UNLIKELY(clock_gettime(realtime_clock_id, &realtime) < 0))
+        return;
+    if (LIKELY(realtime.tv_sec == lwan_clock_get()->now))
+        return;
+
+    /* Another thread is already updating it. */
+    if (!__sync_bool_compare_and_swap(&clock_updating, 0, 1))
+        return;
+    if (UNLIKELY(realtime.tv_sec == lwan_clock_get()->now))
+        goto out;
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &monotonic) < 0))
+        goto out;
+
+    next = (ATOMIC_READ(clock_current) + 1) % CLOCK_SLOTS;
+    slot = &clock_slots[next];
+
+    slot->now = realtime.tv_sec;
+    slot->monotonic = monotonic.tv_sec;
+    lwan_format_rfc_time(realtime.tv_sec, slot->date);
+    lwan_format_rfc_time(realtime.tv_sec + clock_expires, slot->expires);
+
+    __sync_synchronize();
+    ATOMIC_READ(clock_current) = next;
+
+out:
+    __sync_synchronize();
+    ATOMIC_READ(clock_updating) = 0;
+}
+
+const struct lwan_clock *lwan_clock_get(void)
+{
+    return &clock_slots[ATOMIC_READ(clock_current)];
+}
@@ -0,0 +1,338 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+
+#include "lwan-private.h"
+#include "lwan-timer-wheel.h"
+
+/*
+ * Links are stored as ints: a positive value N refers to the connection
+ * with file descriptor N - 1, and a negative value -N to the head of slot
+ * N - 1.  Zero means "not linked", so that a zeroed connection array
+ * needs no initialization.
+ *
+ * Slot 0..255 are the root level, with one tick per slot; each of the
+ * following levels has 64 slots, each covering a whole turn of the
+ * previous level.  Timers are cascaded down one level every time the
+ * level below it wraps around, as in the classic Linux implementation.
+ */
+
+#define ROOT_MASK (TIMER_WHEEL_ROOT_SIZE - 1)
+#define LEVEL_MASK (TIMER_WHEEL_LEVEL_SIZE - 1)
+#define LEVEL_SHIFT(n_) (TIMER_WHEEL_ROOT_BITS + (unsigned int)(n_) * TIMER_WHEEL_LEVEL_BITS)
+#define LEVEL_SLOT(n_) (TIMER_WHEEL_ROOT_SIZE + (unsigned int)(n_) * TIMER_WHEEL_LEVEL_SIZE)
+
+static ALWAYS_INLINE int conn_to_link(const struct timer_wheel *tw,
+                                      const struct lwan_connection *conn)
+{
+    return (int)(conn - tw->conns) + 1;
+}
+
+static ALWAYS_INLINE int slot_to_link(unsigned int slot)
+{
+    return -(int)slot - 1;
+}
+
+static ALWAYS_INLINE int *link_prev(struct timer_wheel *tw, int link)
+{
+    return link > 0 ? &tw->conns[link - 1].prev : &tw->slots[-link - 1].prev;
+}
+
+static ALWAYS_INLINE int *link_next(struct timer_wheel *tw, int link)
+{
+    return link > 0 ? &tw->conns[link - 1].next : &tw->slots[-link - 1].next;
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &ts) < 0))
+        lwan_status_critical_perror("clock_gettime");
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static ALWAYS_INLINE void set_root_pending(struct timer_wheel *tw,
+                                           unsigned int slot)
+{
+    tw->root_pending[slot / 64] |= 1ull << (slot % 64);
+}
+
+static ALWAYS_INLINE void clear_root_pending(struct timer_wheel *tw,
+                                             unsigned int slot)
+{
+    tw->root_pending[slot / 64] &= ~(1ull << (slot % 64));
+}
+
+static unsigned int slot_for_expiration(const struct timer_wheel *tw,
+                                        unsigned int expires)
+{
+    int delta = (int)(expires - tw->now);
+
+    if (delta < 0)
+        return tw->now & ROOT_MASK;
+    if (delta < 1 << LEVEL_SHIFT(0))
+        return expires & ROOT_MASK;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < 1 << LEVEL_SHIFT(level + 1))
+            return LEVEL_SLOT(level) +
+                   ((expires >> LEVEL_SHIFT(level)) & LEVEL_MASK);
+    }
+
+    /* Timers beyond the range of the wheel are parked at the farthest slot
+     * and cascaded down from there as usual, as their time_to_die is
+     * checked upon expiration. */
+    if (delta >= 1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))
+        expires = tw->now + (1u << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1;
+
+    return LEVEL_SLOT(TIMER_WHEEL_LEVELS - 1) +
+           ((expires >> LEVEL_SHIFT(TIMER_WHEEL_LEVELS - 1)) & LEVEL_MASK);
+}
+
+static void link_conn(struct timer_wheel *tw, struct lwan_connection *conn)
+{
+    unsigned int slot = slot_for_expiration(tw, conn->time_to_die);
+    const int head = slot_to_link(slot);
+    const int node = conn_to_link(tw, conn);
+    struct timer_wheel_slot *s = &tw->slots[slot];
+
+    conn->prev = s->prev;
+    conn->next = head;
+    *link_next(tw, s->prev) = node;
+    s->prev = node;
+
+    if (slot < TIMER_WHEEL_ROOT_SIZE)
+        set_root_pending(tw, slot);
+
+    tw->count++;
+}
+
+static void unlink_conn(struct timer_wheel *tw, struct lwan_connection *conn)
+{
+    const int prev = conn->prev;
+    const int next = conn->next;
+
+    *link_next(tw, prev) = next;
+    *link_prev(tw, next) = prev;
+
+    /* Both neighbors being the same slot head means it's now empty. */
+    if (prev == next && prev < 0) {
+        unsigned int slot = (unsigned int)(-prev - 1);
+
+        if (slot < TIMER_WHEEL_ROOT_SIZE)
+            clear_root_pending(tw, slot);
+    }
+
+    conn->prev = conn->next = 0;
+    tw->count--;
+}
+
+/* Detaches all connections from a slot, and calls func() for each one of
+ * them.  func() is free to rearm the timer for the connection it has been
+ * given, even if it ends up in the same slot. */
+static void drain_slot(struct timer_wheel *tw, unsigned int slot,
+                       void (*func)(struct timer_wheel *tw,
+                                    struct lwan_connection *conn,
+                                    void *data),
+                       void *data)
+{
+    struct timer_wheel_slot *s = &tw->slots[slot];
+    const int head = slot_to_link(slot);
+    int link = s->next;
+
+    s->next = s->prev = head;
+    if (slot < TIMER_WHEEL_ROOT_SIZE)
+        clear_root_pending(tw, slot);
+
+    while (link != head) {
+        struct lwan_connection *conn = &tw->conns[link - 1];
+
+        link = conn->next;
+        conn->prev = conn->next = 0;
+        tw->count--;
+
+        func(tw, conn, data);
+    }
+}
+
+static void relink_conn(struct timer_wheel *tw,
+                        struct lwan_connection *conn,
+                        void *data __attribute__((unused)))
+{
+    link_conn(tw, conn);
+}
+
+struct expire_data {
+    timer_wheel_expire_func func;
+    void *data;
+    unsigned int tick;
+};
+
+static void expire_conn(struct timer_wheel *tw,
+                        struct lwan_connection *conn,
+                        void *data)
+{
+    struct expire_data *ed = data;
+
+    /* Deadlines are postponed lazily; only expire if it's really due. */
+    if ((int)(conn->time_to_die - ed->tick) > 0)
+        link_conn(tw, conn);
+    else
+        ed->func(conn, ed->data);
+}
+
+static bool cascade(struct timer_wheel *tw, int level)
+{
+    unsigned int index = (tw->now >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+
+    drain_slot(tw, LEVEL_SLOT(level) + index, relink_conn, NULL);
+
+    return index == 0;
+}
+
+static void process_tick(struct timer_wheel *tw,
+                         timer_wheel_expire_func func, void *data)
+{
+    struct expire_data ed = {.func = func, .data = data, .tick = tw->now};
+    unsigned int index = tw->now & ROOT_MASK;
+
+    if (!index) {
+        for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            if (!cascade(tw, level))
+                break;
+        }
+    }
+
+    tw->now++;
+    tw->next_tick_ms += TIMER_WHEEL_TICK_MS;
+
+    drain_slot(tw, index, expire_conn, &ed);
+}
+
+void timer_wheel_init(struct timer_wheel *tw, struct lwan_connection *conns)
+{
+    tw->conns = conns;
+    tw->now = 0;
+    tw->count = 0;
+    tw->next_tick_ms = monotonic_ms() + TIMER_WHEEL_TICK_MS;
+
+    memset(tw->root_pending, 0, sizeof(tw->root_pending));
+
+    for (unsigned int slot = 0; slot < N_ELEMENTS(tw->slots); slot++)
+        tw->slots[slot].next = tw->slots[slot].prev = slot_to_link(slot);
+}
+
+void timer_wheel_add(struct timer_wheel *tw, struct lwan_connection *conn,
+                     unsigned int timeout_ms)
+{
+    /* Round up, so that timers never expire early. */
+    unsigned int expires =
+        tw->now + (timeout_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+
+    if (timer_wheel_armed(conn)) {
+        /* The slot a connection is in is never later than its
+         * time_to_die, so postponing is just a matter of updating it. */
+        if ((int)(expires - conn->time_to_die) >= 0) {
+            conn->time_to_die = expires;
+            return;
+        }
+
+        unlink_conn(tw, conn);
+    }
+
+    conn->time_to_die = expires;
+    link_conn(tw, conn);
+}
+
+void timer_wheel_del(struct timer_wheel *tw, struct lwan_connection *conn)
+{
+    if (timer_wheel_armed(conn))
+        unlink_conn(tw, conn);
+}
+
+int timer_wheel_timeout(const struct timer_wheel *tw)
+{
+    if (!tw->count)
+        return -1;
+
+    /* Wake up for the next non-empty root slot, or when the root level
+     * wraps around and timers need to be cascaded down. */
+    unsigned int index = tw->now & ROOT_MASK;
+    unsigned int ticks = index ? TIMER_WHEEL_ROOT_SIZE - index : 0;
+
+    for (unsigned int slot = index; ticks && slot < TIMER_WHEEL_ROOT_SIZE;) {
+        uint64_t pending = tw->root_pending[slot / 64] >> (slot % 64);
+
+        if (pending) {
+            ticks = slot + (unsigned int)__builtin_ctzll(pending) - index;
+            break;
+        }
+
+        slot = (slot + 64) & ~63u;
+    }
+
+    uint64_t now_ms = monotonic_ms();
+    uint64_t wake_ms = tw->next_tick_ms + ticks * TIMER_WHEEL_TICK_MS;
+
+    return wake_ms > now_ms ? (int)(wake_ms - now_ms) : 0;
+}
+
+void timer_wheel_advance(struct timer_wheel *tw, timer_wheel_expire_func func,
+                         void *data)
+{
+    uint64_t now_ms = monotonic_ms();
+
+    while (now_ms >= tw->next_tick_ms) {
+        if (!tw->count) {
+            /* Nothing to expire: catch up with the clock at once. */
+            uint64_t ticks =
+                (now_ms - tw->next_tick_ms) / TIMER_WHEEL_TICK_MS + 1;
+
+            tw->now += (unsigned int)ticks;
+            tw->next_tick_ms += ticks * TIMER_WHEEL_TICK_MS;
+            break;
+        }
+
+        process_tick(tw, func, data);
+    }
+}
+
+static void expire_unconditionally(struct timer_wheel *tw
+                                   __attribute__((unused)),
+                                   struct lwan_connection *conn,
+                                   void *data)
+{
+    struct expire_data *ed = data;
+
+    ed->func(conn, ed->data);
+}
+
+void timer_wheel_expire_all(struct timer_wheel *tw,
+                            timer_wheel_expire_func func, void *data)
+{
+    struct expire_data ed = {.func = func, .data = data};
+
+    for (unsigned int slot = 0; slot < N_ELEMENTS(tw->slots); slot++)
+        drain_slot(tw, slot, expire_unconditionally, &ed);
+}
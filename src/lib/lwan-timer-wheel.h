@@ -0,0 +1,79 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lwan.h"
+
+#define TIMER_WHEEL_TICK_MS 10
+
+#define TIMER_WHEEL_ROOT_BITS 8
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_ROOT_SIZE (1 << TIMER_WHEEL_ROOT_BITS)
+#define TIMER_WHEEL_LEVEL_SIZE (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+
+struct timer_wheel_slot {
+    int prev, next;
+};
+
+/*
+ * Hierarchical timer wheel for connections, using the prev/next/time_to_die
+ * fields of struct lwan_connection.  A connection can have at most one
+ * timer; arming it again just moves its deadline.  Postponing a deadline
+ * only writes to time_to_die; the connection is moved to the right slot
+ * when its old slot expires.
+ */
+struct timer_wheel {
+    struct lwan_connection *conns;
+    uint64_t next_tick_ms;
+    unsigned int now;
+    unsigned int count;
+    uint64_t root_pending[TIMER_WHEEL_ROOT_SIZE / 64];
+    struct timer_wheel_slot
+        slots[TIMER_WHEEL_ROOT_SIZE + TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_SIZE];
+};
+
+typedef void (*timer_wheel_expire_func)(struct lwan_connection *conn,
+                                        void *data);
+
+void timer_wheel_init(struct timer_wheel *tw, struct lwan_connection *conns);
+
+void timer_wheel_add(struct timer_wheel *tw, struct lwan_connection *conn,
+                     unsigned int timeout_ms);
+void timer_wheel_del(struct timer_wheel *tw, struct lwan_connection *conn);
+
+int timer_wheel_timeout(const struct timer_wheel *tw);
+void timer_wheel_advance(struct timer_wheel *tw, timer_wheel_expire_func func,
+                         void *data);
+void timer_wheel_expire_all(struct timer_wheel *tw,
+                            timer_wheel_expire_func func, void *data);
+
+static inline bool timer_wheel_empty(const struct timer_wheel *tw)
+{
+    return tw->count == 0;
+}
+
+static inline bool timer_wheel_armed(const struct lwan_connection *conn)
+{
+    return conn->prev != 0;
+}
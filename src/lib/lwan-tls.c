@@ -0,0 +1,437 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "lwan-private.h"
+
+#if defined(HAVE_KTLS)
+
+#include <linux/tls.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/*
+ * Only the handshake is performed by OpenSSL.  Once it's done, the
+ * application traffic keys are derived from the secrets it hands to the
+ * key log callback, and given to the kernel, which then encrypts and
+ * decrypts records on its own: the socket can be used with read(),
+ * writev() and sendfile() as if it were a plain TCP connection, and the
+ * SSL object is freed right away.
+ *
+ * This is restricted to TLS 1.3 without session tickets: no record is
+ * sent with the traffic keys before the kernel takes over, so both
+ * sequence numbers start at zero.
+ */
+
+struct lwan_tls {
+    SSL_CTX *ctx;
+    EVP_KDF *hkdf;
+};
+
+struct traffic_secrets {
+    unsigned char client[EVP_MAX_MD_SIZE];
+    unsigned char server[EVP_MAX_MD_SIZE];
+    size_t client_len;
+    size_t server_len;
+};
+
+union kernel_crypto_info {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+    struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+};
+
+static int secrets_index = -1;
+
+static void keylog_callback(const SSL *ssl, const char *line)
+{
+    struct traffic_secrets *secrets = SSL_get_ex_data(ssl, secrets_index);
+    unsigned char *secret;
+    size_t *len;
+
+    if (!secrets)
+        return;
+
+    if (!strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ",
+                 sizeof("CLIENT_TRAFFIC_SECRET_0 ") - 1)) {
+        secret = secrets->client;
+        len = &secrets->client_len;
+    } else if (!strncmp(line, "SERVER_TRAFFIC_SECRET_0 ",
+                        sizeof("SERVER_TRAFFIC_SECRET_0 ") - 1)) {
+        secret = secrets->server;
+        len = &secrets->server_len;
+    } else {
+        return;
+    }
+
+    /* Label, client random, then the secret itself. */
+    line = strchr(line, ' ');
+    line = line ? strchr(line + 1, ' ') : NULL;
+    if (!line || OPENSSL_hexstr2buf_ex(secret, EVP_MAX_MD_SIZE, len, line + 1,
+                                       '\0') != 1)
+        *len = 0;
+}
+
+static bool hkdf_expand_label(const struct lwan_tls *tls,
+                              const EVP_MD *md,
+                              const unsigned char *secret,
+                              size_t secret_len,
+                              const char *label,
+                              unsigned char *out,
+                              size_t out_len)
+{
+    /* struct HkdfLabel from RFC 8446 section 7.1, with an empty context. */
+    unsigned char info[2 + 1 + sizeof("tls13 ") - 1 + 8 + 1];
+    const size_t label_len = strlen(label);
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    EVP_KDF_CTX *kctx;
+    bool ret;
+
+    if (label_len > 8)
+        return false;
+
+    info[0] = (unsigned char)(out_len >> 8);
+    info[1] = (unsigned char)out_len;
+    info[2] = (unsigned char)(sizeof("tls13 ") - 1 + label_len);
+    memcpy(info + 3, "tls13 ", sizeof("tls13 ") - 1);
+    memcpy(info + 3 + sizeof("tls13 ") - 1, label, label_len);
+    info[3 + sizeof("tls13 ") - 1 + label_len] = 0;
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+                                         (char *)EVP_MD_get0_name(md), 0),
+        OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY,
+                                          (void *)secret, secret_len),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info,
+                                          3 + sizeof("tls13 ") - 1 +
+                                              label_len + 1),
+        OSSL_PARAM_construct_end(),
+    };
+
+    kctx = EVP_KDF_CTX_new(tls->hkdf);
+    if (!kctx)
+        return false;
+
+    ret = EVP_KDF_derive(kctx, out, out_len, params) > 0;
+    EVP_KDF_CTX_free(kctx);
+
+    return ret;
+}
+
+#define SET_KEY_AND_IV(ci_, member_, key_, iv_)                               \
+    ({                                                                        \
+        memcpy((ci_)->member_.key, key_, sizeof((ci_)->member_.key));         \
+        memcpy((ci_)->member_.salt, iv_, sizeof((ci_)->member_.salt));        \
+        memcpy((ci_)->member_.iv, (iv_) + sizeof((ci_)->member_.salt),        \
+               sizeof((ci_)->member_.iv));                                    \
+        (socklen_t) sizeof((ci_)->member_);                                   \
+    })
+
+static bool set_kernel_keys(const struct lwan_tls *tls,
+                            int fd,
+                            int direction,
+                            const SSL_CIPHER *cipher,
+                            const unsigned char *secret,
+                            size_t secret_len)
+{
+    const EVP_MD *md = SSL_CIPHER_get_handshake_digest(cipher);
+    union kernel_crypto_info ci = {.info.version = TLS_1_3_VERSION};
+    unsigned char key[32], iv[12];
+    size_t key_len;
+    socklen_t ci_len;
+    bool ret = false;
+
+    switch (SSL_CIPHER_get_protocol_id(cipher)) {
+    case 0x1301: /* TLS_AES_128_GCM_SHA256 */
+        ci.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+        break;
+    case 0x1302: /* TLS_AES_256_GCM_SHA384 */
+        ci.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+        break;
+    case 0x1303: /* TLS_CHACHA20_POLY1305_SHA256 */
+        ci.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        key_len = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+        break;
+    default:
+        return false;
+    }
+
+    if (!md || !secret_len)
+        return false;
+    if (!hkdf_expand_label(tls, md, secret, secret_len, "key", key, key_len))
+        goto out;
+    if (!hkdf_expand_label(tls, md, secret, secret_len, "iv", iv, sizeof(iv)))
+        goto out;
+
+    switch (ci.info.cipher_type) {
+    case TLS_CIPHER_AES_GCM_128:
+        ci_len = SET_KEY_AND_IV(&ci, aes_gcm_128, key, iv);
+        break;
+    case TLS_CIPHER_AES_GCM_256:
+        ci_len = SET_KEY_AND_IV(&ci, aes_gcm_256, key, iv);
+        break;
+    default:
+        ci_len = SET_KEY_AND_IV(&ci, chacha20_poly1305, key, iv);
+        break;
+    }
+
+    ret = setsockopt(fd, SOL_TLS, direction, &ci, ci_len) == 0;
+
+out:
+    OPENSSL_cleanse(&ci, sizeof(ci));
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    return ret;
+}
+
+#undef SET_KEY_AND_IV
+
+static void cleanse_secrets(void *data)
+{
+    OPENSSL_cleanse(data, sizeof(struct traffic_secrets));
+}
+
+bool lwan_tls_handshake(struct lwan *l,
+                        struct lwan_connection *conn,
+                        int fd,
+                        bool *http2)
+{
+    struct coro *coro = conn->coro;
+    size_t generation = coro_deferred_get_generation(coro);
+    struct traffic_secrets secrets = {.client_len = 0, .server_len = 0};
+    const SSL_CIPHER *cipher;
+    const unsigned char *alpn;
+    unsigned int alpn_len;
+    bool ret = false;
+    SSL *ssl;
+
+    ssl = SSL_new(l->tls->ctx);
+    if (UNLIKELY(!ssl))
+        return false;
+
+    /* The coroutine might never be resumed while waiting for the client,
+     * so tear things down from the deferred queue. */
+    coro_defer(coro, CORO_DEFER(SSL_free), ssl);
+    coro_defer(coro, cleanse_secrets, &secrets);
+
+    if (UNLIKELY(!SSL_set_fd(ssl, fd)))
+        goto out;
+    if (UNLIKELY(!SSL_set_ex_data(ssl, secrets_index, &secrets)))
+        goto out;
+
+    while (true) {
+        int r = SSL_accept(ssl);
+
+        if (r == 1)
+            break;
+
+        switch (SSL_get_error(ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+            conn->flags |= CONN_MUST_READ;
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            conn->flags &= ~CONN_MUST_READ;
+            conn->flags |= CONN_WRITE_BLOCKED;
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+            break;
+        default:
+            lwan_status_debug("TLS handshake failed: %s",
+                              ERR_reason_error_string(ERR_peek_error()));
+            ERR_clear_error();
+            goto out;
+        }
+    }
+    conn->flags &= ~CONN_MUST_READ;
+
+    /* Anything OpenSSL read past the handshake would be lost. */
+    if (UNLIKELY(SSL_has_pending(ssl)))
+        goto out;
+
+    SSL_get0_alpn_selected(ssl, &alpn, &alpn_len);
+    *http2 = alpn_len == 2 && !memcmp(alpn, "h2", 2);
+
+    if (UNLIKELY(setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) <
+                 0)) {
+        lwan_status_perror("setsockopt(TCP_ULP)");
+        goto out;
+    }
+
+    cipher = SSL_get_current_cipher(ssl);
+    ret = set_kernel_keys(l->tls, fd, TLS_TX, cipher, secrets.server,
+                          secrets.server_len) &&
+          set_kernel_keys(l->tls, fd, TLS_RX, cipher, secrets.client,
+                          secrets.client_len);
+    if (UNLIKELY(!ret))
+        lwan_status_perror("Could not hand TLS keys to the kernel");
+
+out:
+    coro_deferred_run(coro, generation);
+    return ret;
+}
+
+static int alpn_select(SSL *ssl __attribute__((unused)),
+                       const unsigned char **out,
+                       unsigned char *out_len,
+                       const unsigned char *in,
+                       unsigned int in_len,
+                       void *data)
+{
+    static const unsigned char h2_and_http_1_1[] = "\x02h2\x08http/1.1";
+    static const unsigned char http_1_1[] = "\x08http/1.1";
+    const struct lwan *l = data;
+    const unsigned char *protos = http_1_1;
+    unsigned int protos_len = sizeof(http_1_1) - 1;
+
+    if (l->config.http2) {
+        protos = h2_and_http_1_1;
+        protos_len = sizeof(h2_and_http_1_1) - 1;
+    }
+
+    /* Clients that don't speak any of these get no protocol at all. */
+    if (SSL_select_next_proto((unsigned char **)out, out_len, protos,
+                              protos_len, in,
+                              in_len) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static bool kernel_tls_available(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ret;
+
+    if (fd < 0)
+        return false;
+
+    /* The TLS ULP can't be attached to a socket that isn't connected, but
+     * the error for that is only given once the module has been found. */
+    ret = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 ||
+          errno != ENOENT;
+    close(fd);
+
+    return ret;
+}
+
+void lwan_tls_init(struct lwan *l)
+{
+    const struct lwan_config *config = &l->config;
+    struct lwan_tls *tls;
+
+    if (!config->tls_certificate && !config->tls_private_key)
+        return;
+    if (!config->tls_certificate || !config->tls_private_key)
+        lwan_status_critical("Both tls_certificate and tls_private_key "
+                             "must be set");
+    if (config->proxy_protocol)
+        lwan_status_critical("PROXY protocol can't be used with TLS");
+    if (!kernel_tls_available())
+        lwan_status_critical("Kernel TLS isn't available (is the tls "
+                             "module loaded?)");
+
+    tls = calloc(1, sizeof(*tls));
+    if (!tls)
+        lwan_status_critical_perror("calloc");
+
+    if (secrets_index < 0) {
+        secrets_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+        if (secrets_index < 0)
+            lwan_status_critical("Could not allocate SSL ex data index");
+    }
+
+    tls->hkdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+    if (!tls->hkdf)
+        lwan_status_critical("HKDF isn't available");
+
+    tls->ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls->ctx)
+        lwan_status_critical("Could not create TLS context");
+
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_3_VERSION);
+    SSL_CTX_set_num_tickets(tls->ctx, 0);
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_keylog_callback(tls->ctx, keylog_callback);
+    SSL_CTX_set_alpn_select_cb(tls->ctx, alpn_select, l);
+    if (!SSL_CTX_set_ciphersuites(tls->ctx, "TLS_AES_128_GCM_SHA256:"
+                                            "TLS_AES_256_GCM_SHA384:"
+                                            "TLS_CHACHA20_POLY1305_SHA256"))
+        lwan_status_critical("Could not set TLS cipher suites");
+
+    if (SSL_CTX_use_certificate_chain_file(tls->ctx,
+                                           config->tls_certificate) != 1)
+        lwan_status_critical("Could not load TLS certificate from %s",
+                             config->tls_certificate);
+    if (SSL_CTX_use_PrivateKey_file(tls->ctx, config->tls_private_key,
+                                    SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls->ctx) != 1)
+        lwan_status_critical("Could not load TLS private key from %s",
+                             config->tls_private_key);
+
+    lwan_status_info("Serving TLS 1.3, with records handled by the kernel");
+    l->tls = tls;
+}
+
+void lwan_tls_shutdown(struct lwan *l)
+{
+    if (!l->tls)
+        return;
+
+    SSL_CTX_free(l->tls->ctx);
+    EVP_KDF_free(l->tls->hkdf);
+    free(l->tls);
+    l->tls = NULL;
+}
+
+#else
+
+void lwan_tls_init(struct lwan *l)
+{
+    if (l->config.tls_certificate || l->config.tls_private_key)
+        lwan_status_critical("TLS support has not been built in");
+}
+
+void lwan_tls_shutdown(struct lwan *l __attribute__((unused))) {}
+
+bool lwan_tls_handshake(struct lwan *l __attribute__((unused)),
+                        struct lwan_connection *conn __attribute__((unused)),
+                        int fd __attribute__((unused)),
+                        bool *http2 __attribute__((unused)))
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+/* Statically defined tracing points ("USDT probes"), under the "lwan"
+ * provider.  Each one is a single nop in the code, plus a note in the ELF
+ * file describing where that nop is and where its arguments are, so that
+ * tools such as bpftrace, perf or SystemTap can attach to them in a
+ * running process:
+ *
+ *     bpftrace -e 'usdt:./lwan:lwan:request_start { @[tid] = nsecs; }'
+ *
+ * They're compiled in whenever <sys/sdt.h> is available. */
+
+#if defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+
+#define LWAN_TRACE0(name_) DTRACE_PROBE(lwan, name_)
+#define LWAN_TRACE1(name_, a_) DTRACE_PROBE1(lwan, name_, a_)
+#define LWAN_TRACE2(name_, a_, b_) DTRACE_PROBE2(lwan, name_, a_, b_)
+#define LWAN_TRACE3(name_, a_, b_, c_) DTRACE_PROBE3(lwan, name_, a_, b_, c_)
+#else
+#define LWAN_TRACE0(name_) do { } while (0)
+#define LWAN_TRACE1(name_, a_) do { (void)(a_); } while (0)
+#define LWAN_TRACE2(name_, a_, b_) do { (void)(a_); (void)(b_); } while (0)
+#define LWAN_TRACE3(name_, a_, b_, c_)                                         \
+    do {                                                                       \
+        (void)(a_);                                                            \
+        (void)(b_);                                                            \
+        (void)(c_);                                                            \
+    } while (0)
+#endif
@@ -27,112 +27,247 @@ lwan_trie_init(struct lwan_trie *trie, void (*free_node)(void *data))
 {
     if (!trie)
         return false;
-    trie->root = NULL;
+
+    lwan_trie_leaf_array_init(&trie->leaves);
     trie->free_node = free_node;
+    trie->compiled.nodes = NULL;
     return true;
 }
 
-static ALWAYS_INLINE struct lwan_trie_leaf *
-find_leaf_with_key(struct lwan_trie_node *node, const char *key, size_t len)
+static void
+free_compiled(struct lwan_trie *trie)
 {
-    struct lwan_trie_leaf *leaf = node->leaf;
+    /* The first and labels arrays live in the same block as the nodes. */
+    free((void *)trie->compiled.nodes);
+    trie->compiled.nodes = NULL;
+    trie->compiled.first = NULL;
+    trie->compiled.labels = NULL;
+}
 
-    if (!leaf)
-        return NULL;
+void
+lwan_trie_add(struct lwan_trie *trie, const char *key, void *data)
+{
+    struct lwan_trie_leaf *leaf;
 
-    if (!leaf->next) /* No collisions -- no need to strncmp() */
-        return leaf;
+    if (UNLIKELY(!trie || !key || !data))
+        return;
 
-    for (; leaf; leaf = leaf->next) {
-        if (!strncmp(leaf->key, key, len - 1))
-            return leaf;
+    LWAN_ARRAY_FOREACH (&trie->leaves, leaf) {
+        if (streq(leaf->key, key)) {
+            if (trie->free_node)
+                trie->free_node(leaf->data);
+            leaf->data = data;
+            return;
+        }
     }
 
-    return NULL;
+    leaf = lwan_trie_leaf_array_append(&trie->leaves);
+    if (!leaf)
+        lwan_status_critical_perror("lwan_trie_leaf_array_append");
+
+    leaf->key = strdup(key);
+    if (!leaf->key)
+        lwan_status_critical_perror("strdup");
+    leaf->data = data;
+
+    free_compiled(trie);
 }
 
-#define GET_NODE() \
-    do { \
-        if (!(node = *knode)) { \
-            *knode = node = calloc(1, sizeof(*node)); \
-            if (!node) \
-                goto oom; \
-        } \
-        ++node->ref_count; \
-    } while(0)
+static int
+compare_leaves(const void *a, const void *b)
+{
+    const struct lwan_trie_leaf *la = a;
+    const struct lwan_trie_leaf *lb = b;
 
-void
-lwan_trie_add(struct lwan_trie *trie, const char *key, void *data)
+    return strcmp(la->key, lb->key);
+}
+
+/* Builds a radix tree out of the keys, breadth-first, so that the children
+ * of every node end up next to each other.  With the keys sorted, every
+ * node covers a contiguous range of them, sharing the first `depth` bytes;
+ * each run of keys with the same next byte becomes a child, labeled with
+ * the longest prefix the keys in that run have in common. */
+bool
+lwan_trie_compile(struct lwan_trie *trie)
 {
-    if (UNLIKELY(!trie || !key || !data))
-        return;
+    struct lwan_trie_leaf *leaves = trie->leaves.base.base;
+    const size_t n_leaves = trie->leaves.base.elements;
+    size_t max_nodes, labels_size = 0;
+    size_t n_nodes = 1, labels_used = 0;
+    struct lwan_trie_node *nodes;
+    unsigned char *first;
+    char *labels;
+    struct {
+        uint32_t lo, hi, depth;
+    } *ranges;
+
+    free_compiled(trie);
+
+    if (!n_leaves)
+        return true;
+
+    if (n_leaves > INT32_MAX / 2)
+        return false;
 
-    struct lwan_trie_node **knode, *node;
-    const char *orig_key = key;
+    qsort(leaves, n_leaves, sizeof(*leaves), compare_leaves);
 
-    /* Traverse the trie, allocating nodes if necessary */
-    for (knode = &trie->root; *key; knode = &node->next[(int)(*key++ & 7)])
-        GET_NODE();
+    /* Every key adds at most a node for itself and another one where an
+     * existing label has to be split. */
+    max_nodes = 2 * n_leaves + 1;
+    for (size_t i = 0; i < n_leaves; i++)
+        labels_size += strlen(leaves[i].key);
 
-    /* Get the leaf node (allocate it if necessary) */
-    GET_NODE();
+    nodes = malloc(max_nodes * (sizeof(*nodes) + sizeof(*first)) +
+                   labels_size);
+    if (!nodes)
+        return false;
+    first = (unsigned char *)(nodes + max_nodes);
+    labels = (char *)(first + max_nodes);
 
-    struct lwan_trie_leaf *leaf = find_leaf_with_key(node, orig_key, (size_t)(key - orig_key));
-    bool had_key = leaf;
-    if (!leaf) {
-        leaf = malloc(sizeof(*leaf));
-        if (!leaf)
-            lwan_status_critical_perror("malloc");
-    } else if (trie->free_node) {
-        trie->free_node(leaf->data);
+    ranges = calloc(max_nodes, sizeof(*ranges));
+    if (!ranges) {
+        free(nodes);
+        return false;
     }
 
-    leaf->data = data;
-    if (!had_key) {
-        leaf->key = strdup(orig_key);
-        leaf->next = node->leaf;
-        node->leaf = leaf;
+    nodes[0] = (struct lwan_trie_node){.leaf = -1};
+    first[0] = '\0';
+    ranges[0].hi = (uint32_t)n_leaves;
+
+    for (size_t i = 0; i < n_nodes; i++) {
+        const uint32_t depth = ranges[i].depth;
+        uint32_t lo = ranges[i].lo;
+        const uint32_t hi = ranges[i].hi;
+
+        /* Keys are unique, and a key that ends here sorts before all the
+         * others sharing its prefix. */
+        if (leaves[lo].key[depth] == '\0')
+            nodes[i].leaf = (int32_t)lo++;
+
+        nodes[i].children = (uint32_t)n_nodes;
+        nodes[i].n_children = 0;
+
+        while (lo < hi) {
+            const char *key = leaves[lo].key + depth;
+            uint32_t run_end = lo + 1;
+            size_t label_len;
+
+            while (run_end < hi && leaves[run_end].key[depth] == *key)
+                run_end++;
+
+            /* Sorted, so the first and last keys of a run share the
+             * shortest common prefix of the whole run. */
+            const char *last_key = leaves[run_end - 1].key + depth;
+            for (label_len = 1;
+                 key[label_len] && key[label_len] == last_key[label_len];
+                 label_len++)
+                ;
+
+            if (UNLIKELY(label_len > UINT16_MAX))
+                goto error;
+
+            memcpy(labels + labels_used, key, label_len);
+
+            nodes[n_nodes] = (struct lwan_trie_node){
+                .label = (uint32_t)labels_used,
+                .label_len = (uint16_t)label_len,
+                .leaf = -1,
+            };
+            first[n_nodes] = (unsigned char)*key;
+            ranges[n_nodes].lo = lo;
+            ranges[n_nodes].hi = run_end;
+            ranges[n_nodes].depth = depth + (uint32_t)label_len;
+
+            labels_used += label_len;
+            nodes[i].n_children++;
+            n_nodes++;
+            lo = run_end;
+        }
     }
-    return;
 
-oom:
-    lwan_status_critical_perror("calloc");
-}
+    free(ranges);
 
-#undef GET_NODE
+    trie->compiled.nodes = nodes;
+    trie->compiled.first = first;
+    trie->compiled.labels = labels;
+    return true;
 
-static ALWAYS_INLINE struct lwan_trie_node *
-lookup_node(struct lwan_trie_node *root, const char *key, bool prefix, size_t *prefix_len)
-{
-    struct lwan_trie_node *node, *previous_node = NULL;
-    const char *orig_key = key;
+error:
+    free(ranges);
+    free(nodes);
+    return false;
+}
 
-    for (node = root; node && *key; node = node->next[(int)(*key++ & 7)]) {
-        if (node->leaf)
-            previous_node = node;
+static void *
+lookup_uncompiled(struct lwan_trie *trie, const char *key, bool prefix)
+{
+    const struct lwan_trie_leaf *leaf, *best = NULL;
+    size_t best_len = 0;
+
+    LWAN_ARRAY_FOREACH (&trie->leaves, leaf) {
+        size_t len = strlen(leaf->key);
+
+        if (prefix) {
+            if (len >= best_len && !strncmp(leaf->key, key, len)) {
+                best = leaf;
+                best_len = len;
+            }
+        } else if (streq(leaf->key, key)) {
+            return leaf->data;
+        }
     }
 
-    *prefix_len = (size_t)(key - orig_key);
-    if (node && node->leaf)
-        return node;
-    if (prefix && previous_node)
-        return previous_node;
-    return NULL;
+    return best ? best->data : NULL;
 }
 
-
 ALWAYS_INLINE void *
 lwan_trie_lookup_full(struct lwan_trie *trie, const char *key, bool prefix)
 {
     if (UNLIKELY(!trie))
         return NULL;
 
-    size_t prefix_len;
-    struct lwan_trie_node *node = lookup_node(trie->root, key, prefix, &prefix_len);
-    if (!node)
-        return NULL;
-    struct lwan_trie_leaf *leaf = find_leaf_with_key(node, key, prefix_len);
-    return leaf ? leaf->data : NULL;
+    const struct lwan_trie_node *nodes = trie->compiled.nodes;
+    if (UNLIKELY(!nodes))
+        return lookup_uncompiled(trie, key, prefix);
+
+    const struct lwan_trie_leaf *leaves = trie->leaves.base.base;
+    const unsigned char *first = trie->compiled.first;
+    const struct lwan_trie_node *node = nodes;
+    int32_t longest = node->leaf;
+
+    while (*key) {
+        const unsigned char *f = first + node->children;
+        const unsigned char *f_end = f + node->n_children;
+
+        for (; f < f_end; f++) {
+            if (*f == (unsigned char)*key)
+                break;
+        }
+        if (f == f_end)
+            break;
+
+        /* The first byte has already been compared; the key is
+         * NUL-terminated and labels have no NULs, so comparing stops at
+         * the end of the key should it be shorter than the label. */
+        const struct lwan_trie_node *child = nodes + (f - first);
+        const char *label = trie->compiled.labels + child->label;
+        uint16_t i;
+        for (i = 1; i < child->label_len; i++) {
+            if (label[i] != key[i])
+                break;
+        }
+        if (i != child->label_len)
+            break;
+
+        key += child->label_len;
+        node = child;
+        if (node->leaf >= 0)
+            longest = node->leaf;
+    }
+
+    if (prefix)
+        return longest >= 0 ? leaves[longest].data : NULL;
+    return !*key && node->leaf >= 0 ? leaves[node->leaf].data : NULL;
 }
 
 ALWAYS_INLINE void *
@@ -150,42 +285,23 @@ lwan_trie_lookup_exact(struct lwan_trie *trie, const char *key)
 ALWAYS_INLINE int32_t
 lwan_trie_entry_count(struct lwan_trie *trie)
 {
-    return (trie && trie->root) ? trie->root->ref_count : 0;
+    return trie ? (int32_t)trie->leaves.base.elements : 0;
 }
 
-static void
-lwan_trie_node_destroy(struct lwan_trie *trie, struct lwan_trie_node *node)
+void
+lwan_trie_destroy(struct lwan_trie *trie)
 {
-    if (!node)
-        return;
+    struct lwan_trie_leaf *leaf;
 
-    int32_t nodes_destroyed = node->ref_count;
-
-    for (struct lwan_trie_leaf *leaf = node->leaf; leaf;) {
-        struct lwan_trie_leaf *tmp = leaf->next;
+    if (!trie)
+        return;
 
+    LWAN_ARRAY_FOREACH (&trie->leaves, leaf) {
         if (trie->free_node)
             trie->free_node(leaf->data);
-
         free(leaf->key);
-        free(leaf);
-        leaf = tmp;
     }
 
-    for (int32_t i = 0; nodes_destroyed > 0 && i < 8; i++) {
-        if (node->next[i]) {
-            lwan_trie_node_destroy(trie, node->next[i]);
-            --nodes_destroyed;
-        }
-    }
-
-    free(node);
-}
-
-void
-lwan_trie_destroy(struct lwan_trie *trie)
-{
-    if (!trie || !trie->root)
-        return;
-    lwan_trie_node_destroy(trie, trie->root);
+    lwan_trie_leaf_array_reset(&trie->leaves);
+    free_compiled(trie);
 }
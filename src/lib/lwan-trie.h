@@ -21,29 +21,47 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
-struct lwan_trie_node {
-    struct lwan_trie_node *next[8];
-    struct lwan_trie_leaf *leaf;
-    int ref_count;
-};
+#include "lwan-array.h"
 
 struct lwan_trie_leaf {
     char *key;
     void *data;
-    struct lwan_trie_leaf *next;
+};
+
+DEFINE_ARRAY_TYPE(lwan_trie_leaf_array, struct lwan_trie_leaf)
+
+/* Node of the compiled radix tree.  The children of a node are stored
+ * next to each other, and the first byte of every node's label is kept
+ * in a separate array, so finding the child to descend into only reads
+ * a few contiguous bytes. */
+struct lwan_trie_node {
+    uint32_t label;
+    uint32_t children;
+    uint16_t label_len;
+    uint16_t n_children;
+    int32_t leaf;
 };
 
 struct lwan_trie {
-    struct lwan_trie_node *root;
+    struct lwan_trie_leaf_array leaves;
     void (*free_node)(void *data);
+
+    /* Built by lwan_trie_compile() from the leaves, in a single block of
+     * memory; NULL if keys were added since. */
+    struct {
+        const struct lwan_trie_node *nodes;
+        const unsigned char *first;
+        const char *labels;
+    } compiled;
 };
 
 bool		 lwan_trie_init(struct lwan_trie *trie, void (*free_node)(void *data));
 void		 lwan_trie_destroy(struct lwan_trie *trie);
 void		 lwan_trie_add(struct lwan_trie *trie, const char *key, void *data);
+bool		 lwan_trie_compile(struct lwan_trie *trie);
 void 		*lwan_trie_lookup_full(struct lwan_trie *trie, const char *key, bool prefix);
 void 		*lwan_trie_lookup_prefix(struct lwan_trie *trie, const char *key);
 void		*lwan_trie_lookup_exact(struct lwan_trie *trie, const char *key);
 int32_t		 lwan_trie_entry_count(struct lwan_trie *trie);
-
@@ -0,0 +1,290 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "lwan-private.h"
+#include "lwan-timer-wheel.h"
+#include "lwan-uring.h"
+
+#if defined(USE_IO_URING)
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static ALWAYS_INLINE void *ring_ptr(void *ring, __u32 offset)
+{
+    return (char *)ring + offset;
+}
+
+bool lwan_uring_init(struct lwan_uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    size_t sq_size, cq_size;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return false;
+
+    /* Older kernels would need two mappings and could drop completions;
+     * don't bother with them. */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto close_fd;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(__u32);
+    cq_size = params.cq_off.cqes +
+              params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring == MAP_FAILED)
+        goto close_fd;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq.sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq.sqes == MAP_FAILED)
+        goto unmap_ring;
+
+    ring->sq.head = ring_ptr(ring->ring, params.sq_off.head);
+    ring->sq.tail = ring_ptr(ring->ring, params.sq_off.tail);
+    ring->sq.mask = ring_ptr(ring->ring, params.sq_off.ring_mask);
+    ring->sq.entries = params.sq_entries;
+    ring->sq.local_tail = ring->sq.submitted = *ring->sq.tail;
+
+    ring->cq.head = ring_ptr(ring->ring, params.cq_off.head);
+    ring->cq.tail = ring_ptr(ring->ring, params.cq_off.tail);
+    ring->cq.mask = ring_ptr(ring->ring, params.cq_off.ring_mask);
+    ring->cq.cqes = ring_ptr(ring->ring, params.cq_off.cqes);
+
+    /* Entry N of the submission array always points to SQE N, so that
+     * SQEs can be handed out in order without touching the array again. */
+    __u32 *array = ring_ptr(ring->ring, params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    return true;
+
+unmap_ring:
+    munmap(ring->ring, ring->ring_size);
+close_fd:
+    close(ring->fd);
+    ring->fd = -1;
+    return false;
+}
+
+void lwan_uring_free(struct lwan_uring *ring)
+{
+    if (ring->fd < 0)
+        return;
+
+    munmap(ring->sq.sqes, ring->sqes_size);
+    munmap(ring->ring, ring->ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+bool lwan_uring_has_unsubmitted(const struct lwan_uring *ring)
+{
+    return ring->sq.local_tail != ring->sq.submitted;
+}
+
+int lwan_uring_submit(struct lwan_uring *ring)
+{
+    unsigned int to_submit = ring->sq.local_tail - ring->sq.submitted;
+    int ret;
+
+    if (!to_submit)
+        return 0;
+
+    __atomic_store_n(ring->sq.tail, ring->sq.local_tail, __ATOMIC_RELEASE);
+
+    ret = uring_enter(ring->fd, to_submit);
+    if (LIKELY(ret > 0))
+        ring->sq.submitted += (unsigned int)ret;
+    else if (ret < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR)
+        lwan_status_perror("io_uring_enter");
+
+    return ret;
+}
+
+struct io_uring_sqe *lwan_uring_get_sqe(struct lwan_uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (UNLIKELY(ring->sq.local_tail -
+                     __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE) >=
+                 ring->sq.entries)) {
+        lwan_uring_submit(ring);
+
+        if (ring->sq.local_tail -
+                __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE) >=
+            ring->sq.entries)
+            return NULL;
+    }
+
+    sqe = &ring->sq.sqes[ring->sq.local_tail & *ring->sq.mask];
+    ring->sq.local_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned int lwan_uring_reap(struct lwan_uring *ring,
+                             void (*func)(struct lwan_uring_op *op, void *data),
+                             void *data)
+{
+    unsigned int head = *ring->cq.head;
+    unsigned int reaped = 0;
+
+    while (head != __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = &ring->cq.cqes[head & *ring->cq.mask];
+        struct lwan_uring_op *op = (struct lwan_uring_op *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+
+        /* Release the entry before calling func(), which might resume a
+         * coroutine that queues more work. */
+        __atomic_store_n(ring->cq.head, ++head, __ATOMIC_RELEASE);
+
+        /* Cancellation requests have no operation attached to them. */
+        if (!op)
+            continue;
+
+        op->res = res;
+        op->flags = cqe->flags;
+        op->done = true;
+        func(op, data);
+        reaped++;
+    }
+
+    return reaped;
+}
+
+int lwan_uring_await(struct lwan_request *request, struct io_uring_sqe *sqe)
+{
+    struct lwan_connection *conn = request->conn;
+    struct lwan_thread *t = conn->thread;
+    struct lwan_uring_op op = {.conn = conn};
+    const unsigned int timeout_ms = t->lwan->config.keep_alive_timeout * 1000u;
+    bool cancelled = false;
+
+    sqe->user_data = (__u64)(uintptr_t)&op;
+    conn->flags |= CONN_URING_PENDING;
+
+    /* The completion is written to this coroutine's stack, so it can't go
+     * away before it arrives; if the timer expires first, the operation is
+     * cancelled, and the cancellation itself is waited for. */
+    while (!op.done) {
+        timer_wheel_add(t->wheel, conn, timeout_ms);
+        conn->flags |= CONN_SUSPENDED;
+
+        coro_yield(conn->coro, CONN_CORO_SUSPEND);
+
+        conn->flags &= ~CONN_SUSPENDED;
+
+        if (!op.done && !cancelled) {
+            struct io_uring_sqe *cancel = lwan_uring_get_sqe(t->uring);
+
+            if (cancel) {
+                cancel->opcode = IORING_OP_ASYNC_CANCEL;
+                cancel->fd = -1;
+                cancel->addr = (__u64)(uintptr_t)&op;
+                cancelled = true;
+            }
+        }
+    }
+
+    conn->flags &= ~CONN_URING_PENDING;
+    return op.res;
+}
+
+ssize_t lwan_uring_recv(struct lwan_request *request, void *buf, size_t count)
+{
+    struct lwan_uring *ring = request->conn->thread->uring;
+    struct io_uring_sqe *sqe;
+    int res;
+
+    if (UNLIKELY(!ring) || UNLIKELY(!(sqe = lwan_uring_get_sqe(ring))))
+        return read(request->fd, buf, count);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = request->fd;
+    sqe->addr = (__u64)(uintptr_t)buf;
+    sqe->len = count > UINT32_MAX ? UINT32_MAX : (__u32)count;
+    /* Without this, the kernel would hold on to the buffer until something
+     * arrives; idle connections are better left to epoll. */
+    sqe->msg_flags = MSG_DONTWAIT;
+
+    res = lwan_uring_await(request, sqe);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+bool lwan_uring_accept(struct lwan_uring *ring, int listen_fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring->accept_unsupported)
+        return false;
+
+    sqe = lwan_uring_get_sqe(ring);
+    if (UNLIKELY(!sqe))
+        return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (__u64)(uintptr_t)&ring->accept;
+
+    ring->accept = (struct lwan_uring_op){};
+    return true;
+}
+
+#endif
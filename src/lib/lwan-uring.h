@@ -0,0 +1,93 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#if defined(USE_IO_URING)
+
+#include <linux/io_uring.h>
+
+#include "lwan.h"
+
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+struct lwan_uring_op {
+    struct lwan_connection *conn;
+    int res;
+    unsigned int flags;
+    bool done;
+};
+
+/* One per I/O thread.  Submission queue entries are only handed to the
+ * kernel by lwan_uring_submit(), called once per iteration of the I/O
+ * loop, so that everything queued by coroutines in that iteration goes
+ * in a single io_uring_enter() call. */
+struct lwan_uring {
+    int fd;
+
+    struct {
+        unsigned int *head, *tail, *mask;
+        unsigned int entries;
+        unsigned int local_tail, submitted;
+        struct io_uring_sqe *sqes;
+    } sq;
+
+    struct {
+        unsigned int *head, *tail, *mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+
+    /* Completions of the multishot accept on the thread's listening
+     * socket, if any, end up here; its conn is NULL. */
+    struct lwan_uring_op accept;
+    bool accept_unsupported;
+};
+
+bool lwan_uring_init(struct lwan_uring *ring, unsigned int entries);
+void lwan_uring_free(struct lwan_uring *ring);
+
+struct io_uring_sqe *lwan_uring_get_sqe(struct lwan_uring *ring);
+int lwan_uring_submit(struct lwan_uring *ring);
+bool lwan_uring_has_unsubmitted(const struct lwan_uring *ring);
+unsigned int lwan_uring_reap(struct lwan_uring *ring,
+                             void (*func)(struct lwan_uring_op *op, void *data),
+                             void *data);
+
+/* Queues an SQE obtained with lwan_uring_get_sqe() on behalf of the
+ * connection handling the request, and suspends its coroutine until the
+ * completion arrives.  Returns the result of the operation (a negative
+ * errno value on errors). */
+int lwan_uring_await(struct lwan_request *request, struct io_uring_sqe *sqe);
+
+/* Reads from the request socket through the ring, without ever waiting
+ * for data: fails with EAGAIN if there's nothing to read. */
+ssize_t lwan_uring_recv(struct lwan_request *request, void *buf, size_t count);
+
+/* Queues a multishot accept on the listening socket, completing on
+ * ring->accept once for every new connection.  Returns false if there's
+ * no room in the ring or the kernel doesn't support it. */
+bool lwan_uring_accept(struct lwan_uring *ring, int listen_fd);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan-private.h"
+#include "lwan-vhost.h"
+
+/* As per RFC 1035; longer Host headers can't match anything. */
+#define MAX_HOST_LEN 253
+
+struct vhost {
+    struct lwan_trie url_map_trie;
+    struct vhost *next;
+};
+
+struct lwan_vhosts {
+    struct hash *by_name;
+    struct vhost *list;
+    void (*free_url_map)(void *data);
+};
+
+struct lwan_vhosts *lwan_vhosts_new(void (*free_url_map)(void *data))
+{
+    struct lwan_vhosts *vhosts = malloc(sizeof(*vhosts));
+
+    if (!vhosts)
+        return NULL;
+
+    vhosts->by_name = hash_str_new(free, NULL);
+    if (!vhosts->by_name) {
+        free(vhosts);
+        return NULL;
+    }
+
+    vhosts->list = NULL;
+    vhosts->free_url_map = free_url_map;
+
+    return vhosts;
+}
+
+void lwan_vhosts_free(struct lwan_vhosts *vhosts)
+{
+    struct vhost *vhost, *next;
+
+    if (!vhosts)
+        return;
+
+    for (vhost = vhosts->list; vhost; vhost = next) {
+        next = vhost->next;
+        lwan_trie_destroy(&vhost->url_map_trie);
+        free(vhost);
+    }
+
+    hash_free(vhosts->by_name);
+    free(vhosts);
+}
+
+struct lwan_trie *lwan_vhosts_add(struct lwan_vhosts *vhosts)
+{
+    struct vhost *vhost = malloc(sizeof(*vhost));
+
+    if (!vhost)
+        return NULL;
+
+    if (!lwan_trie_init(&vhost->url_map_trie, vhosts->free_url_map)) {
+        free(vhost);
+        return NULL;
+    }
+
+    vhost->next = vhosts->list;
+    vhosts->list = vhost;
+
+    return &vhost->url_map_trie;
+}
+
+/* Lowercases the host name into buf, without the port and the trailing
+ * dot of a fully qualified name.  Returns false if it can't be a valid
+ * name. */
+static bool normalize_host(char buf[static MAX_HOST_LEN + 1],
+                           const char *host,
+                           size_t len)
+{
+    const char *colon;
+
+    if (len && host[0] == '[') {
+        /* IPv6 literal: the port comes after the closing bracket. */
+        const char *bracket = memchr(host, ']', len);
+
+        if (!bracket)
+            return false;
+        len = (size_t)(bracket - host) + 1;
+    } else if ((colon = memchr(host, ':', len))) {
+        len = (size_t)(colon - host);
+    }
+
+    if (len && host[len - 1] == '.')
+        len--;
+    if (!len || len > MAX_HOST_LEN)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        char ch = host[i];
+
+        if (ch >= 'A' && ch <= 'Z')
+            ch |= 0x20;
+        else if (UNLIKELY(ch == '\0' || ch == '/' || lwan_char_isspace(ch)))
+            return false;
+        buf[i] = ch;
+    }
+    buf[len] = '\0';
+
+    return true;
+}
+
+bool lwan_vhosts_add_name(struct lwan_vhosts *vhosts,
+                          struct lwan_trie *url_map_trie,
+                          const char *name)
+{
+    char buf[MAX_HOST_LEN + 1];
+    char *key;
+
+    if (!normalize_host(buf, name, strlen(name)))
+        return false;
+
+    /* Wildcards are only supported for the leftmost label. */
+    if (strchr(buf + (buf[0] == '*' ? 1 : 0), '*'))
+        return false;
+    if (buf[0] == '*' && buf[1] != '.')
+        return false;
+
+    key = strdup(buf);
+    if (!key)
+        return false;
+
+    if (hash_add_unique(vhosts->by_name, key, url_map_trie) < 0) {
+        free(key);
+        return false;
+    }
+
+    return true;
+}
+
+bool lwan_vhosts_compile(struct lwan_vhosts *vhosts)
+{
+    for (struct vhost *vhost = vhosts->list; vhost; vhost = vhost->next) {
+        if (!lwan_trie_compile(&vhost->url_map_trie))
+            return false;
+    }
+
+    return true;
+}
+
+struct lwan_trie *lwan_vhosts_find(const struct lwan_vhosts *vhosts,
+                                   const char *host,
+                                   size_t len)
+{
+    char buf[MAX_HOST_LEN + 2];
+    struct lwan_trie *url_map_trie;
+    char *dot;
+
+    /* Leaves room before the name for the wildcard lookup below. */
+    if (UNLIKELY(!normalize_host(buf + 1, host, len)))
+        return NULL;
+
+    url_map_trie = hash_find(vhosts->by_name, buf + 1);
+    if (LIKELY(url_map_trie))
+        return url_map_trie;
+
+    dot = strchr(buf + 1, '.');
+    if (!dot)
+        return NULL;
+
+    dot[-1] = '*';
+    return hash_find(vhosts->by_name, dot - 1);
+}
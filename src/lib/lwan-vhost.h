@@ -0,0 +1,48 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lwan-trie.h"
+
+/* Sites served by the same listener, told apart by the Host header.  Each
+ * one has its own URL map, compiled on its own; requests for hosts that
+ * aren't known here use the URL map of the listener itself.  Names are
+ * matched regardless of case and port, and "*.example.com" matches names
+ * right under example.com that don't have a site of their own. */
+struct lwan_vhosts;
+
+struct lwan_vhosts *lwan_vhosts_new(void (*free_url_map)(void *data));
+void lwan_vhosts_free(struct lwan_vhosts *vhosts);
+
+/* Returns the (empty) URL map of a new site, which gets its names with
+ * lwan_vhosts_add_name(); that fails if the name is taken or invalid. */
+struct lwan_trie *lwan_vhosts_add(struct lwan_vhosts *vhosts);
+bool lwan_vhosts_add_name(struct lwan_vhosts *vhosts,
+                          struct lwan_trie *url_map_trie,
+                          const char *name);
+bool lwan_vhosts_compile(struct lwan_vhosts *vhosts);
+
+struct lwan_trie *lwan_vhosts_find(const struct lwan_vhosts *vhosts,
+                                   const char *host,
+                                   size_t len);
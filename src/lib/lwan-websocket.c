@@ -0,0 +1,489 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* WebSockets (RFC 6455), without extensions.  Frames are read with
+ * lwan_request_read_body(), so a connection waiting for the next message
+ * is just a coroutine that yielded with CONN_MUST_READ: it sits in the
+ * timer wheel, costing nothing until the socket becomes readable. */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "lwan-private.h"
+
+#include "base64.h"
+#include "lwan-escape.h"
+#include "lwan-io-wrappers.h"
+#include "sha1.h"
+
+enum ws_opcode {
+    WS_OPCODE_CONTINUATION = 0x0,
+    WS_OPCODE_TEXT = 0x1,
+    WS_OPCODE_BINARY = 0x2,
+    WS_OPCODE_CLOSE = 0x8,
+    WS_OPCODE_PING = 0x9,
+    WS_OPCODE_PONG = 0xa,
+};
+
+enum ws_close_code {
+    WS_CLOSE_PROTOCOL_ERROR = 1002,
+    WS_CLOSE_INVALID_DATA = 1007,
+    WS_CLOSE_MESSAGE_TOO_BIG = 1009,
+};
+
+#define WS_FIN 0x80
+#define WS_RSV_MASK 0x70
+#define WS_OPCODE_MASK 0x0f
+#define WS_IS_CONTROL 0x08
+#define WS_MASKED 0x80
+#define WS_MAX_CONTROL_PAYLOAD 125
+
+struct ws_frame {
+    uint64_t len;
+    unsigned char mask[4];
+    unsigned char opcode;
+    bool fin;
+};
+
+struct ws_handshake {
+    struct lwan_value key;
+    bool upgrade;
+    bool connection;
+    bool version;
+};
+
+static bool value_eq(const struct lwan_value *v, const char *str)
+{
+    size_t len = strlen(str);
+
+    return v->len == len && !strncasecmp(v->value, str, len);
+}
+
+static bool value_has_token(const struct lwan_value *v, const char *token)
+{
+    size_t len = strlen(token);
+    const char *p = v->value;
+    const char *end = p + v->len;
+
+    while (p < end) {
+        const char *comma = memchr(p, ',', (size_t)(end - p));
+        const char *token_end = comma ? comma : end;
+
+        while (p < token_end && (*p == ' ' || *p == '\t'))
+            p++;
+        while (token_end > p && (token_end[-1] == ' ' || token_end[-1] == '\t'))
+            token_end--;
+
+        if ((size_t)(token_end - p) == len && !strncasecmp(p, token, len))
+            return true;
+
+        if (!comma)
+            break;
+        p = comma + 1;
+    }
+
+    return false;
+}
+
+static bool inspect_header(const struct lwan_value *name,
+                           const struct lwan_value *value,
+                           void *data)
+{
+    struct ws_handshake *handshake = data;
+
+    if (value_eq(name, "Upgrade"))
+        handshake->upgrade = value_has_token(value, "websocket");
+    else if (value_eq(name, "Connection"))
+        handshake->connection = value_has_token(value, "upgrade");
+    else if (value_eq(name, "Sec-WebSocket-Key"))
+        handshake->key = *value;
+    else if (value_eq(name, "Sec-WebSocket-Version"))
+        handshake->version = value_eq(value, "13");
+
+    return true;
+}
+
+enum lwan_http_status
+lwan_request_websocket_upgrade(struct lwan_request *request)
+{
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    struct ws_handshake handshake = {};
+    unsigned char digest[SHA1_DIGEST_LENGTH];
+    char headers[DEFAULT_HEADERS_SIZE];
+    struct sha1_ctx sha1;
+    unsigned char *accept;
+    size_t accept_len;
+    size_t header_len;
+
+    if (UNLIKELY(request->flags & RESPONSE_SENT_HEADERS))
+        return HTTP_INTERNAL_ERROR;
+    if (UNLIKELY(lwan_request_get_method(request) != REQUEST_METHOD_GET))
+        return HTTP_NOT_ALLOWED;
+    /* RFC 8441 isn't supported. */
+    if (UNLIKELY(request->flags & REQUEST_IS_HTTP_2))
+        return HTTP_BAD_REQUEST;
+
+    lwan_request_foreach_header(request, inspect_header, &handshake);
+    if (UNLIKELY(!handshake.upgrade || !handshake.connection ||
+                 !handshake.version || handshake.key.len != 24))
+        return HTTP_BAD_REQUEST;
+
+    sha1_init(&sha1);
+    sha1_update(&sha1, handshake.key.value, handshake.key.len);
+    sha1_update(&sha1, guid, sizeof(guid) - 1);
+    sha1_final(&sha1, digest);
+
+    accept = base64_encode(digest, sizeof(digest), &accept_len);
+    if (UNLIKELY(!accept))
+        return HTTP_INTERNAL_ERROR;
+    /* Strip the newline base64_encode() ends its output with. */
+    accept[accept_len - 1] = '\0';
+
+    request->conn->flags |= CONN_IS_WEBSOCKET;
+    request->conn->flags &= ~CONN_KEEP_ALIVE;
+    request->flags |= RESPONSE_NO_CONTENT_LENGTH;
+    header_len = lwan_prepare_response_header_full(
+        request, HTTP_SWITCHING_PROTOCOLS, headers, sizeof(headers),
+        (struct lwan_key_value[]){
+            {.key = "Upgrade", .value = "websocket"},
+            {.key = "Sec-WebSocket-Accept", .value = (char *)accept},
+            {},
+        });
+    free(accept);
+
+    if (UNLIKELY(!header_len)) {
+        request->conn->flags &= ~CONN_IS_WEBSOCKET;
+        return HTTP_INTERNAL_ERROR;
+    }
+
+    request->flags |= RESPONSE_SENT_HEADERS;
+    lwan_send(request, headers, header_len, 0);
+
+    lwan_request_begin_upgraded_body(request);
+
+    return HTTP_SWITCHING_PROTOCOLS;
+}
+
+static void write_frame(struct lwan_request *request,
+                        unsigned char opcode,
+                        const void *payload,
+                        size_t len)
+{
+    unsigned char header[10];
+    size_t header_len;
+
+    header[0] = WS_FIN | opcode;
+    if (len < 126) {
+        header[1] = (unsigned char)len;
+        header_len = 2;
+    } else if (len <= UINT16_MAX) {
+        header[1] = 126;
+        header[2] = (unsigned char)(len >> 8);
+        header[3] = (unsigned char)len;
+        header_len = 4;
+    } else {
+        uint64_t be_len = htobe64((uint64_t)len);
+
+        header[1] = 127;
+        memcpy(header + 2, &be_len, sizeof(be_len));
+        header_len = 10;
+    }
+
+    struct iovec vec[] = {
+        {.iov_base = header, .iov_len = header_len},
+        {.iov_base = (void *)payload, .iov_len = len},
+    };
+    lwan_writev(request, vec, N_ELEMENTS(vec));
+}
+
+static ALWAYS_INLINE bool is_open(const struct lwan_request *request)
+{
+    return (request->conn->flags & CONN_IS_WEBSOCKET) &&
+           !(request->flags & REQUEST_WEBSOCKET_CLOSED);
+}
+
+static void write_message(struct lwan_request *request, unsigned char opcode)
+{
+    if (UNLIKELY(!is_open(request)))
+        return;
+
+    write_frame(request, opcode,
+                lwan_strbuf_get_buffer(request->response.buffer),
+                lwan_strbuf_get_length(request->response.buffer));
+    lwan_strbuf_reset(request->response.buffer);
+}
+
+void lwan_response_websocket_write_text(struct lwan_request *request)
+{
+    write_message(request, WS_OPCODE_TEXT);
+}
+
+void lwan_response_websocket_write_binary(struct lwan_request *request)
+{
+    write_message(request, WS_OPCODE_BINARY);
+}
+
+/* The mask is applied 16 bytes at a time with SSE2 or NEON; offset is the
+ * position of buf within the payload, as payloads are read in chunks. */
+static void unmask(char *buf, size_t len, const unsigned char mask[4],
+                   size_t offset)
+{
+    unsigned char rotated[4];
+    uint32_t mask32;
+    uint64_t mask64;
+    size_t i = 0;
+
+    for (int j = 0; j < 4; j++)
+        rotated[j] = mask[(offset + (size_t)j) & 3];
+    memcpy(&mask32, rotated, sizeof(mask32));
+
+#if defined(__x86_64__)
+    const __m128i mask128 = _mm_set1_epi32((int)mask32);
+
+    for (; len - i >= 16; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(chunk, mask128));
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask32));
+
+    for (; len - i >= 16; i += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)(buf + i));
+        vst1q_u8((uint8_t *)(buf + i), veorq_u8(chunk, mask128));
+    }
+#endif
+
+    mask64 = (uint64_t)mask32 << 32 | mask32;
+    for (; len - i >= 8; i += 8) {
+        uint64_t chunk;
+
+        memcpy(&chunk, buf + i, sizeof(chunk));
+        chunk ^= mask64;
+        memcpy(buf + i, &chunk, sizeof(chunk));
+    }
+
+    for (; i < len; i++)
+        buf[i] ^= (char)rotated[i & 3];
+}
+
+static bool read_all(struct lwan_request *request, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t n = lwan_request_read_body(request, p, len);
+
+        if (UNLIKELY(n <= 0))
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+    }
+
+    return true;
+}
+
+static bool read_frame_header(struct lwan_request *request,
+                              struct ws_frame *frame,
+                              int *close_code)
+{
+    unsigned char header[2];
+
+    if (UNLIKELY(!read_all(request, header, sizeof(header))))
+        return false;
+
+    /* No extensions are negotiated, so the reserved bits must be unset;
+     * frames from clients must be masked. */
+    if (UNLIKELY((header[0] & WS_RSV_MASK) || !(header[1] & WS_MASKED))) {
+        *close_code = WS_CLOSE_PROTOCOL_ERROR;
+        return false;
+    }
+
+    frame->fin = header[0] & WS_FIN;
+    frame->opcode = header[0] & WS_OPCODE_MASK;
+    frame->len = header[1] & (unsigned char)~WS_MASKED;
+
+    if (frame->len == 126) {
+        uint16_t be_len;
+
+        if (UNLIKELY(!read_all(request, &be_len, sizeof(be_len))))
+            return false;
+        frame->len = be16toh(be_len);
+    } else if (frame->len == 127) {
+        uint64_t be_len;
+
+        if (UNLIKELY(!read_all(request, &be_len, sizeof(be_len))))
+            return false;
+        frame->len = be64toh(be_len);
+    }
+
+    return read_all(request, frame->mask, sizeof(frame->mask));
+}
+
+static inline size_t min_size(size_t a, size_t b)
+{
+    return (a > b) ? b : a;
+}
+
+static bool read_payload(struct lwan_request *request,
+                         const struct ws_frame *frame)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    char chunk[DEFAULT_BUFFER_SIZE];
+    size_t remaining = (size_t)frame->len;
+    size_t offset = 0;
+
+    if (UNLIKELY(!lwan_strbuf_grow_to(buffer,
+                                      lwan_strbuf_get_length(buffer) + remaining)))
+        return false;
+
+    while (remaining) {
+        ssize_t n = lwan_request_read_body(request, chunk,
+                                           min_size(remaining, sizeof(chunk)));
+
+        if (UNLIKELY(n <= 0))
+            return false;
+
+        unmask(chunk, (size_t)n, frame->mask, offset);
+        if (UNLIKELY(!lwan_strbuf_append_str(buffer, chunk, (size_t)n)))
+            return false;
+
+        offset += (size_t)n;
+        remaining -= (size_t)n;
+    }
+
+    return true;
+}
+
+static int close_connection(struct lwan_request *request, int close_code)
+{
+    if (close_code) {
+        const unsigned char payload[] = {(unsigned char)(close_code >> 8),
+                                         (unsigned char)close_code};
+
+        write_frame(request, WS_OPCODE_CLOSE, payload, sizeof(payload));
+    }
+
+    request->flags |= REQUEST_WEBSOCKET_CLOSED;
+    lwan_strbuf_reset(request->response.buffer);
+
+    return ENOTCONN;
+}
+
+/* Returns false if the connection should be closed. */
+static bool handle_control_frame(struct lwan_request *request,
+                                 const struct ws_frame *frame,
+                                 int *close_code)
+{
+    char payload[WS_MAX_CONTROL_PAYLOAD];
+
+    if (UNLIKELY(!frame->fin || frame->len > WS_MAX_CONTROL_PAYLOAD)) {
+        *close_code = WS_CLOSE_PROTOCOL_ERROR;
+        return false;
+    }
+
+    if (UNLIKELY(!read_all(request, payload, (size_t)frame->len)))
+        return false;
+    unmask(payload, (size_t)frame->len, frame->mask, 0);
+
+    switch (frame->opcode) {
+    case WS_OPCODE_PING:
+        write_frame(request, WS_OPCODE_PONG, payload, (size_t)frame->len);
+        return true;
+    case WS_OPCODE_PONG:
+        return true;
+    case WS_OPCODE_CLOSE:
+        /* Echo the status code, if there's one. */
+        if (frame->len == 1)
+            *close_code = WS_CLOSE_PROTOCOL_ERROR;
+        else if (frame->len)
+            *close_code = (unsigned char)payload[0] << 8 | (unsigned char)payload[1];
+        else
+            write_frame(request, WS_OPCODE_CLOSE, NULL, 0);
+        return false;
+    default:
+        *close_code = WS_CLOSE_PROTOCOL_ERROR;
+        return false;
+    }
+}
+
+int lwan_response_websocket_read(struct lwan_request *request)
+{
+    const size_t max_len = request->conn->thread->lwan->config.max_post_data_size;
+    struct lwan_strbuf *buffer = request->response.buffer;
+    unsigned char message_opcode = WS_OPCODE_CONTINUATION;
+    int close_code = 0;
+
+    if (UNLIKELY(!is_open(request)))
+        return ENOTCONN;
+
+    lwan_strbuf_reset(buffer);
+
+    while (true) {
+        struct ws_frame frame;
+
+        if (UNLIKELY(!read_frame_header(request, &frame, &close_code)))
+            return close_connection(request, close_code);
+
+        if (frame.opcode & WS_IS_CONTROL) {
+            if (handle_control_frame(request, &frame, &close_code))
+                continue;
+            return close_connection(request, close_code);
+        }
+
+        if (frame.opcode == WS_OPCODE_CONTINUATION) {
+            if (UNLIKELY(message_opcode == WS_OPCODE_CONTINUATION))
+                return close_connection(request, WS_CLOSE_PROTOCOL_ERROR);
+        } else if (frame.opcode == WS_OPCODE_TEXT ||
+                   frame.opcode == WS_OPCODE_BINARY) {
+            if (UNLIKELY(message_opcode != WS_OPCODE_CONTINUATION))
+                return close_connection(request, WS_CLOSE_PROTOCOL_ERROR);
+            message_opcode = frame.opcode;
+        } else {
+            return close_connection(request, WS_CLOSE_PROTOCOL_ERROR);
+        }
+
+        if (UNLIKELY(frame.len > max_len - lwan_strbuf_get_length(buffer)))
+            return close_connection(request, WS_CLOSE_MESSAGE_TOO_BIG);
+
+        if (UNLIKELY(!read_payload(request, &frame)))
+            return close_connection(request, 0);
+
+        if (!frame.fin)
+            continue;
+
+        if (message_opcode == WS_OPCODE_TEXT &&
+            UNLIKELY(!lwan_utf8_is_valid(lwan_strbuf_get_buffer(buffer),
+                                         lwan_strbuf_get_length(buffer))))
+            return close_connection(request, WS_CLOSE_INVALID_DATA);
+
+        return 0;
+    }
+}
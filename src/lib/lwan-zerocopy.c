@@ -0,0 +1,331 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
+
+#include "lwan-private.h"
+#include "lwan-zerocopy.h"
+#include "hash.h"
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) &&                        \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
+/* Buffers of sockets closed before their completions arrived are held for
+ * this long, as the kernel might still be transmitting them. */
+#define LINGER_SECONDS 30
+
+struct zerocopy_socket {
+    /* In the order they were sent, which is also the order they complete
+     * (for TCP, at least). */
+    struct zerocopy_pending *head, **tail;
+    uint32_t next_seq;
+    bool disabled;
+};
+
+struct zerocopy_pending {
+    struct zerocopy_pending *next;
+    struct zerocopy_socket *sock;
+    /* Sequence number of the last sendmsg() call with these buffers. */
+    uint32_t seq;
+    bool sent;
+    time_t linger_until;
+    void (*release)(void *data1, void *data2);
+    void *data1, *data2;
+};
+
+struct lwan_zerocopy {
+    struct hash *sockets;
+    struct zerocopy_pending *lingering, **lingering_tail;
+};
+
+static ALWAYS_INLINE const void *fd_key(int fd)
+{
+    return (const void *)(intptr_t)fd;
+}
+
+static void release_pending(struct zerocopy_pending *pending)
+{
+    pending->release(pending->data1, pending->data2);
+    free(pending);
+}
+
+static void release_all(struct zerocopy_pending *pending)
+{
+    while (pending) {
+        struct zerocopy_pending *next = pending->next;
+
+        release_pending(pending);
+        pending = next;
+    }
+}
+
+static void free_socket(void *data)
+{
+    struct zerocopy_socket *sock = data;
+
+    /* hash_add() calls this for the previous value, even if there's none. */
+    if (sock) {
+        release_all(sock->head);
+        free(sock);
+    }
+}
+
+static struct lwan_zerocopy *get_zerocopy(struct lwan_thread *t)
+{
+    struct lwan_zerocopy *zc = t->zerocopy;
+
+    if (LIKELY(zc))
+        return zc;
+
+    zc = malloc(sizeof(*zc));
+    if (UNLIKELY(!zc))
+        return NULL;
+
+    zc->sockets = hash_int_new(NULL, free_socket);
+    if (UNLIKELY(!zc->sockets)) {
+        free(zc);
+        return NULL;
+    }
+    zc->lingering = NULL;
+    zc->lingering_tail = &zc->lingering;
+
+    return t->zerocopy = zc;
+}
+
+struct zerocopy_socket *lwan_zerocopy_get_socket(struct lwan_request *request)
+{
+#if defined(HAVE_ZEROCOPY)
+    struct lwan_zerocopy *zc = get_zerocopy(request->conn->thread);
+    struct zerocopy_socket *sock;
+    const int one = 1;
+
+    if (UNLIKELY(!zc))
+        return NULL;
+
+    if (request->conn->flags & CONN_ZEROCOPY) {
+        sock = hash_find(zc->sockets, fd_key(request->fd));
+        return sock && !sock->disabled ? sock : NULL;
+    }
+
+    sock = malloc(sizeof(*sock));
+    if (UNLIKELY(!sock))
+        return NULL;
+
+    sock->head = NULL;
+    sock->tail = &sock->head;
+    sock->next_seq = 0;
+    /* Not worth trying again for every response if this fails. */
+    sock->disabled = setsockopt(request->fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                                  sizeof(one)) < 0;
+
+    if (UNLIKELY(hash_add(zc->sockets, fd_key(request->fd), sock) < 0)) {
+        free(sock);
+        return NULL;
+    }
+    request->conn->flags |= CONN_ZEROCOPY;
+
+    return sock->disabled ? NULL : sock;
+#else
+    (void)request;
+    return NULL;
+#endif
+}
+
+struct zerocopy_pending *
+lwan_zerocopy_pending_new(void (*release)(void *data1, void *data2),
+                          void *data1, void *data2)
+{
+    struct zerocopy_pending *pending = malloc(sizeof(*pending));
+
+    if (LIKELY(pending)) {
+        pending->sent = false;
+        pending->release = release;
+        pending->data1 = data1;
+        pending->data2 = data2;
+    }
+
+    return pending;
+}
+
+void lwan_zerocopy_sent(struct zerocopy_socket *sock,
+                        struct zerocopy_pending *pending)
+{
+    /* The kernel numbers these calls, starting from 0. */
+    pending->sock = sock;
+    pending->seq = sock->next_seq++;
+    pending->sent = true;
+}
+
+void lwan_zerocopy_disable(struct zerocopy_socket *sock)
+{
+    sock->disabled = true;
+}
+
+void lwan_zerocopy_commit(struct zerocopy_pending *pending)
+{
+    struct zerocopy_socket *sock = pending->sock;
+
+    if (!pending->sent) {
+        release_pending(pending);
+        return;
+    }
+
+    pending->next = NULL;
+    *sock->tail = pending;
+    sock->tail = &pending->next;
+}
+
+#if defined(HAVE_ZEROCOPY)
+static void complete(struct zerocopy_socket *sock, uint32_t up_to)
+{
+    struct zerocopy_pending *pending;
+
+    while ((pending = sock->head) && (int32_t)(up_to - pending->seq) >= 0) {
+        sock->head = pending->next;
+        release_pending(pending);
+    }
+    if (!sock->head)
+        sock->tail = &sock->head;
+}
+
+static bool is_recverr(const struct cmsghdr *cmsg)
+{
+    return (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+}
+#endif
+
+void lwan_zerocopy_reap(struct lwan_thread *t, int fd)
+{
+#if defined(HAVE_ZEROCOPY)
+    struct zerocopy_socket *sock;
+
+    if (UNLIKELY(!t->zerocopy))
+        return;
+    sock = hash_find(t->zerocopy->sockets, fd_key(fd));
+    if (UNLIKELY(!sock))
+        return;
+
+    while (true) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        /* Completions are coalesced by the kernel, so this rarely takes
+         * more than one call. */
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            const struct sock_extended_err *err;
+
+            if (!is_recverr(cmsg))
+                continue;
+
+            err = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_errno || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* Loopback, or a device that can't scatter/gather: pages have
+             * been copied anyway, and waiting for completions only made
+             * things slower. */
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                sock->disabled = true;
+
+            complete(sock, err->ee_data);
+        }
+    }
+#else
+    (void)t;
+    (void)fd;
+#endif
+}
+
+void lwan_zerocopy_forget(struct lwan_thread *t, int fd)
+{
+    struct lwan_zerocopy *zc = t->zerocopy;
+    struct zerocopy_socket *sock;
+
+    if (UNLIKELY(!zc))
+        return;
+    sock = hash_find(zc->sockets, fd_key(fd));
+    if (UNLIKELY(!sock))
+        return;
+
+    if (sock->head) {
+        time_t linger_until = lwan_clock_get()->monotonic + LINGER_SECONDS;
+
+        for (struct zerocopy_pending *p = sock->head; p; p = p->next)
+            p->linger_until = linger_until;
+
+        *zc->lingering_tail = sock->head;
+        zc->lingering_tail = sock->tail;
+        sock->head = NULL;
+    }
+
+    hash_del(zc->sockets, fd_key(fd));
+}
+
+void lwan_zerocopy_release_lingering(struct lwan_thread *t)
+{
+    struct lwan_zerocopy *zc = t->zerocopy;
+    struct zerocopy_pending *pending;
+    time_t now;
+
+    if (LIKELY(!zc || !zc->lingering))
+        return;
+
+    now = lwan_clock_get()->monotonic;
+    while ((pending = zc->lingering) && pending->linger_until <= now) {
+        zc->lingering = pending->next;
+        release_pending(pending);
+    }
+    if (!zc->lingering)
+        zc->lingering_tail = &zc->lingering;
+}
+
+bool lwan_zerocopy_has_lingering(const struct lwan_thread *t)
+{
+    return t->zerocopy && t->zerocopy->lingering;
+}
+
+void lwan_zerocopy_free(struct lwan_zerocopy *zc)
+{
+    if (!zc)
+        return;
+
+    hash_free(zc->sockets);
+    release_all(zc->lingering);
+    free(zc);
+}
@@ -0,0 +1,62 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2026 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lwan.h"
+
+/* Bookkeeping for responses sent with MSG_ZEROCOPY: the kernel reads the
+ * buffers while transmitting them, so whatever owns them has to be kept
+ * around until a completion shows up in the error queue of the socket.
+ * Kept per I/O thread, and allocated on first use. */
+
+struct lwan_zerocopy;
+struct zerocopy_socket;
+struct zerocopy_pending;
+
+/* Returns NULL if the socket can't (or shouldn't) send with MSG_ZEROCOPY;
+ * CONN_ZEROCOPY is set in the connection otherwise. */
+struct zerocopy_socket *lwan_zerocopy_get_socket(struct lwan_request *request);
+struct zerocopy_pending *
+lwan_zerocopy_pending_new(void (*release)(void *data1, void *data2),
+                          void *data1, void *data2);
+/* To be called after each sendmsg() with MSG_ZEROCOPY that didn't fail. */
+void lwan_zerocopy_sent(struct zerocopy_socket *sock,
+                        struct zerocopy_pending *pending);
+/* For sockets where sends would fail, or be copied by the kernel
+ * anyway. */
+void lwan_zerocopy_disable(struct zerocopy_socket *sock);
+/* Releases the buffers right away if nothing was sent, or once the kernel
+ * is done with them otherwise.  Takes ownership of pending. */
+void lwan_zerocopy_commit(struct zerocopy_pending *pending);
+
+/* Called by I/O threads for connections with CONN_ZEROCOPY, when there's
+ * an error on the socket and when it's about to be closed.  Completions
+ * can't be received after that, so buffers of closed sockets are released
+ * after a while instead. */
+void lwan_zerocopy_reap(struct lwan_thread *t, int fd);
+void lwan_zerocopy_forget(struct lwan_thread *t, int fd);
+void lwan_zerocopy_release_lingering(struct lwan_thread *t);
+bool lwan_zerocopy_has_lingering(const struct lwan_thread *t);
+
+void lwan_zerocopy_free(struct lwan_zerocopy *zc);
@@ -23,11 +23,14 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libproc.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -37,6 +40,10 @@
 
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
+#include "lwan-lazy-module.h"
+#include "lwan-micro-cache.h"
+#include "lwan-rate-limit.h"
+#include "lwan-vhost.h"
 
 #if defined(HAVE_LUA)
 #include "lwan-lua.h"
@@ -45,14 +52,34 @@
 static const struct lwan_config default_config = {
     .listener = "localhost:8080",
     .keep_alive_timeout = 15,
+    .websocket_timeout = 300,
+    .request_header_timeout = 10,
+    .request_body_timeout = 30,
+    .write_timeout = 30,
+    .min_transfer_rate = 512,
     .quiet = false,
     .reuse_port = false,
     .proxy_protocol = false,
     .allow_cors = false,
     .expires = 1 * ONE_WEEK,
     .n_threads = 0,
+    .coro_pool_size = 32,
+    .overload_threshold = 90,
+    .scheduling_policy = SCHEDULE_BY_FD,
     .max_post_data_size = 10 * DEFAULT_BUFFER_SIZE,
+    .compress_min_size = 1024,
+    .zerocopy_min_size = 0,
     .allow_post_temp_file = false,
+    .cpu_affinity = NULL,
+    .numa_local_connections = false,
+    .http2 = false,
+    .edge_triggered_epoll = false,
+    .coro_stack_stats = false,
+    .busy_poll = 0,
+    .tcp_fastopen = 5,
+    .tcp_defer_accept = 0,
+    .lazy_modules = false,
+    .module_idle_timeout = 5 * ONE_MINUTE,
 };
 
 LWAN_HANDLER(brew_coffee)
@@ -96,7 +123,9 @@ static void destroy_urlmap(void *data)
 {
     struct lwan_url_map *url_map = data;
 
-    if (url_map->module) {
+    if (url_map->flags & HANDLER_LAZY_MODULE) {
+        lwan_lazy_module_free(url_map->lazy);
+    } else if (url_map->module) {
         const struct lwan_module *module = url_map->module;
 
         if (module->destroy)
@@ -107,11 +136,54 @@ static void destroy_urlmap(void *data)
 
     free(url_map->authorization.realm);
     free(url_map->authorization.password_file);
+    lwan_rate_limit_free(url_map->rate_limit);
+    lwan_micro_cache_free(url_map->micro_cache);
     free((char *)url_map->prefix);
     free(url_map);
 }
 
-static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
+static struct lwan_stack_usage *stack_usage_for_prefix(struct lwan *l,
+                                                      const char *prefix)
+{
+    struct lwan_stack_usage *usage;
+
+    for (usage = l->stack_usage; usage; usage = usage->next) {
+        if (streq(usage->prefix, prefix))
+            return usage;
+    }
+
+    usage = calloc(1, sizeof(*usage));
+    if (!usage)
+        return NULL;
+
+    usage->prefix = strdup(prefix);
+    if (!usage->prefix) {
+        free(usage);
+        return NULL;
+    }
+
+    usage->next = l->stack_usage;
+    l->stack_usage = usage;
+    return usage;
+}
+
+static void free_stack_usage(struct lwan *l)
+{
+    struct lwan_stack_usage *usage = l->stack_usage;
+
+    while (usage) {
+        struct lwan_stack_usage *next = usage->next;
+
+        free(usage->prefix);
+        free(usage);
+        usage = next;
+    }
+
+    l->stack_usage = NULL;
+}
+
+static struct lwan_url_map *add_url_map(struct lwan *l, struct lwan_trie *t,
+                                        const char *prefix,
                                         const struct lwan_url_map *map)
 {
     struct lwan_url_map *copy = malloc(sizeof(*copy));
@@ -123,6 +195,10 @@ static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
 
     copy->prefix = strdup(prefix ? prefix : copy->prefix);
     copy->prefix_len = strlen(copy->prefix);
+    copy->stack_usage = l->config.coro_stack_stats
+                            ? stack_usage_for_prefix(l, copy->prefix)
+                            : NULL;
+    lwan_url_map_specialize(copy);
     lwan_trie_add(t, copy->prefix, copy);
 
     return copy;
@@ -174,12 +250,120 @@ error:
     free(url_map->authorization.password_file);
 }
 
+static struct lwan_rate_limit *parse_rate_limit(struct config *c,
+                                                struct config_line *l)
+{
+    long requests_per_second = 0;
+    long burst = 0;
+
+    while (config_read_line(c, l)) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "requests_per_second")) {
+                requests_per_second = parse_long(l->value, 0);
+            } else if (streq(l->key, "burst")) {
+                burst = parse_long(l->value, 0);
+            } else {
+                config_error(c, "Unknown rate limit key: %s", l->key);
+                return NULL;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->key);
+            return NULL;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            if (requests_per_second <= 0 || requests_per_second > 1000000) {
+                config_error(c, "Requests per second must be between 1 "
+                                "and 1000000");
+                return NULL;
+            }
+            if (burst < 0 || burst > 1000000) {
+                config_error(c, "Burst must be between 0 and 1000000");
+                return NULL;
+            }
+
+            struct lwan_rate_limit *rl = lwan_rate_limit_new(
+                (unsigned int)requests_per_second, (unsigned int)burst);
+            if (!rl)
+                config_error(c, "Could not create rate limiter");
+            return rl;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing rate limit");
+    return NULL;
+}
+
+static struct lwan_micro_cache *parse_micro_cache(struct config *c,
+                                                  struct config_line *l)
+{
+    struct lwan_micro_cache_settings settings = {.ttl = 5};
+    char *vary_headers = NULL;
+    char *vary_cookies = NULL;
+    struct lwan_micro_cache *mc = NULL;
+
+    while (config_read_line(c, l)) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "ttl")) {
+                settings.ttl = parse_time_period(l->value, settings.ttl);
+            } else if (streq(l->key, "stale_while_revalidate")) {
+                settings.stale_while_revalidate = parse_time_period(
+                    l->value, settings.stale_while_revalidate);
+            } else if (streq(l->key, "vary_headers")) {
+                free(vary_headers);
+                vary_headers = strdup(l->value);
+            } else if (streq(l->key, "vary_cookies")) {
+                free(vary_cookies);
+                vary_cookies = strdup(l->value);
+            } else if (streq(l->key, "max_entries")) {
+                settings.max_entries = (size_t)parse_long(l->value, 0);
+            } else if (streq(l->key, "max_size")) {
+                settings.max_size = (size_t)parse_long(l->value, 0);
+            } else {
+                config_error(c, "Unknown micro cache key: %s", l->key);
+                goto out;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->key);
+            goto out;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            if (!settings.ttl) {
+                config_error(c, "Micro cache TTL must be at least 1 second");
+                goto out;
+            }
+
+            settings.vary_headers = vary_headers;
+            settings.vary_cookies = vary_cookies;
+            mc = lwan_micro_cache_new(&settings);
+            if (!mc)
+                config_error(c, "Could not create micro cache");
+            goto out;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing micro cache");
+
+out:
+    free(vary_headers);
+    free(vary_cookies);
+    return mc;
+}
+
 static void parse_listener_prefix(struct config *c, struct config_line *l,
                                   struct lwan *lwan,
+                                  struct lwan_trie *url_map_trie,
                                   const struct lwan_module *module,
                                   void *handler)
 {
     struct lwan_url_map url_map = {};
+    struct lwan_url_map *copy;
+    struct lwan_lazy_module *lazy = NULL;
     struct hash *hash = hash_str_new(free, free);
     char *prefix = strdupa(l->value);
     struct config *isolated;
@@ -203,6 +387,16 @@ static void parse_listener_prefix(struct config *c, struct config_line *l,
                     config_error(c, "Could not find module \"%s\"", l->value);
                     goto out;
                 }
+            } else if (streq(l->key, "stream_post_data")) {
+                if (parse_bool(l->value, false))
+                    url_map.flags |= HANDLER_STREAM_POST_DATA;
+            } else if (streq(l->key, "compress_response")) {
+                if (parse_bool(l->value, false))
+                    url_map.flags |= HANDLER_COMPRESS_RESPONSE |
+                                     HANDLER_PARSE_ACCEPT_ENCODING;
+            } else if (streq(l->key, "constant_response")) {
+                if (parse_bool(l->value, false))
+                    url_map.flags |= HANDLER_CONSTANT_RESPONSE;
             } else if (streq(l->key, "handler")) {
                 if (handler) {
                     config_error(c, "Handler already specified");
@@ -221,6 +415,16 @@ static void parse_listener_prefix(struct config *c, struct config_line *l,
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(l->key, "authorization")) {
                 parse_listener_prefix_authorization(c, l, &url_map);
+            } else if (streq(l->key, "rate_limit")) {
+                lwan_rate_limit_free(url_map.rate_limit);
+                url_map.rate_limit = parse_rate_limit(c, l);
+                if (url_map.rate_limit)
+                    url_map.flags |= HANDLER_RATE_LIMIT;
+            } else if (streq(l->key, "micro_cache")) {
+                lwan_micro_cache_free(url_map.micro_cache);
+                url_map.micro_cache = parse_micro_cache(c, l);
+                if (url_map.micro_cache)
+                    url_map.flags |= HANDLER_MICRO_CACHE;
             } else {
                 if (!config_skip_section(c, l)) {
                     config_error(c, "Could not skip section");
@@ -254,6 +458,20 @@ add_map:
         url_map.module = NULL;
 
         hash = NULL;
+    } else if (module && lwan->config.lazy_modules &&
+               lwan_lazy_module_supported(module) && module->handle_request) {
+        lazy = lwan_lazy_module_new(module, hash,
+                                    lwan->config.module_idle_timeout);
+        if (!lazy) {
+            config_error(c, "Could not set up module instance");
+            goto out;
+        }
+        hash = NULL;
+
+        url_map.handler = module->handle_request;
+        url_map.flags |= module->flags | HANDLER_LAZY_MODULE;
+        url_map.module = module;
+        url_map.lazy = lazy;
     } else if (module && module->create_from_hash && module->handle_request) {
         url_map.data = module->create_from_hash(prefix, hash);
 
@@ -272,9 +490,15 @@ add_map:
         goto out;
     }
 
-    add_url_map(&lwan->url_map_trie, prefix, &url_map);
+    copy = add_url_map(lwan, url_map_trie, prefix, &url_map);
+    if (lazy)
+        lwan_lazy_module_attach(lazy, copy);
+    url_map.rate_limit = NULL;
+    url_map.micro_cache = NULL;
 
 out:
+    lwan_rate_limit_free(url_map.rate_limit);
+    lwan_micro_cache_free(url_map.micro_cache);
     hash_free(hash);
     config_close(isolated);
 }
@@ -286,26 +510,31 @@ void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map)
         lwan_status_critical_perror("Could not initialize trie");
 
     for (; map->prefix; map++) {
-        struct lwan_url_map *copy = add_url_map(&l->url_map_trie, NULL, map);
-
-        if (UNLIKELY(!copy))
-            continue;
+        struct lwan_url_map copy = *map;
 
-        if (copy->module && copy->module->create) {
-            copy->data = copy->module->create (map->prefix, copy->args);
-            copy->flags = copy->module->flags;
-            copy->handler = copy->module->handle_request;
+        if (copy.module && copy.module->create) {
+            copy.data = copy.module->create(map->prefix, copy.args);
+            copy.flags = map->flags | copy.module->flags;
+            copy.handler = copy.module->handle_request;
         } else {
-            copy->flags = HANDLER_PARSE_MASK;
+            copy.flags = map->flags | HANDLER_PARSE_MASK;
         }
+
+        add_url_map(l, &l->url_map_trie, NULL, &copy);
     }
+
+    if (UNLIKELY(!lwan_trie_compile(&l->url_map_trie)))
+        lwan_status_critical("Could not compile URL map");
 }
 
-static void parse_listener(struct config *c, struct config_line *l,
-                           struct lwan *lwan)
+static void parse_virtual_host(struct config *c, struct config_line *l,
+                               struct lwan *lwan);
+
+/* Prefixes of a listener or of one of its virtual hosts. */
+static void parse_url_maps(struct config *c, struct config_line *l,
+                           struct lwan *lwan, struct lwan_trie *url_map_trie)
 {
-    free(lwan->config.listener);
-    lwan->config.listener = strdup(l->value);
+    const bool in_virtual_host = url_map_trie != &lwan->url_map_trie;
 
     while (config_read_line(c, l)) {
         switch (l->type) {
@@ -314,7 +543,17 @@ static void parse_listener(struct config *c, struct config_line *l,
             return;
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(l->key, "prefix")) {
-                parse_listener_prefix(c, l, lwan, NULL, NULL);
+                parse_listener_prefix(c, l, lwan, url_map_trie, NULL, NULL);
+                continue;
+            }
+
+            if (streq(l->key, "virtual_host")) {
+                if (in_virtual_host) {
+                    config_error(c, "Virtual hosts can't be nested");
+                    return;
+                }
+
+                parse_virtual_host(c, l, lwan);
                 continue;
             }
 
@@ -323,7 +562,7 @@ static void parse_listener(struct config *c, struct config_line *l,
 
                 void *handler = find_handler(l->key);
                 if (handler) {
-                    parse_listener_prefix(c, l, lwan, NULL, handler);
+                    parse_listener_prefix(c, l, lwan, url_map_trie, NULL, handler);
                     continue;
                 }
 
@@ -333,7 +572,7 @@ static void parse_listener(struct config *c, struct config_line *l,
 
             const struct lwan_module *module = find_module(l->key);
             if (module) {
-                parse_listener_prefix(c, l, lwan, module, NULL);
+                parse_listener_prefix(c, l, lwan, url_map_trie, module, NULL);
                 continue;
             }
 
@@ -344,7 +583,57 @@ static void parse_listener(struct config *c, struct config_line *l,
         }
     }
 
-    config_error(c, "Expecting section end while parsing listener");
+    config_error(c, in_virtual_host
+                        ? "Expecting section end while parsing virtual host"
+                        : "Expecting section end while parsing listener");
+}
+
+static void parse_virtual_host(struct config *c, struct config_line *l,
+                               struct lwan *lwan)
+{
+    char *names = strdupa(l->value);
+    struct lwan_trie *url_map_trie;
+    char *name, *saveptr;
+    int n_names = 0;
+
+    if (!lwan->vhosts) {
+        lwan->vhosts = lwan_vhosts_new(destroy_urlmap);
+        if (!lwan->vhosts) {
+            config_error(c, "Could not create virtual hosts");
+            return;
+        }
+    }
+
+    url_map_trie = lwan_vhosts_add(lwan->vhosts);
+    if (!url_map_trie) {
+        config_error(c, "Could not create virtual host");
+        return;
+    }
+
+    for (name = strtok_r(names, ", \t", &saveptr); name;
+         name = strtok_r(NULL, ", \t", &saveptr)) {
+        if (!lwan_vhosts_add_name(lwan->vhosts, url_map_trie, name)) {
+            config_error(c, "Virtual host name is invalid or already taken: %s",
+                         name);
+            return;
+        }
+        n_names++;
+    }
+    if (!n_names) {
+        config_error(c, "Virtual host needs at least one name");
+        return;
+    }
+
+    parse_url_maps(c, l, lwan, url_map_trie);
+}
+
+static void parse_listener(struct config *c, struct config_line *l,
+                           struct lwan *lwan)
+{
+    free(lwan->config.listener);
+    lwan->config.listener = strdup(l->value);
+
+    parse_url_maps(c, l, lwan, &lwan->url_map_trie);
 }
 
 const char *lwan_get_config_path(char *path_buf, size_t path_buf_len)
@@ -367,6 +656,20 @@ out:
     return "lwan.conf";
 }
 
+static enum lwan_scheduling_policy
+parse_scheduling_policy(struct config *conf, const char *value)
+{
+    if (streq(value, "fd"))
+        return SCHEDULE_BY_FD;
+    if (streq(value, "least_loaded"))
+        return SCHEDULE_LEAST_LOADED;
+    if (streq(value, "power_of_two_choices"))
+        return SCHEDULE_POWER_OF_TWO_CHOICES;
+
+    config_error(conf, "Unknown scheduling policy: %s", value);
+    return default_config.scheduling_policy;
+}
+
 static bool setup_from_config(struct lwan *lwan, const char *path)
 {
     struct config *conf;
@@ -391,6 +694,21 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             if (streq(line.key, "keep_alive_timeout")) {
                 lwan->config.keep_alive_timeout = (unsigned short)parse_long(
                     line.value, default_config.keep_alive_timeout);
+            } else if (streq(line.key, "websocket_timeout")) {
+                lwan->config.websocket_timeout = (unsigned int)parse_long(
+                    line.value, default_config.websocket_timeout);
+            } else if (streq(line.key, "request_header_timeout")) {
+                lwan->config.request_header_timeout = (unsigned int)parse_long(
+                    line.value, default_config.request_header_timeout);
+            } else if (streq(line.key, "request_body_timeout")) {
+                lwan->config.request_body_timeout = (unsigned int)parse_long(
+                    line.value, default_config.request_body_timeout);
+            } else if (streq(line.key, "write_timeout")) {
+                lwan->config.write_timeout = (unsigned int)parse_long(
+                    line.value, default_config.write_timeout);
+            } else if (streq(line.key, "min_transfer_rate")) {
+                lwan->config.min_transfer_rate = (unsigned int)parse_long(
+                    line.value, default_config.min_transfer_rate);
             } else if (streq(line.key, "quiet")) {
                 lwan->config.quiet =
                     parse_bool(line.value, default_config.quiet);
@@ -406,6 +724,15 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             } else if (streq(line.key, "expires")) {
                 lwan->config.expires =
                     parse_time_period(line.value, default_config.expires);
+            } else if (streq(line.key, "tls_certificate")) {
+                free(lwan->config.tls_certificate);
+                lwan->config.tls_certificate = strdup(line.value);
+            } else if (streq(line.key, "tls_private_key")) {
+                free(lwan->config.tls_private_key);
+                lwan->config.tls_private_key = strdup(line.value);
+            } else if (streq(line.key, "access_log")) {
+                free(lwan->config.access_log);
+                lwan->config.access_log = strdup(line.value);
             } else if (streq(line.key, "error_template")) {
                 free(lwan->config.error_template);
                 lwan->config.error_template = strdup(line.value);
@@ -416,6 +743,21 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
                     config_error(conf, "Invalid number of threads: %ld",
                                  n_threads);
                 lwan->config.n_threads = (unsigned short int)n_threads;
+            } else if (streq(line.key, "coro_pool_size")) {
+                long coro_pool_size =
+                    parse_long(line.value, default_config.coro_pool_size);
+                if (coro_pool_size < 0 || coro_pool_size > 65535)
+                    config_error(conf, "Invalid coroutine pool size: %ld",
+                                 coro_pool_size);
+                lwan->config.coro_pool_size = (unsigned short)coro_pool_size;
+            } else if (streq(line.key, "overload_threshold")) {
+                long overload_threshold = parse_long(
+                    line.value, default_config.overload_threshold);
+                if (overload_threshold < 0 || overload_threshold > 100)
+                    config_error(conf, "Invalid overload threshold: %ld%%",
+                                 overload_threshold);
+                lwan->config.overload_threshold =
+                    (unsigned short)overload_threshold;
             } else if (streq(line.key, "max_post_data_size")) {
                 long max_post_data_size = parse_long(
                     line.value, (long)default_config.max_post_data_size);
@@ -425,6 +767,79 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
                     config_error(conf,
                                  "Maximum post data can't be over 128MiB");
                 lwan->config.max_post_data_size = (size_t)max_post_data_size;
+            } else if (streq(line.key, "compress_min_size")) {
+                long compress_min_size = parse_long(
+                    line.value, (long)default_config.compress_min_size);
+                if (compress_min_size < 0)
+                    config_error(conf, "Negative minimum compression size");
+                else
+                    lwan->config.compress_min_size = (size_t)compress_min_size;
+            } else if (streq(line.key, "zerocopy_min_size")) {
+                long zerocopy_min_size = parse_long(
+                    line.value, (long)default_config.zerocopy_min_size);
+                if (zerocopy_min_size < 0)
+                    config_error(conf, "Negative minimum zerocopy size");
+                else
+                    lwan->config.zerocopy_min_size = (size_t)zerocopy_min_size;
+            } else if (streq(line.key, "scheduling_policy")) {
+                lwan->config.scheduling_policy =
+                    parse_scheduling_policy(conf, line.value);
+            } else if (streq(line.key, "cpu_affinity")) {
+                free(lwan->config.cpu_affinity);
+                lwan->config.cpu_affinity = strdup(line.value);
+            } else if (streq(line.key, "busy_poll")) {
+                long busy_poll = parse_long(line.value, 0);
+                if (busy_poll < 0 || busy_poll > 1000000)
+                    config_error(conf, "Busy polling budget must be between "
+                                       "0 and 1000000 microseconds");
+                else
+                    lwan->config.busy_poll = (unsigned int)busy_poll;
+            } else if (streq(line.key, "tcp_fastopen")) {
+                long tcp_fastopen =
+                    parse_long(line.value, default_config.tcp_fastopen);
+                if (tcp_fastopen < 0 || tcp_fastopen > 65535)
+                    config_error(conf, "Invalid TCP Fast Open queue length: %ld",
+                                 tcp_fastopen);
+                else
+                    lwan->config.tcp_fastopen = (unsigned int)tcp_fastopen;
+            } else if (streq(line.key, "tcp_defer_accept")) {
+                long tcp_defer_accept =
+                    parse_long(line.value, default_config.tcp_defer_accept);
+                if (tcp_defer_accept < 0 || tcp_defer_accept > 3600)
+                    config_error(conf, "TCP_DEFER_ACCEPT timeout must be "
+                                       "between 0 and 3600 seconds");
+                else
+                    lwan->config.tcp_defer_accept =
+                        (unsigned int)tcp_defer_accept;
+            } else if (streq(line.key, "lazy_modules")) {
+                lwan->config.lazy_modules =
+                    parse_bool(line.value, default_config.lazy_modules);
+            } else if (streq(line.key, "module_idle_timeout")) {
+                long module_idle_timeout = parse_long(
+                    line.value, default_config.module_idle_timeout);
+                if (module_idle_timeout < 0)
+                    config_error(conf, "Negative module idle timeout");
+                else
+                    lwan->config.module_idle_timeout =
+                        (unsigned int)module_idle_timeout;
+            } else if (streq(line.key, "numa_local_connections")) {
+                lwan->config.numa_local_connections = parse_bool(
+                    line.value, default_config.numa_local_connections);
+            } else if (streq(line.key, "http2")) {
+                lwan->config.http2 =
+                    parse_bool(line.value, default_config.http2);
+            } else if (streq(line.key, "coro_stack_stats")) {
+                lwan->config.coro_stack_stats = parse_bool(
+                    line.value, default_config.coro_stack_stats);
+                if (lwan->config.coro_stack_stats &&
+                    !coro_stack_stats_supported()) {
+                    lwan_status_warning("Coroutine stack stats aren't "
+                                        "supported in this build");
+                    lwan->config.coro_stack_stats = false;
+                }
+            } else if (streq(line.key, "edge_triggered_epoll")) {
+                lwan->config.edge_triggered_epoll = parse_bool(
+                    line.value, default_config.edge_triggered_epoll);
             } else if (streq(line.key, "allow_temp_files")) {
                 lwan->config.allow_post_temp_file =
                     !!strstr(line.value, "post");
@@ -442,6 +857,9 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
                 }
             } else if (streq(line.key, "straitjacket")) {
                 lwan_straitjacket_enforce_from_config(conf);
+            } else if (streq(line.key, "rate_limit")) {
+                lwan_rate_limit_free(lwan->rate_limit);
+                lwan->rate_limit = parse_rate_limit(conf, &line);
             } else {
                 config_error(conf, "Unknown section type: %s", line.key);
             }
@@ -458,6 +876,11 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
 
     config_close(conf);
 
+    if (!lwan_trie_compile(&lwan->url_map_trie))
+        lwan_status_critical("Could not compile URL map");
+    if (lwan->vhosts && !lwan_vhosts_compile(lwan->vhosts))
+        lwan_status_critical("Could not compile URL maps of virtual hosts");
+
     return true;
 }
 
@@ -487,12 +910,24 @@ static inline size_t align_to_size(size_t value, size_t alignment)
 
 static void allocate_connections(struct lwan *l, size_t max_open_files)
 {
-    const size_t sz = max_open_files * sizeof(struct lwan_connection);
+    const size_t sz = align_to_size(max_open_files * sizeof(struct lwan_connection), 4096);
 
-    if (posix_memalign((void **)&l->conns, 64, align_to_size(sz, 64)))
-        lwan_status_critical_perror("aligned_alloc");
+    /* Anonymous mappings are zeroed and page-aligned; pages are only
+     * committed when first touched, which, with numa_local_connections,
+     * is done by the I/O thread that will use them. */
+    l->conns = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (l->conns == MAP_FAILED)
+        lwan_status_critical_perror("mmap");
 
-    memset(l->conns, 0, sz);
+    l->n_conns = max_open_files;
+}
+
+static void free_connections(struct lwan *l)
+{
+    const size_t sz = align_to_size(l->n_conns * sizeof(struct lwan_connection), 4096);
+
+    munmap(l->conns, sz);
 }
 
 static unsigned short int get_number_of_cpus(void)
@@ -506,6 +941,74 @@ static unsigned short int get_number_of_cpus(void)
     return (unsigned short int)n_online_cpus;
 }
 
+static unsigned short schedule_by_fd(struct lwan *l, int fd)
+{
+#ifdef __x86_64__
+    /* Since struct lwan_connection is guaranteed to be 32-byte long, two of
+     * them can fill up a cache line.  This formula will group two connections
+     * per thread in a way that false-sharing is avoided.  This gives wrong
+     * results when fd=0, but this shouldn't happen (as 0 is either the
+     * standard input or the main socket, but even if that changes,
+     * scheduling will still work).  */
+    return (unsigned short)(((fd - 1) / 2) % l->thread.count);
+#else
+    static unsigned short counter = 0;
+    return (unsigned short)(counter++ % l->thread.count);
+#endif
+}
+
+static ALWAYS_INLINE unsigned int thread_load(struct lwan_thread *t)
+{
+    /* Connections that were handed off but not yet picked up by the
+     * thread also count towards its load. */
+    return ATOMIC_READ(t->n_connections) + (unsigned int)ATOMIC_READ(t->n_pending);
+}
+
+static unsigned short schedule_least_loaded(struct lwan *l, int fd)
+{
+    unsigned short best = 0;
+    unsigned int best_load = thread_load(&l->thread.threads[0]);
+
+    for (unsigned short i = 1; i < l->thread.count; i++) {
+        unsigned int load = thread_load(&l->thread.threads[i]);
+
+        if (load < best_load) {
+            best_load = load;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static unsigned short schedule_power_of_two_choices(struct lwan *l, int fd)
+{
+    /* xorshift32; only ever called from the main thread. */
+    static uint32_t state = 2463534242u;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    unsigned short a = (unsigned short)(state % l->thread.count);
+    unsigned short b = (unsigned short)((state >> 16) % l->thread.count);
+
+    if (thread_load(&l->thread.threads[b]) < thread_load(&l->thread.threads[a]))
+        return b;
+    return a;
+}
+
+static unsigned short schedule_by_fd_page(struct lwan *l, int fd)
+{
+    return lwan_thread_for_fd_page(l, fd);
+}
+
+static unsigned short (*const schedulers[])(struct lwan *l, int fd) = {
+    [SCHEDULE_BY_FD] = schedule_by_fd,
+    [SCHEDULE_LEAST_LOADED] = schedule_least_loaded,
+    [SCHEDULE_POWER_OF_TWO_CHOICES] = schedule_power_of_two_choices,
+};
+
 void lwan_init(struct lwan *l) { lwan_init_with_config(l, &default_config); }
 
 const struct lwan_config *lwan_get_default_config(void)
@@ -525,6 +1028,10 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
     memcpy(&l->config, config, sizeof(*config));
     l->config.listener = dup_or_null(l->config.listener);
     l->config.config_file_path = dup_or_null(l->config.config_file_path);
+    l->config.cpu_affinity = dup_or_null(l->config.cpu_affinity);
+    l->config.tls_certificate = dup_or_null(l->config.tls_certificate);
+    l->config.tls_private_key = dup_or_null(l->config.tls_private_key);
+    l->config.access_log = dup_or_null(l->config.access_log);
 
     /* Initialize status first, as it is used by other things during
      * their initialization. */
@@ -534,6 +1041,7 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
      * printed if we're on a debug build, so the quiet setting will be
      * respected. */
     lwan_job_thread_init();
+    lwan_readahead_init();
     lwan_tables_init();
 
     /* Load the configuration file. */
@@ -550,7 +1058,12 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
         lwan_status_init(l);
     }
 
+    lwan_clock_init((time_t)l->config.expires);
     lwan_response_init(l);
+    lwan_tls_init(l);
+
+    if (l->config.coro_stack_stats)
+        coro_stack_stats_enable();
 
     /* Continue initialization as normal. */
     lwan_status_debug("Initializing lwan web server");
@@ -577,6 +1090,19 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
     lwan_status_info("Using %d threads, maximum %d sockets per thread",
                      l->thread.count, l->thread.max_fd);
 
+    if (l->config.scheduling_policy >= N_ELEMENTS(schedulers)) {
+        lwan_status_warning("Invalid scheduling policy, scheduling by fd");
+        l->config.scheduling_policy = SCHEDULE_BY_FD;
+    }
+    l->thread.schedule = schedulers[l->config.scheduling_policy];
+    if (l->config.numa_local_connections) {
+        if (l->config.scheduling_policy == SCHEDULE_BY_FD)
+            l->thread.schedule = schedule_by_fd_page;
+        else
+            lwan_status_warning("numa_local_connections works best with "
+                                "scheduling_policy = fd");
+    }
+
     signal(SIGPIPE, SIG_IGN);
 
     lwan_thread_init(l);
@@ -591,49 +1117,88 @@ void lwan_shutdown(struct lwan *l)
     free(l->config.listener);
     free(l->config.error_template);
     free(l->config.config_file_path);
+    free(l->config.cpu_affinity);
+    free(l->config.tls_certificate);
+    free(l->config.tls_private_key);
+    free(l->config.access_log);
 
     lwan_job_thread_shutdown();
     lwan_thread_shutdown(l);
+    lwan_readahead_shutdown();
 
     lwan_status_debug("Shutting down URL handlers");
     lwan_trie_destroy(&l->url_map_trie);
+    lwan_vhosts_free(l->vhosts);
+    lwan_rate_limit_free(l->rate_limit);
+    free_stack_usage(l);
 
-    free(l->conns);
+    free_connections(l);
 
     lwan_response_shutdown(l);
+    lwan_tls_shutdown(l);
     lwan_tables_shutdown();
     lwan_status_shutdown(l);
     lwan_http_authorize_shutdown();
 }
 
-static ALWAYS_INLINE void schedule_client(struct lwan *l, int fd)
+static ALWAYS_INLINE int sibling_fd(struct lwan *l, int fd)
+{
+#ifdef __x86_64__
+    /* The other connection sharing a cache line with this one; see
+     * schedule_by_fd(). */
+    int sibling = ((fd - 1) & 1) ? fd - 1 : fd + 1;
+
+    if (UNLIKELY(sibling < 1 || (size_t)sibling >= l->thread.max_fd * l->thread.count))
+        return -1;
+
+    return sibling;
+#else
+    return -1;
+#endif
+}
+
+static ALWAYS_INLINE struct lwan_thread *schedule_client(struct lwan *l,
+                                                         int fd)
 {
-    int thread;
 #ifdef __x86_64__
     static_assert(sizeof(struct lwan_connection) == 32,
                   "Two connections per cache line");
-    /* Since struct lwan_connection is guaranteed to be 32-byte long, two of
-     * them can fill up a cache line.  This formula will group two connections
-     * per thread in a way that false-sharing is avoided.  This gives wrong
-     * results when fd=0, but this shouldn't happen (as 0 is either the
-     * standard input or the main socket, but even if that changes,
-     * scheduling will still work).  */
-    thread = ((fd - 1) / 2) % l->thread.count;
-#else
-    static int counter = 0;
-    thread = counter++ % l->thread.count;
 #endif
-    struct lwan_thread *t = &l->thread.threads[thread];
-    lwan_thread_add_client(t, fd);
+    struct lwan_thread *t;
+    int sibling = sibling_fd(l, fd);
+
+    /* Load-aware policies would otherwise scatter connections that share
+     * a cache line across threads.  If the sibling connection is still
+     * alive, keep this one on the same thread. */
+    if (sibling >= 0 && (ATOMIC_READ(l->conns[sibling].flags) & CONN_IS_ALIVE) &&
+        l->conns[sibling].thread) {
+        t = l->conns[sibling].thread;
+    } else {
+        t = &l->thread.threads[l->thread.schedule(l, fd)];
+    }
+
+    lwan_thread_queue_client(t, fd);
+    return t;
 }
 
 static volatile sig_atomic_t main_socket = -1;
+static volatile sig_atomic_t quit_pipe_fd = -1;
+static volatile sig_atomic_t reload_requested = 0;
 
 static_assert(sizeof(main_socket) >= sizeof(int),
               "size of sig_atomic_t > size of int");
 
 static void sigint_handler(int signal_number __attribute__((unused)))
 {
+    if (quit_pipe_fd >= 0) {
+        /* Wake up lwan_main_loop() if I/O threads are accepting
+         * connections by themselves. */
+        if (write((int)quit_pipe_fd, "", 1) < 0)
+            return;
+        quit_pipe_fd = -1;
+        return;
+    }
+
     if (main_socket < 0)
         return;
     shutdown((int)main_socket, SHUT_RDWR);
@@ -641,33 +1206,270 @@ static void sigint_handler(int signal_number __attribute__((unused)))
     main_socket = -1;
 }
 
-void lwan_main_loop(struct lwan *l)
+static void sigusr2_handler(int signal_number __attribute__((unused)))
 {
-    assert(main_socket == -1);
-    main_socket = l->main_socket;
+    /* Installed without SA_RESTART: interrupting accept() or read() in
+     * the main loop is all that's needed to get it to look at this. */
+    reload_requested = 1;
+}
+
+static void install_signal_handlers(void)
+{
+    struct sigaction sa = {.sa_handler = sigusr2_handler};
+
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
         lwan_status_critical("Could not set signal handler");
 
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) < 0)
+        lwan_status_critical_perror("Could not set SIGUSR2 handler");
+}
+
+static void drain_connections(struct lwan *l)
+{
+    /* Idle keep-alive connections aren't woken up, so they might take as
+     * long as the keep-alive timeout to go away; anything still around
+     * after that is closed by lwan_shutdown(). */
+    const unsigned int max_ticks = l->config.keep_alive_timeout * 10u + 10u;
+    unsigned int remaining;
+
+    ATOMIC_READ(l->draining) = true;
+
+    for (unsigned int tick = 0;; tick++) {
+        remaining = 0;
+        for (unsigned short i = 0; i < l->thread.count; i++)
+            remaining += thread_load(&l->thread.threads[i]);
+
+        if (!remaining || tick == max_ticks)
+            break;
+
+        usleep(100 * 1000);
+    }
+
+    if (remaining)
+        lwan_status_info("Closing %u connections that didn't finish in time",
+                         remaining);
+    else
+        lwan_status_info("All connections drained");
+}
+
+static struct lwan_successor successor = {.ready_fd = -1};
+
+/* Starts a new process with the same command line, handing it the main
+ * socket (with the systemd socket activation protocol).  This process keeps
+ * serving until it's ready, and as if nothing happened if it isn't. */
+static bool start_successor(struct lwan *l)
+{
+    reload_requested = 0;
+
+    if (successor.ready_fd >= 0) {
+        lwan_status_info("Still waiting for new process (PID %d)",
+                         successor.pid);
+        return false;
+    }
+
+    lwan_status_info("Signal 12 (User defined signal 2) received, "
+                     "starting new process");
+
+    if (!lwan_reload_spawn_successor(l, &successor)) {
+        lwan_status_error("Could not start new process, still serving");
+        return false;
+    }
+
+    return true;
+}
+
+/* Called once the new process is ready to serve. */
+static void hand_over_to_successor(struct lwan *l)
+{
+    if (l->main_socket >= 0) {
+        /* Only ours is closed: the successor has its own copy. */
+        main_socket = -1;
+        close(l->main_socket);
+        l->main_socket = -1;
+    } else {
+        lwan_thread_stop_accepting(l);
+    }
+
+    lwan_status_info("New process is ready, draining connections");
+    drain_connections(l);
+}
+
+static void wait_for_interrupt(struct lwan *l)
+{
+    int pipe_fd[2];
+    char buffer;
+
+    if (pipe2(pipe_fd, O_CLOEXEC) < 0)
+        lwan_status_critical_perror("pipe");
+
+    quit_pipe_fd = pipe_fd[1];
+    install_signal_handlers();
+
     lwan_status_info("Ready to serve");
+    lwan_reload_notify_predecessor();
 
-    for (;;) {
+    while (read(pipe_fd[0], &buffer, 1) < 0) {
+        if (errno != EINTR) {
+            lwan_status_perror("read");
+            break;
+        }
+
+        /* I/O threads keep accepting connections while this waits. */
+        if (reload_requested && start_successor(l)) {
+            if (lwan_reload_wait_for_successor(&successor)) {
+                hand_over_to_successor(l);
+                goto out;
+            }
+            lwan_status_error("New process failed, still serving");
+        }
+    }
+
+    lwan_status_info("Signal 2 (Interrupt) received");
+
+out:
+    quit_pipe_fd = -1;
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+}
+
+/* Out of file descriptors or memory: the pending connection can't even be
+ * accepted to be turned away, so give connections some time to go away
+ * instead of spinning.  The wait doubles for as long as this keeps
+ * happening, and is halved by each connection that's accepted; this is
+ * only logged when it starts. */
+static void back_off_accepting(unsigned int *backoff_ms)
+{
+    if (!*backoff_ms) {
+        lwan_status_perror("accept");
+        *backoff_ms = 10;
+    } else if (*backoff_ms < 1000) {
+        *backoff_ms *= 2;
+    }
+
+    usleep(*backoff_ms * 1000);
+}
+
+/* Connections pending on the main socket are accepted in batches of up to
+ * this many, and each I/O thread is woken up (at most) once per batch. */
+#define ACCEPT_BATCH_SIZE 64
+
+static void flush_clients(struct lwan_thread *threads[], int n_clients)
+{
+    for (int i = 0; i < n_clients; i++)
+        lwan_thread_flush_clients(threads[i]);
+}
+
+/* Returns the number of connections accepted, or -1 (with errno set) if
+ * none could be because of something other than there being none left. */
+static int accept_clients(struct lwan *l, unsigned int *backoff_ms)
+{
+    struct lwan_thread *threads[ACCEPT_BATCH_SIZE];
+    int n_clients = 0;
+
+    while (n_clients < ACCEPT_BATCH_SIZE) {
         int client_fd =
             accept4((int)main_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
         if (UNLIKELY(client_fd < 0)) {
-            switch (errno) {
-            case EBADF:
-            case ECONNABORTED:
-                if (main_socket < 0) {
-                    lwan_status_info("Signal 2 (Interrupt) received");
-                } else {
-                    lwan_status_info("Main socket closed for unknown reasons");
+            if (errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN)
+                break;
+
+            int saved_errno = errno;
+            flush_clients(threads, n_clients);
+            errno = saved_errno;
+            return n_clients ? n_clients : -1;
+        }
+
+        if (UNLIKELY(*backoff_ms))
+            *backoff_ms /= 2;
+        threads[n_clients++] = schedule_client(l, client_fd);
+    }
+
+    flush_clients(threads, n_clients);
+    return n_clients;
+}
+
+void lwan_main_loop(struct lwan *l)
+{
+    unsigned int backoff_ms = 0;
+
+    assert(main_socket == -1);
+
+    if (l->main_socket < 0) {
+        /* Each I/O thread has its own SO_REUSEPORT listener; nothing to
+         * accept here. */
+        wait_for_interrupt(l);
+        return;
+    }
+
+    main_socket = l->main_socket;
+    install_signal_handlers();
+
+    lwan_status_info("Ready to serve");
+    lwan_reload_notify_predecessor();
+
+    /* Draining the accept queue needs to know when it's empty. */
+    int flags = fcntl(l->main_socket, F_GETFL);
+    if (flags < 0 || fcntl(l->main_socket, F_SETFL, flags | O_NONBLOCK) < 0)
+        lwan_status_critical_perror("fcntl");
+
+    for (;;) {
+        /* Connections are accepted while a new process gets ready, as
+         * it might take a while to; poll() ignores a negative fd. */
+        struct pollfd pfds[] = {
+            {.fd = (int)main_socket, .events = POLLIN},
+            {.fd = successor.ready_fd, .events = POLLIN},
+        };
+        int timeout = successor.ready_fd >= 0
+                          ? lwan_reload_successor_timeout(&successor)
+                          : -1;
+        int n_ready;
+
+        if (UNLIKELY(main_socket < 0)) {
+            errno = EBADF;
+        } else if (UNLIKELY((n_ready = poll(pfds, N_ELEMENTS(pfds),
+                                            timeout)) < 0)) {
+            /* Handled below, like errors from accept(). */
+        } else {
+            if (UNLIKELY(successor.ready_fd >= 0) &&
+                (pfds[1].revents || !n_ready)) {
+                if (lwan_reload_successor_ready(&successor)) {
+                    hand_over_to_successor(l);
+                    return;
                 }
-                return;
+                lwan_status_error("New process failed, still serving");
             }
 
-            lwan_status_perror("accept");
-        } else {
-            schedule_client(l, client_fd);
+            if (!pfds[0].revents ||
+                LIKELY(accept_clients(l, &backoff_ms) >= 0))
+                continue;
         }
+
+        switch (errno) {
+        case EBADF:
+        case EINVAL:
+            if (main_socket < 0) {
+                lwan_status_info("Signal 2 (Interrupt) received");
+            } else {
+                lwan_status_info("Main socket closed for unknown reasons");
+            }
+            lwan_reload_abandon_successor(&successor);
+            return;
+        case EINTR:
+            if (reload_requested)
+                start_successor(l);
+            continue;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            back_off_accepting(&backoff_ms);
+            continue;
+        }
+
+        lwan_status_perror("accept");
     }
 }
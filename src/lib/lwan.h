@@ -36,9 +36,16 @@ extern "C" {
 #include "lwan-status.h"
 #include "lwan-trie.h"
 #include "lwan-strbuf.h"
+#include "queue.h"
 
 #define DEFAULT_BUFFER_SIZE 4096
+/* Requests are read into a buffer of the smaller size in the coroutine
+ * stack; those that don't fit are moved to one with the larger size. */
+#define REQUEST_BUFFER_SIZE 2048
+#define LARGE_REQUEST_BUFFER_SIZE (4 * DEFAULT_BUFFER_SIZE)
 #define DEFAULT_HEADERS_SIZE 512
+/* Range requests with more ranges than this are answered in full. */
+#define MAX_RANGES 16
 
 #define N_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
 
@@ -155,6 +162,7 @@ static ALWAYS_INLINE int16_t string_as_int16(const char *s)
 #endif
 
 enum lwan_http_status {
+    HTTP_SWITCHING_PROTOCOLS = 101,
     HTTP_OK = 200,
     HTTP_PARTIAL_CONTENT = 206,
     HTTP_MOVED_PERMANENTLY = 301,
@@ -169,9 +177,12 @@ enum lwan_http_status {
     HTTP_RANGE_UNSATISFIABLE = 416,
     HTTP_I_AM_A_TEAPOT = 418,
     HTTP_CLIENT_TOO_HIGH = 420,
+    HTTP_TOO_MANY_REQUESTS = 429,
     HTTP_INTERNAL_ERROR = 500,
     HTTP_NOT_IMPLEMENTED = 501,
+    HTTP_BAD_GATEWAY = 502,
     HTTP_UNAVAILABLE = 503,
+    HTTP_GATEWAY_TIMEOUT = 504,
     HTTP_SERVER_TOO_HIGH = 520,
 };
 
@@ -186,6 +197,12 @@ enum lwan_handler_flags {
     HANDLER_CAN_REWRITE_URL = 1<<7,
     HANDLER_PARSE_COOKIES = 1<<8,
     HANDLER_DATA_IS_HASH_TABLE = 1<<9,
+    HANDLER_STREAM_POST_DATA = 1<<10,
+    HANDLER_RATE_LIMIT = 1<<11,
+    HANDLER_COMPRESS_RESPONSE = 1<<12,
+    HANDLER_MICRO_CACHE = 1<<13,
+    HANDLER_LAZY_MODULE = 1<<14,
+    HANDLER_CONSTANT_RESPONSE = 1<<15,
 
     HANDLER_PARSE_MASK = 1<<0 | 1<<1 | 1<<2 | 1<<3 | 1<<4 | 1<<8
 };
@@ -201,6 +218,7 @@ enum lwan_request_flags {
      */
     REQUEST_ALLOW_PROXY_REQS_SHIFT = 6,
     REQUEST_ALLOW_CORS_SHIFT = 8,
+    REQUEST_ALLOW_HTTP_2_SHIFT = 20,
 
     REQUEST_METHOD_MASK        = 1<<0 | 1<<1 | 1<<2,
     REQUEST_METHOD_GET         = 1<<0,
@@ -220,6 +238,19 @@ enum lwan_request_flags {
     RESPONSE_CHUNKED_ENCODING  = 1<<10,
     RESPONSE_NO_CONTENT_LENGTH = 1<<11,
     RESPONSE_URL_REWRITTEN     = 1<<12,
+
+    REQUEST_PARSED_QUERY_STRING = 1<<13,
+    REQUEST_PARSED_COOKIES     = 1<<14,
+    REQUEST_PARSED_POST_DATA   = 1<<15,
+    REQUEST_PIPELINED          = 1<<16,
+    REQUEST_ACCEPT_BROTLI      = 1<<17,
+    REQUEST_ACCEPT_ZSTD        = 1<<18,
+    REQUEST_PARSED_JSON_BODY   = 1<<19,
+    REQUEST_ALLOW_HTTP_2       = 1<<REQUEST_ALLOW_HTTP_2_SHIFT,
+    REQUEST_IS_HTTP_2          = 1<<21,
+    REQUEST_WEBSOCKET_CLOSED   = 1<<22,
+    RESPONSE_MAY_COMPRESS      = 1<<23,
+    RESPONSE_COMPRESSED        = 1<<24,
 };
 
 enum lwan_connection_flags {
@@ -229,12 +260,29 @@ enum lwan_connection_flags {
     CONN_SHOULD_RESUME_CORO = 1<<2,
     CONN_WRITE_EVENTS       = 1<<3,
     CONN_MUST_READ          = 1<<4,
+    CONN_SUSPENDED          = 1<<5,
+    CONN_URING_PENDING      = 1<<6,
+    CONN_IS_WEBSOCKET       = 1<<7,
+    CONN_HAS_DEADLINE       = 1<<8,
+    /* Waiting for the next request, with nothing in flight. */
+    CONN_IDLE               = 1<<9,
+    /* Keep-alive timer armed to trim the coroutine, rather than to
+     * close the connection. */
+    CONN_IDLE_TRIM          = 1<<10,
+    /* Has sent responses with MSG_ZEROCOPY; see lwan-zerocopy.h. */
+    CONN_ZEROCOPY           = 1<<11,
+    /* A write would have blocked: with edge_triggered_epoll, the coroutine
+     * is only resumed once the socket becomes writable again. */
+    CONN_WRITE_BLOCKED      = 1<<12,
+    /* In the list of coroutines to resume with edge_triggered_epoll. */
+    CONN_READY              = 1<<13,
 };
 
 enum lwan_connection_coro_yield {
     CONN_CORO_ABORT = -1,
     CONN_CORO_MAY_RESUME = 0,
-    CONN_CORO_FINISHED = 1
+    CONN_CORO_FINISHED = 1,
+    CONN_CORO_SUSPEND = 2
 };
 
 struct lwan_key_value {
@@ -243,9 +291,15 @@ struct lwan_key_value {
 };
 
 struct lwan_request;
+struct lwan_json;
+struct request_parser_helper;
+struct lwan_h2_stream;
+struct lwan_deflate;
 struct lwan_response {
     struct lwan_strbuf *buffer;
     const char *mime_type;
+    /* Set by stream callbacks for the Content-Length header; counts what's
+     * been sent so far in chunked responses. */
     size_t content_length;
     struct lwan_key_value *headers;
 
@@ -268,7 +322,7 @@ struct lwan_connection {
     unsigned int time_to_die;
     struct coro *coro;
     struct lwan_thread *thread;
-    int prev, next; /* for death queue */
+    int prev, next; /* for the timer wheel */
 };
 
 struct lwan_proxy {
@@ -280,6 +334,12 @@ struct lwan_proxy {
 
 DEFINE_ARRAY_TYPE(lwan_key_value_array, struct lwan_key_value)
 
+/* Responses to pipelined requests, waiting to be sent together. */
+struct lwan_output_batch {
+    char *buffer;
+    size_t len;
+};
+
 struct lwan_request {
     enum lwan_request_flags flags;
     int fd;
@@ -287,17 +347,29 @@ struct lwan_request {
     struct lwan_value original_url;
     struct lwan_connection *conn;
     struct lwan_proxy *proxy;
+    struct request_parser_helper *helper;
+    struct lwan_output_batch *batch;
+    struct lwan_h2_stream *h2;
+    struct lwan_deflate *deflate;
+    /* Set for handlers with HANDLER_CONSTANT_RESPONSE until their response
+     * is kept by the I/O thread. */
+    const struct lwan_url_map *constant_response;
 
     struct lwan_key_value_array query_params, post_data, cookies;
 
     struct {
         time_t if_modified_since;
-        struct {
+        struct lwan_range {
           off_t from;
           off_t to;
         } range;
+        /* All ranges in the Range header; the first one is also in range */
+        const struct lwan_range *ranges;
+        size_t n_ranges;
         struct lwan_value *body;
         struct lwan_value *content_type;
+        /* Parsed along with If-Modified-Since */
+        struct lwan_value *if_none_match;
     } header;
     struct lwan_response response;
 };
@@ -328,6 +400,11 @@ struct lwan_handler_info {
                                      void *data);
 };
 
+typedef enum lwan_http_status (*lwan_url_map_prepare_func)(
+    struct lwan_url_map *url_map,
+    struct lwan_request *request,
+    struct request_parser_helper *helper);
+
 struct lwan_url_map {
     enum lwan_http_status (*handler)(struct lwan_request *request, struct lwan_response *response, void *data);
     void *data;
@@ -343,10 +420,82 @@ struct lwan_url_map {
         char *realm;
         char *password_file;
     } authorization;
+
+    /* Set along with HANDLER_RATE_LIMIT. */
+    struct lwan_rate_limit *rate_limit;
+
+    /* Set along with HANDLER_MICRO_CACHE. */
+    struct lwan_micro_cache *micro_cache;
+
+    /* Set along with HANDLER_LAZY_MODULE; data is NULL until the module
+     * instance is created. */
+    struct lwan_lazy_module *lazy;
+
+    /* Set with coro_stack_stats; shared by maps with the same prefix. */
+    struct lwan_stack_usage *stack_usage;
+
+    /* Prepares requests as asked by flags; picked for them when the map
+     * is added. */
+    lwan_url_map_prepare_func prepare;
+};
+
+enum lwan_scheduling_policy {
+    SCHEDULE_BY_FD = 0,
+    SCHEDULE_LEAST_LOADED,
+    SCHEDULE_POWER_OF_TWO_CHOICES,
+};
+
+struct timer_wheel;
+struct header_cache;
+struct constant_response_cache;
+
+struct lwan_busy_poll_stats {
+    unsigned long long spin_ns;     /* Time spent polling without sleeping */
+    unsigned long long spin_hits;   /* Events found while spinning */
+    unsigned long long spin_misses; /* Budget ran out; went to sleep */
+};
+
+/* Request durations are counted in buckets, whose upper bounds are given
+ * by lwan_metrics_latency_bounds_us[]; the last one has no upper bound. */
+#define LWAN_METRICS_LATENCY_BUCKETS 15
+
+extern const unsigned int
+    lwan_metrics_latency_bounds_us[LWAN_METRICS_LATENCY_BUCKETS - 1];
+
+/* With coro_stack_stats, the stack used by requests is counted, for each
+ * prefix, in buckets bounded by lwan_metrics_stack_bounds[] (in bytes). */
+#define LWAN_METRICS_STACK_BUCKETS 9
+
+extern const unsigned int
+    lwan_metrics_stack_bounds[LWAN_METRICS_STACK_BUCKETS - 1];
+
+struct lwan_stack_usage {
+    struct lwan_stack_usage *next;
+    char *prefix;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[LWAN_METRICS_STACK_BUCKETS];
+};
+
+struct lwan_thread_metrics {
+    unsigned long long connections_accepted;
+    unsigned long long connections_timed_out;
+    unsigned long long connections_shed;
+    unsigned long long requests;
+    unsigned long long bytes_sent;
+    /* Indexed by status code / 100. */
+    unsigned long long responses[6];
+    /* Only updated once request durations are being measured. */
+    unsigned long long latency_sum_ns;
+    unsigned long long latency[LWAN_METRICS_LATENCY_BUCKETS];
 };
 
 struct lwan_thread {
     struct lwan *lwan;
+    struct timer_wheel *wheel;
+    struct header_cache *header_cache;
+    struct constant_response_cache *constant_responses;
+    int cpu;
     struct {
         char date[30];
         char expires[30];
@@ -354,8 +503,59 @@ struct lwan_thread {
     } date;
 
     int epoll_fd;
-    int pipe_fd[2];
+    int wakeup_fd[2];
+    int listen_fd;
     pthread_t self;
+    long tid;
+
+    /* File descriptors handed off by lwan_thread_queue_client().  The
+     * wakeup file descriptor is only signaled when n_pending goes up from
+     * 0.  n_queued are those not accounted for in n_pending yet; it's only
+     * used by the thread accepting connections. */
+    struct mpsc_queue pending_fds;
+    int n_pending;
+    int n_queued;
+
+    /* Number of connections in this thread's death queue.  Only written
+     * to by the thread itself; read by the scheduler. */
+    unsigned int n_connections;
+
+    /* A spare pipe for splice(), lent to one coroutine at a time; -1 if
+     * there's none. */
+    int splice_pipe[2];
+
+    /* Socket I/O is submitted through this ring when built with io_uring
+     * support and the kernel allows it; NULL otherwise. */
+    struct lwan_uring *uring;
+
+    /* The connection whose coroutine is running, or NULL while in the
+     * scheduler; read by the sampling profiler's signal handler. */
+    struct lwan_connection *running_conn;
+
+    /* Only written to by the thread itself. */
+    struct lwan_busy_poll_stats busy_poll;
+
+    /* NULL unless requests are being logged; see lwan-access-log.h. */
+    struct lwan_access_log_ring *access_log;
+
+    /* Allocated on first use; see lwan-deflate.h. */
+    struct lwan_deflate_pool *deflate_pool;
+
+    /* Likewise; see lwan-zerocopy.h. */
+    struct lwan_zerocopy *zerocopy;
+
+    /* Free LARGE_REQUEST_BUFFER_SIZE buffers, linked through their first
+     * bytes. */
+    void *large_request_buffers;
+    unsigned int n_large_request_buffers;
+
+    /* Tables of references to hot entries of the caches used by this
+     * thread; see cache_sweep_fronts(). */
+    struct cache_front *cache_fronts;
+    bool holds_cache_refs;
+
+    /* Likewise; in its own cache line, as it's updated on every request. */
+    struct lwan_thread_metrics metrics __attribute__((aligned(64)));
 };
 
 struct lwan_straitjacket {
@@ -367,30 +567,80 @@ struct lwan_config {
     char *listener;
     char *error_template;
     char *config_file_path;
+    char *cpu_affinity;
+    char *tls_certificate;
+    char *tls_private_key;
+    char *access_log;
     size_t max_post_data_size;
+    size_t compress_min_size;
+    size_t zerocopy_min_size;
     unsigned short keep_alive_timeout;
+    unsigned int websocket_timeout;
+    unsigned int request_header_timeout;
+    unsigned int request_body_timeout;
+    unsigned int write_timeout;
+    unsigned int min_transfer_rate;
     unsigned int expires;
+    unsigned int busy_poll;
+    unsigned int tcp_fastopen;
+    unsigned int tcp_defer_accept;
+    unsigned int module_idle_timeout;
     unsigned short n_threads;
+    unsigned short coro_pool_size;
+    unsigned short overload_threshold;
+    enum lwan_scheduling_policy scheduling_policy;
     bool quiet;
     bool reuse_port;
     bool proxy_protocol;
     bool allow_cors;
     bool allow_post_temp_file;
+    bool numa_local_connections;
+    bool http2;
+    bool edge_triggered_epoll;
+    bool coro_stack_stats;
+    bool lazy_modules;
 };
 
+struct lwan_vhosts;
+
 struct lwan {
     struct lwan_trie url_map_trie;
+    /* NULL if the listener has no virtual hosts. */
+    struct lwan_vhosts *vhosts;
     struct lwan_connection *conns;
+    size_t n_conns;
+
+    /* One for each prefix, with coro_stack_stats. */
+    struct lwan_stack_usage *stack_usage;
 
     struct {
         pthread_barrier_t barrier;
         struct lwan_thread *threads;
+        unsigned short (*schedule)(struct lwan *l, int fd);
         unsigned int max_fd;
         unsigned short count;
     } thread;
 
     struct lwan_config config;
     int main_socket;
+
+    /* Set if the listener speaks TLS. */
+    struct lwan_tls *tls;
+
+    /* Applied to every request, before its headers are parsed; NULL if
+     * there's no server-wide rate limit. */
+    struct lwan_rate_limit *rate_limit;
+
+    /* Background writer for the access log, if there's one. */
+    struct lwan_access_log *access_log;
+
+    /* Timing requests costs a couple of clock reads each, so it's only
+     * done after the metrics endpoint has been scraped at least once. */
+    bool measure_latency;
+
+    /* Set once another process took over the listening socket: responses
+     * stop keeping connections alive so that they can be drained. */
+    bool draining;
 };
 
 void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map);
@@ -402,11 +652,38 @@ size_t lwan_prepare_response_header(struct lwan_request *request, enum lwan_http
     __attribute__((warn_unused_result));
 
 const char *lwan_request_get_post_param(struct lwan_request *request, const char *key)
-    __attribute__((warn_unused_result, pure));
+    __attribute__((warn_unused_result));
 const char *lwan_request_get_query_param(struct lwan_request *request, const char *key)
-    __attribute__((warn_unused_result, pure));
+    __attribute__((warn_unused_result));
 const char * lwan_request_get_cookie(struct lwan_request *request, const char *key)
-    __attribute__((warn_unused_result, pure));
+    __attribute__((warn_unused_result));
+
+/* For handlers with HANDLER_STREAM_POST_DATA: the request body isn't read
+ * beforehand, but pulled by the handler with one of these.  Both return
+ * the number of bytes moved (0 once the body has been consumed), or a
+ * negative errno value.  */
+ssize_t lwan_request_read_body(struct lwan_request *request, void *buf, size_t count)
+    __attribute__((warn_unused_result));
+ssize_t lwan_request_splice_body(struct lwan_request *request, int fd)
+    __attribute__((warn_unused_result));
+
+/* NULL-terminated arrays, sorted by key; NULL if there's nothing to return. */
+const struct lwan_key_value *lwan_request_get_post_params(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+const struct lwan_key_value *lwan_request_get_query_params(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+const struct lwan_key_value *lwan_request_get_cookies(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+
+/* For bodies with a Content-Type of application/json (see lwan-json.h);
+ * NULL if there's no such body or it isn't valid.  The first parses the
+ * whole body once, in place; the second only parses the value at path,
+ * unless the whole body has already been parsed. */
+const struct lwan_json *lwan_request_get_json_body(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+const struct lwan_json *lwan_request_find_json(struct lwan_request *request,
+                                               const char *const path[])
+    __attribute__((warn_unused_result));
 
 bool lwan_response_set_chunked(struct lwan_request *request, enum lwan_http_status status);
 void lwan_response_send_chunk(struct lwan_request *request);
@@ -414,6 +691,25 @@ void lwan_response_send_chunk(struct lwan_request *request);
 bool lwan_response_set_event_stream(struct lwan_request *request, enum lwan_http_status status);
 void lwan_response_send_event(struct lwan_request *request, const char *event);
 
+/* WebSockets (RFC 6455).  Once the upgrade succeeds, messages are read into
+ * and written from the response buffer; reading yields to the I/O loop
+ * until a whole message arrives, and answers pings on its own.  Reads
+ * return 0, or ENOTCONN once the connection has been closed; handlers for
+ * clients that just go away aren't resumed, so clean up with coro_defer().
+ * Handlers should return HTTP_SWITCHING_PROTOCOLS when they're done.  */
+enum lwan_http_status lwan_request_websocket_upgrade(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+void lwan_response_websocket_write_text(struct lwan_request *request);
+void lwan_response_websocket_write_binary(struct lwan_request *request);
+int lwan_response_websocket_read(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+
+void lwan_request_sleep(struct lwan_request *request, unsigned int ms);
+bool lwan_request_await_read(struct lwan_request *request, int fd,
+                             unsigned int timeout_ms);
+bool lwan_request_await_write(struct lwan_request *request, int fd,
+                              unsigned int timeout_ms);
+
 const char *lwan_http_status_as_string(enum lwan_http_status status)
     __attribute__((const)) __attribute__((warn_unused_result));
 const char *lwan_http_status_as_string_with_code(enum lwan_http_status status)
@@ -431,6 +727,11 @@ void lwan_straitjacket_enforce(const struct lwan_straitjacket *sj);
 
 const struct lwan_config *lwan_get_default_config(void);
 
+/* Sum of the counters of all I/O threads. */
+void lwan_get_busy_poll_stats(const struct lwan *l,
+                              struct lwan_busy_poll_stats *stats);
+void lwan_get_metrics(const struct lwan *l, struct lwan_thread_metrics *metrics);
+
 int lwan_connection_get_fd(const struct lwan *lwan, const struct lwan_connection *conn)
     __attribute__((pure)) __attribute__((warn_unused_result));
 
@@ -438,6 +739,9 @@ const char *lwan_request_get_remote_address(struct lwan_request *request,
             char buffer[ENFORCE_STATIC_BUFFER_LENGTH INET6_ADDRSTRLEN])
     __attribute__((warn_unused_result));
 
+int lwan_request_get_accept_encoding_qvalue(struct lwan_request *request,
+                                            enum lwan_request_flags encoding);
+
 int lwan_format_rfc_time(const time_t in, char out[ENFORCE_STATIC_BUFFER_LENGTH 30]);
 int lwan_parse_rfc_time(const char in[ENFORCE_STATIC_BUFFER_LENGTH 30], time_t *out);
 
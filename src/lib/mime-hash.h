@@ -0,0 +1,63 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared by mimegen, which builds the perfect hash table for MIME types,
+ * and lwan-tables.c, which looks extensions up in it: FNV-1a followed by
+ * the MurmurHash3 finalizer, so that both halves of the result are usable
+ * on their own.  Extensions are hashed after being lowercased. */
+static inline uint64_t mime_hash_extension(const char *ext, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)ext[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/* The topmost bits pick the bucket; picking it from the bits that also
+ * feed mime_hash_slot() would make every key in a bucket share the low
+ * bits of its slot, regardless of the displacement. */
+static inline uint32_t mime_hash_bucket(uint64_t hash, uint32_t n_buckets)
+{
+    return (uint32_t)(hash >> 48) & (n_buckets - 1);
+}
+
+/* The bucket's displacement then picks the slot. */
+static inline uint32_t
+mime_hash_slot(uint64_t hash, uint32_t displacement, uint32_t table_size)
+{
+    uint32_t lo = (uint32_t)hash;
+    uint32_t hi = (uint32_t)(hash >> 32) | 1;
+
+    return (lo + displacement * hi) & (table_size - 1);
+}
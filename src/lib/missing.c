@@ -96,6 +96,15 @@ mempcpy(void *dest, const void *src, size_t len)
 }
 #endif
 
+#ifndef HAS_EXPLICIT_BZERO
+void explicit_bzero(void *s, size_t n)
+{
+    memset(s, 0, n);
+    /* Keeps the compiler from assuming the memset() is a dead store. */
+    __asm__ __volatile__("" : : "r"(s) : "memory");
+}
+#endif
+
 #ifndef HAS_MEMRCHR
 void *
 memrchr(const void *s, int c, size_t n)
@@ -573,6 +582,16 @@ ssize_t readahead(int fd __attribute__((unused)),
 }
 #endif
 
+#if !defined(HAS_POSIX_FADVISE)
+int posix_fadvise(int fd __attribute__((unused)),
+                  off_t offset __attribute__((unused)),
+                  off_t len __attribute__((unused)),
+                  int advice __attribute__((unused)))
+{
+    return 0;
+}
+#endif
+
 #if !defined(HAS_GET_CURRENT_DIR_NAME)
 #include <limits.h>
 
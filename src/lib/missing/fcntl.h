@@ -58,4 +58,17 @@
 ssize_t readahead(int fd, off_t offset, size_t count);
 #endif
 
+#ifndef HAS_POSIX_FADVISE
+#include <sys/types.h>
+
+#define POSIX_FADV_NORMAL 0
+#define POSIX_FADV_RANDOM 1
+#define POSIX_FADV_SEQUENTIAL 2
+#define POSIX_FADV_WILLNEED 3
+#define POSIX_FADV_DONTNEED 4
+#define POSIX_FADV_NOREUSE 5
+
+int posix_fadvise(int fd, off_t offset, off_t len, int advice);
+#endif
+
 #endif /* MISSING_FCNTL_H */
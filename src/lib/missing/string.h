@@ -61,6 +61,10 @@ void *mempcpy(void *dest, const void *src, size_t len);
 void *memrchr(const void *s, int c, size_t n);
 #endif
 
+#ifndef HAS_EXPLICIT_BZERO
+void explicit_bzero(void *s, size_t n);
+#endif
+
 static inline int
 streq(const char *a, const char *b)
 {
@@ -26,4 +26,8 @@
 #define MAP_HUGETLB 0
 #endif
 
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
 #endif /* _MISSING_MMAN_H_ */
@@ -0,0 +1,106 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+
+#include "lwan.h"
+#include "queue.h"
+
+static size_t next_power_of_two(size_t n)
+{
+    size_t p = 1;
+
+    while (p < n)
+        p <<= 1;
+
+    return p;
+}
+
+int mpsc_queue_init(struct mpsc_queue *q, size_t size)
+{
+    if (UNLIKELY(size < 2))
+        return -EINVAL;
+
+    size = next_power_of_two(size);
+
+    q->cells = calloc(size, sizeof(*q->cells));
+    if (UNLIKELY(!q->cells))
+        return -ENOMEM;
+
+    for (size_t i = 0; i < size; i++)
+        q->cells[i].sequence = i;
+
+    q->mask = size - 1;
+    q->head = q->tail = 0;
+
+    return 0;
+}
+
+void mpsc_queue_free(struct mpsc_queue *q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+bool mpsc_queue_push(struct mpsc_queue *q, int value)
+{
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct mpsc_queue_cell *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* Queue is full. */
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->value = value;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+bool mpsc_queue_pop(struct mpsc_queue *q, int *value)
+{
+    struct mpsc_queue_cell *cell = &q->cells[q->head & q->mask];
+    size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+    if (seq != q->head + 1)
+        return false;
+
+    *value = cell->value;
+    __atomic_store_n(&cell->sequence, q->head + q->mask + 1, __ATOMIC_RELEASE);
+    q->head++;
+
+    return true;
+}
@@ -0,0 +1,47 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bounded multiple-producer, single-consumer ring of ints, based on
+ * Dmitry Vyukov's bounded queue.  Producers only contend on the tail
+ * index; the consumer never uses atomic read-modify-write operations. */
+
+struct mpsc_queue_cell {
+    size_t sequence;
+    int value;
+};
+
+struct mpsc_queue {
+    struct mpsc_queue_cell *cells;
+    size_t mask;
+
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+};
+
+int mpsc_queue_init(struct mpsc_queue *q, size_t size);
+void mpsc_queue_free(struct mpsc_queue *q);
+
+bool mpsc_queue_push(struct mpsc_queue *q, int value);
+bool mpsc_queue_pop(struct mpsc_queue *q, int *value);
@@ -0,0 +1,129 @@
+/*
+ * SHA-1, as described in FIPS 180-4.
+ * This file is placed in the public domain.
+ */
+
+#include <string.h>
+
+#include "sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_transform(uint32_t state[5],
+                           const unsigned char block[SHA1_BLOCK_LENGTH])
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    }
+    for (; i < 80; i++)
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (i = 0; i < 80; i++) {
+        uint32_t f, k, t;
+
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        t = ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void sha1_init(struct sha1_ctx *ctx)
+{
+    static const uint32_t initial_state[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+    };
+
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->count = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t used = (size_t)(ctx->count % SHA1_BLOCK_LENGTH);
+
+    ctx->count += len;
+
+    if (used) {
+        size_t fill = SHA1_BLOCK_LENGTH - used;
+
+        if (len < fill) {
+            memcpy(ctx->buffer + used, p, len);
+            return;
+        }
+
+        memcpy(ctx->buffer + used, p, fill);
+        sha1_transform(ctx->state, ctx->buffer);
+        p += fill;
+        len -= fill;
+    }
+
+    for (; len >= SHA1_BLOCK_LENGTH; len -= SHA1_BLOCK_LENGTH) {
+        sha1_transform(ctx->state, p);
+        p += SHA1_BLOCK_LENGTH;
+    }
+
+    memcpy(ctx->buffer, p, len);
+}
+
+void sha1_final(struct sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_LENGTH])
+{
+    uint64_t bits = ctx->count * 8;
+    size_t used = (size_t)(ctx->count % SHA1_BLOCK_LENGTH);
+    int i;
+
+    ctx->buffer[used++] = 0x80;
+    if (used > SHA1_BLOCK_LENGTH - 8) {
+        memset(ctx->buffer + used, 0, SHA1_BLOCK_LENGTH - used);
+        sha1_transform(ctx->state, ctx->buffer);
+        used = 0;
+    }
+    memset(ctx->buffer + used, 0, SHA1_BLOCK_LENGTH - 8 - used);
+
+    for (i = 0; i < 8; i++)
+        ctx->buffer[SHA1_BLOCK_LENGTH - 1 - i] = (unsigned char)(bits >> (i * 8));
+    sha1_transform(ctx->state, ctx->buffer);
+
+    for (i = 0; i < 5; i++) {
+        digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+}
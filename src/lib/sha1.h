@@ -0,0 +1,24 @@
+/*
+ * SHA-1, as described in FIPS 180-4.
+ * This file is placed in the public domain.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LENGTH 20
+#define SHA1_BLOCK_LENGTH 64
+
+/* Only used for the WebSocket handshake, where collisions don't matter;
+ * don't use it for anything else. */
+struct sha1_ctx {
+    uint32_t state[5];
+    uint64_t count;
+    unsigned char buffer[SHA1_BLOCK_LENGTH];
+};
+
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+void sha1_final(struct sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_LENGTH]);
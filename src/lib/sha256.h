@@ -0,0 +1,23 @@
+/*
+ * SHA-256, as described in FIPS 180-4.
+ * This file is placed in the public domain.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA256_BLOCK_LENGTH 64
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t count;
+    unsigned char buffer[SHA256_BLOCK_LENGTH];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx,
+                  unsigned char digest[SHA256_DIGEST_LENGTH]);
@@ -22,33 +22,34 @@
 
 #define _DEFAULT_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sqlite3.h>
 
 #include "lwan.h"
 #include "lwan-cache.h"
 #include "lwan-mod-serve-files.h"
 #include "lwan-template.h"
 
+#include "ipdb-index.h"
+
 /* Set to 0 to disable */
 #define QUERIES_PER_HOUR 10000
 
 struct ip_info {
-    struct cache_entry base;
     struct {
-        char *code;
-        char *name;
+        const char *code;
+        const char *name;
     } country, region;
     struct {
-        char *name;
-        char *zip_code;
+        const char *name;
+        const char *zip_code;
     } city;
     double latitude, longitude;
     struct {
-        char *code, *area;
+        const char *code, *area;
     } metro;
-    char *ip;
+    const char *ip;
     const char *callback;
 };
 
@@ -120,25 +121,6 @@ static const char csv_template_str[] = \
     "\"{{metro.area}}\"";
 
 
-static const char ip_to_city_query[] = \
-    "SELECT " \
-    "   city_location.country_code, country_blocks.country_name," \
-    "   city_location.region_code, region_names.region_name," \
-    "   city_location.city_name, city_location.postal_code," \
-    "   city_location.latitude, city_location.longitude," \
-    "   city_location.metro_code, city_location.area_code " \
-    "FROM city_blocks " \
-    "   NATURAL JOIN city_location " \
-    "   INNER JOIN country_blocks ON " \
-    "      city_location.country_code = country_blocks.country_code " \
-    "   INNER JOIN region_names ON " \
-    "      city_location.country_code = region_names.country_code " \
-    "      AND " \
-    "      city_location.region_code = region_names.region_code " \
-    "WHERE city_blocks.ip_start <= ? " \
-    "ORDER BY city_blocks.ip_start DESC LIMIT 1";
-
-
 union ip_to_octet {
     unsigned char octet[sizeof(in_addr_t)];
     in_addr_t ip;
@@ -184,8 +166,7 @@ struct query_limit {
 static struct cache *query_limit;
 #endif
 
-static struct cache *cache = NULL;
-static sqlite3 *db = NULL;
+static struct ipdb_index *ipdb;
 
 static bool
 net_contains_ip(const struct ip_net *net, in_addr_t ip)
@@ -208,92 +189,42 @@ is_reserved_ip(in_addr_t ip)
     return false;
 }
 
-static void
-destroy_ipinfo(struct cache_entry *entry,
-            void *context __attribute__((unused)))
-{
-    struct ip_info *ip_info = (struct ip_info *)entry;
-
-    if (!ip_info)
-        return;
-
-    free(ip_info->country.code);
-    free(ip_info->country.name);
-    free(ip_info->region.code);
-    free(ip_info->region.name);
-    free(ip_info->city.name);
-    free(ip_info->city.zip_code);
-    free(ip_info->metro.code);
-    free(ip_info->metro.area);
-    free(ip_info->ip);
-    free(ip_info);
-}
-
-static ALWAYS_INLINE char *
-text_column_helper(sqlite3_stmt *stmt, int ind)
-{
-    const unsigned char *value;
-
-    value = sqlite3_column_text(stmt, ind);
-    return value ? strdup((char *)value) : NULL;
-}
-
-static struct cache_entry *
-create_ipinfo(const char *key, void *context __attribute__((unused)))
+static bool
+lookup_ipinfo(const char *ip, struct ip_info *ip_info)
 {
-    sqlite3_stmt *stmt;
-    struct ip_info *ip_info = NULL;
+    const struct ipdb_record *record;
     struct in_addr addr;
 
-    if (UNLIKELY(!inet_aton(key, &addr)))
-        goto end_no_finalize;
+    if (UNLIKELY(!inet_aton(ip, &addr)))
+        return false;
 
     if (is_reserved_ip(addr.s_addr)) {
-        ip_info = calloc(1, sizeof(*ip_info));
-        if (LIKELY(ip_info)) {
-            ip_info->country.code = strdup("RD");
-            ip_info->country.name = strdup("Reserved");
-            ip_info->ip = strdup(key);
-        }
-        goto end_no_finalize;
+        *ip_info = (struct ip_info) {
+            .country = { .code = "RD", .name = "Reserved" },
+            .ip = ip,
+        };
+        return true;
     }
 
-    if (sqlite3_prepare(db, ip_to_city_query,
-                        sizeof(ip_to_city_query) - 1,
-                        &stmt, NULL) != SQLITE_OK)
-        goto end_no_finalize;
-
-    if (sqlite3_bind_int64(stmt, 1, ntohl(addr.s_addr)) != SQLITE_OK)
-        goto end;
-
-    if (sqlite3_step(stmt) != SQLITE_ROW)
-        goto end;
-
-    ip_info = malloc(sizeof(*ip_info));
-    if (!ip_info)
-        goto end;
+    record = ipdb_index_lookup(ipdb, ntohl(addr.s_addr));
+    if (UNLIKELY(!record))
+        return false;
 
-#define TEXT_COLUMN(index) text_column_helper(stmt, index)
+#define STRING(field) ipdb_index_string(ipdb, record, IPDB_ ## field)
 
-    ip_info->country.code = TEXT_COLUMN(0);
-    ip_info->country.name = TEXT_COLUMN(1);
-    ip_info->region.code = TEXT_COLUMN(2);
-    ip_info->region.name = TEXT_COLUMN(3);
-    ip_info->city.name = TEXT_COLUMN(4);
-    ip_info->city.zip_code = TEXT_COLUMN(5);
-    ip_info->latitude = sqlite3_column_double(stmt, 6);
-    ip_info->longitude = sqlite3_column_double(stmt, 7);
-    ip_info->metro.code = TEXT_COLUMN(8);
-    ip_info->metro.area = TEXT_COLUMN(9);
-
-#undef TEXT_COLUMN
+    *ip_info = (struct ip_info) {
+        .country = { .code = STRING(COUNTRY_CODE), .name = STRING(COUNTRY_NAME) },
+        .region = { .code = STRING(REGION_CODE), .name = STRING(REGION_NAME) },
+        .city = { .name = STRING(CITY_NAME), .zip_code = STRING(ZIP_CODE) },
+        .latitude = record->latitude,
+        .longitude = record->longitude,
+        .metro = { .code = STRING(METRO_CODE), .area = STRING(AREA_CODE) },
+        .ip = ip,
+    };
 
-    ip_info->ip = strdup(key);
+#undef STRING
 
-end:
-    sqlite3_finalize(stmt);
-end_no_finalize:
-    return (struct cache_entry *)ip_info;
+    return true;
 }
 
 #if QUERIES_PER_HOUR != 0
@@ -302,8 +233,10 @@ create_query_limit(const char *key __attribute__((unused)),
             void *context __attribute__((unused)))
 {
     struct query_limit *entry = malloc(sizeof(*entry));
-    if (LIKELY(entry))
+    if (LIKELY(entry)) {
+        entry->base.size = sizeof(*entry);
         entry->queries = 0;
+    }
     return (struct cache_entry *)entry;
 }
 
@@ -315,8 +248,9 @@ destroy_query_limit(struct cache_entry *entry,
 }
 #endif
 
-static struct ip_info *
-internal_query(struct lwan_request *request, const char *ip_address)
+static bool
+internal_query(struct lwan_request *request, const char *ip_address,
+               struct ip_info *info)
 {
     const char *query;
 
@@ -327,10 +261,9 @@ internal_query(struct lwan_request *request, const char *ip_address)
     else
         query = request->url.value;
     if (UNLIKELY(!query))
-        return NULL;
+        return false;
 
-    return (struct ip_info *)cache_coro_get_and_ref_entry(cache,
-                request->conn->coro, query);
+    return lookup_ipinfo(query, info);
 }
 
 #if QUERIES_PER_HOUR != 0
@@ -342,8 +275,11 @@ static bool is_rate_limited(const char *ip_address)
 
     limit = (struct query_limit *)
                 cache_get_and_ref_entry(query_limit, ip_address, &error);
-    if (!limit)
-        return true;
+    if (!limit) {
+        /* Someone else is creating the entry for this address: this is
+         * one of its first queries. */
+        return error != EINPROGRESS;
+    }
 
     limited = ATOMIC_AAF(&limit->queries, 1) > QUERIES_PER_HOUR;
     cache_entry_unref(query_limit, &limit->base);
@@ -356,7 +292,7 @@ LWAN_HANDLER(templated_output)
 {
     const struct template_mime *tm = data;
     const char *ip_address;
-    struct ip_info *info;
+    struct ip_info info;
     char ip_address_buf[INET6_ADDRSTRLEN];
 
     ip_address = lwan_request_get_remote_address(request, ip_address_buf);
@@ -368,16 +304,12 @@ LWAN_HANDLER(templated_output)
         return HTTP_FORBIDDEN;
 #endif
 
-    info = internal_query(request, ip_address);
-    if (UNLIKELY(!info))
+    if (UNLIKELY(!internal_query(request, ip_address, &info)))
         return HTTP_NOT_FOUND;
 
-    const char *callback = lwan_request_get_query_param(request, "callback");
-    struct ip_info info_with_callback = *info;
-    info_with_callback.callback = callback;
+    info.callback = lwan_request_get_query_param(request, "callback");
 
-    lwan_tpl_apply_with_buffer(tm->tpl, response->buffer,
-                &info_with_callback);
+    lwan_tpl_apply_with_buffer(tm->tpl, response->buffer, &info);
     response->mime_type = tm->mime_type;
 
     return HTTP_OK;
@@ -410,12 +342,10 @@ main(void)
     struct template_mime xml_tpl = compile_template(xml_template_str,
         "text/plain; charset=UTF-8");
 
-    int result = sqlite3_open_v2("./db/ipdb.sqlite", &db,
-                                 SQLITE_OPEN_READONLY, NULL);
-    if (result != SQLITE_OK)
-        lwan_status_critical("Could not open database: %s",
-                    sqlite3_errmsg(db));
-    cache = cache_create(create_ipinfo, destroy_ipinfo, NULL, 10);
+    /* Built from ./db/ipdb.sqlite by freegeoip-mkindex. */
+    ipdb = ipdb_index_open("./db/ipdb.index");
+    if (!ipdb)
+        lwan_status_critical_perror("Could not open ./db/ipdb.index");
 
 #if QUERIES_PER_HOUR != 0
     lwan_status_info("Limiting to %d queries per hour per client",
@@ -450,8 +380,7 @@ main(void)
 #if QUERIES_PER_HOUR != 0
     cache_destroy(query_limit);
 #endif
-    cache_destroy(cache);
-    sqlite3_close(db);
+    ipdb_index_close(ipdb);
 
     return 0;
 }
@@ -0,0 +1,170 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lwan.h"
+#include "ipdb-index.h"
+
+struct ipdb_index {
+    void *map;
+    size_t map_size;
+
+    size_t n_ranges;
+    uint32_t last_record;
+    const uint32_t *starts;
+    const uint32_t *preceding;
+    const struct ipdb_record *records;
+    const char *strings;
+    uint32_t strings_size;
+};
+
+static bool validate(const struct ipdb_index *index, uint32_t n_records)
+{
+    for (size_t i = 1; i <= index->n_ranges; i++) {
+        if (index->preceding[i] != IPDB_NO_RECORD &&
+            index->preceding[i] >= n_records)
+            return false;
+    }
+    if (index->last_record != IPDB_NO_RECORD &&
+        index->last_record >= n_records)
+        return false;
+
+    for (uint32_t i = 0; i < n_records; i++) {
+        for (int field = 0; field < IPDB_N_FIELDS; field++) {
+            if (index->records[i].strings[field] >= index->strings_size)
+                return false;
+        }
+    }
+
+    return index->strings[index->strings_size - 1] == '\0';
+}
+
+struct ipdb_index *ipdb_index_open(const char *path)
+{
+    const struct ipdb_index_header *header;
+    struct ipdb_index *index;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0)
+        goto close_fd;
+    if ((size_t)st.st_size < sizeof(*header)) {
+        errno = EINVAL;
+        goto close_fd;
+    }
+
+    index = malloc(sizeof(*index));
+    if (!index)
+        goto close_fd;
+
+    index->map_size = (size_t)st.st_size;
+    index->map = mmap(NULL, index->map_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                      fd, 0);
+    if (index->map == MAP_FAILED)
+        goto free_index;
+    close(fd);
+
+    header = index->map;
+    if (memcmp(header->magic, IPDB_INDEX_MAGIC, sizeof(header->magic)))
+        goto invalid;
+
+    size = sizeof(*header) +
+           2 * ((size_t)header->n_ranges + 1) * sizeof(uint32_t) +
+           (size_t)header->n_records * sizeof(struct ipdb_record) +
+           header->strings_size;
+    if (size != index->map_size || !header->strings_size)
+        goto invalid;
+
+    index->n_ranges = header->n_ranges;
+    index->last_record = header->last_record;
+    index->starts = (const uint32_t *)(header + 1);
+    index->preceding = index->starts + index->n_ranges + 1;
+    index->records =
+        (const struct ipdb_record *)(index->preceding + index->n_ranges + 1);
+    index->strings = (const char *)(index->records + header->n_records);
+    index->strings_size = header->strings_size;
+
+    if (!validate(index, header->n_records))
+        goto invalid;
+
+    return index;
+
+invalid:
+    munmap(index->map, index->map_size);
+    free(index);
+    errno = EINVAL;
+    return NULL;
+free_index:
+    free(index);
+close_fd:
+    close(fd);
+    return NULL;
+}
+
+void ipdb_index_close(struct ipdb_index *index)
+{
+    if (index) {
+        munmap(index->map, index->map_size);
+        free(index);
+    }
+}
+
+const struct ipdb_record *ipdb_index_lookup(const struct ipdb_index *index,
+                                            uint32_t address)
+{
+    const uint32_t *starts = index->starts;
+    size_t k = 1;
+    uint32_t record;
+
+    /* Finds the first range starting after address.  Children of slot k
+     * are at 2k and 2k+1, so the slots a few levels down are contiguous
+     * and can be prefetched well before they're needed. */
+    while (k <= index->n_ranges) {
+        __builtin_prefetch(starts + k * 16);
+        k = 2 * k + (starts[k] <= address);
+    }
+    k >>= __builtin_ffsl((long)~k);
+
+    /* The range that matters is the one right before that. */
+    record = k ? index->preceding[k] : index->last_record;
+    if (record == IPDB_NO_RECORD)
+        return NULL;
+
+    return &index->records[record];
+}
+
+const char *ipdb_index_string(const struct ipdb_index *index,
+                              const struct ipdb_record *record,
+                              enum ipdb_field field)
+{
+    return index->strings + record->strings[field];
+}
@@ -0,0 +1,82 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Index of IPv4 ranges built from the SQLite database by freegeoip-mkindex,
+ * and mapped into memory by freegeoip.  Everything is in native byte
+ * order, and laid out so that it can be used straight from the mapping:
+ *
+ *   struct ipdb_index_header
+ *   uint32_t starts[n_ranges + 1]       first address of each range, in
+ *                                       Eytzinger order (from index 1)
+ *   uint32_t preceding[n_ranges + 1]    record of the range right before
+ *                                       the one in the same slot of starts
+ *   struct ipdb_record records[n_records]
+ *   char strings[strings_size]          NUL-terminated, each stored once
+ *
+ * Ranges are identified by their first address only; an address belongs
+ * to the last range starting at or before it.
+ */
+
+#define IPDB_INDEX_MAGIC "LWANGEO1"
+#define IPDB_NO_RECORD UINT32_MAX
+
+struct ipdb_index_header {
+    char magic[8];
+    uint32_t n_ranges;
+    uint32_t n_records;
+    uint32_t strings_size;
+    /* Record for addresses past the start of the last range. */
+    uint32_t last_record;
+    uint32_t pad[2];
+};
+
+enum ipdb_field {
+    IPDB_COUNTRY_CODE,
+    IPDB_COUNTRY_NAME,
+    IPDB_REGION_CODE,
+    IPDB_REGION_NAME,
+    IPDB_CITY_NAME,
+    IPDB_ZIP_CODE,
+    IPDB_METRO_CODE,
+    IPDB_AREA_CODE,
+    IPDB_N_FIELDS
+};
+
+struct ipdb_record {
+    /* Offsets into the string table. */
+    uint32_t strings[IPDB_N_FIELDS];
+    double latitude, longitude;
+};
+
+struct ipdb_index;
+
+struct ipdb_index *ipdb_index_open(const char *path);
+void ipdb_index_close(struct ipdb_index *index);
+
+/* Returns NULL if the address comes before every range. */
+const struct ipdb_record *ipdb_index_lookup(const struct ipdb_index *index,
+                                            uint32_t address);
+const char *ipdb_index_string(const struct ipdb_index *index,
+                              const struct ipdb_record *record,
+                              enum ipdb_field field);
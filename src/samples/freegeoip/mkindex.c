@@ -0,0 +1,285 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Builds the index used by freegeoip (see ipdb-index.h) from the
+ * SQLite database. */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "lwan.h"
+#include "hash.h"
+#include "ipdb-index.h"
+
+static const char ranges_query[] = \
+    "SELECT " \
+    "   city_blocks.ip_start," \
+    "   city_location.country_code, country_blocks.country_name," \
+    "   city_location.region_code, region_names.region_name," \
+    "   city_location.city_name, city_location.postal_code," \
+    "   city_location.metro_code, city_location.area_code," \
+    "   city_location.latitude, city_location.longitude " \
+    "FROM city_blocks " \
+    "   NATURAL JOIN city_location " \
+    "   INNER JOIN country_blocks ON " \
+    "      city_location.country_code = country_blocks.country_code " \
+    "   INNER JOIN region_names ON " \
+    "      city_location.country_code = region_names.country_code " \
+    "      AND " \
+    "      city_location.region_code = region_names.region_code " \
+    "ORDER BY city_blocks.ip_start";
+
+struct buffer {
+    void *data;
+    size_t used, allocated;
+};
+
+static void *buffer_append(struct buffer *buf, const void *data, size_t len)
+{
+    if (buf->used + len > buf->allocated) {
+        size_t allocated = buf->allocated ? buf->allocated : 4096;
+
+        while (allocated < buf->used + len)
+            allocated *= 2;
+
+        buf->data = realloc(buf->data, allocated);
+        if (!buf->data)
+            lwan_status_critical("Could not allocate memory");
+        buf->allocated = allocated;
+    }
+
+    void *ptr = (char *)buf->data + buf->used;
+    memcpy(ptr, data, len);
+    buf->used += len;
+    return ptr;
+}
+
+struct builder {
+    struct buffer starts, range_records, records, strings;
+    struct hash *interned_strings, *interned_records;
+};
+
+/* Values in the hash tables are indices plus one, as NULL means "not
+ * found". */
+static uint32_t intern_string(struct builder *builder, const char *str)
+{
+    uintptr_t offset;
+
+    if (!str)
+        str = "";
+
+    offset = (uintptr_t)hash_find(builder->interned_strings, str);
+    if (offset)
+        return (uint32_t)(offset - 1);
+
+    offset = builder->strings.used;
+    buffer_append(&builder->strings, str, strlen(str) + 1);
+
+    char *key = strdup(str);
+    if (!key || hash_add(builder->interned_strings, key, (void *)(offset + 1)))
+        lwan_status_critical("Could not intern string");
+
+    return (uint32_t)offset;
+}
+
+static uint32_t intern_record(struct builder *builder,
+                              const struct ipdb_record *record)
+{
+    char *key;
+    uintptr_t index;
+
+    if (asprintf(&key, "%u %u %u %u %u %u %u %u %a %a", record->strings[0],
+                 record->strings[1], record->strings[2], record->strings[3],
+                 record->strings[4], record->strings[5], record->strings[6],
+                 record->strings[7], record->latitude, record->longitude) < 0)
+        lwan_status_critical("Could not allocate memory");
+
+    index = (uintptr_t)hash_find(builder->interned_records, key);
+    if (index) {
+        free(key);
+        return (uint32_t)(index - 1);
+    }
+
+    index = builder->records.used / sizeof(*record);
+    buffer_append(&builder->records, record, sizeof(*record));
+    if (hash_add(builder->interned_records, key, (void *)(index + 1)))
+        lwan_status_critical("Could not intern record");
+
+    return (uint32_t)index;
+}
+
+static void read_ranges(struct builder *builder, sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    if (sqlite3_prepare_v2(db, ranges_query, sizeof(ranges_query) - 1, &stmt,
+                           NULL) != SQLITE_OK)
+        lwan_status_critical("Could not prepare query: %s", sqlite3_errmsg(db));
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        sqlite3_int64 ip_start = sqlite3_column_int64(stmt, 0);
+        struct ipdb_record record = {
+            .latitude = sqlite3_column_double(stmt, 9),
+            .longitude = sqlite3_column_double(stmt, 10),
+        };
+
+        if (ip_start < 0 || ip_start > UINT32_MAX) {
+            lwan_status_warning("Ignoring range starting at %lld",
+                                (long long)ip_start);
+            continue;
+        }
+
+        for (int field = 0; field < IPDB_N_FIELDS; field++) {
+            record.strings[field] = intern_string(
+                builder, (const char *)sqlite3_column_text(stmt, field + 1));
+        }
+
+        uint32_t start = (uint32_t)ip_start;
+        uint32_t record_index = intern_record(builder, &record);
+        size_t n_ranges = builder->starts.used / sizeof(uint32_t);
+
+        /* With more than one range starting at the same address, the
+         * last one wins. */
+        if (n_ranges && ((uint32_t *)builder->starts.data)[n_ranges - 1] == start) {
+            ((uint32_t *)builder->range_records.data)[n_ranges - 1] =
+                record_index;
+            continue;
+        }
+
+        buffer_append(&builder->starts, &start, sizeof(start));
+        buffer_append(&builder->range_records, &record_index,
+                      sizeof(record_index));
+    }
+
+    if (ret != SQLITE_DONE)
+        lwan_status_critical("Could not read ranges: %s", sqlite3_errmsg(db));
+
+    sqlite3_finalize(stmt);
+}
+
+/* An in-order traversal of the implicit tree rooted at slot k visits
+ * slots in the same order as the sorted ranges. */
+static size_t eytzinger(const uint32_t *starts, const uint32_t *records,
+                        uint32_t *out_starts, uint32_t *out_preceding,
+                        size_t i, size_t k, size_t n)
+{
+    if (k <= n) {
+        i = eytzinger(starts, records, out_starts, out_preceding, i, 2 * k,
+                      n);
+        out_starts[k] = starts[i];
+        out_preceding[k] = i ? records[i - 1] : IPDB_NO_RECORD;
+        i++;
+        i = eytzinger(starts, records, out_starts, out_preceding, i,
+                      2 * k + 1, n);
+    }
+
+    return i;
+}
+
+static void write_index(const struct builder *builder, const char *path)
+{
+    const size_t n_ranges = builder->starts.used / sizeof(uint32_t);
+    const uint32_t *records = builder->range_records.data;
+    struct ipdb_index_header header = {
+        .magic = IPDB_INDEX_MAGIC,
+        .n_ranges = (uint32_t)n_ranges,
+        .n_records = (uint32_t)(builder->records.used / sizeof(struct ipdb_record)),
+        .strings_size = (uint32_t)builder->strings.used,
+        .last_record = n_ranges ? records[n_ranges - 1] : IPDB_NO_RECORD,
+    };
+    uint32_t *starts = calloc(n_ranges + 1, sizeof(uint32_t));
+    uint32_t *preceding = calloc(n_ranges + 1, sizeof(uint32_t));
+    char *tmp_path;
+    FILE *out;
+
+    if (!starts || !preceding)
+        lwan_status_critical("Could not allocate memory");
+
+    eytzinger(builder->starts.data, records, starts, preceding, 0, 1, n_ranges);
+
+    if (asprintf(&tmp_path, "%s.tmp", path) < 0)
+        lwan_status_critical("Could not allocate memory");
+
+    out = fopen(tmp_path, "wbe");
+    if (!out)
+        lwan_status_critical_perror("Could not create %s", tmp_path);
+
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(starts, sizeof(uint32_t), n_ranges + 1, out) != n_ranges + 1 ||
+        fwrite(preceding, sizeof(uint32_t), n_ranges + 1, out) != n_ranges + 1 ||
+        fwrite(builder->records.data, 1, builder->records.used, out) !=
+            builder->records.used ||
+        fwrite(builder->strings.data, 1, builder->strings.used, out) !=
+            builder->strings.used)
+        lwan_status_critical_perror("Could not write %s", tmp_path);
+
+    if (fclose(out))
+        lwan_status_critical_perror("Could not write %s", tmp_path);
+    if (rename(tmp_path, path) < 0)
+        lwan_status_critical_perror("Could not rename %s to %s", tmp_path, path);
+
+    lwan_status_info("Wrote %zu ranges, %u records and %u bytes of strings to %s",
+                     n_ranges, header.n_records, header.strings_size, path);
+
+    free(tmp_path);
+    free(starts);
+    free(preceding);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *db_path = argc > 1 ? argv[1] : "./db/ipdb.sqlite";
+    const char *index_path = argc > 2 ? argv[2] : "./db/ipdb.index";
+    struct builder builder = {};
+    sqlite3 *db;
+
+    if (argc > 3) {
+        fprintf(stderr, "Usage: %s [ipdb.sqlite] [ipdb.index]\n", argv[0]);
+        return 1;
+    }
+
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+        lwan_status_critical("Could not open database: %s", sqlite3_errmsg(db));
+
+    builder.interned_strings = hash_str_new(free, NULL);
+    builder.interned_records = hash_str_new(free, NULL);
+    if (!builder.interned_strings || !builder.interned_records)
+        lwan_status_critical("Could not allocate memory");
+
+    /* Offset 0 is the empty string, used for NULL columns too. */
+    intern_string(&builder, "");
+
+    read_ranges(&builder, db);
+    write_index(&builder, index_path);
+
+    hash_free(builder.interned_strings);
+    hash_free(builder.interned_records);
+    free(builder.starts.data);
+    free(builder.range_records.data);
+    free(builder.records.data);
+    free(builder.strings.data);
+    sqlite3_close(db);
+
+    return 0;
+}
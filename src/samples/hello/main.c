@@ -33,7 +33,11 @@ int
 main(void)
 {
     const struct lwan_url_map default_map[] = {
-        { .prefix = "/", .handler = LWAN_HANDLER_REF(hello_world) },
+        {
+            .prefix = "/",
+            .handler = LWAN_HANDLER_REF(hello_world),
+            .flags = HANDLER_CONSTANT_RESPONSE,
+        },
         { .prefix = NULL }
     };
     struct lwan l;
@@ -17,24 +17,100 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <errno.h>
 #include <mysql.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "database.h"
 
+/* Only a handful of different queries are ever made. */
+#define DB_STMT_CACHE_SIZE 8
+
+/* Connections a thread can have checked out at the same time; only
+ * drivers that wait for the server without blocking need more than one. */
+#define DB_POOL_MAX_PER_THREAD 16
+
+/* Used by non-blocking drivers when the server asks for no timeout. */
+#define DB_WAIT_TIMEOUT_MS 10000
+
 struct db_stmt {
     bool (*bind)(const struct db_stmt *stmt, struct db_row *rows, size_t n_rows);
     bool (*step)(const struct db_stmt *stmt, struct db_row *row);
+    void (*reset)(struct db_stmt *stmt);
     void (*finalize)(struct db_stmt *stmt);
 };
 
 struct db {
     void (*disconnect)(struct db *db);
     struct db_stmt *(*prepare)(const struct db *db, const char *sql, const size_t sql_len);
+
+    /* Statements prepared with db_prepare_stmt_cached(), keyed by the
+     * address of their SQL. */
+    struct {
+        const char *sql;
+        struct db_stmt *stmt;
+    } stmt_cache[DB_STMT_CACHE_SIZE];
+
+    struct {
+        db_wait_cb cb;
+        void *data;
+    } wait;
+
+    /* Set while waiting for the server: if whoever was waiting goes away
+     * in the meantime, the connection is in an unknown state. */
+    bool in_query;
+
+    /* Every connection in the same pool, and idle ones in this thread. */
+    struct db *pool_next;
+    struct db *pool_next_idle;
+};
+
+struct db_pool_thread {
+    struct db *idle;
+    unsigned int checked_out;
+    struct db_pool_thread *next;
+};
+
+struct db_pool {
+    struct db *(*connect)(void *data);
+    void *data;
+
+    pthread_key_t key;
+
+    pthread_mutex_t lock;
+    struct db *conns;
+    struct db_pool_thread *threads;
 };
 
+static void db_init(struct db *db)
+{
+    memset(db->stmt_cache, 0, sizeof(db->stmt_cache));
+    db->wait.cb = NULL;
+    db->wait.data = NULL;
+    db->in_query = false;
+    db->pool_next = NULL;
+    db->pool_next_idle = NULL;
+}
+
+#if defined(HAVE_MYSQL_NONBLOCK)
+/* Returns true if fd became ready before the timeout. */
+static bool db_wait(struct db *db, int fd, bool for_write,
+                    unsigned int timeout_ms)
+{
+    if (db->wait.cb)
+        return db->wait.cb(db->wait.data, fd, for_write, timeout_ms);
+
+    struct pollfd pfd = {.fd = fd, .events = for_write ? POLLOUT : POLLIN};
+    return poll(&pfd, 1, (int)timeout_ms) > 0;
+}
+#endif
+
 /* MySQL */
 
 struct db_mysql {
@@ -42,12 +118,50 @@ struct db_mysql {
     MYSQL *con;
 };
 
+#if defined(HAVE_MYSQL_NONBLOCK)
+/* Translates what the client library wants to wait for into a call to
+ * db_wait(), which will suspend the coroutine handling the request if
+ * one has been set with db_set_wait_cb(). */
+static int db_mysql_wait(struct db_mysql *db_mysql, int status)
+{
+    unsigned int timeout_ms = DB_WAIT_TIMEOUT_MS;
+
+    if (status & MYSQL_WAIT_TIMEOUT)
+        timeout_ms = mysql_get_timeout_value_ms(db_mysql->con);
+
+    if (db_wait(&db_mysql->base, mysql_get_socket(db_mysql->con),
+                status & MYSQL_WAIT_WRITE, timeout_ms))
+        return status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE);
+
+    return MYSQL_WAIT_TIMEOUT;
+}
+
+#define MYSQL_CALL(db_mysql_, ret_, func_, handle_, ...)                       \
+    do {                                                                       \
+        int status_ = func_##_start(&(ret_), handle_, ##__VA_ARGS__);          \
+        (db_mysql_)->base.in_query = true;                                     \
+        while (status_) {                                                      \
+            status_ = func_##_cont(&(ret_), handle_,                           \
+                                   db_mysql_wait((db_mysql_), status_));       \
+        }                                                                      \
+        (db_mysql_)->base.in_query = false;                                    \
+    } while (0)
+#else
+#define MYSQL_CALL(db_mysql_, ret_, func_, handle_, ...)                       \
+    do {                                                                       \
+        (void)(db_mysql_);                                                     \
+        (ret_) = func_(handle_, ##__VA_ARGS__);                                \
+    } while (0)
+#endif
+
 struct db_stmt_mysql {
     struct db_stmt base;
+    struct db_mysql *db;
     MYSQL_STMT *stmt;
     MYSQL_BIND *param_bind;
     MYSQL_BIND *result_bind;
     bool must_execute_again;
+    bool must_bind_result;
 };
 
 static bool db_stmt_bind_mysql(const struct db_stmt *stmt,
@@ -57,12 +171,13 @@ static bool db_stmt_bind_mysql(const struct db_stmt *stmt,
 
     stmt_mysql->must_execute_again = true;
 
+    /* mysql_stmt_execute() throws away whatever is left from the previous
+     * execution by itself; mysql_stmt_reset() would be another round trip
+     * to the server. */
     if (!stmt_mysql->param_bind) {
         stmt_mysql->param_bind = calloc(n_rows, sizeof(*stmt_mysql->param_bind));
         if (!stmt_mysql->param_bind)
             return false;
-    } else {
-        mysql_stmt_reset(stmt_mysql->stmt);
     }
 
     for (size_t row = 0; row < n_rows; row++) {
@@ -87,13 +202,21 @@ static bool db_stmt_step_mysql(const struct db_stmt *stmt, struct db_row *row)
 {
     struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
 
+    int ret;
+
     if (stmt_mysql->must_execute_again) {
         stmt_mysql->must_execute_again = false;
-        if (mysql_stmt_execute(stmt_mysql->stmt))
+
+        MYSQL_CALL(stmt_mysql->db, ret, mysql_stmt_execute, stmt_mysql->stmt);
+        if (ret)
             return false;
+
+        /* Statements outlive requests, so results are bound again on
+         * each execution: buffers from a previous one might be gone. */
+        stmt_mysql->must_bind_result = true;
     }
 
-    if (!stmt_mysql->result_bind) {
+    if (stmt_mysql->must_bind_result) {
         size_t n_rows = 0;
         for (struct db_row *r = row; r->kind != '\0'; r++)
             n_rows++;
@@ -101,14 +224,11 @@ static bool db_stmt_step_mysql(const struct db_stmt *stmt, struct db_row *row)
         if (!n_rows)
             return false;
 
-        stmt_mysql->result_bind = calloc(n_rows, sizeof(*stmt_mysql->result_bind));
-        if (!stmt_mysql->result_bind)
-            return false;
-
-        stmt_mysql->param_bind = calloc(n_rows, sizeof(*stmt_mysql->param_bind));
-        if (!stmt_mysql->param_bind) {
-            free(stmt_mysql->param_bind);
-            return false;
+        if (!stmt_mysql->result_bind) {
+            stmt_mysql->result_bind =
+                calloc(n_rows, sizeof(*stmt_mysql->result_bind));
+            if (!stmt_mysql->result_bind)
+                return false;
         }
 
         MYSQL_BIND *result = stmt_mysql->result_bind;
@@ -129,9 +249,19 @@ static bool db_stmt_step_mysql(const struct db_stmt *stmt, struct db_row *row)
 
         if (mysql_stmt_bind_result(stmt_mysql->stmt, result))
             return false;
+
+        stmt_mysql->must_bind_result = false;
     }
 
-    return mysql_stmt_fetch(stmt_mysql->stmt) == 0;
+    MYSQL_CALL(stmt_mysql->db, ret, mysql_stmt_fetch, stmt_mysql->stmt);
+    return ret == 0;
+}
+
+static void db_stmt_reset_mysql(struct db_stmt *stmt)
+{
+    struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
+
+    stmt_mysql->must_execute_again = true;
 }
 
 static void db_stmt_finalize_mysql(struct db_stmt *stmt)
@@ -147,8 +277,9 @@ static void db_stmt_finalize_mysql(struct db_stmt *stmt)
 static struct db_stmt *db_prepare_mysql(const struct db *db, const char *sql,
         const size_t sql_len)
 {
-    const struct db_mysql *db_mysql = (const struct db_mysql *)db;
+    struct db_mysql *db_mysql = (struct db_mysql *)db;
     struct db_stmt_mysql *stmt_mysql = malloc(sizeof(*stmt_mysql));
+    int ret;
 
     if (!stmt_mysql)
         return NULL;
@@ -159,18 +290,23 @@ static struct db_stmt *db_prepare_mysql(const struct db *db, const char *sql,
         return NULL;
     }
 
-    if (mysql_stmt_prepare(stmt_mysql->stmt, sql, sql_len)) {
+    MYSQL_CALL(db_mysql, ret, mysql_stmt_prepare, stmt_mysql->stmt, sql,
+               sql_len);
+    if (ret) {
         mysql_stmt_close(stmt_mysql->stmt);
         free(stmt_mysql);
         return NULL;
     }
 
+    stmt_mysql->db = db_mysql;
     stmt_mysql->base.bind = db_stmt_bind_mysql;
     stmt_mysql->base.step = db_stmt_step_mysql;
+    stmt_mysql->base.reset = db_stmt_reset_mysql;
     stmt_mysql->base.finalize = db_stmt_finalize_mysql;
     stmt_mysql->result_bind = NULL;
     stmt_mysql->param_bind = NULL;
     stmt_mysql->must_execute_again = true;
+    stmt_mysql->must_bind_result = true;
 
     return (struct db_stmt*)stmt_mysql;
 }
@@ -197,12 +333,20 @@ struct db *db_connect_mysql(const char *host, const char *user, const char *pass
         return NULL;
     }
 
+#if defined(HAVE_MYSQL_NONBLOCK)
+    /* Blocking calls still work after this; connecting is one of them,
+     * as it only happens once per connection in the pool. */
+    if (mysql_options(db_mysql->con, MYSQL_OPT_NONBLOCK, 0))
+        goto error;
+#endif
+
     if (!mysql_real_connect(db_mysql->con, host, user, pass, database, 0, NULL, 0))
         goto error;
 
     if (mysql_set_character_set(db_mysql->con, "utf8"))
         goto error;
 
+    db_init(&db_mysql->base);
     db_mysql->base.disconnect = db_disconnect_mysql;
     db_mysql->base.prepare = db_prepare_mysql;
 
@@ -276,6 +420,13 @@ static bool db_stmt_step_sqlite(const struct db_stmt *stmt, struct db_row *row)
     return true;
 }
 
+static void db_stmt_reset_sqlite(struct db_stmt *stmt)
+{
+    struct db_stmt_sqlite *stmt_sqlite = (struct db_stmt_sqlite *)stmt;
+
+    sqlite3_reset(stmt_sqlite->sqlite);
+}
+
 static void db_stmt_finalize_sqlite(struct db_stmt *stmt)
 {
     struct db_stmt_sqlite *stmt_sqlite = (struct db_stmt_sqlite *)stmt;
@@ -301,6 +452,7 @@ static struct db_stmt *db_prepare_sqlite(const struct db *db, const char *sql,
 
     stmt_sqlite->base.bind = db_stmt_bind_sqlite;
     stmt_sqlite->base.step = db_stmt_step_sqlite;
+    stmt_sqlite->base.reset = db_stmt_reset_sqlite;
     stmt_sqlite->base.finalize = db_stmt_finalize_sqlite;
 
     return (struct db_stmt *)stmt_sqlite;
@@ -333,6 +485,7 @@ struct db *db_connect_sqlite(const char *path, bool read_only, const char *pragm
             sqlite3_exec(db_sqlite->sqlite, pragmas[p], NULL, NULL, NULL);
     }
 
+    db_init(&db_sqlite->base);
     db_sqlite->base.disconnect = db_disconnect_sqlite;
     db_sqlite->base.prepare = db_prepare_sqlite;
 
@@ -358,6 +511,11 @@ inline void db_stmt_finalize(struct db_stmt *stmt)
 
 inline void db_disconnect(struct db *db)
 {
+    for (size_t i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+        if (db->stmt_cache[i].stmt)
+            db_stmt_finalize(db->stmt_cache[i].stmt);
+    }
+
     db->disconnect(db);
 }
 
@@ -366,3 +524,231 @@ inline struct db_stmt *db_prepare_stmt(const struct db *db, const char *sql,
 {
     return db->prepare(db, sql, sql_len);
 }
+
+struct db_stmt *db_prepare_stmt_cached(struct db *db, const char *sql,
+    const size_t sql_len)
+{
+    size_t i;
+
+    for (i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+        if (db->stmt_cache[i].sql == sql) {
+            struct db_stmt *stmt = db->stmt_cache[i].stmt;
+
+            stmt->reset(stmt);
+            return stmt;
+        }
+
+        if (!db->stmt_cache[i].sql)
+            break;
+    }
+
+    if (i == DB_STMT_CACHE_SIZE)
+        return NULL;
+
+    struct db_stmt *stmt = db_prepare_stmt(db, sql, sql_len);
+    if (stmt) {
+        db->stmt_cache[i].sql = sql;
+        db->stmt_cache[i].stmt = stmt;
+    }
+
+    return stmt;
+}
+
+void db_set_wait_cb(struct db *db, db_wait_cb cb, void *data)
+{
+    db->wait.cb = cb;
+    db->wait.data = data;
+}
+
+struct db_stmt *db_prepare_stmt_batch(struct db *db, const char *sql_template)
+{
+    char placeholders[DB_BATCH_SIZE * 2];
+    char sql[1024];
+    int sql_len;
+
+    for (size_t i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+        if (db->stmt_cache[i].sql == sql_template)
+            return db_prepare_stmt_cached(db, sql_template, 0);
+        if (!db->stmt_cache[i].sql)
+            break;
+    }
+
+    for (size_t i = 0; i < DB_BATCH_SIZE; i++) {
+        placeholders[i * 2] = '?';
+        placeholders[i * 2 + 1] = ',';
+    }
+    placeholders[DB_BATCH_SIZE * 2 - 1] = '\0';
+
+    sql_len = snprintf(sql, sizeof(sql), sql_template, placeholders);
+    if (sql_len < 0 || (size_t)sql_len >= sizeof(sql))
+        return NULL;
+
+    /* Cached under the template, which is what callers have at hand. */
+    for (size_t i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+        if (db->stmt_cache[i].sql)
+            continue;
+
+        struct db_stmt *stmt = db_prepare_stmt(db, sql, (size_t)sql_len);
+        if (stmt) {
+            db->stmt_cache[i].sql = sql_template;
+            db->stmt_cache[i].stmt = stmt;
+        }
+        return stmt;
+    }
+
+    return NULL;
+}
+
+bool db_stmt_bind_batch(const struct db_stmt *stmt,
+    struct db_row rows[DB_BATCH_SIZE], const int *values, size_t n_values)
+{
+    if (!n_values || n_values > DB_BATCH_SIZE)
+        return false;
+
+    /* Placeholders that aren't needed repeat the last value, which
+     * doesn't change the rows that are found. */
+    for (size_t i = 0; i < DB_BATCH_SIZE; i++) {
+        rows[i].kind = 'i';
+        rows[i].u.i = values[i < n_values ? i : n_values - 1];
+    }
+
+    return db_stmt_bind(stmt, rows, DB_BATCH_SIZE);
+}
+
+/* Pool */
+
+struct db_pool *db_pool_new(struct db *(*connect)(void *data), void *data)
+{
+    struct db_pool *pool = malloc(sizeof(*pool));
+
+    if (!pool)
+        return NULL;
+
+    /* Connections are owned by the pool, which disconnects them all at
+     * once in db_pool_free(), so there's no destructor. */
+    if (pthread_key_create(&pool->key, NULL)) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->connect = connect;
+    pool->data = data;
+    pool->conns = NULL;
+    pool->threads = NULL;
+
+    return pool;
+}
+
+static struct db_pool_thread *db_pool_get_thread(struct db_pool *pool)
+{
+    struct db_pool_thread *thread = pthread_getspecific(pool->key);
+
+    if (thread)
+        return thread;
+
+    thread = calloc(1, sizeof(*thread));
+    if (!thread)
+        return NULL;
+
+    if (pthread_setspecific(pool->key, thread)) {
+        free(thread);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    thread->next = pool->threads;
+    pool->threads = thread;
+    pthread_mutex_unlock(&pool->lock);
+
+    return thread;
+}
+
+struct db *db_pool_get(struct db_pool *pool)
+{
+    struct db_pool_thread *thread = db_pool_get_thread(pool);
+    struct db *db;
+
+    if (!thread)
+        return NULL;
+
+    db = thread->idle;
+    if (db) {
+        thread->idle = db->pool_next_idle;
+        thread->checked_out++;
+        return db;
+    }
+
+    if (thread->checked_out >= DB_POOL_MAX_PER_THREAD) {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    db = pool->connect(pool->data);
+    if (!db)
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    db->pool_next = pool->conns;
+    pool->conns = db;
+    pthread_mutex_unlock(&pool->lock);
+
+    thread->checked_out++;
+    return db;
+}
+
+static void db_pool_drop(struct db_pool *pool, struct db *db)
+{
+    pthread_mutex_lock(&pool->lock);
+    for (struct db **conn = &pool->conns; *conn; conn = &(*conn)->pool_next) {
+        if (*conn == db) {
+            *conn = db->pool_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    db_disconnect(db);
+}
+
+void db_pool_put(struct db_pool *pool, struct db *db)
+{
+    struct db_pool_thread *thread = pthread_getspecific(pool->key);
+
+    thread->checked_out--;
+
+    /* Whoever was using this connection didn't wait for the server to
+     * finish answering; there's no telling what's left in the socket. */
+    if (db->in_query) {
+        db_pool_drop(pool, db);
+        return;
+    }
+
+    db_set_wait_cb(db, NULL, NULL);
+    db->pool_next_idle = thread->idle;
+    thread->idle = db;
+}
+
+void db_pool_free(struct db_pool *pool)
+{
+    struct db *db = pool->conns;
+    struct db_pool_thread *thread = pool->threads;
+
+    while (db) {
+        struct db *next = db->pool_next;
+
+        db_disconnect(db);
+        db = next;
+    }
+
+    while (thread) {
+        struct db_pool_thread *next = thread->next;
+
+        free(thread);
+        thread = next;
+    }
+
+    pthread_key_delete(pool->key);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -22,6 +22,7 @@
 #include <stdbool.h>
 
 struct db;
+struct db_pool;
 struct db_stmt;
 
 struct db_row {
@@ -40,6 +41,41 @@ void db_disconnect(struct db *db);
 struct db_stmt *db_prepare_stmt(const struct db *db, const char *sql,
     const size_t sql_len);
 
+/* Prepares sql once per connection; sql must be a string constant, as
+ * its address is what's looked up.  Statements obtained this way must not
+ * be finalized: db_disconnect() takes care of them. */
+struct db_stmt *db_prepare_stmt_cached(struct db *db, const char *sql,
+    const size_t sql_len);
+
+/* For queries looking up a list of integers at once: sql_template has a
+ * "%s" where DB_BATCH_SIZE placeholders go, as in "... WHERE id IN (%s)".
+ * Statements are cached like with db_prepare_stmt_cached().  Up to
+ * DB_BATCH_SIZE values are then bound with db_stmt_bind_batch(), using
+ * rows[] as storage that, as with db_stmt_bind(), has to be around until
+ * db_stmt_step() is done; each matching row is returned once, in no
+ * particular order. */
+#define DB_BATCH_SIZE 32
+struct db_stmt *db_prepare_stmt_batch(struct db *db, const char *sql_template);
+bool db_stmt_bind_batch(const struct db_stmt *stmt,
+    struct db_row rows[DB_BATCH_SIZE], const int *values, size_t n_values);
+
+/* Drivers that can talk to the server without blocking (MySQL, if built
+ * against MariaDB's client library) call this whenever they'd have to wait
+ * for fd; it should return true once it's ready, or false on timeout.
+ * Without one, drivers block the calling thread. */
+typedef bool (*db_wait_cb)(void *data, int fd, bool for_write,
+    unsigned int timeout_ms);
+void db_set_wait_cb(struct db *db, db_wait_cb cb, void *data);
+
+/* Connections are per thread, made as needed, and kept around after being
+ * given back with db_pool_put(); threads don't serialize on a single
+ * connection, and each can have several queries in flight.  db_pool_get()
+ * fails with EAGAIN if a thread has too many connections checked out. */
+struct db_pool *db_pool_new(struct db *(*connect)(void *data), void *data);
+struct db *db_pool_get(struct db_pool *pool);
+void db_pool_put(struct db_pool *pool, struct db *db);
+void db_pool_free(struct db_pool *pool);
+
 struct db *db_connect_sqlite(const char *path, bool read_only, const char *pragmas[]);
 struct db *db_connect_mysql(const char *host, const char *user, const char *pass, const char *database);
 
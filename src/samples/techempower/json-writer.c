@@ -0,0 +1,182 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "lwan.h"
+#include "lwan-escape.h"
+#include "int-to-str.h"
+
+#include "json-writer.h"
+
+static ALWAYS_INLINE void
+append(struct json_writer *writer, const char *str, size_t len)
+{
+    /* lwan_strbuf_append_str() would take a length of 0 as "use strlen()". */
+    if (!len || writer->failed)
+        return;
+    if (UNLIKELY(!lwan_strbuf_append_str(writer->buffer, str, len)))
+        writer->failed = true;
+}
+
+static ALWAYS_INLINE void append_char(struct json_writer *writer, char c)
+{
+    if (writer->failed)
+        return;
+    if (UNLIKELY(!lwan_strbuf_append_char(writer->buffer, c)))
+        writer->failed = true;
+}
+
+/* Called before every value and key, so that separators don't have to be
+ * tracked per nesting level: a comma goes in after anything but an opening
+ * bracket or a key. */
+static ALWAYS_INLINE void separate(struct json_writer *writer)
+{
+    if (writer->needs_comma)
+        append_char(writer, ',');
+}
+
+void json_writer_init(struct json_writer *writer, struct lwan_strbuf *buffer)
+{
+    writer->buffer = buffer;
+    writer->needs_comma = false;
+    writer->failed = false;
+}
+
+bool json_writer_finish(struct json_writer *writer)
+{
+    return !writer->failed;
+}
+
+static void begin(struct json_writer *writer, char c)
+{
+    separate(writer);
+    append_char(writer, c);
+    writer->needs_comma = false;
+}
+
+static void end(struct json_writer *writer, char c)
+{
+    append_char(writer, c);
+    writer->needs_comma = true;
+}
+
+void json_writer_begin_object(struct json_writer *writer)
+{
+    begin(writer, '{');
+}
+
+void json_writer_end_object(struct json_writer *writer)
+{
+    end(writer, '}');
+}
+
+void json_writer_begin_array(struct json_writer *writer)
+{
+    begin(writer, '[');
+}
+
+void json_writer_end_array(struct json_writer *writer)
+{
+    end(writer, ']');
+}
+
+static void append_escaped(struct json_writer *writer, const char *str)
+{
+    if (writer->failed)
+        return;
+    if (UNLIKELY(!lwan_append_json_escaped(writer->buffer, str, 0)))
+        writer->failed = true;
+}
+
+void json_writer_key(struct json_writer *writer, const char *key)
+{
+    separate(writer);
+    append_escaped(writer, key);
+    append_char(writer, ':');
+    writer->needs_comma = false;
+}
+
+void json_writer_int(struct json_writer *writer, long value)
+{
+    char buffer[INT_TO_STR_BUFFER_SIZE];
+    size_t len;
+    char *str;
+
+    separate(writer);
+    str = int_to_string(value, buffer, &len);
+    append(writer, str, len);
+    writer->needs_comma = true;
+}
+
+void json_writer_str(struct json_writer *writer, const char *value)
+{
+    if (UNLIKELY(!value)) {
+        json_writer_null(writer);
+        return;
+    }
+
+    separate(writer);
+    append_escaped(writer, value);
+    writer->needs_comma = true;
+}
+
+void json_writer_bool(struct json_writer *writer, bool value)
+{
+    separate(writer);
+    if (value)
+        append(writer, "true", 4);
+    else
+        append(writer, "false", 5);
+    writer->needs_comma = true;
+}
+
+void json_writer_null(struct json_writer *writer)
+{
+    separate(writer);
+    append(writer, "null", 4);
+    writer->needs_comma = true;
+}
+
+void json_writer_struct(struct json_writer *writer,
+                        const struct json_field_descriptor *desc,
+                        const void *ptr)
+{
+    json_writer_begin_object(writer);
+
+    for (; desc->key; desc++) {
+        /* Keys are quoted when the descriptor is built, so they go in with
+         * a single append. */
+        separate(writer);
+        append(writer, desc->key, desc->key_len);
+        writer->needs_comma = false;
+
+        desc->write(writer, (const char *)ptr + desc->offset);
+    }
+
+    json_writer_end_object(writer);
+}
+
+void json_writer_int_field(struct json_writer *writer, const void *ptr)
+{
+    json_writer_int(writer, *(const int *)ptr);
+}
+
+void json_writer_str_field(struct json_writer *writer, const void *ptr)
+{
+    json_writer_str(writer, *(const char *const *)ptr);
+}
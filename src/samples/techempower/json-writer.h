@@ -0,0 +1,83 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2018 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "lwan-strbuf.h"
+
+/* Writes JSON straight into a strbuf (usually response->buffer), without
+ * building a tree first.  Errors are sticky: once an append fails, every
+ * other call is a no-op, and json_writer_finish() returns false. */
+struct json_writer {
+    struct lwan_strbuf *buffer;
+    bool needs_comma;
+    bool failed;
+};
+
+/* Describes a struct member, much like lwan_var_descriptor does for
+ * templates.  Arrays of these end with JSON_FIELD_END. */
+struct json_field_descriptor {
+    const char *key;
+    size_t key_len;
+    off_t offset;
+
+    void (*write)(struct json_writer *writer, const void *ptr);
+};
+
+#define JSON_FIELD(struct_, field_, write_)                                   \
+    {                                                                          \
+        .key = "\"" #field_ "\":", .key_len = sizeof("\"" #field_ "\":") - 1,  \
+        .offset = offsetof(struct_, field_), .write = write_                   \
+    }
+
+#define JSON_FIELD_INT(struct_, field_)                                        \
+    JSON_FIELD(struct_, field_, json_writer_int_field)
+
+#define JSON_FIELD_STR(struct_, field_)                                        \
+    JSON_FIELD(struct_, field_, json_writer_str_field)
+
+#define JSON_FIELD_END                                                         \
+    {                                                                          \
+        .key = NULL                                                            \
+    }
+
+void json_writer_init(struct json_writer *writer, struct lwan_strbuf *buffer);
+bool json_writer_finish(struct json_writer *writer);
+
+void json_writer_begin_object(struct json_writer *writer);
+void json_writer_end_object(struct json_writer *writer);
+void json_writer_begin_array(struct json_writer *writer);
+void json_writer_end_array(struct json_writer *writer);
+
+void json_writer_key(struct json_writer *writer, const char *key);
+void json_writer_int(struct json_writer *writer, long value);
+void json_writer_str(struct json_writer *writer, const char *value);
+void json_writer_bool(struct json_writer *writer, bool value);
+void json_writer_null(struct json_writer *writer);
+
+void json_writer_struct(struct json_writer *writer,
+                        const struct json_field_descriptor *desc,
+                        const void *ptr);
+
+void json_writer_int_field(struct json_writer *writer, const void *ptr);
+void json_writer_str_field(struct json_writer *writer, const void *ptr);
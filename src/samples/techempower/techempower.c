@@ -17,6 +17,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -25,10 +26,34 @@
 #include "lwan-template.h"
 
 #include "database.h"
-#include "json.h"
+#include "json-writer.h"
 
 static const char hello_world[] = "Hello, World!";
 static const char random_number_query[] = "SELECT randomNumber FROM World WHERE id=?";
+static const char random_numbers_query[] =
+    "SELECT id, randomNumber FROM World WHERE id IN (%s)";
+
+struct hello {
+    const char *message;
+};
+
+static const struct json_field_descriptor hello_desc[] = {
+    JSON_FIELD_STR(struct hello, message),
+    JSON_FIELD_END
+};
+
+struct world {
+    int id;
+    int randomNumber;
+};
+
+static const struct json_field_descriptor world_desc[] = {
+    JSON_FIELD_INT(struct world, id),
+    JSON_FIELD_INT(struct world, randomNumber),
+    JSON_FIELD_END
+};
+
+struct fortune_array;
 
 struct Fortune {
     struct {
@@ -37,6 +62,10 @@ struct Fortune {
         int id;
         char *message;
     } item;
+
+    /* Loaded (and sorted) before the template is applied: the generator
+     * runs in a coroutine of its own, which can't wait for the database. */
+    const struct fortune_array *fortunes;
 };
 
 DEFINE_ARRAY_TYPE(fortune_array, struct Fortune)
@@ -68,79 +97,126 @@ static const struct lwan_var_descriptor fortune_desc[] = {
     TPL_VAR_SENTINEL
 };
 
-static struct db *database;
+static struct db_pool *database_pool;
 static struct lwan_tpl *fortune_tpl;
 
-static enum lwan_http_status
-json_response(struct lwan_response *response, JsonNode *node)
+static struct {
+    const char *user;
+    const char *password;
+    const char *hostname;
+    const char *db;
+} mysql_config;
+
+static struct db *connect_mysql(void *data __attribute__((unused)))
 {
-    size_t length;
-    char *serialized;
+    return db_connect_mysql(mysql_config.hostname, mysql_config.user,
+                            mysql_config.password, mysql_config.db);
+}
 
-    serialized = json_stringify_length(node, NULL, &length);
-    json_delete(node);
-    if (UNLIKELY(!serialized))
-        return HTTP_INTERNAL_ERROR;
+static struct db *connect_sqlite(void *data __attribute__((unused)))
+{
+    const char *pragmas[] = {
+        "PRAGMA mmap_size=44040192",
+        "PRAGMA journal_mode=OFF",
+        "PRAGMA locking_mode=EXCLUSIVE",
+        NULL
+    };
 
-    lwan_strbuf_set(response->buffer, serialized, length);
-    free(serialized);
+    return db_connect_sqlite("techempower.db", true, pragmas);
+}
 
-    response->mime_type = "application/json";
-    return HTTP_OK;
+static bool wait_for_database(void *data, int fd, bool for_write,
+                              unsigned int timeout_ms)
+{
+    struct lwan_request *request = data;
+
+    if (for_write)
+        return lwan_request_await_write(request, fd, timeout_ms);
+    return lwan_request_await_read(request, fd, timeout_ms);
 }
 
-LWAN_HANDLER(json)
+static void put_database(void *data)
 {
-    JsonNode *hello = json_mkobject();
-    if (UNLIKELY(!hello))
-        return HTTP_INTERNAL_ERROR;
+    db_pool_put(database_pool, data);
+}
 
-    json_append_member(hello, "message", json_mkstring(hello_world));
+/* Checks out a connection for the rest of the request; while waiting for
+ * the database, other connections handled by this thread keep going. */
+static struct db *get_database(struct lwan_request *request)
+{
+    struct db *database;
+
+    while (!(database = db_pool_get(database_pool))) {
+        if (errno != EAGAIN)
+            return NULL;
+        lwan_request_sleep(request, 1);
+    }
 
-    return json_response(response, hello);
+    db_set_wait_cb(database, wait_for_database, request);
+    coro_defer(request->conn->coro, put_database, database);
+
+    return database;
 }
 
-static JsonNode *
-db_query(struct db_stmt *stmt, struct db_row rows[], struct db_row results[])
+static struct db_stmt *
+prepare_stmt(struct lwan_request *request, const char *sql, size_t sql_len)
 {
-    JsonNode *object = NULL;
-    int id = rand() % 10000;
+    struct db *database = get_database(request);
 
-    rows[0].u.i = id;
+    return database ? db_prepare_stmt_cached(database, sql, sql_len) : NULL;
+}
 
-    if (UNLIKELY(!db_stmt_bind(stmt, rows, 1)))
-        goto out;
+static ALWAYS_INLINE int random_id(void)
+{
+    /* Rows in the World table go from 1 to 10000. */
+    return rand() % 10000 + 1;
+}
 
-    if (UNLIKELY(!db_stmt_step(stmt, results)))
-        goto out;
+static enum lwan_http_status
+json_response(struct lwan_response *response, struct json_writer *writer)
+{
+    if (UNLIKELY(!json_writer_finish(writer)))
+        return HTTP_INTERNAL_ERROR;
 
-    object = json_mkobject();
-    if (UNLIKELY(!object))
-        goto out;
+    response->mime_type = "application/json";
+    return HTTP_OK;
+}
 
-    json_append_member(object, "id", json_mknumber(id));
-    json_append_member(object, "randomNumber", json_mknumber(results[0].u.i));
+LWAN_HANDLER(json)
+{
+    const struct hello hello = { .message = hello_world };
+    struct json_writer writer;
 
-out:
-    return object;
+    json_writer_init(&writer, response->buffer);
+    json_writer_struct(&writer, hello_desc, &hello);
+
+    return json_response(response, &writer);
 }
 
 LWAN_HANDLER(db)
 {
     struct db_row rows[1] = {{ .kind = 'i' }};
     struct db_row results[] = {{ .kind = 'i' }, { .kind = '\0' }};
-    struct db_stmt *stmt = db_prepare_stmt(database, random_number_query,
+    struct db_stmt *stmt = prepare_stmt(request, random_number_query,
             sizeof(random_number_query) - 1);
     if (UNLIKELY(!stmt))
         return HTTP_INTERNAL_ERROR;
 
-    JsonNode *object = db_query(stmt, rows, results);
-    db_stmt_finalize(stmt);
+    struct world world = { .id = random_id() };
 
-    if (UNLIKELY(!object))
+    rows[0].u.i = world.id;
+    if (UNLIKELY(!db_stmt_bind(stmt, rows, 1)))
         return HTTP_INTERNAL_ERROR;
+    if (UNLIKELY(!db_stmt_step(stmt, results)))
+        return HTTP_INTERNAL_ERROR;
+    world.randomNumber = results[0].u.i;
+
+    struct json_writer writer;
 
-    return json_response(response, object);
+    json_writer_init(&writer, response->buffer);
+    json_writer_struct(&writer, world_desc, &world);
+
+    return json_response(response, &writer);
 }
 
 LWAN_HANDLER(queries)
@@ -158,34 +234,58 @@ LWAN_HANDLER(queries)
         queries = 1;
     }
 
-    struct db_stmt *stmt = db_prepare_stmt(database, random_number_query,
-            sizeof(random_number_query) - 1);
-    if (UNLIKELY(!stmt))
+    struct db *database = get_database(request);
+    if (UNLIKELY(!database))
         return HTTP_INTERNAL_ERROR;
 
-    JsonNode *array = json_mkarray();
-    if (UNLIKELY(!array))
-        goto out_no_array;
-
-    struct db_row rows[1] = {{ .kind = 'i' }};
-    struct db_row results[] = {{ .kind = 'i' }, { .kind = '\0' }};
-    while (queries--) {
-        JsonNode *object = db_query(stmt, rows, results);
-        
-        if (UNLIKELY(!object))
-            goto out_array;
-
-        json_append_element(array, object);
+    struct json_writer writer;
+
+    json_writer_init(&writer, response->buffer);
+    json_writer_begin_array(&writer);
+
+    /* Look rows up DB_BATCH_SIZE at a time, rather than doing one round
+     * trip to the database per row. */
+    while (queries > 0) {
+        const size_t n_ids =
+            queries > DB_BATCH_SIZE ? DB_BATCH_SIZE : (size_t)queries;
+        struct world worlds[DB_BATCH_SIZE];
+        int ids[DB_BATCH_SIZE];
+        struct db_row rows[DB_BATCH_SIZE];
+        struct db_row results[] = {{ .kind = 'i' }, { .kind = 'i' },
+                                   { .kind = '\0' }};
+        struct db_stmt *stmt;
+        size_t i, n_found = 0;
+
+        for (i = 0; i < n_ids; i++)
+            worlds[i].id = ids[i] = random_id();
+
+        stmt = db_prepare_stmt_batch(database, random_numbers_query);
+        if (UNLIKELY(!stmt))
+            return HTTP_INTERNAL_ERROR;
+        if (UNLIKELY(!db_stmt_bind_batch(stmt, rows, ids, n_ids)))
+            return HTTP_INTERNAL_ERROR;
+
+        /* Rows come in any order, and once for ids picked more than once. */
+        while (db_stmt_step(stmt, results)) {
+            for (i = 0; i < n_ids; i++) {
+                if (worlds[i].id == results[0].u.i) {
+                    worlds[i].randomNumber = results[1].u.i;
+                    n_found++;
+                }
+            }
+        }
+        if (UNLIKELY(n_found != n_ids))
+            return HTTP_INTERNAL_ERROR;
+
+        for (i = 0; i < n_ids; i++)
+            json_writer_struct(&writer, world_desc, &worlds[i]);
+
+        queries -= (long)n_ids;
     }
 
-    db_stmt_finalize(stmt);
-    return json_response(response, array);
+    json_writer_end_array(&writer);
 
-out_array:
-    json_delete(array);
-out_no_array:
-    db_stmt_finalize(stmt);
-    return HTTP_INTERNAL_ERROR;
+    return json_response(response, &writer);
 }
 
 LWAN_HANDLER(plaintext)
@@ -234,20 +334,17 @@ static bool append_fortune(struct coro *coro, struct fortune_array *fortunes,
     return true;
 }
 
-static int fortune_list_generator(struct coro *coro, void *data)
+static bool load_fortunes(struct lwan_request *request,
+                          struct fortune_array *fortunes)
 {
     static const char fortune_query[] = "SELECT * FROM Fortune";
+    struct coro *coro = request->conn->coro;
     char fortune_buffer[256];
-    struct Fortune *fortune = data;
-    struct fortune_array fortunes;
     struct db_stmt *stmt;
-    size_t i;
 
-    stmt = db_prepare_stmt(database, fortune_query, sizeof(fortune_query) - 1);
+    stmt = prepare_stmt(request, fortune_query, sizeof(fortune_query) - 1);
     if (UNLIKELY(!stmt))
-        return 0;
-
-    fortune_array_init(&fortunes);
+        return false;
 
     struct db_row results[] = {
         { .kind = 'i' },
@@ -255,33 +352,56 @@ static int fortune_list_generator(struct coro *coro, void *data)
         { .kind = '\0' }
     };
     while (db_stmt_step(stmt, results)) {
-        if (!append_fortune(coro, &fortunes, results[0].u.i, results[1].u.s))
-            goto out;
+        if (!append_fortune(coro, fortunes, results[0].u.i, results[1].u.s))
+            return false;
     }
 
-    if (!append_fortune(coro, &fortunes, 0,
+    if (!append_fortune(coro, fortunes, 0,
                             "Additional fortune added at request time."))
-        goto out;
+        return false;
+
+    fortune_array_sort(fortunes, fortune_compare);
 
-    fortune_array_sort(&fortunes, fortune_compare);
+    return true;
+}
+
+static int fortune_list_generator(struct coro *coro, void *data)
+{
+    struct Fortune *fortune = data;
+    const struct fortune_array *fortunes = fortune->fortunes;
+    size_t i;
 
-    for (i = 0; i < fortunes.base.elements; i++) {
-        struct Fortune *f = &((struct Fortune *)fortunes.base.base)[i];
+    for (i = 0; i < fortunes->base.elements; i++) {
+        struct Fortune *f = &((struct Fortune *)fortunes->base.base)[i];
         fortune->item.id = f->item.id;
         fortune->item.message = f->item.message;
         coro_yield(coro, 1);
     }
 
-out:
-    fortune_array_reset(&fortunes);
-    db_stmt_finalize(stmt);
     return 0;
 }
 
+static void reset_fortunes(void *data)
+{
+    fortune_array_reset(data);
+}
+
 LWAN_HANDLER(fortunes)
 {
-    struct Fortune fortune;
+    /* Not on the stack: the coroutine might be killed while waiting for
+     * the database, and the array still has to be freed. */
+    struct fortune_array *fortunes =
+        coro_malloc(request->conn->coro, sizeof(*fortunes));
+    if (UNLIKELY(!fortunes))
+        return HTTP_INTERNAL_ERROR;
 
+    fortune_array_init(fortunes);
+    coro_defer(request->conn->coro, reset_fortunes, fortunes);
+
+    if (UNLIKELY(!load_fortunes(request, fortunes)))
+        return HTTP_INTERNAL_ERROR;
+
+    struct Fortune fortune = { .fortunes = fortunes };
     if (UNLIKELY(!lwan_tpl_apply_with_buffer(fortune_tpl,
                                              response->buffer, &fortune)))
        return HTTP_INTERNAL_ERROR;
@@ -308,33 +428,34 @@ main(void)
     srand((unsigned int)time(NULL));
 
     if (getenv("USE_MYSQL")) {
-        const char *user = getenv("MYSQL_USER");
-        const char *password = getenv("MYSQL_PASS");
-        const char *hostname = getenv("MYSQL_HOST");
-        const char *db = getenv("MYSQL_DB");
+        mysql_config.user = getenv("MYSQL_USER");
+        mysql_config.password = getenv("MYSQL_PASS");
+        mysql_config.hostname = getenv("MYSQL_HOST");
+        mysql_config.db = getenv("MYSQL_DB");
 
-        if (!user)
+        if (!mysql_config.user)
             lwan_status_critical("No MySQL user provided");
-        if (!password)
+        if (!mysql_config.password)
             lwan_status_critical("No MySQL password provided");
-        if (!hostname)
+        if (!mysql_config.hostname)
             lwan_status_critical("No MySQL hostname provided");
-        if (!db)
+        if (!mysql_config.db)
             lwan_status_critical("No MySQL database provided");
 
-        database = db_connect_mysql(hostname, user, password, db);
+        database_pool = db_pool_new(connect_mysql, NULL);
     } else {
-        const char *pragmas[] = {
-            "PRAGMA mmap_size=44040192",
-            "PRAGMA journal_mode=OFF",
-            "PRAGMA locking_mode=EXCLUSIVE",
-            NULL
-        };
-        database = db_connect_sqlite("techempower.db", true, pragmas);
+        database_pool = db_pool_new(connect_sqlite, NULL);
     }
 
+    if (!database_pool)
+        lwan_status_critical("Could not create database connection pool");
+
+    /* Connect once from here so that bad settings are caught right away,
+     * rather than by the first request on each thread. */
+    struct db *database = db_pool_get(database_pool);
     if (!database)
         lwan_status_critical("Could not connect to the database");
+    db_pool_put(database_pool, database);
 
     fortune_tpl = lwan_tpl_compile_string(fortunes_template_str, fortune_desc);
     if (!fortune_tpl)
@@ -344,7 +465,7 @@ main(void)
     lwan_main_loop(&l);
 
     lwan_tpl_free(fortune_tpl);
-    db_disconnect(database);
+    db_pool_free(database_pool);
     lwan_shutdown(&l);
 
     return 0;
@@ -0,0 +1,238 @@
+#!/usr/bin/python3
+# Runs the micro-benchmarks (corobench, hashbench, microbench) and a few
+# load scenarios (loadbench against testrunner), and writes the results to
+# a JSON file; two such files can then be compared, failing if anything
+# got slower than a threshold:
+#
+#   benchsuite.py run --build-dir build --output results.json
+#   benchsuite.py compare baseline.json results.json --threshold 10
+#
+# Every benchmark is run a few times and the median is kept, to make the
+# numbers less sensitive to noise.  Use a Release build.
+
+import argparse
+import json
+import os
+import platform
+import socket
+import subprocess
+import sys
+import time
+
+LARGE_FILE = 'benchsuite-large.bin'
+LARGE_FILE_SIZE = 64 * 1024 * 1024
+
+MICRO_BENCHMARKS = (
+  # (binary, arguments, arguments with --quick)
+  ('corobench', ['-j'], ['-j', '100000']),
+  ('hashbench', ['-j'], ['-j', '400000']),
+  ('microbench', ['-j'], ['-j', '-n', '100000']),
+)
+
+LOAD_SCENARIOS = (
+  # (name, loadbench arguments, path)
+  ('keep-alive', ['-c', '64', '-n', '200000'], '/hello'),
+  ('pipelining', ['-c', '16', '-p', '16', '-n', '400000'], '/hello'),
+  ('churn', ['-c', '32', '-r', '-n', '20000'], '/hello'),
+  ('static-file', ['-c', '64', '-n', '200000'], '/100.html'),
+  ('large-sendfile', ['-c', '4', '-n', '400'], '/' + LARGE_FILE),
+)
+
+
+def run_json_lines(command):
+  output = subprocess.run(command, check=True, stdout=subprocess.PIPE,
+                          universal_newlines=True).stdout
+  # Debug builds also print status messages to the standard output.
+  return [json.loads(line) for line in output.splitlines()
+          if line.startswith('{')]
+
+
+def median_of_runs(runs):
+  results = {}
+
+  for run in runs:
+    for result in run:
+      results.setdefault(result['benchmark'], []).append(result)
+
+  merged = {}
+  for name, samples in results.items():
+    samples.sort(key=lambda result: result['value'])
+    median = dict(samples[len(samples) // 2])
+    median['samples'] = [sample['value'] for sample in samples]
+    merged[name] = median
+
+  return merged
+
+
+def wait_for_port(port, process, timeout=10.0):
+  deadline = time.time() + timeout
+
+  while time.time() < deadline:
+    if process.poll() is not None:
+      raise Exception('testrunner exited with status %d' % process.returncode)
+    try:
+      with socket.create_connection(('127.0.0.1', port), timeout=0.5):
+        return
+    except OSError:
+      time.sleep(0.1)
+
+  raise Exception('Timeout waiting for testrunner')
+
+
+def run_micro(bin_dir, repeat, quick):
+  runs = []
+
+  for binary, args, quick_args in MICRO_BENCHMARKS:
+    path = os.path.join(bin_dir, binary, binary)
+    if not os.path.exists(path):
+      print('Skipping %s: not built' % binary, file=sys.stderr)
+      continue
+
+    for i in range(repeat):
+      print('Running %s (%d/%d)' % (binary, i + 1, repeat), file=sys.stderr)
+      runs.append(run_json_lines([path] + (quick_args if quick else args)))
+
+  return runs
+
+
+def run_load(bin_dir, source_dir, repeat, quick):
+  loadbench = os.path.join(bin_dir, 'loadbench', 'loadbench')
+  testrunner = os.path.join(bin_dir, 'testrunner', 'testrunner')
+  large_file = os.path.join(source_dir, 'wwwroot', LARGE_FILE)
+  runs = []
+
+  # A sparse file: what's being measured is sendfile(), not the disk.
+  with open(large_file, 'wb') as f:
+    f.truncate(LARGE_FILE_SIZE)
+
+  lwan = subprocess.Popen([testrunner], cwd=source_dir,
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+  try:
+    wait_for_port(8080, lwan)
+
+    for name, args, path in LOAD_SCENARIOS:
+      if quick:
+        args = list(args)
+        args[args.index('-n') + 1] = str(int(args[args.index('-n') + 1]) // 10)
+
+      for i in range(repeat):
+        print('Running %s (%d/%d)' % (name, i + 1, repeat), file=sys.stderr)
+        runs.append(run_json_lines([loadbench, '-j', '-N', name] + args +
+                                   ['http://127.0.0.1:8080' + path]))
+  finally:
+    lwan.kill()
+    lwan.wait()
+    os.unlink(large_file)
+
+  return runs
+
+
+def git_revision(source_dir):
+  try:
+    return subprocess.run(['git', 'rev-parse', 'HEAD'], cwd=source_dir,
+                          check=True, stdout=subprocess.PIPE,
+                          stderr=subprocess.DEVNULL,
+                          universal_newlines=True).stdout.strip()
+  except (OSError, subprocess.CalledProcessError):
+    return None
+
+
+def command_run(args):
+  source_dir = os.path.abspath(args.source_dir)
+  bin_dir = os.path.join(os.path.abspath(args.build_dir), 'src', 'bin')
+
+  runs = run_micro(bin_dir, args.repeat, args.quick)
+  if not args.no_load:
+    runs += run_load(bin_dir, source_dir, args.repeat, args.quick)
+
+  results = {
+    'meta': {
+      'revision': git_revision(source_dir),
+      'machine': platform.machine(),
+      'system': platform.platform(),
+      'cpus': os.cpu_count(),
+      'time': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+      'quick': args.quick,
+    },
+    'results': median_of_runs(runs),
+  }
+
+  with open(args.output, 'w') as f:
+    json.dump(results, f, indent=2, sort_keys=True)
+  print('Results written to %s' % args.output, file=sys.stderr)
+
+  for result in results['results'].values():
+    if result.get('errors'):
+      print('%s: %d errors' % (result['benchmark'], result['errors']),
+            file=sys.stderr)
+      return 1
+
+  return 0
+
+
+def higher_is_better(unit):
+  return unit.endswith('/s')
+
+
+def command_compare(args):
+  with open(args.baseline) as f:
+    baseline = json.load(f)
+  with open(args.results) as f:
+    results = json.load(f)
+
+  if baseline['meta'].get('quick') != results['meta'].get('quick'):
+    print('Warning: comparing a --quick run with a full one', file=sys.stderr)
+  baseline, results = baseline['results'], results['results']
+
+  regressions = 0
+
+  for name in sorted(baseline):
+    old = baseline[name]
+    new = results.get(name)
+    if new is None:
+      print('%-48s missing' % name)
+      continue
+
+    # Positive means better, regardless of the unit.
+    change = (new['value'] - old['value']) / old['value'] * 100.0
+    if not higher_is_better(old['unit']):
+      change = 0.0 - change
+
+    regressed = change < -args.threshold
+    regressions += regressed
+    print('%-48s %12.2f -> %12.2f %-6s %+7.1f%%%s' % (
+      name, old['value'], new['value'], old['unit'], change,
+      '  REGRESSION' if regressed else ''))
+
+  for name in sorted(set(results) - set(baseline)):
+    print('%-48s new' % name)
+
+  return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  subparsers = parser.add_subparsers(dest='command')
+  subparsers.required = True
+
+  run = subparsers.add_parser('run', help='run benchmarks')
+  run.add_argument('--build-dir', default='build')
+  run.add_argument('--source-dir',
+                   default=os.path.join(os.path.dirname(__file__), '..', '..'))
+  run.add_argument('--output', default='benchsuite-results.json')
+  run.add_argument('--repeat', type=int, default=3)
+  run.add_argument('--quick', action='store_true',
+                   help='fewer iterations; results aren\'t comparable')
+  run.add_argument('--no-load', action='store_true',
+                   help='only run micro-benchmarks')
+  run.set_defaults(func=command_run)
+
+  compare = subparsers.add_parser('compare', help='compare two results')
+  compare.add_argument('baseline')
+  compare.add_argument('results')
+  compare.add_argument('--threshold', type=float, default=10.0,
+                       help='percentage beyond which a change is a regression')
+  compare.set_defaults(func=command_compare)
+
+  args = parser.parse_args()
+  sys.exit(args.func(args))
@@ -8,6 +8,7 @@ import re
 import requests
 import signal
 import socket
+import struct
 import subprocess
 import sys
 import time
@@ -73,10 +74,21 @@ class TestPost(LwanTest):
     self.assertHttpResponseValid(r, 200, 'application/json')
     self.assertEqual(r.json(), {'did-it-blend': 'oh-hell-yeah'})
 
-  def make_request_with_size(self, size):
+  def test_json_body(self):
+    body = {'skip': [{'name': 'nope'}, '}'], 'user': {'id': 1, 'name': 'J\u00f6rg "j"'}}
+    r = requests.post('http://127.0.0.1:8080/post/json', json=body)
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), {'name': 'J\u00f6rg "j"', 'members': 2})
+
+  def test_invalid_json_body(self):
+    r = requests.post('http://127.0.0.1:8080/post/json',
+      data='{"user": {"name": "x"}, }', headers={'Content-Type': 'application/json'})
+    self.assertHttpResponseValid(r, 400, 'text/html')
+
+  def make_request_with_size(self, size, url='/post/big'):
     data = "tro" + "lo" * size
 
-    r = requests.post('http://127.0.0.1:8080/post/big', data=data,
+    r = requests.post('http://127.0.0.1:8080' + url, data=data,
       headers={'Content-Type': 'x-test/trololo'})
 
     self.assertHttpResponseValid(r, 200, 'application/json')
@@ -89,6 +101,9 @@ class TestPost(LwanTest):
   def test_medium_request(self): self.make_request_with_size(100)
   def test_large_request(self): self.make_request_with_size(1000)
 
+  def test_streamed_request(self):
+    self.make_request_with_size(1000000, url='/post/stream')
+
   # These two tests are supposed to fail, with Lwan aborting the connection.
   def test_huge_request(self):
     try:
@@ -127,6 +142,27 @@ class TestFileServing(LwanTest):
     self.assertResponse404(r)
 
 
+  def test_file_created_after_404_is_served(self):
+    path = os.path.join('wwwroot', 'created-after-404.txt')
+    self.addCleanup(lambda: os.path.exists(path) and os.remove(path))
+
+    for _ in range(2):
+      r = requests.get('http://127.0.0.1:8080/created-after-404.txt')
+      self.assertResponse404(r)
+
+    with open(path, 'w') as f:
+      f.write('Hello!\n')
+
+    for _ in range(20):
+      r = requests.get('http://127.0.0.1:8080/created-after-404.txt')
+      if r.status_code == 200:
+        break
+      time.sleep(0.1)
+
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.text, 'Hello!\n')
+
+
   def test_dot_dot_slash_yields_404(self):
     r = requests.get('http://127.0.0.1:8080/../../../../../../../../../etc/passwd')
 
@@ -194,6 +230,20 @@ class TestFileServing(LwanTest):
 
     self.assertEqual(r.text, '\0' * 32718)
 
+  def test_range_multiple(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Range': 'bytes=0-10, 20-30'})
+
+    self.assertEqual(r.status_code, 206)
+    self.assertTrue(r.headers['content-type'].startswith('multipart/byteranges; boundary='))
+    boundary = r.headers['content-type'].split('=', 1)[1]
+
+    self.assertEqual(int(r.headers['content-length']), len(r.content))
+    self.assertEqual(r.text.count('--' + boundary + '\r\n'), 2)
+    self.assertTrue(r.text.endswith('\r\n--' + boundary + '--\r\n'))
+    self.assertTrue('Content-Range: bytes 0-9/' in r.text)
+    self.assertTrue('Content-Range: bytes 20-29/' in r.text)
+
 
   def test_slash_slash_slash_does_not_matter_404(self):
     r = requests.get('http://127.0.0.1:8080//////////etc/passwd')
@@ -250,7 +300,7 @@ class TestFileServing(LwanTest):
       'deflate',
       'foo,bar,deflate',
       'foo, bar, deflate',
-      'deflote' # This should fail, but won't in our current implementation
+      'deflate;q=0.5, gzip;q=0',
     )
 
     for encoding in encodings:
@@ -268,6 +318,24 @@ class TestFileServing(LwanTest):
       self.assertEqual(r.text, 'X' * 100)
 
 
+  def test_compressed_small_file_preference(self):
+    encodings = (
+      ('gzip', 'gzip'),
+      ('deflate, gzip', 'gzip'),
+      ('gzip;q=0.5, deflate', 'deflate'),
+      ('gzip;q=0, deflate;q=0', None),
+      ('deflote', None),
+    )
+
+    for accept, expected in encodings:
+      r = requests.get('http://127.0.0.1:8080/100.html',
+            headers={'Accept-Encoding': accept})
+
+      self.assertResponseHtml(r)
+      self.assertEqual(r.headers.get('content-encoding'), expected)
+      self.assertEqual(r.text, 'X' * 100)
+
+
   def test_get_larger_file(self):
     r = requests.get('http://127.0.0.1:8080/zero',
           headers={'Accept-Encoding': 'foobar'})
@@ -280,6 +348,24 @@ class TestFileServing(LwanTest):
     self.assertEqual(r.text, '\0' * 32768)
 
 
+  def test_etag_revalidation(self):
+    for path in ('/100.html', '/zero'):
+      r = requests.get('http://127.0.0.1:8080' + path,
+            headers={'Accept-Encoding': 'foobar'})
+
+      self.assertEqual(r.status_code, 200)
+      self.assertTrue('etag' in r.headers)
+      etag = r.headers['etag']
+
+      for inm, status in ((etag, 304), ('W/' + etag, 304), ('*', 304),
+                          ('"foo", ' + etag, 304), ('"foo"', 200)):
+        r = requests.get('http://127.0.0.1:8080' + path,
+              headers={'Accept-Encoding': 'foobar', 'If-None-Match': inm})
+
+        self.assertEqual(r.status_code, status)
+        self.assertEqual(r.headers['etag'], etag)
+
+
   def test_directory_listing(self):
     r = requests.get('http://127.0.0.1:8080/icons',
           headers={'Accept-Encoding': 'foobar'})
@@ -395,6 +481,20 @@ class TestMalformedRequests(SocketTest):
       self.assertHttpCode(sock, 405)
 
 
+  def test_slow_headers_time_out(self):
+    with self.connect() as sock:
+      sock.send('GET /hello HTTP/1.1\r\n')
+      start = time.time()
+
+      # Each header line would otherwise reset the keep-alive timeout.
+      with self.assertRaises(OSError):
+        while time.time() - start < 10:
+          sock.send('X-Slow: yes\r\n')
+          time.sleep(0.25)
+
+      self.assertLess(time.time() - start, 5)
+
+
   def test_no_http_version_fails(self):
     with self.connect() as sock:
       sock.send('GET /\r\n\r\n')
@@ -433,6 +533,17 @@ class TestMalformedRequests(SocketTest):
     except requests.exceptions.ConnectionError:
       pass
 
+
+  def test_request_larger_than_small_buffer(self):
+    with requests.Session() as s:
+      r = s.get('http://127.0.0.1:8080/hello', headers={'X-Big': 'a' * 8000})
+      self.assertResponsePlain(r)
+      self.assertEqual(r.text, 'Hello, world!')
+
+      # Same connection, now back to the small buffer.
+      r = s.get('http://127.0.0.1:8080/hello')
+      self.assertResponsePlain(r)
+
 class TestChunkedEncoding(LwanTest):
   def test_chunked_encoding(self):
     r = requests.get('http://localhost:8080/chunked')
@@ -445,6 +556,80 @@ class TestChunkedEncoding(LwanTest):
       ''.join('*This is chunk %d*\n' % i for i in range(11)) +
       'Last chunk\n')
 
+class TestSharedCache(LwanTest):
+  path = '/tmp/lwan-testrunner-shared-cache'
+
+  def get_from_both(self):
+    # Modules are only instantiated (and the cache opened) once used.
+    for prefix in ('/shared-cache', '/shared-cache-again'):
+      yield requests.get('http://127.0.0.1:8080' + prefix + '/100.html',
+                         headers={'Accept-Encoding': 'gzip'}, timeout=5)
+
+  def test_shared_between_instances(self):
+    expected = requests.get('http://127.0.0.1:8080/100.html').text
+
+    for r in self.get_from_both():
+      self.assertHttpResponseValid(r, 200, 'text/html')
+      self.assertEqual(r.text, expected)
+
+  def test_not_locked_after_open(self):
+    # Other processes opening the cache would otherwise block on it.
+    import fcntl
+
+    for r in self.get_from_both():
+      self.assertEqual(r.status_code, 200)
+
+    with open(self.path, 'rb') as f:
+      fcntl.flock(f, fcntl.LOCK_EX | fcntl.LOCK_NB)
+      fcntl.flock(f, fcntl.LOCK_UN)
+
+class TestCompressedResponse(LwanTest):
+  query = '?dump_vars=1&' + '&'.join('key%d=value%d' % (i, i) for i in range(40))
+
+  def test_compressed(self):
+    uncompressed = requests.get('http://localhost:8080/hello' + self.query)
+    self.assertFalse('Content-Encoding' in uncompressed.headers)
+
+    for encoding in ('gzip', 'deflate'):
+      r = requests.get('http://localhost:8080/compressed/hello' + self.query,
+                       headers={'Accept-Encoding': encoding})
+      self.assertResponsePlain(r)
+      self.assertEqual(r.headers['Content-Encoding'], encoding)
+      self.assertEqual(r.headers['Vary'], 'Accept-Encoding')
+      self.assertTrue(int(r.headers['Content-Length']) < len(uncompressed.text))
+      self.assertEqual(r.text, uncompressed.text)
+
+  def test_not_compressed(self):
+    r = requests.get('http://localhost:8080/compressed/hello')
+    self.assertResponsePlain(r)
+    self.assertFalse('Content-Encoding' in r.headers)
+    self.assertEqual(r.text, 'Hello, world!')
+
+    r = requests.get('http://localhost:8080/compressed/hello' + self.query,
+                     headers={'Accept-Encoding': 'identity'})
+    self.assertResponsePlain(r)
+    self.assertFalse('Content-Encoding' in r.headers)
+
+  def test_chunked(self):
+    r = requests.get('http://localhost:8080/compressed/chunked')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['Content-Encoding'], 'gzip')
+    self.assertEqual(r.headers['Transfer-Encoding'], 'chunked')
+    self.assertEqual(r.text,
+      'Testing chunked encoding! First chunk\n' +
+      ''.join('*This is chunk %d*\n' % i for i in range(11)) +
+      'Last chunk\n')
+
+class TestSleep(LwanTest):
+  def test_sleep(self):
+    start = time.time()
+    r = requests.get('http://localhost:8080/sleep?ms=500')
+    diff = time.time() - start
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Slept 500ms')
+    self.assertTrue(diff >= 0.5)
+
 class TestLua(LwanTest):
   def test_inline(self):
     r = requests.get('http://localhost:8080/inline')
@@ -461,6 +646,59 @@ class TestLua(LwanTest):
     self.assertResponseHtml(r)
     self.assertEqual(r.text, 'Hello, foo!')
 
+  def test_http_request(self):
+    r = requests.get('http://localhost:8080/lua/backend')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, '200 Hello, backend!')
+
+  def unused_port(self):
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+      sock.bind(('127.0.0.1', 0))
+      return sock.getsockname()[1]
+
+  def test_socket_read_write(self):
+    r = requests.get('http://localhost:8080/lua/socket')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'HTTP/1.1 200 OK|Hello, socket1!|'
+                             'HTTP/1.1 200 OK|Hello, socket2!')
+
+  def test_socket_connect_refused(self):
+    r = requests.get('http://localhost:8080/lua/socket_refused',
+                     params={'port': self.unused_port()})
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'nil|Connection refused')
+
+  def test_socket_receive_timeout(self):
+    # Connections are completed by the kernel, but nothing is ever sent.
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as server:
+      server.bind(('127.0.0.1', 0))
+      server.listen(1)
+
+      start = time.time()
+      r = requests.get('http://localhost:8080/lua/socket_timeout',
+                       params={'port': server.getsockname()[1]})
+      elapsed = time.time() - start
+
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'nil|timeout|')
+    self.assertTrue(0.2 <= elapsed < 5)
+
+  def test_http_request_post(self):
+    r = requests.get('http://localhost:8080/lua/http_post')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, '200|posted client|%d' % len('posted client'))
+
+  def test_http_request_chunked(self):
+    r = requests.get('http://localhost:8080/lua/http_chunked')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, '200|' + ''.join('Chunk #%d\n' % i for i in range(11)))
+
+  def test_http_request_errors(self):
+    r = requests.get('http://localhost:8080/lua/http_errors',
+                     params={'port': self.unused_port()})
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'invalid URL|Connection refused')
+
   def test_cookies(self):
     cookies_to_send = {
         'FOO': 'BAR'
@@ -744,11 +982,307 @@ Accept: text/plain,text/html;q=0.9,application/xhtml+xml;q=0.9,application/xml;q
       self.assertTrue(s in responses)
       responses = responses.replace(s, '')
 
+class TestHTTP2(SocketTest):
+  def frame(self, type, flags, stream_id, payload=b''):
+    return struct.pack('>I', len(payload))[1:] + \
+      struct.pack('>BBI', type, flags, stream_id) + payload
+
+  def read_responses(self, sock, stream_ids):
+    responses = {stream_id: [b'', b''] for stream_id in stream_ids}
+    pending = set(stream_ids)
+    buffer = b''
+
+    while pending:
+      while len(buffer) < 9 or len(buffer) < 9 + int.from_bytes(buffer[:3], 'big'):
+        data = sock.recv(4096)
+        self.assertTrue(data)
+        buffer += data
+      length = int.from_bytes(buffer[:3], 'big')
+      type, flags, stream_id = struct.unpack('>BBI', buffer[3:9])
+      payload, buffer = buffer[9:9 + length], buffer[9 + length:]
+
+      if stream_id in pending:
+        # No RST_STREAM expected
+        self.assertNotEqual(type, 3)
+        if type in (0, 1):
+          responses[stream_id][type ^ 1] += payload
+          if flags & 1:
+            pending.remove(stream_id)
+
+    return responses
+
+  def test_prior_knowledge(self):
+    # :method GET, :scheme http, :path /hello, :authority localhost
+    block = b'\x82\x86\x04\x06/hello\x01\x09localhost'
+
+    with self.connect() as sock:
+      sock = sock._wrapped_sock
+      sock.sendall(b'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n' +
+                   self.frame(4, 0, 0) + self.frame(1, 5, 1, block) +
+                   self.frame(1, 5, 3, block))
+
+      for headers, body in self.read_responses(sock, (1, 3)).values():
+        self.assertEqual(headers[0], 0x88) # :status 200
+        self.assertTrue(b'text/plain' in headers)
+        self.assertEqual(body, b'Hello, world!')
+
+class TestWebSocket(SocketTest):
+  def frame(self, opcode, payload, fin=True):
+    mask = os.urandom(4)
+    masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+    header = struct.pack('>B', (0x80 if fin else 0) | opcode)
+    if len(payload) < 126:
+      header += struct.pack('>B', 0x80 | len(payload))
+    else:
+      header += struct.pack('>BH', 0x80 | 126, len(payload))
+    return header + mask + masked
+
+  def recv_exactly(self, sock, n):
+    data = b''
+    while len(data) < n:
+      chunk = sock.recv(n - len(data))
+      self.assertTrue(chunk)
+      data += chunk
+    return data
+
+  def read_frame(self, sock):
+    opcode, length = self.recv_exactly(sock, 2)
+    if length == 126:
+      length, = struct.unpack('>H', self.recv_exactly(sock, 2))
+    return opcode, self.recv_exactly(sock, length)
+
+  def upgrade(self, sock):
+    sock.sendall(b'GET /websocket HTTP/1.1\r\n'
+                 b'Host: localhost\r\n'
+                 b'Upgrade: websocket\r\n'
+                 b'Connection: keep-alive, Upgrade\r\n'
+                 b'Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n'
+                 b'Sec-WebSocket-Version: 13\r\n\r\n')
+
+    response = b''
+    while not response.endswith(b'\r\n\r\n'):
+      response += self.recv_exactly(sock, 1)
+    self.assertTrue(response.startswith(b'HTTP/1.1 101 '))
+    # Example from RFC 6455, section 1.3
+    self.assertTrue(b'Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n' in response)
+
+  def test_echo(self):
+    with self.connect() as sock:
+      sock = sock._wrapped_sock
+      self.upgrade(sock)
+
+      sock.sendall(self.frame(1, b'Hello, '))
+      self.assertEqual(self.read_frame(sock), (0x81, b'Hello, '))
+
+      # Fragmented message, with a ping in the middle
+      message = b'WebSocket! ' * 100
+      sock.sendall(self.frame(1, message[:10], fin=False) +
+                   self.frame(9, b'ping') +
+                   self.frame(0, message[10:]))
+      self.assertEqual(self.read_frame(sock), (0x8a, b'ping'))
+      self.assertEqual(self.read_frame(sock), (0x81, message))
+
+      sock.sendall(self.frame(8, struct.pack('>H', 1000)))
+      self.assertEqual(self.read_frame(sock), (0x88, struct.pack('>H', 1000)))
+      self.assertEqual(sock.recv(1), b'')
+
+  def test_invalid_utf8(self):
+    with self.connect() as sock:
+      sock = sock._wrapped_sock
+      self.upgrade(sock)
+
+      sock.sendall(self.frame(1, b'\xc0\xaf'))
+      self.assertEqual(self.read_frame(sock), (0x88, struct.pack('>H', 1007)))
+
+  def test_not_an_upgrade(self):
+    r = requests.get('http://127.0.0.1:8080/websocket')
+    self.assertEqual(r.status_code, 400)
+
+class TestPubSub(SocketTest):
+  def subscribe(self):
+    sock = self.connect()._wrapped_sock
+    sock.sendall(b'GET /pubsub/subscribe HTTP/1.1\r\nHost: localhost\r\n\r\n')
+
+    response = b''
+    while b'\r\n\r\n' not in response:
+      data = sock.recv(4096)
+      self.assertTrue(data)
+      response += data
+    headers, body = response.split(b'\r\n\r\n', 1)
+    self.assertTrue(headers.startswith(b'HTTP/1.1 200 OK\r\n'))
+    self.assertTrue(b'Content-Type: text/event-stream' in headers)
+
+    return sock, body
+
+  def test_fan_out(self):
+    subscribers = [self.subscribe() for _ in range(4)]
+    try:
+      for message in ('first', 'second'):
+        r = requests.get('http://127.0.0.1:8080/pubsub/publish',
+                         params={'message': message})
+        self.assertResponsePlain(r, 200)
+        self.assertEqual(r.text, 'Published')
+
+      expected = b'event: message\r\ndata: first\r\n\r\n' \
+                 b'event: message\r\ndata: second\r\n\r\n'
+      for sock, body in subscribers:
+        sock.settimeout(5)
+        while len(body) < len(expected):
+          data = sock.recv(4096)
+          self.assertTrue(data)
+          body += data
+        self.assertEqual(body, expected)
+    finally:
+      for sock, _ in subscribers:
+        sock.close()
+
+class TestMicroCache(SocketTest):
+  def url(self, **params):
+    # Each test gets its own entries.
+    params['test'] = self.id()
+    return 'http://127.0.0.1:8080/micro-cache?' + \
+      '&'.join('%s=%s' % item for item in sorted(params.items()))
+
+  def test_hit(self):
+    first = requests.get(self.url())
+    self.assertResponsePlain(first)
+    self.assertTrue(first.text.startswith('Generation '))
+
+    self.assertEqual(requests.get(self.url()).text, first.text)
+    self.assertEqual(requests.head(self.url()).headers['Content-Length'],
+                     str(len(first.text)))
+
+    other = requests.get(self.url(), headers={'X-Variant': 'other'})
+    self.assertNotEqual(other.text, first.text)
+    self.assertEqual(requests.get(self.url(), headers={'X-Variant': 'other'}).text,
+                     other.text)
+
+  def test_single_flight(self):
+    path = self.url(ms=300).split(':8080', 1)[1]
+    socks = [self.connect()._wrapped_sock for _ in range(4)]
+    try:
+      for sock in socks:
+        sock.sendall(('GET %s HTTP/1.0\r\n\r\n' % path).encode())
+
+      bodies = set()
+      for sock in socks:
+        sock.settimeout(5)
+        response = b''
+        while b'\r\n\r\n' not in response:
+          data = sock.recv(4096)
+          self.assertTrue(data)
+          response += data
+        headers, body = response.split(b'\r\n\r\n', 1)
+        self.assertTrue(headers.startswith(b'HTTP/1.0 200 OK\r\n'))
+        length = int(re.search(rb'Content-Length: (\d+)', headers).group(1))
+        while len(body) < length:
+          data = sock.recv(4096)
+          self.assertTrue(data)
+          body += data
+        bodies.add(body)
+
+      self.assertEqual(len(bodies), 1)
+    finally:
+      for sock in socks:
+        sock.close()
+
+  def test_client_gone_during_miss(self):
+    path = self.url(ms=1000).split(':8080', 1)[1]
+    sock = self.connect()._wrapped_sock
+    sock.sendall(('GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n' % path).encode())
+    time.sleep(0.2)
+    sock.close()
+
+    r = requests.get(self.url(ms=1000), timeout=5)
+    self.assertResponsePlain(r)
+    self.assertEqual(requests.get(self.url(ms=1000), timeout=5).text, r.text)
+
 class TestArtificialResponse(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/brew-coffee')
 
     self.assertEqual(r.status_code, 418)
 
+  def test_constant_response_is_sent_again(self):
+    first = requests.get('http://127.0.0.1:8080/brew-coffee')
+    second = requests.get('http://127.0.0.1:8080/brew-coffee')
+    self.assertEqual(second.status_code, 418)
+    self.assertEqual(first.content, second.content)
+    self.assertHttpResponseValid(second, 418, 'text/html')
+
+    r = requests.head('http://127.0.0.1:8080/brew-coffee')
+    self.assertEqual(r.status_code, 418)
+    self.assertEqual(r.content, b'')
+    self.assertEqual(int(r.headers['Content-Length']), len(first.content))
+
+    r = requests.get('http://127.0.0.1:8080/elsewhere', allow_redirects=False)
+    r = requests.get('http://127.0.0.1:8080/elsewhere', allow_redirects=False)
+    self.assertEqual(r.status_code, 301)
+    self.assertEqual(r.headers['Location'], 'http://lwan.ws')
+
+class TestVirtualHosts(LwanTest):
+  def get_status(self, host, path):
+    r = requests.get('http://127.0.0.1:8080' + path, headers={'Host': host})
+    return r.status_code
+
+  def test_known_host_has_its_own_url_map(self):
+    for host in ('vhost.test', 'VHOST.Test:8080', 'vhost.test.'):
+      self.assertEqual(self.get_status(host, '/hello'), 418)
+      self.assertEqual(self.get_status(host, '/100.html'), 404)
+
+  def test_wildcard_matches_one_level(self):
+    self.assertEqual(self.get_status('www.vhost.test', '/hello'), 418)
+    self.assertEqual(self.get_status('a.b.vhost.test', '/hello'), 200)
+
+  def test_unknown_host_uses_listener_url_map(self):
+    self.assertEqual(self.get_status('unknown.test', '/hello'), 200)
+    self.assertEqual(self.get_status('unknown.test', '/100.html'), 200)
+
+
+class TestMetrics(LwanTest):
+  def test_metrics(self):
+    requests.get('http://127.0.0.1:8080/hello')
+    not_modified = requests.get('http://127.0.0.1:8080/100.html',
+      headers={'If-Modified-Since': 'Fri, 31 Dec 2100 23:59:59 GMT'})
+    self.assertEqual(not_modified.status_code, 304)
+    r = requests.get('http://127.0.0.1:8080/metrics')
+
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.headers['content-type'], 'text/plain; version=0.0.4')
+
+    values = {}
+    for line in r.text.splitlines():
+      if not line.startswith('#'):
+        name, value = line.rsplit(' ', 1)
+        values[name] = float(value)
+
+    self.assertTrue(values['lwan_requests_total'] >= 2)
+    self.assertTrue(values['lwan_responses_total{code="2xx"}'] >= 1)
+    self.assertTrue(values['lwan_responses_total{code="3xx"}'] >= 1)
+    self.assertTrue('lwan_request_duration_seconds_count' in values)
+
+    # Not available in ASan builds.
+    if 'lwan_coroutine_stack_size_bytes' not in values:
+      return
+
+    stack_size = values['lwan_coroutine_stack_size_bytes']
+    used = values['lwan_coroutine_stack_max_used_bytes{prefix="/hello"}']
+    self.assertTrue(values['lwan_coroutine_stack_used_bytes_count{prefix="/hello"}'] >= 1)
+    self.assertTrue(0 < used <= stack_size)
+
+
+  def test_profiler(self):
+    r = requests.get('http://127.0.0.1:8080/profile?seconds=99')
+    self.assertEqual(r.status_code, 400)
+
+    r = requests.get('http://127.0.0.1:8080/profile?seconds=1&hz=1000')
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.headers['content-type'], 'text/plain')
+
+    for line in r.text.splitlines():
+      stack, count = line.rsplit(' ', 1)
+      self.assertTrue(stack.startswith('lwan-thread-'))
+      self.assertTrue(int(count) > 0)
+
 if __name__ == '__main__':
   unittest.main()
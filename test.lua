@@ -41,6 +41,106 @@ function handle_get_random(req)
     req:set_response("Random number: " .. math.random())
 end
 
+function handle_get_backend(req)
+    -- Fetched twice, so that the second request reuses the connection
+    local body
+    for i = 1, 2 do
+        local status, response = req:http_request("http://127.0.0.1:8080/hello?name=backend")
+        if not status then
+            req:set_response("Error: " .. response)
+            return
+        end
+        body = status .. " " .. response
+    end
+    req:set_response(body)
+end
+
+function handle_post_echo(req)
+    req:set_response("posted " .. (req:post_param[[name]] or "nothing"))
+end
+
+function handle_get_socket(req)
+    local sock, err = req:tcp_connect("127.0.0.1", 8080)
+    if not sock then
+        req:set_response("Error: " .. err)
+        return
+    end
+
+    -- Two requests on the same connection: the first response is read up
+    -- to its Content-Length, so the second one starts right after it.
+    local results = {}
+    for i = 1, 2 do
+        local ok
+        ok, err = sock:send("GET /hello?name=socket" .. i .. " HTTP/1.1\r\n" ..
+                            "Host: 127.0.0.1\r\n\r\n")
+        if not ok then
+            req:set_response("Error: " .. err)
+            return
+        end
+
+        local status_line = sock:receive("*l")
+        local length
+        while true do
+            local line = sock:receive()
+            if not line or line == "" then break end
+            length = length or tonumber(line:match("^[Cc]ontent%-[Ll]ength:%s*(%d+)"))
+        end
+        results[#results + 1] = status_line .. "|" .. sock:receive(length)
+    end
+    sock:close()
+
+    req:set_response(table.concat(results, "|"))
+end
+
+function handle_get_socket_refused(req)
+    local sock, err = req:tcp_connect("127.0.0.1", tonumber(req:query_param[[port]]))
+    req:set_response(tostring(sock) .. "|" .. err)
+end
+
+function handle_get_socket_timeout(req)
+    local sock, err = req:tcp_connect("127.0.0.1", tonumber(req:query_param[[port]]))
+    if not sock then
+        req:set_response("Error: " .. err)
+        return
+    end
+
+    sock:settimeout(200)
+    sock:send("Hello?\r\n")
+    local line, partial
+    line, err, partial = sock:receive("*l")
+    req:set_response(tostring(line) .. "|" .. err .. "|" .. partial)
+end
+
+function handle_get_http_post(req)
+    local status, body, headers = req:http_request{
+        url = "http://127.0.0.1:8080/lua/echo",
+        method = "POST",
+        headers = { ["Content-Type"] = "application/x-www-form-urlencoded" },
+        body = "name=client",
+    }
+    if not status then
+        req:set_response("Error: " .. body)
+        return
+    end
+    req:set_response(status .. "|" .. body .. "|" .. headers["content-length"])
+end
+
+function handle_get_http_chunked(req)
+    local status, body = req:http_request("http://127.0.0.1:8080/lua/chunked")
+    if not status then
+        req:set_response("Error: " .. body)
+        return
+    end
+    req:set_response(status .. "|" .. body)
+end
+
+function handle_get_http_errors(req)
+    local port = req:query_param[[port]]
+    local _, invalid = req:http_request("ftp://127.0.0.1/")
+    local _, refused = req:http_request("http://127.0.0.1:" .. port .. "/")
+    req:set_response(invalid .. "|" .. refused)
+end
+
 function string.starts(String, Start)
    -- From http://lua-users.org/wiki/StringRecipes
    return string.sub(String, 1, string.len(Start)) == Start